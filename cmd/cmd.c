@@ -15,96 +15,445 @@
 
 //===== ESP -> Serial responses
 
+// Responses are SLIP-escaped (or COBS-encoded) into a small staging buffer, computing the CRC
+// in the same pass, and handed to the UART TX ring in bulk whenever it fills up and at the end
+// of each response. Only one response is ever being built at a time.
+#define CMD_OUTBUF 256
+static uint8_t cmd_outbuf[CMD_OUTBUF];
+static uint16_t cmd_outlen;
+static uint16_t resp_crc;
+static uint8_t cmd_framing;      // CMD_FRAMING_*
+// COBS: the code byte of a block is only known once the block ends (at a zero byte or after
+// 254 non-zero bytes), so the block stays in the buffer until then. Blocks are at most 255
+// bytes, they always fit.
+static uint16_t cmd_cobs_pos;    // offset of the code byte of the open block
+static uint8_t cmd_cobs_code;    // 1 + bytes in the open block, 0 if none is open
+
+void ICACHE_FLASH_ATTR
+cmdSetFraming(uint8_t framing) {
+  cmd_framing = framing;
+}
+
+static void ICACHE_FLASH_ATTR
+cmdProtoFlush(void) {
+  uint16_t n = cmd_cobs_code > 0 ? cmd_cobs_pos : cmd_outlen;
+  if (n > 0) uart0_tx_buffer((char*)cmd_outbuf, n);
+  if (n < cmd_outlen) os_memmove(cmd_outbuf, cmd_outbuf+n, cmd_outlen-n);
+  cmd_outlen -= n;
+  if (cmd_cobs_code > 0) cmd_cobs_pos -= n;
+}
+
+// Start a frame
+static void ICACHE_FLASH_ATTR
+cmdProtoBegin(void) {
+  cmd_outlen = 0;
+  cmd_outbuf[cmd_outlen++] = SLIP_END;
+  if (cmd_framing == CMD_FRAMING_COBS) {
+    cmd_cobs_pos = cmd_outlen++;
+    cmd_cobs_code = 1;
+  }
+  resp_crc = 0;
+}
+
+// COBS-encode and buffer data, adding it to the CRC
+static void HOT_IRAM_ATTR
+cmdProtoWriteCobs(const uint8_t *data, short len, uint16_t *crc) {
+  uint16_t acc = *crc;
+  while (len-- > 0) {
+    if (cmd_outlen > CMD_OUTBUF-2) cmdProtoFlush(); // a byte adds at most 2
+    uint8_t b = *data++;
+    acc = crc16_add(b, acc);
+    if (b != 0) {
+      cmd_outbuf[cmd_outlen++] = b ^ SLIP_END;
+      if (++cmd_cobs_code < 0xff) continue;
+    }
+    // end of block, start the next one
+    cmd_outbuf[cmd_cobs_pos] = cmd_cobs_code ^ SLIP_END;
+    cmd_cobs_pos = cmd_outlen++;
+    cmd_cobs_code = 1;
+  }
+  *crc = acc;
+}
+
+// Escape and buffer data, adding it to the CRC
+static void HOT_IRAM_ATTR
+cmdProtoWriteBuf(const uint8_t *data, short len, uint16_t *crc) {
+  if (cmd_framing == CMD_FRAMING_COBS) {
+    cmdProtoWriteCobs(data, len, crc);
+    return;
+  }
+  while (len > 0) {
+    short room = (CMD_OUTBUF - cmd_outlen) / 2; // worst case every byte gets escaped
+    if (room == 0) {
+      cmdProtoFlush();
+      continue;
+    }
+    short n = len < room ? len : room;
+    cmd_outlen += crc16_slip(cmd_outbuf+cmd_outlen, data, n, crc);
+    data += n;
+    len -= n;
+  }
+}
+
+// End the frame
 static void ICACHE_FLASH_ATTR
-cmdProtoWrite(uint8_t data) {
-  switch(data){
-  case SLIP_END:
-    uart0_write_char(SLIP_ESC);
-    uart0_write_char(SLIP_ESC_END);
-    break;
-  case SLIP_ESC:
-    uart0_write_char(SLIP_ESC);
-    uart0_write_char(SLIP_ESC_ESC);
-    break;
-  default:
-    uart0_write_char(data);
+cmdProtoClose(void) {
+  if (cmd_cobs_code > 0) {
+    cmd_outbuf[cmd_cobs_pos] = cmd_cobs_code ^ SLIP_END;
+    cmd_cobs_code = 0;
   }
+  if (cmd_outlen == CMD_OUTBUF) cmdProtoFlush();
+  cmd_outbuf[cmd_outlen++] = SLIP_END;
+  cmdProtoFlush();
 }
 
+// Add the CRC and end the frame
 static void ICACHE_FLASH_ATTR
-cmdProtoWriteBuf(const uint8_t *data, short len) {
-  while (len--) cmdProtoWrite(*data++);
+cmdProtoEnd(void) {
+  uint16_t crc = resp_crc, dummy = 0;
+  cmdProtoWriteBuf((uint8_t*)&crc, 2, &dummy);
+  cmdProtoClose();
 }
 
-static uint16_t resp_crc;
+void HOT_IRAM_ATTR
+cmdChannelSend(uint8_t ctl, const void *data, uint16_t len) {
+  uint8_t hdr[2] = { SLIP_CHAN, ctl };
+  uint16_t crc = 0; // not sent
+  cmdProtoBegin();
+  cmdProtoWriteBuf(hdr, 2, &crc);
+  cmdProtoWriteBuf(data, len, &crc);
+  cmdProtoClose();
+}
 
-// Start a response, returns the partial CRC
+//===== Pipelining, see cmd.h
+
+uint8_t cmdWindow;
+static uint32_t cmd_outstanding[256/32]; // bitmap of sequence numbers awaiting a response
+static uint8_t cmd_noutstanding;
+static uint8_t cmd_seq;                  // sequence number of the request being executed
+static bool cmd_answered, cmd_deferred;  // what the executing handler did about it
+
+uint8_t ICACHE_FLASH_ATTR
+cmdPipelineReset(uint16_t window) {
+  cmdWindow = window > CMD_WINDOW_MAX ? CMD_WINDOW_MAX : window;
+  os_memset(cmd_outstanding, 0, sizeof(cmd_outstanding));
+  cmd_noutstanding = 0;
+  return cmdWindow;
+}
+
+uint8_t ICACHE_FLASH_ATTR
+cmdDeferResponse(void) {
+  cmd_deferred = true;
+  return cmd_seq;
+}
+
+// Start tracking a request, returns false (after telling the MCU) if it can't be accepted
+static bool ICACHE_FLASH_ATTR
+cmdSeqBegin(uint8_t seq) {
+  cmd_seq = 0;
+  if (seq == 0) return true;
+  if (cmd_noutstanding >= cmdWindow || cmd_outstanding[seq>>5] & (1<<(seq&31))) {
+    DBG("cmdSeqBegin: reject seq=%d outstanding=%d\n", seq, cmd_noutstanding);
+    cmdResponseStartSeq(seq, CMD_RESP_BUSY, 0, 0);
+    cmdResponseEnd();
+    return false;
+  }
+  cmd_outstanding[seq>>5] |= 1<<(seq&31);
+  cmd_noutstanding++;
+  cmd_seq = seq;
+  cmd_answered = cmd_deferred = false;
+  return true;
+}
+
+// Free the slot of a sequence number, it has been responded to
+static void ICACHE_FLASH_ATTR
+cmdSeqRelease(uint8_t seq) {
+  if (cmd_outstanding[seq>>5] & (1<<(seq&31))) {
+    cmd_outstanding[seq>>5] &= ~(1<<(seq&31));
+    cmd_noutstanding--;
+  }
+}
+
+// Done executing a request, ack it if the handler didn't respond
+static void ICACHE_FLASH_ATTR
+cmdSeqEnd(void) {
+  uint8_t seq = cmd_seq;
+  cmd_seq = 0;
+  if (seq == 0 || cmd_answered || cmd_deferred) return;
+  cmdResponseStartSeq(seq, CMD_RESP_V, 0, 0);
+  cmdResponseEnd();
+}
+
+// Start a response to the request being executed, returns the partial CRC
 void ICACHE_FLASH_ATTR
 cmdResponseStart(uint16_t cmd, uint32_t value, uint16_t argc) {
-  DBG("cmdResponse: cmd=%d val=%d argc=%d\n", cmd, value, argc);
+  cmdResponseStartSeq(cmd_seq, cmd, value, argc);
+}
 
-  uart0_write_char(SLIP_END);
-  cmdProtoWriteBuf((uint8_t*)&cmd, 2);
-  resp_crc = crc16_data((uint8_t*)&cmd, 2, 0);
-  cmdProtoWriteBuf((uint8_t*)&argc, 2);
-  resp_crc = crc16_data((uint8_t*)&argc, 2, resp_crc);
-  cmdProtoWriteBuf((uint8_t*)&value, 4);
-  resp_crc = crc16_data((uint8_t*)&value, 4, resp_crc);
+//===== Response batching, see cmd.h
+
+// While batching, responses are collected raw (no SLIP, no CRC) in cmd_batch_buf, each one
+// preceded by its 16-bit length, and cmdBatchFlush sends them as the arguments of a single
+// CMD_RESP_BATCH frame. A response that doesn't fit even into an empty buffer is switched to
+// go out as a regular frame.
+#define CMD_BATCH_BUF 1024
+static uint8_t *cmd_batch_buf;
+static uint16_t cmd_batch_len;   // bytes in cmd_batch_buf
+static uint16_t cmd_batch_cur;   // offset of the length of the response being built
+static uint16_t cmd_batch_cnt;   // number of complete responses in the buffer
+static uint8_t cmd_batch_depth;  // nesting of cmdBatchBegin
+static bool cmd_batch_direct;    // current response bypasses the batch buffer
+bool cmdBatchUnsolicited;
+
+// Send the complete responses collected so far
+static void ICACHE_FLASH_ATTR
+cmdBatchFlush(void) {
+  if (cmd_batch_cnt == 0) return;
+  DBG("cmdBatchFlush: %d responses, %d bytes\n", cmd_batch_cnt, cmd_batch_cur);
+  CmdPacket hdr = { CMD_RESP_BATCH, cmd_batch_cnt, 0 };
+  cmdProtoBegin();
+  cmdProtoWriteBuf((uint8_t*)&hdr, sizeof(hdr), &resp_crc);
+  uint16_t off = 0;
+  uint32_t zero = 0;
+  for (uint16_t i=0; i<cmd_batch_cnt; i++) {
+    uint16_t len;
+    os_memcpy(&len, cmd_batch_buf+off, 2); // may be unaligned
+    cmdProtoWriteBuf(cmd_batch_buf+off, len+2, &resp_crc);
+    uint16_t pad = (4-((len+2)&3))&3; // same layout as cmdResponseBody
+    cmdProtoWriteBuf((uint8_t*)&zero, pad, &resp_crc);
+    off += len+2;
+  }
+  cmdProtoEnd();
+
+  // keep the response in progress, if any
+  os_memmove(cmd_batch_buf, cmd_batch_buf+cmd_batch_cur, cmd_batch_len-cmd_batch_cur);
+  cmd_batch_len -= cmd_batch_cur;
+  cmd_batch_cur = 0;
+  cmd_batch_cnt = 0;
+}
+
+bool ICACHE_FLASH_ATTR
+cmdBatchBegin(bool unsolicited) {
+  if (unsolicited && !cmdBatchUnsolicited) return false;
+  if (cmd_batch_depth == 0) {
+    cmd_batch_buf = os_malloc(CMD_BATCH_BUF);
+    if (cmd_batch_buf == NULL) return false;
+    cmd_batch_len = cmd_batch_cur = cmd_batch_cnt = 0;
+    cmd_batch_direct = false;
+  }
+  cmd_batch_depth++;
+  return true;
+}
+
+void ICACHE_FLASH_ATTR
+cmdBatchEnd(void) {
+  if (cmd_batch_depth == 0 || --cmd_batch_depth > 0) return;
+  cmdBatchFlush();
+  os_free(cmd_batch_buf);
+  cmd_batch_buf = NULL;
+}
+
+// Write raw response data, either into the batch or escaped straight into the output
+static void ICACHE_FLASH_ATTR
+cmdRespWrite(const void *data, uint16_t len) {
+  if (cmd_batch_buf != NULL && !cmd_batch_direct) {
+    if (cmd_batch_len + len > CMD_BATCH_BUF) cmdBatchFlush();
+    if (cmd_batch_len + len <= CMD_BATCH_BUF) {
+      os_memcpy(cmd_batch_buf+cmd_batch_len, data, len);
+      cmd_batch_len += len;
+      return;
+    }
+    // too big to batch: send what we have of this response as the start of a regular frame
+    cmd_batch_direct = true;
+    cmdProtoBegin();
+    cmdProtoWriteBuf(cmd_batch_buf+cmd_batch_cur+2, cmd_batch_len-cmd_batch_cur-2, &resp_crc);
+    cmd_batch_len = cmd_batch_cur;
+  }
+  cmdProtoWriteBuf(data, len, &resp_crc);
+}
+
+//===== Responses
+
+// Start a response with a given sequence number
+void ICACHE_FLASH_ATTR
+cmdResponseStartSeq(uint8_t seq, uint16_t cmd, uint32_t value, uint16_t argc) {
+  DBG("cmdResponse: cmd=%d seq=%d val=%d argc=%d\n", cmd, seq, value, argc);
+
+  if (seq != 0) {
+    if (seq == cmd_seq) cmd_answered = true;
+    cmdSeqRelease(seq);
+    cmd |= seq << 8;
+  }
+
+  if (cmd_batch_buf != NULL) {
+    // reserve room for the length
+    cmd_batch_direct = false;
+    if (cmd_batch_len + 2 > CMD_BATCH_BUF) cmdBatchFlush();
+    cmd_batch_cur = cmd_batch_len;
+    cmd_batch_len += 2;
+  } else {
+    cmdProtoBegin();
+  }
+  cmdRespWrite(&cmd, 2);
+  cmdRespWrite(&argc, 2);
+  cmdRespWrite(&value, 4);
 }
 
 // Adds data to a response, returns the partial CRC
 void ICACHE_FLASH_ATTR
 cmdResponseBody(const void *data, uint16_t len) {
-  cmdProtoWriteBuf((uint8_t*)&len, 2);
-  resp_crc = crc16_data((uint8_t*)&len, 2, resp_crc);
-
-  cmdProtoWriteBuf(data, len);
-  resp_crc = crc16_data(data, len, resp_crc);
+  cmdRespWrite(&len, 2);
+  cmdRespWrite(data, len);
 
   uint16_t pad = (4-((len+2)&3))&3; // get to multiple of 4
   if (pad > 0) {
     uint32_t temp = 0;
-    cmdProtoWriteBuf((uint8_t*)&temp, pad);
-    resp_crc = crc16_data((uint8_t*)&temp, pad, resp_crc);
+    cmdRespWrite(&temp, pad);
   }
 }
 
 // Ends a response
 void ICACHE_FLASH_ATTR
 cmdResponseEnd() {
-  cmdProtoWriteBuf((uint8_t*)&resp_crc, 2);
-  uart0_write_char(SLIP_END);
+  if (cmd_batch_buf != NULL && !cmd_batch_direct) {
+    uint16_t len = cmd_batch_len - cmd_batch_cur - 2;
+    os_memcpy(cmd_batch_buf+cmd_batch_cur, &len, 2); // may be unaligned
+    cmd_batch_cur = cmd_batch_len;
+    cmd_batch_cnt++;
+    return;
+  }
+  cmd_batch_direct = false;
+  cmdProtoEnd();
 }
 
 //===== serial -> ESP commands
 
+// Commands are dispatched by direct indexing with the command ID, the table is filled from
+// commands[] the first time it's needed and by cmdRegister
+static cmdfunc_t cmdDispatch[CMD_MAX_ID];
+#ifdef CMD_DBG
+static char *cmdText[CMD_MAX_ID];
+#endif
+static bool cmdDispatchReady;
+static cmdstream_t cmdStreamDispatch[CMD_MAX_ID];
+
+static void ICACHE_FLASH_ATTR
+cmdDispatchInit(void) {
+  if (cmdDispatchReady) return;
+  cmdDispatchReady = true;
+  for (const CmdList *scp = commands; scp->sc_function != NULL; scp++)
+    cmdRegister(scp->sc_name, scp->sc_text, scp->sc_function);
+  for (const CmdStreamList *scp = streamCommands; scp->sc_stream != NULL; scp++)
+    cmdRegisterStream(scp->sc_name, scp->sc_stream);
+}
+
+bool ICACHE_FLASH_ATTR
+cmdRegister(CmdName cmd, char *text, cmdfunc_t fn) {
+  cmdDispatchInit();
+  if ((unsigned)cmd >= CMD_MAX_ID) {
+    os_printf("cmdRegister: cmd=%d %s out of range\n", cmd, text);
+    return false;
+  }
+  cmdDispatch[cmd] = fn;
+#ifdef CMD_DBG
+  cmdText[cmd] = text;
+#endif
+  return true;
+}
+
 // Execute a parsed command
 static void ICACHE_FLASH_ATTR
-cmdExec(const CmdList *scp, CmdPacket *packet) {
-  // Iterate through the command table and call the appropriate function
-  while (scp->sc_function != NULL) {
-    if(scp->sc_name == packet->cmd) {
-      DBG("cmdExec: Dispatching cmd=%s\n", scp->sc_text);
-      // call command function
-      scp->sc_function(packet);
-      return;
-    }
-    scp++;
+cmdExec(CmdPacket *packet) {
+  cmdDispatchInit();
+  if (packet->cmd < CMD_MAX_ID && cmdDispatch[packet->cmd] != NULL) {
+    DBG("cmdExec: Dispatching cmd=%s\n", cmdText[packet->cmd]);
+    // call command function
+    cmdDispatch[packet->cmd](packet);
+    return;
   }
   DBG("cmdExec: cmd=%d not found\n", packet->cmd);
 }
 
+// Execute a command with pipelining bookkeeping, this nests for batches
+static void ICACHE_FLASH_ATTR
+cmdExecSeq(CmdPacket *packet, uint8_t seq) {
+  uint8_t outer_seq = cmd_seq;
+  bool outer_answered = cmd_answered, outer_deferred = cmd_deferred;
+  if (cmdSeqBegin(seq)) {
+    cmdExec(packet);
+    cmdSeqEnd();
+  }
+  cmd_seq = outer_seq;
+  cmd_answered = outer_answered;
+  cmd_deferred = outer_deferred;
+}
+
+// Check that the arguments of a packet lie within its len bytes, the padding of the last one
+// may be missing
+static bool ICACHE_FLASH_ATTR
+cmdPacketValid(const CmdPacket *packet, uint16_t len) {
+  if (len < sizeof(CmdPacket)) return false;
+  const uint8_t *args = (const uint8_t*)&packet->args;
+  uint16_t off = 0, avail = len - (args - (const uint8_t*)packet);
+  for (uint16_t i=0; i<packet->argc; i++) {
+    uint16_t l;
+    if (off+2 > avail) return false;
+    os_memcpy(&l, args+off, 2);
+    if (off+2+l > avail) return false;
+    off += 2 + ((l+3)&~3);
+  }
+  return true;
+}
+
+// Command handler for a batch: each argument is a complete packet (without CRC) that gets
+// executed in turn, optionally batching the responses
+void ICACHE_FLASH_ATTR
+cmdBatch(CmdPacket *cmd) {
+  CmdRequest req;
+  cmdRequest(&req, cmd);
+  if (cmd->value & CMD_BATCH_UNSOL) cmdBatchUnsolicited = true;
+  bool batched = (cmd->value & CMD_BATCH_RESP) && cmdBatchBegin(false);
+  DBG("cmdBatch: %d packets, batched=%d\n", cmd->argc, batched);
+
+  while (req.arg_num < cmd->argc) {
+    uint16_t len = cmdArgLen(&req);
+    // the sub-packet is only 2-byte aligned, copy it so the handler can read the value field
+    CmdPacket *sub = len >= sizeof(CmdPacket) ? os_malloc(len) : NULL;
+    if (sub != NULL) {
+      os_memcpy(sub, req.arg_ptr+2, len);
+      uint8_t seq = 0;
+      if (cmdWindow > 0) {
+        seq = CMD_SEQ(sub->cmd);
+        sub->cmd = CMD_ID(sub->cmd);
+      }
+      if (!cmdPacketValid(sub, len))
+        DBG("cmdBatch: packet length overrun, arg %d\n", req.arg_num);
+      else if (sub->cmd != CMD_BATCH)
+        cmdExecSeq(sub, seq); // no nesting
+      os_free(sub);
+    }
+    cmdSkipArg(&req);
+  }
+
+  if (batched) cmdBatchEnd();
+  // the sub-commands got the responses, the batch itself has none but needs its slot freed
+  cmd_answered = true;
+  if (cmd_seq != 0) cmdSeqRelease(cmd_seq);
+}
+
 // Parse a packet and print info about it
 void ICACHE_FLASH_ATTR
 cmdParsePacket(uint8_t *buf, short len) {
   // minimum command length
-  if (len < sizeof(CmdPacket)) return;
+  if (len < (short)sizeof(CmdPacket)) return;
 
   // init pointers into buffer
   CmdPacket *packet = (CmdPacket*)buf;
-  uint8_t *data_ptr = (uint8_t*)&packet->args;
-  uint8_t *data_limit = data_ptr+len;
-
+  uint8_t seq = 0;
+  if (cmdWindow > 0) {
+    seq = CMD_SEQ(packet->cmd);
+    packet->cmd = CMD_ID(packet->cmd);
+  }
   DBG("cmdParsePacket: cmd=%d argc=%d value=%u\n",
       packet->cmd,
       packet->argc,
@@ -113,6 +462,8 @@ cmdParsePacket(uint8_t *buf, short len) {
 
 #if 0
   // print out arguments
+  uint8_t *data_ptr = (uint8_t*)&packet->args;
+  uint8_t *data_limit = (uint8_t*)packet+len;
   uint16_t argn = 0;
   uint16_t argc = packet->argc;
   while (data_ptr+2 < data_limit && argc--) {
@@ -130,13 +481,112 @@ cmdParsePacket(uint8_t *buf, short len) {
     // we have not received a sync, perhaps we reset? Tell MCU to do a sync
     cmdResponseStart(CMD_SYNC, 0, 0);
     cmdResponseEnd();
-  } else if (data_ptr <= data_limit) {
-    cmdExec(commands, packet);
+  } else if (cmdPacketValid(packet, len)) {
+    cmdExecSeq(packet, seq);
   } else {
     DBG("cmdParsePacket: packet length overrun, parsing arg %d\n", packet->argc);
   }
 }
 
+//===== Streaming command packets
+
+static cmdstream_t cmd_stream_fn; // handler of the packet being streamed, NULL if none
+static CmdStream cmd_stream;
+static uint8_t cmd_stream_seq;
+static enum { CS_ARGLEN, CS_ARGDATA, CS_PAD, CS_DONE } cmd_stream_state;
+static uint8_t cmd_stream_cnt;    // bytes of arg length seen, resp. pad bytes left
+
+bool ICACHE_FLASH_ATTR
+cmdRegisterStream(CmdName cmd, cmdstream_t fn) {
+  cmdDispatchInit();
+  if ((unsigned)cmd >= CMD_MAX_ID) {
+    os_printf("cmdRegisterStream: cmd=%d out of range\n", cmd);
+    return false;
+  }
+  cmdStreamDispatch[cmd] = fn;
+  return true;
+}
+
+// Start streaming a packet given its header, returns false if the command doesn't stream
+bool ICACHE_FLASH_ATTR
+cmdStreamStart(CmdPacket *hdr) {
+  cmd_stream_fn = NULL;
+  cmdDispatchInit();
+  uint16_t id = cmdWindow > 0 ? CMD_ID(hdr->cmd) : hdr->cmd;
+  if (id >= CMD_MAX_ID || cmdStreamDispatch[id] == NULL || !cmdInSync)
+    return false; // not in sync gets handled when the full packet gets parsed
+  DBG("cmdStreamStart: cmd=%d argc=%d\n", hdr->cmd, hdr->argc);
+  cmd_stream_fn = cmdStreamDispatch[id];
+  os_memset(&cmd_stream, 0, sizeof(cmd_stream));
+  os_memcpy(&cmd_stream.hdr, hdr, sizeof(CmdPacket));
+  cmd_stream_seq = cmd_stream.hdr.cmd != id ? CMD_SEQ(cmd_stream.hdr.cmd) : 0;
+  cmd_stream.hdr.cmd = id;
+  cmd_stream_state = hdr->argc > 0 ? CS_ARGLEN : CS_DONE;
+  cmd_stream_cnt = 0;
+  return true;
+}
+
+// Feed bytes of the packet following the header, the layout is the same as parsed by
+// cmdPopArg: a 16-bit length followed by the data padded to a multiple of 4 for each argument
+void ICACHE_FLASH_ATTR
+cmdStreamData(const uint8_t *data, uint16_t len) {
+  if (cmd_stream_fn == NULL) return;
+  while (len > 0 && cmd_stream_state != CS_DONE) {
+    switch (cmd_stream_state) {
+    case CS_ARGLEN:
+      ((uint8_t*)&cmd_stream.arglen)[cmd_stream_cnt++] = *data++;
+      len--;
+      if (cmd_stream_cnt < 2) break;
+      cmd_stream.argoff = 0;
+      cmd_stream_state = CS_ARGDATA;
+      if (cmd_stream.arglen == 0) {
+        cmd_stream_fn(&cmd_stream, data, 0);
+        cmd_stream_state = CS_PAD; // no padding either, falls through to the next arg
+      }
+      cmd_stream_cnt = (4-(cmd_stream.arglen&3))&3;
+      break;
+    case CS_ARGDATA: {
+      uint16_t n = cmd_stream.arglen - cmd_stream.argoff;
+      if (n > len) n = len;
+      cmd_stream_fn(&cmd_stream, data, n);
+      cmd_stream.argoff += n;
+      data += n;
+      len -= n;
+      if (cmd_stream.argoff == cmd_stream.arglen) cmd_stream_state = CS_PAD;
+      break;
+      }
+    case CS_PAD:
+      if (cmd_stream_cnt > 0) {
+        cmd_stream_cnt--;
+        data++;
+        len--;
+      }
+      break;
+    case CS_DONE:
+      break;
+    }
+    if (cmd_stream_state == CS_PAD && cmd_stream_cnt == 0) {
+      // move on to the next argument
+      cmd_stream.argn++;
+      cmd_stream_state = cmd_stream.argn < cmd_stream.hdr.argc ? CS_ARGLEN : CS_DONE;
+    }
+  }
+}
+
+// End of the streamed packet, ok is the result of the CRC check
+void ICACHE_FLASH_ATTR
+cmdStreamEnd(bool ok) {
+  if (cmd_stream_fn == NULL) return;
+  cmd_stream.ok = ok && cmd_stream_state == CS_DONE;
+  if (!cmd_stream.ok)
+    os_printf("cmdStreamEnd: cmd=%d bad packet, crc %s\n", cmd_stream.hdr.cmd, ok ? "ok" : "bad");
+  // the request only counts against the window once it's complete
+  if (!cmdSeqBegin(cmd_stream.ok ? cmd_stream_seq : 0)) cmd_stream.ok = false;
+  cmd_stream_fn(&cmd_stream, NULL, 0);
+  cmdSeqEnd();
+  cmd_stream_fn = NULL;
+}
+
 //===== Helpers to parse a command packet
 
 // Fill out a CmdRequest struct given a CmdPacket
@@ -173,6 +623,18 @@ cmdPopArg(CmdRequest *req, void *data, uint16_t len) {
   return 0;
 }
 
+// Return a pointer to the next argument and skip it
+const void * ICACHE_FLASH_ATTR
+cmdPopArgPtr(CmdRequest *req, uint16_t *len) {
+  if (req->arg_num >= req->cmd->argc) return NULL;
+
+  *len = *(uint16_t*)req->arg_ptr;
+  const void *data = req->arg_ptr + 2;
+  req->arg_ptr += 2 + ((*len+3)&~3); // round up to multiple of 4
+  req->arg_num ++;
+  return data;
+}
+
 // Skip the next argument
 void ICACHE_FLASH_ATTR
 cmdSkipArg(CmdRequest *req) {
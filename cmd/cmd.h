@@ -57,9 +57,11 @@ typedef enum {
 
   CMD_WEB_SETUP = 30,   // set-up WEB callback
   CMD_WEB_DATA,         // WEB data from MCU
+  CMD_WEB_INVALIDATE,   // drop cached WEB answers
 
   CMD_SOCKET_SETUP = 40, // set-up callbacks
   CMD_SOCKET_SEND,       // send data over UDP socket
+  CMD_SOCKET_CREDIT,     // MCU can accept more received data
 
   CMD_WIFI_GET_APCOUNT = 50,  // Query the number of networks / Access Points known
   CMD_WIFI_GET_APNAME,        // Query the name (SSID) of an Access Point (AP)
@@ -68,8 +70,67 @@ typedef enum {
   CMD_WIFI_GET_SSID,          // Query SSID currently connected to
   CMD_WIFI_START_SCAN,        // Trigger a scan (takes a long time)
 
+  CMD_BATCH = 60,             // several packets in one frame, see cmdBatch
+  CMD_RESP_BATCH,             // several responses in one frame
+
+  CMD_RESP_BUSY = 63,         // pipelining: request rejected, window full or seq in use
+
 } CmdName;
 
+// Size of the dispatch table, command IDs must be below this
+#define CMD_MAX_ID 64
+
+// Pipelining: if the MCU passes a window size to CMD_SYNC it may then have that many requests
+// outstanding. It puts a sequence number 1..255 into the upper byte of the cmd field of each
+// request and esp-link returns it in the upper byte of the cmd field of the response, so
+// responses can come back out of order as operations complete. Each request gets exactly one
+// tagged response, which frees its slot in the window: what the handler replies, or an empty
+// CMD_RESP_V if it doesn't reply, or CMD_RESP_BUSY if the request couldn't be accepted.
+// Unsolicited callbacks (wifi status, MQTT data, ...) carry sequence number 0.
+#define CMD_WINDOW_MAX 16
+#define CMD_ID(c)  ((c) & 0xff)
+#define CMD_SEQ(c) ((c) >> 8)
+
+// Negotiated window, 0 when not pipelining
+extern uint8_t cmdWindow;
+// Set up pipelining with the given window (0 to turn it off), returns the granted window
+uint8_t cmdPipelineReset(uint16_t window);
+// Called by a handler that completes its request later, returns the sequence number to pass to
+// cmdResponseStartSeq at that point
+uint8_t cmdDeferResponse(void);
+
+// Framing: SLIP is the default. If the MCU passes the CMD_SYNC_COBS flag as the second argument
+// of CMD_SYNC (after the window, 0 for no pipelining) the frames that follow the sync response
+// use Consistent Overhead Byte Stuffing instead, which adds one byte per 254 rather than up to
+// one per byte. The COBS output is XOR-ed with SLIP_END so that frames are still delimited by
+// SLIP_END and never contain it, everything else (CRC, console text, streaming) stays the same.
+// The sync response itself goes out in the framing the sync came in with and reports the
+// flags that were granted. A SLIP-framed CMD_SYNC is recognized at any time, so an MCU that
+// resets just syncs again in SLIP.
+#define CMD_SYNC_COBS 1
+enum { CMD_FRAMING_SLIP, CMD_FRAMING_COBS };
+// Set the framing of the responses
+void cmdSetFraming(uint8_t framing);
+
+// Channels: with the CMD_SYNC_CHANNELS flag the bridge's TCP connections are carried over the
+// command link as well, in frames that start with SLIP_CHAN followed by a type and channel
+// byte, then the data. They have no command header and no CRC and are passed straight to or
+// from the connection, in either framing. Channel n is the n'th connection slot, on data from
+// the MCU channel 0 goes to all of them. The esp sends SLIP_CHAN_OPEN and SLIP_CHAN_CLOSE
+// when a client connects and goes away (and SLIP_CHAN_OPEN for each open one after the sync),
+// the MCU can send SLIP_CHAN_CLOSE to disconnect one. Telnet and programming connections are
+// bridged as before and they alone get the text the MCU prints outside of frames, a channel
+// only carries what the MCU sends it.
+#define CMD_SYNC_CHANNELS 2
+#define SLIP_CHAN         0xD0   // first byte of a channel frame, never starts a command
+#define SLIP_CHAN_DATA    0x00   // types, or-ed with the channel number
+#define SLIP_CHAN_OPEN    0x10
+#define SLIP_CHAN_CLOSE   0x20
+#define SLIP_CHAN_TYPE(c) ((c) & 0xf0)
+#define SLIP_CHAN_NUM(c)  ((c) & 0x0f)
+// Send a channel frame, ctl is the type or-ed with the channel
+void cmdChannelSend(uint8_t ctl, const void *data, uint16_t len);
+
 typedef void (*cmdfunc_t)(CmdPacket *cmd);
 
 typedef struct {
@@ -78,9 +139,13 @@ typedef struct {
   cmdfunc_t sc_function; // pointer to function
 } CmdList;
 
-// command dispatch table
+// command dispatch table, terminated by an entry with a NULL sc_function
 extern const CmdList commands[];
 
+// Register a command handler in addition to the ones in commands[], this lets modules add
+// their own commands without editing the central list. Returns false if the ID is out of range.
+bool cmdRegister(CmdName cmd, char *text, cmdfunc_t fn);
+
 #define CMD_CBNLEN 16
 typedef struct {
   char name[CMD_CBNLEN];
@@ -90,17 +155,67 @@ typedef struct {
 // Used by slip protocol to cause parsing of a received packet
 void cmdParsePacket(uint8_t *buf, short len);
 
+// Streaming commands: a command with a stream handler doesn't need to fit into the SLIP
+// buffer, instead the handler sees the arguments in chunks as they arrive. It is called with
+// each chunk of each argument and finally with data==NULL once the frame is complete, at which
+// point ok tells whether the CRC checked out. Nothing should be acted upon before that.
+typedef struct {
+  CmdPacket hdr;      // packet header (cmd, argc, value)
+  uint16_t  argn;     // index of the argument the data belongs to
+  uint16_t  arglen;   // total length of that argument
+  uint16_t  argoff;   // offset of the data within the argument
+  bool      ok;       // at the end: the frame was complete and its CRC is correct
+  void      *ctx;     // for the handler, NULL when the packet starts
+} CmdStream;
+
+typedef void (*cmdstream_t)(CmdStream *st, const uint8_t *data, uint16_t len);
+
+typedef struct {
+  CmdName     sc_name;     // name as CmdName enum
+  cmdstream_t sc_stream;   // pointer to stream handler
+} CmdStreamList;
+
+// stream handler table, terminated by an entry with a NULL sc_stream
+extern const CmdStreamList streamCommands[];
+
+// Register a stream handler for a command, it takes precedence over the regular handler
+bool cmdRegisterStream(CmdName cmd, cmdstream_t fn);
+// Used by the slip protocol to stream a packet after it has received the header
+bool cmdStreamStart(CmdPacket *hdr);
+void cmdStreamData(const uint8_t *data, uint16_t len);
+void cmdStreamEnd(bool ok);
+
 // Return the info about a callback to the attached uC by name, these are callbacks that the
 // attached uC registers using the ADD_SENSOR command
 CmdCallback* cmdGetCbByName(char* name);
 
-// Add a callback
+// Add a callback, returns a handle for cmdGetCbByHandle or 0 if the table is full
 uint32_t cmdAddCb(char *name, uint32_t callback);
 
+// Return the info about a callback given the handle returned by cmdAddCb, this avoids the
+// name lookup in hot paths. Handles become invalid at the next CMD_SYNC.
+CmdCallback* cmdGetCbByHandle(uint32_t handle);
+
+// Batching: the arguments of a CMD_BATCH packet are complete packets (header and arguments,
+// no CRC), which are executed in order. With CMD_BATCH_RESP in the value the responses they
+// produce are sent as the arguments of one CMD_RESP_BATCH frame, same layout. CMD_BATCH_UNSOL
+// additionally lets esp-link batch bursts of callbacks, such as several MQTT messages arriving
+// together, until the next sync.
+#define CMD_BATCH_RESP  1
+#define CMD_BATCH_UNSOL 2
+extern bool cmdBatchUnsolicited;
+void cmdBatch(CmdPacket *cmd);
+// Collect responses until the matching cmdBatchEnd, these nest. With unsolicited set this only
+// happens if the MCU asked for it, returns whether batching started.
+bool cmdBatchBegin(bool unsolicited);
+void cmdBatchEnd(void);
+
 // Responses
 
 // Start a response
 void cmdResponseStart(uint16_t cmd, uint32_t value, uint16_t argc);
+// Start a response to a deferred pipelined request
+void cmdResponseStartSeq(uint8_t seq, uint16_t cmd, uint32_t value, uint16_t argc);
 // Adds data to a response
 void cmdResponseBody(const void* data, uint16_t len);
 // Ends a response
@@ -118,6 +233,9 @@ uint32_t cmdGetArgc(CmdRequest *req);
 uint16_t cmdArgLen(CmdRequest *req);
 // Copy next arg from request into the data pointer, returns 0 on success, -1 on error
 int32_t cmdPopArg(CmdRequest *req, void *data, uint16_t len);
+// Return a pointer to the next arg in the packet and skip it, this avoids a copy when the data
+// is consumed before the packet goes away, returns NULL if there are no more args
+const void *cmdPopArgPtr(CmdRequest *req, uint16_t *len);
 // Skip next arg
 void cmdSkipArg(CmdRequest *req);
 
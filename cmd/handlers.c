@@ -6,6 +6,8 @@
 #include "sntp.h"
 #include "cmd.h"
 #include "uart.h"
+#include "slip.h"
+#include "serbridge.h"
 #include <cgiwifi.h>
 #ifdef MQTT
 #include <mqtt_cmd.h>
@@ -51,6 +53,8 @@ static uint8_t lastWifiStatus = wifiIsDisconnected;
 static bool wifiCbAdded = false;
 // keep track of whether we received a sync command from uC
 bool cmdInSync = false;
+// handle of the MCU's wifi status callback
+static uint32_t wifiCbHandle;
 
 // Command dispatch table for serial -> ESP commands
 const CmdList commands[] = {
@@ -60,6 +64,7 @@ const CmdList commands[] = {
   {CMD_CB_ADD,          "ADD_CB",         cmdAddCallback},
   {CMD_GET_TIME,        "GET_TIME",       cmdGetTime},
   {CMD_GET_WIFI_INFO,   "GET_WIFI_INFO",  cmdGetWifiInfo},
+  {CMD_BATCH,           "BATCH",          cmdBatch},
   // {CMD_SET_WIFI_INFO,   "SET_WIFI_INFO",  cmdSetWifiInfo},
 
   {CMD_WIFI_GET_APCOUNT,	"WIFI_GET_APCOUNT",	cmdWifiGetApCount},
@@ -83,50 +88,86 @@ const CmdList commands[] = {
 #endif
   {CMD_WEB_SETUP,       "WEB_SETUP",      WEB_Setup},
   {CMD_WEB_DATA,        "WEB_DATA",       WEB_Data},
+  {CMD_WEB_INVALIDATE,  "WEB_INVALIDATE", WEB_Invalidate},
 #ifdef SOCKET
   {CMD_SOCKET_SETUP,    "SOCKET_SETUP",   SOCKET_Setup},
   {CMD_SOCKET_SEND,     "SOCKET_SEND",    SOCKET_Send},
+  {CMD_SOCKET_CREDIT,   "SOCKET_CREDIT",  SOCKET_Credit},
 #endif
+  {CMD_NULL,            NULL,             NULL},           // end marker
+};
+
+// Stream handlers for commands whose arguments may not fit into the SLIP buffer
+const CmdStreamList streamCommands[] = {
+#ifdef MQTT
+  {CMD_MQTT_PUBLISH,    MQTTCMD_PublishStream},
+#endif
+#ifdef SOCKET
+  {CMD_SOCKET_SEND,     SOCKET_SendStream},
+#endif
+  {CMD_NULL,            NULL},           // end marker
 };
 
 //===== List of registered callbacks (to uC)
 
-// WifiCb plus 10 for other stuff
-#define MAX_CALLBACKS 12
+// The callbacks are kept in a small open-addressed hash table keyed by name. Entries are never
+// removed individually, the whole table gets cleared in cmdSync, so linear probing suffices.
+// Must be a power of 2.
+#define MAX_CALLBACKS 32
 CmdCallback callbacks[MAX_CALLBACKS]; // cleared in cmdSync
 
+// FNV-1a hash of the name, limited to what's stored
+static uint32_t ICACHE_FLASH_ATTR
+cmdCbHash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (int i=0; i<CMD_CBNLEN-1 && name[i] != 0; i++) {
+    h ^= (uint8_t)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Find the slot holding the name or the empty slot where it would go, -1 if the table is full
+static int ICACHE_FLASH_ATTR
+cmdCbSlot(const char *name) {
+  uint32_t i = cmdCbHash(name);
+  for (int n=0; n<MAX_CALLBACKS; n++, i++) {
+    CmdCallback *cb = &callbacks[i & (MAX_CALLBACKS-1)];
+    if (cb->name[0] == '\0' || os_strncmp(cb->name, name, CMD_CBNLEN-1) == 0)
+      return i & (MAX_CALLBACKS-1);
+  }
+  return -1;
+}
+
 uint32_t ICACHE_FLASH_ATTR
 cmdAddCb(char* name, uint32_t cb) {
-  for (uint8_t i = 0; i < MAX_CALLBACKS; i++) {
-    //DBG("cmdAddCb: index %d name=%s cb=%p\n", i, callbacks[i].name,
-    //  (void *)callbacks[i].callback);
-    // find existing callback or add to the end
-    if (os_strncmp(callbacks[i].name, name, CMD_CBNLEN) == 0 || callbacks[i].name[0] == '\0') {
-      os_strncpy(callbacks[i].name, name, sizeof(callbacks[i].name));
-      callbacks[i].name[CMD_CBNLEN-1] = 0; // strncpy doesn't null terminate
-      callbacks[i].callback = cb;
-      DBG("cmdAddCb: '%s'->0x%x added at %d\n", callbacks[i].name, cb, i);
-      return 1;
-    }
-  }
-  return 0;
+  int i = cmdCbSlot(name);
+  if (i < 0 || name[0] == '\0') return 0;
+  // find existing callback or add a new one
+  os_strncpy(callbacks[i].name, name, sizeof(callbacks[i].name));
+  callbacks[i].name[CMD_CBNLEN-1] = 0; // strncpy doesn't null terminate
+  callbacks[i].callback = cb;
+  DBG("cmdAddCb: '%s'->0x%x added at %d\n", callbacks[i].name, cb, i);
+  return i+1;
 }
 
 CmdCallback* ICACHE_FLASH_ATTR
 cmdGetCbByName(char* name) {
-  for (uint8_t i = 0; i < MAX_CALLBACKS; i++) {
-    //DBG("cmdGetCbByName: index %d name=%s cb=%p\n", i, callbacks[i].name,
-    //  (void *)callbacks[i].callback);
-    // if callback doesn't exist or it's null
-    if (os_strncmp(callbacks[i].name, name, CMD_CBNLEN) == 0) {
-      DBG("cmdGetCbByName: cb %s found at index %d\n", name, i);
-      return &callbacks[i];
-    }
+  int i = cmdCbSlot(name);
+  if (i >= 0 && callbacks[i].name[0] != '\0') {
+    DBG("cmdGetCbByName: cb %s found at index %d\n", name, i);
+    return &callbacks[i];
   }
   DBG("cmdGetCbByName: cb %s not found\n", name);
   return 0;
 }
 
+CmdCallback* ICACHE_FLASH_ATTR
+cmdGetCbByHandle(uint32_t handle) {
+  if (handle == 0 || handle > MAX_CALLBACKS || callbacks[handle-1].name[0] == '\0') return 0;
+  return &callbacks[handle-1];
+}
+
 //===== Wifi callback
 
 // Callback from wifi subsystem to notify us of status changes
@@ -135,8 +176,8 @@ cmdWifiCb(uint8_t wifiStatus) {
   if (wifiStatus != lastWifiStatus){
     DBG("cmdWifiCb: wifiStatus=%d\n", wifiStatus);
     lastWifiStatus = wifiStatus;
-    CmdCallback *wifiCb = cmdGetCbByName("wifiCb");
-    if ((uint32_t)wifiCb->callback != -1) {
+    CmdCallback *wifiCb = cmdGetCbByHandle(wifiCbHandle);
+    if (wifiCb != NULL && (uint32_t)wifiCb->callback != -1) {
       uint8_t status = wifiStatus == wifiGotIP ? 5 : 1;
       cmdResponseStart(CMD_RESP_CB, (uint32_t)wifiCb->callback, 1);
       cmdResponseBody((uint8_t*)&status, 1);
@@ -158,12 +199,24 @@ cmdSync(CmdPacket *cmd) {
   CmdRequest req;
   uart0_write_char(SLIP_END); // prefix with a SLIP END to ensure we get a clean start
   cmdRequest(&req, cmd);
-  if(cmd->argc != 0 || cmd->value == 0) {
+  // the response goes out in the framing the sync came in with
+  bool cobs = slip_is_cobs_frame();
+  cmdSetFraming(cobs ? CMD_FRAMING_COBS : CMD_FRAMING_SLIP);
+  if(cmd->argc > 2 || cmd->value == 0) {
     cmdResponseStart(CMD_RESP_V, 0, 0);
     cmdResponseEnd();
     return;
   }
 
+  // an optional argument requests pipelining with the given window size, a second one
+  // requests the CMD_SYNC_* options
+  uint16_t window = 0, flags = 0;
+  if (cmd->argc >= 1 && cmdPopArg(&req, &window, sizeof(window))) window = 0;
+  if (cmd->argc == 2 && cmdPopArg(&req, &flags, sizeof(flags))) flags = 0;
+  flags &= CMD_SYNC_COBS | CMD_SYNC_CHANNELS;
+  window = cmdPipelineReset(window);
+  cmdBatchUnsolicited = false;
+
   // clear callbacks table
   os_memset(callbacks, 0, sizeof(callbacks));
 
@@ -175,13 +228,22 @@ cmdSync(CmdPacket *cmd) {
     wifiCbAdded = true;
   }
 
-  // send OK response
-  cmdResponseStart(CMD_RESP_V, cmd->value, 0);
+  // send OK response, with the granted window if pipelining was requested and the granted
+  // options if any were
+  cmdResponseStart(CMD_RESP_V, cmd->value, cmd->argc);
+  if (cmd->argc >= 1) cmdResponseBody(&window, sizeof(window));
+  if (cmd->argc == 2) cmdResponseBody(&flags, sizeof(flags));
   cmdResponseEnd();
   cmdInSync = true;
 
+  // then switch the framing
+  cobs = flags & CMD_SYNC_COBS;
+  cmdSetFraming(cobs ? CMD_FRAMING_COBS : CMD_FRAMING_SLIP);
+  slip_set_cobs(cobs);
+  serbridgeSetChannels(flags & CMD_SYNC_CHANNELS);
+
   // save the MCU's callback and trigger an initial callback
-  cmdAddCb("wifiCb", cmd->value);
+  wifiCbHandle = cmdAddCb("wifiCb", cmd->value);
   lastWifiStatus = 0xff; // set to invalid value so we immediately send status cb in all cases
   cmdWifiCb(wifiState);
 
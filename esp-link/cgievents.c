@@ -0,0 +1,134 @@
+#include <esp8266.h>
+#include "cgi.h"
+#include "cgievents.h"
+
+#ifdef CGIEVENTS_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define EVENTS_MAX_CONN 3     // max number of streams open at the same time
+#define EVENTS_POLL_MS  50    // how often the buffers are checked for new text
+#define EVENTS_BEAT     (15000/EVENTS_POLL_MS) // polls without text until a keep-alive goes out
+
+// The buffers are polled for new text instead of the writers kicking the streams: the log gets
+// written from within os_printf, which may be called from anywhere, e.g. the httpd itself.
+
+typedef struct {
+  HttpdConnData *conn;  // NULL if the slot is free
+  EventSource *src;
+  int next;             // offset of the next char to send
+  uint16_t idle;        // polls since something was sent
+} EventStream;
+
+static EventStream streams[EVENTS_MAX_CONN];
+static ETSTimer eventsTimer;
+static bool eventsTimerArmed;
+
+// offset just past the last char in the buffer
+static int ICACHE_FLASH_ATTR eventsEnd(EventSource *src) {
+  if (src->size == 0) return *src->pos; // buffer could not be allocated
+  return *src->pos + (*src->wr + src->size - *src->rd) % src->size;
+}
+
+// put the next part of the stream into the output buffer
+static void ICACHE_FLASH_ATTR eventsSend(EventStream *s) {
+  EventSource *src = s->src;
+  int end = eventsEnd(src);
+  int avail, len = 0;
+  char *buff = httpdSendBuf(s->conn, &avail);
+
+  if (s->next < *src->pos) {
+    // we've lost some text
+    len += os_sprintf(buff+len, "event: gap\ndata:\n\n");
+    s->next = *src->pos;
+  } else if (s->next > end) {
+    // the buffer has been cleared
+    s->next = *src->pos;
+  }
+
+  if (s->next == end) {
+    if (s->idle >= EVENTS_BEAT) {
+      len += os_sprintf(buff+len, ":\n\n"); // comment to keep the connection alive
+    }
+  } else {
+    // one data line per line of text, the browser joins them with a newline
+    int rd = (*src->rd + s->next - *src->pos) % src->size;
+    len += os_sprintf(buff+len, "data: ");
+    while (s->next < end && len < avail-32) {
+      char c = src->buf[rd];
+      if (c == '\n') {
+        len += os_sprintf(buff+len, "\ndata: ");
+      } else if (c != '\r') { // \r ends a line as well in an event stream
+        buff[len++] = c;
+      }
+      rd = (rd+1) % src->size;
+      s->next++;
+    }
+    len += os_sprintf(buff+len, "\nid: %d\n\n", s->next);
+  }
+
+  if (len > 0) s->idle = 0;
+  httpdSendCommit(s->conn, len);
+}
+
+static void ICACHE_FLASH_ATTR eventsTimerCb(void *arg) {
+  bool any = false;
+  for (int i=0; i<EVENTS_MAX_CONN; i++) {
+    EventStream *s = streams+i;
+    if (s->conn == NULL) continue;
+    any = true;
+    if (s->idle < EVENTS_BEAT) s->idle++;
+    if (s->next != eventsEnd(s->src) || s->idle >= EVENTS_BEAT) httpdResume(s->conn);
+  }
+  if (!any) {
+    os_timer_disarm(&eventsTimer);
+    eventsTimerArmed = false;
+  }
+}
+
+int ICACHE_FLASH_ATTR cgiEvents(HttpdConnData *connData) {
+  EventStream *s = connData->cgiData;
+  if (connData->conn == NULL) {
+    // Connection aborted. Clean up.
+    if (s != NULL) s->conn = NULL;
+    return HTTPD_CGI_DONE;
+  }
+
+  if (s == NULL) {
+    // first call, grab a stream
+    for (int i=0; i<EVENTS_MAX_CONN && s == NULL; i++)
+      if (streams[i].conn == NULL) s = streams+i;
+    if (s == NULL) {
+      errorResponse(connData, 503, "Too many event streams");
+      return HTTPD_CGI_DONE;
+    }
+
+    char buff[16];
+    s->src = (EventSource *)connData->cgiArg;
+    s->next = *s->src->pos;
+    s->idle = 0;
+    if (httpdGetHeader(connData, "Last-Event-ID", buff, sizeof(buff)) ||
+        httpdFindArg(connData->getArgs, "start", buff, sizeof(buff)) > 0)
+      s->next = atoi(buff);
+    s->conn = connData;
+    connData->cgiData = s;
+    DBG("Events: stream %d from %d\n", s - streams, s->next);
+
+    httpdStartResponse(connData, 200);
+    httpdHeader(connData, "Content-Type", "text/event-stream");
+    httpdHeader(connData, "Cache-Control", "no-cache");
+    httpdEndHeaders(connData);
+
+    if (!eventsTimerArmed) {
+      os_timer_disarm(&eventsTimer);
+      os_timer_setfn(&eventsTimer, eventsTimerCb, NULL);
+      os_timer_arm(&eventsTimer, EVENTS_POLL_MS, 1);
+      eventsTimerArmed = true;
+    }
+  }
+
+  eventsSend(s);
+  return HTTPD_CGI_MORE;
+}
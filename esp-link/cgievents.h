@@ -0,0 +1,23 @@
+#ifndef CGIEVENTS_H
+#define CGIEVENTS_H
+
+#include "httpd.h"
+
+// Server-sent event streams of the text in a circular buffer like the ones of the console and
+// the log (see console.c for the invariants). New text is pushed to the browser as it arrives
+// on a single long-lived connection. Each event carries a chunk of text with the offset of its
+// end as id, so an EventSource that reconnects picks up where it left off. Text that fell out
+// of the buffer before it could be sent is signaled by a "gap" event.
+
+typedef struct {
+  const char *buf;  // the circular buffer
+  int size;         // size of buf
+  int *wr, *rd;     // write and read index into buf
+  int *pos;         // offset of the char at rd since the reset of the buffer
+} EventSource;
+
+// cgi streaming the EventSource passed as cgiArg, takes the offset to start at from the
+// Last-Event-ID header or the "start" arg, starts with the oldest text in the buffer otherwise
+int cgiEvents(HttpdConnData *connData);
+
+#endif
@@ -16,6 +16,8 @@ Some flash handling cgi routines. Used for reading the existing flash and updati
 #include <esp8266.h>
 #include "cgi.h"
 #include "cgiflash.h"
+#include "espfsformat.h"
+#include "pull.h"
 
 #ifdef CGIFLASH_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -65,9 +67,319 @@ int ICACHE_FLASH_ATTR cgiGetFirmwareNext(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
+//===== Firmware upload pipeline
+
+// The upload is collected into whole flash sectors, which are written in one go. Sectors are
+// erased ahead of the data from a timer, i.e. between TCP receives, so the erase doesn't hold up
+// the receive path. The image is checked as it streams in: after the 0xEA header and the irom
+// segment comes a regular 0xE9 image whose segments are covered by a one-byte checksum that sits
+// at the end of the 16-byte aligned padding.
+
+#define OTA_ERASE_AHEAD 2    // number of sectors to erase ahead of the data
+#define OTA_HS_MAX_BITS 12   // largest heatshrink window accepted for compressed uploads
+#define OTA_HS_OUT      256  // decompressed bytes collected before they go down the pipeline
+
+enum { OTA_IROM_HDR, OTA_IROM, OTA_FW_HDR, OTA_SEG_HDR, OTA_SEG, OTA_PAD, OTA_DONE };
+
+typedef struct {
+  void     *owner;           // connection the upload is coming in on, or the download
+  uint32_t base;             // flash address of the partition being written
+  uint32_t len;              // length of the image
+  uint32_t written;          // bytes written to flash
+  uint32_t erased;           // bytes of the partition erased
+  uint32_t *buf;             // sector being collected, allocated when needed
+  uint16_t fill;             // bytes in buf
+  // image check
+  uint8_t  state;            // OTA_*
+  uint8_t  segs;             // segments left
+  uint8_t  sum;              // running checksum
+  uint8_t  hdrLen;           // bytes in hdr
+  uint32_t hdr[4];           // header being collected
+  uint32_t left;             // bytes left in the current segment
+  uint32_t pos;              // bytes checked
+  struct OtaInflate *hs;     // decompressor, NULL for uncompressed uploads
+} OtaState;
+
+// State of the heatshrink decompressor for compressed uploads, followed by the window. Input is
+// pushed in as it arrives, so a token may be split across calls and stays in bits until it's
+// complete.
+typedef struct OtaInflate {
+  uint32_t produced;         // bytes decompressed
+  uint32_t bits;             // input bits not used yet, the low nbits of it
+  uint8_t  nbits;
+  uint8_t  windowBits, lookaheadBits;
+  uint16_t head;             // where the next output byte goes in the window
+  uint16_t outLen;           // bytes in out
+  uint8_t  out[OTA_HS_OUT];  // output that hasn't been checked and written yet
+  uint8_t  window[0];
+} OtaInflate;
+
+static OtaState *ota;
+static ETSTimer otaEraseTimer;
+
+static void ICACHE_FLASH_ATTR otaFree(void) {
+  os_timer_disarm(&otaEraseTimer);
+  if (ota == NULL) return;
+  if (ota->buf != NULL) os_free(ota->buf);
+  if (ota->hs != NULL) os_free(ota->hs);
+  os_free(ota);
+  ota = NULL;
+}
+
+// erase the sector at offset off of the partition
+static void ICACHE_FLASH_ATTR otaEraseSector(uint32_t off) {
+  spi_flash_erase_sector((ota->base + off)/SPI_FLASH_SEC_SIZE);
+  ota->erased = off + SPI_FLASH_SEC_SIZE;
+}
+
+// erase one sector ahead of the data and come back for the next one
+static void ICACHE_FLASH_ATTR otaEraseCb(void *arg) {
+  if (ota == NULL) return;
+  uint32_t limit = ota->written + OTA_ERASE_AHEAD*SPI_FLASH_SEC_SIZE;
+  if (limit > ota->len) limit = ota->len;
+  if (ota->erased >= limit) return;
+  otaEraseSector(ota->erased);
+  os_timer_arm(&otaEraseTimer, 0, 0);
+}
+
+// write a sector, or what's left of the image, len has to be a multiple of 4
+static void ICACHE_FLASH_ATTR otaWriteSector(uint32_t *data, uint16_t len) {
+  if (ota->erased <= ota->written) otaEraseSector(ota->written); // the timer didn't get to it
+  spi_flash_write(ota->base + ota->written, data, len);
+  ota->written += len;
+  os_timer_disarm(&otaEraseTimer);
+  os_timer_arm(&otaEraseTimer, 0, 0);
+}
+
+// write data to flash in whole sectors, last is set for the last piece of the upload
+static char* ICACHE_FLASH_ATTR otaWrite(uint8_t *data, int len, bool last) {
+  while (len > 0) {
+    // large enough pieces get written straight out of the post buffer
+    if (ota->fill == 0 && ((uint32_t)data & 3) == 0 &&
+        (len >= SPI_FLASH_SEC_SIZE || (last && (len&3) == 0))) {
+      int n = len < SPI_FLASH_SEC_SIZE ? len : SPI_FLASH_SEC_SIZE;
+      otaWriteSector((uint32_t *)data, n);
+      data += n;
+      len -= n;
+      continue;
+    }
+    if (ota->buf == NULL) {
+      ota->buf = os_malloc(SPI_FLASH_SEC_SIZE);
+      if (ota->buf == NULL) return "Out of memory";
+    }
+    int n = SPI_FLASH_SEC_SIZE - ota->fill;
+    if (n > len) n = len;
+    os_memcpy((uint8_t *)ota->buf + ota->fill, data, n);
+    ota->fill += n;
+    data += n;
+    len -= n;
+    if (ota->fill == SPI_FLASH_SEC_SIZE || (last && len == 0)) {
+      // pad the end of the image to a multiple of 4 bytes
+      while (ota->fill & 3) ((uint8_t *)ota->buf)[ota->fill++] = 0xFF;
+      otaWriteSector(ota->buf, ota->fill);
+      ota->fill = 0;
+    }
+  }
+  return NULL;
+}
+
+// run the image check over the next piece of the upload
+static char* ICACHE_FLASH_ATTR otaCheck(uint8_t *data, int len) {
+  while (len > 0) {
+    int n = len;
+    switch (ota->state) {
+    case OTA_IROM_HDR:
+    case OTA_FW_HDR:
+    case OTA_SEG_HDR: {
+      // collect the header, the first one includes the irom segment header
+      int need = ota->state == OTA_IROM_HDR ? 16 : 8;
+      if (n > need - ota->hdrLen) n = need - ota->hdrLen;
+      os_memcpy((uint8_t *)ota->hdr + ota->hdrLen, data, n);
+      ota->hdrLen += n;
+      if (ota->hdrLen < need) break;
+      ota->hdrLen = 0;
+      if (ota->state == OTA_IROM_HDR) {
+        ota->left = ota->hdr[3];
+        ota->state = OTA_IROM;
+      } else if (ota->state == OTA_FW_HDR) {
+        if ((ota->hdr[0] & 0xFF) != 0xE9) return "Bad firmware header";
+        ota->segs = (ota->hdr[0] >> 8) & 0xFF;
+        ota->state = ota->segs > 0 ? OTA_SEG_HDR : OTA_PAD;
+      } else {
+        ota->left = ota->hdr[1];
+        ota->state = OTA_SEG;
+      }
+      if (ota->left > ota->len) return "Bad firmware segment";
+      break;
+    }
+    case OTA_IROM:
+    case OTA_SEG:
+      if (n > ota->left) n = ota->left;
+      if (ota->state == OTA_SEG)
+        for (int i=0; i<n; i++) ota->sum ^= data[i];
+      ota->left -= n;
+      if (ota->left > 0) break;
+      if (ota->state == OTA_IROM) ota->state = OTA_FW_HDR;
+      else ota->state = --ota->segs > 0 ? OTA_SEG_HDR : OTA_PAD;
+      break;
+    case OTA_PAD:
+      // the checksum is the last byte of a 16-byte block
+      if (ota->pos % 16 != 15) {
+        if (n > 15 - ota->pos % 16) n = 15 - ota->pos % 16;
+        break;
+      }
+      n = 1;
+      if (data[0] != ota->sum) return "Firmware checksum mismatch";
+      DBG("Firmware checksum OK at 0x%05x\n", ota->pos);
+      ota->state = OTA_DONE;
+      break;
+    default:
+      break; // the rest is not checked
+    }
+    data += n;
+    len -= n;
+    ota->pos += n;
+  }
+  return NULL;
+}
+
+// check and write the next piece of the image
+static char* ICACHE_FLASH_ATTR otaPut(uint8_t *data, int len, bool last) {
+  char *err = otaCheck(data, len);
+  if (err == NULL) err = otaWrite(data, len, last);
+  return err;
+}
+
+// send the decompressed output on, the header check is done on the first block
+static char* ICACHE_FLASH_ATTR otaInflateFlush(OtaInflate *hs) {
+  char *err = NULL;
+  bool last = hs->produced == ota->len;
+  if (ota->pos == 0) {
+    if (hs->outLen < 16) return "Firmware image truncated";
+    err = check_header(hs->out);
+  }
+  if (err == NULL) err = otaPut(hs->out, hs->outLen, last);
+  hs->outLen = 0;
+  return err;
+}
+
+// decompress the next piece of a compressed upload, what comes after the end of the image is
+// ignored
+static char* ICACHE_FLASH_ATTR otaInflate(uint8_t *data, int len) {
+  OtaInflate *hs = ota->hs;
+  uint16_t mask = (1<<hs->windowBits) - 1;
+  uint8_t refBits = 1 + hs->windowBits + hs->lookaheadBits;
+  while (len > 0 && hs->produced < ota->len) {
+    hs->bits = (hs->bits<<8) | *data++;
+    hs->nbits += 8;
+    len--;
+    // decode all the tokens that are complete
+    while (hs->nbits > 0 && hs->produced < ota->len) {
+      bool literal = (hs->bits >> (hs->nbits-1)) & 1;
+      if (hs->nbits < (literal ? 9 : refBits)) break;
+      uint16_t count = 1, distance = 0;
+      if (literal) {
+        hs->nbits -= 9;
+      } else {
+        hs->nbits -= refBits;
+        uint32_t ref = hs->bits >> hs->nbits;
+        distance = ((ref >> hs->lookaheadBits) & mask) + 1;
+        count = (ref & ((1<<hs->lookaheadBits)-1)) + 1;
+      }
+      while (count-- > 0 && hs->produced < ota->len) {
+        uint8_t c = literal ? hs->bits >> hs->nbits : hs->window[(hs->head-distance) & mask];
+        hs->window[hs->head++ & mask] = c;
+        hs->out[hs->outLen++] = c;
+        hs->produced++;
+        if (hs->outLen == OTA_HS_OUT || hs->produced == ota->len) {
+          char *err = otaInflateFlush(hs);
+          if (err != NULL) return err;
+        }
+      }
+      hs->bits &= (1<<hs->nbits) - 1;
+    }
+  }
+  return NULL;
+}
+
+// set up the decompressor if the upload starts with the compressed firmware header, returns
+// the number of header bytes
+static int ICACHE_FLASH_ATTR otaInflateInit(uint8_t *data, int len, char **err) {
+  uint32_t *hdr = (uint32_t *)data;
+  if (hdr[0] != FW_HEATSHRINK_MAGIC) return 0;
+  int w = data[8]>>4, l = data[8]&0xf;
+  if (hdr[1] > FIRMWARE_SIZE) {
+    *err = "Firmware image too large";
+  } else if (w < 4 || w > OTA_HS_MAX_BITS || l < 1 || l >= w) {
+    *err = "Invalid compression";
+  } else {
+    ota->hs = os_zalloc(sizeof(OtaInflate) + (1<<w));
+    if (ota->hs == NULL) {
+      *err = "Out of memory";
+      return 0;
+    }
+    ota->hs->windowBits = w;
+    ota->hs->lookaheadBits = l;
+    ota->len = hdr[1];
+    DBG("Compressed firmware, %d bytes\n", ota->len);
+  }
+  return 9;
+}
+
+// start writing an image of len bytes (compressed uploads have their own length)
+static char* ICACHE_FLASH_ATTR otaStart(void *owner, uint32_t len) {
+  otaFree();
+  ota = os_zalloc(sizeof(OtaState));
+  if (ota == NULL) return "Out of memory";
+  // let's see which partition we need to flash and what flash address that puts us at
+  uint8 id = system_upgrade_userbin_check();
+  ota->owner = owner;
+  ota->base = id == 1 ? 4*1024                   // either start after 4KB boot partition
+      : 4*1024 + FIRMWARE_SIZE + 16*1024 + 4*1024; // 4KB boot, fw1, 16KB user param, 4KB reserved
+  ota->len = len;
+  ota->sum = 0xEF;
+  DBG("Flashing 0x%05x (id=%d)\n", ota->base, 2 - id);
+  os_timer_disarm(&otaEraseTimer);
+  os_timer_setfn(&otaEraseTimer, otaEraseCb, NULL);
+  os_timer_arm(&otaEraseTimer, 0, 0);
+  return NULL;
+}
+
+// feed the next piece of the image into the pipeline, first is set for the first one
+static char* ICACHE_FLASH_ATTR otaFeed(uint8_t *data, int len, bool first, bool last) {
+  char *err = NULL;
+  // a compressed image starts with its own header, else check that the data starts with an
+  // appropriate firmware header
+  if (first) {
+    int n = otaInflateInit(data, len, &err);
+    if (n == 0 && err == NULL) err = check_header(data);
+    data += n;
+    len -= n;
+  }
+  if (err == NULL && ota->hs != NULL) err = otaInflate(data, len);
+  else if (err == NULL) err = otaPut(data, len, last);
+  if (err == NULL && last && ota->state != OTA_DONE) err = "Firmware image truncated";
+  return err;
+}
+
+// give up on the image being written
+static void ICACHE_FLASH_ATTR otaAbort(void) {
+  if (ota == NULL) return;
+  // make sure the partial image doesn't get booted
+  if (ota->written > 0) spi_flash_erase_sector(ota->base/SPI_FLASH_SEC_SIZE);
+  otaFree();
+}
+
+#ifdef REST
+static char *otaPullData(char *data, uint16_t len, uint32_t offset, uint32_t total, bool last);
+#endif
+
 //===== Cgi that allows the firmware to be replaced via http POST
 int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
-  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+  if (connData->conn==NULL) { // Connection aborted. Clean up.
+    if (ota != NULL && ota->owner == connData) otaFree();
+    return HTTPD_CGI_DONE;
+  }
 
   if (!canOTA()) {
     errorResponse(connData, 400, flash_too_small);
@@ -92,18 +404,28 @@ int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
   if (connData->post->buff == NULL || connData->requestType != HTTPD_METHOD_POST ||
       connData->post->len < 1024) err = "Invalid request";
 
-  // check that data starts with an appropriate header
-  if (err == NULL && offset == 0) err = check_header(connData->post->buff);
-
-  // make sure we're buffering in 1024 byte chunks
-  if (err == NULL && offset % 1024 != 0) {
-    err = "Buffering problem";
+  // start the pipeline, this drops a download that may be going on
+  if (err == NULL && offset == 0) {
+#ifdef REST
+    pullAbort(otaPullData, "Aborted by an upload");
+#endif
+    err = otaStart(connData, connData->post->len);
+    if (err != NULL) code = 500;
+  }
+  if (err == NULL && (ota == NULL || ota->owner != connData)) {
+    err = "Another upload is in progress";
     code = 500;
   }
 
+  // check and write the data
+  bool last = connData->post->received == connData->post->len;
+  if (err == NULL)
+    err = otaFeed((uint8_t *)connData->post->buff, connData->post->buffLen, offset == 0, last);
+
   // return an error if there is one
   if (err != NULL) {
     DBG("Error %d: %s\n", code, err);
+    if (ota != NULL && ota->owner == connData) otaAbort();
     httpdStartResponse(connData, code);
     httpdHeader(connData, "Content-Type", "text/plain");
     //httpdHeader(connData, "Content-Length", strlen(err)+2);
@@ -114,31 +436,73 @@ int ICACHE_FLASH_ATTR cgiUploadFirmware(HttpdConnData *connData) {
     return HTTPD_CGI_DONE;
   }
 
-  // let's see which partition we need to flash and what flash address that puts us at
-  uint8 id = system_upgrade_userbin_check();
-  int address = id == 1 ? 4*1024                   // either start after 4KB boot partition
-      : 4*1024 + FIRMWARE_SIZE + 16*1024 + 4*1024; // 4KB boot, fw1, 16KB user param, 4KB reserved
-  address += offset;
+  if (last) {
+    otaFree();
+    httpdStartResponse(connData, 200);
+    httpdEndHeaders(connData);
+    return HTTPD_CGI_DONE;
+  } else {
+    return HTTPD_CGI_MORE;
+  }
+}
 
-  // erase next flash block if necessary
-  if (address % SPI_FLASH_SEC_SIZE == 0){
-    DBG("Flashing 0x%05x (id=%d)\n", address, 2 - id);
-    spi_flash_erase_sector(address/SPI_FLASH_SEC_SIZE);
+//===== Downloading the firmware from a URL
+
+#ifdef REST
+// sink for the download
+static char* ICACHE_FLASH_ATTR otaPullData(char *data, uint16_t len, uint32_t offset,
+    uint32_t total, bool last) {
+  char *err = NULL;
+  if (offset == 0) {
+    if (total == 0) return "Content-Length required";
+    if (total > FIRMWARE_SIZE) return "Firmware image too large";
+    err = otaStart(otaPullData, total);
+  } else if (ota == NULL || ota->owner != otaPullData) {
+    err = "Aborted by an upload";
   }
+  if (err == NULL) err = otaFeed((uint8_t *)data, len, offset == 0, last);
+  if (err == NULL && last) otaFree();
+  return err;
+}
 
-  // Write the data
-  //DBG("Writing %d bytes at 0x%05x (%d of %d)\n", connData->post->buffSize, address,
-  //		connData->post->received, connData->post->len);
-  spi_flash_write(address, (uint32 *)connData->post->buff, connData->post->buffLen);
+static void ICACHE_FLASH_ATTR otaPullAbort(void) {
+  if (ota != NULL && ota->owner == otaPullData) otaAbort();
+}
 
-  if (connData->post->received == connData->post->len){
-    httpdStartResponse(connData, 200);
-    httpdEndHeaders(connData);
+// POST /flash/pull?url=http://... starts downloading the firmware, which happens in the
+// background, GET /flash/pull tells how it's going. The download has to be for the partition
+// /flash/next names, once it's DONE /flash/reboot switches to it.
+int ICACHE_FLASH_ATTR cgiPullFirmware(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  if (!canOTA()) {
+    errorResponse(connData, 400, flash_too_small);
     return HTTPD_CGI_DONE;
+  }
+
+  char buf[128];
+  if (connData->requestType == HTTPD_METHOD_POST) {
+    if (httpdFindArg(connData->getArgs, "url", buf, sizeof(buf)) <= 0) {
+      errorResponse(connData, 400, "Missing url parameter");
+      return HTTPD_CGI_DONE;
+    }
+    char *err = pullStart(buf, "firmware", otaPullData, otaPullAbort, false);
+    if (err != NULL) {
+      errorResponse(connData, 400, err);
+      return HTTPD_CGI_DONE;
+    }
+    noCacheHeaders(connData, 204);
+    httpdEndHeaders(connData);
   } else {
-    return HTTPD_CGI_MORE;
+    pullStatus(buf);
+    noCacheHeaders(connData, 200);
+    httpdHeader(connData, "Content-Type", "text/plain");
+    httpdEndHeaders(connData);
+    httpdSend(connData, buf, -1);
   }
+  return HTTPD_CGI_DONE;
 }
+#endif
 
 static ETSTimer flash_reboot_timer;
 
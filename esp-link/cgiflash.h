@@ -6,6 +6,7 @@
 int cgiReadFlash(HttpdConnData *connData);
 int cgiGetFirmwareNext(HttpdConnData *connData);
 int cgiUploadFirmware(HttpdConnData *connData);
+int cgiPullFirmware(HttpdConnData *connData);
 int cgiRebootFirmware(HttpdConnData *connData);
 int cgiReset(HttpdConnData *connData);
 
@@ -43,7 +43,7 @@
 #define BAUD_INTERVAL  600   // interval after which we change baud rate
 #define PGM_TIMEOUT  20000   // timeout after sync is achieved, in milliseconds
 #define PGM_INTERVAL   200   // send sync at this interval in ms when in programming mode
-#define ATTEMPTS         8   // number of attempts total to make
+#define ATTEMPTS         2   // number of times to go through the baud rates
 
 #define DBG_GPIO5 1 // define to 1 to use GPIO5 to trigger scope
 
@@ -89,6 +89,9 @@ struct packet {
   uint8_t cksum;	// xor of all bytes including start and body
 } pbuf;
 
+// baud rates to try after the last one and the configured one, fastest first
+static const int32_t megaBauds[] = { 1000000, 500000, 230400, 115200, 57600 };
+
 // forward function references
 static void megaTimerCB(void *);
 static void megaUartRecv(char *buffer, short length);
@@ -183,6 +186,7 @@ int ICACHE_FLASH_ATTR cgiMegaSync(HttpdConnData *connData) {
     optibootInit();
     baudRate = flashConfig.baud_rate;
     programmingCB = megaUartRecv;
+    pgmBaudInit(connData, flashConfig.mega_baud, megaBauds, sizeof(megaBauds)/sizeof(int32_t));
     initBaud();
     serbridgeReset();
 #if DBG_GPIO5
@@ -417,20 +421,21 @@ static void ICACHE_FLASH_ATTR readRebootMCUReply() {
   }
 }
 
-static void ICACHE_FLASH_ATTR sendReadFlashQuery() {
+// read n bytes from the current address, the address moves on
+static void ICACHE_FLASH_ATTR sendReadFlashQuery(uint16_t n) {
   pbuf.ms1 = 0;
   pbuf.ms2 = 4;
   pbuf.body[0] = CMD_READ_FLASH_ISP;
-  pbuf.body[1] = 0;	// Number of bytes to read, MSB first
-  pbuf.body[2] = 16;
+  pbuf.body[1] = n >> 8;	// Number of bytes to read, MSB first
+  pbuf.body[2] = n & 0xff;
   pbuf.body[3] = 0x20;	// ??
 
   writePacket();
 }
 
-static void ICACHE_FLASH_ATTR readReadFlashReply(char *buf) {
+static void ICACHE_FLASH_ATTR readReadFlashReply(char *buf, uint16_t n) {
   int len = readPacket();
-  if (len == 19) {
+  if (len == n+3) {
     if (pbuf.body[0] == CMD_READ_FLASH_ISP && pbuf.body[1] == STATUS_CMD_OK) {
       int i;
       for (i=0; i<len-3; i++)
@@ -441,6 +446,14 @@ static void ICACHE_FLASH_ATTR readReadFlashReply(char *buf) {
     reply_ok = false;
 }
 
+// compare n bytes from the current address with buf, the address moves on
+static bool ICACHE_FLASH_ATTR readFlashDiffers(char *buf, uint16_t n) {
+  sendReadFlashQuery(n);
+  int len = readPacket();
+  reply_ok = len == n+3 && pbuf.body[0] == CMD_READ_FLASH_ISP && pbuf.body[1] == STATUS_CMD_OK;
+  return !reply_ok || os_memcmp(buf, pbuf.body+2, n) != 0;
+}
+
 static void ICACHE_FLASH_ATTR sendLoadAddressQuery(uint32_t addr) {
   pbuf.ms1 = 0;
   pbuf.ms2 = 5;
@@ -567,6 +580,10 @@ int ICACHE_FLASH_ATTR cgiMegaData(HttpdConnData *connData) {
     }
   }
 
+  // ?diff=1: only program the pages that changed
+  char diff[4];
+  optibootData->diff = httpdFindArg(connData->getArgs, "diff", diff, sizeof(diff)) > 0 && diff[0] == '1';
+
   // iterate through the data received and program the AVR one block at a time
   HttpdPostData *post = connData->post;
   char *saved = optibootData->saved;
@@ -643,11 +660,16 @@ int ICACHE_FLASH_ATTR cgiMegaData(HttpdConnData *connData) {
     code = 200;
     // calculate some stats
     float dt = ((system_get_time() - optibootData->startTime)/1000)/1000.0; // in seconds
+    pgmBaudRemember(&flashConfig.mega_baud, baudRate);
     uint32_t pgmDone = optibootData->pgmDone;
+    uint32_t pgmSkipped = optibootData->pgmSkipped;
+    bool diff = optibootData->diff;
     optibootInit();
     os_sprintf(errMessage, "Success. %d bytes at %d baud in %d.%ds, %dB/s %d%% efficient",
         pgmDone, baudRate, (int)dt, (int)(dt*10)%10, (int)(pgmDone/dt),
         (int)(100.0*(10.0*pgmDone/baudRate)/dt));
+    if (diff)
+      os_sprintf(errMessage+os_strlen(errMessage), ", %d bytes unchanged", pgmSkipped);
   } else {
     code = 400;
     optibootInit();
@@ -697,6 +719,24 @@ bool ICACHE_FLASH_ATTR megaProgramPage(void) {
   armTimer(PGM_TIMEOUT);
   // DBG("OB sent address 0x%04x\n", addr);
 
+  // in differential mode read the page back first, skip it if it's the same
+  if (optibootData->diff) {
+    bool differs = readFlashDiffers(optibootData->pageBuf, pgmLen);
+    armTimer(PGM_TIMEOUT);
+    if (!differs) {
+      optibootData->pgmSkipped += pgmLen;
+      goto done;
+    }
+    // reading moved the address on
+    sendLoadAddressQuery(addr);
+    readLoadAddressReply();
+    armTimer(PGM_TIMEOUT);
+    if (! reply_ok) {
+      DBG("OB pgm failed in load address\n");
+      return false;
+    }
+  }
+
   // send page content
   sendProgramPageQuery(optibootData->pageBuf, pgmLen);
 
@@ -707,7 +747,9 @@ bool ICACHE_FLASH_ATTR megaProgramPage(void) {
     DBG("OB pgm failed in prog page\n");
     return false;
   }
+  optibootData->pgmDone += pgmLen;
 
+done:
   // shift data out of buffer
   os_memmove(optibootData->pageBuf, optibootData->pageBuf+pgmLen, optibootData->pageLen-pgmLen);
   optibootData->pageLen -= pgmLen;
@@ -718,7 +760,6 @@ bool ICACHE_FLASH_ATTR megaProgramPage(void) {
   optibootData->address += pgmLen;
   DBG(" new %08x\n", optibootData->address + optibootData->segment);
 #endif
-  optibootData->pgmDone += pgmLen;
 
   // DBG("OB pgm OK\n");
   return true;
@@ -731,16 +772,13 @@ static void ICACHE_FLASH_ATTR armTimer(uint32_t ms) {
   os_timer_arm(&optibootTimer, ms, 0);
 }
 
-static int baudRates[] = { 0, 9600, 57600, 115200 };
-
 static void ICACHE_FLASH_ATTR setBaud() {
-  baudRate = baudRates[(baudCnt++) % 4];
+  baudRate = pgmBauds[(baudCnt++) % pgmBaudCount];
   uart0_baud(baudRate);
   //DBG("OB changing to %ld baud\n", baudRate);
 }
 
 static void ICACHE_FLASH_ATTR initBaud() {
-  baudRates[0] = flashConfig.baud_rate;
   setBaud();
 }
 
@@ -772,8 +810,19 @@ static void ICACHE_FLASH_ATTR megaTimerCB(void *arg) {
 	cur_seqno++;
 	ok = readSyncPacket();
       }
-      if (ok < 0)
-        break;		// Don't increment progState
+      if (ok < 0) {
+        // no reply, try the next baud rate unless we've been through them all
+        if (baudCnt >= ATTEMPTS*pgmBaudCount) {
+          DBG("OB abandoned after %d attempts\n", baudCnt);
+          os_sprintf(errMessage, "sync abandoned after %d attempts", baudCnt);
+          uart0_baud(flashConfig.baud_rate);
+          return;
+        }
+        DBG("OB no sync response @%d baud\n", baudRate);
+        setBaud();
+        armTimer(INIT_DELAY);
+        return;		// Don't increment progState
+      }
 
       progState++;
 
@@ -984,8 +1033,8 @@ int ICACHE_FLASH_ATTR cgiMegaRead(HttpdConnData *connData) {
 
   for (i=0; i<len; i+=16) {
     char flash[20];
-    sendReadFlashQuery();
-    readReadFlashReply(flash);
+    sendReadFlashQuery(16);
+    readReadFlashReply(flash, 16);
     if (! reply_ok) {
       espconn_send(connData->conn, (uint8_t *)"Unknown problem\n", 16);
       return HTTPD_CGI_DONE;
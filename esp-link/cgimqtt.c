@@ -15,6 +15,8 @@ char *mqttState(void) {
 #include "status.h"
 #include "mqtt_client.h"
 #include "cgimqtt.h"
+#include "httpdjson.h"
+#include "espfs.h"
 
 #ifdef CGIMQTT_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -28,50 +30,60 @@ char *mqttState(void) {
 
 // Cgi to return MQTT settings
 int ICACHE_FLASH_ATTR cgiMqttGet(HttpdConnData *connData) {
-  char buff[1024];
-  int len;
-
   if (connData->conn==NULL) return HTTPD_CGI_DONE;
 
   // get the current status topic for display
-  char status_buf1[128], *sb1=status_buf1;
-  char status_buf2[128], *sb2=status_buf2;
-  mqttStatusMsg(status_buf1);
-  // quote all " for the json, sigh...
-  for (int i=0; i<127 && *sb1; i++) {
-    if (*sb1 == '"') {
-      *sb2++ = '\\';
-      i++;
-    }
-    *sb2++ = *sb1++;
-  }
-  *sb2 = 0;
-
-  len = os_sprintf(buff, "{ "
-      "\"slip-enable\":%d, "
-      "\"mqtt-enable\":%d, "
-      "\"mqtt-state\":\"%s\", "
-      "\"mqtt-status-enable\":%d, "
-      "\"mqtt-clean-session\":%d, "
-      "\"mqtt-port\":%d, "
-      "\"mqtt-timeout\":%d, "
-      "\"mqtt-keepalive\":%d, "
-      "\"mqtt-host\":\"%s\", "
-      "\"mqtt-client-id\":\"%s\", "
-      "\"mqtt-username\":\"%s\", "
-      "\"mqtt-password\":\"%s\", "
-      "\"mqtt-status-topic\":\"%s\", "
-      "\"mqtt-status-value\":\"%s\" }",
-      flashConfig.slip_enable, flashConfig.mqtt_enable,
-      mqtt_states[mqttClient.connState], flashConfig.mqtt_status_enable,
-      flashConfig.mqtt_clean_session, flashConfig.mqtt_port,
-      flashConfig.mqtt_timeout, flashConfig.mqtt_keepalive,
-      flashConfig.mqtt_host, flashConfig.mqtt_clientid,
-      flashConfig.mqtt_username, flashConfig.mqtt_password,
-      flashConfig.mqtt_status_topic, status_buf2);
+  char status_buf[128];
+  mqttStatusMsg(status_buf);
 
+  JsonWriter w;
   jsonHeader(connData, 200);
-  httpdSend(connData, buff, len);
+  jsonBegin(&w, connData, 0);
+  jsonObject(&w, NULL);
+  jsonInt(&w, "slip-enable", flashConfig.slip_enable);
+  jsonInt(&w, "mqtt-enable", flashConfig.mqtt_enable);
+  jsonString(&w, "mqtt-state", mqtt_states[mqttClient.connState]);
+  jsonInt(&w, "mqtt-status-enable", flashConfig.mqtt_status_enable);
+  jsonInt(&w, "mqtt-bridge-stats-enable", flashConfig.mqtt_bridge_stats);
+  jsonInt(&w, "mqtt-metrics-enable", flashConfig.mqtt_metrics);
+  jsonInt(&w, "mqtt-clean-session", flashConfig.mqtt_clean_session);
+  jsonInt(&w, "mqtt-coalesce", flashConfig.mqtt_coalesce);
+  jsonInt(&w, "mqtt-spool", flashConfig.mqtt_spool);
+  jsonUInt(&w, "mqtt-spooled", mqttClient.spool ? mqttClient.spool->count : 0);
+  jsonInt(&w, "mqtt-port", flashConfig.mqtt_port);
+  jsonInt(&w, "mqtt-timeout", flashConfig.mqtt_timeout);
+  jsonInt(&w, "mqtt-keepalive", flashConfig.mqtt_keepalive);
+  jsonInt(&w, "mqtt-queue-size",
+      flashConfig.mqtt_queue_size ? flashConfig.mqtt_queue_size : MQTT_QUEUE_SIZE);
+  jsonInt(&w, "mqtt-inflight", flashConfig.mqtt_inflight ? flashConfig.mqtt_inflight : MQTT_INFLIGHT);
+  jsonInt(&w, "mqtt-queue-max", flashConfig.mqtt_queue_max);
+  jsonInt(&w, "mqtt-queue-policy", flashConfig.mqtt_queue_policy);
+  jsonInt(&w, "mqtt-queued", mqttClient.msgQueue.count);
+  jsonUInt(&w, "mqtt-enqueued", mqttClient.queueStats.enqueued);
+  jsonUInt(&w, "mqtt-sent", mqttClient.queueStats.sent);
+  jsonUInt(&w, "mqtt-dropped", mqttClient.queueStats.dropped);
+  jsonUInt(&w, "mqtt-retransmitted", mqttClient.queueStats.retransmitted);
+  jsonInt(&w, "mqtt-queue-peak", mqttClient.queueStats.peakCount);
+  jsonInt(&w, "mqtt-queue-peak-bytes", mqttClient.queueStats.peakBytes);
+  jsonString(&w, "mqtt-host", flashConfig.mqtt_host);
+  jsonString(&w, "mqtt-client-id", flashConfig.mqtt_clientid);
+  jsonString(&w, "mqtt-username", flashConfig.mqtt_username);
+  jsonString(&w, "mqtt-password", flashConfig.mqtt_password);
+  jsonString(&w, "mqtt-status-topic", flashConfig.mqtt_status_topic);
+  jsonInt(&w, "mqtt-status-delta", flashConfig.mqtt_status_delta);
+  jsonInt(&w, "mqtt-status-heartbeat",
+      flashConfig.mqtt_status_heartbeat ? flashConfig.mqtt_status_heartbeat : 300);
+  jsonInt(&w, "mqtt-status-heap-th",
+      flashConfig.mqtt_status_heap_th ? flashConfig.mqtt_status_heap_th : 1024);
+  jsonInt(&w, "mqtt-status-rssi-th",
+      flashConfig.mqtt_status_rssi_th ? flashConfig.mqtt_status_rssi_th : 3);
+  jsonInt(&w, "mqtt-uart-enable", flashConfig.mqtt_uart_enable);
+  jsonInt(&w, "mqtt-uart-delim", flashConfig.mqtt_uart_delim ? flashConfig.mqtt_uart_delim : '\n');
+  jsonString(&w, "mqtt-uart-topic", flashConfig.mqtt_uart_topic);
+  jsonString(&w, "mqtt-uart-sub-topic", flashConfig.mqtt_uart_sub_topic);
+  jsonString(&w, "mqtt-status-value", status_buf);
+  jsonClose(&w);
+  jsonEnd(&w);
   return HTTPD_CGI_DONE;
 }
 
@@ -97,6 +109,25 @@ int ICACHE_FLASH_ATTR cgiMqttSet(HttpdConnData *connData) {
   mqtt_server |= getBoolArg(connData, "mqtt-clean-session",
       &flashConfig.mqtt_clean_session);
 
+  if (mqtt_server < 0) return HTTPD_CGI_DONE;
+  mqtt_server |= getBoolArg(connData, "mqtt-coalesce",
+      &flashConfig.mqtt_coalesce);
+
+  if (mqtt_server < 0) return HTTPD_CGI_DONE;
+  uint8_t spool_was = flashConfig.mqtt_spool;
+  mqtt_server |= getBoolArg(connData, "mqtt-spool",
+      &flashConfig.mqtt_spool);
+  // the spool takes the top of the user page section, which must not hold user pages then
+  if (flashConfig.mqtt_spool && !spool_was) {
+    char *end = espFsImageEnd(userPageCtx);
+    if (getMqttSpoolStart() == 0 || (end != NULL && (uint32_t)end > getMqttSpoolStart())) {
+      flashConfig.mqtt_spool = 0;
+      errorResponse(connData, 400, getMqttSpoolStart() == 0 ?
+          "MQTT spool needs at least 2MB flash" : "User pages overlap the MQTT spool area");
+      return HTTPD_CGI_DONE;
+    }
+  }
+
   if (mqtt_server < 0) return HTTPD_CGI_DONE;
   int8_t mqtt_en_chg = getBoolArg(connData, "mqtt-enable",
       &flashConfig.mqtt_enable);
@@ -127,6 +158,51 @@ int ICACHE_FLASH_ATTR cgiMqttSet(HttpdConnData *connData) {
     flashConfig.mqtt_keepalive = keepalive;
   }
 
+  // handle mqtt queue size, this needs the client to be re-initialized
+  if (httpdFindArg(connData->getArgs, "mqtt-queue-size", buff, sizeof(buff)) > 0) {
+    int32_t size = atoi(buff);
+    if (size < 512 || size > 16384) {
+      errorResponse(connData, 400, "Invalid MQTT queue size");
+      return HTTPD_CGI_DONE;
+    }
+    if (size != flashConfig.mqtt_queue_size) {
+      flashConfig.mqtt_queue_size = size;
+      mqtt_server |= 1;
+    }
+  }
+
+  // handle mqtt in-flight window
+  if (httpdFindArg(connData->getArgs, "mqtt-inflight", buff, sizeof(buff)) > 0) {
+    int32_t inflight = atoi(buff);
+    if (inflight < 1 || inflight > MQTT_MAX_INFLIGHT) {
+      errorResponse(connData, 400, "Invalid MQTT in-flight window");
+      return HTTPD_CGI_DONE;
+    }
+    if (inflight != flashConfig.mqtt_inflight) {
+      flashConfig.mqtt_inflight = inflight;
+      mqtt_server |= 1;
+    }
+  }
+
+  // handle mqtt queue limit and overflow policy, these take effect right away
+  if (httpdFindArg(connData->getArgs, "mqtt-queue-max", buff, sizeof(buff)) > 0) {
+    int32_t max = atoi(buff);
+    if (max < 0 || max > 1000) {
+      errorResponse(connData, 400, "Invalid MQTT queue message limit");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.mqtt_queue_max = max;
+  }
+  if (httpdFindArg(connData->getArgs, "mqtt-queue-policy", buff, sizeof(buff)) > 0) {
+    int32_t policy = atoi(buff);
+    if (policy < MQTT_DROP_NEWEST || policy > MQTT_DROP_QOS0) {
+      errorResponse(connData, 400, "Invalid MQTT queue policy");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.mqtt_queue_policy = policy;
+  }
+  MQTT_SetQueueLimit(&mqttClient, flashConfig.mqtt_queue_max, flashConfig.mqtt_queue_policy);
+
   // if server setting changed, we need to "make it so"
   if (mqtt_server) {
     DBG("MQTT server settings changed, enable=%d\n", flashConfig.mqtt_enable);
@@ -150,9 +226,59 @@ int ICACHE_FLASH_ATTR cgiMqttSet(HttpdConnData *connData) {
   // next status tick
   if (getBoolArg(connData, "mqtt-status-enable", &flashConfig.mqtt_status_enable) < 0)
     return HTTPD_CGI_DONE;
+  if (getBoolArg(connData, "mqtt-bridge-stats-enable", &flashConfig.mqtt_bridge_stats) < 0)
+    return HTTPD_CGI_DONE;
+  if (getBoolArg(connData, "mqtt-metrics-enable", &flashConfig.mqtt_metrics) < 0)
+    return HTTPD_CGI_DONE;
   if (getStringArg(connData, "mqtt-status-topic",
         flashConfig.mqtt_status_topic, sizeof(flashConfig.mqtt_status_topic)) < 0)
     return HTTPD_CGI_DONE;
+  if (getBoolArg(connData, "mqtt-status-delta", &flashConfig.mqtt_status_delta) < 0)
+    return HTTPD_CGI_DONE;
+  if (httpdFindArg(connData->getArgs, "mqtt-status-heartbeat", buff, sizeof(buff)) > 0) {
+    int32_t hb = atoi(buff);
+    if (hb < 10 || hb > 65535) {
+      errorResponse(connData, 400, "Invalid MQTT status heartbeat");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.mqtt_status_heartbeat = hb;
+  }
+  if (httpdFindArg(connData->getArgs, "mqtt-status-heap-th", buff, sizeof(buff)) > 0) {
+    int32_t th = atoi(buff);
+    if (th < 1 || th > 65535) {
+      errorResponse(connData, 400, "Invalid MQTT status heap threshold");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.mqtt_status_heap_th = th;
+  }
+  if (httpdFindArg(connData->getArgs, "mqtt-status-rssi-th", buff, sizeof(buff)) > 0) {
+    int32_t th = atoi(buff);
+    if (th < 1 || th > 100) {
+      errorResponse(connData, 400, "Invalid MQTT status RSSI threshold");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.mqtt_status_rssi_th = th;
+  }
+
+  // the UART line bridge picks up its settings with the next record, only enabling it or
+  // changing the topic for the uart needs a subscription
+  int8_t uart_sub = getBoolArg(connData, "mqtt-uart-enable", &flashConfig.mqtt_uart_enable);
+  if (uart_sub < 0) return HTTPD_CGI_DONE;
+  if (getStringArg(connData, "mqtt-uart-topic",
+        flashConfig.mqtt_uart_topic, sizeof(flashConfig.mqtt_uart_topic)) < 0)
+    return HTTPD_CGI_DONE;
+  uart_sub |= getStringArg(connData, "mqtt-uart-sub-topic",
+      flashConfig.mqtt_uart_sub_topic, sizeof(flashConfig.mqtt_uart_sub_topic));
+  if (uart_sub < 0) return HTTPD_CGI_DONE;
+  if (uart_sub > 0) mqttUartSubscribe();
+  if (httpdFindArg(connData->getArgs, "mqtt-uart-delim", buff, sizeof(buff)) > 0) {
+    int32_t delim = atoi(buff);
+    if (delim < 1 || delim > 255) {
+      errorResponse(connData, 400, "Invalid UART record delimiter");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.mqtt_uart_delim = delim;
+  }
 
   // if SLIP-enable is toggled it gets picked-up immediately by the parser
   int slip_update = getBoolArg(connData, "slip-enable", &flashConfig.slip_enable);
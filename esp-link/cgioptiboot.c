@@ -16,12 +16,13 @@
 #include "serled.h"
 
 #include "pgmshared.h"
+#include "pull.h"
 
 #define INIT_DELAY     150   // wait this many millisecs before sending anything
 #define BAUD_INTERVAL  600   // interval after which we change baud rate
 #define PGM_TIMEOUT  20000   // timeout after sync is achieved, in milliseconds
 #define PGM_INTERVAL   200   // send sync at this interval in ms when in programming mode
-#define ATTEMPTS         8   // number of attempts total to make
+#define ATTEMPTS         2   // number of times to go through the baud rates
 
 #ifdef OPTIBOOT_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -52,13 +53,54 @@ static uint32_t baudRate;    // baud rate at which we're programming
 #define MAX_PAGE_SZ 512      // max flash page size supported
 #define MAX_SAVED   512      // max chars in saved buffer
 
+// Pages are queued and sent to optiboot from the UART receive callback as the acks for the
+// previous one come in, so the next HTTP chunk can be received while the AVR is programming.
+// Optiboot can't take any characters while it writes a page, so only one page at a time is
+// in flight, the others wait in the queue. The HTTP side only blocks if the queue is full.
+// In differential mode (?diff=1 on the upload) each page is read back after LOAD_ADDRESS
+// and only programmed if it differs.
+#define PGM_QUEUE_SZ 1024    // bytes of page data that can be queued
+#define PGM_QUEUE_MAX   8    // max number of pages in the queue
+
+static struct {
+  char     *buf;                   // PGM_QUEUE_SZ bytes, slots pages of pgmSz each
+  uint8_t  slots;                  // number of pages that fit
+  uint8_t  head;                   // slot of the page in flight or next to go out
+  uint8_t  count;                  // pages in the queue, including the one in flight
+  uint8_t  step;                   // 0: idle, waiting for the ack of 1: LOAD_ADDRESS,
+                                   // 2: PROG_PAGE, 3: the reply to READ_PAGE, 4: the
+                                   // LOAD_ADDRESS after READ_PAGE
+  uint8_t  differs;                // the page read back differs from the queued one
+  uint16_t readPos;                // bytes of the READ_PAGE reply received
+  uint16_t len[PGM_QUEUE_MAX];
+  uint32_t address[PGM_QUEUE_MAX];
+  HttpdConnData *waiting;          // request waiting for the queue to drain
+  bool     pullDone;               // the download is complete, finish once the queue drains
+} pgmQueue;
+
+static bool pulling;                // the data comes from a download rather than a POST
+static bool pullDiff;               // ?diff=1 was given for the download
+
+// baud rates to try after the last one and the configured one, fastest first
+static const int32_t optibootBauds[] = { 1000000, 500000, 460800, 230400, 115200, 57600, 9600 };
+
 // forward function references
 static void optibootTimerCB(void *);
 static void optibootUartRecv(char *buffer, short length);
 static void armTimer(uint32_t ms);
 static void initBaud(void);
 
+#ifdef REST
+static char *optibootPullData(char *data, uint16_t len, uint32_t offset, uint32_t total, bool last);
+#endif
+
 static void ICACHE_FLASH_ATTR optibootInit() {
+#ifdef REST
+  if (pulling) {
+    pulling = false;
+    pullAbort(optibootPullData, errMessage[0] ? errMessage : "Aborted by a sync request");
+  }
+#endif
   progState = stateInit;
   baudCnt = 0;
   uart0_baud(flashConfig.baud_rate);
@@ -67,6 +109,8 @@ static void ICACHE_FLASH_ATTR optibootInit() {
   errMessage[0] = 0;
   responseLen = 0;
   programmingCB = NULL;
+  if (pgmQueue.buf) os_free(pgmQueue.buf);
+  os_memset(&pgmQueue, 0, sizeof(pgmQueue));
   if (optibootData != NULL) {
     if (optibootData->conn != NULL)
       optibootData->conn->cgiPrivData = (void *)-1; // signal that request has been aborted
@@ -118,6 +162,7 @@ int ICACHE_FLASH_ATTR cgiOptibootSync(HttpdConnData *connData) {
     mqtt_block(); // prevent MQTT from interfering
     baudRate = flashConfig.baud_rate;
     programmingCB = optibootUartRecv;
+    pgmBaudInit(connData, flashConfig.optiboot_baud, optibootBauds, sizeof(optibootBauds)/sizeof(int32_t));
     initBaud();
     serbridgeReset();
 #if DBG_GPIO5
@@ -161,57 +206,40 @@ int ICACHE_FLASH_ATTR cgiOptibootSync(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
-//===== Cgi to write firmware to Optiboot, requires prior sync call
-int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
-  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-  if (!optibootData)
-    DBG("OB pgm: state=%d postLen=%d\n", progState, connData->post->len);
-
-  // check that we have sync
-  if (errMessage[0] || progState < stateProg) {
-    DBG("OB not in sync, state=%d, err=%s\n", progState, errMessage);
-    errorResponse(connData, 400, errMessage[0] ? errMessage : "Optiboot not in sync");
-    return HTTPD_CGI_DONE;
-  }
-
-  // check that we don't have two concurrent programming requests going on
-  if (connData->cgiPrivData == (void *)-1) {
-    DBG("OB aborted\n");
-    errorResponse(connData, 400, "Request got aborted by a concurrent sync request");
-    return HTTPD_CGI_DONE;
-  }
-
-  // allocate data structure to track programming
-  if (!optibootData) {
-    optibootData = os_zalloc(sizeof(struct optibootData));
-    char *saved = os_zalloc(MAX_SAVED+1); // need space for string terminator
-    char *pageBuf = os_zalloc(MAX_PAGE_SZ+MAX_SAVED/2);
-    if (!optibootData || !pageBuf || !saved) {
-      errorResponse(connData, 400, "Out of memory");
-      return HTTPD_CGI_DONE;
-    }
-    optibootData->mega = false;
-    optibootData->pageBuf = pageBuf;
-    optibootData->saved = saved;
-    optibootData->startTime = system_get_time();
-    optibootData->pgmSz = 128; // hard coded for 328p for now, should be query string param
-    DBG("OB data alloc\n");
-  }
+// Allocate the data structures to track programming, returns false if out of memory
+static bool ICACHE_FLASH_ATTR optibootAlloc(void) {
+  optibootData = os_zalloc(sizeof(struct optibootData));
+  char *saved = os_zalloc(MAX_SAVED+1); // need space for string terminator
+  char *pageBuf = os_zalloc(MAX_PAGE_SZ+MAX_SAVED/2);
+  if (!optibootData || !pageBuf || !saved) return false;
+  optibootData->mega = false;
+  optibootData->pageBuf = pageBuf;
+  optibootData->saved = saved;
+  optibootData->startTime = system_get_time();
+  optibootData->pgmSz = 128; // hard coded for 328p for now, should be query string param
+  pgmQueue.buf = os_malloc(PGM_QUEUE_SZ);
+  if (!pgmQueue.buf) return false;
+  pgmQueue.slots = PGM_QUEUE_SZ / optibootData->pgmSz;
+  if (pgmQueue.slots > PGM_QUEUE_MAX) pgmQueue.slots = PGM_QUEUE_MAX;
+  DBG("OB data alloc\n");
+  return true;
+}
 
-  // iterate through the data received and program the AVR one block at a time
-  HttpdPostData *post = connData->post;
+// Iterate through the data received and program the AVR one block at a time, returns false
+// with errMessage set if the data is bad or programming failed
+static bool ICACHE_FLASH_ATTR optibootHex(char *data, int len) {
   char *saved = optibootData->saved;
-  while (post->buffLen > 0) {
+  while (len > 0) {
     // first fill-up the saved buffer
     short saveLen = strlen(saved);
     if (saveLen < MAX_SAVED) {
       short cpy = MAX_SAVED-saveLen;
-      if (cpy > post->buffLen) cpy = post->buffLen;
-      os_memcpy(saved+saveLen, post->buff, cpy);
+      if (cpy > len) cpy = len;
+      os_memcpy(saved+saveLen, data, cpy);
       saveLen += cpy;
       saved[saveLen] = 0; // string terminator
-      os_memmove(post->buff, post->buff+cpy, post->buffLen-cpy);
-      post->buffLen -= cpy;
+      data += cpy;
+      len -= cpy;
       //DBG("OB cp %d buff->saved\n", cpy);
     }
 
@@ -233,16 +261,10 @@ int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
       if (saved[0] != ':') {
         DBG("OB found non-: start\n");
         os_sprintf(errMessage, "Expected start of record in POST data, got %s", saved);
-        errorResponse(connData, 400, errMessage);
-        optibootInit();
-        return HTTPD_CGI_DONE;
+        return false;
       }
 
-      if (!checkHex(saved+1, 2)) {
-        errorResponse(connData, 400, errMessage);
-        optibootInit();
-        return HTTPD_CGI_DONE;
-      }
+      if (!checkHex(saved+1, 2)) return false;
       uint8_t recLen = getHexValue(saved+1, 2);
       //DBG("OB record %d\n", recLen);
 
@@ -250,9 +272,7 @@ int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
       if (saveLen >= 11+recLen*2) {
         if (!processRecord(saved, 11+recLen*2)) {
           DBG("OB process err %s\n", errMessage);
-          errorResponse(connData, 400, errMessage);
-          optibootInit();
-          return HTTPD_CGI_DONE;
+          return false;
         }
         short shift = 11+recLen*2;
         os_memmove(saved, saved+shift, saveLen+1-shift);
@@ -263,13 +283,13 @@ int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
       }
     }
   }
+  return true;
+}
 
+// All the data has been received and programmed, leave errMessage describing the outcome and
+// return the HTTP status for it
+static short ICACHE_FLASH_ATTR optibootFinish(void) {
   short code;
-  if (post->received < post->len) {
-    //DBG("OB pgm need more\n");
-    return HTTPD_CGI_MORE;
-  }
-
   if (optibootData->eof) {
     // tell optiboot to reboot into the sketch
     uart0_write_char(STK_LEAVE_PROGMODE);
@@ -277,17 +297,91 @@ int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
     code = 200;
     // calculate some stats
     float dt = ((system_get_time() - optibootData->startTime)/1000)/1000.0; // in seconds
+    pgmBaudRemember(&flashConfig.optiboot_baud, baudRate);
     uint16_t pgmDone = optibootData->pgmDone;
+    uint32_t pgmSkipped = optibootData->pgmSkipped;
+    bool diff = optibootData->diff;
     optibootInit();
     os_sprintf(errMessage, "Success. %d bytes at %d baud in %d.%ds, %dB/s %d%% efficient",
         pgmDone, baudRate, (int)dt, (int)(dt*10)%10, (int)(pgmDone/dt),
         (int)(100.0*(10.0*pgmDone/baudRate)/dt));
+    if (diff)
+      os_sprintf(errMessage+os_strlen(errMessage), ", %d bytes unchanged", pgmSkipped);
   } else {
     code = 400;
     optibootInit();
     os_strcpy(errMessage, "Improperly terminated POST data");
   }
   DBG("OB pgm done: %d -- %s\n", code, errMessage);
+  return code;
+}
+
+//===== Cgi to write firmware to Optiboot, requires prior sync call
+int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
+  if (connData->conn==NULL) { // Connection aborted. Clean up.
+    if (pgmQueue.waiting == connData) pgmQueue.waiting = NULL;
+    return HTTPD_CGI_DONE;
+  }
+  if (!optibootData)
+    DBG("OB pgm: state=%d postLen=%d\n", progState, connData->post->len);
+
+  // a page queued earlier failed to program
+  if (optibootData && errMessage[0]) {
+    DBG("OB pgm failed: %s\n", errMessage);
+    errorResponse(connData, 400, errMessage);
+    optibootInit();
+    return HTTPD_CGI_DONE;
+  }
+
+  // check that we have sync
+  if (errMessage[0] || progState < stateProg) {
+    DBG("OB not in sync, state=%d, err=%s\n", progState, errMessage);
+    errorResponse(connData, 400, errMessage[0] ? errMessage : "Optiboot not in sync");
+    return HTTPD_CGI_DONE;
+  }
+
+  // check that we don't have two concurrent programming requests going on
+  if (connData->cgiPrivData == (void *)-1) {
+    DBG("OB aborted\n");
+    errorResponse(connData, 400, "Request got aborted by a concurrent sync request");
+    return HTTPD_CGI_DONE;
+  }
+
+  if (pulling) {
+    errorResponse(connData, 400, "A download is being programmed");
+    return HTTPD_CGI_DONE;
+  }
+
+  // allocate data structure to track programming
+  if (!optibootData && !optibootAlloc()) {
+    errorResponse(connData, 400, "Out of memory");
+    return HTTPD_CGI_DONE;
+  }
+
+  // ?diff=1: only program the pages that changed
+  char diff[4];
+  optibootData->diff = httpdFindArg(connData->getArgs, "diff", diff, sizeof(diff)) > 0 && diff[0] == '1';
+
+  HttpdPostData *post = connData->post;
+  if (!optibootHex(post->buff, post->buffLen)) {
+    errorResponse(connData, 400, errMessage);
+    optibootInit();
+    return HTTPD_CGI_DONE;
+  }
+  post->buffLen = 0;
+
+  if (post->received < post->len) {
+    //DBG("OB pgm need more\n");
+    return HTTPD_CGI_MORE;
+  }
+
+  // wait for the queued pages to be programmed, the receive callback resumes the request
+  if (pgmQueue.count > 0) {
+    pgmQueue.waiting = connData;
+    return HTTPD_CGI_MORE;
+  }
+
+  short code = optibootFinish();
   noCacheHeaders(connData, code);
   httpdEndHeaders(connData);
   httpdSend(connData, errMessage, -1);
@@ -295,29 +389,246 @@ int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
-// Poll UART for ACKs, max 50ms
-static bool pollAck() {
-  char recv[16];
-  uint16_t need = ackWait*2;
-  uint16_t got = uart0_rx_poll(recv, need, 50000);
+//===== Programming from a download
+
+#ifdef REST
+// The download has been programmed
+static void ICACHE_FLASH_ATTR optibootPullFinish(void) {
+  pulling = false;
+  short code = optibootFinish();
+  pullDone(code == 200, errMessage);
+  errMessage[0] = 0;
+}
+
+// sink for the download
+static char* ICACHE_FLASH_ATTR optibootPullData(char *data, uint16_t len, uint32_t offset,
+    uint32_t total, bool last) {
+  if (offset == 0) {
+    if (!optibootData && !optibootAlloc()) return "Out of memory";
+    optibootData->diff = pullDiff;
+  }
+  if (errMessage[0]) return errMessage; // a queued page failed
+  if (!optibootHex(data, len)) return errMessage;
+  if (!last) return NULL;
+  if (pgmQueue.count > 0) pgmQueue.pullDone = true; // finish once it's all programmed
+  else optibootPullFinish();
+  return NULL;
+}
+
+static void ICACHE_FLASH_ATTR optibootPullAbort(void) {
+  pulling = false;
+  optibootInit();
+}
+
+// POST /pgm/pull?url=http://... downloads a hex file and programs it, after a sync like an
+// upload, GET /pgm/pull tells how it's going
+int ICACHE_FLASH_ATTR cgiOptibootPull(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  char buf[128];
+  if (connData->requestType == HTTPD_METHOD_POST) {
+    char *err = NULL;
+    if (httpdFindArg(connData->getArgs, "url", buf, sizeof(buf)) <= 0)
+      err = "Missing url parameter";
+    else if (errMessage[0] || progState < stateProg)
+      err = errMessage[0] ? errMessage : "Optiboot not in sync";
+    else if (optibootData || pulling)
+      err = "Another upload is in progress";
+    char diff[4];
+    pullDiff = httpdFindArg(connData->getArgs, "diff", diff, sizeof(diff)) > 0 && diff[0] == '1';
+    if (err == NULL) err = pullStart(buf, "sketch", optibootPullData, optibootPullAbort, true);
+    if (err != NULL) {
+      errorResponse(connData, 400, err);
+      return HTTPD_CGI_DONE;
+    }
+    pulling = true;
+    noCacheHeaders(connData, 204);
+    httpdEndHeaders(connData);
+  } else {
+    pullStatus(buf);
+    noCacheHeaders(connData, 200);
+    httpdHeader(connData, "Content-Type", "text/plain");
+    httpdEndHeaders(connData);
+    httpdSend(connData, buf, -1);
+  }
+  return HTTPD_CGI_DONE;
+}
+#endif
+
+// A page failed to program: drop the queue and let the request waiting for it report the error
+static void ICACHE_FLASH_ATTR pgmFail(void) {
+  DBG("OB pgm failed: %s\n", errMessage);
+  pgmQueue.count = 0;
+  pgmQueue.step = 0;
+#ifdef REST
+  if (pgmQueue.pullDone) {
+    // the download is complete, nobody is going to look at errMessage
+    pgmQueue.pullDone = false;
+    optibootInit();
+    return;
+  }
+#endif
+  if (pgmQueue.waiting != NULL) {
+    HttpdConnData *conn = pgmQueue.waiting;
+    pgmQueue.waiting = NULL;
+    httpdResume(conn);
+  }
+}
+
+// Send the next step of the page at the head of the queue, if optiboot is ready for it
+static void ICACHE_FLASH_ATTR pgmPump(void) {
+  if (pgmQueue.count == 0) return;
+  uint8_t slot = pgmQueue.head;
+  uint16_t pgmLen = pgmQueue.len[slot];
+  char cmd[4];
+
+  if (pgmQueue.step == 0 || pgmQueue.step == 3) {
+    // send address to optiboot (little endian format), again after a read-back since
+    // optiboot advances the address in READ_PAGE
+#ifdef DBG_GPIO5
+    gpio_output_set((1<<5), 0, (1<<5), 0); // output 1
+#endif
+    uint16_t addr = pgmQueue.address[slot] >> 1; // word address
+    cmd[0] = STK_LOAD_ADDRESS;
+    cmd[1] = addr & 0xff;
+    cmd[2] = addr >> 8;
+    cmd[3] = CRC_EOP;
+    uart0_tx_buffer(cmd, 4);
+    pgmQueue.step = pgmQueue.step == 0 ? 1 : 4;
+  } else if (pgmQueue.step == 1 && optibootData->diff) {
+    // read the page back to see whether it needs programming
+    cmd[0] = STK_READ_PAGE;
+    cmd[1] = pgmLen>>8;
+    cmd[2] = pgmLen&0xff;
+    cmd[3] = 'F';
+    uart0_tx_buffer(cmd, 4);
+    cmd[0] = CRC_EOP;
+    uart0_tx_buffer(cmd, 1);
+    pgmQueue.step = 3;
+    pgmQueue.readPos = 0;
+    pgmQueue.differs = 0;
+  } else if (pgmQueue.step == 1 || pgmQueue.step == 4) {
+    // send page length (big-endian format, go figure...) and content
+    cmd[0] = STK_PROG_PAGE;
+    cmd[1] = pgmLen>>8;
+    cmd[2] = pgmLen&0xff;
+    cmd[3] = 'F'; // we're writing flash
+    uart0_tx_buffer(cmd, 4);
+    uart0_tx_buffer(pgmQueue.buf + slot*optibootData->pgmSz, pgmLen);
+    cmd[0] = CRC_EOP;
+    uart0_tx_buffer(cmd, 1);
+    pgmQueue.step = 2;
+  }
+  armTimer(PGM_INTERVAL); // optiboot has to ack within this time
+}
+
+// The page in flight is done, go on with the next one
+static void ICACHE_FLASH_ATTR pgmNext(bool programmed) {
 #ifdef DBG_GPIO5
   gpio_output_set(0, (1<<5), (1<<5), 0); // output 0
 #endif
-  if (got < need) {
-    os_strcpy(errMessage, "Timeout waiting for flash page to be programmed");
-    return false;
+  if (programmed) optibootData->pgmDone += pgmQueue.len[pgmQueue.head];
+  else optibootData->pgmSkipped += pgmQueue.len[pgmQueue.head];
+  pgmQueue.head = (pgmQueue.head+1) % pgmQueue.slots;
+  pgmQueue.count--;
+  pgmQueue.step = 0;
+  pgmPump();
+
+#ifdef REST
+  if (pgmQueue.count == 0 && pgmQueue.pullDone) {
+    pgmQueue.pullDone = false;
+    optibootPullFinish();
+    return;
+  }
+#endif
+  if (pgmQueue.count == 0 && pgmQueue.waiting != NULL) {
+    HttpdConnData *conn = pgmQueue.waiting;
+    pgmQueue.waiting = NULL;
+    httpdResume(conn);
   }
-  ackWait = 0;
-  if (recv[0] == STK_INSYNC && recv[1] == STK_OK)
-    return true;
-  os_sprintf(errMessage, "Did not get ACK after programming cmd: %x02x %x02x", recv[0], recv[1]);
-  return false;
 }
 
-// Program a flash page
+// Optiboot acked the step of the page in flight
+static void ICACHE_FLASH_ATTR pgmAck(void) {
+  if (pgmQueue.step == 0 || pgmQueue.count == 0) return; // stray ack
+  if (pgmQueue.step == 1 || pgmQueue.step == 4) pgmPump();
+  else pgmNext(true);
+}
+
+// Compare the reply to READ_PAGE with the queued page as it comes in, it holds NULL characters
+// so it can't go through the response buffer. Returns the number of characters used.
+static short ICACHE_FLASH_ATTR pgmReadReply(char *buf, short length) {
+  uint16_t pgmLen = pgmQueue.len[pgmQueue.head];
+  char *page = pgmQueue.buf + pgmQueue.head*optibootData->pgmSz;
+  short i = 0;
+  while (i < length && pgmQueue.readPos < pgmLen+2) {
+    char c = buf[i++];
+    uint16_t pos = pgmQueue.readPos++;
+    if (pos >= 1 && pos <= pgmLen) {
+      if (c != page[pos-1]) pgmQueue.differs = 1;
+    } else if (c != (pos == 0 ? STK_INSYNC : STK_OK)) {
+      os_sprintf(errMessage, "Bad reply reading flash page: %02x at %d", c, pos);
+      pgmFail();
+      return i;
+    }
+  }
+  if (pgmQueue.readPos == pgmLen+2) {
+    if (pgmQueue.differs) pgmPump(); // program it
+    else pgmNext(false);
+  }
+  return i;
+}
+
+// Take the acks out of the response buffer, the ones for sync requests come first
+static void ICACHE_FLASH_ATTR pgmParseAcks(void) {
+  while (responseLen >= 2 && responseBuf[0] == STK_INSYNC && responseBuf[1] == STK_OK) {
+    os_memmove(responseBuf, responseBuf+2, responseLen-2);
+    responseLen -= 2;
+    if (ackWait > 0) ackWait--;
+    else pgmAck();
+  }
+  if (responseLen >= 2 && pgmQueue.step != 0) {
+    os_sprintf(errMessage, "Did not get ACK after programming cmd: %02x %02x",
+        responseBuf[0], responseBuf[1]);
+    pgmFail();
+  }
+}
+
+// Handle characters received while programming
+static void ICACHE_FLASH_ATTR pgmRecv(char *buf, short length) {
+  if (pgmQueue.step == 3) {
+    short used = pgmReadReply(buf, length);
+    buf += used;
+    length -= used;
+  }
+  // append what's left to what we have accumulated
+  char *rb = responseBuf+responseLen;
+  for (short i=0; i<length && (rb-responseBuf)<(RESP_SZ-1); i++)
+    if (buf[i] != 0) *rb++ = buf[i]; // don't copy NULL characters, TODO: fix it
+  responseLen = rb-responseBuf;
+  responseBuf[responseLen] = 0; // string terminator
+  pgmParseAcks();
+}
+
+// Block until there is room in the queue, polling the UART for acks, max 50ms per character
+static bool ICACHE_FLASH_ATTR pgmWait(void) {
+  while (pgmQueue.count == pgmQueue.slots) {
+    char c;
+    if (uart0_rx_poll(&c, 1, 50000) == 0) {
+      os_strcpy(errMessage, "Timeout waiting for flash page to be programmed");
+      pgmFail();
+      return false;
+    }
+    pgmRecv(&c, 1);
+    if (errMessage[0]) return false;
+  }
+  return true;
+}
+
+// Queue a flash page for programming
 bool ICACHE_FLASH_ATTR optibootProgramPage(void) {
   if (optibootData->pageLen == 0) return true;
-  armTimer(PGM_TIMEOUT); // keep the timerCB out of the picture
+  if (errMessage[0]) return false; // a queued page failed
 
   if (ackWait > 7) {
     os_sprintf(errMessage, "Lost sync while programming\n");
@@ -328,51 +639,21 @@ bool ICACHE_FLASH_ATTR optibootProgramPage(void) {
   if (pgmLen > optibootData->pgmSz) pgmLen = optibootData->pgmSz;
   DBG("OB pgm %d@0x%x\n", pgmLen, optibootData->address);
 
-  // send address to optiboot (little endian format)
-#ifdef DBG_GPIO5
-  gpio_output_set((1<<5), 0, (1<<5), 0); // output 1
-#endif
-  ackWait++;
-  uart0_write_char(STK_LOAD_ADDRESS);
-  uint16_t addr = optibootData->address >> 1; // word address
-  uart0_write_char(addr & 0xff);
-  uart0_write_char(addr >> 8);
-  uart0_write_char(CRC_EOP);
-  armTimer(PGM_TIMEOUT);
-  if (!pollAck()) {
-    DBG("OB pgm failed in load address\n");
-    return false;
-  }
-  armTimer(PGM_TIMEOUT);
-
-  // send page length (big-endian format, go figure...)
-#ifdef DBG_GPIO5
-  gpio_output_set((1<<5), 0, (1<<5), 0); // output 1
-#endif
-  ackWait++;
-  uart0_write_char(STK_PROG_PAGE);
-  uart0_write_char(pgmLen>>8);
-  uart0_write_char(pgmLen&0xff);
-  uart0_write_char('F'); // we're writing flash
-
-  // send page content
-  for (short i=0; i<pgmLen; i++)
-    uart0_write_char(optibootData->pageBuf[i]);
-  uart0_write_char(CRC_EOP);
-
-  armTimer(PGM_TIMEOUT);
-  bool ok = pollAck();
-  armTimer(PGM_TIMEOUT);
-  if (!ok) {
-    DBG("OB pgm failed in prog page\n");
+  if (!pgmWait()) {
+    DBG("OB pgm failed waiting for the queue\n");
     return false;
   }
+  uint8_t slot = (pgmQueue.head + pgmQueue.count) % pgmQueue.slots;
+  os_memcpy(pgmQueue.buf + slot*optibootData->pgmSz, optibootData->pageBuf, pgmLen);
+  pgmQueue.len[slot] = pgmLen;
+  pgmQueue.address[slot] = optibootData->address;
+  pgmQueue.count++;
+  if (pgmQueue.count == 1) pgmPump();
 
   // shift data out of buffer
   os_memmove(optibootData->pageBuf, optibootData->pageBuf+pgmLen, optibootData->pageLen-pgmLen);
   optibootData->pageLen -= pgmLen;
   optibootData->address += pgmLen;
-  optibootData->pgmDone += pgmLen;
 
   //DBG("OB pgm OK\n");
   return true;
@@ -385,16 +666,13 @@ static void ICACHE_FLASH_ATTR armTimer(uint32_t ms) {
   os_timer_arm(&optibootTimer, ms, 0);
 }
 
-static int baudRates[] = { 0, 9600, 57600, 115200 };
-
 static void ICACHE_FLASH_ATTR setBaud() {
-  baudRate = baudRates[(baudCnt++) % 4];
+  baudRate = pgmBauds[(baudCnt++) % pgmBaudCount];
   uart0_baud(baudRate);
   //DBG("OB changing to %ld baud\n", baudRate);
 }
 
 static void ICACHE_FLASH_ATTR initBaud() {
-  baudRates[0] = flashConfig.baud_rate;
   setBaud();
 }
 
@@ -408,11 +686,12 @@ static void ICACHE_FLASH_ATTR optibootTimerCB(void *arg) {
         armTimer(BAUD_INTERVAL-INIT_DELAY);
         return;
     case stateSync: // oops, must have not heard back!?
-      if (baudCnt > ATTEMPTS) {
+      if (baudCnt >= ATTEMPTS*pgmBaudCount) {
         // we're doomed, give up
         DBG("OB abandoned after %d attempts\n", baudCnt);
+        short attempts = baudCnt;
         optibootInit();
-        strcpy(errMessage, "sync abandoned after 8 attempts");
+        os_sprintf(errMessage, "sync abandoned after %d attempts", attempts);
         return;
       }
       // time to switch baud rate and issue a reset
@@ -423,6 +702,11 @@ static void ICACHE_FLASH_ATTR optibootTimerCB(void *arg) {
       armTimer(INIT_DELAY);
       return;
     case stateProg: // we're programming and we timed-out of inaction
+      if (pgmQueue.step != 0) { // optiboot didn't ack the page in flight
+        os_strcpy(errMessage, "Timeout waiting for flash page to be programmed");
+        pgmFail();
+        return;
+      }
       uart0_write_char(STK_GET_SYNC);
       uart0_write_char(CRC_EOP);
       ackWait++; // we now expect an ACK
@@ -458,6 +742,12 @@ static short ICACHE_FLASH_ATTR skipInSync(char *buf, short length) {
 // receive response from optiboot, we only store the last response
 static void ICACHE_FLASH_ATTR optibootUartRecv(char *buf, short length) {
   //print_buff("RAW", buf, length);
+  if (progState == stateProg) {
+    armTimer(PGM_INTERVAL); // reset timer
+    pgmRecv(buf, length);
+    return;
+  }
+
   // append what we got to what we have accumulated
   if (responseLen < RESP_SZ-1) {
     char *rb = responseBuf+responseLen;
@@ -538,15 +828,6 @@ static void ICACHE_FLASH_ATTR optibootUartRecv(char *buf, short length) {
       ackWait = 0;
     }
     break;
-  case stateProg: // count down expected sync responses
-    //DBG("UART recv %d\n", length);
-    while (responseLen >= 2 && responseBuf[0] == STK_INSYNC && responseBuf[1] == STK_OK) {
-      if (ackWait > 0) ackWait--;
-      os_memmove(responseBuf, responseBuf+2, responseLen-2);
-      responseLen -= 2;
-    }
-    armTimer(PGM_INTERVAL); // reset timer
-    break;
   default:
     break;
   }
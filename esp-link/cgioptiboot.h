@@ -7,5 +7,6 @@
 
 int ICACHE_FLASH_ATTR cgiOptibootSync(HttpdConnData *connData);
 int ICACHE_FLASH_ATTR cgiOptibootData(HttpdConnData *connData);
+int ICACHE_FLASH_ATTR cgiOptibootPull(HttpdConnData *connData);
 
 #endif
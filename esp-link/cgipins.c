@@ -6,6 +6,7 @@
 #include "serled.h"
 #include "status.h"
 #include "serbridge.h"
+#include "httpdjson.h"
 
 #if 0
 static char *map_names[] = {
@@ -28,16 +29,19 @@ static const int num_map_func = sizeof(map_func)/sizeof(char*);
 int ICACHE_FLASH_ATTR cgiPinsGet(HttpdConnData *connData) {
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted
 
-  char buff[1024];
-  int len;
-
-  len = os_sprintf(buff,
-      "{ \"reset\":%d, \"isp\":%d, \"conn\":%d, \"ser\":%d, \"swap\":%d, \"rxpup\":%d }",
-      flashConfig.reset_pin, flashConfig.isp_pin, flashConfig.conn_led_pin,
-      flashConfig.ser_led_pin, !!flashConfig.swap_uart, !!flashConfig.rx_pullup);
-
+  JsonWriter w;
   jsonHeader(connData, 200);
-  httpdSend(connData, buff, len);
+  jsonBegin(&w, connData, 0);
+  jsonObject(&w, NULL);
+  jsonInt(&w, "reset", flashConfig.reset_pin);
+  jsonInt(&w, "isp", flashConfig.isp_pin);
+  jsonInt(&w, "conn", flashConfig.conn_led_pin);
+  jsonInt(&w, "ser", flashConfig.ser_led_pin);
+  jsonInt(&w, "swap", !!flashConfig.swap_uart);
+  jsonInt(&w, "rxpup", !!flashConfig.rx_pullup);
+  jsonInt(&w, "flow", !!flashConfig.flow_control);
+  jsonClose(&w);
+  jsonEnd(&w);
   return HTTPD_CGI_DONE;
 }
 
@@ -49,13 +53,14 @@ int ICACHE_FLASH_ATTR cgiPinsSet(HttpdConnData *connData) {
 
   int8_t ok = 0;
   int8_t reset, isp, conn, ser;
-  uint8_t swap, rxpup;
+  uint8_t swap, rxpup, flow = flashConfig.flow_control;
   ok |= getInt8Arg(connData, "reset", &reset);
   ok |= getInt8Arg(connData, "isp", &isp);
   ok |= getInt8Arg(connData, "conn", &conn);
   ok |= getInt8Arg(connData, "ser", &ser);
   ok |= getBoolArg(connData, "swap", &swap);
   ok |= getBoolArg(connData, "rxpup", &rxpup);
+  if (getBoolArg(connData, "flow", &flow) < 0) return HTTPD_CGI_DONE;
   if (ok < 0) return HTTPD_CGI_DONE;
 
   char *coll;
@@ -82,6 +87,11 @@ int ICACHE_FLASH_ATTR cgiPinsSet(HttpdConnData *connData) {
       if (pins & (1<<1)) { coll = "Uart TX"; goto collision; }
       if (pins & (1<<3)) { coll = "Uart RX"; goto collision; }
     }
+    if (flow) {
+      // RTS/CTS are on gpio15/13, or on gpio1/3 when the uart is swapped
+      if (pins & (1<<(swap?1:15))) { coll = "Uart RTS"; goto collision; }
+      if (pins & (1<<(swap?3:13))) { coll = "Uart CTS"; goto collision; }
+    }
 
     // we're good, set flashconfig
     flashConfig.reset_pin = reset;
@@ -90,8 +100,9 @@ int ICACHE_FLASH_ATTR cgiPinsSet(HttpdConnData *connData) {
     flashConfig.ser_led_pin = ser;
     flashConfig.swap_uart = swap;
     flashConfig.rx_pullup = rxpup;
-    os_printf("Pins changed: reset=%d isp=%d conn=%d ser=%d swap=%d rx-pup=%d\n",
-	reset, isp, conn, ser, swap, rxpup);
+    flashConfig.flow_control = flow;
+    os_printf("Pins changed: reset=%d isp=%d conn=%d ser=%d swap=%d rx-pup=%d flow=%d\n",
+	reset, isp, conn, ser, swap, rxpup, flow);
 
     // apply the changes
     serbridgeInitPins();
@@ -5,6 +5,13 @@
 #include "config.h"
 #include "sntp.h"
 #include "cgimqtt.h"
+#include "uart.h"
+#include "serbridge.h"
+#include "metrics.h"
+#include "prof.h"
+#include "perf.h"
+#include "httpdjson.h"
+#include "espfs.h"
 #ifdef SYSLOG
 #include "syslog.h"
 #endif
@@ -15,11 +22,11 @@
 #define DBG(format, ...) do { } while(0)
 #endif
 
-char* rst_codes[7] = {
+const char rst_codes[7][12] FLASH_DATA = {
   "normal", "wdt reset", "exception", "soft wdt", "restart", "deep sleep", "external",
 };
 
-char* flash_maps[7] = {
+const char flash_maps[7][16] FLASH_DATA = {
   "512KB:256/256", "256KB", "1MB:512/512", "2MB:512/512", "4MB:512/512",
   "2MB:1024/1024", "4MB:1024/1024"
 };
@@ -56,46 +63,209 @@ int ICACHE_FLASH_ATTR cgiSystemSet(HttpdConnData *connData) {
 
 // Cgi to return various System information
 int ICACHE_FLASH_ATTR cgiSystemInfo(HttpdConnData *connData) {
-  char buff[1024];
+  char buff[64];
 
   if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 
   uint8 part_id = system_upgrade_userbin_check();
   uint32_t fid = spi_flash_get_id();
   struct rst_info *rst_info = system_get_rst_info();
+  UartRxStats rx;
+  uart0_rx_stats(&rx);
 
-  os_sprintf(buff,
-    "{ "
-      "\"name\": \"%s\", "
-      "\"reset cause\": \"%d=%s\", "
-      "\"size\": \"%s\", "
-      "\"upload-size\": \"%d\", "
-      "\"id\": \"0x%02X 0x%04X\", "
-      "\"partition\": \"%s\", "
-      "\"slip\": \"%s\", "
-      "\"mqtt\": \"%s/%s\", "
-      "\"baud\": \"%d\", "
-      "\"description\": \"%s\""
-    " }",
-    flashConfig.hostname,
-    rst_info->reason,
-    rst_codes[rst_info->reason],
-    flash_maps[system_get_flash_size_map()],
-    getUserPageSectionEnd()-getUserPageSectionStart(),
-    fid & 0xff, (fid & 0xff00) | ((fid >> 16) & 0xff),
-    part_id ? "user2.bin" : "user1.bin",
-    flashConfig.slip_enable ? "enabled" : "disabled",
-    flashConfig.mqtt_enable ? "enabled" : "disabled",
-    mqttState(),
-    flashConfig.baud_rate,
-    flashConfig.sys_descr
-    );
+  JsonWriter w;
+  jsonHeader(connData, 200);
+  jsonBegin(&w, connData, 0);
+  jsonObject(&w, NULL);
+  jsonString(&w, "name", flashConfig.hostname);
+  char name[16];
+  os_sprintf(buff, "%d=%s", rst_info->reason,
+      flashStrncpy(name, rst_codes[rst_info->reason], sizeof(name)));
+  jsonString(&w, "reset cause", buff);
+  jsonString(&w, "size", flashStrncpy(name, flash_maps[system_get_flash_size_map()], sizeof(name)));
+  os_sprintf(buff, "%d", getUserPageSectionEnd()-getUserPageSectionStart());
+  jsonString(&w, "upload-size", buff);
+  os_sprintf(buff, "0x%02X 0x%04X", fid & 0xff, (fid & 0xff00) | ((fid >> 16) & 0xff));
+  jsonString(&w, "id", buff);
+  jsonString(&w, "partition", part_id ? "user2.bin" : "user1.bin");
+  jsonString(&w, "slip", flashConfig.slip_enable ? "enabled" : "disabled");
+  os_sprintf(buff, "%s/%s", flashConfig.mqtt_enable ? "enabled" : "disabled", mqttState());
+  jsonString(&w, "mqtt", buff);
+  os_sprintf(buff, "%d", flashConfig.baud_rate);
+  jsonString(&w, "baud", buff);
+  os_sprintf(buff, "%d of %d bytes peak, %d overruns", rx.high_water, rx.ring_size,
+      rx.overruns + rx.fifo_overflows);
+  jsonString(&w, "uart-rx", buff);
+  jsonString(&w, "description", flashConfig.sys_descr);
+  jsonClose(&w);
+  jsonEnd(&w);
+  return HTTPD_CGI_DONE;
+}
 
+// Cgi to return the free heap figures and, when built with HEAP_PROF, the per-module counters
+int ICACHE_FLASH_ATTR cgiSystemHeap(HttpdConnData *connData) {
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+
+  // HEAP_PROF_JSON_MAX fits into the send buffer along with the headers
+  JsonWriter w;
   jsonHeader(connData, 200);
-  httpdSend(connData, buff, -1);
+  jsonBegin(&w, connData, 0);
+  heapProfJson(&w);
+  jsonEnd(&w);
   return HTTPD_CGI_DONE;
 }
 
+// Cgi to return the metrics registry, as JSON or with ?format=text in the Prometheus text
+// format. It's sent in as many parts as it takes.
+int ICACHE_FLASH_ATTR cgiMetrics(HttpdConnData *connData) {
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+  // cgiData: (next metric + 1) * 2, plus 1 for the text format, 0 on the first call,
+  // cgiPrivData the state of the JSON writer there
+  int i = (int)connData->cgiData >> 1;
+  bool text = (int)connData->cgiData & 1;
+  bool first = i == 0;
+
+  if (first) {
+    char fmt[8];
+    text = httpdFindArg(connData->getArgs, "format", fmt, sizeof(fmt)) > 0 &&
+        os_strcmp(fmt, "text") == 0;
+    noCacheHeaders(connData, 200);
+    httpdHeader(connData, "Content-Type", text ? "text/plain; version=0.0.4" : "application/json");
+    httpdEndHeaders(connData);
+    i = 1;
+  }
+
+  if (text) {
+    // the Prometheus text format isn't JSON, it's printed as it is
+    int avail, len = 0;
+    char *buff = httpdSendBuf(connData, &avail);
+    while (i-1 < METRICS_COUNT && len + METRICS_PRINT_MAX <= avail) {
+      len += metricsPrintText(buff+len, i-1);
+      i++;
+    }
+    httpdSendCommit(connData, len);
+    if (i-1 == METRICS_COUNT) return HTTPD_CGI_DONE;
+    connData->cgiData = (void *)(i*2 + 1);
+    return HTTPD_CGI_MORE;
+  }
+
+  JsonWriter w;
+  jsonBegin(&w, connData, first ? 0 : (uint32_t)connData->cgiPrivData);
+  if (first) jsonObject(&w, NULL);
+  uint32_t state = jsonCheckpoint(&w);
+  while (i-1 < METRICS_COUNT) {
+    metricsJson(&w, i-1);
+    if (w.full) break;
+    i++;
+    state = jsonCheckpoint(&w);
+  }
+  if (i-1 == METRICS_COUNT) {
+    jsonClose(&w); // the last group
+    jsonClose(&w);
+  }
+  if (jsonEnd(&w)) return HTTPD_CGI_DONE;
+  connData->cgiData = (void *)(i*2);
+  connData->cgiPrivData = (void *)state;
+  return HTTPD_CGI_MORE;
+}
+
+#ifdef PROFILER
+// Cgi to return the profiler sections and the longest run, ?reset=1 clears them afterwards
+int ICACHE_FLASH_ATTR cgiProf(HttpdConnData *connData) {
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+  JsonWriter w;
+  // cgiData: next section + 1, 0 on the first call, cgiPrivData the state of the writer there
+  int i = (int)connData->cgiData;
+
+  if (i == 0) {
+    jsonHeader(connData, 200);
+    jsonBegin(&w, connData, 0);
+    jsonObject(&w, NULL);
+    jsonInt(&w, "cpu_mhz", system_get_cpu_freq());
+    profLongestJson(&w, "longest");
+    jsonArray(&w, "sections");
+    i = 1;
+  } else {
+    jsonBegin(&w, connData, (uint32_t)connData->cgiPrivData);
+  }
+
+  uint32_t state = jsonCheckpoint(&w);
+  while (i-1 < PROF_NSECTIONS) {
+    profSectionJson(&w, i-1);
+    if (w.full) break;
+    i++;
+    state = jsonCheckpoint(&w);
+  }
+  if (i-1 == PROF_NSECTIONS) {
+    jsonClose(&w);
+    jsonClose(&w);
+  }
+  if (jsonEnd(&w)) {
+    char reset[4];
+    if (httpdFindArg(connData->getArgs, "reset", reset, sizeof(reset)) > 0 && reset[0] == '1')
+      profReset();
+    return HTTPD_CGI_DONE;
+  }
+  connData->cgiData = (void *)i;
+  connData->cgiPrivData = (void *)state;
+  return HTTPD_CGI_MORE;
+}
+#endif
+
+// Cgi to return the httpd counters, with one entry for each URL that got requests. The list
+// can be long, it's sent in as many parts as it takes.
+int ICACHE_FLASH_ATTR cgiHttpStats(HttpdConnData *connData) {
+  if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+  JsonWriter w;
+  // cgiData: next entry + 1, 0 on the first call, cgiPrivData the state of the writer there
+  int i = (int)connData->cgiData;
+  const HttpdRouteStats *st;
+  const char *url;
+
+  if (i == 0) {
+    const HttpdStats *hs = httpdGetStats();
+    jsonHeader(connData, 200);
+    jsonBegin(&w, connData, 0);
+    jsonObject(&w, NULL);
+    jsonUInt(&w, "not_found", hs->notFound);
+    jsonUInt(&w, "refused", hs->refused);
+    jsonUInt(&w, "evicted", hs->evicted);
+    jsonUInt(&w, "busy", hs->busy);
+    jsonArray(&w, "urls");
+    i = 1;
+  } else {
+    jsonBegin(&w, connData, (uint32_t)connData->cgiPrivData);
+  }
+
+  uint32_t state = jsonCheckpoint(&w);
+  while ((st = httpdGetRouteStats(i-1, &url)) != NULL) {
+    if (st->count != 0 || st->notFound != 0) {
+      uint32_t avg = st->count ? (st->timeMs / st->count) * 1000 +
+          ((st->timeMs % st->count) * 1000 + st->timeRemUs) / st->count : 0;
+      jsonObject(&w, NULL);
+      jsonString(&w, "url", url);
+      jsonUInt(&w, "count", st->count);
+      jsonUInt(&w, "not_found", st->notFound);
+      jsonUInt(&w, "bytes", st->bytes);
+      jsonUInt(&w, "time_ms", st->timeMs);
+      jsonUInt(&w, "avg_us", avg);
+      jsonUInt(&w, "max_us", st->maxUs);
+      jsonClose(&w);
+      if (w.full) break;
+    }
+    i++;
+    state = jsonCheckpoint(&w);
+  }
+  if (st == NULL) {
+    jsonClose(&w);
+    jsonClose(&w);
+  }
+  if (jsonEnd(&w)) return HTTPD_CGI_DONE;
+  connData->cgiData = (void *)i;
+  connData->cgiPrivData = (void *)state;
+  return HTTPD_CGI_MORE;
+}
+
 void ICACHE_FLASH_ATTR cgiServicesSNTPInit() {
   if (flashConfig.sntp_server[0] != '\0') {
     sntp_stop();
@@ -107,40 +277,55 @@ void ICACHE_FLASH_ATTR cgiServicesSNTPInit() {
   }
 }
 
-int ICACHE_FLASH_ATTR cgiServicesInfo(HttpdConnData *connData) {
-  char buff[1024];
+// "enabled" or "disabled", as the services page expects flags
+static void ICACHE_FLASH_ATTR jsonEnabled(JsonWriter *w, const char *key, bool on) {
+  jsonString(w, key, on ? "enabled" : "disabled");
+}
 
+int ICACHE_FLASH_ATTR cgiServicesInfo(HttpdConnData *connData) {
   if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 
-  os_sprintf(buff,
-    "{ "
-#ifdef SYSLOG
-      "\"syslog_host\": \"%s\", "
-      "\"syslog_minheap\": %d, "
-      "\"syslog_filter\": %d, "
-      "\"syslog_showtick\": \"%s\", "
-      "\"syslog_showdate\": \"%s\", "
-#endif
-      "\"timezone_offset\": %d, "
-      "\"sntp_server\": \"%s\", "
-      "\"mdns_enable\": \"%s\", "
-      "\"mdns_servername\": \"%s\""
-    " }",
+  JsonWriter w;
+  jsonHeader(connData, 200);
+  jsonBegin(&w, connData, 0);
+  jsonObject(&w, NULL);
 #ifdef SYSLOG
-    flashConfig.syslog_host,
-    flashConfig.syslog_minheap,
-    flashConfig.syslog_filter,
-    flashConfig.syslog_showtick ? "enabled" : "disabled",
-    flashConfig.syslog_showdate ? "enabled" : "disabled",
+  jsonString(&w, "syslog_host", flashConfig.syslog_host);
+  jsonInt(&w, "syslog_minheap", flashConfig.syslog_minheap);
+  jsonInt(&w, "syslog_filter", flashConfig.syslog_filter);
+  jsonEnabled(&w, "syslog_showtick", flashConfig.syslog_showtick);
+  jsonEnabled(&w, "syslog_showdate", flashConfig.syslog_showdate);
+  jsonInt(&w, "syslog_slots", flashConfig.syslog_slots ? flashConfig.syslog_slots : SYSLOG_SLOTS);
+  jsonEnabled(&w, "syslog_overwrite", flashConfig.syslog_overwrite);
+  jsonInt(&w, "syslog_repeat", flashConfig.syslog_repeat ? flashConfig.syslog_repeat : SYSLOG_REPEAT);
+  jsonInt(&w, "syslog_rate", flashConfig.syslog_rate);
+  jsonEnabled(&w, "syslog_tcp", flashConfig.syslog_tcp);
 #endif
-    flashConfig.timezone_offset,
-    flashConfig.sntp_server,
-    flashConfig.mdns_enable ? "enabled" : "disabled",
-    flashConfig.mdns_servername
-    );
-
-  jsonHeader(connData, 200);
-  httpdSend(connData, buff, -1);
+  jsonInt(&w, "timezone_offset", flashConfig.timezone_offset);
+  jsonString(&w, "sntp_server", flashConfig.sntp_server);
+  jsonEnabled(&w, "mdns_enable", flashConfig.mdns_enable);
+  jsonString(&w, "mdns_servername", flashConfig.mdns_servername);
+  jsonInt(&w, "bridge_flush_bytes", flashConfig.bridge_flush_bytes);
+  jsonInt(&w, "bridge_flush_ms", flashConfig.bridge_flush_ms);
+  jsonInt(&w, "bridge_udp_port", flashConfig.bridge_udp_port);
+  if (flashConfig.bridge_udp_peer_ip != 0) jsonIP(&w, "bridge_udp_peer", flashConfig.bridge_udp_peer_ip);
+  else jsonString(&w, "bridge_udp_peer", "");
+  jsonInt(&w, "bridge_udp_peer_port", flashConfig.bridge_udp_peer_port);
+  jsonInt(&w, "perf_profile", flashConfig.perf_profile);
+  jsonInt(&w, "espfs_cache", flashConfig.espfs_cache);
+  jsonInt(&w, "tcp_keepintvl", flashConfig.tcp_keepintvl);
+  jsonInt(&w, "tcp_keepcnt", flashConfig.tcp_keepcnt);
+  for (int i=0; i<TCP_SVC_COUNT; i++) {
+    char key[32];
+    os_sprintf(key, "tcp_%s_nagle", perfTcpSvcNames[i]);
+    jsonEnabled(&w, key, flashConfig.tcp_nagle & (1<<i));
+    os_sprintf(key, "tcp_%s_copy", perfTcpSvcNames[i]);
+    jsonEnabled(&w, key, flashConfig.tcp_copy & (1<<i));
+    os_sprintf(key, "tcp_%s_keepidle", perfTcpSvcNames[i]);
+    jsonInt(&w, key, flashConfig.tcp_keepidle[i]);
+  }
+  jsonClose(&w);
+  jsonEnd(&w);
   return HTTPD_CGI_DONE;
 }
 
@@ -159,6 +344,16 @@ int ICACHE_FLASH_ATTR cgiServicesSet(HttpdConnData *connData) {
   if (syslog < 0) return HTTPD_CGI_DONE;
   syslog |= getBoolArg(connData, "syslog_showdate", &flashConfig.syslog_showdate);
   if (syslog < 0) return HTTPD_CGI_DONE;
+  syslog |= getUInt8Arg(connData, "syslog_slots", &flashConfig.syslog_slots);
+  if (syslog < 0) return HTTPD_CGI_DONE;
+  syslog |= getBoolArg(connData, "syslog_overwrite", &flashConfig.syslog_overwrite);
+  if (syslog < 0) return HTTPD_CGI_DONE;
+  syslog |= getUInt8Arg(connData, "syslog_repeat", &flashConfig.syslog_repeat);
+  if (syslog < 0) return HTTPD_CGI_DONE;
+  syslog |= getUInt8Arg(connData, "syslog_rate", &flashConfig.syslog_rate);
+  if (syslog < 0) return HTTPD_CGI_DONE;
+  syslog |= getBoolArg(connData, "syslog_tcp", &flashConfig.syslog_tcp);
+  if (syslog < 0) return HTTPD_CGI_DONE;
 
 #ifdef SYSLOG
   if (syslog > 0) {
@@ -214,6 +409,62 @@ int ICACHE_FLASH_ATTR cgiServicesSet(HttpdConnData *connData) {
     }
   }
 
+  int8_t bridge = 0;
+  bridge |= getUInt16Arg(connData, "bridge_flush_bytes", &flashConfig.bridge_flush_bytes);
+  if (bridge < 0) return HTTPD_CGI_DONE;
+  bridge |= getUInt16Arg(connData, "bridge_flush_ms", &flashConfig.bridge_flush_ms);
+  if (bridge < 0) return HTTPD_CGI_DONE;
+  if (flashConfig.bridge_flush_bytes > MAX_TXBUFFER) flashConfig.bridge_flush_bytes = MAX_TXBUFFER;
+
+  int8_t udp = 0;
+  udp |= getUInt16Arg(connData, "bridge_udp_port", &flashConfig.bridge_udp_port);
+  if (udp < 0) return HTTPD_CGI_DONE;
+  udp |= getUInt16Arg(connData, "bridge_udp_peer_port", &flashConfig.bridge_udp_peer_port);
+  if (udp < 0) return HTTPD_CGI_DONE;
+  char peer[16];
+  int8_t p = getStringArg(connData, "bridge_udp_peer", peer, sizeof(peer));
+  if (p < 0) return HTTPD_CGI_DONE;
+  if (p > 0) {
+    uint32_t ip = 0;
+    if (peer[0] != 0 && !UTILS_StrToIP(peer, &ip)) {
+      errorResponse(connData, 400, "Invalid UDP peer address");
+      return HTTPD_CGI_DONE;
+    }
+    flashConfig.bridge_udp_peer_ip = ip;
+    udp = 1;
+  }
+  if (udp > 0) serbridgeUdpInit();
+
+  int8_t perf = getUInt8Arg(connData, "perf_profile", &flashConfig.perf_profile);
+  if (perf < 0) return HTTPD_CGI_DONE;
+  if (perf > 0) {
+    if (flashConfig.perf_profile >= PERF_NPROFILES) flashConfig.perf_profile = PERF_BALANCED;
+    perfApply();
+  }
+
+  int8_t cache = getUInt8Arg(connData, "espfs_cache", &flashConfig.espfs_cache);
+  if (cache < 0) return HTTPD_CGI_DONE;
+  if (cache > 0) espFsRamCacheSize(flashConfig.espfs_cache * 1024);
+
+  // per-service TCP options, these apply to new connections
+  for (int i=0; i<TCP_SVC_COUNT; i++) {
+    char name[32];
+    uint8_t on;
+    int8_t r;
+    os_sprintf(name, "tcp_%s_nagle", perfTcpSvcNames[i]);
+    r = getBoolArg(connData, name, &on);
+    if (r < 0) return HTTPD_CGI_DONE;
+    if (r > 0) flashConfig.tcp_nagle = on ? flashConfig.tcp_nagle | (1<<i) : flashConfig.tcp_nagle & ~(1<<i);
+    os_sprintf(name, "tcp_%s_copy", perfTcpSvcNames[i]);
+    r = getBoolArg(connData, name, &on);
+    if (r < 0) return HTTPD_CGI_DONE;
+    if (r > 0) flashConfig.tcp_copy = on ? flashConfig.tcp_copy | (1<<i) : flashConfig.tcp_copy & ~(1<<i);
+    os_sprintf(name, "tcp_%s_keepidle", perfTcpSvcNames[i]);
+    if (getUInt16Arg(connData, name, &flashConfig.tcp_keepidle[i]) < 0) return HTTPD_CGI_DONE;
+  }
+  if (getUInt8Arg(connData, "tcp_keepintvl", &flashConfig.tcp_keepintvl) < 0) return HTTPD_CGI_DONE;
+  if (getUInt8Arg(connData, "tcp_keepcnt", &flashConfig.tcp_keepcnt) < 0) return HTTPD_CGI_DONE;
+
   if (configSave()) {
     httpdStartResponse(connData, 204);
     httpdEndHeaders(connData);
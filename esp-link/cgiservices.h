@@ -5,12 +5,18 @@
 
 int cgiSystemSet(HttpdConnData *connData);
 int cgiSystemInfo(HttpdConnData *connData);
+int cgiHttpStats(HttpdConnData *connData);
+int cgiSystemHeap(HttpdConnData *connData);
+int cgiMetrics(HttpdConnData *connData);
+#ifdef PROFILER
+int cgiProf(HttpdConnData *connData);
+#endif
 
 void cgiServicesSNTPInit();
 int cgiServicesInfo(HttpdConnData *connData);
 int cgiServicesSet(HttpdConnData *connData);
 
-extern char* rst_codes[7];
-extern char* flash_maps[7];
+extern const char rst_codes[7][12]; // in flash, see flashdata.h
+extern const char flash_maps[7][16];
 
 #endif // CGISERVICES_H
@@ -6,19 +6,39 @@
 #include "cgioptiboot.h"
 #include "multipart.h"
 #include "espfsformat.h"
+#include "espfs.h"
 #include "config.h"
 #include "web-server.h"
 
 int header_position = 0;  // flash offset of the file header
 int upload_position = 0;  // flash offset where to store page upload
 int html_header_len = 0;  // length of the HTML header added to the file
+int hash_position = 0;    // flash offset of the content hash of the file
+uint32_t upload_hash;     // content hash of the file so far
+
+// index of the uploaded files, written behind the termination block, more files don't get one
+#define UPLOAD_INDEX_MAX 64
+EspFsIndexEntry *upload_index = NULL; // sorted by name hash
+int upload_index_count = 0;           // number of files, more than UPLOAD_INDEX_MAX: no index
+
+// list of the HTML pages for the menu, written behind the index, see FLAG_PAGES
+char *upload_pages = NULL;
+int upload_pages_full = 0;            // a page didn't fit, the rest are left out
 
 // this is the header to add if user uploads HTML file
+#ifdef BUNDLE_ASSETS
+#define HTML_HEADER_CSS "<link rel=stylesheet href=\"/bundle.css\">"
+#else
+#define HTML_HEADER_CSS "<link rel=stylesheet href=\"/pure.css\"><link rel=stylesheet href=\"/style.css\">"
+#endif
 const char * HTML_HEADER =   "<!doctype html><html><head><title>esp-link</title>"
-                             "<link rel=stylesheet href=\"/pure.css\"><link rel=stylesheet href=\"/style.css\">"
+                             HTML_HEADER_CSS
                              "<meta name=viewport content=\"width=device-width, initial-scale=1\"><script src=\"/ui.js\">"
                              "</script><script src=\"/userpage.js\"></script></head><body><div id=layout>    ";
 
+// unaligned data is written in pieces of this size
+#define WRITE_FLASH_CHUNK 256
+
 // this method is for flash writing and erasing the page
 // write is incremental, so whenever a page border is reached, the next page will be erased
 int ICACHE_FLASH_ATTR webServerSetupWriteFlash( int addr, void * data, int length )
@@ -30,14 +50,11 @@ int ICACHE_FLASH_ATTR webServerSetupWriteFlash( int addr, void * data, int lengt
     return 1;
   }
 
-  void * free_ptr = 0;
-  if(( length & 3 ) != 0 ) // ESP8266 always writes 4 bytes, so the remaining ones should be oxFF-ed out
-  {
-    free_ptr = os_malloc(length + 4);
-    os_memset(free_ptr, 0xFF, length + 4);
-    os_memcpy(free_ptr, data, length);
-    data = free_ptr;
-  }
+  // ESP8266 always writes 4 bytes, so the remaining ones should be oxFF-ed out, the source has to
+  // be aligned as well and the multipart data comes straight from the receive buffer, so such
+  // data goes through a small aligned buffer
+  static uint32_t chunk[WRITE_FLASH_CHUNK/4];
+  bool aligned = ( length & 3 ) == 0 && ( (uint32_t)data & 3 ) == 0;
 
   int ptr = 0;
   while( addr < end_addr )
@@ -51,12 +68,20 @@ int ICACHE_FLASH_ATTR webServerSetupWriteFlash( int addr, void * data, int lengt
     if( end_addr > max )
       len = max - addr;
 
-    spi_flash_write( addr, (uint32_t *)((char *)data + ptr), len );
+    uint32_t *src = (uint32_t *)((char *)data + ptr);
+    if( !aligned )
+    {
+      if( len > WRITE_FLASH_CHUNK )
+        len = WRITE_FLASH_CHUNK;
+      if( len & 3 )
+        chunk[len/4] = 0xFFFFFFFF;
+      os_memcpy(chunk, src, len);
+      src = chunk;
+    }
+    spi_flash_write( addr, src, len );
     ptr += len;
     addr += len;
   }
-  if( free_ptr != 0 )
-    os_free(free_ptr);
   return 0;
 }
 
@@ -77,6 +102,17 @@ void ICACHE_FLASH_ATTR dumpFlash( int end )
   }
 }
 
+// release the index and page list buffers of an upload
+static void ICACHE_FLASH_ATTR webServerSetupFreeUpload()
+{
+  if( upload_index != NULL )
+    os_free(upload_index);
+  upload_index = NULL;
+  if( upload_pages != NULL )
+    os_free(upload_pages);
+  upload_pages = NULL;
+}
+
 // multipart callback for uploading user defined pages
 int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *data, int dataLen, int position)
 {
@@ -85,6 +121,14 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
     case FILE_UPLOAD_START:
       upload_position = getUserPageSectionStart();
       header_position = upload_position;
+      if( upload_index == NULL )
+        upload_index = (EspFsIndexEntry *)os_malloc(UPLOAD_INDEX_MAX * sizeof(EspFsIndexEntry));
+      upload_index_count = 0;
+      if( upload_pages == NULL )
+        upload_pages = (char *)os_malloc(WEB_USER_PAGES_SIZE);
+      if( upload_pages != NULL )
+        upload_pages[0] = 0;
+      upload_pages_full = 0;
       break;
     case FILE_START:
       {
@@ -93,12 +137,13 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
         // write the starting block on esp-fs
         EspFsHeader hdr;
         hdr.magic = 0xFFFFFFFF; // espfs magic is invalid during upload
-        hdr.flags = 0;
+        hdr.flags = FLAG_HASH;
         hdr.compression = 0;
 
         int len = dataLen + 1;
         while(( len & 3 ) != 0 )
           len++;
+        len += 4; // the hash goes at the end of the name, it's left 0xFF until the file is done
 
         hdr.nameLen = len;
         hdr.fileLenComp = hdr.fileLenDecomp = 0xFFFFFFFF;
@@ -110,11 +155,33 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
       
         char nameBuf[len];
         os_memset(nameBuf, 0, len);
+        os_memset(nameBuf + len - 4, 0xFF, 4);
         os_memcpy(nameBuf, data, dataLen);
 
+        // add the file to the index, keeping it sorted
+        if( upload_index != NULL && upload_index_count < UPLOAD_INDEX_MAX )
+        {
+          uint32_t name_hash = espFsNameHash(nameBuf);
+          int i = upload_index_count;
+          while( i > 0 && upload_index[i-1].hash > name_hash )
+          {
+            upload_index[i] = upload_index[i-1];
+            i--;
+          }
+          upload_index[i].hash = name_hash;
+          upload_index[i].offset = header_position - getUserPageSectionStart();
+        }
+        upload_index_count++;
+
+        if( upload_pages != NULL && !upload_pages_full &&
+            WEB_AddUserPage(upload_pages, WEB_USER_PAGES_SIZE, nameBuf) )
+          upload_pages_full = 1;
+
         if( webServerSetupWriteFlash( upload_position, (uint32_t *)(nameBuf), len ) )
           return 1;
         upload_position += len;
+        hash_position = upload_position - 4;
+        upload_hash = ESPFS_HASH_INIT;
       
         // add header to HTML files
         if( ( dataLen > 5 ) && ( os_strcmp(data + dataLen - 5, ".html") == 0 ) ) // if the file ends with .html, wrap into an espfs image
@@ -124,6 +191,8 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
           os_memcpy(buf, HTML_HEADER, html_header_len);
           if( webServerSetupWriteFlash( upload_position, (uint32_t *)(buf), html_header_len ) )
             return 1;
+          for(int i=0; i < html_header_len; i++ )
+            upload_hash = ESPFS_HASH_STEP(upload_hash, buf[i]);
           upload_position += html_header_len;
         }
       }
@@ -132,6 +201,8 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
       if( webServerSetupWriteFlash( upload_position, data, dataLen ) )
         return 1;
       upload_position += dataLen;
+      for(int i=0; i < dataLen; i++ )
+        upload_hash = ESPFS_HASH_STEP(upload_hash, data[i]);
       break;
     case FILE_DONE:
       {
@@ -153,23 +224,48 @@ int ICACHE_FLASH_ATTR webServerSetupMultipartCallback(MultipartCmd cmd, char *da
         // set file size
         spi_flash_write( header_position + ((char *)&hdr.fileLenComp - (char*)&hdr), (uint32_t *)&hdr.fileLenComp, sizeof(uint32_t) );
         spi_flash_write( header_position + ((char *)&hdr.fileLenDecomp - (char*)&hdr), (uint32_t *)&hdr.fileLenDecomp, sizeof(uint32_t) );
+        // set content hash
+        spi_flash_write( hash_position, &upload_hash, sizeof(uint32_t) );
       }
       break;
     case FILE_UPLOAD_DONE:
       {
         // write the termination block
 
+        // followed by the index if all files are in there
+        int index = upload_index != NULL && upload_index_count <= UPLOAD_INDEX_MAX;
+
         EspFsHeader hdr;
         hdr.magic = ESPFS_MAGIC; 
-        hdr.flags = 1;
+        hdr.flags = FLAG_LASTFILE | (index ? FLAG_INDEX : 0) | (upload_pages != NULL ? FLAG_PAGES : 0);
         hdr.compression = 0;
         hdr.nameLen = 0;
-        hdr.fileLenComp = hdr.fileLenDecomp = 0;
+        hdr.fileLenComp = hdr.fileLenDecomp = index ? upload_index_count * sizeof(EspFsIndexEntry) : 0;
 
         if( webServerSetupWriteFlash( upload_position, (uint32_t *)(&hdr), sizeof(EspFsHeader) ) )
           return 1;
         upload_position += sizeof(EspFsHeader);
 
+        if( index )
+        {
+          if( webServerSetupWriteFlash( upload_position, upload_index, hdr.fileLenComp ) )
+            return 1;
+          upload_position += hdr.fileLenComp;
+        }
+
+        // followed by the list of pages
+        if( upload_pages != NULL )
+        {
+          int32_t pages_len = os_strlen(upload_pages);
+          if( webServerSetupWriteFlash( upload_position, &pages_len, sizeof(int32_t) ) )
+            return 1;
+          upload_position += sizeof(int32_t);
+          if( pages_len > 0 && webServerSetupWriteFlash( upload_position, upload_pages, pages_len ) )
+            return 1;
+          upload_position += pages_len;
+        }
+        webServerSetupFreeUpload();
+
         WEB_Init(); // reload the content
       }
       break;
@@ -185,5 +281,8 @@ int ICACHE_FLASH_ATTR cgiWebServerSetupUpload(HttpdConnData *connData)
   if( webServerContext == NULL )
     webServerContext = multipartCreateContext( webServerSetupMultipartCallback );
   
-  return multipartProcess(webServerContext, connData);
+  int ret = multipartProcess(webServerContext, connData);
+  if( ret == HTTPD_CGI_DONE )
+    webServerSetupFreeUpload(); // aborted or failed uploads don't reach FILE_UPLOAD_DONE
+  return ret;
 }
@@ -16,10 +16,13 @@ Cgi/template routines for the /wifi url.
 
 #include <esp8266.h>
 #include "cgiwifi.h"
+#include "perf.h"
+#include "httpdjson.h"
 #include "cgi.h"
 #include "status.h"
 #include "config.h"
 #include "log.h"
+#include "dnscache.h"
 
 #ifdef CGIWIFI_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -63,6 +66,101 @@ static char* ICACHE_FLASH_ATTR wifiGetReason(void) {
   return wifiReasons[1];
 }
 
+// ===== Fast reconnect
+
+// With flashConfig.wifi_fast the BSSID and channel of the AP are kept in RTC memory, which
+// survives resets and reboots but not power cycles. After a reset the device then goes straight
+// for that AP on its channel instead of scanning for the SSID first, if that doesn't work out
+// the cache is dropped and the normal scan takes over.
+#define WIFI_FAST_RTC_ADDR 64         // first RTC memory block available to the application
+#define WIFI_FAST_MAGIC    0x57464331
+#define WIFI_FAST_TIMEOUT  3000       // ms to get associated with the cached AP
+
+typedef struct {
+  uint32_t magic;
+  uint32_t ssid_hash;                 // SSID the cache is for
+  uint8_t  bssid[6];
+  uint8_t  channel;
+  uint8_t  spare;
+  uint32_t check;                     // sum of the words above
+} WifiFastCache;
+
+static WifiFastCache wifiFast;
+static ETSTimer wifiFastTimer;
+static bool wifiFastTrying;           // associating with the cached AP
+static bool wifiFastBssid;            // the current station config is locked to the cached AP
+
+static uint32_t ICACHE_FLASH_ATTR wifiFastCheck(WifiFastCache *c) {
+  uint32_t *w = (uint32_t *)c, sum = 0;
+  for (uint32_t i=0; i<sizeof(WifiFastCache)/4-1; i++) sum += w[i];
+  return sum;
+}
+
+static uint32_t ICACHE_FLASH_ATTR wifiFastHash(const uint8_t *ssid) {
+  uint32_t h = 2166136261u;
+  for (int i=0; i<32 && ssid[i]; i++) h = (h ^ ssid[i]) * 16777619u;
+  return h;
+}
+
+// Load the cache, returns false if there is none for the configured SSID
+static bool ICACHE_FLASH_ATTR wifiFastLoad(void) {
+  if (!system_rtc_mem_read(WIFI_FAST_RTC_ADDR, &wifiFast, sizeof(wifiFast))) return false;
+  return wifiFast.magic == WIFI_FAST_MAGIC && wifiFast.check == wifiFastCheck(&wifiFast) &&
+    wifiFast.ssid_hash == wifiFastHash(stconf.ssid) && wifiFast.channel > 0;
+}
+
+static void ICACHE_FLASH_ATTR wifiFastSave(const uint8_t *ssid, const uint8_t *bssid, uint8_t ch) {
+  uint32_t hash = wifiFastHash(ssid);
+  if (wifiFast.magic == WIFI_FAST_MAGIC && wifiFast.ssid_hash == hash &&
+      wifiFast.channel == ch && os_memcmp(wifiFast.bssid, bssid, 6) == 0) return;
+  os_memset(&wifiFast, 0, sizeof(wifiFast));
+  wifiFast.magic = WIFI_FAST_MAGIC;
+  wifiFast.ssid_hash = hash;
+  os_memcpy(wifiFast.bssid, bssid, 6);
+  wifiFast.channel = ch;
+  wifiFast.check = wifiFastCheck(&wifiFast);
+  system_rtc_mem_write(WIFI_FAST_RTC_ADDR, &wifiFast, sizeof(wifiFast));
+  DBG("Wifi fast connect: cached " MACSTR " ch %d\n", MAC2STR(bssid), ch);
+}
+
+static void ICACHE_FLASH_ATTR wifiFastClear(void) {
+  os_memset(&wifiFast, 0, sizeof(wifiFast));
+  system_rtc_mem_write(WIFI_FAST_RTC_ADDR, &wifiFast, sizeof(wifiFast));
+}
+
+// Go back to the normal station config, so (re)connecting scans for the SSID
+static void ICACHE_FLASH_ATTR wifiFastUnlock(void) {
+  if (!wifiFastBssid) return;
+  wifiFastBssid = false;
+  wifi_station_set_config_current(&stconf);
+}
+
+// Timer callback: the cached AP didn't work out, drop the cache and scan
+static void ICACHE_FLASH_ATTR wifiFastFallback(void *arg) {
+  if (!wifiFastTrying) return;
+  wifiFastTrying = false;
+  DBG("Wifi fast connect failed, scanning\n");
+  wifiFastClear();
+  wifi_station_disconnect();
+  wifiFastUnlock();
+  wifi_station_connect();
+}
+
+// Lock the station config to the cached AP, from user_init the SDK then connects to it
+static void ICACHE_FLASH_ATTR wifiFastStart(void) {
+  struct station_config conf = stconf;
+  conf.bssid_set = 1;
+  os_memcpy(conf.bssid, wifiFast.bssid, 6);
+  wifi_set_channel(wifiFast.channel);
+  wifi_station_set_config_current(&conf);
+  wifiFastBssid = true;
+  wifiFastTrying = true;
+  DBG("Wifi fast connect to " MACSTR " ch %d\n", MAC2STR(wifiFast.bssid), wifiFast.channel);
+  os_timer_disarm(&wifiFastTimer);
+  os_timer_setfn(&wifiFastTimer, wifiFastFallback, NULL);
+  os_timer_arm(&wifiFastTimer, WIFI_FAST_TIMEOUT, 0);
+}
+
 // handler for wifi status change callback coming in from espressif library
 static void ICACHE_FLASH_ATTR wifiHandleEventCb(System_Event_t *evt) {
   switch (evt->event) {
@@ -71,6 +169,11 @@ static void ICACHE_FLASH_ATTR wifiHandleEventCb(System_Event_t *evt) {
     wifiReason = 0;
     DBG("Wifi connected to ssid %s, ch %d\n", evt->event_info.connected.ssid,
       evt->event_info.connected.channel);
+    wifiFastTrying = false;
+    os_timer_disarm(&wifiFastTimer);
+    if (flashConfig.wifi_fast)
+      wifiFastSave(evt->event_info.connected.ssid, evt->event_info.connected.bssid,
+        evt->event_info.connected.channel);
     statusWifiUpdate(wifiState);
     break;
   case EVENT_STAMODE_DISCONNECTED:
@@ -78,6 +181,13 @@ static void ICACHE_FLASH_ATTR wifiHandleEventCb(System_Event_t *evt) {
     wifiReason = evt->event_info.disconnected.reason;
     DBG("Wifi disconnected from ssid %s, reason %s (%d)\n",
       evt->event_info.disconnected.ssid, wifiGetReason(), evt->event_info.disconnected.reason);
+    if (wifiFastTrying) {
+      // fall back from a timer, not from within the event handler
+      os_timer_disarm(&wifiFastTimer);
+      os_timer_arm(&wifiFastTimer, 10, 0);
+    } else {
+      wifiFastUnlock(); // the AP may have gone away, let the SDK look for the SSID again
+    }
     statusWifiUpdate(wifiState);
     break;
   case EVENT_STAMODE_AUTHMODE_CHANGE:
@@ -91,6 +201,7 @@ static void ICACHE_FLASH_ATTR wifiHandleEventCb(System_Event_t *evt) {
       IP2STR(&evt->event_info.got_ip.ip), IP2STR(&evt->event_info.got_ip.mask),
       IP2STR(&evt->event_info.got_ip.gw));
     statusWifiUpdate(wifiState);
+    dnsCacheFlushFailed(); // lookups that failed while we were offline
     if (!mdns_started)
       wifiStartMDNS(evt->event_info.got_ip.ip);
     break;
@@ -152,6 +263,13 @@ void ICACHE_FLASH_ATTR wifiStartMDNS(struct ip_addr ip) {
 
 // ===== wifi scanning
 
+// The scan results are kept in a fixed table sorted by signal strength, with only the strongest
+// AP of each SSID and at most WIFI_SCAN_MAX APs, so a scan doesn't allocate anything. Results
+// that are less than WIFI_SCAN_FRESH ms old are handed out again instead of scanning, which
+// takes a couple of seconds, so the web UI and the MCU can share a scan.
+#define WIFI_SCAN_MAX   20
+#define WIFI_SCAN_FRESH 10000
+
 //WiFi access point data
 typedef struct {
   char ssid[32];
@@ -162,17 +280,44 @@ typedef struct {
 //Scan result
 typedef struct {
   char scanInProgress; //if 1, don't access the underlying stuff from the webpage.
-  ApData **apData;
+  ApData apData[WIFI_SCAN_MAX];
   int noAps;
+  uint32_t scanTime; // system_get_time() of the last scan, 0 if there is none
 } ScanResultData;
 
 //Static scan status storage.
 static ScanResultData cgiWifiAps;
 
+// Age of the scan results in ms
+static uint32_t ICACHE_FLASH_ATTR wifiScanAge(void) {
+  return (system_get_time() - cgiWifiAps.scanTime) / 1000;
+}
+
+// Add an AP to the sorted table, where it replaces a weaker one with the same ssid
+static void ICACHE_FLASH_ATTR wifiScanAdd(struct bss_info *bss) {
+  ApData *aps = cgiWifiAps.apData;
+  int n = cgiWifiAps.noAps, i;
+  for (i=0; i<n; i++) {
+    if (os_strncmp(aps[i].ssid, (char *)bss->ssid, 32) != 0) continue;
+    if (aps[i].rssi >= bss->rssi) return;
+    os_memmove(aps+i, aps+i+1, (n-i-1)*sizeof(ApData)); // drop the weaker one
+    n--;
+    break;
+  }
+  for (i=0; i<n && aps[i].rssi >= bss->rssi; i++) ;
+  if (i == WIFI_SCAN_MAX) return;
+  if (n == WIFI_SCAN_MAX) n--; // the weakest falls off the end
+  os_memmove(aps+i+1, aps+i, (n-i)*sizeof(ApData));
+  os_strncpy(aps[i].ssid, (char *)bss->ssid, 32);
+  aps[i].rssi = bss->rssi;
+  aps[i].enc = bss->authmode;
+  cgiWifiAps.noAps = n+1;
+}
+
 //Callback the code calls when a wlan ap scan is done. Basically stores the result in
 //the cgiWifiAps struct.
 void ICACHE_FLASH_ATTR wifiScanDoneCb(void *arg, STATUS status) {
-  int n;
+  int n = 0;
   struct bss_info *bss_link = (struct bss_info *)arg;
 
   if (status!=OK) {
@@ -181,43 +326,15 @@ void ICACHE_FLASH_ATTR wifiScanDoneCb(void *arg, STATUS status) {
     return;
   }
 
-  //Clear prev ap data if needed.
-  if (cgiWifiAps.apData!=NULL) {
-    for (n=0; n<cgiWifiAps.noAps; n++) os_free(cgiWifiAps.apData[n]);
-    os_free(cgiWifiAps.apData);
-  }
-
-  //Count amount of access points found.
-  n=0;
+  cgiWifiAps.noAps = 0;
   while (bss_link != NULL) {
-    bss_link = bss_link->next.stqe_next;
-    n++;
-  }
-  //Allocate memory for access point data
-  cgiWifiAps.apData=(ApData **)os_malloc(sizeof(ApData *)*n);
-  cgiWifiAps.noAps=n;
-  DBG("Scan done: found %d APs\n", n);
-
-  //Copy access point data to the static struct
-  n=0;
-  bss_link = (struct bss_info *)arg;
-  while (bss_link != NULL) {
-    if (n>=cgiWifiAps.noAps) {
-      //This means the bss_link changed under our nose. Shouldn't happen!
-      //Break because otherwise we will write in unallocated memory.
-      DBG("Huh? I have more than the allocated %d aps!\n", cgiWifiAps.noAps);
-      break;
-    }
-    //Save the ap data.
-    cgiWifiAps.apData[n]=(ApData *)os_malloc(sizeof(ApData));
-    cgiWifiAps.apData[n]->rssi=bss_link->rssi;
-    cgiWifiAps.apData[n]->enc=bss_link->authmode;
-    strncpy(cgiWifiAps.apData[n]->ssid, (char*)bss_link->ssid, 32);
     DBG("bss%d: %s (%d)\n", n+1, (char*)bss_link->ssid, bss_link->rssi);
-
+    if (bss_link->ssid[0] != 0) wifiScanAdd(bss_link); // hidden APs can't be picked anyway
     bss_link = bss_link->next.stqe_next;
     n++;
   }
+  DBG("Scan done: found %d APs, kept %d\n", n, cgiWifiAps.noAps);
+  cgiWifiAps.scanTime = system_get_time() | 1;
   //We're done.
   cgiWifiAps.scanInProgress=0;
 }
@@ -230,52 +347,69 @@ static void ICACHE_FLASH_ATTR scanStartCb(void *arg) {
 
 static int ICACHE_FLASH_ATTR cgiWiFiGetScan(HttpdConnData *connData) {
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-  char buff[1460];
-  const int chunk = 1460/64; // ssid is up to 32 chars
-  int len = 0;
+  JsonWriter w;
 
   DBG("GET scan: cgiData=%d noAps=%d\n", (int)connData->cgiData, cgiWifiAps.noAps);
 
-  // handle continuation call, connData->cgiData-1 is the position in the scan results where we
-  // we need to continue sending from (using -1 'cause 0 means it's the first call)
-  if (connData->cgiData) {
-    int next = (int)connData->cgiData-1;
-    int pos = next;
-    while (pos < cgiWifiAps.noAps && pos < next+chunk) {
-      len += os_sprintf(buff+len, "{\"essid\": \"%s\", \"rssi\": %d, \"enc\": \"%d\"}%c\n",
-        cgiWifiAps.apData[pos]->ssid, cgiWifiAps.apData[pos]->rssi, cgiWifiAps.apData[pos]->enc,
-        (pos+1 == cgiWifiAps.noAps) ? ' ' : ',');
-      pos++;
-    }
-    // done or more?
-    if (pos == cgiWifiAps.noAps) {
-      len += os_sprintf(buff+len, "]}}\n");
-      httpdSend(connData, buff, len);
+  // connData->cgiData-1 is the position in the scan results where we need to continue sending
+  // from (using -1 'cause 0 means it's the first call), cgiPrivData the state of the writer there
+  if (connData->cgiData == NULL) {
+    jsonHeader(connData, 200);
+    jsonBegin(&w, connData, 0);
+    jsonObject(&w, NULL);
+    jsonObject(&w, "result");
+
+    if (cgiWifiAps.scanInProgress==1) {
+      //We're still scanning. Tell Javascript code that.
+      jsonString(&w, "inProgress", "1");
+      jsonClose(&w);
+      jsonClose(&w);
+      jsonEnd(&w);
       return HTTPD_CGI_DONE;
-    } else {
-      connData->cgiData = (void*)(pos+1);
-      httpdSend(connData, buff, len);
-      return HTTPD_CGI_MORE;
     }
-  }
-
-  jsonHeader(connData, 200);
 
-  if (cgiWifiAps.scanInProgress==1) {
-    //We're still scanning. Tell Javascript code that.
-    len = os_sprintf(buff, "{\n \"result\": { \n\"inProgress\": \"1\"\n }\n}\n");
-    httpdSend(connData, buff, len);
-    return HTTPD_CGI_DONE;
+    jsonString(&w, "inProgress", "0");
+    jsonInt(&w, "age", wifiScanAge() / 1000);
+    jsonArray(&w, "APs");
+    connData->cgiData = (void *)1; // start with first result
+  } else {
+    jsonBegin(&w, connData, (uint32_t)connData->cgiPrivData);
   }
 
-  len = os_sprintf(buff, "{\"result\": {\"inProgress\": \"0\", \"APs\": [\n");
-  connData->cgiData = (void *)1; // start with first result next time we're called
-  httpdSend(connData, buff, len);
+  // fill up the output buffer, which shares the segment with the headers on the first call
+  int pos = (int)connData->cgiData-1;
+  uint32_t state = jsonCheckpoint(&w);
+  while (pos < cgiWifiAps.noAps) {
+    ApData *ap = cgiWifiAps.apData + pos;
+    char enc[4];
+    os_sprintf(enc, "%d", ap->enc);
+    jsonObject(&w, NULL);
+    jsonStringN(&w, "essid", ap->ssid, sizeof(ap->ssid));
+    jsonInt(&w, "rssi", ap->rssi);
+    jsonString(&w, "enc", enc);
+    jsonClose(&w);
+    if (w.full) break;
+    pos++;
+    state = jsonCheckpoint(&w);
+  }
+  // done or more?
+  if (pos == cgiWifiAps.noAps) {
+    jsonClose(&w);
+    jsonClose(&w);
+    jsonClose(&w);
+  }
+  if (jsonEnd(&w)) return HTTPD_CGI_DONE;
+  connData->cgiData = (void*)(pos+1);
+  connData->cgiPrivData = (void*)state;
   return HTTPD_CGI_MORE;
 }
 
-// Start scanning, without parameters
+// Start scanning, without parameters, fresh results are used as they are
 void ICACHE_FLASH_ATTR wifiStartScan() {
+  if (cgiWifiAps.scanTime != 0 && wifiScanAge() < WIFI_SCAN_FRESH) {
+    DBG("Using scan results from %dms ago\n", (int)wifiScanAge());
+    return;
+  }
   if (!cgiWifiAps.scanInProgress) {
     cgiWifiAps.scanInProgress = 1;
     os_timer_disarm(&scanTimer);
@@ -496,6 +630,9 @@ int ICACHE_FLASH_ATTR cgiWiFiSpecial(HttpdConnData *connData) {
     httpdSend(connData, "Request is missing fields", -1);
     return HTTPD_CGI_DONE;
   }
+  if (getBoolArg(connData, "fastconn", &flashConfig.wifi_fast) < 0)
+    return HTTPD_CGI_DONE;
+  if (!flashConfig.wifi_fast) wifiFastClear();
 
   char url[64]; // redirect URL
   if (os_strcmp(dhcp, "off") == 0) {
@@ -662,36 +799,28 @@ int ICACHE_FLASH_ATTR cgiApSettingsChange(HttpdConnData *connData) {
 // Get current Soft-AP settings
 int ICACHE_FLASH_ATTR cgiApSettingsInfo(HttpdConnData *connData) {
 
-    char buff[1024];
     if (connData->conn == NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
-    os_sprintf(buff,
-               "{ "
-               "\"ap_ssid\": \"%s\", "
-               "\"ap_password\": \"%s\", "
-               "\"ap_authmode\": %d, "
-               "\"ap_maxconn\": %d, "
-               "\"ap_beacon\": %d, "
-               "\"ap_channel\": %d, "
-               "\"ap_hidden\": \"%s\" "
-               " }",
-               apconf.ssid,
-               apconf.password,
-               apconf.authmode,
-               apconf.max_connection,
-               apconf.beacon_interval,
-               apconf.channel,
-               apconf.ssid_hidden ? "enabled" : "disabled"
-               );
 
+    JsonWriter w;
     jsonHeader(connData, 200);
-    httpdSend(connData, buff, -1);
+    jsonBegin(&w, connData, 0);
+    jsonObject(&w, NULL);
+    jsonStringN(&w, "ap_ssid", (char *)apconf.ssid, sizeof(apconf.ssid));
+    jsonStringN(&w, "ap_password", (char *)apconf.password, sizeof(apconf.password));
+    jsonInt(&w, "ap_authmode", apconf.authmode);
+    jsonInt(&w, "ap_maxconn", apconf.max_connection);
+    jsonInt(&w, "ap_beacon", apconf.beacon_interval);
+    jsonInt(&w, "ap_channel", apconf.channel);
+    jsonString(&w, "ap_hidden", apconf.ssid_hidden ? "enabled" : "disabled");
+    jsonClose(&w);
+    jsonEnd(&w);
     return HTTPD_CGI_DONE;
 }
 
 //This cgi changes the operating mode: STA / AP / STA+AP
 int ICACHE_FLASH_ATTR cgiWiFiSetMode(HttpdConnData *connData) {
   int len;
-  char buff[1024];
+  char buff[16];
   int previous_mode = wifi_get_opmode();
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 
@@ -730,11 +859,11 @@ int ICACHE_FLASH_ATTR cgiWiFiSetMode(HttpdConnData *connData) {
 static char *connStatuses[] = { "idle", "connecting", "wrong password", "AP not found",
                          "failed", "got IP address" };
 
-static char *wifiWarn[] = { 0,
-    "Switch to <a href=\\\"#\\\" onclick=\\\"changeWifiMode(3)\\\">STA+AP mode</a>",
-    "Switch to <a href=\\\"#\\\" onclick=\\\"changeWifiMode(3)\\\">STA+AP mode</a>",
-    "Switch to <a href=\\\"#\\\" onclick=\\\"changeWifiMode(1)\\\">STA mode</a>",
-    "Switch to <a href=\\\"#\\\" onclick=\\\"changeWifiMode(2)\\\">AP mode</a>",
+static char *wifiWarn[] = { "",
+    "Switch to <a href=\"#\" onclick=\"changeWifiMode(3)\">STA+AP mode</a>",
+    "Switch to <a href=\"#\" onclick=\"changeWifiMode(3)\">STA+AP mode</a>",
+    "Switch to <a href=\"#\" onclick=\"changeWifiMode(1)\">STA mode</a>",
+    "Switch to <a href=\"#\" onclick=\"changeWifiMode(2)\">AP mode</a>",
 };
 
 static char *apAuthMode[] = { "OPEN",
@@ -750,9 +879,21 @@ static char *apAuthMode[] = { "OPEN",
 #define MODECHANGE "no"
 #endif
 
-// print various Wifi information into json buffer
-int ICACHE_FLASH_ATTR printWifiInfo(char *buff) {
-  int len;
+// number as a JSON string, the UI expects some of the numbers that way
+static void ICACHE_FLASH_ATTR jsonIntString(JsonWriter *w, const char *key, int val, char *suffix) {
+  char buf[16];
+  os_sprintf(buf, "%d%s", val, suffix);
+  jsonString(w, key, buf);
+}
+
+static void ICACHE_FLASH_ATTR jsonMac(JsonWriter *w, const char *key, uint8_t *mac) {
+  char buf[20];
+  os_sprintf(buf, MACSTR, MAC2STR(mac));
+  jsonString(w, key, buf);
+}
+
+// print various Wifi information as members of the current json object
+void ICACHE_FLASH_ATTR printWifiInfo(JsonWriter *w) {
     //struct station_config stconf;
     wifi_station_get_config(&stconf);
     //struct softap_config apconf;
@@ -777,47 +918,51 @@ int ICACHE_FLASH_ATTR printWifiInfo(char *buff) {
     wifi_get_macaddr(1, apmac_addr);
     uint8_t chan = wifi_get_channel();
 
-    len = os_sprintf(buff,
-        "\"mode\": \"%s\", \"modechange\": \"%s\", \"ssid\": \"%s\", \"status\": \"%s\", "
-        "\"phy\": \"%s\", \"rssi\": \"%ddB\", \"warn\": \"%s\",  \"apwarn\": \"%s\", "
-        "\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\", \"chan\":\"%d\", \"apssid\": \"%s\", "
-        "\"appass\": \"%s\", \"apchan\": \"%d\", \"apmaxc\": \"%d\", \"aphidd\": \"%s\", "
-        "\"apbeac\": \"%d\", \"apauth\": \"%s\",\"apmac\":\"%02x:%02x:%02x:%02x:%02x:%02x\"",
-        mode, MODECHANGE, (char*)stconf.ssid, status, phy, rssi, warn, apwarn,
-        mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5],
-        chan, (char*)apconf.ssid, (char*)apconf.password, apconf.channel, apconf.max_connection,
-        apconf.ssid_hidden?"enabled":"disabled", apconf.beacon_interval,
-        apauth,apmac_addr[0], apmac_addr[1], apmac_addr[2], apmac_addr[3], apmac_addr[4],
-        apmac_addr[5]);
+    jsonString(w, "mode", mode);
+    jsonString(w, "modechange", MODECHANGE);
+    jsonStringN(w, "ssid", (char*)stconf.ssid, sizeof(stconf.ssid));
+    jsonString(w, "status", status);
+    jsonString(w, "phy", phy);
+    jsonIntString(w, "rssi", rssi, "dB");
+    jsonString(w, "warn", warn);
+    jsonString(w, "apwarn", apwarn);
+    jsonMac(w, "mac", mac_addr);
+    jsonIntString(w, "chan", chan, "");
+    jsonStringN(w, "apssid", (char*)apconf.ssid, sizeof(apconf.ssid));
+    jsonStringN(w, "appass", (char*)apconf.password, sizeof(apconf.password));
+    jsonIntString(w, "apchan", apconf.channel, "");
+    jsonIntString(w, "apmaxc", apconf.max_connection, "");
+    jsonString(w, "aphidd", apconf.ssid_hidden?"enabled":"disabled");
+    jsonIntString(w, "apbeac", apconf.beacon_interval, "");
+    jsonString(w, "apauth", apauth);
+    jsonMac(w, "apmac", apmac_addr);
 
     struct ip_info info;
     if (wifi_get_ip_info(0, &info)) {
-        len += os_sprintf(buff+len, ", \"ip\": \"%d.%d.%d.%d\"", IP2STR(&info.ip.addr));
-        len += os_sprintf(buff+len, ", \"netmask\": \"%d.%d.%d.%d\"", IP2STR(&info.netmask.addr));
-        len += os_sprintf(buff+len, ", \"gateway\": \"%d.%d.%d.%d\"", IP2STR(&info.gw.addr));
-        len += os_sprintf(buff+len, ", \"hostname\": \"%s\"", flashConfig.hostname);
+        jsonIP(w, "ip", info.ip.addr);
+        jsonIP(w, "netmask", info.netmask.addr);
+        jsonIP(w, "gateway", info.gw.addr);
+        jsonString(w, "hostname", flashConfig.hostname);
     } else {
-        len += os_sprintf(buff+len, ", \"ip\": \"-none-\"");
+        jsonString(w, "ip", "-none-");
     }
-    len += os_sprintf(buff+len, ", \"staticip\": \"%d.%d.%d.%d\"", IP2STR(&flashConfig.staticip));
-    len += os_sprintf(buff+len, ", \"dhcp\": \"%s\"", flashConfig.staticip > 0 ? "off" : "on");
-
-    return len;
+    jsonIP(w, "staticip", flashConfig.staticip);
+    jsonString(w, "dhcp", flashConfig.staticip > 0 ? "off" : "on");
+    jsonInt(w, "fastconn", flashConfig.wifi_fast);
 }
 
 int ICACHE_FLASH_ATTR cgiWiFiConnStatus(HttpdConnData *connData) {
-  char buff[1024];
-  int len;
+  JsonWriter w;
 
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
   jsonHeader(connData, 200);
 
-  len = os_sprintf(buff, "{");
-  len += printWifiInfo(buff+len);
-  len += os_sprintf(buff+len, ", ");
+  jsonBegin(&w, connData, 0);
+  jsonObject(&w, NULL);
+  printWifiInfo(&w);
 
   if (wifiReason != 0) {
-    len += os_sprintf(buff+len, "\"reason\": \"%s\", ", wifiGetReason());
+    jsonString(&w, "reason", wifiGetReason());
   }
 
 #if 0
@@ -834,24 +979,24 @@ int ICACHE_FLASH_ATTR cgiWiFiConnStatus(HttpdConnData *connData) {
   }
 #endif
 
-  len += os_sprintf(buff+len, "\"x\":0}\n");
-  //DBG("  -> %s\n", buff);
-  httpdSend(connData, buff, len);
+  jsonInt(&w, "x", 0);
+  jsonClose(&w);
+  jsonEnd(&w);
   return HTTPD_CGI_DONE;
 }
 
 // Cgi to return various Wifi information
 int ICACHE_FLASH_ATTR cgiWifiInfo(HttpdConnData *connData) {
-  char buff[1024];
+  JsonWriter w;
 
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
 
-  os_strcpy(buff, "{");
-  printWifiInfo(buff+1);
-  os_strcat(buff, "}");
-
   jsonHeader(connData, 200);
-  httpdSend(connData, buff, -1);
+  jsonBegin(&w, connData, 0);
+  jsonObject(&w, NULL);
+  printWifiInfo(&w);
+  jsonClose(&w);
+  jsonEnd(&w);
   return HTTPD_CGI_DONE;
 }
 
@@ -879,14 +1024,18 @@ void ICACHE_FLASH_ATTR wifiInit() {
     // Check the wifi opmode
     int x = wifi_get_opmode() & 0x3;
 
-    // If STA is enabled switch to STA+AP to allow for recovery, it will then switch to STA-only
-    // once it gets an IP address
-    if (x == 1) wifi_set_opmode(3);
-
     // Call both STATION and SOFTAP default config
     wifi_station_get_config_default(&stconf);
     wifi_softap_get_config_default(&apconf);
 
+    // With a cached AP we connect to it right away, see wifiFastStart
+    bool fast = flashConfig.wifi_fast && (x & 1) && wifiFastLoad();
+
+    // If STA is enabled switch to STA+AP to allow for recovery, it will then switch to STA-only
+    // once it gets an IP address. When connecting fast the AP stays off unless the reset timer
+    // below finds that there's no connection, switching costs a flash write each time.
+    if (x == 1 && !fast) wifi_set_opmode(3);
+
     DBG("Wifi init, mode=%s\n",wifiMode[x]);
 
     // Change STATION parameters, if defined in the Makefile
@@ -963,11 +1112,10 @@ void ICACHE_FLASH_ATTR wifiInit() {
 #endif // if defined(AP_SSID)
 
     configWifiIP();
+    if (fast) wifiFastStart();
 
-    // The default sleep mode should be modem_sleep, but we set it here explicitly for good
-    // measure. We can't use light_sleep because that powers off everthing and we would loose
-    // all connections.
-    wifi_set_sleep_type(MODEM_SLEEP_T);
+    // The sleep mode (and CPU clock) come from the performance profile, modem_sleep by default
+    perfApply();
 
     wifi_set_event_handler_cb(wifiHandleEventCb);
     // check on the wifi in a few seconds to see whether we need to switch mode
@@ -991,9 +1139,9 @@ ICACHE_FLASH_ATTR void wifiGetApName(int i, char *ptr) {
     return;
 
   if (ptr != 0)
-    strncpy(ptr, cgiWifiAps.apData[i]->ssid, 32);
+    strncpy(ptr, cgiWifiAps.apData[i].ssid, 32);
 
-  DBG("AP %s\n", cgiWifiAps.apData[i]->ssid);
+  DBG("AP %s\n", cgiWifiAps.apData[i].ssid);
 }
 
 // Access functions for cgiWifiAps : returns the signal strength of network (i is index into array). Return current network strength for negative i.
@@ -1005,7 +1153,7 @@ ICACHE_FLASH_ATTR int wifiSignalStrength(int i) {
   else if (i >= cgiWifiAps.noAps)
     rssi = 0;				// FIX ME
   else
-    rssi = cgiWifiAps.apData[i]->rssi;	// Signal strength of any known network
+    rssi = cgiWifiAps.apData[i].rssi;	// Signal strength of any known network
 
   return rssi;
 }
@@ -68,7 +68,184 @@ static void memDump(void *addr, int len) {
 }
 #endif
 
-bool ICACHE_FLASH_ATTR configSave(void) {
+// ===== Config journal
+
+// Each sector starts with a full copy of the settings (the FlashFull layout firmware without
+// the journal writes), followed by a journal with the changes made since. configSave appends a
+// record with the bytes that changed to the primary sector, only when that's full the settings
+// get compacted into a new copy in the other sector, which is the only time a sector is erased.
+// The previous sector is left alone until the next compaction so there's always a fall-back.
+// A record is a JrnlHdr followed by JrnlRuns, each with its data padded to a multiple of 4.
+typedef struct {
+  uint16_t size;  // bytes of runs that follow, 0xffff: end of the journal (erased flash)
+  uint16_t crc;   // crc16 of the runs
+} __attribute__((aligned(4))) JrnlHdr; // read and written as a word
+
+typedef struct {
+  uint16_t off;   // offset into FlashConfig
+  uint16_t len;   // bytes of data that follow
+} __attribute__((aligned(4))) JrnlRun;
+
+#define JRNL_START sizeof(FlashFull) // sector offset of the first record
+#define JRNL_FIRST 8                 // first offset that is journaled, skips seq, magic and crc
+#define JRNL_GAP   8                 // differences closer than this go into one run
+#define JRNL_MAX   512               // bigger changes compact straight away
+#define JRNL_CHUNK 64                // bytes read or written at a time
+
+static uint32_t jrnlEnd; // sector offset of the next record in the primary, FLASH_SECT if full
+
+#define PAD4(n) (((n)+3) & ~3)
+
+// Compute the crc16 of len bytes of flash at addr
+static bool ICACHE_FLASH_ATTR jrnlCrc(uint32_t addr, int len, uint16_t *crc) {
+  uint32_t buf[JRNL_CHUNK/4];
+  *crc = 0;
+  while (len > 0) {
+    int n = len < JRNL_CHUNK ? len : JRNL_CHUNK;
+    if (spi_flash_read(addr, buf, n) != SPI_FLASH_RESULT_OK) return false;
+    *crc = crc16_data((unsigned char *)buf, n, *crc);
+    addr += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Apply the runs of a record that has been checked already
+static bool ICACHE_FLASH_ATTR jrnlApply(uint32_t addr, int size, FlashFull *ff) {
+  uint32_t buf[JRNL_CHUNK/4];
+  uint32_t end = addr + size;
+  while (addr < end) {
+    JrnlRun run;
+    if (spi_flash_read(addr, (uint32_t *)&run, sizeof(run)) != SPI_FLASH_RESULT_OK) return false;
+    addr += sizeof(run);
+    if (run.off < JRNL_FIRST || run.off + run.len > sizeof(FlashConfig) ||
+        addr + PAD4(run.len) > end) return false;
+    for (int done=0; done < run.len; ) {
+      int n = run.len - done < JRNL_CHUNK ? PAD4(run.len - done) : JRNL_CHUNK;
+      if (spi_flash_read(addr, buf, n) != SPI_FLASH_RESULT_OK) return false;
+      if (n > run.len - done) n = run.len - done;
+      os_memcpy(ff->block + run.off + done, buf, n);
+      addr += PAD4(n);
+      done += n;
+    }
+  }
+  return true;
+}
+
+// Check that the rest of the sector is erased so records can be appended
+static bool ICACHE_FLASH_ATTR jrnlErased(uint32_t addr, int len) {
+  uint32_t buf[JRNL_CHUNK/4];
+  while (len > 0) {
+    int n = len < JRNL_CHUNK ? len : JRNL_CHUNK;
+    if (spi_flash_read(addr, buf, n) != SPI_FLASH_RESULT_OK) return false;
+    for (int i=0; i<n/4; i++)
+      if (buf[i] != 0xffffffff) return false;
+    addr += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Replay the journal of a sector onto its settings, returns the offset of the next record or
+// FLASH_SECT if no more records can be appended (full, torn record after a crash, ...)
+static uint32_t ICACHE_FLASH_ATTR jrnlReplay(int sect, FlashFull *ff) {
+  uint32_t base = flashAddr() + sect*FLASH_SECT;
+  uint32_t pos = JRNL_START;
+  while (pos + sizeof(JrnlHdr) <= FLASH_SECT) {
+    JrnlHdr hdr;
+    uint16_t crc;
+    if (spi_flash_read(base+pos, (uint32_t *)&hdr, sizeof(hdr)) != SPI_FLASH_RESULT_OK)
+      return FLASH_SECT;
+    if (hdr.size == 0xffff && hdr.crc == 0xffff) break;
+    if (hdr.size == 0 || (hdr.size & 3) || pos + sizeof(hdr) + hdr.size > FLASH_SECT ||
+        !jrnlCrc(base+pos+sizeof(hdr), hdr.size, &crc) || crc != hdr.crc ||
+        !jrnlApply(base+pos+sizeof(hdr), hdr.size, ff)) {
+#ifdef CONFIG_DBG
+      os_printf("Config journal: bad record at %d\n", pos);
+#endif
+      return FLASH_SECT;
+    }
+    pos += sizeof(hdr) + hdr.size;
+  }
+  return jrnlErased(base+pos, FLASH_SECT-pos) ? pos : FLASH_SECT;
+}
+
+// Find the next run of bytes at or after *pos where cur differs from old, returns false if
+// there is none
+static bool ICACHE_FLASH_ATTR jrnlNextRun(const uint8_t *cur, const uint8_t *old, uint16_t *pos,
+    JrnlRun *run) {
+  uint16_t i = *pos, last;
+  while (i < sizeof(FlashConfig) && cur[i] == old[i]) i++;
+  if (i >= sizeof(FlashConfig)) return false;
+  last = i;
+  for (uint16_t j=i+1; j < sizeof(FlashConfig) && j-last <= JRNL_GAP; j++)
+    if (cur[j] != old[j]) last = j;
+  run->off = i;
+  run->len = last - i + 1;
+  *pos = last + 1;
+  return true;
+}
+
+// Buffers the runs of a record on their way to flash
+typedef struct {
+  uint32_t addr;
+  uint16_t crc;
+  uint16_t n;
+  uint32_t buf[JRNL_CHUNK/4];
+} JrnlWriter;
+
+static bool ICACHE_FLASH_ATTR jrnlFlush(JrnlWriter *w) {
+  if (w->n == 0) return true;
+  if (spi_flash_write(w->addr, w->buf, w->n) != SPI_FLASH_RESULT_OK) return false;
+  w->crc = crc16_data((unsigned char *)w->buf, w->n, w->crc);
+  w->addr += w->n;
+  w->n = 0;
+  return true;
+}
+
+static bool ICACHE_FLASH_ATTR jrnlPut(JrnlWriter *w, const void *data, int len) {
+  const uint8_t *d = data;
+  while (len > 0) {
+    int n = JRNL_CHUNK - w->n < len ? JRNL_CHUNK - w->n : len;
+    os_memcpy((uint8_t *)w->buf + w->n, d, n);
+    w->n += n;
+    d += n;
+    len -= n;
+    if (w->n == JRNL_CHUNK && !jrnlFlush(w)) return false;
+  }
+  return true;
+}
+
+// Append a record with the differences between flashConfig and the settings in flash (old),
+// returns false if it has to be compacted instead
+static bool ICACHE_FLASH_ATTR jrnlAppend(FlashFull *old) {
+  const uint8_t *cur = (const uint8_t *)&flashConfig;
+  JrnlRun run;
+  uint16_t pos, size = 0;
+  for (pos = JRNL_FIRST; jrnlNextRun(cur, old->block, &pos, &run); )
+    size += sizeof(run) + PAD4(run.len);
+  if (size == 0) return true; // nothing changed
+  if (size > JRNL_MAX || jrnlEnd + sizeof(JrnlHdr) + size > FLASH_SECT) return false;
+
+  // write the runs, then the header, a crash before that leaves the record to be ignored and
+  // the next configSave compacts
+  uint32_t addr = flashAddr() + flash_pri*FLASH_SECT + jrnlEnd;
+  static const uint8_t zero[4];
+  JrnlWriter w = { .addr = addr + sizeof(JrnlHdr) };
+  jrnlEnd = FLASH_SECT; // until the record is complete
+  for (pos = JRNL_FIRST; jrnlNextRun(cur, old->block, &pos, &run); ) {
+    if (!jrnlPut(&w, &run, sizeof(run)) || !jrnlPut(&w, cur + run.off, run.len) ||
+        !jrnlPut(&w, zero, PAD4(run.len) - run.len)) return false;
+  }
+  if (!jrnlFlush(&w)) return false;
+  JrnlHdr hdr = { .size = size, .crc = w.crc };
+  if (spi_flash_write(addr, (uint32_t *)&hdr, sizeof(hdr)) != SPI_FLASH_RESULT_OK) return false;
+  jrnlEnd = w.addr - (flashAddr() + flash_pri*FLASH_SECT);
+  return true;
+}
+
+// Write all the settings into the secondary sector, which becomes the primary
+static bool ICACHE_FLASH_ATTR configCompact(void) {
   FlashFull ff;
   os_memset(&ff, 0, sizeof(ff));
   os_memcpy(&ff, &flashConfig, sizeof(FlashConfig));
@@ -93,17 +270,13 @@ bool ICACHE_FLASH_ATTR configSave(void) {
   ff.fc.seq = seq;
   if (spi_flash_write(addr, (void *)&ff, sizeof(uint32_t)) != SPI_FLASH_RESULT_OK)
     goto fail; // most likely failed, but no harm if successful
-  // now that we have safely written the new version, erase old primary
-  addr = flashAddr() + flash_pri*FLASH_SECT;
+  // the old primary stays as it is, it's the back-up until the next compaction
   flash_pri = 1-flash_pri;
-  if (spi_flash_erase_sector(addr>>12) != SPI_FLASH_RESULT_OK)
-    return true; // no back-up but we're OK
-  // write secondary
-  ff.fc.seq = 0xffffffff;
-  if (spi_flash_write(addr, (void *)&ff, sizeof(ff)) != SPI_FLASH_RESULT_OK)
-    return true; // no back-up but we're OK
-  ff.fc.seq = seq;
-  spi_flash_write(addr, (void *)&ff, sizeof(uint32_t));
+  flashConfig.seq = seq;
+  jrnlEnd = JRNL_START;
+#ifdef CONFIG_DBG
+  os_printf("Config compacted into sector %d, seq %d\n", flash_pri, seq);
+#endif
   return true;
 fail:
 #ifdef CONFIG_DBG
@@ -112,9 +285,22 @@ fail:
   return false;
 }
 
+bool ICACHE_FLASH_ATTR configSave(void) {
+  // get the settings as they are in flash now to see what changed
+  if (jrnlEnd < FLASH_SECT) {
+    FlashFull ff;
+    uint32_t addr = flashAddr() + flash_pri*FLASH_SECT;
+    if (spi_flash_read(addr, (void *)&ff, sizeof(ff)) == SPI_FLASH_RESULT_OK &&
+        jrnlReplay(flash_pri, &ff) == jrnlEnd && jrnlAppend(&ff))
+      return true;
+  }
+  return configCompact();
+}
+
 void ICACHE_FLASH_ATTR configWipe(void) {
   spi_flash_erase_sector(flashAddr()>>12);
   spi_flash_erase_sector((flashAddr()+FLASH_SECT)>>12);
+  jrnlEnd = FLASH_SECT;
 }
 
 static int ICACHE_FLASH_ATTR selectPrimary(FlashFull *fc0, FlashFull *fc1);
@@ -142,10 +328,14 @@ bool ICACHE_FLASH_ATTR configRestore(void) {
     os_memcpy(&flashConfig.mqtt_clientid, &flashConfig.hostname, os_strlen(flashConfig.hostname));
     os_memcpy(&flashConfig.mqtt_status_topic, &flashConfig.hostname, os_strlen(flashConfig.hostname));
     flash_pri = 0;
+    jrnlEnd = FLASH_SECT; // the first save writes a full copy
     return false;
   }
-  // copy good one into global var
-  os_memcpy(&flashConfig, flash_pri == 0 ? &ff0.fc : &ff1.fc, sizeof(FlashConfig));
+  // apply the changes journaled since and copy into global var, the settings of firmware
+  // without the journal simply have an empty one
+  FlashFull *ff = flash_pri == 0 ? &ff0 : &ff1;
+  jrnlEnd = jrnlReplay(flash_pri, ff);
+  os_memcpy(&flashConfig, &ff->fc, sizeof(FlashConfig));
   // convert old config
   if (flashConfig.mqtt_host[0] == 0 && flashConfig.mqtt_old_host[0] != 0) {
       // the mqtt_host got changed from 32 chars to 64 in a new location
@@ -247,13 +437,40 @@ const uint32_t getUserPageSectionEnd()
     case FLASH_SIZE_8M_MAP_512_512:
       return FLASH_SECT + FIRMWARE_SIZE + 2*FLASH_SECT;
     case FLASH_SIZE_16M_MAP_512_512:
+    case FLASH_SIZE_16M_MAP_1024_1024:
+    case FLASH_SIZE_32M_MAP_512_512:
+    case FLASH_SIZE_32M_MAP_1024_1024:
+      // the MQTT spool, when enabled, takes the top of the user page section
+      return flashConfig.mqtt_spool ? getMqttSpoolStart() : getMqttSpoolEnd();
+    default:
+      return 0xFFFFFFFF;
+  }
+}
+
+// size of the flash region reserved for the MQTT store-and-forward spool
+#define MQTT_SPOOL_SIZE (16*FLASH_SECT)
+
+// the spool only exists with >=2MB flash, where it takes the top of the user page section once
+// enabled, returns 0 otherwise
+const uint32_t getMqttSpoolStart()
+{
+  uint32_t end = getMqttSpoolEnd();
+  return end ? end - MQTT_SPOOL_SIZE : 0;
+}
+
+const uint32_t getMqttSpoolEnd()
+{
+  enum flash_size_map map = system_get_flash_size_map();
+  switch(map)
+  {
+    case FLASH_SIZE_16M_MAP_512_512:
     case FLASH_SIZE_16M_MAP_1024_1024:
       return 0x1FC000;
     case FLASH_SIZE_32M_MAP_512_512:
     case FLASH_SIZE_32M_MAP_1024_1024:
       return 0x3FC000;
     default:
-      return 0xFFFFFFFF;
+      return 0;
   }
 }
 
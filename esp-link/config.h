@@ -43,6 +43,44 @@ typedef struct {
   int8_t   stop_bits;
   char     mqtt_password[70];          // MQTT password, was 32-char mqtt_old_password
   char     mqtt_username[70];          // MQTT username, was 32-char mqtt_old_username
+  uint16_t bridge_flush_bytes,         // UART->TCP: coalesce until this many bytes (0=send asap)
+           bridge_flush_ms;            // UART->TCP: max time data is held back (0=default)
+  uint8_t  flow_control;               // UART0 RTS/CTS hardware flow control
+  uint16_t bridge_udp_port,            // UDP serial bridge local port (0=disabled)
+           bridge_udp_peer_port;       // UDP peer port (0=same as local port)
+  uint32_t bridge_udp_peer_ip;         // UDP peer address (0=reply to last sender)
+  uint8_t  mqtt_bridge_stats;          // publish serial bridge counters with the MQTT status
+  uint16_t mqtt_queue_size;            // bytes for queued outbound MQTT messages (0=default)
+  uint8_t  mqtt_inflight;              // max MQTT messages awaiting an ACK (0=default)
+  uint8_t  mqtt_coalesce;              // combine queued QoS0 MQTT messages into one TCP send
+  uint8_t  mqtt_queue_policy;          // what to drop when the MQTT queue is full (0=newest)
+  uint16_t mqtt_queue_max;             // max queued outbound MQTT messages (0=no limit)
+  uint8_t  mqtt_uart_enable,           // publish UART records and write messages to the UART
+           mqtt_uart_delim;            // UART record delimiter (0=newline)
+  char     mqtt_uart_topic[32],        // topic UART records are published to
+           mqtt_uart_sub_topic[32];    // topic whose messages are written to the UART
+  uint8_t  mqtt_spool;                 // spill MQTT publishes that don't fit the queue to flash
+  uint8_t  mqtt_status_delta,          // publish status fields only when they change
+           mqtt_status_rssi_th;        // RSSI change in dB that gets published (0=default)
+  uint16_t mqtt_status_heartbeat,      // seconds between full delta status messages (0=default)
+           mqtt_status_heap_th;        // free heap change that gets published (0=default)
+  int32_t  optiboot_baud,              // baud rate the AVR was last programmed at (0=unknown)
+           mega_baud;                  // same for STK500v2 bootloaders
+  uint8_t  syslog_slots,               // number of queued syslog messages (0=default)
+           syslog_overwrite;           // drop the oldest syslog message when the queue is full
+  uint8_t  syslog_repeat,              // seconds repeated syslog messages are collapsed (0=default)
+           syslog_rate;                // syslog messages per second per tag (0=no limit)
+  uint8_t  syslog_tcp;                 // send syslog over TCP instead of UDP
+  uint16_t console_size;               // bytes of the web console buffer (0=default)
+  uint8_t  mqtt_metrics;               // publish changed metrics with the MQTT status
+  uint8_t  wifi_fast;                  // reconnect to the last AP without scanning after a reset
+  uint8_t  perf_profile;               // PERF_* latency vs power trade-off (0=balanced)
+  uint8_t  tcp_nagle,                  // TCP_SVC_* bits: leave Nagle on (0=no-delay for all)
+           tcp_copy;                   // TCP_SVC_* bits: send in ESPCONN_COPY mode
+  uint16_t tcp_keepidle[5];            // by TCP_SVC_*: idle secs before keepalive probes (0=off)
+  uint8_t  tcp_keepintvl,              // secs between keepalive probes (0=default)
+           tcp_keepcnt;                // unanswered probes that drop the connection (0=default)
+  uint8_t  espfs_cache;                // KB of RAM for copies of the hot web files (0=off)
 } FlashConfig;
 extern FlashConfig flashConfig;
 
@@ -53,5 +91,7 @@ const size_t getFlashSize();
 
 const uint32_t getUserPageSectionStart();
 const uint32_t getUserPageSectionEnd();
+const uint32_t getMqttSpoolStart();
+const uint32_t getMqttSpoolEnd();
 
 #endif
@@ -0,0 +1,207 @@
+#include <esp8266.h>
+#include "dnscache.h"
+
+#ifdef DNSCACHE_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+typedef struct DnsWaiter {
+  struct DnsWaiter *next;
+  dnsCacheCb       cb;
+  void             *arg;
+  const char       *name;     // copy of the name, only for lookups that didn't get an entry
+  char             buf[];     // holds the copy
+} DnsWaiter;
+
+enum { DNS_FREE = 0, DNS_PENDING, DNS_VALID, DNS_FAILED };
+
+typedef struct {
+  char      *name;      // hostname, NULL if the entry is free
+  ip_addr_t ip;         // address if DNS_VALID
+  uint32_t  expires;    // dnsClock seconds when the entry goes stale
+  uint8_t   state;      // DNS_*
+  bool      deliver;    // waiters are to be called by the delivery timer
+  DnsWaiter *waiters;   // callbacks waiting for the answer
+} DnsEntry;
+
+static DnsEntry dnsCache[DNS_CACHE_SIZE];
+static struct espconn dnsConn;  // the SDK wants an espconn for lookups, it's not used otherwise
+static DnsWaiter *dnsRejected; // lookups that didn't get an entry, they fail
+static ETSTimer dnsTimer;       // calls back waiters of entries that already have an answer
+static ETSTimer dnsClockTimer;  // keeps dnsClock going between lookups
+static uint32_t dnsSecs, dnsLastUs;
+static bool     dnsStarted;
+
+// Seconds since the first lookup, system_get_time wraps after 71 minutes, this doesn't as long
+// as it's called more often than that
+static uint32_t ICACHE_FLASH_ATTR
+dnsClock(void) {
+  uint32_t now = system_get_time();
+  uint32_t secs = (now - dnsLastUs) / 1000000;
+  dnsSecs += secs;
+  dnsLastUs += secs * 1000000;
+  return dnsSecs;
+}
+
+static void ICACHE_FLASH_ATTR
+dnsClockCb(void *arg) {
+  dnsClock();
+}
+
+// Call all waiters of an entry, they may start new lookups, deliver keeps the entry (and the
+// name passed to the callbacks) from being reused meanwhile
+static void ICACHE_FLASH_ATTR
+dnsDeliver(DnsEntry *e) {
+  e->deliver = true;
+  while (e->waiters != NULL) {
+    DnsWaiter *w = e->waiters;
+    e->waiters = w->next;
+    dnsCacheCb cb = w->cb;
+    void *arg = w->arg;
+    os_free(w);
+    cb(e->name, e->state == DNS_VALID ? &e->ip : NULL, arg);
+  }
+  e->deliver = false;
+}
+
+static void ICACHE_FLASH_ATTR
+dnsTimerCb(void *arg) {
+  for (int i=0; i<DNS_CACHE_SIZE; i++)
+    if (dnsCache[i].deliver) dnsDeliver(dnsCache+i);
+  while (dnsRejected != NULL) {
+    DnsWaiter *w = dnsRejected;
+    dnsRejected = w->next;
+    w->cb(w->name, NULL, w->arg);
+    os_free(w);
+  }
+}
+
+// Have the timer call the waiters of an entry, or just the rejected ones with e == NULL
+static void ICACHE_FLASH_ATTR
+dnsSchedule(DnsEntry *e) {
+  if (e != NULL) e->deliver = true;
+  os_timer_disarm(&dnsTimer);
+  os_timer_setfn(&dnsTimer, dnsTimerCb, NULL);
+  os_timer_arm(&dnsTimer, 1, 0);
+}
+
+// Record the answer for an entry, the waiters get called right away or by the timer
+static void ICACHE_FLASH_ATTR
+dnsAnswer(DnsEntry *e, ip_addr_t *ipaddr, bool now) {
+  if (ipaddr != NULL && ipaddr->addr != 0) {
+    e->ip = *ipaddr;
+    e->state = DNS_VALID;
+    e->expires = dnsClock() + DNS_CACHE_TTL;
+    DBG("DNS: %s is " IPSTR "\n", e->name, IP2STR(ipaddr));
+  } else {
+    e->state = DNS_FAILED;
+    e->expires = dnsClock() + DNS_CACHE_NEG_TTL;
+    DBG("DNS: lookup of %s failed\n", e->name);
+  }
+  if (now) dnsDeliver(e);
+  else dnsSchedule(e);
+}
+
+static void ICACHE_FLASH_ATTR
+dnsFound(const char *name, ip_addr_t *ipaddr, void *arg) {
+  for (int i=0; i<DNS_CACHE_SIZE; i++) {
+    DnsEntry *e = dnsCache+i;
+    if (e->state == DNS_PENDING && os_strcmp(e->name, name) == 0) {
+      dnsAnswer(e, ipaddr, true);
+      return;
+    }
+  }
+}
+
+// Find a slot for a new name: a free one, else the one expiring first that nobody waits for
+static DnsEntry * ICACHE_FLASH_ATTR
+dnsAlloc(const char *name) {
+  DnsEntry *e = NULL;
+  for (int i=0; i<DNS_CACHE_SIZE; i++) {
+    DnsEntry *c = dnsCache+i;
+    if (c->state == DNS_FREE) { e = c; break; }
+    if (c->state == DNS_PENDING || c->waiters != NULL || c->deliver) continue;
+    if (e == NULL || (int32_t)(c->expires - e->expires) < 0) e = c;
+  }
+  if (e == NULL) return NULL;
+  if (e->name != NULL) os_free(e->name);
+  os_memset(e, 0, sizeof(DnsEntry));
+  e->name = os_malloc(os_strlen(name)+1);
+  if (e->name == NULL) return NULL;
+  os_strcpy(e->name, name);
+  return e;
+}
+
+void ICACHE_FLASH_ATTR
+dnsCacheLookup(const char *name, dnsCacheCb cb, void *arg) {
+  if (!dnsStarted) {
+    dnsStarted = true;
+    dnsLastUs = system_get_time();
+    os_timer_setfn(&dnsClockTimer, dnsClockCb, NULL);
+    os_timer_arm(&dnsClockTimer, 10*60*1000, 1); // well within the 71 minutes
+  }
+  uint32_t now = dnsClock();
+
+  DnsEntry *e = NULL;
+  for (int i=0; i<DNS_CACHE_SIZE; i++) {
+    if (dnsCache[i].state != DNS_FREE && os_strcmp(dnsCache[i].name, name) == 0) {
+      e = dnsCache+i;
+      break;
+    }
+  }
+  bool fresh = e != NULL && (e->state == DNS_PENDING || (int32_t)(e->expires - now) > 0);
+  if (e == NULL) e = dnsAlloc(name);
+
+  // the caller's name may not outlive this call, a rejected lookup keeps a copy
+  DnsWaiter *w = os_malloc(sizeof(DnsWaiter) + (e == NULL ? os_strlen(name)+1 : 0));
+  if (w == NULL) {
+    DBG("DNS: no memory to look up %s\n", name);
+    cb(name, NULL, arg);
+    return;
+  }
+  w->cb = cb;
+  w->arg = arg;
+  w->name = NULL;
+  w->next = NULL;
+  if (e == NULL) {
+    os_strcpy(w->buf, name);
+    w->name = w->buf;
+    DBG("DNS: too many lookups, %s fails\n", name);
+    w->next = dnsRejected;
+    dnsRejected = w;
+    dnsSchedule(NULL);
+    return;
+  }
+  DnsWaiter **wp = &e->waiters; // callbacks go in order
+  while (*wp != NULL) wp = &(*wp)->next;
+  *wp = w;
+
+  if (fresh) {
+    DBG("DNS: %s %s\n", name, e->state == DNS_PENDING ? "pending" : "cached");
+    if (e->state != DNS_PENDING) dnsSchedule(e);
+    return;
+  }
+
+  // new or stale entry, ask the resolver
+  DBG("DNS: looking up %s\n", name);
+  e->state = DNS_PENDING;
+  ip_addr_t ip;
+  int8_t err = espconn_gethostbyname(&dnsConn, e->name, &ip, dnsFound);
+  if (err == ESPCONN_OK)
+    dnsAnswer(e, &ip, false); // in lwip's table, lwip doesn't call back
+  else if (err != ESPCONN_INPROGRESS)
+    dnsAnswer(e, NULL, false);
+}
+
+void ICACHE_FLASH_ATTR
+dnsCacheFlushFailed(void) {
+  for (int i=0; i<DNS_CACHE_SIZE; i++) {
+    DnsEntry *e = dnsCache+i;
+    if (e->state == DNS_FAILED && e->waiters == NULL && !e->deliver) {
+      os_free(e->name);
+      os_memset(e, 0, sizeof(DnsEntry));
+    }
+  }
+}
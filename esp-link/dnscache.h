@@ -0,0 +1,23 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+// Hostname lookups shared by all clients (MQTT, REST, sockets, syslog). Answers are cached for
+// DNS_CACHE_TTL seconds and failures for DNS_CACHE_NEG_TTL seconds. Concurrent lookups of the
+// same name wait for one query.
+
+#define DNS_CACHE_SIZE     6    // hostnames cached
+#define DNS_CACHE_TTL      300  // seconds an address is reused
+#define DNS_CACHE_NEG_TTL  15   // seconds a failed lookup is remembered
+
+// Same as the espconn_gethostbyname callback: ipaddr is NULL if the lookup failed
+typedef void (*dnsCacheCb)(const char *name, ip_addr_t *ipaddr, void *arg);
+
+// Look up a hostname, cb gets called later, only if there's no memory for the lookup at all
+// it gets called (with NULL) from within dnsCacheLookup. The name is copied, it need not stay
+// valid after the call.
+void dnsCacheLookup(const char *name, dnsCacheCb cb, void *arg);
+
+// Forget failed lookups, e.g. when the network comes back after they failed
+void dnsCacheFlushFailed(void);
+
+#endif
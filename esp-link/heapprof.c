@@ -0,0 +1,214 @@
+#include <esp8266.h>
+#include "heapprof.h"
+#include "httpdjson.h"
+
+static uint32_t heapLowWater; // 0 until the first sample
+
+void ICACHE_FLASH_ATTR
+heapProfSample(void) {
+  uint32_t free = system_get_free_heap_size();
+  if (heapLowWater == 0 || free < heapLowWater) heapLowWater = free;
+}
+
+uint32_t ICACHE_FLASH_ATTR
+heapProfLowWater(void) {
+  heapProfSample();
+  return heapLowWater;
+}
+
+// The SDK allocator, which os_malloc is unless HEAP_PROF redirects it to the wrappers below
+#ifdef HEAP_PROF
+#define heapSdkMalloc(s) pvPortMalloc((s), "", 0)
+#define heapSdkFree(p)   vPortFree((p), "", 0)
+#else
+#define heapSdkMalloc(s) os_malloc(s)
+#define heapSdkFree(p)   os_free(p)
+#endif
+
+// Binary search for the largest allocation that succeeds, to within 8 bytes. This calls the SDK
+// allocator directly so it doesn't disturb the counters.
+uint32_t ICACHE_FLASH_ATTR
+heapProfLargestBlock(void) {
+  uint32_t lo = 0, hi = system_get_free_heap_size();
+  while (hi - lo > 8) {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    void *p = heapSdkMalloc(mid);
+    if (p != NULL) {
+      heapSdkFree(p);
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+static const char * const heapModNames[HEAP_MOD_COUNT] = {
+  "other", "serbridge", "mqtt", "httpd", "syslog", "rest", "socket",
+};
+
+#ifdef HEAP_PROF
+
+// Header in front of each block allocated through the wrappers, 8 bytes to keep the alignment
+typedef struct {
+  uint32_t magic;   // HEAP_MAGIC ^ size, tells our blocks from the ones the SDK allocated
+  uint16_t size;    // size requested
+  uint8_t  mod;     // HEAP_MOD_*
+  uint8_t  spare;
+} HeapHdr;
+
+#define HEAP_MAGIC 0x48ea9c00
+
+static HeapModStats heapMods[HEAP_MOD_COUNT];
+
+// Source directories (or file name prefixes) and the module they're counted under, first match
+static const struct { const char *prefix; uint8_t mod; } heapModDirs[] = {
+  { "serial/",        HEAP_MOD_SERBRIDGE },
+  { "esp-link/cgi",   HEAP_MOD_HTTPD },
+  { "httpd/",         HEAP_MOD_HTTPD },
+  { "web-server/",    HEAP_MOD_HTTPD },
+  { "espfs/",         HEAP_MOD_HTTPD },
+  { "mqtt/",          HEAP_MOD_MQTT },
+  { "esp-link/mqtt",  HEAP_MOD_MQTT },
+  { "syslog/",        HEAP_MOD_SYSLOG },
+  { "rest/",          HEAP_MOD_REST },
+  { "socket/",        HEAP_MOD_SOCKET },
+};
+
+// __FILE__ is the same string for all the allocations of a source file, so remember the last one
+static const char *heapLastFile;
+static uint8_t heapLastMod;
+
+static uint8_t ICACHE_FLASH_ATTR
+heapModule(const char *file) {
+  if (file == heapLastFile) return heapLastMod;
+  uint8_t mod = HEAP_MOD_OTHER;
+  for (int i=0; i<sizeof(heapModDirs)/sizeof(heapModDirs[0]); i++) {
+    if (os_strncmp(file, heapModDirs[i].prefix, os_strlen(heapModDirs[i].prefix)) == 0) {
+      mod = heapModDirs[i].mod;
+      break;
+    }
+  }
+  heapLastFile = file;
+  heapLastMod = mod;
+  return mod;
+}
+
+static void ICACHE_FLASH_ATTR
+heapAdd(HeapHdr *h) {
+  HeapModStats *st = heapMods + h->mod;
+  h->magic = HEAP_MAGIC ^ h->size;
+  st->bytes += h->size;
+  if (st->bytes > st->peak) st->peak = st->bytes;
+  st->blocks++;
+  st->allocs++;
+  heapProfSample();
+}
+
+static void ICACHE_FLASH_ATTR
+heapSub(HeapHdr *h) {
+  HeapModStats *st = heapMods + h->mod;
+  h->magic = 0;
+  st->bytes -= h->size;
+  st->blocks--;
+}
+
+// Return the header of a block allocated by the wrappers, NULL for other blocks
+static HeapHdr * ICACHE_FLASH_ATTR
+heapHdr(void *ptr) {
+  if (ptr == NULL) return NULL;
+  HeapHdr *h = (HeapHdr *)ptr - 1;
+  return h->magic == (HEAP_MAGIC ^ h->size) ? h : NULL;
+}
+
+void * ICACHE_FLASH_ATTR
+heapProfMalloc(size_t size, const char *file, bool zero) {
+  uint8_t mod = heapModule(file);
+  HeapHdr *h = NULL;
+  if (size <= 0xffff - sizeof(HeapHdr))
+    h = zero ? pvPortZalloc(size + sizeof(HeapHdr), "", 0) :
+               pvPortMalloc(size + sizeof(HeapHdr), "", 0);
+  if (h == NULL) {
+    heapMods[mod].fails++;
+    return NULL;
+  }
+  h->size = size;
+  h->mod = mod;
+  heapAdd(h);
+  return h + 1;
+}
+
+void * ICACHE_FLASH_ATTR
+heapProfRealloc(void *ptr, size_t size, const char *file) {
+  if (ptr == NULL) return heapProfMalloc(size, file, false);
+  HeapHdr *h = heapHdr(ptr);
+  if (h == NULL) return pvPortRealloc(ptr, size, "", 0);
+
+  // the block stays with the module that allocated it
+  HeapHdr *n = NULL;
+  if (size <= 0xffff - sizeof(HeapHdr)) {
+    heapSub(h);
+    n = pvPortRealloc(h, size + sizeof(HeapHdr), "", 0);
+    if (n == NULL) {
+      heapAdd(h); // the old block is still there
+      heapMods[h->mod].allocs--;
+    } else {
+      n->size = size;
+      heapAdd(n);
+      return n + 1;
+    }
+  }
+  heapMods[h->mod].fails++;
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR
+heapProfFree(void *ptr) {
+  if (ptr == NULL) return;
+  HeapHdr *h = heapHdr(ptr);
+  if (h == NULL) {
+    vPortFree(ptr, "", 0);
+    return;
+  }
+  heapSub(h);
+  vPortFree(h, "", 0);
+}
+
+bool ICACHE_FLASH_ATTR
+heapProfModStats(int mod, HeapModStats *stats) {
+  if (mod < 0 || mod >= HEAP_MOD_COUNT) return false;
+  *stats = heapMods[mod];
+  return true;
+}
+
+#else
+
+bool ICACHE_FLASH_ATTR
+heapProfModStats(int mod, HeapModStats *stats) {
+  return false;
+}
+
+#endif // HEAP_PROF
+
+void ICACHE_FLASH_ATTR
+heapProfJson(JsonWriter *w) {
+  uint32_t largest = heapProfLargestBlock();
+  jsonObject(w, NULL);
+  jsonUInt(w, "free", system_get_free_heap_size());
+  jsonUInt(w, "low_water", heapProfLowWater());
+  jsonUInt(w, "largest_block", largest);
+
+  HeapModStats st;
+  for (int i=0; i<HEAP_MOD_COUNT && heapProfModStats(i, &st); i++) {
+    if (i == 0) jsonObject(w, "modules");
+    jsonObject(w, heapModNames[i]);
+    jsonUInt(w, "bytes", st.bytes);
+    jsonUInt(w, "peak", st.peak);
+    jsonInt(w, "blocks", st.blocks);
+    jsonUInt(w, "allocs", st.allocs);
+    jsonInt(w, "fails", st.fails);
+    jsonClose(w);
+    if (i == HEAP_MOD_COUNT-1) jsonClose(w);
+  }
+  jsonClose(w);
+}
@@ -21,15 +21,22 @@
 static char log_buf[BUF_MAX];
 static int log_wr, log_rd;
 static int log_pos;
+EventSource logEvents = { log_buf, BUF_MAX, &log_wr, &log_rd, &log_pos };
 static bool log_no_uart; // start out printing to uart
 static bool log_newline; // at start of a new line
 
+// characters from os_printf are collected here and written out a line at a time
+#define LINE_MAX 64
+static char log_line[LINE_MAX];
+static int log_line_len;
+
 // write to the uart designated for logging
-static void uart_write_char(char c) {
+static void ICACHE_FLASH_ATTR
+uart_write_buf(const char *buf, int len) {
   if (flashConfig.log_mode == LOG_MODE_ON1)
-    uart1_write_char(c);
+    uart1_tx_buffer(buf, len);
   else
-    uart0_write_char(c);
+    uart0_tx_buffer((char *)buf, len);
 }
 
 // called from wifi reset timer to turn UART on when we loose wifi and back off
@@ -39,7 +46,8 @@ log_uart(bool enable) {
   if (!enable && !log_no_uart && flashConfig.log_mode < LOG_MODE_ON0) {
     // we're asked to turn uart off, and uart is on, and the flash setting isn't always-on
     DBG("Turning OFF uart log\n");
-    os_delay_us(4*1000L); // time for uart to flush
+    log_flush();
+    uart0_tx_flush(); // let the uart drain
     log_no_uart = !enable;
   } else if (enable && log_no_uart && flashConfig.log_mode != LOG_MODE_OFF) {
     // we're asked to turn uart on, and uart is off, and the flash setting isn't always-off
@@ -48,39 +56,80 @@ log_uart(bool enable) {
   }
 }
 
-// write a character into the log buffer
+// append characters to the log buffer, if it overflows the oldest ones are eaten
 static void ICACHE_FLASH_ATTR
-log_write(char c) {
-  log_buf[log_wr] = c;
-  log_wr = (log_wr+1) % BUF_MAX;
-  if (log_wr == log_rd) {
-    log_rd = (log_rd+1) % BUF_MAX; // full, eat first char
-    log_pos++;
+log_write(const char *buf, int len) {
+  int used = (log_wr+BUF_MAX-log_rd) % BUF_MAX;
+  int now_used = used+len < BUF_MAX-1 ? used+len : BUF_MAX-1;
+  log_pos += used + len - now_used;
+  if (len > BUF_MAX-1) { // only the tail survives anyway
+    buf += len - (BUF_MAX-1);
+    len = BUF_MAX-1;
   }
+  int n = BUF_MAX - log_wr; // room until the end of the buffer
+  if (n > len) n = len;
+  os_memcpy(log_buf+log_wr, buf, n);
+  os_memcpy(log_buf, buf+n, len-n);
+  log_wr = (log_wr+len) % BUF_MAX;
+  log_rd = (log_wr+BUF_MAX-now_used) % BUF_MAX;
 }
 
-// write a character to the log buffer and the uart, and handle newlines specially
+// write to the log buffer and the uart unless it's disabled
 static void ICACHE_FLASH_ATTR
-log_write_char(char c) {
-  // log timestamp
-  if (log_newline) {
-    char buff[16];
-    int l = os_sprintf(buff, "%6d> ", (system_get_time()/1000)%1000000);
-    if (!log_no_uart)
-      for (int i=0; i<l; i++) uart_write_char(buff[i]);
-    if (1) // set to 0 to remove timestamps from log buffer to save some space
-      for (int i=0; i<l; i++) log_write(buff[i]);
-    log_newline = false;
+log_emit(const char *buf, int len) {
+  if (!log_no_uart) uart_write_buf(buf, len);
+  log_write(buf, len);
+}
+
+// format the "%6d> " timestamp without going through sprintf
+static int ICACHE_FLASH_ATTR
+log_timestamp(char *buf) {
+  uint32_t ms = (system_get_time()/1000)%1000000;
+  for (int i=5; i>=0; i--) {
+    buf[i] = (i == 5 || ms != 0) ? '0' + ms%10 : ' ';
+    ms /= 10;
   }
-  if (c == '\n') log_newline = true;
-  // Uart output unless disabled
-  if (!log_no_uart) {
-    if (c == '\n') uart_write_char('\r');
-    uart_write_char(c);
+  buf[6] = '>';
+  buf[7] = ' ';
+  return 8;
+}
+
+// Write characters to the log buffer and the uart, each line gets a timestamp and newlines
+// turn into cr-lf.
+void ICACHE_FLASH_ATTR
+log_write_buf(const char *buf, int len) {
+  while (len > 0) {
+    if (log_newline) {
+      char ts[8];
+      log_emit(ts, log_timestamp(ts));
+      log_newline = false;
+    }
+    int n = 0;
+    while (n < len && buf[n] != '\n') n++;
+    log_emit(buf, n);
+    if (n < len) {
+      log_emit("\r\n", 2);
+      log_newline = true;
+      n++;
+    }
+    buf += n;
+    len -= n;
   }
-  // Store in log buffer
-  if (c == '\n') log_write('\r');
-  log_write(c);
+}
+
+// write out the partial line collected from os_printf
+void ICACHE_FLASH_ATTR
+log_flush(void) {
+  int len = log_line_len;
+  log_line_len = 0;
+  log_write_buf(log_line, len);
+}
+
+// os_printf's putc function, collects characters so they get written out a line at a time
+static void ICACHE_FLASH_ATTR
+log_write_char(char c) {
+  log_line[log_line_len++] = c;
+  if (c == '\n' || log_line_len == LINE_MAX) log_flush();
 }
 
 int ICACHE_FLASH_ATTR
@@ -92,6 +141,8 @@ ajaxLog(HttpdConnData *connData) {
 
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
   jsonHeader(connData, 200);
+  log_flush();
+  log_len = (log_wr+BUF_MAX-log_rd) % BUF_MAX;
 
   // figure out where to start in buffer based on URI param
   len = httpdFindArg(connData->getArgs, "start", buff, sizeof(buff));
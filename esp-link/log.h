@@ -2,14 +2,19 @@
 #define LOG_H
 
 #include "httpd.h"
+#include "cgievents.h"
 
 #define LOG_MODE_AUTO 0  // start by logging to uart0, turn aff after we get an IP
 #define LOG_MODE_OFF  1  // always off
 #define LOG_MODE_ON0  2  // always log to uart0
 #define LOG_MODE_ON1  3  // always log to uart1
 
+extern EventSource logEvents; // stream of the log text for cgiEvents
+
 void logInit(void);
 void log_uart(bool enable);
+void log_write_buf(const char *buf, int len); // write to the log without going through os_printf
+void log_flush(void); // write out a partial line printed with os_printf
 int ajaxLog(HttpdConnData *connData);
 int ajaxLogDbg(HttpdConnData *connData);
 
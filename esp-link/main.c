@@ -32,6 +32,7 @@
 #include "log.h"
 #include "gpio.h"
 #include "cgiservices.h"
+#include "metrics.h"
 
 #ifdef WEBSERVER
 #include "web-server.h"
@@ -70,20 +71,27 @@ should be placed above the URLs they protect.
 HttpdBuiltInUrl builtInUrls[] = {
   { "/", cgiRedirect, "/home.html" },
   { "/menu", cgiMenu, NULL },
-  { "/flash/next", cgiGetFirmwareNext, NULL },
-  { "/flash/upload", cgiUploadFirmware, NULL },
-  { "/flash/reboot", cgiRebootFirmware, NULL },
+  { "/flash/next", cgiGetFirmwareNext, NULL, HTTPD_URL_PRIORITY },
+  { "/flash/upload", cgiUploadFirmware, NULL, HTTPD_URL_PRIORITY },
+  { "/flash/reboot", cgiRebootFirmware, NULL, HTTPD_URL_PRIORITY },
+#ifdef REST
+  { "/flash/pull", cgiPullFirmware, NULL, HTTPD_URL_PRIORITY },
+#endif
 
-  { "/pgm/sync", cgiOptibootSync, NULL },
-  { "/pgm/upload", cgiOptibootData, NULL },
+  { "/pgm/sync", cgiOptibootSync, NULL, HTTPD_URL_PRIORITY },
+  { "/pgm/upload", cgiOptibootData, NULL, HTTPD_URL_PRIORITY },
+#ifdef REST
+  { "/pgm/pull", cgiOptibootPull, NULL, HTTPD_URL_PRIORITY },
+#endif
 
-  { "/pgmmega/sync", cgiMegaSync, NULL },		// Start programming mode
-  { "/pgmmega/upload", cgiMegaData, NULL },		// Upload stuff
-  { "/pgmmega/read/*", cgiMegaRead, NULL },		// Download stuff (to verify)
-  { "/pgmmega/fuse/*", cgiMegaFuse, NULL },		// Read or write fuse
-  { "/pgmmega/rebootmcu", cgiMegaRebootMCU, NULL },	// Get out of programming mode
+  { "/pgmmega/sync", cgiMegaSync, NULL, HTTPD_URL_PRIORITY },		// Start programming mode
+  { "/pgmmega/upload", cgiMegaData, NULL, HTTPD_URL_PRIORITY },		// Upload stuff
+  { "/pgmmega/read/*", cgiMegaRead, NULL, HTTPD_URL_PRIORITY },		// Download stuff (to verify)
+  { "/pgmmega/fuse/*", cgiMegaFuse, NULL, HTTPD_URL_PRIORITY },		// Read or write fuse
+  { "/pgmmega/rebootmcu", cgiMegaRebootMCU, NULL, HTTPD_URL_PRIORITY },	// Get out of programming mode
 
   { "/log/text", ajaxLog, NULL },
+  { "/log/events", cgiEvents, &logEvents },
   { "/log/dbg", ajaxLogDbg, NULL },
   { "/log/reset", cgiReset, NULL },
   { "/console/reset", ajaxConsoleReset, NULL },
@@ -91,7 +99,11 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/console/clear", ajaxConsoleClear, NULL },
   { "/console/fmt", ajaxConsoleFormat, NULL },
   { "/console/text", ajaxConsole, NULL },
+  { "/console/events", cgiEvents, &consoleEvents },
   { "/console/send", ajaxConsoleSend, NULL },
+  { "/console/stats", ajaxConsoleStats, NULL },
+  { "/console/raw", ajaxConsoleRaw, NULL },
+  { "/console/size", ajaxConsoleSize, NULL },
   //Enable the line below to protect the WiFi configuration with an username/password combo.
   //    {"/wifi/*", authBasic, myPassFn},
   { "/wifi", cgiRedirect, "/wifi/wifi.html" },
@@ -105,6 +117,12 @@ HttpdBuiltInUrl builtInUrls[] = {
   { "/wifi/apinfo", cgiApSettingsInfo, NULL },
   { "/wifi/apchange", cgiApSettingsChange, NULL },
   { "/system/info", cgiSystemInfo, NULL },
+  { "/system/httpstats", cgiHttpStats, NULL },
+  { "/system/heap", cgiSystemHeap, NULL },
+  { "/system/metrics", cgiMetrics, NULL },
+#ifdef PROFILER
+  { "/system/prof", cgiProf, NULL },
+#endif
   { "/system/update", cgiSystemSet, NULL },
   { "/services/info", cgiServicesInfo, NULL },
   { "/services/update", cgiServicesSet, NULL },
@@ -123,7 +141,8 @@ HttpdBuiltInUrl builtInUrls[] = {
 #ifdef SHOW_HEAP_USE
 static ETSTimer prHeapTimer;
 static void ICACHE_FLASH_ATTR prHeapTimerCb(void *arg) {
-  os_printf("Heap: %ld\n", (unsigned long)system_get_free_heap_size());
+  os_printf("Heap: %ld, low %ld\n", (unsigned long)system_get_free_heap_size(),
+      (unsigned long)heapProfLowWater());
 }
 #endif
 
@@ -176,16 +195,20 @@ user_init(void) {
   uart_init(CALC_UARTMODE(flashConfig.data_bits, flashConfig.parity, flashConfig.stop_bits),
             flashConfig.baud_rate, 115200);
   logInit(); // must come after init of uart
-  // Say hello (leave some time to cause break in TX after boot loader's msg
+  // Say hello. The boot ROM printed at 74880 baud and its last character may still be going
+  // out, keeping TX idle for 10ms gives the receiver a clean frame boundary at the new baud
+  // rate, otherwise the first line comes out garbled. This is the only fixed delay left.
   os_delay_us(10000L);
   os_printf("\n\n** %s\n", esp_link_version);
   os_printf("Flash config restore %s\n", restoreOk ? "ok" : "*FAILED*");
+  metricsInit();
   // Status LEDs
   statusInit();
   serledInit();
   // Wifi
   wifiInit();
   // init the flash filesystem with the html stuff
+  espFsRamCacheSize(flashConfig.espfs_cache * 1024);
   espFsInit(espLinkCtx, &_binary_espfs_img_start, ESPFS_MEMORY);
 
   //EspFsInitResult res = espFsInit(&_binary_espfs_img_start);
@@ -197,6 +220,7 @@ user_init(void) {
 #endif
 
   // init the wifi-serial transparent bridge (port 23)
+  consoleInit();
   serbridgeInit(23, 2323);
   uart_add_recv_cb(&serbridgeUartCb);
 #ifdef SHOW_HEAP_USE
@@ -206,12 +230,15 @@ user_init(void) {
 #endif
 
   struct rst_info *rst_info = system_get_rst_info();
-  NOTICE("Reset cause: %d=%s", rst_info->reason, rst_codes[rst_info->reason]);
+  char name[16];
+  NOTICE("Reset cause: %d=%s", rst_info->reason,
+      flashStrncpy(name, rst_codes[rst_info->reason], sizeof(name)));
   NOTICE("exccause=%d epc1=0x%x epc2=0x%x epc3=0x%x excvaddr=0x%x depc=0x%x",
     rst_info->exccause, rst_info->epc1, rst_info->epc2, rst_info->epc3,
     rst_info->excvaddr, rst_info->depc);
   uint32_t fid = spi_flash_get_id();
-  NOTICE("Flash map %s, manuf 0x%02X chip 0x%04X", flash_maps[system_get_flash_size_map()],
+  NOTICE("Flash map %s, manuf 0x%02X chip 0x%04X",
+      flashStrncpy(name, flash_maps[system_get_flash_size_map()], sizeof(name)),
       fid & 0xff, (fid&0xff00)|((fid>>16)&0xff));
   NOTICE("** %s: ready, heap=%ld", esp_link_version, (unsigned long)system_get_free_heap_size());
 
@@ -0,0 +1,165 @@
+#include <esp8266.h>
+#include "metrics.h"
+#include "httpdjson.h"
+
+uint32_t metricCounters[M_NCOUNTERS];
+int32_t metricGauges[M_NGAUGES];
+MetricHist metricHists[M_NHISTOGRAMS];
+
+typedef struct {
+  const char *name;
+  const char *help;
+} MetricInfo;
+
+#define METRIC_INFO(id, name, help) { name, help },
+static const MetricInfo metricInfo[METRICS_COUNT] = {
+  METRICS_COUNTERS(METRIC_INFO)
+  METRICS_GAUGES(METRIC_INFO)
+  METRICS_HISTOGRAMS(METRIC_INFO)
+};
+#undef METRIC_INFO
+
+// values at the last metricsCompactJson
+static uint32_t metricPrevCounters[M_NCOUNTERS];
+static int32_t metricPrevGauges[M_NGAUGES];
+static uint32_t metricPrevHists[M_NHISTOGRAMS];
+
+void ICACHE_FLASH_ATTR
+metricObserve(int id, uint32_t value) {
+  MetricHist *h = metricHists + id;
+  int b = 0;
+  for (uint32_t bound = 1; b < METRIC_BUCKETS-1 && value > bound; bound <<= 2) b++;
+  h->bucket[b]++;
+  h->count++;
+  h->sum += value;
+}
+
+// The gauges that aren't set by the modules are updated by a timer, it also keeps track of the
+// wrap-around of the microsecond clock
+static ETSTimer metricsTimer;
+static uint32_t metricsLastUs;
+
+static void ICACHE_FLASH_ATTR
+metricsTimerCb(void *arg) {
+  static uint32_t remUs;
+  uint32_t now = system_get_time();
+  uint32_t us = now - metricsLastUs + remUs;
+  metricsLastUs = now;
+  metricGauges[M_UPTIME] += us / 1000000;
+  remUs = us % 1000000;
+  metricGauges[M_HEAP_FREE] = system_get_free_heap_size();
+}
+
+void ICACHE_FLASH_ATTR
+metricsInit(void) {
+  metricsLastUs = system_get_time();
+  metricGauges[M_UPTIME] = metricsLastUs / 1000000;
+  metricsLastUs -= metricsLastUs % 1000000;
+  os_timer_disarm(&metricsTimer);
+  os_timer_setfn(&metricsTimer, metricsTimerCb, NULL);
+  os_timer_arm(&metricsTimer, 10*1000, 1);
+}
+
+// Bucket upper bound as text
+static char * ICACHE_FLASH_ATTR
+metricBound(char *buf, int b) {
+  if (b == METRIC_BUCKETS-1) os_strcpy(buf, "+Inf");
+  else os_sprintf(buf, "%lu", (unsigned long)1 << (2*b));
+  return buf;
+}
+
+int ICACHE_FLASH_ATTR
+metricsPrintText(char *buf, int i) {
+  const MetricInfo *mi = metricInfo + i;
+  if (i == 0) metricGauges[M_HEAP_FREE] = system_get_free_heap_size();
+  char *p = buf;
+  const char *type = i < M_NCOUNTERS ? "counter" : i < M_NCOUNTERS+M_NGAUGES ? "gauge" : "histogram";
+  p += os_sprintf(p, "# HELP esplink_%s %s\n# TYPE esplink_%s %s\n",
+      mi->name, mi->help, mi->name, type);
+  if (i < M_NCOUNTERS) {
+    p += os_sprintf(p, "esplink_%s %lu\n", mi->name, (unsigned long)metricCounters[i]);
+  } else if (i < M_NCOUNTERS+M_NGAUGES) {
+    p += os_sprintf(p, "esplink_%s %ld\n", mi->name, (long)metricGauges[i-M_NCOUNTERS]);
+  } else {
+    MetricHist *h = metricHists + i - M_NCOUNTERS - M_NGAUGES;
+    uint32_t cum = 0;
+    char bound[12];
+    for (int b=0; b<METRIC_BUCKETS; b++) {
+      cum += h->bucket[b];
+      p += os_sprintf(p, "esplink_%s_bucket{le=\"%s\"} %lu\n", mi->name, metricBound(bound, b),
+          (unsigned long)cum);
+    }
+    p += os_sprintf(p, "esplink_%s_sum %lu\nesplink_%s_count %lu\n",
+        mi->name, (unsigned long)h->sum, mi->name, (unsigned long)h->count);
+  }
+  return p - buf;
+}
+
+void ICACHE_FLASH_ATTR
+metricsJson(JsonWriter *w, int i) {
+  const MetricInfo *mi = metricInfo + i;
+  if (i == 0) {
+    metricGauges[M_HEAP_FREE] = system_get_free_heap_size();
+    jsonObject(w, "counters");
+  } else if (i == M_NCOUNTERS) {
+    jsonClose(w);
+    jsonObject(w, "gauges");
+  } else if (i == M_NCOUNTERS+M_NGAUGES) {
+    jsonClose(w);
+    jsonObject(w, "histograms");
+  }
+
+  if (i < M_NCOUNTERS) {
+    jsonUInt(w, mi->name, metricCounters[i]);
+  } else if (i < M_NCOUNTERS+M_NGAUGES) {
+    jsonInt(w, mi->name, metricGauges[i-M_NCOUNTERS]);
+  } else {
+    MetricHist *h = metricHists + i - M_NCOUNTERS - M_NGAUGES;
+    char bound[12];
+    jsonObject(w, mi->name);
+    jsonUInt(w, "count", h->count);
+    jsonUInt(w, "sum", h->sum);
+    jsonObject(w, "buckets");
+    for (int b=0; b<METRIC_BUCKETS; b++)
+      jsonUInt(w, metricBound(bound, b), h->bucket[b]);
+    jsonClose(w);
+    jsonClose(w);
+  }
+}
+
+int ICACHE_FLASH_ATTR
+metricsCompactJson(char *buf) {
+  metricGauges[M_HEAP_FREE] = system_get_free_heap_size();
+  char *p = buf;
+  char *end = buf + METRICS_COMPACT_MAX - 2;  // room for the closing brace
+  *p++ = '{';
+  for (int i=0; i<METRICS_COUNT; i++) {
+    char item[64];
+    int len;
+    const char *name = metricInfo[i].name;
+    int g = i - M_NCOUNTERS, h = i - M_NCOUNTERS - M_NGAUGES;
+    if (i < M_NCOUNTERS) {
+      if (metricCounters[i] == metricPrevCounters[i]) continue;
+      len = os_sprintf(item, "\"%s\":%lu", name, (unsigned long)metricCounters[i]);
+    } else if (i < M_NCOUNTERS+M_NGAUGES) {
+      if (metricGauges[g] == metricPrevGauges[g]) continue;
+      len = os_sprintf(item, "\"%s\":%ld", name, (long)metricGauges[g]);
+    } else {
+      if (metricHists[h].count == metricPrevHists[h]) continue;
+      len = os_sprintf(item, "\"%s\":[%lu,%lu]", name, (unsigned long)metricHists[h].count,
+          (unsigned long)metricHists[h].sum);
+    }
+    if (p + len + 1 > end) break; // the rest goes out next time
+
+    if (i < M_NCOUNTERS) metricPrevCounters[i] = metricCounters[i];
+    else if (i < M_NCOUNTERS+M_NGAUGES) metricPrevGauges[g] = metricGauges[g];
+    else metricPrevHists[h] = metricHists[h].count;
+    if (p != buf+1) *p++ = ',';
+    os_memcpy(p, item, len);
+    p += len;
+  }
+  if (p == buf+1) return 0;
+  *p++ = '}';
+  *p = 0;
+  return p - buf;
+}
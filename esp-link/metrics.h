@@ -0,0 +1,95 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Metrics registry: all counters, gauges and histograms are listed here, so updating one is a
+// plain array access that's cheap enough for the hot paths. Metrics of modules that aren't
+// built in just stay at zero. To add one append it to the list, the id is what gets passed to
+// the METRIC_* macros and the name is what shows up in /system/metrics and over MQTT.
+
+#define METRICS_COUNTERS(X) \
+  X(M_UART_RX_BYTES,     "uart_rx_bytes",       "Bytes received on the UART") \
+  X(M_UART_TX_BYTES,     "uart_tx_bytes",       "Bytes queued for sending on the UART") \
+  X(M_SERBR_CONNECTS,    "serbridge_connects",  "Connections accepted by the serial bridge") \
+  X(M_SERBR_BYTES_IN,    "serbridge_bytes_in",  "Bytes received by the serial bridge") \
+  X(M_SERBR_BYTES_OUT,   "serbridge_bytes_out", "Bytes sent by the serial bridge") \
+  X(M_SERBR_SEND_ERRORS, "serbridge_send_errors", "Failed serial bridge sends") \
+  X(M_SERBR_DROPS,       "serbridge_drops",     "Bytes dropped by the serial bridge") \
+  X(M_MQTT_CONNECTS,     "mqtt_connects",       "TCP connections made to the MQTT broker") \
+  X(M_MQTT_SENT,         "mqtt_sent",           "MQTT messages sent") \
+  X(M_MQTT_RECEIVED,     "mqtt_received",       "MQTT publishes received") \
+  X(M_MQTT_DROPPED,      "mqtt_dropped",        "MQTT messages dropped because the queue was full") \
+  X(M_HTTP_REQUESTS,     "http_requests",       "HTTP requests handled") \
+  X(M_HTTP_BYTES,        "http_bytes",          "HTTP response bytes sent") \
+  X(M_HTTP_NOT_FOUND,    "http_not_found",      "HTTP requests that got a 404") \
+  X(M_HTTP_REFUSED,      "http_refused",        "HTTP connections refused, all slots busy") \
+  X(M_REST_CONNECTS,     "rest_connects",       "REST client connections made") \
+  X(M_REST_REQUESTS,     "rest_requests",       "REST requests completed or failed") \
+  X(M_REST_ERRORS,       "rest_errors",         "REST requests that failed") \
+  X(M_SOCKET_RX_BYTES,   "socket_rx_bytes",     "Bytes received on sockets") \
+  X(M_SOCKET_TX_BYTES,   "socket_tx_bytes",     "Bytes sent on sockets") \
+  X(M_SOCKET_ERRORS,     "socket_errors",       "Failed socket sends") \
+  X(M_SYSLOG_SENT,       "syslog_sent",         "Syslog messages sent") \
+  X(M_SYSLOG_DROPPED,    "syslog_dropped",      "Syslog messages overwritten or rate limited")
+
+#define METRICS_GAUGES(X) \
+  X(M_UPTIME,            "uptime_seconds",      "Seconds since boot") \
+  X(M_HEAP_FREE,         "heap_free_bytes",     "Free heap") \
+  X(M_SERBR_CLIENTS,     "serbridge_clients",   "Connected serial bridge clients")
+
+#define METRICS_HISTOGRAMS(X) \
+  X(M_UART_RX_BATCH,     "uart_rx_batch_bytes", "Bytes handed out per UART receive task run") \
+  X(M_SERBR_SEGMENT,     "serbridge_segment_bytes", "Size of the segments sent by the serial bridge") \
+  X(M_MQTT_SEND_BYTES,   "mqtt_send_bytes",     "Size of the TCP sends to the MQTT broker") \
+  X(M_HTTP_TIME_MS,      "http_request_ms",     "Time to handle an HTTP request")
+
+#define METRIC_ENUM(id, name, help) id,
+enum { METRICS_COUNTERS(METRIC_ENUM) M_NCOUNTERS };
+enum { METRICS_GAUGES(METRIC_ENUM) M_NGAUGES };
+enum { METRICS_HISTOGRAMS(METRIC_ENUM) M_NHISTOGRAMS };
+#undef METRIC_ENUM
+
+// Histogram buckets have upper bounds 1, 4, 16, ... 4^(METRIC_BUCKETS-2) and +Inf
+#define METRIC_BUCKETS 8
+
+typedef struct {
+  uint32_t count;                   // observations
+  uint32_t sum;                     // sum of the observed values
+  uint32_t bucket[METRIC_BUCKETS];  // observations per bucket, not cumulative
+} MetricHist;
+
+extern uint32_t metricCounters[M_NCOUNTERS];
+extern int32_t metricGauges[M_NGAUGES];
+extern MetricHist metricHists[M_NHISTOGRAMS];
+
+#define METRIC_INC(id)    (metricCounters[id]++)
+#define METRIC_ADD(id, n) (metricCounters[id] += (n))
+#define METRIC_SET(id, v) (metricGauges[id] = (v))
+#define METRIC_GAUGE_ADD(id, n) (metricGauges[id] += (n))
+
+// Start the timer that updates the uptime and free heap gauges
+void metricsInit(void);
+
+// Add an observation to a histogram
+void metricObserve(int id, uint32_t value);
+
+// Number of metrics, for metricsJson and metricsPrintText
+#define METRICS_COUNT (M_NCOUNTERS + M_NGAUGES + M_NHISTOGRAMS)
+
+// Write metric i (counters, then gauges, then histograms) as a member of a JSON object. The
+// metrics are grouped into "counters", "gauges" and "histograms" objects, metric 0 opens the
+// first one and the first metric of the next group closes it, the caller closes the last one.
+struct JsonWriter;
+void metricsJson(struct JsonWriter *w, int i);
+
+// Print metric i in the Prometheus text format into buf. Returns the length, at most
+// METRICS_PRINT_MAX, which covers a histogram with a 32-char name and a 64-char help text.
+#define METRICS_PRINT_MAX 1024
+int metricsPrintText(char *buf, int i);
+
+// Compact JSON of the counters and gauges that changed since the last call, and the count and
+// sum of the histograms that did, e.g. {"uart_rx_bytes":1234,"http_request_ms":[12,345]},
+// returns 0 if nothing changed. Needs METRICS_COMPACT_MAX bytes.
+#define METRICS_COMPACT_MAX 1024
+int metricsCompactJson(char *buf);
+
+#endif
@@ -3,7 +3,7 @@
 #include "cgiwifi.h"
 #include "config.h"
 #include "mqtt.h"
-
+#include "uart.h"
 
 #ifdef MQTTCLIENT_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -12,16 +12,85 @@
 #endif
 
 MQTT_Client mqttClient; // main mqtt client used by esp-link
+static MqttSpool *spool; // flash spool for mqttClient, kept across re-inits
 
 static MqttCallback connected_cb;
 static MqttCallback disconnected_cb;
 static MqttCallback published_cb;
 static MqttDataCallback data_cb;
 
+//===== UART line bridge, publishes each record that arrives on the uart and writes the messages
+// of a subscribed topic to the uart, there's no SLIP and no MCU library involved
+
+#define UART_RECORD_MAX 256
+static char uartRecord[UART_RECORD_MAX]; // record being accumulated
+static uint16_t uartRecordLen;
+
+static bool ICACHE_FLASH_ATTR
+mqttUartEnabled(void) {
+  return flashConfig.mqtt_enable && flashConfig.mqtt_uart_enable;
+}
+
+static char ICACHE_FLASH_ATTR
+mqttUartDelim(void) {
+  return flashConfig.mqtt_uart_delim ? flashConfig.mqtt_uart_delim : '\n';
+}
+
+// Subscribe to the topic whose messages go to the uart, if any
+void ICACHE_FLASH_ATTR
+mqttUartSubscribe(void) {
+  if (!mqttUartEnabled() || flashConfig.mqtt_uart_sub_topic[0] == 0) return;
+  if (mqttClient.connState != MQTT_CONNECTED) return; // happens in mqttConnectedCb
+  MQTT_Subscribe(&mqttClient, flashConfig.mqtt_uart_sub_topic, 0);
+}
+
+// Write a received message to the uart if it's on the subscribed topic, followed by the
+// delimiter unless it already ends with it
+static void ICACHE_FLASH_ATTR
+mqttUartWrite(const char* topic, uint32_t topic_len, const char *data, uint32_t data_len) {
+  if (!mqttUartEnabled() || flashConfig.mqtt_uart_sub_topic[0] == 0) return;
+  // with wildcards in the subscription we take the broker's word that the topic matches
+  char *sub = flashConfig.mqtt_uart_sub_topic;
+  if (os_strchr(sub, '+') == NULL && os_strchr(sub, '#') == NULL &&
+      (os_strlen(sub) != topic_len || os_memcmp(sub, topic, topic_len) != 0)) return;
+  char delim = mqttUartDelim();
+  uart0_tx_buffer((char *)data, data_len);
+  if (data_len == 0 || data[data_len-1] != delim) uart0_tx_buffer(&delim, 1);
+}
+
+// Publish the record accumulated so far, empty ones are dropped
+static void ICACHE_FLASH_ATTR
+mqttUartPublish(void) {
+  if (uartRecordLen == 0) return;
+  MQTT_Publish(&mqttClient, flashConfig.mqtt_uart_topic, uartRecord, uartRecordLen, 0, 0);
+  uartRecordLen = 0;
+}
+
+// Split characters that arrived on the uart into records and publish them, records longer than
+// UART_RECORD_MAX are cut into pieces. All the records of one buffer get queued before the first
+// has gone out, so with coalescing they end up in as few TCP segments as possible. Returns false
+// if the bridge is disabled, in which case the characters are left alone.
+bool ICACHE_FLASH_ATTR
+mqttUartBridge(char *buf, short length) {
+  if (!mqttUartEnabled() || flashConfig.mqtt_uart_topic[0] == 0) return false;
+  char delim = mqttUartDelim();
+  for (short i=0; i<length; i++) {
+    char c = buf[i];
+    if (c == delim) {
+      mqttUartPublish();
+    } else if (c != '\r' || delim != '\n') { // drop the CR of CR-LF line endings
+      uartRecord[uartRecordLen++] = c;
+      if (uartRecordLen == UART_RECORD_MAX) mqttUartPublish();
+    }
+  }
+  return true;
+}
+
 void ICACHE_FLASH_ATTR
 mqttConnectedCb(MQTT_Client* client) {
   DBG("MQTT Client: Connected\n");
   //MQTT_Subscribe(client, "system/time", 0); // handy for testing
+  mqttUartSubscribe();
   if (connected_cb)
     connected_cb(client);
 }
@@ -59,6 +128,7 @@ mqttDataCb(MQTT_Client* client, const char* topic, uint32_t topic_len,
   os_free(dataBuf);
 #endif
 
+  mqttUartWrite(topic, topic_len, data, data_len);
   if (data_cb)
     data_cb(client, topic, topic_len, data, data_len);
 }
@@ -67,7 +137,10 @@ void ICACHE_FLASH_ATTR
 wifiStateChangeCb(uint8_t status)
 {
   if (flashConfig.mqtt_enable) {
-    if (status == wifiGotIP && mqttClient.connState < TCP_CONNECTING) {
+    if (status == wifiGotIP && mqttClient.connState == TCP_RECONNECT_REQ) {
+      MQTT_ReconnectNow(&mqttClient); // don't sit out the back-off from while we were offline
+    }
+    else if (status == wifiGotIP && mqttClient.connState == MQTT_DISCONNECTED) {
       MQTT_Connect(&mqttClient);
     }
     else if (status == wifiIsDisconnected && mqttClient.connState == TCP_CONNECTING) {
@@ -81,7 +154,23 @@ mqtt_client_init()
 {
   MQTT_Init(&mqttClient, flashConfig.mqtt_host, flashConfig.mqtt_port, 0, flashConfig.mqtt_timeout,
     flashConfig.mqtt_clientid, flashConfig.mqtt_username, flashConfig.mqtt_password,
-    flashConfig.mqtt_keepalive);
+    flashConfig.mqtt_keepalive, flashConfig.mqtt_queue_size, flashConfig.mqtt_inflight,
+    flashConfig.mqtt_coalesce);
+  MQTT_SetQueueLimit(&mqttClient, flashConfig.mqtt_queue_max, flashConfig.mqtt_queue_policy);
+
+  // the spool recovers what's left in flash from before a reset when it's set up
+  if (flashConfig.mqtt_spool && spool == NULL) {
+    spool = os_zalloc(sizeof(MqttSpool));
+    if (spool != NULL && !MqttSpool_Init(spool, getMqttSpoolStart(), getMqttSpoolEnd())) {
+      os_printf("MQTT: no flash for the spool\n");
+      os_free(spool);
+      spool = NULL;
+    }
+  } else if (!flashConfig.mqtt_spool && spool != NULL) {
+    os_free(spool); // MQTT_Free has flushed it, what's in flash comes back if re-enabled
+    spool = NULL;
+  }
+  MQTT_SetSpool(&mqttClient, spool);
 
   MQTT_OnConnected(&mqttClient, mqttConnectedCb);
   MQTT_OnDisconnected(&mqttClient, mqttDisconnectedCb);
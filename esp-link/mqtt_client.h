@@ -11,5 +11,10 @@ void mqtt_client_on_disconnected(MqttCallback disconnectedCb);
 void mqtt_client_on_published(MqttCallback publishedCb);
 void mqtt_client_on_data(MqttDataCallback dataCb);
 
+// UART line bridge, returns false if it's not enabled
+bool mqttUartBridge(char *buf, short length);
+// Subscribe to the topic that goes to the uart, called when the settings change
+void mqttUartSubscribe(void);
+
 #endif //MQTT_CLIENT_H
 #endif // MQTT
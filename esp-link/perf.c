@@ -0,0 +1,51 @@
+#include <esp8266.h>
+#include "config.h"
+#include "perf.h"
+
+#ifdef PERF_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+const char * const perfProfileNames[PERF_NPROFILES] = { "balanced", "latency", "powersave" };
+const char * const perfTcpSvcNames[TCP_SVC_COUNT] = { "bridge", "httpd", "mqtt", "rest", "socket" };
+
+// max TX power in 0.25dBm steps
+#define PERF_TPW_MAX  82 // 20.5dBm, the SDK's default
+#define PERF_TPW_SAVE 60 // 15dBm
+
+// keepalive defaults
+#define PERF_KEEPINTVL 5 // seconds between probes
+#define PERF_KEEPCNT   3 // unanswered probes before the connection is dropped
+
+static uint8_t ICACHE_FLASH_ATTR perfProfile(void) {
+  return flashConfig.perf_profile < PERF_NPROFILES ? flashConfig.perf_profile : PERF_BALANCED;
+}
+
+void ICACHE_FLASH_ATTR perfApply(void) {
+  uint8_t p = perfProfile();
+  // Light sleep is not an option: it powers off everything and we would loose connections.
+  wifi_set_sleep_type(p == PERF_LOW_LATENCY ? NONE_SLEEP_T : MODEM_SLEEP_T);
+  system_update_cpu_freq(p == PERF_LOW_LATENCY ? SYS_CPU_160MHZ : SYS_CPU_80MHZ);
+  system_phy_set_max_tpw(p == PERF_POWER_SAVER ? PERF_TPW_SAVE : PERF_TPW_MAX);
+  DBG("Perf profile %s: %dMHz\n", perfProfileNames[p], system_get_cpu_freq());
+}
+
+void ICACHE_FLASH_ATTR perfTcpSetup(struct espconn *conn, int svc) {
+  uint8_t bit = 1 << svc;
+  uint8_t opts = ESPCONN_REUSEADDR;
+  if (!(flashConfig.tcp_nagle & bit) && perfProfile() != PERF_POWER_SAVER) opts |= ESPCONN_NODELAY;
+  if (flashConfig.tcp_copy & bit) opts |= ESPCONN_COPY;
+  uint32_t idle = flashConfig.tcp_keepidle[svc];
+  if (idle) opts |= ESPCONN_KEEPALIVE;
+  espconn_set_opt(conn, opts);
+  if (idle) {
+    uint32_t intvl = flashConfig.tcp_keepintvl ? flashConfig.tcp_keepintvl : PERF_KEEPINTVL;
+    uint32_t cnt = flashConfig.tcp_keepcnt ? flashConfig.tcp_keepcnt : PERF_KEEPCNT;
+    espconn_set_keepalive(conn, ESPCONN_KEEPIDLE, &idle);
+    espconn_set_keepalive(conn, ESPCONN_KEEPINTVL, &intvl);
+    espconn_set_keepalive(conn, ESPCONN_KEEPCNT, &cnt);
+  }
+  DBG("TCP %s: opts 0x%x idle %d\n", perfTcpSvcNames[svc], opts, idle);
+}
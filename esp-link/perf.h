@@ -0,0 +1,27 @@
+#ifndef PERF_H
+#define PERF_H
+
+// Operating profiles, selected by flashConfig.perf_profile, that trade latency for power
+enum {
+  PERF_BALANCED,    // modem sleep, 80MHz, TCP no-delay: the long-standing default
+  PERF_LOW_LATENCY, // no modem sleep, 160MHz, TCP no-delay
+  PERF_POWER_SAVER, // modem sleep, 80MHz, reduced TX power, Nagle on (fewer, fuller packets)
+  PERF_NPROFILES
+};
+
+// Services whose TCP connections get their options from the config, the flashConfig.tcp_* bit
+// masks and arrays are indexed by these
+enum { TCP_SVC_BRIDGE, TCP_SVC_HTTPD, TCP_SVC_MQTT, TCP_SVC_REST, TCP_SVC_SOCKET, TCP_SVC_COUNT };
+
+// Apply the configured profile to the radio and CPU, at boot and whenever it changes
+void perfApply(void);
+
+// Set the options of a service's TCP connection, call this once it's connected (or accepted):
+// no-delay unless the service has Nagle enabled or the power saver profile is on, copy mode
+// and keepalive as configured for the service
+void perfTcpSetup(struct espconn *conn, int svc);
+
+extern const char * const perfProfileNames[PERF_NPROFILES];
+extern const char * const perfTcpSvcNames[TCP_SVC_COUNT];
+
+#endif
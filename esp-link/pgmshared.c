@@ -18,6 +18,43 @@ char responseBuf[RESP_SZ]; // buffer to accumulate responses from optiboot
 short responseLen = 0;     // amount accumulated so far
 char errMessage[ERR_MAX];  // error message
 
+int32_t pgmBauds[PGM_BAUD_MAX];
+uint8_t pgmBaudCount;
+
+static void ICACHE_FLASH_ATTR pgmBaudAdd(int32_t baud) {
+  if (baud <= 0 || pgmBaudCount >= PGM_BAUD_MAX) return;
+  for (int i=0; i<pgmBaudCount; i++)
+    if (pgmBauds[i] == baud) return;
+  pgmBauds[pgmBaudCount++] = baud;
+}
+
+// set up the list of baud rates to try
+void ICACHE_FLASH_ATTR pgmBaudInit(HttpdConnData *connData, int32_t last, const int32_t *rates, int n) {
+  pgmBaudCount = 0;
+  pgmBaudAdd(last);
+  pgmBaudAdd(flashConfig.baud_rate);
+
+  char buf[80];
+  if (httpdFindArg(connData->getArgs, "baud", buf, sizeof(buf)) > 0) {
+    char *p = buf;
+    while (*p) {
+      int32_t baud = 0;
+      while (*p >= '0' && *p <= '9') baud = baud*10 + *p++ - '0';
+      pgmBaudAdd(baud);
+      if (*p) p++; // skip the separator
+    }
+  } else {
+    for (int i=0; i<n; i++) pgmBaudAdd(rates[i]);
+  }
+}
+
+// remember the baud rate programming worked at so it's tried first the next time
+void ICACHE_FLASH_ATTR pgmBaudRemember(int32_t *last, int32_t baud) {
+  if (*last == baud) return;
+  *last = baud;
+  configSave();
+}
+
 // verify that N chars are hex characters
 bool ICACHE_FLASH_ATTR checkHex(char *buf, short len) {
   while (len--) {
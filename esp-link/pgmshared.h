@@ -26,6 +26,8 @@ extern struct optibootData {
   uint32_t startTime;        // time of program POST request
   HttpdConnData *conn;       // request doing the programming, so we can cancel it
   bool eof;                  // got EOF record
+  bool diff;                 // only program pages that differ from what the MCU has
+  uint32_t pgmSkipped;       // number of bytes not programmed because they were the same
 
   // Whether to use the Mega (STK500v2) protocol
   bool	mega;
@@ -43,6 +45,16 @@ bool ICACHE_FLASH_ATTR checkHex(char *buf, short len);
 uint32_t ICACHE_FLASH_ATTR getHexValue(char *buf, short len);
 bool ICACHE_FLASH_ATTR processRecord(char *buf, short len);
 bool megaProgramPage(void);
+
+// Baud rates to try when syncing with a bootloader: the one the last successful programming
+// used, the configured one, then the ones passed as ?baud=r1,r2,... to the sync request or
+// else the defaults of the programmer. The ?baud= list only applies to the request it comes
+// with, pgmBaudRemember saves the rate a successful upload used in the flash config
+#define PGM_BAUD_MAX 10
+extern int32_t pgmBauds[PGM_BAUD_MAX];
+extern uint8_t pgmBaudCount;
+void pgmBaudInit(HttpdConnData *connData, int32_t last, const int32_t *rates, int n);
+void pgmBaudRemember(int32_t *last, int32_t baud);
 bool optibootProgramPage(void);
 
 #ifdef OPTIBOOT_DBG
@@ -0,0 +1,74 @@
+#include <esp8266.h>
+#include "prof.h"
+#include "httpdjson.h"
+
+#ifdef PROFILER
+
+#define PROF_NAME(id, name) name,
+static const char * const profNames[PROF_NSECTIONS] = { PROF_SECTIONS(PROF_NAME) };
+#undef PROF_NAME
+
+static ProfSection profSections[PROF_NSECTIONS];
+static uint32_t profLongestCycles;
+static uint32_t profLongestAt;    // system_get_time() when the longest run ended
+static int8_t   profLongestId = -1;
+
+void ICACHE_FLASH_ATTR
+profRecord(int id, uint32_t cycles) {
+  ProfSection *s = profSections + id;
+  if (s->count == 0 || cycles < s->min) s->min = cycles;
+  if (cycles > s->max) s->max = cycles;
+  s->count++;
+  s->total += cycles;
+  int b = 0;
+  for (uint32_t bound = 1024; b < PROF_BUCKETS-1 && cycles > bound; bound <<= 2) b++;
+  s->hist[b]++;
+
+  if (cycles > profLongestCycles) {
+    profLongestCycles = cycles;
+    profLongestId = id;
+    profLongestAt = system_get_time();
+  }
+}
+
+void ICACHE_FLASH_ATTR
+profReset(void) {
+  os_memset(profSections, 0, sizeof(profSections));
+  profLongestCycles = 0;
+  profLongestId = -1;
+}
+
+void ICACHE_FLASH_ATTR
+profSectionJson(JsonWriter *w, int i) {
+  ProfSection *s = profSections + i;
+  uint32_t avg = s->count ? (uint32_t)(s->total / s->count) : 0;
+  jsonObject(w, NULL);
+  jsonString(w, "name", profNames[i]);
+  jsonUInt(w, "count", s->count);
+  jsonUInt(w, "min", s->min);
+  jsonUInt(w, "avg", avg);
+  jsonUInt(w, "max", s->max);
+  jsonArray(w, "hist");
+  for (int b=0; b<PROF_BUCKETS; b++) jsonUInt(w, NULL, s->hist[b]);
+  jsonClose(w);
+  jsonClose(w);
+}
+
+void ICACHE_FLASH_ATTR
+profLongestJson(JsonWriter *w, const char *key) {
+  jsonObject(w, key);
+  if (profLongestId < 0) {
+    jsonRaw(w, "name", "null");
+    jsonUInt(w, "cycles", 0);
+    jsonUInt(w, "us", 0);
+    jsonUInt(w, "ago_ms", 0);
+  } else {
+    jsonString(w, "name", profNames[profLongestId]);
+    jsonUInt(w, "cycles", profLongestCycles);
+    jsonUInt(w, "us", profLongestCycles / system_get_cpu_freq());
+    jsonUInt(w, "ago_ms", (system_get_time() - profLongestAt) / 1000);
+  }
+  jsonClose(w);
+}
+
+#endif // PROFILER
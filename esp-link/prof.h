@@ -0,0 +1,65 @@
+#ifndef PROF_H
+#define PROF_H
+
+// Hot-path profiler based on the CCOUNT cycle counter, built with PROFILER=yes. The sections
+// are listed here, PROF_BEGIN(id) and PROF_END(id) go around the code to measure, in the same
+// block, and without PROFILER they compile to nothing. Each section keeps the count, min, max
+// and total cycles and a histogram, across all sections the longest run is remembered as well.
+// Sections measure 80 cycles per microsecond at 80MHz and must not take longer than ~50 secs.
+
+#define PROF_SECTIONS(X) \
+  X(PROF_UART_RECV,   "uart_recvTask") \
+  X(PROF_SERBR_UART,  "serbridgeUartCb") \
+  X(PROF_SERBR_RECV,  "serbridgeRecvCb") \
+  X(PROF_TELNET,      "telnetUnwrap") \
+  X(PROF_BUFFSEND,    "espbuffsend") \
+  X(PROF_CMD_PARSE,   "cmdParsePacket") \
+  X(PROF_HTTPD_RECV,  "httpdRecvCb") \
+  X(PROF_HTTPD_CGI,   "httpd cgi")
+
+#define PROF_ENUM(id, name) id,
+enum { PROF_SECTIONS(PROF_ENUM) PROF_NSECTIONS };
+#undef PROF_ENUM
+
+#ifdef PROFILER
+
+// Histogram buckets have upper bounds of 1K, 4K, 16K, ... 4^(PROF_BUCKETS-1)K cycles and +Inf
+#define PROF_BUCKETS 8
+
+typedef struct {
+  uint32_t count;
+  uint32_t min, max;              // cycles
+  uint64_t total;                 // cycles
+  uint32_t hist[PROF_BUCKETS];
+} ProfSection;
+
+static inline uint32_t profCcount(void) {
+  uint32_t ccount;
+  __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+  return ccount;
+}
+
+#define PROF_BEGIN(id) uint32_t _prof_start_##id = profCcount()
+#define PROF_END(id)   profRecord(id, profCcount() - _prof_start_##id)
+
+// Add a run of a section
+void profRecord(int id, uint32_t cycles);
+
+// Clear all the counters
+void profReset(void);
+
+// Write section i as a JSON object, an element of an array
+struct JsonWriter;
+void profSectionJson(struct JsonWriter *w, int i);
+
+// Write the longest run as a JSON object, the member key of an object
+void profLongestJson(struct JsonWriter *w, const char *key);
+
+#else
+
+#define PROF_BEGIN(id) do { } while(0)
+#define PROF_END(id)   do { } while(0)
+
+#endif // PROFILER
+
+#endif
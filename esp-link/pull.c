@@ -0,0 +1,240 @@
+#ifdef REST
+#include <esp8266.h>
+#include "rest.h"
+#include "pull.h"
+
+#ifdef PULL_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+enum { PULL_IDLE = 0, PULL_RUNNING, PULL_FINISHING, PULL_DONE, PULL_FAILED };
+
+static struct {
+  char        host[64];
+  char        path[128];
+  uint16_t    port;
+  const char  *name;         // what's being downloaded
+  PullDataFn  *data;         // sink
+  PullAbortFn *abort;
+  bool        async;         // sink finishes by calling pullDone
+  uint8_t     state;         // PULL_*
+  uint8_t     retries;       // times the download has been resumed without making progress
+  bool        fresh;         // no data has arrived in the response to the current request
+  uint32_t    received;      // bytes of the image received, including the ones in buf
+  uint32_t    total;         // length of the image, 0 if unknown
+  uint32_t    skip;          // bytes to drop, the server didn't honor the range asked for
+  uint32_t    *buf;          // PULL_CHUNK bytes being collected for the sink
+  uint16_t    fill;          // bytes in buf
+  char        msg[64];       // outcome
+} pull;
+
+static ETSTimer pullTimer;
+
+static void pullFetchCb(void *arg, int16_t code, uint32_t offset, uint32_t total,
+    const char *data, uint16_t len, bool last);
+
+// Timer callback: drop the fetch, which can't be done from within its callback, pullStart
+// drops it directly
+static void ICACHE_FLASH_ATTR
+pullStopCb(void *arg) {
+  REST_FetchAbort();
+}
+
+// Timer callback: request the image, or the rest of it
+static void ICACHE_FLASH_ATTR
+pullRequestCb(void *arg) {
+  if (pull.state != PULL_RUNNING) return;
+  pull.fresh = true;
+  if (!REST_Fetch(pull.host, pull.port, pull.path, pull.received, pullFetchCb, NULL)) {
+    os_strcpy(pull.msg, "Out of memory");
+    pull.state = PULL_FAILED;
+    if (pull.abort) pull.abort();
+  }
+}
+
+static void ICACHE_FLASH_ATTR
+pullArm(os_timer_func_t *cb, uint32_t ms) {
+  os_timer_disarm(&pullTimer);
+  os_timer_setfn(&pullTimer, cb, NULL);
+  os_timer_arm(&pullTimer, ms, 0);
+}
+
+// The download is over, drop the buffer and the connection
+static void ICACHE_FLASH_ATTR
+pullEnd(uint8_t state, const char *msg) {
+  DBG("PULL %s: %s\n", pull.name, msg);
+  pull.state = state;
+  os_strncpy(pull.msg, msg, sizeof(pull.msg)-1);
+  pull.msg[sizeof(pull.msg)-1] = 0;
+  if (pull.buf != NULL) os_free(pull.buf);
+  pull.buf = NULL;
+  pull.fill = 0;
+  pullArm(pullStopCb, 0);
+}
+
+// The download failed, the sink gets to clean up
+static void ICACHE_FLASH_ATTR
+pullFail(const char *msg) {
+  pullEnd(PULL_FAILED, msg);
+  if (pull.abort) pull.abort();
+}
+
+// Resume a download that got cut off, unless that keeps happening
+static void ICACHE_FLASH_ATTR
+pullRetry(const char *why) {
+  if (pull.retries++ >= PULL_RETRIES) {
+    pullFail(why);
+    return;
+  }
+  DBG("PULL %s: %s, resuming at %d\n", pull.name, why, pull.received);
+  pullArm(pullRequestCb, PULL_RETRY_MS);
+}
+
+// Hand what's in buf to the sink, returns false if it failed
+static bool ICACHE_FLASH_ATTR
+pullDeliver(bool last) {
+  uint16_t len = pull.fill;
+  pull.fill = 0;
+  char *err = pull.data((char *)pull.buf, len, pull.received - len, pull.total, last);
+  if (err != NULL) pullFail(err);
+  return err == NULL;
+}
+
+static void ICACHE_FLASH_ATTR
+pullFetchCb(void *arg, int16_t code, uint32_t offset, uint32_t total,
+    const char *data, uint16_t len, bool last) {
+  if (pull.state != PULL_RUNNING) return;
+  if (code != 200 && code != 206) {
+    char m[32];
+    os_sprintf(m, "HTTP status %d", code);
+    if (code == 502) pullRetry(m); // lost the connection or couldn't get one
+    else pullFail(m);
+    return;
+  }
+
+  // the start of a response, a 200 has the whole image even if we asked for part of it
+  if (pull.fresh) {
+    pull.fresh = false;
+    if (code == 200) {
+      pull.skip = pull.received;
+      if (total > 0) pull.total = total;
+    } else if (total > 0) {
+      pull.total = pull.received + total;
+    }
+  }
+
+  while (len > 0) {
+    uint16_t n = len;
+    if (pull.skip == 0 && pull.fill == PULL_CHUNK) break; // more than the server said it'd send
+    if (pull.skip > 0) {
+      if (n > pull.skip) n = pull.skip;
+      pull.skip -= n;
+    } else {
+      if (n > PULL_CHUNK - pull.fill) n = PULL_CHUNK - pull.fill;
+      os_memcpy((char *)pull.buf + pull.fill, data, n);
+      pull.fill += n;
+      pull.received += n;
+      pull.retries = 0;
+      // the last piece is held back so it goes to the sink with last set
+      if (pull.fill == PULL_CHUNK && pull.received != pull.total && !pullDeliver(false)) return;
+    }
+    data += n;
+    len -= n;
+  }
+  if (!last) return;
+
+  if (pull.total > 0 && pull.received < pull.total) {
+    pullRetry("Download cut short");
+    return;
+  }
+  if (!pullDeliver(true)) return;
+  if (pull.state == PULL_RUNNING) {
+    char m[32];
+    os_sprintf(m, "%d bytes", pull.received);
+    if (pull.async) {
+      pull.state = PULL_FINISHING;
+      if (pull.buf != NULL) os_free(pull.buf);
+      pull.buf = NULL;
+    } else {
+      pullEnd(PULL_DONE, m);
+    }
+  }
+}
+
+char * ICACHE_FLASH_ATTR
+pullStart(const char *url, const char *name, PullDataFn *data, PullAbortFn *abort, bool async) {
+  if (os_strncmp(url, "http://", 7) != 0) return "Only http:// URLs are supported";
+  const char *h = url+7, *e = h;
+  while (*e && *e != ':' && *e != '/') e++;
+  if (e == h || e-h >= sizeof(pull.host)) return "Bad host in URL";
+  uint16_t hostLen = e-h, port = 80;
+  if (*e == ':') {
+    port = atoi(e+1);
+    while (*e && *e != '/') e++;
+  }
+  if (os_strlen(e) >= sizeof(pull.path)) return "URL too long";
+
+  // abort what's going on, the fetch is dropped right away since we're not in its callback
+  // and its data must not reach the new download
+  if (pull.state == PULL_RUNNING || pull.state == PULL_FINISHING) {
+    pullFail("Aborted by a new download");
+    os_timer_disarm(&pullTimer);
+    REST_FetchAbort();
+  }
+
+  os_memset(&pull, 0, sizeof(pull));
+  os_memcpy(pull.host, h, hostLen);
+  os_strcpy(pull.path, *e ? e : "/");
+  pull.port = port;
+  pull.name = name;
+  pull.data = data;
+  pull.abort = abort;
+  pull.async = async;
+  pull.buf = os_malloc(PULL_CHUNK);
+  if (pull.buf == NULL) return "Out of memory";
+  DBG("PULL %s from %s:%d%s\n", name, pull.host, port, pull.path);
+  pull.state = PULL_RUNNING;
+  pullArm(pullRequestCb, 0);
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR
+pullDone(bool ok, const char *msg) {
+  if (pull.state != PULL_RUNNING && pull.state != PULL_FINISHING) return;
+  pullEnd(ok ? PULL_DONE : PULL_FAILED, msg);
+}
+
+void ICACHE_FLASH_ATTR
+pullAbort(PullDataFn *data, const char *msg) {
+  if (pullActive(data)) pullEnd(PULL_FAILED, msg);
+}
+
+bool ICACHE_FLASH_ATTR
+pullActive(PullDataFn *data) {
+  return pull.data == data && (pull.state == PULL_RUNNING || pull.state == PULL_FINISHING);
+}
+
+void ICACHE_FLASH_ATTR
+pullStatus(char *buf) {
+  switch (pull.state) {
+  case PULL_IDLE:
+    os_strcpy(buf, "No download");
+    break;
+  case PULL_RUNNING:
+    if (pull.total > 0)
+      os_sprintf(buf, "%s: downloading, %d of %d bytes", pull.name, pull.received, pull.total);
+    else
+      os_sprintf(buf, "%s: downloading, %d bytes", pull.name, pull.received);
+    break;
+  case PULL_FINISHING:
+    os_sprintf(buf, "%s: %d bytes downloaded, finishing", pull.name, pull.received);
+    break;
+  default:
+    os_sprintf(buf, "%s: %s, %s", pull.name, pull.state == PULL_DONE ? "DONE" : "FAILED",
+        pull.msg);
+    break;
+  }
+}
+#endif
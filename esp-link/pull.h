@@ -0,0 +1,41 @@
+#ifndef PULL_H
+#define PULL_H
+
+// Downloads of firmware images for esp-link and the MCU: instead of a client pushing an image
+// to each device, the device is given a URL and fetches the image itself using the REST client.
+// The body is passed to a sink in PULL_CHUNK pieces, in a word-aligned buffer, the same way
+// httpd passes POST data to a cgi. When the connection breaks the download is resumed where it
+// left off using a Range header, PULL_RETRIES times.
+
+#define PULL_CHUNK   1024   // bytes passed to the sink at a time, except for the last piece
+#define PULL_RETRIES 5      // times a broken download is resumed
+#define PULL_RETRY_MS 2000  // delay before resuming
+
+// Sink for the image: gets each piece with its offset in the image and the total length (0 if
+// the server didn't say), last is set for the last one. It returns an error message to abort
+// the download, or NULL. A sink that finishes asynchronously calls pullDone when it's done,
+// else the download is done when the last piece has been consumed.
+typedef char *PullDataFn(char *data, uint16_t len, uint32_t offset, uint32_t total, bool last);
+
+// Called when the download fails for any reason other than the sink returning an error, and
+// after the sink returned one, so the sink can clean up
+typedef void PullAbortFn(void);
+
+// Start downloading url (http://host[:port]/path) into the sink, name says what's downloaded
+// for pullStatus. A download still going on is aborted. Returns an error message or NULL.
+char *pullStart(const char *url, const char *name, PullDataFn *data, PullAbortFn *abort,
+    bool async);
+
+// Complete an asynchronous sink's download, msg describes the outcome
+void pullDone(bool ok, const char *msg);
+
+// Abort the download if it goes to the given sink
+void pullAbort(PullDataFn *data, const char *msg);
+
+// Whether a download is going to the given sink
+bool pullActive(PullDataFn *data);
+
+// Describe the state of the last download into buf, which must be 128 bytes
+void pullStatus(char *buf);
+
+#endif
@@ -4,6 +4,9 @@
 #include "config.h"
 #include "serled.h"
 #include "cgiwifi.h"
+#include "serbridge.h"
+#include "metrics.h"
+#include "httpdjson.h"
 
 #ifdef MQTT
 #include "mqtt.h"
@@ -12,10 +15,27 @@ extern MQTT_Client mqttClient;
 
 //===== MQTT Status update
 
-// Every minute...
-#define MQTT_STATUS_INTERVAL (60*1000)
+// The status timer ticks every 10 seconds, the full status goes out every minute. In delta mode
+// each tick samples the status fields and only publishes the ones that moved by more than their
+// threshold, plus all of them with every heartbeat so the receiver knows the device is alive.
+#define MQTT_STATUS_TICK      (10*1000)
+#define MQTT_STATUS_INTERVAL  (60*1000)
+#define MQTT_STATUS_HEARTBEAT 300        // default seconds between full delta messages
+#define MQTT_STATUS_HEAP_TH   1024       // default free heap change to publish
+#define MQTT_STATUS_RSSI_TH   3          // default RSSI change to publish
+#define MQTT_STATUS_QUEUE_TH  4          // MQTT queue depth change to publish
+#define MQTT_STATUS_BYTES_TH  1024       // UART byte counter change to publish
 
 static ETSTimer mqttStatusTimer;
+static uint32_t mqttStatusUptime; // seconds since the timer was started, doesn't wrap
+static uint32_t mqttStatusLast;   // uptime of the last full or heartbeat message
+static bool     mqttStatusFresh = true; // the current connection hasn't had a full message yet
+static uint32_t mqttMetricsLast;  // uptime of the last metrics message
+
+// Delta status fields, in the order they appear in the message, with their short keys
+enum { ST_HEAP, ST_RSSI, ST_QUEUE, ST_RX, ST_TX, ST_DROPS, ST_NFIELDS };
+static const char * const mqttStatusKeys[ST_NFIELDS] = { "h", "r", "q", "rx", "tx", "d" };
+static uint32_t mqttStatusPrev[ST_NFIELDS]; // values last published
 
 int ICACHE_FLASH_ATTR
 mqttStatusMsg(char *buf) {
@@ -29,18 +49,141 @@ mqttStatusMsg(char *buf) {
     rssi, (unsigned long)system_get_free_heap_size());
 }
 
-// Timer callback to send an RSSI update to a monitoring system
-static void ICACHE_FLASH_ATTR mqttStatusCb(void *v) {
-  if (!flashConfig.mqtt_status_enable || os_strlen(flashConfig.mqtt_status_topic) == 0 ||
-    mqttClient.connState != MQTT_CONNECTED)
-    return;
-
+// Publish the full status on the status topic plus queue and bridge counters on subtopics
+static void ICACHE_FLASH_ATTR mqttStatusFull(void) {
   char buf[128];
   mqttStatusMsg(buf);
   MQTT_Publish(&mqttClient, flashConfig.mqtt_status_topic, buf, os_strlen(buf), 1, 0);
+
+  // follow up with the outbound queue counters on <status_topic>/queue
+  char topic[sizeof(flashConfig.mqtt_status_topic)+8];
+  char qstats[MQTT_QUEUE_STATS_JSON_MAX];
+  JsonWriter w;
+  os_sprintf(topic, "%s/queue", flashConfig.mqtt_status_topic);
+  jsonBeginBuf(&w, qstats, sizeof(qstats));
+  MQTT_QueueStatsJson(&mqttClient, &w);
+  if (jsonEnd(&w)) MQTT_Publish(&mqttClient, topic, qstats, w.len, 0, 0);
+
+#ifdef HEAP_PROF
+  // heap counters on <status_topic>/heap when built with the profiler
+  os_sprintf(topic, "%s/heap", flashConfig.mqtt_status_topic);
+  char *heap = os_malloc(HEAP_PROF_JSON_MAX);
+  if (heap != NULL) {
+    jsonBeginBuf(&w, heap, HEAP_PROF_JSON_MAX);
+    heapProfJson(&w);
+    if (jsonEnd(&w)) MQTT_Publish(&mqttClient, topic, heap, w.len, 0, 0);
+    os_free(heap);
+  }
+#endif
+
+  // optionally follow up with the serial bridge counters on <status_topic>/bridge
+  if (!flashConfig.mqtt_bridge_stats) return;
+  os_sprintf(topic, "%s/bridge", flashConfig.mqtt_status_topic);
+  char *stats = os_malloc(SERBR_STATS_JSON_MAX);
+  if (stats == NULL) return;
+  int pos = 0;
+  jsonBeginBuf(&w, stats, SERBR_STATS_JSON_MAX);
+  serbridgeStatsJson(&w, &pos);
+  if (jsonEnd(&w)) MQTT_Publish(&mqttClient, topic, stats, w.len, 0, 0);
+  os_free(stats);
+}
+
+static uint32_t ICACHE_FLASH_ATTR mqttStatusThreshold(int field) {
+  switch (field) {
+  case ST_HEAP:
+    return flashConfig.mqtt_status_heap_th ? flashConfig.mqtt_status_heap_th : MQTT_STATUS_HEAP_TH;
+  case ST_RSSI:
+    return flashConfig.mqtt_status_rssi_th ? flashConfig.mqtt_status_rssi_th : MQTT_STATUS_RSSI_TH;
+  case ST_QUEUE:
+    return MQTT_STATUS_QUEUE_TH;
+  case ST_RX:
+  case ST_TX:
+    return MQTT_STATUS_BYTES_TH;
+  default:
+    return 0; // any drop gets reported
+  }
+}
+
+// Publish the fields that changed by more than their threshold, or all of them, as compact
+// JSON, e.g. {"u":3600,"h":21344,"r":-62}, the uptime is always included
+static void ICACHE_FLASH_ATTR mqttStatusDelta(bool all) {
+  uint32_t v[ST_NFIELDS];
+  sint8 rssi = wifi_station_get_rssi();
+  if (rssi > 0) rssi = 0; // not connected or other error
+  v[ST_HEAP] = system_get_free_heap_size();
+  v[ST_RSSI] = (int32_t)rssi;
+  v[ST_QUEUE] = mqttClient.msgQueue.count;
+  int n = ST_RX;
+  if (flashConfig.mqtt_bridge_stats) {
+    serbridgeTotals t;
+    serbridgeGetTotals(&t);
+    v[ST_RX] = t.rx_bytes;
+    v[ST_TX] = t.tx_bytes;
+    v[ST_DROPS] = t.drops;
+    n = ST_NFIELDS;
+  }
+
+  char buf[128], *p = buf;
+  p += os_sprintf(p, "{\"u\":%lu", (unsigned long)mqttStatusUptime);
+  bool changed = false;
+  for (int i=0; i<n; i++) {
+    int32_t d = v[i] - mqttStatusPrev[i];
+    if (d < 0) d = -d;
+    if (!all && (uint32_t)d <= mqttStatusThreshold(i)) continue;
+    if (i == ST_RSSI)
+      p += os_sprintf(p, ",\"%s\":%ld", mqttStatusKeys[i], (long)(int32_t)v[i]);
+    else
+      p += os_sprintf(p, ",\"%s\":%lu", mqttStatusKeys[i], (unsigned long)v[i]);
+    mqttStatusPrev[i] = v[i];
+    changed = true;
+  }
+  if (!all && !changed) return;
+  *p++ = '}';
+  *p = 0;
+  MQTT_Publish(&mqttClient, flashConfig.mqtt_status_topic, buf, p-buf, all ? 1 : 0, 0);
 }
 
+// Publish the metrics that changed since the last time on <status_topic>/metrics
+static void ICACHE_FLASH_ATTR mqttStatusMetrics(void) {
+  char topic[sizeof(flashConfig.mqtt_status_topic)+8];
+  os_sprintf(topic, "%s/metrics", flashConfig.mqtt_status_topic);
+  char *buf = os_malloc(METRICS_COMPACT_MAX);
+  if (buf == NULL) return;
+  int len = metricsCompactJson(buf);
+  if (len > 0) MQTT_Publish(&mqttClient, topic, buf, len, 0, 0);
+  os_free(buf);
+}
+
+// Timer callback to send status updates to a monitoring system
+static void ICACHE_FLASH_ATTR mqttStatusCb(void *v) {
+  mqttStatusUptime += MQTT_STATUS_TICK/1000;
+  heapProfSample();
+  if (!flashConfig.mqtt_status_enable || os_strlen(flashConfig.mqtt_status_topic) == 0 ||
+    mqttClient.connState != MQTT_CONNECTED) {
+    mqttStatusFresh = true;
+    return;
+  }
+
+  if (flashConfig.mqtt_metrics && mqttStatusUptime - mqttMetricsLast >= MQTT_STATUS_INTERVAL/1000) {
+    mqttMetricsLast = mqttStatusUptime;
+    mqttStatusMetrics();
+  }
+
+  if (!flashConfig.mqtt_status_delta) {
+    if (mqttStatusUptime - mqttStatusLast < MQTT_STATUS_INTERVAL/1000) return;
+    mqttStatusLast = mqttStatusUptime;
+    mqttStatusFull();
+    return;
+  }
 
+  // send everything right after connecting and with each heartbeat
+  uint32_t hb = flashConfig.mqtt_status_heartbeat ?
+    flashConfig.mqtt_status_heartbeat : MQTT_STATUS_HEARTBEAT;
+  bool all = mqttStatusFresh || mqttStatusUptime - mqttStatusLast >= hb;
+  if (all) mqttStatusLast = mqttStatusUptime;
+  mqttStatusFresh = false;
+  mqttStatusDelta(all);
+}
 
 #endif // MQTT
 
@@ -122,7 +265,7 @@ void ICACHE_FLASH_ATTR statusInit(void) {
 #ifdef MQTT
   os_timer_disarm(&mqttStatusTimer);
   os_timer_setfn(&mqttStatusTimer, mqttStatusCb, NULL);
-  os_timer_arm(&mqttStatusTimer, MQTT_STATUS_INTERVAL, 1); // recurring timer
+  os_timer_arm(&mqttStatusTimer, MQTT_STATUS_TICK, 1); // recurring timer
 #endif // MQTT
 }
 
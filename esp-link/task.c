@@ -13,53 +13,74 @@
 #include "esp8266.h"
 #include <task.h>
 
-#define MAXUSRTASKS	 8
-
 #ifdef USRTASK_DBG
 #define DBG_USRTASK(format, ...) os_printf(format, ## __VA_ARGS__)
 #else
 #define DBG_USRTASK(format, ...) do { } while(0)
 #endif
 
-LOCAL os_event_t *_task_queue   = NULL;		// system_os_task queue
+// Tasks run at one of two priorities, each with its own system_os_task queue. A task has at
+// most one event queued: posting it again while it's pending only gets counted, the handler
+// sees the par of the first post. Since a handler runs after its pending flag is cleared,
+// nothing posted while it runs gets lost.
+LOCAL os_event_t *_task_queue[2];		// system_os_task queues, low and high priority
 LOCAL os_task_t  *usr_task_queue = NULL;	// user task queue
+LOCAL uint8_t usr_task_prio[MAXUSRTASKS];
+LOCAL volatile bool usr_task_pending[MAXUSRTASKS];
+LOCAL UsrTaskStats usr_task_stats_[MAXUSRTASKS];
+
+static const uint8_t sys_prio[2] = { _taskPrio, _taskPrioHigh };
 
 // it seems save to run the usr_event_handler from RAM, so no ICACHE_FLASH_ATTR here...
 
 LOCAL void usr_event_handler(os_event_t *e)
 {
   DBG_USRTASK("usr_event_handler: event %p (sig=%d, par=%p)\n", e, (int)e->sig, (void *)e->par);
-  if (usr_task_queue[e->sig] == NULL || e->sig < 0 || e->sig >= MAXUSRTASKS) {
+  if (e->sig >= MAXUSRTASKS || usr_task_queue[e->sig] == NULL) {
     os_printf("usr_event_handler: task %d %s\n", (int)e->sig,
-	       usr_task_queue[e->sig] == NULL ? "not registered" : "out of range");
+	       e->sig < MAXUSRTASKS ? "not registered" : "out of range");
     return;
   }
+  usr_task_pending[e->sig] = false;
   (usr_task_queue[e->sig])(e);
 }
 
-LOCAL void init_usr_task() {
-  if (_task_queue == NULL)
-    _task_queue = (os_event_t *)os_zalloc(sizeof(os_event_t) * _task_queueLen);
+LOCAL void init_usr_task(uint8_t prio) {
+  if (_task_queue[prio] == NULL) {
+    _task_queue[prio] = (os_event_t *)os_zalloc(sizeof(os_event_t) * _task_queueLen);
+    system_os_task(usr_event_handler, sys_prio[prio], _task_queue[prio], _task_queueLen);
+  }
 
   if (usr_task_queue == NULL)
     usr_task_queue = (os_task_t *)os_zalloc(sizeof(os_task_t) * MAXUSRTASKS);
-
-  system_os_task(usr_event_handler, _taskPrio, _task_queue, _task_queueLen);
 }
 
 // public functions
 bool post_usr_task(uint8_t task, os_param_t par)
 {
-  return system_os_post(_taskPrio, task, par);
+  if (task >= MAXUSRTASKS) return false;
+  UsrTaskStats *st = &usr_task_stats_[task];
+  if (usr_task_pending[task]) {
+    st->coalesced++;
+    return true;
+  }
+  usr_task_pending[task] = true;
+  if (!system_os_post(sys_prio[usr_task_prio[task]], task, par)) {
+    usr_task_pending[task] = false;
+    st->drops++;
+    return false;
+  }
+  st->posts++;
+  return true;
 }
 
-uint8_t register_usr_task (os_task_t event)
+uint8_t register_usr_task_prio(os_task_t event, uint8_t prio)
 {
   int task;
 
-  DBG_USRTASK("register_usr_task: %p\n", event);
-  if (_task_queue   == NULL || usr_task_queue == NULL)
-    init_usr_task();
+  DBG_USRTASK("register_usr_task: %p prio %d\n", event, prio);
+  if (prio > USRTASK_PRIO_HIGH) prio = USRTASK_PRIO_HIGH;
+  init_usr_task(prio);
 
   for (task = 0; task < MAXUSRTASKS; task++) {
     if (usr_task_queue[task] == event)
@@ -70,9 +91,22 @@ uint8_t register_usr_task (os_task_t event)
     if (usr_task_queue[task] == NULL) {
       DBG_USRTASK("register_usr_task: assign task #%d\n", task);
       usr_task_queue[task] = event;
+      usr_task_prio[task] = prio;
       break;
     }
   }
   return task;
 }
 
+uint8_t register_usr_task (os_task_t event)
+{
+  return register_usr_task_prio(event, USRTASK_PRIO_LOW);
+}
+
+bool usr_task_stats(uint8_t task, UsrTaskStats *stats)
+{
+  if (task >= MAXUSRTASKS || usr_task_queue == NULL || usr_task_queue[task] == NULL)
+    return false;
+  *stats = usr_task_stats_[task];
+  return true;
+}
@@ -11,10 +11,26 @@
 #ifndef	USRTASK_H
 #define USRTASK_H
 
-#define _taskPrio        1
+#define _taskPrio        1	// system task priority of USRTASK_PRIO_LOW
+#define _taskPrioHigh    2	// system task priority of USRTASK_PRIO_HIGH
 #define _task_queueLen   8
 
+#define USRTASK_PRIO_LOW  0	// syslog, housekeeping
+#define USRTASK_PRIO_HIGH 1	// latency critical, e.g. UART RX
+
+#define MAXUSRTASKS	 8
+
+typedef struct {
+  uint32_t posts;	// events posted to the system queue
+  uint32_t coalesced;	// posts while the task was pending already
+  uint32_t drops;	// posts that failed because the system queue was full
+} UsrTaskStats;
+
 uint8_t register_usr_task (os_task_t event);
+uint8_t register_usr_task_prio(os_task_t event, uint8_t prio);
+// queue an event for the task unless it's pending already, returns false if the queue is full
 bool	post_usr_task(uint8_t task, os_param_t par);
+// get the counters of a task, returns false if there is no such task
+bool	usr_task_stats(uint8_t task, UsrTaskStats *stats);
 
 #endif
@@ -0,0 +1,123 @@
+#include <esp8266.h>
+#include "twheel.h"
+
+#define TWHEEL_TICK_US (TWHEEL_TICK_MS*1000)
+// longest the SDK timer sleeps, so the tick clock sees every wrap of system_get_time
+#define TWHEEL_MAX_SLEEP_MS (60*1000)
+
+static TWheelTimer *twheelSlots[TWHEEL_SLOTS]; // timers hashed by expiry tick
+static uint16_t twheelCount;    // timers pending
+static uint32_t twheelTick;     // current tick
+static uint32_t twheelTickUs;   // system_get_time() at the start of the current tick
+static uint32_t twheelDone;     // last tick whose timers have all fired
+static uint32_t twheelNext;     // tick the SDK timer is armed for
+static bool twheelScheduled;    // SDK timer armed
+static bool twheelFiring;       // in twheelFire, it schedules when done
+static ETSTimer twheelTimer;
+
+// Advance the tick clock, returns the microseconds into the current tick
+static uint32_t ICACHE_FLASH_ATTR
+twheelNow(void) {
+  uint32_t us = system_get_time() - twheelTickUs;
+  uint32_t n = us / TWHEEL_TICK_US;
+  twheelTick += n;
+  twheelTickUs += n * TWHEEL_TICK_US;
+  return us - n * TWHEEL_TICK_US;
+}
+
+static void ICACHE_FLASH_ATTR
+twheelUnlink(TWheelTimer *t) {
+  TWheelTimer **pp = &twheelSlots[t->expires & (TWHEEL_SLOTS-1)];
+  while (*pp != NULL && *pp != t) pp = &(*pp)->next;
+  if (*pp != NULL) *pp = t->next;
+  t->armed = false;
+  twheelCount--;
+}
+
+// Arm the SDK timer for the earliest pending tick
+static void ICACHE_FLASH_ATTR
+twheelSchedule(void) {
+  os_timer_disarm(&twheelTimer);
+  twheelScheduled = false;
+  if (twheelCount == 0) return;
+
+  uint32_t frac = twheelNow();
+  int32_t ticks = TWHEEL_MAX_SLEEP_MS / TWHEEL_TICK_MS;
+  for (int i=0; i<TWHEEL_SLOTS; i++) {
+    for (TWheelTimer *t = twheelSlots[i]; t != NULL; t = t->next) {
+      int32_t d = (int32_t)(t->expires - twheelTick);
+      if (d < ticks) ticks = d;
+    }
+  }
+  if (ticks < 1) ticks = 1; // overdue, fire right away
+  twheelNext = twheelTick + ticks;
+  twheelScheduled = true;
+  uint32_t ms = (ticks * TWHEEL_TICK_US - frac + 999) / 1000;
+  os_timer_arm(&twheelTimer, ms > 0 ? ms : 1, 0);
+}
+
+// SDK timer callback: fire everything that's due, each slot is rescanned after a callback
+// because it may have armed or disarmed timers in it
+static void ICACHE_FLASH_ATTR
+twheelFire(void *arg) {
+  twheelScheduled = false;
+  twheelNow();
+  uint32_t now = twheelTick;
+  uint32_t span = now - twheelDone;
+  if (span > TWHEEL_SLOTS) span = TWHEEL_SLOTS;
+
+  twheelFiring = true;
+  for (uint32_t i=1; i<=span; i++) {
+    TWheelTimer **pp = &twheelSlots[(twheelDone + i) & (TWHEEL_SLOTS-1)];
+    while (*pp != NULL) {
+      TWheelTimer *t = *pp;
+      if ((int32_t)(t->expires - now) > 0) {
+        pp = &t->next;
+        continue;
+      }
+      *pp = t->next;
+      t->armed = false;
+      twheelCount--;
+      t->cb(t->arg);
+      pp = &twheelSlots[(twheelDone + i) & (TWHEEL_SLOTS-1)];
+    }
+  }
+  twheelDone = now;
+  twheelFiring = false;
+  twheelSchedule();
+}
+
+void ICACHE_FLASH_ATTR
+twheelSetFn(TWheelTimer *t, TWheelCb cb, void *arg) {
+  if (t->armed) twheelDisarm(t);
+  t->cb = cb;
+  t->arg = arg;
+}
+
+void ICACHE_FLASH_ATTR
+twheelArm(TWheelTimer *t, uint32_t ms) {
+  if (t->armed) twheelUnlink(t);
+  if (twheelTimer.timer_func == NULL) os_timer_setfn(&twheelTimer, twheelFire, NULL);
+  uint32_t frac = twheelNow();
+  // when idle the clock may have missed wraps, but nothing is owed from the past
+  if (twheelCount == 0 && !twheelFiring) twheelDone = twheelTick;
+  // count from the current time, not from the start of the tick
+  uint32_t ticks = (ms + (frac + 999)/1000 + TWHEEL_TICK_MS - 1) / TWHEEL_TICK_MS;
+  if (ticks == 0) ticks = 1;
+  t->expires = twheelTick + ticks;
+  TWheelTimer **slot = &twheelSlots[t->expires & (TWHEEL_SLOTS-1)];
+  t->next = *slot;
+  *slot = t;
+  t->armed = true;
+  twheelCount++;
+
+  // a timer that fires after the SDK timer doesn't need it re-armed
+  if (!twheelFiring && (!twheelScheduled || (int32_t)(t->expires - twheelNext) < 0))
+    twheelSchedule();
+}
+
+void ICACHE_FLASH_ATTR
+twheelDisarm(TWheelTimer *t) {
+  // the SDK timer is left alone, a wakeup with nothing due just re-arms it
+  if (t->armed) twheelUnlink(t);
+}
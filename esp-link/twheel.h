@@ -0,0 +1,34 @@
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+// Shared coarse timer service: modules arm deadlines on a wheel with TWHEEL_TICK_MS ticks and
+// a single SDK timer is armed for the earliest of them, so there are no wakeups while nothing
+// is pending and deadlines that fall in the same tick fire together. Timers are one-shot, a
+// callback may re-arm its own timer or arm and disarm others. Delays are rounded up to whole
+// ticks, so a timer fires between ms and ms+TWHEEL_TICK_MS milliseconds after being armed.
+
+#define TWHEEL_TICK_MS 100
+#define TWHEEL_SLOTS   32  // power of 2
+
+typedef void (*TWheelCb)(void *arg);
+
+typedef struct TWheelTimer {
+  struct TWheelTimer *next;   // in the slot list
+  uint32_t            expires; // tick at which it fires
+  TWheelCb            cb;
+  void               *arg;
+  bool                armed;
+} TWheelTimer;
+
+// Set the callback of a timer, disarms it if it's pending
+void twheelSetFn(TWheelTimer *t, TWheelCb cb, void *arg);
+
+// Arm a timer to fire in ms milliseconds, re-arms it if it's already pending
+void twheelArm(TWheelTimer *t, uint32_t ms);
+
+// Disarm a timer, nothing happens if it isn't pending
+void twheelDisarm(TWheelTimer *t);
+
+#define twheelArmed(t) ((t)->armed)
+
+#endif
@@ -28,6 +28,7 @@ It's written for use with httpd, but doesn't need to be used as such.
 #include <stdlib.h>
 #include <string.h>
 #define os_malloc malloc
+#define os_zalloc(s) calloc(1, s)
 #define os_free free
 #define os_memcpy memcpy
 #define os_memset memset
@@ -47,11 +48,28 @@ EspFsContext userPageCtxDef;
 EspFsContext * espLinkCtx = &espLinkCtxDef;
 EspFsContext * userPageCtx = &userPageCtxDef;
 
+//Read cache of ESPFS_FLASH contexts: the headers, names and index entries are small reads close
+//together, so whole blocks are read and kept, the least recently used one gets replaced.
+#define ESPFS_CACHE_BLOCKS 2
+#define ESPFS_CACHE_BLOCK  512
+
+typedef struct {
+	uint32_t addr[ESPFS_CACHE_BLOCKS];  // flash address of the blocks, 1 if the slot is empty
+	uint8_t  lru;                       // slot to replace next
+	uint32_t data[ESPFS_CACHE_BLOCKS][ESPFS_CACHE_BLOCK/4];
+} EspFsCache;
+
 struct EspFsContext
 {
 	char*       data;
 	EspFsSource source;
 	uint8_t     valid;
+	EspFsCache* cache;      // ESPFS_FLASH only, NULL if it couldn't be allocated
+	char*       index;      // index following the last header, NULL if the image has none
+	int32_t     indexCount; // number of entries in the index
+	char*       pages;      // list of the HTML pages, NULL if the image has none
+	int32_t     pagesLen;
+	char*       end;        // first byte past the image
 };
 
 struct EspFsFile {
@@ -61,9 +79,48 @@ struct EspFsFile {
 	int32_t posDecomp;
 	char *posStart;
 	char *posComp;
+	int32_t left; // bytes left to read in the range set by espFsRange, -1 if there is none
 	void *decompData;
+	struct EspFsRamFile *ram; // RAM copy the data is read from, NULL to read the image
 };
 
+//RAM copies of small files that are opened often, so they're served without reading the image.
+//The data is kept as stored, i.e. still compressed. A file is copied in once it's been opened
+//ESPFS_RAM_MIN_HITS times and fits in the budget, or by dropping the copies of files that are
+//opened less. A file that isn't tracked yet wears down the least used entry by one hit and takes
+//its slot once that's at zero.
+#define ESPFS_RAM_FILES    8
+#define ESPFS_RAM_MAX_FILE 8192
+#define ESPFS_RAM_MIN_HITS 2
+
+typedef struct EspFsRamFile {
+	EspFsContext *ctx;
+	char     *header; // header of the file in the image, NULL if the slot is free
+	char     *data;   // the copy, NULL if the file isn't copied in (yet)
+	int32_t  len;
+	uint16_t hits;    // opens
+	uint16_t users;   // open files reading the copy, it's freed once there are none
+} EspFsRamFile;
+
+static EspFsRamFile espFsRamFiles[ESPFS_RAM_FILES];
+static int32_t espFsRamBudget, espFsRamUsed;
+
+//Largest window the heatshrink decoder accepts, it's allocated for each open file
+#define HEATSHRINK_MAX_WINDOW_BITS 12
+
+//State of the streaming heatshrink decoder, followed by the window
+typedef struct {
+	uint8_t  windowBits, lookaheadBits;
+	uint16_t head;      // where the next output byte goes in the window
+	uint16_t distance;  // distance of the back reference being copied
+	uint16_t count;     // bytes of it that are left
+	uint32_t bits;      // input bits not used yet, the low nbits of it
+	uint8_t  in[32];    // input read ahead from the file, word aligned
+	uint8_t  nbits;
+	uint8_t  inPos, inLen;
+	uint8_t  window[0];
+} HeatshrinkDecoder;
+
 /*
 Available locations, at least in my flash, with boundaries partially guessed. This
 is using 0.9.1/0.9.2 SDK on a not-too-new module.
@@ -81,31 +138,103 @@ a memory exception, crashing the program.
 */
 
 //Copies len bytes over from dst to src, but does it using *only*
-//aligned 32-bit reads. Yes, it's no too optimized but it's short and sweet and it works.
+//aligned 32-bit reads. Each word is read once: the bytes up to the first aligned source word
+//and after the last one are taken out of a word, whole words in between are copied as words if
+//dst is aligned as well, else they get stored a byte at a time.
 
 //ToDo: perhaps os_memcpy also does unaligned accesses?
 #ifdef __ets__
 void ICACHE_FLASH_ATTR memcpyAligned(char *dst, const char *src, int len) {
-	int x;
-	int w, b;
-	for (x=0; x<len; x++) {
-		b=((int)src&3);
-		w=*((int *)(src-b));
-		if (b==0) *dst=(w>>0);
-		if (b==1) *dst=(w>>8);
-		if (b==2) *dst=(w>>16);
-		if (b==3) *dst=(w>>24);
-		dst++; src++;
+	uint32_t w;
+	int b=((int)src&3);
+	if (len<=0) return;
+	if (b!=0) {
+		//head: the rest of the first word
+		w=*((uint32_t *)(src-b))>>(8*b);
+		for (; b<4 && len>0; b++, len--) {
+			*dst++=w;
+			w>>=8;
+			src++;
+		}
+	}
+	if (((int)dst&3)==0) {
+		for (; len>=4; len-=4, src+=4, dst+=4) *((uint32_t *)dst)=*((uint32_t *)src);
+	} else {
+		for (; len>=4; len-=4, src+=4) {
+			w=*((uint32_t *)src);
+			*dst++=w;
+			*dst++=w>>8;
+			*dst++=w>>16;
+			*dst++=w>>24;
+		}
+	}
+	if (len>0) {
+		//tail: the start of the last word
+		w=*((uint32_t *)src);
+		while (len-->0) {
+			*dst++=w;
+			w>>=8;
+		}
 	}
 }
 #else
 #define memcpyAligned memcpy
 #endif
 
+//Reads from flash with the SDK, which wants aligned addresses and lengths: the aligned part goes
+//straight into dst if that's aligned too, the rest through a bounce buffer.
 void ICACHE_FLASH_ATTR memcpyFromFlash(char *dst, const char *src, int len)
 {
-	if( spi_flash_read( (int)src, (void *)dst, len ) != SPI_FLASH_RESULT_OK )
-		os_memset( dst, 0, len ); // if read was not successful, reply with zeroes
+	uint32_t bounce[16];
+	int addr = (int)src;
+	while (len > 0) {
+		int b = addr & 3;
+		if (b == 0 && ((int)dst & 3) == 0 && len >= 4) {
+			int n = len & ~3;
+			if( spi_flash_read( addr, (uint32_t *)dst, n ) != SPI_FLASH_RESULT_OK )
+				os_memset( dst, 0, n ); // if read was not successful, reply with zeroes
+			addr += n; dst += n; len -= n;
+			continue;
+		}
+		int n = sizeof(bounce) - b;
+		if (n > len) n = len;
+		if( spi_flash_read( addr - b, bounce, (b + n + 3) & ~3 ) != SPI_FLASH_RESULT_OK )
+			os_memset( bounce, 0, sizeof(bounce) );
+		os_memcpy( dst, (char *)bounce + b, n );
+		addr += n; dst += n; len -= n;
+	}
+}
+
+// Reads from flash through the context's cache, reads of a whole block or more go straight to
+// the flash as they wouldn't be read again soon.
+static void ICACHE_FLASH_ATTR espfsCachedRead(EspFsContext * ctx, char *dst, const char *src, int len)
+{
+	EspFsCache *c = ctx->cache;
+	if (c == NULL || len >= ESPFS_CACHE_BLOCK) {
+		memcpyFromFlash(dst, src, len);
+		return;
+	}
+	while (len > 0) {
+		uint32_t addr = (uint32_t)src;
+		uint32_t block = addr & ~(ESPFS_CACHE_BLOCK-1);
+		int i = 0;
+		while (i < ESPFS_CACHE_BLOCKS && c->addr[i] != block) i++;
+		if (i == ESPFS_CACHE_BLOCKS) {
+			i = c->lru;
+			if( spi_flash_read( block, c->data[i], ESPFS_CACHE_BLOCK ) != SPI_FLASH_RESULT_OK ) {
+				c->addr[i] = 1;
+				memcpyFromFlash(dst, src, len);
+				return;
+			}
+			c->addr[i] = block;
+		}
+		c->lru = (i + 1) % ESPFS_CACHE_BLOCKS;
+		int off = addr - block;
+		int n = ESPFS_CACHE_BLOCK - off;
+		if (n > len) n = len;
+		os_memcpy(dst, (char *)c->data[i] + off, n);
+		dst += n; src += n; len -= n;
+	}
 }
 
 // memcpy on MEMORY/FLASH file systems
@@ -114,7 +243,7 @@ void espfs_memcpy( EspFsContext * ctx, void * dest, const void * src, int count
 	if( ctx->source == ESPFS_MEMORY )
 		os_memcpy( dest, src, count );
 	else
-		memcpyFromFlash(dest, src, count);
+		espfsCachedRead(ctx, dest, src, count);
 }
 
 // aligned memcpy on MEMORY/FLASH file systems
@@ -123,13 +252,101 @@ void espfs_memcpyAligned( EspFsContext * ctx, void * dest, const void * src, int
 	if( ctx->source == ESPFS_MEMORY )
 		memcpyAligned(dest, src, count);
 	else
-		memcpyFromFlash(dest, src, count);
+		espfsCachedRead(ctx, dest, src, count);
+}
+
+static void ICACHE_FLASH_ATTR espFsRamDrop(EspFsRamFile *f) {
+	if (f->data == NULL || f->users > 0) return;
+	os_free(f->data);
+	f->data = NULL;
+	espFsRamUsed -= f->len;
+}
+
+//Drops the copies, and forgets about the files if ctx is given as its image changed. Copies
+//still being read are freed once the last of their files is closed, if the image changed or
+//the cache is over budget by then.
+static void ICACHE_FLASH_ATTR espFsRamFlush(EspFsContext *ctx) {
+	for (int i=0; i<ESPFS_RAM_FILES; i++) {
+		EspFsRamFile *f = espFsRamFiles + i;
+		if (ctx != NULL && f->ctx != ctx) continue;
+		if (ctx != NULL) {
+			f->header = NULL;
+			f->hits = 0;
+		}
+		espFsRamDrop(f);
+	}
+}
+
+void ICACHE_FLASH_ATTR espFsRamCacheSize(int bytes) {
+	espFsRamBudget = bytes;
+	espFsRamFlush(NULL);
+}
+
+//Counts an open of the file with the given header and stored length, and sets it up to be read
+//from RAM if it's one of the hot ones
+static void ICACHE_FLASH_ATTR espFsRamOpen(EspFsFile *fh, char *header, int len) {
+	if (espFsRamBudget == 0 || len > ESPFS_RAM_MAX_FILE || len > espFsRamBudget) return;
+
+	EspFsRamFile *f = NULL, *victim = NULL;
+	for (int i=0; i<ESPFS_RAM_FILES && f == NULL; i++) {
+		EspFsRamFile *e = espFsRamFiles + i;
+		if (e->header == header && e->ctx == fh->ctx) f = e;
+		else if (e->users == 0 && (victim == NULL || e->hits < victim->hits)) victim = e;
+	}
+	if (f == NULL) {
+		if (victim == NULL) return;
+		if (victim->hits > 0 && --victim->hits > 0) return;
+		espFsRamDrop(victim);
+		f = victim;
+		f->ctx = fh->ctx;
+		f->header = header;
+		f->len = len;
+	}
+	if (f->hits < 0xffff) f->hits++;
+
+	if (f->data == NULL && f->hits >= ESPFS_RAM_MIN_HITS) {
+		while (espFsRamUsed + len > espFsRamBudget) {
+			EspFsRamFile *cold = NULL;
+			for (int i=0; i<ESPFS_RAM_FILES; i++) {
+				EspFsRamFile *e = espFsRamFiles + i;
+				if (e != f && e->data != NULL && e->users == 0 && e->hits < f->hits &&
+						(cold == NULL || e->hits < cold->hits))
+					cold = e;
+			}
+			if (cold == NULL) return;
+			espFsRamDrop(cold);
+		}
+		f->data = (char *)os_malloc(len);
+		if (f->data == NULL) return;
+		espfs_memcpyAligned(fh->ctx, f->data, fh->posStart, len);
+		espFsRamUsed += len;
+	}
+	if (f->data != NULL) {
+		fh->ram = f;
+		f->users++;
+	}
+}
+
+// reads the stored data of an open file
+static void ICACHE_FLASH_ATTR espFsFileRead(EspFsFile *fh, char *dst, char *src, int len) {
+	if (fh->ram != NULL)
+		os_memcpy(dst, fh->ram->data + (src - fh->posStart), len);
+	else
+		espfs_memcpyAligned(fh->ctx, dst, src, len);
 }
 
 // initializes an EspFs context
 EspFsInitResult ICACHE_FLASH_ATTR espFsInit(EspFsContext *ctx, void *flashAddress, EspFsSource source) {
 	ctx->valid = 0;
 	ctx->source = source;
+	espFsRamFlush(ctx);
+	// the flash may have been rewritten since the last init, start with an empty cache
+	if (source == ESPFS_FLASH && ctx->cache == NULL)
+		ctx->cache = (EspFsCache *)os_malloc(sizeof(EspFsCache));
+	if (ctx->cache != NULL) {
+		for (int i=0; i<ESPFS_CACHE_BLOCKS; i++) ctx->cache->addr[i] = 1;
+		ctx->cache->lru = 0;
+	}
 	// base address must be aligned to 4 bytes
 	if (((int)flashAddress & 3) != 0) {
 		return ESPFS_INIT_RESULT_BAD_ALIGN;
@@ -144,9 +361,41 @@ EspFsInitResult ICACHE_FLASH_ATTR espFsInit(EspFsContext *ctx, void *flashAddres
 
 	ctx->data = (char *)flashAddress;
 	ctx->valid = 1;
+
+	// find the index behind the last header, that's a walk over all headers but only this once
+	ctx->index = NULL;
+	ctx->indexCount = 0;
+	char *position = ctx->data;
+	while (testHeader.magic == ESPFS_MAGIC && !(testHeader.flags & FLAG_LASTFILE)) {
+		position += sizeof(EspFsHeader) + testHeader.nameLen + testHeader.fileLenComp;
+		if ((int)position&3) position += 4-((int)position&3);
+		espfs_memcpy(ctx, &testHeader, position, sizeof(EspFsHeader));
+	}
+	if (testHeader.magic == ESPFS_MAGIC && (testHeader.flags & FLAG_INDEX)) {
+		ctx->index = position + sizeof(EspFsHeader);
+		ctx->indexCount = testHeader.fileLenComp / sizeof(EspFsIndexEntry);
+	}
+	ctx->pages = NULL;
+	ctx->pagesLen = 0;
+	ctx->end = position + sizeof(EspFsHeader);
+	if (testHeader.magic == ESPFS_MAGIC && (testHeader.flags & FLAG_INDEX))
+		ctx->end += testHeader.fileLenComp;
+	if (testHeader.magic == ESPFS_MAGIC && (testHeader.flags & FLAG_PAGES)) {
+		position = ctx->end;
+		espfs_memcpy(ctx, &ctx->pagesLen, position, sizeof(int32_t));
+		ctx->pages = position + sizeof(int32_t);
+		ctx->end = ctx->pages + ctx->pagesLen;
+	}
 	return ESPFS_INIT_RESULT_OK;
 }
 
+// Hashes a file name the way the index does.
+uint32_t ICACHE_FLASH_ATTR espFsNameHash(const char *name) {
+	uint32_t hash = ESPFS_HASH_INIT;
+	while (*name != 0) hash = ESPFS_HASH_STEP(hash, *name++);
+	return hash;
+}
+
 // Returns flags of opened file.
 int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 	if (fh == NULL) {
@@ -161,6 +410,13 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 	return (int)flags;
 }
 
+// Gets the content hash of an opened file, returns 0 if the image has none for it.
+int ICACHE_FLASH_ATTR espFsHash(EspFsFile *fh, uint32_t *hash) {
+	if (fh == NULL || !(espFsFlags(fh) & FLAG_HASH)) return 0;
+	espfs_memcpyAligned(fh->ctx, (char*)hash, fh->posStart-4, 4);
+	return 1;
+}
+
 // creates and initializes an iterator over the espfs file system
 void ICACHE_FLASH_ATTR espFsIteratorInit(EspFsContext *ctx, EspFsIterator *iterator)
 {
@@ -173,25 +429,10 @@ void ICACHE_FLASH_ATTR espFsIteratorInit(EspFsContext *ctx, EspFsIterator *itera
 	iterator->position = NULL;
 }
 
-// moves iterator to the next file on espfs
-// returns 1 if iterator move was successful, otherwise 0 (last file)
-// iterator->header and iterator->name will contain file information
-int ICACHE_FLASH_ATTR espFsIteratorNext(EspFsIterator *iterator)
+// points the iterator at the file whose header is at position
+// returns 1 if there is a file there, otherwise 0 (last file or broken image)
+static int ICACHE_FLASH_ATTR espFsIteratorAt(EspFsIterator *iterator, char *position)
 {
-	if( iterator->ctx == NULL )
-		return 0;
-	
-	char * position = iterator->position;
-	if( position == NULL )
-		position = iterator->ctx->data; // first node
-	else
-	{
-		// jump the iterator to the next file
-		
-		position+=sizeof(EspFsHeader) + iterator->header.nameLen+iterator->header.fileLenComp;
-		if ((int)position&3) position+=4-((int)position&3); //align to next 32bit val
-	}
-	
 	iterator->position = position;
 	EspFsHeader * hdr = &iterator->header;
 	espfs_memcpy(iterator->ctx, hdr, position, sizeof(EspFsHeader));
@@ -216,6 +457,28 @@ int ICACHE_FLASH_ATTR espFsIteratorNext(EspFsIterator *iterator)
 	return 1;
 }
 
+// moves iterator to the next file on espfs
+// returns 1 if iterator move was successful, otherwise 0 (last file)
+// iterator->header and iterator->name will contain file information
+int ICACHE_FLASH_ATTR espFsIteratorNext(EspFsIterator *iterator)
+{
+	if( iterator->ctx == NULL )
+		return 0;
+	
+	char * position = iterator->position;
+	if( position == NULL )
+		position = iterator->ctx->data; // first node
+	else
+	{
+		// jump the iterator to the next file
+		
+		position+=sizeof(EspFsHeader) + iterator->header.nameLen+iterator->header.fileLenComp;
+		if ((int)position&3) position+=4-((int)position&3); //align to next 32bit val
+	}
+	
+	return espFsIteratorAt(iterator, position);
+}
+
 //Open a file and return a pointer to the file desc struct.
 EspFsFile ICACHE_FLASH_ATTR *espFsOpen(EspFsContext *ctx, char *fileName) {
 	EspFsIterator it;
@@ -229,11 +492,37 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(EspFsContext *ctx, char *fileName) {
 	//Strip initial slashes
 	while(fileName[0]=='/') fileName++;
 	
-	//Search the file
-	while( espFsIteratorNext(&it) ) 
+	//Search the file, using the index if there is one
+	int i = 0, hi = ctx->indexCount;
+	uint32_t hash = 0;
+	EspFsIndexEntry entry;
+	if (ctx->index != NULL) {
+		hash = espFsNameHash(fileName);
+		while (i < hi) {
+			int mid = (i+hi)/2;
+			espfs_memcpy(ctx, &entry, ctx->index + mid*sizeof(EspFsIndexEntry), sizeof(entry));
+			if (entry.hash < hash) i = mid+1; else hi = mid;
+		}
+	}
+	while (1)
 	{
+		if (ctx->index == NULL) {
+			if (!espFsIteratorNext(&it)) break;
+		} else {
+			if (i >= ctx->indexCount) break;
+			espfs_memcpy(ctx, &entry, ctx->index + i*sizeof(EspFsIndexEntry), sizeof(entry));
+			i++;
+			if (entry.hash != hash) break;
+			if (!espFsIteratorAt(&it, ctx->data + entry.offset)) break;
+		}
 		if (os_strcmp(it.name, fileName)==0) {
-			//Yay, this is the file we need!
+			//Yay, this is the file we need! Its data may be that of another file.
+			if (it.header.flags&FLAG_SHARED) {
+				uint32_t offset;
+				espfs_memcpy(ctx, &offset, it.position + sizeof(EspFsHeader) + it.header.nameLen, 4);
+				if (!espFsIteratorAt(&it, ctx->data + offset) || (it.header.flags&FLAG_SHARED))
+					return NULL;
+			}
 			EspFsFile * r=(EspFsFile *)os_malloc(sizeof(EspFsFile)); //Alloc file desc mem
 			//os_printf("Alloc %p[%d]\n", r, sizeof(EspFsFile));
 			if (r==NULL) return NULL;
@@ -243,12 +532,33 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(EspFsContext *ctx, char *fileName) {
 			r->posComp=it.position + it.header.nameLen  + sizeof(EspFsHeader);
 			r->posStart=it.position + it.header.nameLen  + sizeof(EspFsHeader);
 			r->posDecomp=0;
+			r->left=-1;
+			r->decompData=NULL;
+			r->ram=NULL;
+			espFsRamOpen(r, it.position, it.header.fileLenComp);
 			if (it.header.compression==COMPRESS_NONE) {
 				r->decompData=NULL;
+			} else if (it.header.compression==COMPRESS_HEATSHRINK) {
+				//the first byte has the parameters of the stream
+				uint8_t parm;
+				espFsFileRead(r, (char*)&parm, r->posComp, 1);
+				r->posComp++;
+				int w=parm>>4, l=parm&0xf;
+				HeatshrinkDecoder *hs=NULL;
+				if (w>=4 && w<=HEATSHRINK_MAX_WINDOW_BITS && l>=1 && l<w)
+					hs=(HeatshrinkDecoder *)os_zalloc(sizeof(HeatshrinkDecoder) + (1<<w));
+				if (hs==NULL) {
+					espFsClose(r);
+					return NULL;
+				}
+				hs->windowBits=w;
+				hs->lookaheadBits=l;
+				r->decompData=hs;
 			} else {
 #ifdef ESPFS_DBG
-				os_printf("Invalid compression: %d\n", h.compression);
+				os_printf("Invalid compression: %d\n", it.header.compression);
 #endif
+				espFsClose(r);
 				return NULL;
 			}
 			return r;
@@ -257,6 +567,56 @@ EspFsFile ICACHE_FLASH_ATTR *espFsOpen(EspFsContext *ctx, char *fileName) {
 	return NULL;
 }
 
+//Get n bits from a heatshrink stream, -1 at the end of the compressed data
+static int ICACHE_FLASH_ATTR hsGetBits(EspFsFile *fh, HeatshrinkDecoder *hs, int flen, int n) {
+	while (hs->nbits < n) {
+		if (hs->inPos == hs->inLen) {
+			int left=flen-(fh->posComp-fh->posStart);
+			if (left<=0) return -1;
+			if (left>(int)sizeof(hs->in)) left=sizeof(hs->in);
+			espFsFileRead(fh, (char*)hs->in, fh->posComp, left);
+			fh->posComp+=left;
+			hs->inPos=0;
+			hs->inLen=left;
+		}
+		hs->bits=(hs->bits<<8) | hs->in[hs->inPos++];
+		hs->nbits+=8;
+	}
+	hs->nbits-=n;
+	return (hs->bits>>hs->nbits) & ((1<<n)-1);
+}
+
+//Decompress up to len bytes of a heatshrink stream
+static int ICACHE_FLASH_ATTR hsRead(EspFsFile *fh, HeatshrinkDecoder *hs, int flen, char *buff, int len) {
+	uint16_t mask=(1<<hs->windowBits)-1;
+	int n=0;
+	while (n<len) {
+		uint8_t c;
+		if (hs->count>0) {
+			c=hs->window[(hs->head-hs->distance) & mask];
+			hs->count--;
+		} else {
+			int tag=hsGetBits(fh, hs, flen, 1);
+			if (tag<0) break;
+			if (tag) {
+				int b=hsGetBits(fh, hs, flen, 8);
+				if (b<0) break;
+				c=b;
+			} else {
+				int d=hsGetBits(fh, hs, flen, hs->windowBits);
+				int l=d<0 ? -1 : hsGetBits(fh, hs, flen, hs->lookaheadBits);
+				if (l<0) break;
+				hs->distance=d+1;
+				hs->count=l+1;
+				continue;
+			}
+		}
+		hs->window[hs->head++ & mask]=c;
+		buff[n++]=c;
+	}
+	return n;
+}
+
 //Read len bytes from the given file into buff. Returns the actual amount of bytes read.
 int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 	int flen, fdlen;
@@ -268,26 +628,76 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 	if (fh->decompressor==COMPRESS_NONE) {
 		int toRead;
 		toRead=flen-(fh->posComp-fh->posStart);
+		if (fh->left>=0 && toRead>fh->left) toRead=fh->left;
 		if (len>toRead) len=toRead;
 //		os_printf("Reading %d bytes from %x\n", len, (unsigned int)fh->posComp);
-		espfs_memcpyAligned(fh->ctx, buff, fh->posComp, len);
+		espFsFileRead(fh, buff, fh->posComp, len);
 		fh->posDecomp+=len;
 		fh->posComp+=len;
+		if (fh->left>=0) fh->left-=len;
 //		os_printf("Done reading %d bytes, pos=%x\n", len, fh->posComp);
 		return len;
+	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
+		if (len>fdlen-fh->posDecomp) len=fdlen-fh->posDecomp;
+		len=hsRead(fh, (HeatshrinkDecoder *)fh->decompData, flen, buff, len);
+		fh->posDecomp+=len;
+		return len;
 	}
 	return 0;
 }
 
+// Returns the number of bytes espFsRead returns for the whole file.
+int ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	int len;
+	if (fh==NULL) return 0;
+	if (fh->decompressor==COMPRESS_NONE)
+		espfs_memcpyAligned(fh->ctx, (char*)&len, (char*)&fh->header->fileLenComp, 4);
+	else
+		espfs_memcpyAligned(fh->ctx, (char*)&len, (char*)&fh->header->fileLenDecomp, 4);
+	return len;
+}
+
+// Restricts the following reads to len bytes starting at pos, for uncompressed files only.
+// Returns 0 if that's outside of the file.
+int ICACHE_FLASH_ATTR espFsRange(EspFsFile *fh, int pos, int len) {
+	if (fh==NULL || fh->decompressor!=COMPRESS_NONE) return 0;
+	int flen=espFsSize(fh);
+	if (pos<0 || len<0 || pos+len>flen) return 0;
+	fh->posComp=fh->posStart+pos;
+	fh->posDecomp=pos;
+	fh->left=len;
+	return 1;
+}
+
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
 	if (fh==NULL) return;
 	//os_printf("Freed %p\n", fh);
+	if (fh->decompData!=NULL) os_free(fh->decompData);
+	if (fh->ram!=NULL) {
+		fh->ram->users--;
+		//the image changed meanwhile, or the budget shrank below what's in use
+		if (fh->ram->header==NULL || espFsRamUsed > espFsRamBudget) espFsRamDrop(fh->ram);
+	}
 	os_free(fh);
 }
 
+// Copies the list of HTML pages stored in the image into buff, up to len bytes. Returns the
+// length of the list, -1 if the image has none.
+int ICACHE_FLASH_ATTR espFsPageList(EspFsContext *ctx, char *buff, int len) {
+	if (!ctx->valid || ctx->pages == NULL) return -1;
+	if (len > ctx->pagesLen) len = ctx->pagesLen;
+	if (buff != NULL && len > 0) espfs_memcpy(ctx, buff, ctx->pages, len);
+	return ctx->pagesLen;
+}
+
 // checks if the file system is valid (detect if the content is an espfs image or random data)
 int ICACHE_FLASH_ATTR espFsIsValid(EspFsContext *ctx) {
 	return ctx->valid;
 }
 
+// returns the address of the first byte past the image, NULL if there is no valid image
+char * ICACHE_FLASH_ATTR espFsImageEnd(EspFsContext *ctx) {
+	return ctx->valid ? ctx->end : NULL;
+}
+
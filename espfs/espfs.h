@@ -32,9 +32,21 @@ extern EspFsContext * userPageCtx;
 EspFsInitResult espFsInit(EspFsContext *ctx, void *flashAddress, EspFsSource source);
 EspFsFile *espFsOpen(EspFsContext *ctx, char *fileName);
 int espFsIsValid(EspFsContext *ctx);
+char *espFsImageEnd(EspFsContext *ctx);
+uint32_t espFsNameHash(const char *name);
 int espFsFlags(EspFsFile *fh);
+int espFsHash(EspFsFile *fh, uint32_t *hash);
 int espFsRead(EspFsFile *fh, char *buff, int len);
+int espFsSize(EspFsFile *fh);
+int espFsRange(EspFsFile *fh, int pos, int len);
 void espFsClose(EspFsFile *fh);
+int espFsPageList(EspFsContext *ctx, char *buff, int len);
+
+// sets the bytes of RAM used to keep copies of the files opened most often, 0 turns it off
+void espFsRamCacheSize(int bytes);
+
+// copies from memory mapped flash, which only allows aligned 32-bit reads
+void memcpyAligned(char *dst, const char *src, int len);
 
 void espFsIteratorInit(EspFsContext *ctx, EspFsIterator *iterator);
 int espFsIteratorNext(EspFsIterator *iterator);
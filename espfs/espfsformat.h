@@ -17,6 +17,11 @@ with the FLAG_LASTFILE flag set.
 
 #define FLAG_LASTFILE (1<<0)
 #define FLAG_GZIP (1<<1)
+#define FLAG_HASH (1<<2)
+#define FLAG_TEMPLATE (1<<3)
+#define FLAG_INDEX (1<<4)
+#define FLAG_SHARED (1<<5)
+#define FLAG_PAGES (1<<6)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
 #define ESPFS_MAGIC 0x73665345
@@ -30,4 +35,62 @@ typedef struct {
 	int32_t fileLenDecomp;
 } __attribute__((packed)) EspFsHeader;
 
+/*
+Files with FLAG_HASH have a 32-bit FNV-1a hash of their data as stored in the image in the last
+4 bytes of the name field, behind the null-terminated name and its padding. The httpd uses it as
+ETag. Readers that don't know about the flag just see a longer name field.
+*/
+/*
+Files with FLAG_TEMPLATE are templates that have been split up into segments by mkespfsimage so
+the httpd doesn't need to look for %token% markers. Each segment starts with a 16-bit little
+endian header: the low 15 bits are the length, the top bit is set for a token. A literal
+segment is followed by that many bytes of text, a token segment by the name of the token
+without the % and not null-terminated.
+*/
+/*
+Files with FLAG_SHARED have the same data as a file earlier in the image and don't store it
+again: their data is the 32-bit offset of the header of that file from the start of the image.
+The flags, compression and hash of that file apply.
+*/
+/*
+If the header with FLAG_LASTFILE also has FLAG_INDEX, it's followed by an index of the files
+that's fileLenComp bytes long: an EspFsIndexEntry for each file, sorted by the hash of the name
+and by the position in the image for equal hashes. The name is hashed like the data, without
+the null terminator. Readers that don't know about the flag stop at the last header anyway.
+*/
+/*
+If the header with FLAG_LASTFILE has FLAG_PAGES, the index (or the header if there is none) is
+followed by a 32-bit length and the list of the HTML pages in the image, formatted the way the
+menu shows them. The web-server upload writes it so the list doesn't have to be built by going
+over all the files at boot.
+*/
+typedef struct {
+	uint32_t hash;    // hash of the file name
+	uint32_t offset;  // offset of the file header from the start of the image
+} __attribute__((packed)) EspFsIndexEntry;
+
+/*
+Files with COMPRESS_HEATSHRINK are LZSS compressed the way heatshrink does it: the first byte
+holds the window size in bits in the top 4 bits and the lookahead size in bits in the low 4.
+Then comes a stream of bits, most significant bit first: a 1 followed by a literal byte, or a 0
+followed by the distance-1 of a back reference (window bits) and its length-1 (lookahead bits).
+fileLenDecomp says where the stream ends, the last byte is padded with zeroes.
+*/
+#define HEATSHRINK_WINDOW_BITS 11
+#define HEATSHRINK_LOOKAHEAD_BITS 4
+
+/*
+Compressed firmware for the OTA upload (not part of an espfs image): FW_HEATSHRINK_MAGIC, the
+length of the uncompressed firmware (4 bytes) and then the firmware compressed the same way as a
+COMPRESS_HEATSHRINK file, starting with the window/lookahead byte. mkespfsimage -z makes one.
+*/
+#define FW_HEATSHRINK_MAGIC 0x31534845 // "EHS1"
+
+#define TPL_TOKEN 0x8000
+#define TPL_LEN_MAX 0x7fff
+#define TPL_TOKEN_MAX 63
+
+#define ESPFS_HASH_INIT 2166136261u
+#define ESPFS_HASH_STEP(h, c) (((h) ^ (uint8_t)(c)) * 16777619u)
+
 #endif
\ No newline at end of file
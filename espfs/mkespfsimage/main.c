@@ -18,6 +18,7 @@
 #include <arpa/inet.h>
 #endif
 #include "espfsformat.h"
+#include <pthread.h>
 
 //Gzip
 #ifdef ESPFS_GZIP
@@ -81,6 +82,59 @@ size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
 
 char **gzipExtensions = NULL;
 
+#endif
+
+//Heatshrink: LZSS with the format described in espfsformat.h
+typedef struct {
+	char *out;
+	int len, bits, nbits;
+} BitWriter;
+
+static void hsPutBits(BitWriter *w, int value, int n) {
+	while (n-->0) {
+		w->bits=(w->bits<<1) | ((value>>n)&1);
+		if (++w->nbits==8) {
+			w->out[w->len++]=w->bits;
+			w->bits=w->nbits=0;
+		}
+	}
+}
+
+int compressHeatshrink(char *in, int insize, char *out) {
+	int window=1<<HEATSHRINK_WINDOW_BITS;
+	int lookahead=1<<HEATSHRINK_LOOKAHEAD_BITS;
+	int pos=0;
+	BitWriter w={ out, 0, 0, 0 };
+	out[w.len++]=(HEATSHRINK_WINDOW_BITS<<4) | HEATSHRINK_LOOKAHEAD_BITS;
+	while (pos<insize) {
+		//find the longest match in the window, back references may overlap what they produce
+		int bestLen=0, bestDist=0, dist, len;
+		int maxLen=insize-pos < lookahead ? insize-pos : lookahead;
+		for (dist=1; dist<=window && dist<=pos; dist++) {
+			for (len=0; len<maxLen && in[pos+len]==in[pos-dist+len]; len++) ;
+			if (len>bestLen) {
+				bestLen=len;
+				bestDist=dist;
+				if (len==maxLen) break;
+			}
+		}
+		//a back reference takes 1+window+lookahead bits, a literal 9
+		if (bestLen*9 > 1+HEATSHRINK_WINDOW_BITS+HEATSHRINK_LOOKAHEAD_BITS) {
+			hsPutBits(&w, 0, 1);
+			hsPutBits(&w, bestDist-1, HEATSHRINK_WINDOW_BITS);
+			hsPutBits(&w, bestLen-1, HEATSHRINK_LOOKAHEAD_BITS);
+			pos+=bestLen;
+		} else {
+			hsPutBits(&w, 1, 1);
+			hsPutBits(&w, (unsigned char)in[pos], 8);
+			pos++;
+		}
+	}
+	if (w.nbits>0) hsPutBits(&w, 0, 8-w.nbits);
+	return w.len;
+}
+
+#ifdef ESPFS_GZIP
 int shouldCompressGzip(char *name) {
 	char *ext = name + strlen(name);
 	while (*ext != '.') {
@@ -130,109 +184,382 @@ int parseGzipExtensions(char *input) {
 }
 #endif
 
-int handleFile(int f, char *name, int compression, int level, char **compName, off_t *csizePtr) {
+int isTemplate(char *name) {
+	int len = strlen(name);
+	return len > 4 && strcmp(name + len - 4, ".tpl") == 0;
+}
+
+//Append a template segment header
+static void tplSegment(char *out, off_t *pos, int len, int token) {
+	out[(*pos)++] = len;
+	out[(*pos)++] = (len >> 8) | (token ? TPL_TOKEN >> 8 : 0);
+}
+
+//Split a template up into literal text and %token% segments, see espfsformat.h. "%%" stands
+//for a single %, a % without a closing one is taken literally.
+char *compileTemplate(char *in, off_t size, off_t *outSize, char *name) {
+	//worst case each char is a segment of its own
+	char *out = malloc(size*3 + 2);
+	if (out == NULL) {
+		fprintf(stderr, "%s: out of memory compiling the template\n", name);
+		exit(1);
+	}
+	off_t o = 0, lit = -1, i = 0;
+	while (i < size) {
+		off_t end = i+1;
+		if (in[i] == '%') {
+			while (end < size && in[end] != '%') end++;
+		}
+		//a % that's too far from the next one isn't a token but text, e.g. percentages in CSS
+		if (in[i] == '%' && end < size && end > i+1 && end-i-1 <= TPL_TOKEN_MAX) {
+			//token
+			int len = end-i-1;
+			tplSegment(out, &o, len, 1);
+			memcpy(out+o, in+i+1, len);
+			o += len;
+			lit = -1;
+			i = end+1;
+			continue;
+		}
+		//literal char, "%%" adds the second %
+		if (lit < 0 || o - lit - 2 == TPL_LEN_MAX) {
+			lit = o;
+			o += 2;
+		}
+		out[o++] = in[i];
+		out[lit] = o - lit - 2;
+		out[lit+1] = (o - lit - 2) >> 8;
+		i = in[i] == '%' && end == i+1 && end < size ? i+2 : i+1;
+	}
+	*outSize = o;
+	return out;
+}
+
+//Index of the files written so far, it goes behind the last header
+static EspFsIndexEntry *fileIndex;
+static int indexCount, indexMax;
+static uint32_t imagePos;
+
+//Write to the image, keeping track of the position
+static void emit(const void *data, size_t len) {
+	write(1, data, len);
+	imagePos+=len;
+}
+
+static void indexFile(char *name) {
+	uint32_t hash=ESPFS_HASH_INIT;
+	char *c;
+	for (c=name; *c!=0; c++) hash=ESPFS_HASH_STEP(hash, *c);
+	if (indexCount==indexMax) {
+		indexMax=indexMax ? indexMax*2 : 64;
+		fileIndex=realloc(fileIndex, indexMax*sizeof(EspFsIndexEntry));
+		if (fileIndex==NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	fileIndex[indexCount].hash=hash;
+	fileIndex[indexCount].offset=imagePos;
+	indexCount++;
+}
+
+static int compareIndex(const void *a, const void *b) {
+	const EspFsIndexEntry *x=a, *y=b;
+	if (x->hash!=y->hash) return x->hash<y->hash ? -1 : 1;
+	return x->offset<y->offset ? -1 : x->offset>y->offset;
+}
+
+//A file that goes into the image. The files are compressed in parallel, then written in order.
+typedef struct {
+	char *path;         // file to read
+	char *name;         // name in the image
+	char *data;         // data as stored in the image
+	off_t size, csize;  // size of the file and of data
+	int8_t flags, compression;
+	uint32_t hash;      // hash of data, the ETag
+	uint32_t offset;    // offset of the header in the image
+	int ok;             // the file could be read
+	int cached;         // data came from the cache
+} Job;
+
+static Job *jobs;
+static int numJobs, nextJob;
+static int compType=COMPRESS_NONE, compLvl=-1;
+static char *cacheDir;
+static pthread_mutex_t jobLock=PTHREAD_MUTEX_INITIALIZER;
+
+//Part of the cache file names, bump it whenever the data stored for a file changes, e.g. the
+//template format, so files cached by an older mkespfsimage aren't reused
+#define CACHE_VERSION 2
+
+//Name of the cache file for a file's content and what decides how it's compressed
+static void cacheName(char *buf, int len, Job *j, char *fdat) {
+	uint32_t h1=ESPFS_HASH_INIT, h2=0x9e3779b9;
+	off_t i;
+	for (i=0; i<j->size; i++) {
+		h1=ESPFS_HASH_STEP(h1, fdat[i]);
+		h2=(h2^(uint8_t)fdat[i])*0x01000193 + 0x7f4a7c15;
+	}
+	int kind=isTemplate(j->name) ? 1 : 0;
+#ifdef ESPFS_GZIP
+	if (!kind && shouldCompressGzip(j->name)) kind=2;
+#endif
+	snprintf(buf, len, "%s/%08x%08x-%lx-%d-%d-%d-v%d", cacheDir, h1, h2, (long)j->size,
+		kind, compType, compLvl, CACHE_VERSION);
+}
+
+//Get the stored data from the cache, returns 0 if it's not there
+static int cacheRead(Job *j, char *file) {
+	struct stat st;
+	int f=open(file, O_RDONLY);
+	if (f<0) return 0;
+	if (fstat(f, &st)<0 || st.st_size<2) {
+		close(f);
+		return 0;
+	}
+	char *buf=malloc(st.st_size);
+	int ok=read(f, buf, st.st_size)==st.st_size;
+	close(f);
+	if (!ok) {
+		free(buf);
+		return 0;
+	}
+	j->flags=buf[0];
+	j->compression=buf[1];
+	j->csize=st.st_size-2;
+	j->data=malloc(j->csize+1);
+	memcpy(j->data, buf+2, j->csize);
+	free(buf);
+	return 1;
+}
+
+//Put stored data into the cache, through a temporary file so other builds never see half of it
+static void cacheWrite(Job *j, char *file) {
+	char tmp[1200];
+	snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+	int f=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (f<0) return;
+	char hdr[2]={ j->flags, j->compression };
+	int ok=write(f, hdr, 2)==2 && write(f, j->data, j->csize)==j->csize;
+	close(f);
+	if (!ok || rename(tmp, file)<0) unlink(tmp);
+}
+
+//Read and compress a file
+static void compressFile(Job *j) {
 	char *fdat, *cdat;
 	off_t size, csize;
-	EspFsHeader h;
-	int nameLen;
-	int8_t flags = 0;
+	int compression=compType;
+	int8_t flags=0;
+	char cacheFile[1100];
+	int f=open(j->path, O_RDONLY);
+	if (f<0) {
+		perror(j->path);
+		return;
+	}
 	size=lseek(f, 0, SEEK_END);
 	fdat=mmap(NULL, size, PROT_READ, MAP_SHARED, f, 0);
 	if (fdat==MAP_FAILED) {
 		perror("mmap");
-		return 0;
+		close(f);
+		return;
+	}
+	j->size=size;
+
+	if (cacheDir!=NULL) {
+		cacheName(cacheFile, sizeof(cacheFile), j, fdat);
+		if (cacheRead(j, cacheFile)) {
+			j->cached=1;
+			j->ok=1;
+			munmap(fdat, size);
+			close(f);
+			return;
+		}
 	}
 
+	if (isTemplate(j->name)) {
+		//templates are streamed through the token callbacks, they can't be compressed
+		cdat=compileTemplate(fdat, size, &csize, j->name);
+		compression = COMPRESS_NONE;
+		flags = FLAG_TEMPLATE;
+	} else
 #ifdef ESPFS_GZIP
-	if (shouldCompressGzip(name)) {
+	if (shouldCompressGzip(j->name)) {
 		csize = size*3;
 		if (csize<100) // gzip has some headers that do not fit when trying to compress small files
 			csize = 100; // enlarge buffer if this is the case
 		cdat=malloc(csize);
-		csize=compressGzip(fdat, size, cdat, csize, level);
+		csize=compressGzip(fdat, size, cdat, csize, compLvl);
 		compression = COMPRESS_NONE;
 		flags = FLAG_GZIP;
 	} else
 #endif
+	if (compression==COMPRESS_HEATSHRINK) {
+		cdat=malloc(size+size/8+16);
+		csize=compressHeatshrink(fdat, size, cdat);
+	} else
 	if (compression==COMPRESS_NONE) {
 		csize=size;
-		cdat=fdat;
+		cdat=NULL;
 	} else {
 		fprintf(stderr, "Unknown compression - %d\n", compression);
 		exit(1);
 	}
 
-	if (csize>size) {
+	if (csize>size && !(flags & FLAG_TEMPLATE)) {
 		//Compressing enbiggened this file. Revert to uncompressed store.
 		compression=COMPRESS_NONE;
 		csize=size;
-		cdat=fdat;
+		free(cdat);
+		cdat=NULL;
 		flags=0;
 	}
+	if (cdat==NULL) {
+		cdat=malloc(size+1);
+		memcpy(cdat, fdat, size);
+	}
+	munmap(fdat, size);
+	close(f);
+
+	j->data=cdat;
+	j->csize=csize;
+	j->flags=flags;
+	j->compression=compression;
+	j->ok=1;
+	if (cacheDir!=NULL) cacheWrite(j, cacheFile);
+}
+
+static void *compressWorker(void *arg) {
+	(void)arg; //jobs are handed out through nextJob
+	while (1) {
+		pthread_mutex_lock(&jobLock);
+		int i=nextJob++;
+		pthread_mutex_unlock(&jobLock);
+		if (i>=numJobs) return NULL;
+		compressFile(jobs+i);
+	}
+}
 
-	//Fill header data
+//Write the header and name of a file
+static void writeHeader(Job *j, int8_t flags, int compression, int32_t len, int32_t lenDecomp,
+		int withHash) {
+	EspFsHeader h;
+	int nameLen;
 	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
 	h.flags=flags;
 	h.compression=compression;
-	h.nameLen=nameLen=strlen(name)+1;
+	h.nameLen=nameLen=strlen(j->name)+1;
 	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
+	if (withHash) h.nameLen+=4;
 	h.nameLen=htoxs(h.nameLen);
-	h.fileLenComp=htoxl(csize);
-	h.fileLenDecomp=htoxl(size);
+	h.fileLenComp=htoxl(len);
+	h.fileLenDecomp=htoxl(lenDecomp);
 
-	write(1, &h, sizeof(EspFsHeader));
-	write(1, name, nameLen);
+	j->offset=imagePos;
+	indexFile(j->name);
+	emit(&h, sizeof(EspFsHeader));
+	emit(j->name, nameLen);
 	while (nameLen&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		nameLen++;
 	}
-	write(1, cdat, csize);
+}
+
+//Write a file to the image. Data that's the same as that of a file written earlier is only
+//stored once, the file then just points at the other one.
+static void writeFile(int n, char **compName) {
+	Job *j=jobs+n;
+	off_t i, csize=j->csize;
+	uint32_t hash=ESPFS_HASH_INIT;
+
+	//Hash what goes into the image, it's sent as ETag
+	for (i=0; i<csize; i++) hash=ESPFS_HASH_STEP(hash, j->data[i]);
+	j->hash=hash;
+
+	*compName = "unknown";
+	if (j->compression==COMPRESS_NONE) {
+		*compName = j->flags & FLAG_GZIP ? "gzip" : "none";
+	} else if (j->compression==COMPRESS_HEATSHRINK) {
+		*compName = "heatshrink";
+	}
+	if (j->flags & FLAG_TEMPLATE) *compName = "template";
+
+	for (i=0; i<n; i++) {
+		Job *o=jobs+i;
+		if (o->ok && o->hash==hash && o->csize==csize && o->flags==j->flags &&
+				o->compression==j->compression && memcmp(o->data, j->data, csize)==0) {
+			uint32_t offset=htoxl(o->offset);
+			writeHeader(j, FLAG_SHARED, COMPRESS_NONE, 4, 4, 0);
+			emit(&offset, 4);
+			*compName = "shared";
+			return;
+		}
+	}
+
+	writeHeader(j, j->flags|FLAG_HASH, j->compression, csize, j->size, 1);
+	hash=htoxl(hash);
+	emit(&hash, 4);
+	emit(j->data, csize);
 	//Pad out to 32bit boundary
 	while (csize&3) {
-		write(1, "\000", 1);
+		emit("\000", 1);
 		csize++;
 	}
-	munmap(fdat, size);
-
-	if (compName != NULL) {
-		if (h.compression==COMPRESS_NONE) {
-			if (h.flags & FLAG_GZIP) {
-				*compName = "gzip";
-			} else {
-				*compName = "none";
-			}
-		} else {
-			*compName = "unknown";
-		}
-	}
-  *csizePtr = csize;
-	return (csize*100)/size;
 }
 
-//Write final dummy header with FLAG_LASTFILE set.
+//Write final dummy header with FLAG_LASTFILE set, followed by the index.
 void finishArchive() {
 	EspFsHeader h;
+	int i;
 	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
-	h.flags=FLAG_LASTFILE;
+	h.flags=FLAG_LASTFILE|FLAG_INDEX;
 	h.compression=COMPRESS_NONE;
 	h.nameLen=htoxs(0);
-	h.fileLenComp=htoxl(0);
-	h.fileLenDecomp=htoxl(0);
-	write(1, &h, sizeof(EspFsHeader));
+	h.fileLenComp=htoxl(indexCount*sizeof(EspFsIndexEntry));
+	h.fileLenDecomp=h.fileLenComp;
+	emit(&h, sizeof(EspFsHeader));
+	qsort(fileIndex, indexCount, sizeof(EspFsIndexEntry), compareIndex);
+	for (i=0; i<indexCount; i++) {
+		EspFsIndexEntry e;
+		e.hash=htoxl(fileIndex[i].hash);
+		e.offset=htoxl(fileIndex[i].offset);
+		emit(&e, sizeof(e));
+	}
+}
+
+//Compress a firmware image for the OTA upload, see FW_HEATSHRINK_MAGIC
+int compressFirmware(void) {
+	int size=0, maxSize=65536, n;
+#ifdef __WIN32__
+	setmode(fileno(stdin), _O_BINARY);
+#endif
+	char *in=malloc(maxSize);
+	while ((n=fread(in+size, 1, maxSize-size, stdin))>0) {
+		size+=n;
+		if (size==maxSize) {
+			maxSize*=2;
+			in=realloc(in, maxSize);
+		}
+	}
+	char *out=malloc(size+size/8+16);
+	int csize=compressHeatshrink(in, size, out);
+	int hdr[2]={ htoxl(FW_HEATSHRINK_MAGIC), htoxl(size) };
+	fwrite(hdr, 1, sizeof(hdr), stdout);
+	fwrite(out, 1, csize, stdout);
+	fprintf(stderr, "firmware: %d bytes compressed to %d (%d%%)\n", size, csize+8,
+		size ? (int)(((long)csize+8)*100/size) : 100);
+	return 0;
 }
 
 int main(int argc, char **argv) {
-	int f, x;
+	int x;
 	char fileName[1024];
 	char *realName;
 	struct stat statBuf;
 	int serr;
-	int rate;
 	int err=0;
-	int compType;  //default compression type - heatshrink
-	int compLvl=-1;
-
-	compType = COMPRESS_NONE;
+	int numThreads=0;
+	int firmware=0;
 
 	for (x=1; x<argc; x++) {
 		if (strcmp(argv[x], "-c")==0 && argc>=x-2) {
@@ -242,6 +569,15 @@ int main(int argc, char **argv) {
 			compLvl=atoi(argv[x+1]);
 			if (compLvl<1 || compLvl>9) err=1;
 			x++;
+		} else if (strcmp(argv[x], "-j")==0 && argc>=x-2) {
+			numThreads=atoi(argv[x+1]);
+			if (numThreads<1) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-z")==0) {
+			firmware=1;
+		} else if (strcmp(argv[x], "-C")==0 && argc>=x-2) {
+			cacheDir=argv[x+1];
+			x++;
 #ifdef ESPFS_GZIP
 		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
 			if (!parseGzipExtensions(argv[x+1])) err=1;
@@ -264,13 +600,18 @@ int main(int argc, char **argv) {
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "[-g gzipped_extensions] ");
 #endif
-		fprintf(stderr, "> out.espfs\n");
+		fprintf(stderr, "[-j threads] [-C cache_dir] > out.espfs\n");
+		fprintf(stderr, "       %s -z < user1.bin > user1.bin.hs\n", argv[0]);
 		fprintf(stderr, "Compressors:\n");
 		fprintf(stderr, "0 - None(default)\n");
+		fprintf(stderr, "1 - Heatshrink, for files that aren't gzipped, the esp decompresses them\n");
 		fprintf(stderr, "\nCompression level: 1 is worst but low RAM usage, higher is better compression \nbut uses more ram on decompression. -1 = compressors default.\n");
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "\nGzipped extensions: list of comma separated, case sensitive file extensions \nthat will be gzipped. Defaults to 'html,css,js'\n");
 #endif
+		fprintf(stderr, "\nThreads: number of files compressed at the same time, defaults to the number of cores.\n");
+		fprintf(stderr, "\nCache dir: keeps compressed files there, files whose content didn't change since the\nlast run aren't compressed again.\n");
+		fprintf(stderr, "\n-z: compresses a firmware image for the OTA upload instead of making an espfs image.\n");
 		exit(0);
 	}
 
@@ -278,6 +619,10 @@ int main(int argc, char **argv) {
 	setmode(fileno(stdout), _O_BINARY);
 #endif
 
+	if (firmware) return compressFirmware();
+
+	//Collect the files
+	int maxJobs=0;
 	while(fgets(fileName, sizeof(fileName), stdin)) {
 		//Kill off '\n' at the end
 		fileName[strlen(fileName)-1]=0;
@@ -288,23 +633,47 @@ int main(int argc, char **argv) {
 			realName=fileName;
 			if (fileName[0]=='.') realName++;
 			if (realName[0]=='/') realName++;
-			f=open(fileName, O_RDONLY);
-			if (f>0) {
-				char *compName = "unknown";
-        off_t csize;
-				rate=handleFile(f, realName, compType, compLvl, &compName, &csize);
-				fprintf(stderr, "%-16s (%3d%%, %s, %4u bytes)\n", realName, rate, compName, (uint32_t)csize);
-				close(f);
-			} else {
-				perror(fileName);
+			if (numJobs==maxJobs) {
+				maxJobs=maxJobs ? maxJobs*2 : 64;
+				jobs=realloc(jobs, maxJobs*sizeof(Job));
 			}
+			memset(jobs+numJobs, 0, sizeof(Job));
+			jobs[numJobs].path=strdup(fileName);
+			jobs[numJobs].name=jobs[numJobs].path + (realName-fileName);
+			numJobs++;
 		} else {
 			if (serr!=0) {
 				perror(fileName);
 			}
 		}
 	}
+
+	//Compress them on all cores
+	if (numThreads==0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		numThreads=sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (numThreads<1) numThreads=1;
+	}
+	if (numThreads>numJobs) numThreads=numJobs;
+	pthread_t *threads=malloc((numThreads+1)*sizeof(pthread_t));
+	for (x=0; x<numThreads; x++) {
+		if (pthread_create(threads+x, NULL, compressWorker, NULL)!=0) break;
+	}
+	compressWorker(NULL); //lend a hand, makes sure it's done even if no thread could be started
+	while (x-->0) pthread_join(threads[x], NULL);
+
+	//Write the image in the order of the list
+	for (x=0; x<numJobs; x++) {
+		Job *j=jobs+x;
+		char *compName;
+		if (!j->ok) continue;
+		uint32_t start=imagePos;
+		writeFile(x, &compName);
+		fprintf(stderr, "%-16s (%3d%%, %s%s, %4u bytes)\n", j->name,
+			j->size ? (int)((j->csize*100)/j->size) : 100, compName, j->cached ? ", cached" : "",
+			(uint32_t)(imagePos-start));
+	}
 	finishArchive();
 	return 0;
 }
-
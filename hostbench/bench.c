@@ -0,0 +1,361 @@
+// Host microbenchmarks for the protocol hot paths: SLIP framing and CRC, command dispatch and
+// responses, MQTT message assembly and parsing, packet buffers. The absolute numbers say
+// little about the esp8266, but they move together with it, so comparing runs before and
+// after a change catches regressions without hardware.
+//
+// Usage: bench [-n scale] [-v]
+//   -n  multiply the iteration counts, default 1
+//   -v  let the os_printf debug output through
+
+#include <time.h>
+#include <unistd.h>
+#include <esp8266.h>
+#include "cmd.h"
+#include "slip.h"
+#include "crc16.h"
+#include "mqtt_msg.h"
+#include "pktbuf.h"
+#include "stubs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0ULL
+#endif
+
+//===== Command handlers the benchmarks dispatch to
+
+static uint32_t handled; // packets that made it through to a handler
+static uint32_t streamed; // bytes that made it through to a stream handler
+
+static void ICACHE_FLASH_ATTR
+benchPublish(CmdPacket *cmd) {
+  CmdRequest req;
+  uint8_t topic[64], data[256];
+  cmdRequest(&req, cmd);
+  uint16_t len = cmdArgLen(&req);
+  if (len > sizeof(topic) || cmdPopArg(&req, topic, len)) return;
+  len = cmdArgLen(&req);
+  if (len > sizeof(data) || cmdPopArg(&req, data, len)) return;
+  handled++;
+}
+
+static void ICACHE_FLASH_ATTR
+benchStream(CmdStream *st, const uint8_t *data, uint16_t len) {
+  if (data == NULL) {
+    if (st->ok) handled++;
+    return;
+  }
+  streamed += len;
+}
+
+const CmdList commands[] = {
+  {CMD_MQTT_PUBLISH, "MQTT_PUB", benchPublish},
+  {CMD_NULL,         NULL,       NULL},
+};
+
+const CmdStreamList streamCommands[] = {
+  {CMD_SOCKET_SEND,  benchStream},
+  {CMD_NULL,         NULL},
+};
+
+//===== Packet construction, same format the MCU side produces
+
+static uint8_t pkt[4096];   // raw packet
+static uint16_t pkt_len;
+static uint8_t frame[8192]; // SLIP frame
+static uint16_t frame_len;
+
+static void
+pktStart(uint16_t cmd, uint32_t value, uint16_t argc) {
+  CmdPacket hdr = { cmd, argc, value };
+  memcpy(pkt, &hdr, sizeof(hdr));
+  pkt_len = sizeof(hdr);
+}
+
+static void
+pktArg(const void *data, uint16_t len) {
+  memcpy(pkt+pkt_len, &len, 2);
+  memcpy(pkt+pkt_len+2, data, len);
+  pkt_len += 2 + len;
+  while (pkt_len & 3) pkt[pkt_len++] = 0; // args start on 4-byte boundaries
+}
+
+// SLIP-encode the first len bytes of pkt into frame
+static void
+pktSlip(uint16_t len) {
+  frame_len = 0;
+  frame[frame_len++] = SLIP_END;
+  for (uint16_t i=0; i<len; i++) {
+    if (pkt[i] == SLIP_END) {
+      frame[frame_len++] = SLIP_ESC; frame[frame_len++] = SLIP_ESC_END;
+    } else if (pkt[i] == SLIP_ESC) {
+      frame[frame_len++] = SLIP_ESC; frame[frame_len++] = SLIP_ESC_ESC;
+    } else {
+      frame[frame_len++] = pkt[i];
+    }
+  }
+  frame[frame_len++] = SLIP_END;
+}
+
+// CRC and SLIP-encode pkt into frame
+static void
+pktFrame(void) {
+  uint16_t crc = crc16_data(pkt, pkt_len, 0);
+  memcpy(pkt+pkt_len, &crc, 2);
+  pktSlip(pkt_len+2);
+}
+
+// SLIP-encode a channel frame, which has no command header and no CRC
+static void
+pktChannel(uint8_t ctl, const void *data, uint16_t len) {
+  pkt[0] = SLIP_CHAN;
+  pkt[1] = ctl;
+  memcpy(pkt+2, data, len);
+  pkt_len = 2 + len;
+  pktSlip(pkt_len);
+}
+
+static void
+fill(uint8_t *buf, uint16_t len, uint8_t seed) {
+  for (uint16_t i=0; i<len; i++) buf[i] = (i*7 + seed) & 0xff; // includes SLIP_END and SLIP_ESC
+}
+
+//===== Timing
+
+typedef struct {
+  const char *name;
+  uint32_t   iter;      // iterations at scale 1
+  uint32_t   (*run)(uint32_t n); // runs n iterations, returns bytes processed
+} Bench;
+
+static double
+now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void
+report(const Bench *b, uint32_t n) {
+  double t0 = now();
+  unsigned long long c0 = CYCLES();
+  uint32_t bytes = b->run(n);
+  unsigned long long c1 = CYCLES();
+  double t = now() - t0;
+  printf("%-24s %9u %10.1f %10.0f %10.2f\n", b->name, n, t*1e9/n, (double)(c1-c0)/n,
+      bytes/t/1e6);
+}
+
+//===== Workloads
+
+static uint8_t block[1024];
+static uint8_t out[2*1024];
+
+static uint32_t
+runCrc(uint32_t n) {
+  unsigned short crc = 0;
+  for (uint32_t i=0; i<n; i++) crc = crc16_data(block, sizeof(block), crc);
+  if (crc == 0x1234) printf("\n"); // keep the result alive
+  return n*sizeof(block);
+}
+
+static uint32_t
+runCrcSlip(uint32_t n) {
+  unsigned short crc = 0;
+  for (uint32_t i=0; i<n; i++) crc16_slip(out, block, sizeof(block), &crc);
+  return n*sizeof(block);
+}
+
+// SLIP-decode and dispatch a small MQTT publish, fed in 64-byte chunks like the UART delivers
+static uint32_t
+runSlipPublish(uint32_t n) {
+  uint8_t topic[24], data[48];
+  fill(topic, sizeof(topic), 1);
+  fill(data, sizeof(data), 2);
+  uint8_t qos = 0, retain = 0;
+  pktStart(CMD_MQTT_PUBLISH, 0, 4);
+  pktArg(topic, sizeof(topic));
+  pktArg(data, sizeof(data));
+  pktArg(&qos, 1);
+  pktArg(&retain, 1);
+  pktFrame();
+  handled = 0;
+  for (uint32_t i=0; i<n; i++)
+    for (uint16_t off=0; off<frame_len; off+=64)
+      slip_parse_buf((char*)frame+off, frame_len-off < 64 ? frame_len-off : 64);
+  if (handled != n) printf("slip-publish: only %u of %u packets handled\n", handled, n);
+  return n*frame_len;
+}
+
+// SLIP-decode a 3KB packet that goes through the streaming path
+static uint32_t
+runSlipStream(uint32_t n) {
+  uint8_t data[3000];
+  fill(data, sizeof(data), 3);
+  pktStart(CMD_SOCKET_SEND, 0, 1);
+  pktArg(data, sizeof(data));
+  pktFrame();
+  handled = streamed = 0;
+  for (uint32_t i=0; i<n; i++)
+    for (uint16_t off=0; off<frame_len; off+=128)
+      slip_parse_buf((char*)frame+off, frame_len-off < 128 ? frame_len-off : 128);
+  if (handled != n) printf("slip-stream: only %u of %u packets handled\n", handled, n);
+  return n*frame_len;
+}
+
+// Same 3KB as channel data, as serbridge connections are carried with CMD_SYNC_CHANNELS
+static uint32_t
+runSlipChannel(uint32_t n) {
+  uint8_t data[3000];
+  fill(data, sizeof(data), 3);
+  pktChannel(SLIP_CHAN_DATA | 1, data, sizeof(data));
+  slip_set_channels(true);
+  stub_channel = 0;
+  for (uint32_t i=0; i<n; i++)
+    for (uint16_t off=0; off<frame_len; off+=128)
+      slip_parse_buf((char*)frame+off, frame_len-off < 128 ? frame_len-off : 128);
+  slip_set_channels(false);
+  if (stub_channel != n*sizeof(data))
+    printf("slip-channel: only %u of %u bytes passed on\n", stub_channel,
+        (uint32_t)(n*sizeof(data)));
+  return n*frame_len;
+}
+
+// Encode a callback response with a topic and a payload, as an MQTT delivery does
+static uint32_t
+runCmdResponse(uint32_t n) {
+  uint8_t topic[24], data[64];
+  fill(topic, sizeof(topic), 4);
+  fill(data, sizeof(data), 5);
+  stub_uart_bytes = 0;
+  for (uint32_t i=0; i<n; i++) {
+    cmdResponseStart(CMD_RESP_CB, 0x1234, 2);
+    cmdResponseBody(topic, sizeof(topic));
+    cmdResponseBody(data, sizeof(data));
+    cmdResponseEnd();
+  }
+  return stub_uart_bytes;
+}
+
+// Encode channel frames of a TCP segment's worth of data
+static uint32_t
+runCmdChannel(uint32_t n) {
+  uint8_t data[1460];
+  fill(data, sizeof(data), 5);
+  stub_uart_bytes = 0;
+  for (uint32_t i=0; i<n; i++) cmdChannelSend(SLIP_CHAN_DATA | 1, data, sizeof(data));
+  return stub_uart_bytes;
+}
+
+// Same responses collected into batch frames of 8
+static uint32_t
+runCmdBatch(uint32_t n) {
+  uint8_t topic[24], data[64];
+  fill(topic, sizeof(topic), 4);
+  fill(data, sizeof(data), 5);
+  stub_uart_bytes = 0;
+  for (uint32_t i=0; i<n; i+=8) {
+    cmdBatchBegin(false);
+    for (uint32_t j=i; j<i+8 && j<n; j++) {
+      cmdResponseStart(CMD_RESP_CB, 0x1234, 2);
+      cmdResponseBody(topic, sizeof(topic));
+      cmdResponseBody(data, sizeof(data));
+      cmdResponseEnd();
+    }
+    cmdBatchEnd();
+  }
+  return stub_uart_bytes;
+}
+
+static uint8_t mqtt_buf[1024];
+
+static uint32_t
+runMqttPublish(uint32_t n) {
+  mqtt_connection_t conn;
+  uint8_t data[100];
+  fill(data, sizeof(data), 6);
+  uint32_t bytes = 0;
+  mqtt_msg_init(&conn, mqtt_buf, sizeof(mqtt_buf));
+  for (uint32_t i=0; i<n; i++) {
+    uint16_t id;
+    mqtt_message_t *msg = mqtt_msg_publish(&conn, "esp-link/bench/topic", (char*)data,
+        sizeof(data), i&1, 0, &id);
+    bytes += msg->length;
+  }
+  return bytes;
+}
+
+static uint32_t
+runMqttParse(uint32_t n) {
+  mqtt_connection_t conn;
+  uint8_t data[100];
+  fill(data, sizeof(data), 7);
+  uint16_t id;
+  mqtt_msg_init(&conn, mqtt_buf, sizeof(mqtt_buf));
+  mqtt_message_t *msg = mqtt_msg_publish(&conn, "esp-link/bench/topic", (char*)data,
+      sizeof(data), 1, 0, &id);
+  uint32_t bytes = 0;
+  for (uint32_t i=0; i<n; i++) {
+    uint16_t len = msg->length;
+    int total = mqtt_get_total_length(msg->data, len);
+    const char *topic = mqtt_get_publish_topic(msg->data, &len);
+    len = msg->length;
+    const char *payload = mqtt_get_publish_data(msg->data, &len);
+    if (topic == NULL || payload == NULL) return 0;
+    bytes += total;
+  }
+  return bytes;
+}
+
+static uint32_t
+runPktBuf(uint32_t n) {
+  PktBuf *head = NULL;
+  for (uint32_t i=0; i<n; i++) {
+    head = PktBuf_Push(head, PktBuf_New(128));
+    if ((i&3) == 3) {
+      while (head != NULL) head = PktBuf_ShiftFree(head);
+    }
+  }
+  while (head != NULL) head = PktBuf_ShiftFree(head);
+  return n*128;
+}
+
+static const Bench benches[] = {
+  { "crc16_data 1KB",       100000, runCrc },
+  { "crc16_slip 1KB",       100000, runCrcSlip },
+  { "slip rx publish",      500000, runSlipPublish },
+  { "slip rx stream 3KB",    20000, runSlipStream },
+  { "slip rx channel 3KB",   20000, runSlipChannel },
+  { "cmd response",         500000, runCmdResponse },
+  { "cmd response batched", 500000, runCmdBatch },
+  { "cmd channel 1460",      50000, runCmdChannel },
+  { "mqtt_msg_publish",    1000000, runMqttPublish },
+  { "mqtt parse publish",  1000000, runMqttParse },
+  { "pktbuf push/shift",   1000000, runPktBuf },
+};
+
+int
+main(int argc, char **argv) {
+  uint32_t scale = 1;
+  int c;
+  while ((c = getopt(argc, argv, "n:v")) != -1) {
+    switch (c) {
+    case 'n': scale = atoi(optarg); break;
+    case 'v': stub_quiet = false; break;
+    default:
+      fprintf(stderr, "Usage: %s [-n scale] [-v]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (scale < 1) scale = 1;
+
+  fill(block, sizeof(block), 0);
+  cmdPipelineReset(0);
+
+  printf("%-24s %9s %10s %10s %10s\n", "benchmark", "iter", "ns/op", "cycles/op", "MB/s");
+  for (size_t i=0; i<sizeof(benches)/sizeof(benches[0]); i++)
+    report(&benches[i], benches[i].iter*scale);
+  return 0;
+}
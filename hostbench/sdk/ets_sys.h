@@ -0,0 +1,24 @@
+// Minimal stand-in for the Espressif SDK header of the same name, just enough to build the
+// protocol code on the host for the benchmarks in ../bench.c
+
+#ifndef _ETS_SYS_H
+#define _ETS_SYS_H
+#include <c_types.h>
+typedef uint32_t ETSSignal;
+typedef uint32_t ETSParam;
+typedef struct ETSEventTag { ETSSignal sig; ETSParam par; } ETSEvent;
+typedef void (*ETSTask)(ETSEvent *e);
+typedef void ETSTimerFunc(void *timer_arg);
+typedef struct _ETSTIMER_ { struct _ETSTIMER_ *timer_next; uint32_t timer_expire; uint32_t timer_period; ETSTimerFunc *timer_func; void *timer_arg; } ETSTimer;
+#define ETS_UART_INUM 5
+#define ETS_GPIO_INUM 4
+#define ETS_FRC_TIMER1_INUM 9
+void ets_isr_attach(int, void*, void*);
+#define ETS_UART_INTR_ATTACH(func, arg) ets_isr_attach(ETS_UART_INUM, (func), (void *)(arg))
+#define ETS_UART_INTR_ENABLE() ets_isr_unmask(1 << ETS_UART_INUM)
+#define ETS_UART_INTR_DISABLE() ets_isr_mask(1 << ETS_UART_INUM)
+#define ETS_GPIO_INTR_ATTACH(func, arg) ets_isr_attach(ETS_GPIO_INUM, (func), (void *)(arg))
+#define ETS_GPIO_INTR_ENABLE() ets_isr_unmask(1 << ETS_GPIO_INUM)
+#define ETS_GPIO_INTR_DISABLE() ets_isr_mask(1 << ETS_GPIO_INUM)
+#define ETS_FRC_TIMER1_INTR_ATTACH(func, arg) ets_isr_attach(ETS_FRC_TIMER1_INUM, (func), (void *)(arg))
+#endif
@@ -0,0 +1,25 @@
+// Minimal stand-in for the Espressif SDK header of the same name, just enough to build the
+// protocol code on the host for the benchmarks in ../bench.c
+
+#ifndef _GPIO_H_
+#define _GPIO_H_
+#include <c_types.h>
+#include <eagle_soc.h>
+#define GPIO_PIN_ADDR(i) (GPIO_PIN0_ADDRESS + i*4)
+#define GPIO_ID_PIN0 0
+#define GPIO_ID_PIN(n) (GPIO_ID_PIN0+(n))
+#define GPIO_PIN_INTR_DISABLE 0
+#define GPIO_PIN_INTR_POSEDGE 1
+#define GPIO_PIN_INTR_NEGEDGE 2
+#define GPIO_PIN_INTR_ANYEDGE 3
+#define GPIO_OUTPUT_SET(gpio_no, bit_value) gpio_output_set((bit_value)<<gpio_no, ((~(bit_value))&0x01)<<gpio_no, 1<<gpio_no,0)
+#define GPIO_DIS_OUTPUT(gpio_no) gpio_output_set(0,0,0, 1<<gpio_no)
+#define GPIO_INPUT_GET(gpio_no) ((gpio_input_get()>>gpio_no)&BIT0)
+void gpio_output_set(uint32 set_mask, uint32 clear_mask, uint32 enable_mask, uint32 disable_mask);
+uint32 gpio_input_get(void);
+void gpio_pin_intr_state_set(uint32 i, int intr_state);
+void gpio_init(void);
+void gpio_intr_handler_register(void *fn, void *arg);
+uint32 gpio_intr_pending(void);
+void gpio_intr_ack(uint32 ack_mask);
+#endif
@@ -0,0 +1,24 @@
+// Minimal stand-in for the Espressif SDK header of the same name, just enough to build the
+// protocol code on the host for the benchmarks in ../bench.c
+
+#ifndef IP_ADDR_H
+#define IP_ADDR_H
+#include <c_types.h>
+struct ip_addr { uint32 addr; };
+typedef struct ip_addr ip_addr_t;
+struct ip_info { struct ip_addr ip; struct ip_addr netmask; struct ip_addr gw; };
+#define IP4_ADDR(ipaddr, a,b,c,d) (ipaddr)->addr = ((uint32)((d) & 0xff) << 24) | ((uint32)((c) & 0xff) << 16) | ((uint32)((b) & 0xff) << 8) | (uint32)((a) & 0xff)
+#define ip4_addr1(ipaddr) (((uint8*)(ipaddr))[0])
+#define ip4_addr2(ipaddr) (((uint8*)(ipaddr))[1])
+#define ip4_addr3(ipaddr) (((uint8*)(ipaddr))[2])
+#define ip4_addr4(ipaddr) (((uint8*)(ipaddr))[3])
+#define ip4_addr1_16(ipaddr) ((uint16)ip4_addr1(ipaddr))
+#define ip4_addr2_16(ipaddr) ((uint16)ip4_addr2(ipaddr))
+#define ip4_addr3_16(ipaddr) ((uint16)ip4_addr3(ipaddr))
+#define ip4_addr4_16(ipaddr) ((uint16)ip4_addr4(ipaddr))
+#define IP2STR(ipaddr) ip4_addr1_16(ipaddr), ip4_addr2_16(ipaddr), ip4_addr3_16(ipaddr), ip4_addr4_16(ipaddr)
+#define IPSTR "%d.%d.%d.%d"
+uint32 ipaddr_addr(const char *cp);
+#define IPADDR_ANY ((uint32)0x00000000UL)
+#define IPADDR_NONE ((uint32)0xffffffffUL)
+#endif
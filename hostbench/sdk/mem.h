@@ -0,0 +1,16 @@
+// Minimal stand-in for the Espressif SDK header of the same name, just enough to build the
+// protocol code on the host for the benchmarks in ../bench.c
+
+#ifndef __MEM_H__
+#define __MEM_H__
+#include <c_types.h>
+void *pvPortMalloc(size_t sz, const char *, unsigned);
+void vPortFree(void *p, const char *, unsigned);
+void *pvPortZalloc(size_t sz, const char *, unsigned);
+void *pvPortRealloc(void *p, size_t n, const char *, unsigned);
+#define os_free(s) vPortFree(s, "", 0)
+#define os_malloc(s) pvPortMalloc(s, "", 0)
+#define os_calloc(s,n) pvPortZalloc((s)*(n), "", 0)
+#define os_realloc(p, s) pvPortRealloc(p, s, "", 0)
+#define os_zalloc(s) pvPortZalloc(s, "", 0)
+#endif
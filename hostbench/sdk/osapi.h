@@ -0,0 +1,40 @@
+// Minimal stand-in for the Espressif SDK header of the same name, just enough to build the
+// protocol code on the host for the benchmarks in ../bench.c
+
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+#include <string.h>
+#include <c_types.h>
+#include <ets_sys.h>
+#include <user_config.h>
+#define os_bzero ets_bzero
+#define os_delay_us ets_delay_us
+#define os_install_putc1 ets_install_putc1
+#define os_memcmp ets_memcmp
+#define os_memcpy ets_memcpy
+#define os_memmove ets_memmove
+#define os_memset ets_memset
+#define os_strcat strcat
+#define os_strchr strchr
+#define os_strcmp ets_strcmp
+#define os_strcpy ets_strcpy
+#define os_strlen ets_strlen
+#define os_strncmp ets_strncmp
+#define os_strncpy ets_strncpy
+#define os_strstr ets_strstr
+#define os_timer_arm(a, b, c) ets_timer_arm_new(a, b, c, 1)
+#define os_timer_arm_us(a, b, c) ets_timer_arm_new(a, b, c, 0)
+#define os_timer_disarm ets_timer_disarm
+#define os_timer_setfn ets_timer_setfn
+#define os_sprintf ets_sprintf
+#define os_printf ets_printf
+#define os_random os_random
+void ets_delay_us(uint32);
+void ets_install_putc1(void *);
+size_t ets_strlen(const char *s);
+int ets_strncmp(const char *s1, const char *s2, int len);
+void ets_timer_arm_new(ETSTimer *a, int b, int c, int isMstimer);
+int ets_printf(const char *fmt, ...);
+unsigned long os_random(void);
+int os_get_random(unsigned char *buf, size_t len);
+#endif
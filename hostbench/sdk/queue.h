@@ -0,0 +1,10 @@
+// Minimal stand-in for the Espressif SDK header of the same name, just enough to build the
+// protocol code on the host for the benchmarks in ../bench.c
+
+#ifndef _SYS_QUEUE_H_
+#define _SYS_QUEUE_H_
+#define STAILQ_HEAD(name, type) struct name { struct type *stqh_first; struct type **stqh_last; }
+#define STAILQ_ENTRY(type) struct { struct type *stqe_next; }
+#define STAILQ_FIRST(head) ((head)->stqh_first)
+#define STAILQ_NEXT(elm, field) ((elm)->field.stqe_next)
+#endif
@@ -0,0 +1,59 @@
+// Host-side stand-ins for the SDK and esp-link functions that the protocol code calls, so
+// slip.c, cmd.c, crc16.c, mqtt_msg.c and pktbuf.c can be built and timed off-target.
+
+#include <stdarg.h>
+#include <esp8266.h>
+#include "cmd.h"
+#include "stubs.h"
+
+uint32_t stub_uart_bytes;  // bytes "transmitted" on UART0
+uint32_t stub_console;     // console characters seen by the slip parser
+uint32_t stub_channel;     // channel data bytes passed on by the slip parser
+bool stub_quiet = true;    // suppress os_printf output
+
+// SDK
+
+int ets_printf(const char *fmt, ...) {
+  if (stub_quiet) return 0;
+  va_list ap;
+  va_start(ap, fmt);
+  int r = vprintf(fmt, ap);
+  va_end(ap);
+  return r;
+}
+int os_printf_plus(const char *fmt, ...) {
+  if (stub_quiet) return 0;
+  va_list ap;
+  va_start(ap, fmt);
+  int r = vprintf(fmt, ap);
+  va_end(ap);
+  return r;
+}
+void system_set_os_print(uint8 onoff) { }
+
+void *ets_memset(void *d, int c, size_t n) { return memset(d, c, n); }
+void *ets_memcpy(void *d, const void *s, size_t n) { return memcpy(d, s, n); }
+void *ets_memmove(void *d, const void *s, size_t n) { return memmove(d, s, n); }
+int ets_memcmp(const void *a, const void *b, size_t n) { return memcmp(a, b, n); }
+size_t ets_strlen(const char *s) { return strlen(s); }
+char *ets_strcpy(char *d, const char *s) { return strcpy(d, s); }
+char *ets_strncpy(char *d, const char *s, size_t n) { return strncpy(d, s, n); }
+int ets_strcmp(const char *a, const char *b) { return strcmp(a, b); }
+int ets_strncmp(const char *a, const char *b, int n) { return strncmp(a, b, n); }
+char *ets_strstr(const char *h, const char *n) { return strstr(h, n); }
+
+void *pvPortMalloc(size_t sz, const char *f, unsigned l) { return malloc(sz); }
+void *pvPortZalloc(size_t sz, const char *f, unsigned l) { return calloc(1, sz); }
+void *pvPortRealloc(void *p, size_t sz, const char *f, unsigned l) { return realloc(p, sz); }
+void vPortFree(void *p, const char *f, unsigned l) { free(p); }
+
+uint32 system_get_time(void) { return 0; }
+
+// esp-link
+
+void uart0_tx_buffer(char *buf, uint16 len) { stub_uart_bytes += len; }
+void uart0_write_char(char c) { stub_uart_bytes++; }
+void console_process(char *buf, short len) { stub_console += len; }
+void serbridgeChannelRecv(uint8_t ctl, char *data, short len) { stub_channel += len; }
+
+bool cmdInSync = true;
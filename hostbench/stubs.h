@@ -0,0 +1,9 @@
+#ifndef STUBS_H
+#define STUBS_H
+
+extern uint32_t stub_uart_bytes;  // bytes "transmitted" on UART0
+extern uint32_t stub_console;     // console characters seen by the slip parser
+extern uint32_t stub_channel;     // channel data bytes passed on by the slip parser
+extern bool stub_quiet;           // suppress os_printf output
+
+#endif
@@ -49,6 +49,27 @@ function retryLoad(repeat) {
   fetchText(1000, repeat);
 }
 
+// Stream the text as it arrives using server-sent events, falls back to polling (or a single
+// fetch) if the browser can't do that
+function streamText(repeat) {
+  if (!window.EventSource) { fetchText(100, repeat); return; }
+  var el = $("#console");
+  if (el.textEnd == undefined) {
+    el.textEnd = 0;
+    el.innerHTML = "";
+  }
+  var es = new EventSource(console_url.replace(/text$/, "events") + "?start=" + el.textEnd);
+  es.addEventListener("gap", function(e) {
+    el.innerHTML = el.innerHTML.concat("\r\n<missing lines\r\n");
+  });
+  es.onmessage = function(e) {
+    // the id is the offset of the end of the text, it starts over if esp-link got reset
+    var end = parseInt(e.lastEventId);
+    var start = end < el.textEnd ? 0 : el.textEnd;
+    updateText({ start: start, len: end - start, text: e.data });
+  };
+}
+
 //===== Text entry
 
 function consoleSendInit() {
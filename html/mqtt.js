@@ -3,7 +3,7 @@
 function changeMqtt(e) {
   e.preventDefault();
   var url = "mqtt?1=1";
-  var i, inputs = document.querySelectorAll('#mqtt-form input');
+  var i, inputs = document.querySelectorAll('#mqtt-form input, #mqtt-form select');
   for (i = 0; i < inputs.length; i++) {
     if (inputs[i].type != "checkbox")
       url += "&" + inputs[i].name + "=" + inputs[i].value;
@@ -30,7 +30,7 @@ function displayMqtt(data) {
       else el.innerHTML = data[v];
       return;
     }
-    el = document.querySelector('input[name="' + v + '"]');
+    el = document.querySelector('input[name="' + v + '"], select[name="' + v + '"]');
     if (el != null) {
       if (el.type == "checkbox") el.checked = data[v] > 0;
       else el.value = data[v];
@@ -56,8 +56,13 @@ function fetchMqtt() {
 
 function changeMqttStatus(e) {
   e.preventDefault();
-  var v = document.querySelector('input[name="mqtt-status-topic"]').value;
-  ajaxSpin("POST", "/mqtt?mqtt-status-topic=" + v, function () {
+  var url = "/mqtt?1=1";
+  var i, inputs = document.querySelectorAll('#mqtt-status-form input');
+  for (i = 0; i < inputs.length; i++) {
+    if (inputs[i].type != "checkbox")
+      url += "&" + inputs[i].name + "=" + encodeURIComponent(inputs[i].value);
+  };
+  ajaxSpin("POST", url, function () {
     showNotification("MQTT status settings updated");
   }, function (s, st) {
     showWarning("Error: " + st);
@@ -65,6 +70,22 @@ function changeMqttStatus(e) {
   });
 }
 
+function changeMqttUart(e) {
+  e.preventDefault();
+  var url = "/mqtt?1=1";
+  var i, inputs = document.querySelectorAll('#mqtt-uart-form input');
+  for (i = 0; i < inputs.length; i++) {
+    if (inputs[i].type != "checkbox")
+      url += "&" + inputs[i].name + "=" + encodeURIComponent(inputs[i].value);
+  };
+  ajaxSpin("POST", url, function () {
+    showNotification("UART bridge settings updated");
+  }, function (s, st) {
+    showWarning("Error: " + st);
+    window.setTimeout(fetchMqtt, 100);
+  });
+}
+
 function setMqtt(name, v) {
   ajaxSpin("POST", "/mqtt?" + name + "=" + (v ? 1 : 0), function () {
     var n = name.replace("-enable", "");
@@ -1,7 +1,7 @@
 function changeServices(e) {
   e.preventDefault();
   var url = "services/update?1=1";
-  var i, inputs = document.querySelectorAll("#" + e.target.id + " input,select");
+  var i, inputs = document.querySelectorAll("#" + e.target.id + " input, #" + e.target.id + " select");
   for (i = 0; i < inputs.length; i++) {
     if (inputs[i].type == "checkbox") {
       if (inputs[i].name.slice(-6) == "enable")
@@ -50,6 +50,8 @@ function displayServices(data) {
   $("#syslog-spinner").setAttribute("hidden", "");
   $("#sntp-spinner").setAttribute("hidden", "");
   $("#mdns-spinner").setAttribute("hidden", "");
+  $("#bridge-spinner").setAttribute("hidden", "");
+  $("#perf-spinner").setAttribute("hidden", "");
 
   if (data.syslog_host !== undefined) {
     $("#Syslog-form").removeAttribute("hidden");
@@ -59,6 +61,8 @@ function displayServices(data) {
   }
   $("#SNTP-form").removeAttribute("hidden");
   $("#mDNS-form").removeAttribute("hidden");
+  $("#Bridge-form").removeAttribute("hidden");
+  $("#Perf-form").removeAttribute("hidden");
 
   var i, inputs = $("input");
   for (i = 0; i < inputs.length; i++) {
@@ -292,6 +292,8 @@ function showWifiInfo(data) {
   });
   var dhcp = $('#dhcp-r'+data.dhcp);
   if (dhcp) dhcp.click();
+  var fc = $("#wifi-fastconn");
+  if (fc) fc.checked = data.fastconn == 1;
   $("#wifi-spinner").setAttribute("hidden", "");
   $("#wifi-table").removeAttribute("hidden");
   currAp = data.ssid;
@@ -453,6 +455,7 @@ function displayPins(resp) {
   createSelectForPin("ser", resp["ser"]);
   $("#pin-swap").value = resp["swap"];
   $("#pin-rxpup").checked = !!resp["rxpup"];
+  $("#pin-flow").checked = !!resp["flow"];
   createPresets($("#pin-preset"));
 
   $("#pin-spinner").setAttribute("hidden", "");
@@ -474,6 +477,7 @@ function setPins(ev) {
     sep = "&";
   });
   url += "&rxpup=" + ($("#pin-rxpup").checked ? "1" : "0");
+  url += "&flow=" + ($("#pin-flow").checked ? "1" : "0");
 //  console.log("set pins: " + url);
   ajaxSpin("POST", url, function() {
     showNotification("Pin assignment changed");
@@ -182,6 +182,7 @@ function changeSpecial(e) {
   url += "&staticip=" + encodeURIComponent($("#wifi-staticip").value);
   url += "&netmask=" + encodeURIComponent($("#wifi-netmask").value);
   url += "&gateway=" + encodeURIComponent($("#wifi-gateway").value);
+  url += "&fastconn=" + ($("#wifi-fastconn").checked ? 1 : 0);
 
   hideWarning();
   var cb = $("#special-button");
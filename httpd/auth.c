@@ -16,11 +16,43 @@ HTTP auth implementation. Only does basic authentication for now.
 #include "auth.h"
 #include "base64.h"
 
+//"Basic " and the base64 of user:pass, longer headers can't match anyway
+#define AUTH_HDR_MAX (6+(AUTH_MAX_USER_LEN+AUTH_MAX_PASS_LEN+3)/3*4+1)
+
+//The last validated Authorization headers, per client IP and user/password callback. Polling
+//pages send the same header many times a second, a hit skips the decoding and the comparisons.
+//The whole header is kept, along with the time it was last validated.
+typedef struct {
+	uint8_t ip[4];
+	const void *getUserPw;
+	uint32_t time;		//system_get_time() of the last validation
+	char hdr[AUTH_HDR_MAX];
+} AuthCacheEntry;
+
+static AuthCacheEntry authCache[AUTH_CACHE_SIZE];
+
+//Returns the entry of the client, or the one to replace. NULL if the client's address is unknown.
+static AuthCacheEntry * ICACHE_FLASH_ATTR authCacheFind(HttpdConnData *connData, uint32_t now, bool *hit) {
+	*hit=false;
+	if (connData->conn->proto.tcp==NULL) return NULL;
+	uint8_t *ip=connData->conn->proto.tcp->remote_ip;
+	AuthCacheEntry *oldest=authCache;
+	for (int i=0; i<AUTH_CACHE_SIZE; i++) {
+		AuthCacheEntry *e=authCache+i;
+		if (e->getUserPw==connData->cgiArg && os_memcmp(e->ip, ip, 4)==0) {
+			*hit=(now - e->time) < AUTH_CACHE_TTL*1000;
+			return e;
+		}
+		if ((now - e->time) > (now - oldest->time) || e->getUserPw==NULL) oldest=e;
+	}
+	return oldest;
+}
+
 int ICACHE_FLASH_ATTR authBasic(HttpdConnData *connData) {
 	const char *forbidden="401 Forbidden.";
 	int no=0;
 	int r;
-	char hdr[(AUTH_MAX_USER_LEN+AUTH_MAX_PASS_LEN+2)*10];
+	char hdr[AUTH_HDR_MAX];
 	char userpass[AUTH_MAX_USER_LEN+AUTH_MAX_PASS_LEN+2];
 	char user[AUTH_MAX_USER_LEN];
 	char pass[AUTH_MAX_PASS_LEN];
@@ -31,22 +63,36 @@ int ICACHE_FLASH_ATTR authBasic(HttpdConnData *connData) {
 
 	r=httpdGetHeader(connData, "Authorization", hdr, sizeof(hdr));
 	if (r && strncmp(hdr, "Basic", 5)==0) {
-		r=base64_decode(strlen(hdr)-6, hdr+6, sizeof(userpass), (unsigned char *)userpass);
+		uint32_t now=system_get_time();
+		int hdrLen=strlen(hdr)+1;
+		bool hit;
+		AuthCacheEntry *e=authCacheFind(connData, now, &hit);
+		if (hit && os_memcmp(e->hdr, hdr, hdrLen)==0) return HTTPD_CGI_AUTHENTICATED;
+
+		r=base64_decode(strlen(hdr)-6, hdr+6, sizeof(userpass)-1, (unsigned char *)userpass);
 		if (r<0) r=0; //just clean out string on decode error
 		userpass[r]=0; //zero-terminate user:pass string
 //		os_printf("Auth: %s\n", userpass);
 		while (((AuthGetUserPw)(connData->cgiArg))(connData, no,
 				user, AUTH_MAX_USER_LEN, pass, AUTH_MAX_PASS_LEN)) {
 			//Check user/pass against auth header
-			if (strlen(userpass)==strlen(user)+strlen(pass)+1 &&
-					os_strncmp(userpass, user, strlen(user))==0 &&
-					userpass[strlen(user)]==':' &&
-					os_strcmp(userpass+strlen(user)+1, pass)==0) {
+			int userLen=strlen(user);
+			if (r==userLen+strlen(pass)+1 &&
+					os_strncmp(userpass, user, userLen)==0 &&
+					userpass[userLen]==':' &&
+					os_strcmp(userpass+userLen+1, pass)==0) {
 				//Authenticated. Yay!
+				if (e!=NULL) {
+					os_memcpy(e->ip, connData->conn->proto.tcp->remote_ip, 4);
+					e->getUserPw=connData->cgiArg;
+					os_memcpy(e->hdr, hdr, hdrLen);
+					e->time=now;
+				}
 				return HTTPD_CGI_AUTHENTICATED;
 			}
 			no++; //Not authenticated with this user/pass. Check next user/pass combo.
 		}
+		if (e!=NULL && e->getUserPw==connData->cgiArg) e->getUserPw=NULL; //the client's header changed
 	}
 
 	//Not authenticated. Go bug user with login screen.
@@ -58,4 +104,3 @@ int ICACHE_FLASH_ATTR authBasic(HttpdConnData *connData) {
 	//Okay, all done.
 	return HTTPD_CGI_DONE;
 }
-
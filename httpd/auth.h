@@ -17,6 +17,12 @@
 //has.
 typedef int (* AuthGetUserPw)(HttpdConnData *connData, int no, char *user, int userLen, char *pass, int passLen);
 
+//Clients whose Authorization header was validated in the last AUTH_CACHE_TTL seconds are passed
+//without checking it again, as long as they send the same header. A changed password thus
+//takes effect for them once the TTL has run out.
+#define AUTH_CACHE_SIZE 4
+#define AUTH_CACHE_TTL 10
+
 int ICACHE_FLASH_ATTR authBasic(HttpdConnData *connData);
 
 #endif
\ No newline at end of file
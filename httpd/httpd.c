@@ -16,6 +16,10 @@ Esp8266 http server - core routines
 
 #include <esp8266.h>
 #include "httpd.h"
+#include "espfs.h"
+#include "metrics.h"
+#include "prof.h"
+#include "perf.h"
 
 //#define HTTPD_DBG
 #ifdef HTTPD_DBG
@@ -28,16 +32,158 @@ Esp8266 http server - core routines
 //Max length of request head
 #define MAX_HEAD_LEN 1024
 //Max amount of connections
+#ifndef MAX_CONN
 #define MAX_CONN 6
-//Max post buffer len
+#endif
+//Connections kept for HTTPD_URL_PRIORITY urls: other requests get a 503 when all but these
+//are busy
+#ifndef HTTPD_RESERVED_CONN
+#define HTTPD_RESERVED_CONN 1
+#endif
+//Max post buffer len, a post that fits is passed to the cgi in one piece
 #define MAX_POST 1024
-//Max send buffer len
-#define MAX_SENDBUFF_LEN 2600
+//Post buffer for longer posts, which get streamed to the cgi in pieces of this size. It's a
+//multiple of the flash sector size so uploads can erase and write whole sectors. Set it to
+//MAX_POST to stream in 1KB pieces.
+#ifndef POST_WINDOW
+#define POST_WINDOW 4096
+#endif
+//Free heap that has to remain when allocating a POST_WINDOW buffer, else MAX_POST is used
+#define POST_WINDOW_RESERVE 8192
+//Max send buffer len, two full-sized segments, which is what fits into the TCP send buffer
+#define MAX_SENDBUFF_LEN (2*1460)
+//Time a kept-alive connection may sit idle waiting for the next request
+#define HTTPD_IDLE_MS 10000
+//Space reserved around each chunk of a chunked response: "%04x\r\n" in front, "\r\n" after it
+//plus the "0\r\n\r\n" that ends the response
+#define CHUNK_HEAD 6
+#define CHUNK_TAIL (2+5)
+//Max number of segments queued by httpdSendRef
+#define MAX_SEND_SEGS 4
+
+//A piece of constant data queued for sending
+typedef struct {
+  const char *data;
+  short len;
+} HttpdSeg;
 
 
 //This gets set at init time.
 static HttpdBuiltInUrl *builtInUrls;
 
+//Headers whose position httpdParseHeader notes down so httpdGetHeader doesn't have to search
+//for them, the others are found by scanning the request head
+static const char *const indexedHeaders[] = {
+  "Accept-Encoding", "Authorization", "Content-Type", "If-None-Match", "Last-Event-ID",
+  "Range", "If-Range",
+};
+#define NUM_INDEXED_HEADERS (sizeof(indexedHeaders)/sizeof(indexedHeaders[0]))
+
+//Max number of entries in builtInUrls the router indexes, the rest is scanned linearly
+#define MAX_ROUTES 128
+
+//URL router built from builtInUrls at init time: the literal URLs are kept sorted by hash so a
+//lookup is a binary search instead of a strcmp per table entry, the wildcard entries are kept
+//in a short list in table order. Each lookup returns the first entry at or after a given table
+//index that matches, so the semantics of walking the table from the top are unchanged.
+typedef struct {
+  uint32_t hash;            // hash of the literal URL
+  uint8_t index;            // index into builtInUrls
+} HttpdRoute;
+
+static HttpdRoute *routes;           // literal URLs sorted by hash, then by index
+static HttpdRouteStats *routeStats;  // counters per builtInUrls entry
+static HttpdStats httpdStats;
+static uint8_t *wildRoutes;          // indexes of the entries with a leading or trailing '*'
+static int numRoutes, numWildRoutes;
+static int numBuiltInUrls;
+
+static uint32_t ICACHE_FLASH_ATTR httpdHashUrl(const char *url) {
+  uint32_t h = 2166136261u; // FNV-1a
+  while (*url) h = (h ^ (uint8_t)*url++) * 16777619u;
+  return h;
+}
+
+static void ICACHE_FLASH_ATTR httpdRouteInit(void) {
+  int i, j;
+  numBuiltInUrls = 0;
+  while (builtInUrls[numBuiltInUrls].url != NULL) numBuiltInUrls++;
+  int n = numBuiltInUrls < MAX_ROUTES ? numBuiltInUrls : MAX_ROUTES;
+  routeStats = os_zalloc(numBuiltInUrls * sizeof(HttpdRouteStats) + 1);
+  routes = os_malloc(n * sizeof(HttpdRoute) + 1);
+  wildRoutes = os_malloc(n + 1);
+  numRoutes = numWildRoutes = 0;
+  if (routes == NULL || wildRoutes == NULL) {
+    os_printf("Httpd: no memory for router, using linear lookup\n");
+    return;
+  }
+  for (i=0; i<n; i++) {
+    const char *url = builtInUrls[i].url;
+    int urlLen = os_strlen(url);
+    if (urlLen > 0 && (url[0] == '*' || url[urlLen-1] == '*')) {
+      wildRoutes[numWildRoutes++] = i;
+      continue;
+    }
+    //insertion sort, the table is short and this only runs once
+    uint32_t h = httpdHashUrl(url);
+    for (j=numRoutes; j>0 && routes[j-1].hash > h; j--) routes[j] = routes[j-1];
+    routes[j].hash = h;
+    routes[j].index = i;
+    numRoutes++;
+  }
+  DBG("Httpd router: %d literal, %d wildcard, %d linear\n", numRoutes, numWildRoutes,
+      numBuiltInUrls - n);
+}
+
+//Checks whether builtInUrls[i] matches the url, this is the original linear-scan test
+static int ICACHE_FLASH_ATTR httpdUrlMatch(int i, const char *url, int len) {
+  const char *pat = builtInUrls[i].url;
+  int patLen = os_strlen(pat);
+  if (patLen == 0) return len == 0;
+  if (os_strcmp(pat, url) == 0) return 1;
+  if (pat[patLen-1] == '*' && os_strncmp(pat, url, patLen-1) == 0) return 1;
+  if (pat[0] == '*' && len >= patLen-1 &&
+      os_strncmp(pat+1, url+len-patLen+1, patLen-1) == 0) return 1;
+  return 0;
+}
+
+//Returns the index of the first entry at or after from that matches the url, or
+//numBuiltInUrls if there is none
+static int ICACHE_FLASH_ATTR httpdRoute(const char *url, int from) {
+  int len = os_strlen(url);
+  int best = numBuiltInUrls;
+  int i;
+  if (routes == NULL || wildRoutes == NULL) {
+    for (i=from; i<numBuiltInUrls; i++) if (httpdUrlMatch(i, url, len)) return i;
+    return numBuiltInUrls;
+  }
+
+  //literal match: find the first route with this hash, equal hashes are sorted by index
+  uint32_t h = httpdHashUrl(url);
+  int lo = 0, hi = numRoutes;
+  while (lo < hi) {
+    int mid = (lo+hi)/2;
+    if (routes[mid].hash < h) lo = mid+1; else hi = mid;
+  }
+  for (; lo<numRoutes && routes[lo].hash == h; lo++) {
+    if (routes[lo].index >= from && os_strcmp(builtInUrls[routes[lo].index].url, url) == 0) {
+      best = routes[lo].index;
+      break;
+    }
+  }
+
+  //a wildcard entry wins if it comes first in the table
+  for (i=0; i<numWildRoutes && wildRoutes[i] < best; i++) {
+    if (wildRoutes[i] >= from && httpdUrlMatch(wildRoutes[i], url, len)) return wildRoutes[i];
+  }
+  if (best < numBuiltInUrls) return best;
+
+  //entries beyond what the router indexes
+  for (i=from > MAX_ROUTES ? from : MAX_ROUTES; i<numBuiltInUrls; i++)
+    if (httpdUrlMatch(i, url, len)) return i;
+  return numBuiltInUrls;
+}
+
 //Private data for http connection
 struct HttpdPriv {
   char head[MAX_HEAD_LEN];  // buffer to accumulate header
@@ -47,6 +193,21 @@ struct HttpdPriv {
   short sendBuffLen;        // offset into output buffer
   short sendBuffMax;        // size of output buffer
   short code;               // http response code (only for logging)
+  int bodyLen;              // Content-Length of the request
+  char keepAlive;           // connection stays open for the next request
+  char framed;              // response started by httpdStartResponse, its length is known
+  char hasLength;           // response has a Content-Length header
+  char chunked;             // response uses chunked transfer-encoding
+  short chunkStart;         // offset of the chunk in the output buffer
+  char last;                // the data being flushed ends the response
+  char sending;             // data has been sent and the sent callback hasn't come yet
+  short hdrOff[NUM_INDEXED_HEADERS]; // offset of the value of indexed headers in head, 0: none
+  HttpdSeg segs[MAX_SEND_SEGS]; // data queued by httpdSendRef that didn't fit yet
+  char numSegs;             // number of queued segments
+  short route;              // builtInUrls entry serving the request, -1 if none
+  uint32 bytesSent;         // bytes of the response sent so far
+  uint32 lastActive;        // system time of the last data received or sent
+  ETSTimer idleTimer;       // closes a kept-alive connection that's idle for too long
 };
 
 //Connection pool
@@ -54,19 +215,23 @@ static HttpdPriv connPrivData[MAX_CONN];
 static HttpdConnData connData[MAX_CONN];
 static HttpdPostData connPostData[MAX_CONN];
 
+//Output buffer, shared by all connections: it's only used from the start of a callback until
+//the data is passed to espconn_sent, which copies it
+static char sendBuffer[MAX_SENDBUFF_LEN];
+
 //Listening connection data
 static struct espconn httpdConn;
 static esp_tcp httpdTcp;
 
-//Struct to keep extension->mime data in
+//Struct to keep extension->mime data in, the table is in flash
 typedef struct {
-  const char *ext;
-  const char *mimetype;
+  char ext[8];
+  char mimetype[28];
 } MimeMap;
 
 //The mappings from file extensions to mime types. If you need an extra mime type,
 //add it here.
-static const MimeMap mimeTypes[] = {
+static const MimeMap mimeTypes[] FLASH_DATA = {
   { "htm", "text/htm" },
   { "html", "text/html; charset=UTF-8" },
   { "css", "text/css" },
@@ -76,11 +241,13 @@ static const MimeMap mimeTypes[] = {
   { "jpeg", "image/jpeg" },
   { "png", "image/png" },
   { "tpl", "text/html; charset=UTF-8" },
-  { NULL, "text/html" }, //default value
+  { "", "text/html" }, //default value
 };
 
-//Returns a static char* to a mime type for a given url to a file.
+//Returns a static char* to a mime type for a given url to a file, it's overwritten by the
+//next call.
 const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
+  static char mimetype[sizeof(mimeTypes[0].mimetype)];
   int i = 0;
   //Go find the extension
   char *ext = url + (strlen(url) - 1);
@@ -88,8 +255,8 @@ const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
   if (*ext == '.') ext++;
 
   //ToDo: os_strcmp is case sensitive; we may want to do case-intensive matching here...
-  while (mimeTypes[i].ext != NULL && os_strcmp(ext, mimeTypes[i].ext) != 0) i++;
-  return mimeTypes[i].mimetype;
+  while (flashReadByte(mimeTypes[i].ext) != 0 && flashStrcmp(ext, mimeTypes[i].ext) != 0) i++;
+  return flashStrncpy(mimetype, mimeTypes[i].mimetype, sizeof(mimetype));
 }
 
 // debug string to identify connection (ip address & port)
@@ -109,14 +276,26 @@ static void debugConn(void *arg, char *what) {
 #endif
 }
 
-// Retires a connection for re-use
-static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
-  if (conn->conn && conn->conn->reverse == conn)
-    conn->conn->reverse = NULL; // break reverse link
-
-  // log information about the request we handled
+// log information about the request we handled, if there is one
+static void ICACHE_FLASH_ATTR httpdLogRequest(HttpdConnData *conn) {
+  if (conn->url == NULL) return; // kept alive or closed before a request came in
   uint32 dt = conn->startTime;
-  if (dt > 0) dt = (system_get_time() - dt) / 1000;
+  if (dt > 0) dt = system_get_time() - dt;
+  if (conn->priv->route >= 0 && routeStats != NULL) {
+    HttpdRouteStats *st = routeStats + conn->priv->route;
+    st->count++;
+    st->bytes += conn->priv->bytesSent;
+    if (dt > st->maxUs) st->maxUs = dt;
+    uint32 us = dt + st->timeRemUs;
+    st->timeMs += us / 1000;
+    st->timeRemUs = us % 1000;
+  }
+  METRIC_INC(M_HTTP_REQUESTS);
+  METRIC_ADD(M_HTTP_BYTES, conn->priv->bytesSent);
+  metricObserve(M_HTTP_TIME_MS, dt / 1000);
+  conn->priv->route = -1;
+  conn->priv->bytesSent = 0;
+  dt /= 1000;
   if (conn->conn && conn->url)
 #if 0
     DBG("HTTP %s %s from %s -> %d in %ums, heap=%ld\n",
@@ -127,9 +306,19 @@ static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
       conn->requestType == HTTPD_METHOD_GET ? "GET" : "POST", conn->url,
       conn->priv->code, dt, (unsigned long)system_get_free_heap_size());
 #endif
+}
+
+// Retires a connection for re-use
+static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
+  if (conn->conn && conn->conn->reverse == conn)
+    conn->conn->reverse = NULL; // break reverse link
+  os_timer_disarm(&conn->priv->idleTimer);
+  httpdLogRequest(conn);
 
   conn->conn = NULL; // don't try to send anything, the SDK crashes...
+  conn->priv->numSegs = 0;
   if (conn->cgi != NULL) conn->cgi(conn); // free cgi data
+  conn->url = NULL;
   if (conn->post->buff != NULL) os_free(conn->post->buff);
   conn->cgi = NULL;
   conn->post->buff = NULL;
@@ -201,8 +390,28 @@ int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLe
   return -1; //not found
 }
 
+//Copy a header value up to the end of the line
+static void ICACHE_FLASH_ATTR httpdCopyHeader(char *p, char *ret, int retLen) {
+  while (*p != 0 && *p != '\r' && *p != '\n' && retLen>1) {
+    *ret++ = *p++;
+    retLen--;
+  }
+  //Zero-terminate string
+  *ret = 0;
+}
+
 //Get the value of a certain header in the HTTP client head
 int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
+  int i;
+  //Common headers have been located by httpdParseHeader
+  for (i = 0; i<NUM_INDEXED_HEADERS; i++) {
+    if (os_strcmp(header, indexedHeaders[i]) == 0) {
+      if (conn->priv->hdrOff[i] == 0) return 0;
+      httpdCopyHeader(conn->priv->head + conn->priv->hdrOff[i], ret, retLen);
+      return 1;
+    }
+  }
+
   char *p = conn->priv->head;
   p = p + strlen(p) + 1; //skip GET/POST part
   p = p + strlen(p) + 1; //skip HTTP part
@@ -215,12 +424,7 @@ int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *re
       //Skip past spaces after the colon
       while (*p == ' ') p++;
       //Copy from p to end
-      while (*p != 0 && *p != '\r' && *p != '\n' && retLen>1) {
-        *ret++ = *p++;
-        retLen--;
-      }
-      //Zero-terminate string
-      *ret = 0;
+      httpdCopyHeader(p, ret, retLen);
       //All done :)
       return 1;
     }
@@ -232,8 +436,9 @@ int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *re
 //Setup an output buffer
 void ICACHE_FLASH_ATTR httpdSetOutputBuffer(HttpdConnData *conn, char *buff, short max) {
   conn->priv->sendBuff = buff;
-  conn->priv->sendBuffLen = 0;
-  conn->priv->sendBuffMax = max;
+  conn->priv->chunkStart = 0;
+  conn->priv->sendBuffLen = conn->priv->chunked ? CHUNK_HEAD : 0;
+  conn->priv->sendBuffMax = conn->priv->chunked ? max - CHUNK_TAIL : max;
 }
 
 //Start the response headers.
@@ -242,7 +447,14 @@ void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
   int l;
   conn->priv->code = code;
   char *status = code < 400 ? "OK" : "ERROR";
-  l = os_sprintf(buff, "HTTP/1.0 %d %s\r\nServer: esp-link\r\nConnection: close\r\n", code, status);
+  if (conn->priv->keepAlive) {
+    // the length of the response is known from the Content-Length header or from chunking it,
+    // so the connection can stay open
+    conn->priv->framed = 1;
+    l = os_sprintf(buff, "HTTP/1.1 %d %s\r\nServer: esp-link\r\n", code, status);
+  } else {
+    l = os_sprintf(buff, "HTTP/1.0 %d %s\r\nServer: esp-link\r\nConnection: close\r\n", code, status);
+  }
   httpdSend(conn, buff, l);
 }
 
@@ -251,12 +463,29 @@ void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const
   char buff[256];
   int l;
 
+  if (os_strcmp(field, "Content-Length") == 0) conn->priv->hasLength = 1;
   l = os_sprintf(buff, "%s: %s\r\n", field, val);
   httpdSend(conn, buff, l);
 }
 
-//Finish the headers.
+//Finish the headers. A response without Content-Length on a kept-alive connection is chunked,
+//each flush of the output buffer then sends one chunk. 204 and 304 responses never have a body.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+  HttpdPriv *priv = conn->priv;
+  if (priv->framed && !priv->hasLength && priv->code != 204 && priv->code != 304) {
+    char *te = "Transfer-Encoding: chunked\r\n\r\n";
+    if (priv->sendBuffLen + os_strlen(te) + CHUNK_HEAD + CHUNK_TAIL <= priv->sendBuffMax) {
+      httpdSend(conn, te, -1);
+      priv->chunked = 1;
+      priv->chunkStart = priv->sendBuffLen;
+      priv->sendBuffLen += CHUNK_HEAD;
+      priv->sendBuffMax -= CHUNK_TAIL;
+      return;
+    }
+    // no room to chunk, the end of the response is signaled by closing
+    priv->framed = priv->keepAlive = 0;
+    httpdSend(conn, "Connection: close\r\n", -1);
+  }
   httpdSend(conn, "\r\n", -1);
 }
 
@@ -287,7 +516,7 @@ int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData) {
 //Returns 1 for success, 0 for out-of-memory.
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len) {
   if (len<0) len = strlen(data);
-  if (conn->priv->sendBuffLen + len>conn->priv->sendBuffMax) {
+  if (conn->priv->numSegs > 0 || conn->priv->sendBuffLen + len>conn->priv->sendBuffMax) {
     DBG("%sERROR! httpdSend full (%d of %d)\n",
       connStr, conn->priv->sendBuffLen, conn->priv->sendBuffMax);
     return 0;
@@ -297,16 +526,169 @@ int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len)
   return 1;
 }
 
+//Return the free space in the output buffer and its size in *avail, for data that gets read
+//straight into it. httpdSendCommit then adds what was put there.
+char ICACHE_FLASH_ATTR *httpdSendBuf(HttpdConnData *conn, int *avail) {
+  *avail = conn->priv->numSegs > 0 ? 0 : conn->priv->sendBuffMax - conn->priv->sendBuffLen;
+  return conn->priv->sendBuff + conn->priv->sendBuffLen;
+}
+
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len) {
+  conn->priv->sendBuffLen += len;
+}
+
+//Move as much of the queued segments into the output buffer as fits
+static void ICACHE_FLASH_ATTR httpdGather(HttpdConnData *conn) {
+  HttpdPriv *priv = conn->priv;
+  int i;
+  for (i = 0; i<priv->numSegs; i++) {
+    HttpdSeg *s = priv->segs + i;
+    int len = priv->sendBuffMax - priv->sendBuffLen;
+    if (len > s->len) len = s->len;
+    //data in flash can only be read 32 bits at a time
+    if ((uint32_t)s->data >= 0x40200000) memcpyAligned(priv->sendBuff + priv->sendBuffLen, s->data, len);
+    else os_memcpy(priv->sendBuff + priv->sendBuffLen, s->data, len);
+    priv->sendBuffLen += len;
+    s->data += len;
+    s->len -= len;
+    if (s->len > 0) break;
+  }
+  if (i > 0) {
+    os_memmove(priv->segs, priv->segs + i, (priv->numSegs - i) * sizeof(HttpdSeg));
+    priv->numSegs -= i;
+  }
+}
+
+//Send data that stays valid until the response is complete, e.g. a constant string in RAM or
+//flash, without it having to fit into the output buffer. What doesn't fit is queued and goes
+//out in following segments before the cgi gets called again, meanwhile the output buffer
+//counts as full. len must be given for data in flash.
+//Returns 1 for success, 0 if too many segments are queued.
+int ICACHE_FLASH_ATTR httpdSendRef(HttpdConnData *conn, const char *data, int len) {
+  HttpdPriv *priv = conn->priv;
+  if (len<0) len = strlen(data);
+  if (priv->numSegs == MAX_SEND_SEGS) {
+    DBG("%sERROR! httpdSendRef queue full\n", connStr);
+    return 0;
+  }
+  priv->segs[(int)priv->numSegs].data = data;
+  priv->segs[(int)priv->numSegs].len = len;
+  priv->numSegs++;
+  httpdGather(conn);
+  return 1;
+}
+
 //Helper function to send any data in conn->priv->sendBuff
 void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn) {
-  if (conn->priv->sendBuffLen != 0) {
-    sint8 status = espconn_sent(conn->conn, (uint8_t*)conn->priv->sendBuff, conn->priv->sendBuffLen);
+  HttpdPriv *priv = conn->priv;
+  if (priv->chunked) {
+    // fill in the size of the chunk in the space reserved in front of it, leaving out empty
+    // ones as they would end the response
+    int len = priv->sendBuffLen - priv->chunkStart - CHUNK_HEAD;
+    if (len > 0) {
+      char head[CHUNK_HEAD+1];
+      os_sprintf(head, "%04x\r\n", len);
+      os_memcpy(priv->sendBuff + priv->chunkStart, head, CHUNK_HEAD);
+      os_memcpy(priv->sendBuff + priv->sendBuffLen, "\r\n", 2);
+      priv->sendBuffLen += 2;
+    } else {
+      priv->sendBuffLen = priv->chunkStart;
+    }
+    if (priv->last && priv->numSegs == 0) {
+      os_memcpy(priv->sendBuff + priv->sendBuffLen, "0\r\n\r\n", 5);
+      priv->sendBuffLen += 5;
+    }
+  }
+  if (priv->sendBuffLen != 0) {
+    sint8 status = espconn_sent(conn->conn, (uint8_t*)priv->sendBuff, priv->sendBuffLen);
     if (status != 0) {
       DBG("%sERROR! espconn_sent returned %d, trying to send %d to %s\n",
-          connStr, status, conn->priv->sendBuffLen, conn->url);
+          connStr, status, priv->sendBuffLen, conn->url);
+    } else {
+      priv->sending = 1;
+      priv->bytesSent += priv->sendBuffLen;
     }
-    conn->priv->sendBuffLen = 0;
   }
+  priv->chunkStart = 0;
+  priv->sendBuffLen = priv->chunked && !(priv->last && priv->numSegs == 0) ? CHUNK_HEAD : 0;
+}
+
+static void ICACHE_FLASH_ATTR httpdIdleCb(void *arg) {
+  HttpdConnData *conn = arg;
+  if (conn->conn == NULL || conn->cgi != NULL || conn->priv->headPos != 0) return;
+  DBG("%sclosing idle connection\n", connStr);
+  espconn_disconnect(conn->conn); // we will get a disconnect callback
+}
+
+//Get ready for the next request on a kept-alive connection
+static void ICACHE_FLASH_ATTR httpdNextRequest(HttpdConnData *conn) {
+  HttpdPriv *priv = conn->priv;
+  httpdLogRequest(conn);
+  if (conn->post->buff != NULL) os_free(conn->post->buff);
+  conn->post->buff = NULL;
+  conn->post->buffLen = 0;
+  conn->post->received = 0;
+  conn->post->len = -1;
+  conn->post->multipartBoundary = NULL;
+  conn->url = NULL;
+  conn->getArgs = NULL;
+  conn->cgiData = NULL;
+  conn->startTime = 0;
+  priv->headPos = 0;
+  priv->bodyLen = 0;
+  priv->framed = priv->hasLength = priv->chunked = priv->last = 0;
+  priv->numSegs = 0;
+}
+
+//All of the response has been flushed. The connection is kept open for the next request if the
+//response's length is known and all of the request has been received, else it gets closed
+//once the data has been sent.
+static void ICACHE_FLASH_ATTR httpdResponseFinish(HttpdConnData *conn) {
+  HttpdPriv *priv = conn->priv;
+  if (!priv->framed || conn->post->received < priv->bodyLen) priv->keepAlive = 0;
+  if (priv->keepAlive) httpdNextRequest(conn);
+  else if (conn->post) conn->post->len = 0; // skip any remaining receives
+}
+
+//The response is complete: flush the rest of it, the response is finished once any queued
+//segments have been sent as well
+static void ICACHE_FLASH_ATTR httpdResponseDone(HttpdConnData *conn) {
+  conn->cgi = NULL; //mark for destruction.
+  conn->priv->last = 1;
+  httpdFlush(conn);
+  if (conn->priv->numSegs == 0) httpdResponseFinish(conn);
+}
+
+//Send the next part of the response: queued segments first, then whatever the cgi produces.
+//Called when the previous part has been sent and by httpdResume
+static void ICACHE_FLASH_ATTR httpdContinue(HttpdConnData *conn) {
+  httpdSetOutputBuffer(conn, sendBuffer, sizeof(sendBuffer));
+  //queued segments go out first, the cgi fills up the rest of the segment after them
+  httpdGather(conn);
+  if (conn->priv->numSegs > 0) {
+    httpdFlush(conn);
+    return;
+  }
+  if (conn->cgi == NULL) {
+    //the queued data was the end of the response
+    httpdFlush(conn);
+    httpdResponseFinish(conn);
+    return;
+  }
+
+  PROF_BEGIN(PROF_HTTPD_CGI);
+  int r = conn->cgi(conn); //Execute cgi fn.
+  PROF_END(PROF_HTTPD_CGI);
+  if (r == HTTPD_CGI_NOTFOUND || r == HTTPD_CGI_AUTHENTICATED) {
+    DBG("%sERROR! Bad CGI code %d\n", connStr, r);
+    conn->priv->keepAlive = 0;
+    r = HTTPD_CGI_DONE;
+  }
+  if (r == HTTPD_CGI_DONE) {
+    httpdResponseDone(conn);
+    return;
+  }
+  httpdFlush(conn);
 }
 
 //Callback called when the data on a socket has been successfully sent.
@@ -315,29 +697,81 @@ static void ICACHE_FLASH_ATTR httpdSentCb(void *arg) {
   struct espconn* pCon = (struct espconn *)arg;
   HttpdConnData *conn = (HttpdConnData *)pCon->reverse;
   if (conn == NULL) return; // aborted connection
-
-  char sendBuff[MAX_SENDBUFF_LEN];
-  httpdSetOutputBuffer(conn, sendBuff, sizeof(sendBuff));
-
-  if (conn->cgi == NULL) { //Marked for destruction?
+  conn->priv->sending = 0;
+  conn->priv->lastActive = system_get_time();
+
+  if (conn->cgi == NULL && conn->priv->numSegs == 0) { //Marked for destruction?
+    if (conn->priv->keepAlive) {
+      // wait for the next request, but not forever
+      os_timer_disarm(&conn->priv->idleTimer);
+      os_timer_setfn(&conn->priv->idleTimer, httpdIdleCb, conn);
+      os_timer_arm(&conn->priv->idleTimer, HTTPD_IDLE_MS, 0);
+      return;
+    }
     //os_printf("Closing 0x%p/0x%p->0x%p\n", arg, conn->conn, conn);
     espconn_disconnect(conn->conn); // we will get a disconnect callback
     return; //No need to call httpdFlush.
   }
 
-  int r = conn->cgi(conn); //Execute cgi fn.
-  if (r == HTTPD_CGI_DONE) {
-    conn->cgi = NULL; //mark for destruction.
-  }
-  if (r == HTTPD_CGI_NOTFOUND || r == HTTPD_CGI_AUTHENTICATED) {
-    DBG("%sERROR! Bad CGI code %d\n", connStr, r);
-    conn->cgi = NULL; //mark for destruction.
+  httpdContinue(conn);
+}
+
+//Call the cgi of a connection that is waiting for data to become available, for cgis that push
+//data as it comes in. Does nothing if the previous data hasn't been sent yet, the cgi gets
+//called from the sent callback then anyway.
+void ICACHE_FLASH_ATTR httpdResume(HttpdConnData *conn) {
+  if (conn->conn == NULL || conn->cgi == NULL || conn->priv->sending) return;
+  httpdContinue(conn);
+}
+
+//Tells whether a connection could be closed to make room: 1 if it's waiting for a request, e.g.
+//kept alive, 2 if its cgi is waiting for data to push (see httpdResume), 0 if it's busy. A
+//parked HTTPD_URL_PRIORITY request, e.g. a programming sync waiting on the MCU, counts as busy
+static int ICACHE_FLASH_ATTR httpdIdleKind(HttpdConnData *c) {
+  if (c->conn == NULL || c->priv->sending || c->priv->numSegs > 0) return 0;
+  if (c->cgi == NULL) return c->priv->headPos == 0 && c->post->len < 0 ? 1 : 0;
+  if (c->post->len < 0 || c->post->received < c->post->len) return 0;
+  if (c->priv->route >= 0 && (builtInUrls[c->priv->route].flags & HTTPD_URL_PRIORITY)) return 0;
+  return 2;
+}
+
+//Close the connection that has been idle the longest, kept-alive ones go before the ones
+//waiting for data to push. Returns the pool slot or MAX_CONN if no connection is idle.
+static int ICACHE_FLASH_ATTR httpdEvict(void) {
+  uint32 now = system_get_time();
+  int best = MAX_CONN, bestKind = 0;
+  uint32 bestAge = 0;
+  for (int i = 0; i<MAX_CONN; i++) {
+    int kind = httpdIdleKind(connData+i);
+    uint32 age = now - connData[i].priv->lastActive;
+    if (kind == 0 || (bestKind != 0 && (kind > bestKind || (kind == bestKind && age <= bestAge))))
+      continue;
+    best = i;
+    bestKind = kind;
+    bestAge = age;
   }
-  httpdFlush(conn);
+  if (best == MAX_CONN) return MAX_CONN;
+  HttpdConnData *c = connData+best;
+  struct espconn *old = c->conn;
+  DBG("%sevicting %s, idle %lums\n", connStr, c->priv->from, (unsigned long)bestAge/1000);
+  httpdRetireConn(c);
+  espconn_disconnect(old);
+  httpdStats.evicted++;
+  return best;
+}
+
+//Number of connections other than conn that are working on a request
+static int ICACHE_FLASH_ATTR httpdBusyConns(HttpdConnData *conn) {
+  int n = 0;
+  for (int i = 0; i<MAX_CONN; i++)
+    if (connData+i != conn && connData[i].conn != NULL && httpdIdleKind(connData+i) == 0) n++;
+  return n;
 }
 
-static const char *httpNotFoundHeader = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n"
+static const char httpNotFoundHeader[] FLASH_DATA = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n"
   "Content-Type: text/plain\r\nContent-Length: 12\r\n\r\nNot Found.\r\n";
+static const char httpBusyHeader[] FLASH_DATA = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\n"
+  "Retry-After: 2\r\nContent-Type: text/plain\r\nContent-Length: 7\r\n\r\nBusy.\r\n";
 
 //This is called when the headers have been received and the connection is ready to send
 //the result headers and data.
@@ -354,41 +788,42 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
   while (1) {
     //Look up URL in the built-in URL table.
     if (conn->cgi == NULL) {
-      while (builtInUrls[i].url != NULL) {
-        int match = 0;
-        int urlLen = os_strlen(builtInUrls[i].url);
-        //See if there's a literal match
-        if (os_strcmp(builtInUrls[i].url, conn->url) == 0) match = 1;
-        //See if there's a wildcard match
-        if (builtInUrls[i].url[urlLen - 1] == '*' &&
-          os_strncmp(builtInUrls[i].url, conn->url, urlLen - 1) == 0) match = 1;
-        else if (builtInUrls[i].url[0] == '*' && ( strlen(conn->url) >= urlLen -1 )  &&
-          os_strncmp(builtInUrls[i].url + 1, conn->url + strlen(conn->url) - urlLen + 1, urlLen - 1) == 0) match = 1;
-        if (match) {
-          //os_printf("Is url index %d\n", i);
-          conn->cgiData = NULL;
-	  conn->cgiResponse = NULL;
-          conn->cgi = builtInUrls[i].cgiCb;
-          conn->cgiArg = builtInUrls[i].cgiArg;
-          break;
-        }
-        i++;
+      i = httpdRoute(conn->url, i);
+      //Keep the reserved connections free for priority urls
+      if (i < numBuiltInUrls && conn->priv->route < 0 && !(builtInUrls[i].flags & HTTPD_URL_PRIORITY) &&
+          httpdBusyConns(conn) >= MAX_CONN - HTTPD_RESERVED_CONN) {
+        DBG("%s%s: too busy, 503\n", connStr, conn->url);
+        httpdStats.busy++;
+        httpdSendRef(conn, httpBusyHeader, sizeof(httpBusyHeader)-1);
+        httpdResponseDone(conn);
+        return;
+      }
+      if (i < numBuiltInUrls) {
+        //os_printf("Is url index %d\n", i);
+        conn->priv->route = i;
+        conn->cgiData = NULL;
+        conn->cgiResponse = NULL;
+        conn->cgi = builtInUrls[i].cgiCb;
+        conn->cgiArg = builtInUrls[i].cgiArg;
       }
-      if (builtInUrls[i].url == NULL) {
+      if (i >= numBuiltInUrls) {
         //Drat, we're at the end of the URL table. This usually shouldn't happen. Well, just
         //generate a built-in 404 to handle this.
         DBG("%s%s not found. 404!\n", connStr, conn->url);
-        httpdSend(conn, httpNotFoundHeader, -1);
-        httpdFlush(conn);
-        conn->cgi = NULL; //mark for destruction.
-        if (conn->post) conn->post->len = 0; // skip any remaining receives
+        httpdStats.notFound++;
+        METRIC_INC(M_HTTP_NOT_FOUND);
+        conn->priv->route = -1;
+        httpdSendRef(conn, httpNotFoundHeader, sizeof(httpNotFoundHeader)-1);
+        httpdResponseDone(conn);
         return;
       }
     }
 
     //Okay, we have a CGI function that matches the URL. See if it wants to handle the
     //particular URL we're supposed to handle.
+    PROF_BEGIN(PROF_HTTPD_CGI);
     r = conn->cgi(conn);
+    PROF_END(PROF_HTTPD_CGI);
     if (r == HTTPD_CGI_MORE) {
       //Yep, it's happy to do so and has more data to send.
       httpdFlush(conn);
@@ -396,9 +831,7 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
     }
     else if (r == HTTPD_CGI_DONE) {
       //Yep, it's happy to do so and already is done sending data.
-      httpdFlush(conn);
-      conn->cgi = NULL; //mark for destruction.
-      if (conn->post) conn->post->len = 0; // skip any remaining receives
+      httpdResponseDone(conn);
       return;
     }
     else {
@@ -407,6 +840,8 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
       }
       //URL doesn't want to handle the request: either the data isn't found or there's no
       //need to generate a login screen.
+      if (r == HTTPD_CGI_NOTFOUND && routeStats != NULL && conn->priv->route >= 0)
+        routeStats[conn->priv->route].notFound++;
       conn->cgi = NULL; // force lookup again
       i++; //look at next url the next iteration of the loop.
     }
@@ -427,6 +862,22 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     first_line = true;
   }
 
+  if (!first_line) {
+    //Note down where the value of an indexed header is
+    char *c = (char *)os_strstr(h, ":");
+    if (c != NULL) {
+      int len = c - h;
+      for (i = 0; i<NUM_INDEXED_HEADERS; i++) {
+        if (os_strncmp(h, indexedHeaders[i], len) == 0 && indexedHeaders[i][len] == 0) {
+          c++;
+          while (*c == ' ') c++;
+          if (conn->priv->hdrOff[i] == 0) conn->priv->hdrOff[i] = c - conn->priv->head;
+          break;
+        }
+      }
+    }
+  }
+
   if (first_line) {
     char *e;
 
@@ -440,6 +891,9 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     if (e == NULL) return; //wtf?
     *e = 0; //terminate url part
 
+    //HTTP/1.1 connections stay open unless the client says otherwise
+    conn->priv->keepAlive = os_strncmp(e+1, "HTTP/1.1", 8) == 0;
+
     // Count number of open connections
     //esp_tcp *tcp = conn->conn->proto.tcp;
     //DBG("%sHTTP %s %s from %s\n", connStr,
@@ -462,11 +916,14 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     while (h[i] == ' ') i++;
     //Get POST data length
     conn->post->len = atoi(h + i);
+    conn->priv->bodyLen = conn->post->len;
 
     // Allocate the buffer
     if (conn->post->len > MAX_POST) {
-      // we'll stream this in in chunks
+      // we'll stream this in in chunks, as big as the heap allows
       conn->post->buffSize = MAX_POST;
+      if (system_get_free_heap_size() > POST_WINDOW + POST_WINDOW_RESERVE)
+        conn->post->buffSize = conn->post->len < POST_WINDOW ? conn->post->len : POST_WINDOW;
     }
     else {
       conn->post->buffSize = conn->post->len;
@@ -475,6 +932,10 @@ static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
     conn->post->buff = (char*)os_malloc(conn->post->buffSize + 1);
     conn->post->buffLen = 0;
   }
+  else if (os_strncmp(h, "Connection:", 11) == 0) {
+    for (i = 11; h[i] != 0; i++) h[i] = tolower((int)h[i]);
+    if (os_strstr(h + 11, "close") != NULL) conn->priv->keepAlive = 0;
+  }
   else if (os_strncmp(h, "Content-Type: ", 14) == 0) {
     if (os_strstr(h, "multipart/form-data")) {
       // It's multipart form data so let's pull out the boundary for future use
@@ -496,9 +957,11 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
   struct espconn* pCon = (struct espconn *)arg;
   HttpdConnData *conn = (HttpdConnData *)pCon->reverse;
   if (conn == NULL) return; // aborted connection
+  PROF_BEGIN(PROF_HTTPD_RECV);
+  os_timer_disarm(&conn->priv->idleTimer);
+  conn->priv->lastActive = system_get_time();
 
-  char sendBuff[MAX_SENDBUFF_LEN];
-  httpdSetOutputBuffer(conn, sendBuff, sizeof(sendBuff));
+  httpdSetOutputBuffer(conn, sendBuffer, sizeof(sendBuffer));
 
   //This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
   //<0 (-1): Post len unknown because we're still receiving headers
@@ -509,6 +972,7 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
   for (int x = 0; x<len; x++) {
     if (conn->post->len<0) {
       //This byte is a header byte.
+      if (conn->priv->headPos == 0) conn->startTime = system_get_time();
       if (conn->priv->headPos != MAX_HEAD_LEN) conn->priv->head[conn->priv->headPos++] = data[x];
       conn->priv->head[conn->priv->headPos] = 0;
       //Scan for /r/n/r/n. Receiving this indicate the headers end.
@@ -518,6 +982,7 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
 	conn->post->multipartBoundary = NULL;
         //Reset url data
         conn->url = NULL;
+        os_memset(conn->priv->hdrOff, 0, sizeof(conn->priv->hdrOff));
         //Iterate over all received headers and parse them.
         char *p = conn->priv->head;
         while (p<(&conn->priv->head[conn->priv->headPos - 4])) {
@@ -527,16 +992,34 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
           httpdParseHeader(p, conn);  //and parse it.
           p = e + 2;            //Skip /r/n (now /0/n)
         }
+        //A request that comes in while the previous response is still being sent doesn't
+        //get answered, the connection closes and the client has to send it again.
+        if (conn->priv->sending) {
+          DBG("%spipelined request, closing\n", connStr);
+          conn->priv->keepAlive = 0;
+          conn->post->len = 0;
+          break;
+        }
         //If we don't need to receive post data, we can send the response now.
         if (conn->post->len == 0) {
           httpdProcessRequest(conn);
         }
       }
     }
-    else if (conn->post->len != 0) {
-      //This byte is a POST byte.
-      conn->post->buff[conn->post->buffLen++] = data[x];
-      conn->post->received++;
+    else if (conn->post->len == 0) {
+      //Data after the request, we can't answer it, see above.
+      conn->priv->keepAlive = 0;
+      break;
+    }
+    else {
+      //These are POST bytes, take as many as fit into the buffer in one go.
+      int n = len - x;
+      if (n > conn->post->buffSize - conn->post->buffLen) n = conn->post->buffSize - conn->post->buffLen;
+      if (n > conn->post->len - conn->post->received) n = conn->post->len - conn->post->received;
+      os_memcpy(conn->post->buff + conn->post->buffLen, data + x, n);
+      conn->post->buffLen += n;
+      conn->post->received += n;
+      x += n - 1;
       if (conn->post->buffLen >= conn->post->buffSize || conn->post->received == conn->post->len) {
         //Received a chunk of post data
         conn->post->buff[conn->post->buffLen] = 0; //zero-terminate, in case the cgi handler knows it can use strings
@@ -546,6 +1029,7 @@ static void ICACHE_FLASH_ATTR httpdRecvCb(void *arg, char *data, unsigned short
       }
     }
   }
+  PROF_END(PROF_HTTPD_RECV);
 }
 
 static void ICACHE_FLASH_ATTR httpdDisconCb(void *arg) {
@@ -576,8 +1060,11 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   int i;
   for (i = 0; i<MAX_CONN; i++) if (connData[i].conn == NULL) break;
   //DBG("Con req, conn=%p, pool slot %d\n", conn, i);
+  if (i == MAX_CONN) i = httpdEvict(); //Make room by closing an idle connection
   if (i == MAX_CONN) {
     os_printf("%sHTTP: conn pool overflow!\n", connStr);
+    httpdStats.refused++;
+    METRIC_INC(M_HTTP_REFUSED);
     espconn_disconnect(conn);
     return;
   }
@@ -592,6 +1079,14 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   connData[i].conn = conn;
   conn->reverse = connData+i;
   connData[i].priv->headPos = 0;
+  connData[i].priv->bodyLen = 0;
+  connData[i].priv->keepAlive = 0;
+  connData[i].priv->framed = connData[i].priv->hasLength = connData[i].priv->chunked = 0;
+  connData[i].priv->last = connData[i].priv->sending = 0;
+  connData[i].priv->numSegs = 0;
+  connData[i].priv->route = -1;
+  connData[i].priv->bytesSent = 0;
+  connData[i].priv->lastActive = system_get_time();
 
   esp_tcp *tcp = conn->proto.tcp;
   os_sprintf(connData[i].priv->from, "%d.%d.%d.%d:%d", tcp->remote_ip[0], tcp->remote_ip[1],
@@ -602,13 +1097,14 @@ static void ICACHE_FLASH_ATTR httpdConnectCb(void *arg) {
   connData[i].post->received = 0;
   connData[i].post->len = -1;
   connData[i].startTime = system_get_time();
+  connData[i].url = NULL;
 
   espconn_regist_recvcb(conn, httpdRecvCb);
   espconn_regist_reconcb(conn, httpdReconCb);
   espconn_regist_disconcb(conn, httpdDisconCb);
   espconn_regist_sentcb(conn, httpdSentCb);
 
-  espconn_set_opt(conn, ESPCONN_REUSEADDR | ESPCONN_NODELAY);
+  perfTcpSetup(conn, TCP_SVC_HTTPD);
 }
 
 //Httpd initialization routine. Call this to kick off webserver functionality.
@@ -623,10 +1119,22 @@ void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
   httpdTcp.local_port = port;
   httpdConn.proto.tcp = &httpdTcp;
   builtInUrls = fixedUrls;
+  httpdRouteInit();
   DBG("Httpd init, conn=%p\n", &httpdConn);
   espconn_regist_connectcb(&httpdConn, httpdConnectCb);
   espconn_accept(&httpdConn);
-  espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN);
+  espconn_tcp_set_max_con_allow(&httpdConn, MAX_CONN+1); // one more to evict an idle one
+}
+
+//Returns the counters of builtInUrls entry i and its url, NULL past the end of the table
+const HttpdRouteStats * ICACHE_FLASH_ATTR httpdGetRouteStats(int i, const char **url) {
+  if (routeStats == NULL || i < 0 || i >= numBuiltInUrls) return NULL;
+  *url = builtInUrls[i].url;
+  return routeStats + i;
+}
+
+const HttpdStats * ICACHE_FLASH_ATTR httpdGetStats(void) {
+  return &httpdStats;
 }
 
 // looks up connection handle based on ip / port
@@ -658,9 +1166,7 @@ HttpdConnData * ICACHE_FLASH_ATTR  httpdLookUpConn(uint8_t * ip, int port) {
 // when MCU response arrives, the handler looks up connection based on ip/port and call httpdSetCGIResponse with the data to transmit
 
 int ICACHE_FLASH_ATTR httpdSetCGIResponse(HttpdConnData * conn, void * response) {
-  char sendBuff[MAX_SENDBUFF_LEN];
-  conn->priv->sendBuff = sendBuff;
-  conn->priv->sendBuffLen = 0;
+  httpdSetOutputBuffer(conn, sendBuffer, sizeof(sendBuffer));
 
   conn->cgiResponse = response;
   httpdProcessRequest(conn);
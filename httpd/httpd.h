@@ -52,13 +52,36 @@ typedef struct {
 	const char *url;
 	cgiSendCallback cgiCb;
 	const void *cgiArg;
+	uint8_t flags;      // HTTPD_URL_*
 } HttpdBuiltInUrl;
 
+//The url may use the connections reserved by HTTPD_RESERVED_CONN, e.g. for firmware uploads
+#define HTTPD_URL_PRIORITY 1
+
+//Counters of the requests served by a builtInUrls entry
+typedef struct {
+	uint32_t count;     // requests served
+	uint32_t notFound;  // requests the cgi passed on with HTTPD_CGI_NOTFOUND
+	uint32_t bytes;     // bytes sent, including the headers
+	uint32_t timeMs;    // total time from the start of the requests until their responses were out
+	uint32_t maxUs;     // time of the slowest request
+	uint16_t timeRemUs; // microseconds not yet added to timeMs
+} HttpdRouteStats;
+
+//Counters of the requests that couldn't be served
+typedef struct {
+	uint32_t notFound;  // requests no builtInUrls entry handled, answered with a 404
+	uint32_t refused;   // connections closed right away because all connection slots were busy
+	uint32_t evicted;   // idle connections closed to make room for a new one
+	uint32_t busy;      // requests answered with a 503 to keep the reserved connections free
+} HttpdStats;
+
 int ICACHE_FLASH_ATTR cgiRedirect(HttpdConnData *connData);
 void ICACHE_FLASH_ATTR httpdRedirect(HttpdConnData *conn, char *newUrl);
 int httpdUrlDecode(char *val, int valLen, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLen);
 void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port);
+void ICACHE_FLASH_ATTR httpdResume(HttpdConnData *conn);
 const char *httpdGetMimetype(char *url);
 void ICACHE_FLASH_ATTR httpdSetOutputBuffer(HttpdConnData *conn, char *buff, short max);
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code);
@@ -66,8 +89,13 @@ void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn);
 int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
 int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len);
+char ICACHE_FLASH_ATTR *httpdSendBuf(HttpdConnData *conn, int *avail);
+void ICACHE_FLASH_ATTR httpdSendCommit(HttpdConnData *conn, int len);
+int ICACHE_FLASH_ATTR httpdSendRef(HttpdConnData *conn, const char *data, int len);
 void ICACHE_FLASH_ATTR httpdFlush(HttpdConnData *conn);
 HttpdConnData * ICACHE_FLASH_ATTR  httpdLookUpConn(uint8_t * ip, int port);
 int ICACHE_FLASH_ATTR  httpdSetCGIResponse(HttpdConnData * conn, void *response);
+const HttpdRouteStats * ICACHE_FLASH_ATTR httpdGetRouteStats(int i, const char **url);
+const HttpdStats * ICACHE_FLASH_ATTR httpdGetStats(void);
 
 #endif
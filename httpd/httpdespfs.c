@@ -18,7 +18,49 @@ Connector to let httpd use the espfs filesystem to serve the files in it.
 
 // The static files marked with FLAG_GZIP are compressed and will be served with GZIP compression.
 // If the client does not advertise that he accepts GZIP send following warning message (telnet users for e.g.)
-static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
+static const char gzipNonSupportedMessage[] FLASH_DATA = "HTTP/1.0 501 Not implemented\r\nServer: esp8266-httpd/"HTTPDVER"\r\nConnection: close\r\nContent-Type: text/plain\r\nContent-Length: 52\r\n\r\nYour browser does not accept gzip-compressed data.\r\n";
+
+//Read the next part of a file straight into the output buffer, filling it up so the data goes
+//out in full-sized segments, the first part shares the segment with the headers. Returns
+//HTTPD_CGI_DONE once all of the file is in.
+static int ICACHE_FLASH_ATTR espFsHookSend(HttpdConnData *connData, EspFsFile *file) {
+	int avail;
+	char *buff=httpdSendBuf(connData, &avail);
+	int len=espFsRead(file, buff, avail);
+	httpdSendCommit(connData, len);
+	if (len!=avail) {
+		//We're done.
+		espFsClose(file);
+		connData->cgiData=NULL;
+		return HTTPD_CGI_DONE;
+	}
+	//Ok, till next time.
+	return HTTPD_CGI_MORE;
+}
+
+//Parse a "bytes=" Range header for a file of size bytes into [*start, *end). Only a single range
+//is supported, the whole file is sent for anything else. Returns 1 for a range, 0 if the whole
+//file should be sent and -1 if the range is outside of the file.
+static int ICACHE_FLASH_ATTR parseRange(char *h, int size, int *start, int *end) {
+	if (os_strncmp(h, "bytes=", 6) != 0 || os_strstr(h, ",") != NULL) return 0;
+	h += 6;
+	if (*h == '-') {
+		//the last n bytes
+		int n = atoi(h+1);
+		if (n <= 0) return n == 0 && h[1] == '0' ? -1 : 0;
+		*start = n < size ? size - n : 0;
+		*end = size;
+	} else {
+		if (*h < '0' || *h > '9') return 0;
+		*start = atoi(h);
+		char *e = os_strstr(h, "-");
+		if (e == NULL) return 0;
+		*end = e[1] >= '0' && e[1] <= '9' ? atoi(e+1) + 1 : size;
+		if (*end < *start+1) return 0;
+		if (*end > size) *end = size;
+	}
+	return *start < size ? 1 : -1;
+}
 
 //This is a catch-all cgi function. It takes the url passed to it, looks up the corresponding
 //path in the filesystem and if it exists, passes the file through. This simulates what a normal
@@ -26,10 +68,11 @@ static const char *gzipNonSupportedMessage = "HTTP/1.0 501 Not implemented\r\nSe
 int ICACHE_FLASH_ATTR 
 cgiEspFsHook(HttpdConnData *connData) {
 	EspFsFile *file=connData->cgiData;
-	int len;
-	char buff[1024];
 	char acceptEncodingBuffer[64];
-	int isGzip;
+	char etag[12], ifNoneMatch[64];
+	uint32_t hash;
+	int isGzip, hasEtag, seekable;
+	int size, start, end, range=0;
 
 	//os_printf("cgiEspFsHook conn=%p conn->conn=%p file=%p\n", connData, connData->conn, file);
 
@@ -71,33 +114,74 @@ cgiEspFsHook(HttpdConnData *connData) {
 			httpdGetHeader(connData, "Accept-Encoding", acceptEncodingBuffer, 64);
 			if (os_strstr(acceptEncodingBuffer, "gzip") == NULL) {
 				//No Accept-Encoding: gzip header present
-				httpdSend(connData, gzipNonSupportedMessage, -1);
+				httpdSendRef(connData, gzipNonSupportedMessage, sizeof(gzipNonSupportedMessage)-1);
+				espFsClose(file);
+				return HTTPD_CGI_DONE;
+			}
+		}
+
+		// Files with a content hash get it as ETag, if the browser already has this version it
+		// gets a 304 without the file.
+		hasEtag = espFsHash(file, &hash);
+		if (hasEtag) {
+			os_sprintf(etag, "\"%08x\"", (unsigned int)hash);
+			if (httpdGetHeader(connData, "If-None-Match", ifNoneMatch, sizeof(ifNoneMatch)) &&
+					(os_strstr(ifNoneMatch, etag) != NULL || os_strcmp(ifNoneMatch, "*") == 0)) {
 				espFsClose(file);
+				httpdStartResponse(connData, 304);
+				httpdHeader(connData, "ETag", etag);
+				httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
+				httpdEndHeaders(connData);
 				return HTTPD_CGI_DONE;
 			}
 		}
 
+		// Stored files can be fetched in parts, unless If-Range says the browser has a different
+		// version of the file. Setting the range to the whole file tells whether the file is
+		// stored as is, compressed files can't be read from the middle.
+		size = espFsSize(file);
+		start = 0;
+		end = size;
+		seekable = !isGzip && espFsRange(file, 0, size);
+		if (seekable && httpdGetHeader(connData, "Range", acceptEncodingBuffer, sizeof(acceptEncodingBuffer)) &&
+				(!httpdGetHeader(connData, "If-Range", ifNoneMatch, sizeof(ifNoneMatch)) ||
+				(hasEtag && os_strcmp(ifNoneMatch, etag) == 0))) {
+			range = parseRange(acceptEncodingBuffer, size, &start, &end);
+		}
+		if (range < 0) {
+			espFsClose(file);
+			os_sprintf(acceptEncodingBuffer, "bytes */%d", size);
+			httpdStartResponse(connData, 416);
+			httpdHeader(connData, "Content-Range", acceptEncodingBuffer);
+			httpdHeader(connData, "Content-Length", "0");
+			httpdEndHeaders(connData);
+			return HTTPD_CGI_DONE;
+		}
+		if (range > 0) espFsRange(file, start, end-start);
+
 		connData->cgiData=file;
-		httpdStartResponse(connData, 200);
+		httpdStartResponse(connData, range ? 206 : 200);
 		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
 		if (isGzip) {
 			httpdHeader(connData, "Content-Encoding", "gzip");
 		}
+		if (seekable) {
+			httpdHeader(connData, "Accept-Ranges", "bytes");
+		}
+		if (range) {
+			os_sprintf(acceptEncodingBuffer, "bytes %d-%d/%d", start, end-1, size);
+			httpdHeader(connData, "Content-Range", acceptEncodingBuffer);
+		}
+		os_sprintf(acceptEncodingBuffer, "%d", end-start);
+		httpdHeader(connData, "Content-Length", acceptEncodingBuffer);
+		if (hasEtag) {
+			httpdHeader(connData, "ETag", etag);
+		}
 		httpdHeader(connData, "Cache-Control", "max-age=3600, must-revalidate");
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(file, buff, 1024);
-	if (len>0) espconn_sent(connData->conn, (uint8 *)buff, len);
-	if (len!=1024) {
-		//We're done.
-		espFsClose(file);
-		return HTTPD_CGI_DONE;
-	} else {
-		//Ok, till next time.
-		return HTTPD_CGI_MORE;
-	}
+	return espFsHookSend(connData, file);
 }
 
 #if 0
@@ -174,28 +258,30 @@ error: // error response
 }
 #endif
 
-#if 0
-//cgiEspFsTemplate can be used as a template.
+//cgiEspFsTemplate serves a template, calling the TplCallback in cgiArg for each %token%. The
+//template has been split into literal and token segments by mkespfsimage (see espfsformat.h),
+//so the literal text is read straight into the output buffer in bulk.
+
+//Room left in the output buffer for a token callback to fill in
+#define TPL_TOKEN_ROOM 512
 
 typedef struct {
 	EspFsFile *file;
 	void *tplArg;
-	char token[64];
-	int tokenPos;
+	int literal; //bytes left in the current literal segment
+	char token[TPL_TOKEN_MAX+1];
 } TplData;
 
-typedef void (* TplCallback)(HttpdConnData *connData, char *token, void **arg);
-
 int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 	TplData *tpd=connData->cgiData;
-	int len;
-	int x, sp=0;
-	char *e=NULL;
-	char buff[1025];
+	TplCallback cb=(TplCallback)connData->cgiArg;
+	int avail;
+	char *buff;
 
 	if (connData->conn==NULL) {
 		//Connection aborted. Clean up.
-		((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
+		if (tpd==NULL) return HTTPD_CGI_DONE;
+		cb(connData, NULL, &tpd->tplArg);
 		espFsClose(tpd->file);
 		os_free(tpd);
 		return HTTPD_CGI_DONE;
@@ -203,76 +289,57 @@ int ICACHE_FLASH_ATTR cgiEspFsTemplate(HttpdConnData *connData) {
 
 	if (tpd==NULL) {
 		//First call to this cgi. Open the file so we can read it.
-		tpd=(TplData *)os_malloc(sizeof(TplData));
-		tpd->file=espFsOpen(connData->url);
-		tpd->tplArg=NULL;
-		tpd->tokenPos=-1;
-		if (tpd->file==NULL) {
-			espFsClose(tpd->file);
-			os_free(tpd);
+		EspFsFile *file=espFsOpen(espLinkCtx, connData->url);
+		if (file==NULL) return HTTPD_CGI_NOTFOUND;
+		if (!(espFsFlags(file) & FLAG_TEMPLATE)) {
+			os_printf("cgiEspFsTemplate: %s is not a template\n", connData->url);
+			espFsClose(file);
 			return HTTPD_CGI_NOTFOUND;
 		}
-		if (espFsFlags(tpd->file) & FLAG_GZIP) {
-			os_printf("cgiEspFsTemplate: Trying to use gzip-compressed file %s as template!\n", connData->url);
-			espFsClose(tpd->file);
-			os_free(tpd);
-			return HTTPD_CGI_NOTFOUND;
+		tpd=(TplData *)os_malloc(sizeof(TplData));
+		if (tpd==NULL) {
+			espFsClose(file);
+			errorResponse(connData, 500, "Out of memory");
+			return HTTPD_CGI_DONE;
 		}
+		tpd->file=file;
+		tpd->tplArg=NULL;
+		tpd->literal=0;
 		connData->cgiData=tpd;
 		httpdStartResponse(connData, 200);
 		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
 		httpdEndHeaders(connData);
-		return HTTPD_CGI_MORE;
 	}
 
-	len=espFsRead(tpd->file, buff, 1024);
-	if (len>0) {
-		sp=0;
-		e=buff;
-		for (x=0; x<len; x++) {
-			if (tpd->tokenPos==-1) {
-				//Inside ordinary text.
-				if (buff[x]=='%') {
-					//Send raw data up to now
-					if (sp!=0) httpdSend(connData, e, sp);
-					sp=0;
-					//Go collect token chars.
-					tpd->tokenPos=0;
-				} else {
-					sp++;
-				}
-			} else {
-				if (buff[x]=='%') {
-					if (tpd->tokenPos==0) {
-						//This is the second % of a %% escape string.
-						//Send a single % and resume with the normal program flow.
-						httpdSend(connData, "%", 1);
-					} else {
-						//This is an actual token.
-						tpd->token[tpd->tokenPos++]=0; //zero-terminate token
-						((TplCallback)(connData->cgiArg))(connData, tpd->token, &tpd->tplArg);
-					}
-					//Go collect normal chars again.
-					e=&buff[x+1];
-					tpd->tokenPos=-1;
-				} else {
-					if (tpd->tokenPos<(sizeof(tpd->token)-1)) tpd->token[tpd->tokenPos++]=buff[x];
-				}
-			}
+	while (1) {
+		buff=httpdSendBuf(connData, &avail);
+		if (tpd->literal>0) {
+			//Copy as much of the literal text as fits
+			int len=espFsRead(tpd->file, buff, tpd->literal<avail ? tpd->literal : avail);
+			httpdSendCommit(connData, len);
+			if (len==0 && avail>0) break; //truncated image
+			tpd->literal-=len;
+			if (tpd->literal>0) return HTTPD_CGI_MORE;
+			continue;
+		}
+		if (avail<TPL_TOKEN_ROOM) return HTTPD_CGI_MORE;
+
+		uint8_t seg[2];
+		if (espFsRead(tpd->file, (char *)seg, 2)!=2) break; //end of the template
+		int len=(seg[0] | (seg[1]<<8)) & TPL_LEN_MAX;
+		if (seg[1] & (TPL_TOKEN>>8)) {
+			if (len>TPL_TOKEN_MAX || espFsRead(tpd->file, tpd->token, len)!=len) break;
+			tpd->token[len]=0;
+			cb(connData, tpd->token, &tpd->tplArg);
+		} else {
+			tpd->literal=len;
 		}
 	}
-	//Send remaining bit.
-	if (sp!=0) httpdSend(connData, e, sp);
-	if (len!=1024) {
-		//We're done.
-		((TplCallback)(connData->cgiArg))(connData, NULL, &tpd->tplArg);
-		espFsClose(tpd->file);
-		os_free(tpd);
-		return HTTPD_CGI_DONE;
-	} else {
-		//Ok, till next time.
-		return HTTPD_CGI_MORE;
-	}
-}
-#endif
 
+	//We're done.
+	cb(connData, NULL, &tpd->tplArg);
+	espFsClose(tpd->file);
+	os_free(tpd);
+	connData->cgiData=NULL;
+	return HTTPD_CGI_DONE;
+}
@@ -7,8 +7,12 @@
 #include "cgi.h"
 #include "httpd.h"
 
+//Gets called for each token of a template with the token name and a pointer to a per-request
+//argument, and once more with token=NULL at the end so it can clean up
+typedef void (* TplCallback)(HttpdConnData *connData, char *token, void **arg);
+
 int cgiEspFsHook(HttpdConnData *connData);
-//int cgiEspFsTemplate(HttpdConnData *connData);
+int cgiEspFsTemplate(HttpdConnData *connData);
 //int ICACHE_FLASH_ATTR cgiEspFsHtml(HttpdConnData *connData);
 
 #endif
@@ -0,0 +1,151 @@
+/*
+Streaming JSON writer for cgis, see httpdjson.h
+*/
+
+#include <esp8266.h>
+#include "httpdjson.h"
+
+// The state packs the nesting depth in the low 4 bits, then one bit per level telling whether
+// it's an array and one bit per level telling whether it already has a member
+#define JS_DEPTH(s)   ((s) & 0xf)
+#define JS_ARR(d)     (1u << (4 + (d)))
+#define JS_COMMA(d)   (1u << (4 + JSON_MAX_DEPTH + 1 + (d)))
+
+void ICACHE_FLASH_ATTR jsonBegin(JsonWriter *w, HttpdConnData *conn, uint32_t state) {
+  w->conn = conn;
+  w->buf = httpdSendBuf(conn, &w->avail);
+  w->len = w->markLen = 0;
+  w->state = w->markState = state;
+  w->full = false;
+}
+
+void ICACHE_FLASH_ATTR jsonBeginBuf(JsonWriter *w, char *buf, int len) {
+  w->conn = NULL;
+  w->buf = buf;
+  w->avail = len;
+  w->len = w->markLen = 0;
+  w->state = w->markState = 0;
+  w->full = false;
+}
+
+uint32_t ICACHE_FLASH_ATTR jsonCheckpoint(JsonWriter *w) {
+  if (!w->full) {
+    w->markLen = w->len;
+    w->markState = w->state;
+  }
+  return w->markState;
+}
+
+bool ICACHE_FLASH_ATTR jsonEnd(JsonWriter *w) {
+  if (w->full) w->len = w->markLen;
+  if (w->conn != NULL) httpdSendCommit(w->conn, w->len);
+  return !w->full;
+}
+
+static void ICACHE_FLASH_ATTR jsonPut(JsonWriter *w, const char *s, int n) {
+  if (w->full) return;
+  if (w->len + n > w->avail) {
+    w->full = true;
+    return;
+  }
+  os_memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+// Separator and key in front of a value
+static void ICACHE_FLASH_ATTR jsonKey(JsonWriter *w, const char *key) {
+  int d = JS_DEPTH(w->state);
+  if (w->state & JS_COMMA(d)) jsonPut(w, ",", 1);
+  w->state |= JS_COMMA(d);
+  if (key != NULL && d > 0 && !(w->state & JS_ARR(d))) {
+    jsonPut(w, "\"", 1);
+    jsonPut(w, key, os_strlen(key));
+    jsonPut(w, "\":", 2);
+  }
+}
+
+static void ICACHE_FLASH_ATTR jsonOpen(JsonWriter *w, const char *key, bool arr) {
+  jsonKey(w, key);
+  int d = JS_DEPTH(w->state) + 1;
+  if (d > JSON_MAX_DEPTH) {
+    w->full = true; // can't be represented, treat it like running out of space
+    return;
+  }
+  w->state = (w->state & ~0xf & ~JS_ARR(d) & ~JS_COMMA(d)) | d | (arr ? JS_ARR(d) : 0);
+  jsonPut(w, arr ? "[" : "{", 1);
+}
+
+void ICACHE_FLASH_ATTR jsonObject(JsonWriter *w, const char *key) {
+  jsonOpen(w, key, false);
+}
+
+void ICACHE_FLASH_ATTR jsonArray(JsonWriter *w, const char *key) {
+  jsonOpen(w, key, true);
+}
+
+void ICACHE_FLASH_ATTR jsonClose(JsonWriter *w) {
+  int d = JS_DEPTH(w->state);
+  if (d == 0) return;
+  jsonPut(w, w->state & JS_ARR(d) ? "]" : "}", 1);
+  w->state = (w->state & ~0xf) | (d-1);
+}
+
+void ICACHE_FLASH_ATTR jsonStringN(JsonWriter *w, const char *key, const char *val, int maxLen) {
+  jsonKey(w, key);
+  jsonPut(w, "\"", 1);
+  // copy runs of characters that don't need escaping in one go
+  const char *run = val;
+  for (int i=0; i<maxLen && val[i] != 0; i++) {
+    unsigned char c = val[i];
+    if (c >= ' ' && c != '"' && c != '\\') continue;
+    jsonPut(w, run, val + i - run);
+    run = val + i + 1;
+    char esc[8];
+    switch (c) {
+    case '"': jsonPut(w, "\\\"", 2); break;
+    case '\\': jsonPut(w, "\\\\", 2); break;
+    case '\n': jsonPut(w, "\\n", 2); break;
+    case '\r': jsonPut(w, "\\r", 2); break;
+    case '\t': jsonPut(w, "\\t", 2); break;
+    default:
+      os_sprintf(esc, "\\u%04x", c);
+      jsonPut(w, esc, 6);
+    }
+  }
+  const char *end = run;
+  while (end - val < maxLen && *end != 0) end++;
+  jsonPut(w, run, end - run);
+  jsonPut(w, "\"", 1);
+}
+
+void ICACHE_FLASH_ATTR jsonString(JsonWriter *w, const char *key, const char *val) {
+  jsonStringN(w, key, val, 0x7fff);
+}
+
+void ICACHE_FLASH_ATTR jsonInt(JsonWriter *w, const char *key, int32_t val) {
+  char buf[12];
+  jsonKey(w, key);
+  jsonPut(w, buf, os_sprintf(buf, "%ld", (long)val));
+}
+
+void ICACHE_FLASH_ATTR jsonUInt(JsonWriter *w, const char *key, uint32_t val) {
+  char buf[12];
+  jsonKey(w, key);
+  jsonPut(w, buf, os_sprintf(buf, "%lu", (unsigned long)val));
+}
+
+void ICACHE_FLASH_ATTR jsonBool(JsonWriter *w, const char *key, bool val) {
+  jsonKey(w, key);
+  jsonPut(w, val ? "true" : "false", val ? 4 : 5);
+}
+
+void ICACHE_FLASH_ATTR jsonIP(JsonWriter *w, const char *key, uint32_t ip) {
+  char buf[16];
+  os_sprintf(buf, IPSTR, IP2STR(&ip));
+  jsonString(w, key, buf);
+}
+
+void ICACHE_FLASH_ATTR jsonRaw(JsonWriter *w, const char *key, const char *val) {
+  jsonKey(w, key);
+  jsonPut(w, val, os_strlen(val));
+}
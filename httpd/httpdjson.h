@@ -0,0 +1,63 @@
+#ifndef HTTPDJSON_H
+#define HTTPDJSON_H
+
+#include "httpd.h"
+
+// Streaming JSON writer: the output goes straight into the connection's send buffer, so cgis
+// don't need big buffers on the stack. Commas between members, the quoting of keys and the
+// escaping of strings are taken care of. Once the send buffer is full all further output is
+// dropped, a cgi that produces more than fits takes checkpoints between items: jsonEnd then
+// cuts the output at the last checkpoint and the cgi continues from there on the next call,
+// starting the writer with the state jsonCheckpoint returned.
+//
+//   JsonWriter w;
+//   jsonBegin(&w, connData, 0);
+//   jsonObject(&w, NULL);
+//   jsonString(&w, "ssid", ssid);
+//   jsonInt(&w, "rssi", rssi);
+//   jsonClose(&w);
+//   jsonEnd(&w);
+//
+// jsonBeginBuf writes into a plain buffer instead, e.g. for an MQTT message, w.len is the length
+// of the output after jsonEnd.
+
+#define JSON_MAX_DEPTH 13
+
+typedef struct JsonWriter {
+  HttpdConnData *conn; // NULL when writing into a plain buffer
+  char     *buf;       // free space in the send buffer
+  int      len, avail; // bytes written into buf, size of buf
+  uint32_t state;      // nesting depth and which levels are arrays and need a comma
+  int      markLen;    // len at the last checkpoint
+  uint32_t markState;  // state at the last checkpoint
+  bool     full;       // output didn't fit, everything after markLen is dropped
+} JsonWriter;
+
+// Start writing, state is 0 for a new document or what jsonCheckpoint returned
+void jsonBegin(JsonWriter *w, HttpdConnData *conn, uint32_t state);
+// Start writing a new document into buf, which holds len bytes
+void jsonBeginBuf(JsonWriter *w, char *buf, int len);
+// Mark a point where the output can be cut, returns the state to continue from there
+uint32_t jsonCheckpoint(JsonWriter *w);
+// Commit the output to the send buffer, returns false if it got cut at a checkpoint. With a
+// plain buffer the output is just cut.
+bool jsonEnd(JsonWriter *w);
+
+// Open an object or array as a member (key) of an object or an element (key NULL) of an array
+void jsonObject(JsonWriter *w, const char *key);
+void jsonArray(JsonWriter *w, const char *key);
+// Close the innermost object or array
+void jsonClose(JsonWriter *w);
+
+// Members or elements, keys are not escaped
+void jsonString(JsonWriter *w, const char *key, const char *val);
+void jsonStringN(JsonWriter *w, const char *key, const char *val, int maxLen);
+void jsonInt(JsonWriter *w, const char *key, int32_t val);
+void jsonUInt(JsonWriter *w, const char *key, uint32_t val);
+void jsonBool(JsonWriter *w, const char *key, bool val);
+// An IP address in dotted quad notation, as a string
+void jsonIP(JsonWriter *w, const char *key, uint32_t ip);
+// Preformatted JSON value
+void jsonRaw(JsonWriter *w, const char *key, const char *val);
+
+#endif
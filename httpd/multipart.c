@@ -21,6 +21,8 @@ struct _MultipartCtx {
   int               recvPosition;       // receive position (how many bytes was processed from the HTTP post)
   char *            boundaryBuffer;     // buffer used for boundary detection
   int               boundaryBufferPtr;  // pointer in the boundary buffer
+  int               boundaryLen;        // length of the boundary
+  uint8_t *         skip;               // boundary search skip table, after the boundary buffer
   MultipartState    state;              // multipart processing state
 };
 
@@ -31,6 +33,8 @@ MultipartCtx * ICACHE_FLASH_ATTR multipartCreateContext(MultipartCallback callba
   ctx->callBack = callback;
   ctx->position = ctx->startTime = ctx->recvPosition = ctx->boundaryBufferPtr = 0;
   ctx->boundaryBuffer = NULL;
+  ctx->skip = NULL;
+  ctx->boundaryLen = 0;
   ctx->state = STATE_SEARCH_BOUNDARY;
   return ctx;
 }
@@ -39,7 +43,8 @@ MultipartCtx * ICACHE_FLASH_ATTR multipartCreateContext(MultipartCallback callba
 void ICACHE_FLASH_ATTR multipartAllocBoundaryBuffer(MultipartCtx * context)
 {
   if( context->boundaryBuffer == NULL )
-    context->boundaryBuffer = (char *)os_malloc(3*BOUNDARY_SIZE + 1);
+    context->boundaryBuffer = (char *)os_malloc(3*BOUNDARY_SIZE + 1 + 256);
+  context->skip = (uint8_t *)context->boundaryBuffer + 3*BOUNDARY_SIZE + 1;
   context->boundaryBufferPtr = 0;
 }
 
@@ -50,6 +55,7 @@ void ICACHE_FLASH_ATTR multipartFreeBoundaryBuffer(MultipartCtx * context)
   {
     os_free(context->boundaryBuffer);
     context->boundaryBuffer = NULL;
+    context->skip = NULL;
   }
 }
 
@@ -60,174 +66,235 @@ void ICACHE_FLASH_ATTR multipartDestroyContext(MultipartCtx * context)
   os_free(context);
 }
 
-// this is because of os_memmem is missing
-void * mp_memmem(const void *l, size_t l_len, const void *s, size_t s_len)
+// Boundary search, Boyer-Moore-Horspool: compare the last byte of the boundary at the current
+// position and on a mismatch jump ahead by how far that byte is from the end of the boundary.
+// The skip table is built once per request, the boundary is at most BOUNDARY_SIZE so it fits
+// in bytes. Returns the offset of the boundary in buf or -1.
+static void ICACHE_FLASH_ATTR multipartBuildSkip(MultipartCtx * context, char * boundary)
 {
-	register char *cur, *last;
-	const char *cl = (const char *)l;
-	const char *cs = (const char *)s;
+  int blen = context->boundaryLen;
+  os_memset(context->skip, blen, 256);
+  for( int i=0; i < blen-1; i++ )
+    context->skip[(uint8_t)boundary[i]] = blen - 1 - i;
+}
 
-	/* we need something to compare */
-	if (l_len == 0 || s_len == 0)
-		return NULL;
+static int ICACHE_FLASH_ATTR multipartFindBoundary(MultipartCtx * context, char * boundary, char * buf, int len)
+{
+  int last = context->boundaryLen - 1;
+  int i = 0;
+  while( i + last < len )
+  {
+    uint8_t c = buf[i + last];
+    if( c == (uint8_t)boundary[last] && os_memcmp(buf + i, boundary, last) == 0 )
+      return i;
+    i += context->skip[c];
+  }
+  return -1;
+}
 
-	/* "s" must be smaller or equal to "l" */
-	if (l_len < s_len)
-		return NULL;
+// process one line of the part headers, buf[len] is writable and gets zero-terminated meanwhile
+static int ICACHE_FLASH_ATTR multipartProcessHeader(MultipartCtx * context, char * buf, int len)
+{
+  char c = buf[len];
+  buf[len] = 0;
 
-	/* special case where s_len == 1 */
-	if (s_len == 1)
-		return memchr(l, (int)*cs, l_len);
+  if( context->state == STATE_SEARCH_HEADER_END )
+  {
+    if( len == 1 || ( ( len == 2 ) && ( buf[0] == '\r' ) ) ) // empty line?
+    {
+      context->state = STATE_UPLOAD_FILE;
+      context->position = 0;
+    }
+  }
+  else if( os_strncmp( buf, "Content-Disposition:",  20 ) == 0 )
+  {
+    char * fnam = os_strstr( buf, "filename=" );
+    if( fnam != NULL )
+    {
+      int pos = fnam - buf + 9;
+      while(buf[pos] == ' ') pos++; // skip spaces
+      if( buf[pos] == '"' ) // quote start
+      {
+        pos++;
+        int start = pos;
+        while( pos < len && buf[pos] != '"' ) // quote end
+          pos++;
+        if( pos < len )
+        {
+          buf[pos] = 0; // terminating zero for the file name
+          os_printf("Uploading file: %s\n", buf + start);
+          if( context->callBack( FILE_START, buf + start, pos - start, 0 ) ) // FILE_START callback
+          {
+            buf[len] = c;
+            return 1; // if an error happened
+          }
+          buf[pos] = '"'; // restore the original quote
+          context->state = STATE_SEARCH_HEADER_END;
+        }
+      }
+    }
+  }
 
-	/* the last position where its possible to find "s" in "l" */
-	last = (char *)cl + l_len - s_len;
+  buf[len] = c;
+  return 0;
+}
 
-	for (cur = (char *)cl; cur <= last; cur++)
-		if (cur[0] == cs[0] && memcmp(cur, cs, s_len) == 0)
-			return cur;
+// hand file data to the callback, terminated by a zero (for easier handling)
+static int ICACHE_FLASH_ATTR multipartFileData(MultipartCtx * context, char * buf, int len)
+{
+  if( len == 0 )
+    return 0;
+  char c = buf[len];
+  buf[len] = 0;
+  int err = context->callBack( FILE_DATA, buf, len, context->position ); // FILE_DATA callback
+  buf[len] = c;
+  context->position += len;
+  return err;
+}
 
-	return NULL;
+// the boundary was reached
+static int ICACHE_FLASH_ATTR multipartBoundaryDone(MultipartCtx * context)
+{
+  if( context->state == STATE_UPLOAD_FILE )
+  {
+    if( context->callBack( FILE_DONE, NULL, 0, context->position ) ) // file done callback
+      return 1; // if an error happened
+    os_printf("File upload done\n");
+  }
+  context->state = STATE_SEARCH_HEADER; // search the next header
+  return 0;
 }
 
+// Process as much of buf as can be, buf[len] must be writable. Unless this is the last of the
+// data the processing stops where a boundary or a header line may continue in the next packet.
+// Returns the number of bytes used up or -1 on error.
+static int ICACHE_FLASH_ATTR multipartScan(MultipartCtx * context, char * boundary, char * buf, int len, int last)
+{
+  int blen = context->boundaryLen;
+  int pos = 0;
+
+  while( pos < len )
+  {
+    if( context->state == STATE_SEARCH_HEADER || context->state == STATE_SEARCH_HEADER_END )
+    {
+      int lineLen = 0;
+      while( pos + lineLen < len && buf[pos + lineLen] != '\n' )
+        lineLen++;
+      if( pos + lineLen < len )
+        lineLen++; // include the newline
+      else if( ! last )
+      {
+        if( lineLen < BOUNDARY_SIZE )
+          break; // wait for the rest of the line
+        lineLen = BOUNDARY_SIZE; // overlong lines are chopped
+      }
+
+      if( lineLen >= blen && os_memcmp( buf + pos, boundary, blen ) == 0 )
+      {
+        if( multipartBoundaryDone(context) )
+          return -1;
+        pos += blen; // process the rest of the line as a header
+      }
+      else
+      {
+        if( multipartProcessHeader(context, buf + pos, lineLen) )
+          return -1;
+        pos += lineLen;
+      }
+    }
+    else // searching the first boundary or uploading a file
+    {
+      int found = multipartFindBoundary(context, boundary, buf + pos, len - pos);
+      int dataSize = found;
+      if( found < 0 )
+      {
+        // the end could be the start of a boundary, file data is passed on in multiples of 4
+        // bytes so the flash writes stay aligned
+        dataSize = len - pos;
+        if( ! last )
+        {
+          dataSize -= blen - 1;
+          if( context->state == STATE_UPLOAD_FILE )
+            dataSize &= ~3;
+          if( dataSize <= 0 )
+            break;
+        }
+      }
+
+      if( context->state == STATE_UPLOAD_FILE && multipartFileData(context, buf + pos, dataSize) )
+        return -1;
+      pos += dataSize;
+
+      if( found >= 0 )
+      {
+        if( multipartBoundaryDone(context) )
+          return -1;
+        pos += blen; // jump over the boundary
+      }
+      else if( ! last )
+        break;
+    }
+  }
+
+  return pos;
+}
 
 // this method is for processing data coming from the HTTP post request
 //   context:   the multipart context
 //   boundary:  a string which indicates boundary
-//   data:      the received data
-//   len:       the received data length (can't be bigger than BOUNDARY_SIZE)
+//   data:      the received data, data[len] must be writable
+//   len:       the received data length
 //   last:      last packet indicator
 //
 // Detecting a boundary is not easy. One has to take care of boundaries which are splitted in 2 packets
 //   [Packet 1, 5 bytes of the boundary][Packet 2, remaining 10 bytes of the boundary];
 //
 // Algorythm:
-//   - create a buffer which size is 3*BOUNDARY_SIZE
-//   - put data into the buffer as long as the buffer size is smaller than 2*BOUNDARY_SIZE
-//   - search boundary in the received buffer, if found: boundary reached -> process data before boundary -> process boundary
-//   - if not found -> process the first BOUNDARY_SIZE amount of bytes from the buffer
-//   - remove processed data from the buffer
+//   - the data is processed in place, file data goes to the callback in spans as large as the
+//     packet, the last boundaryLen-1 bytes are held back as they could be part of a boundary
+//   - what's held back is kept in the boundary buffer, when the next packet comes in as much of
+//     it as fits is appended and that's processed, until everything that was held back is used up
+//   - then processing continues in place in the packet
 // this algorythm guarantees that no boundary loss will happen
 
 int ICACHE_FLASH_ATTR multipartProcessData(MultipartCtx * context, char * boundary, char * data, int len, int last)
 {
-  if( len != 0 ) // add data to the boundary buffer
-  {
-    os_memcpy(context->boundaryBuffer + context->boundaryBufferPtr, data, len);
-    
-    context->boundaryBufferPtr += len;
-    context->boundaryBuffer[context->boundaryBufferPtr] = 0;
-  }
-  
+  // first the data from the previous packet
   while( context->boundaryBufferPtr > 0 )
   {
-    if( ! last && context->boundaryBufferPtr <= 2 * BOUNDARY_SIZE ) // return if buffer is too small and not the last packet is processed
-      return 0;
-  
-    int dataSize = BOUNDARY_SIZE;
-  
-    char * boundaryLoc = mp_memmem( context->boundaryBuffer, context->boundaryBufferPtr, boundary, os_strlen(boundary) );
-    if( boundaryLoc != NULL )
-    {
-      int pos = boundaryLoc - context->boundaryBuffer;
-      if( pos > BOUNDARY_SIZE ) // process in the next call
-        boundaryLoc = NULL;
-      else
-        dataSize = pos;
-    }
-    
-    if( dataSize != 0 ) // data to process
+    int held = context->boundaryBufferPtr;
+    int n = 3*BOUNDARY_SIZE - held;
+    if( n > len )
+      n = len;
+    os_memcpy(context->boundaryBuffer + held, data, n);
+    context->boundaryBufferPtr += n;
+
+    int used = multipartScan(context, boundary, context->boundaryBuffer, context->boundaryBufferPtr, last && n == len);
+    if( used < 0 )
+      return 1;
+    if( used >= held ) // the held back data is used up, go on with the packet
     {
-      switch( context->state )
-      {
-        case STATE_SEARCH_HEADER:
-        case STATE_SEARCH_HEADER_END:
-          {
-            char * chr = os_strchr( context->boundaryBuffer, '\n' );
-            if( chr != NULL )
-            {
-	      // chop datasize to contain only one line
-              int pos = chr - context->boundaryBuffer + 1;
-              if( pos < dataSize ) // if chop smaller than the dataSize, delete the boundary
-              {
-                dataSize = pos;
-                boundaryLoc = NULL; // process boundary next time
-              }
-              if( context->state == STATE_SEARCH_HEADER_END )
-              {
-                if( pos == 1 || ( ( pos == 2 ) && ( context->boundaryBuffer[0] == '\r' ) ) ) // empty line?
-                {
-                  context->state = STATE_UPLOAD_FILE;
-                  context->position = 0;
-                }
-              }
-              else if( os_strncmp( context->boundaryBuffer, "Content-Disposition:",  20 ) == 0 )
-              {
-                char * fnam = os_strstr( context->boundaryBuffer, "filename=" );
-                if( fnam != NULL )
-                {
-                  int pos = fnam - context->boundaryBuffer + 9;
-                  if( pos < dataSize )
-                  {
-                    while(context->boundaryBuffer[pos] == ' ') pos++; // skip spaces
-                    if( context->boundaryBuffer[pos] == '"' ) // quote start
-                    {
-                      pos++;
-                      int start = pos;
-                      while( pos < context->boundaryBufferPtr )
-                      {
-                        if( context->boundaryBuffer[pos] == '"' ) // quote end
-                          break;
-                        pos++;
-                      }
-                      if( pos < context->boundaryBufferPtr )
-                      {
-                        context->boundaryBuffer[pos] = 0; // terminating zero for the file name
-                        os_printf("Uploading file: %s\n", context->boundaryBuffer + start);
-                        if( context->callBack( FILE_START, context->boundaryBuffer + start, pos - start, 0 ) ) // FILE_START callback
-			  return 1; // if an error happened
-                        context->boundaryBuffer[pos] = '"'; // restore the original quote
-                        context->state = STATE_SEARCH_HEADER_END;
-                      }
-                    }
-                  }
-                }
-              }
-            }
-          }
-          break;
-        case STATE_UPLOAD_FILE:
-          {
-            char c = context->boundaryBuffer[dataSize];
-            context->boundaryBuffer[dataSize] = 0; // add terminating zero (for easier handling)
-            if( context->callBack( FILE_DATA, context->boundaryBuffer, dataSize, context->position ) ) // FILE_DATA callback
-	      return 1;
-            context->boundaryBuffer[dataSize] = c;
-            context->position += dataSize;
-          }
-          break;
-        default:
-          break;
-      }
+      context->boundaryBufferPtr = 0;
+      data += used - held;
+      len -= used - held;
+      break;
     }
-    
-    if( boundaryLoc != NULL ) // boundary found?
-    {
-      dataSize += os_strlen(boundary); // jump over the boundary
-      if( context->state == STATE_UPLOAD_FILE )
-      {
-        if( context->callBack( FILE_DONE, NULL, 0, context->position ) ) // file done callback
-	  return 1; // if an error happened
-        os_printf("File upload done\n");
-      }
 
-      context->state = STATE_SEARCH_HEADER; // search the next header
-    }
-    
-    // move the buffer back with dataSize
-    context->boundaryBufferPtr -= dataSize;
-    os_memcpy(context->boundaryBuffer, context->boundaryBuffer + dataSize, context->boundaryBufferPtr);
+    context->boundaryBufferPtr -= used;
+    os_memmove(context->boundaryBuffer, context->boundaryBuffer + used, context->boundaryBufferPtr);
+    data += n;
+    len -= n;
+    if( len == 0 )
+      return 0;
   }
-  
+
+  int used = multipartScan(context, boundary, data, len, last);
+  if( used < 0 )
+    return 1;
+
+  // hold back the rest for the next packet
+  os_memcpy(context->boundaryBuffer, data + used, len - used);
+  context->boundaryBufferPtr = len - used;
   return 0;
 }
 
@@ -254,26 +321,23 @@ int ICACHE_FLASH_ATTR multipartProcess(MultipartCtx * context, HttpdConnData * c
       context->state = STATE_SEARCH_BOUNDARY;
  
       multipartAllocBoundaryBuffer(context);
-      
-      if( context->callBack( FILE_UPLOAD_START, NULL, 0, context->position ) ) // start uploading files
+      context->boundaryLen = os_strlen(post->multipartBoundary);
+      if( context->boundaryLen > BOUNDARY_SIZE )
+      {
+        os_printf("Multipart boundary too long\n");
+        context->state = STATE_ERROR;
+      }
+      else
+        multipartBuildSkip(context, post->multipartBoundary);
+
+      if( context->state != STATE_ERROR && context->callBack( FILE_UPLOAD_START, NULL, 0, context->position ) ) // start uploading files
         context->state = STATE_ERROR;
     }
 
     if( context->state != STATE_ERROR )
     {
-      int feed = 0;
-      while( feed < post->buffLen )
-      {
-        int len = post->buffLen - feed;
-        if( len > BOUNDARY_SIZE )
-          len = BOUNDARY_SIZE;
-        if( multipartProcessData(context, post->multipartBoundary, post->buff + feed, len, 0) )
-        {
-          context->state = STATE_ERROR;
-          break;
-        }
-        feed += len;
-      }
+      if( multipartProcessData(context, post->multipartBoundary, post->buff, post->buffLen, 0) )
+        context->state = STATE_ERROR;
     }
     
     context->recvPosition += post->buffLen;
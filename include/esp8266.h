@@ -12,6 +12,16 @@
 #include <string.h>
 
 #include <c_types.h>
+#include "flashdata.h"
+
+// The serial hot path is marked HOT_IRAM_ATTR instead of ICACHE_FLASH_ATTR. Built with
+// HOT_IRAM=yes it goes into IRAM, where WiFi and httpd code can't evict it from the cache,
+// else it goes into flash like everything else.
+#ifdef HOT_IRAM
+#define HOT_IRAM_ATTR __attribute__((section(".text.hot")))
+#else
+#define HOT_IRAM_ATTR ICACHE_FLASH_ATTR
+#endif
 #include <ip_addr.h>
 #include <espconn.h>
 #include <ets_sys.h>
@@ -23,6 +33,7 @@
 
 #include "espmissingincludes.h"
 #include "uart_hw.h"
+#include "heapprof.h"
 
 #ifdef __WIN32__
 #include <_mingw.h>
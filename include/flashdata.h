@@ -0,0 +1,37 @@
+#ifndef FLASHDATA_H
+#define FLASHDATA_H
+
+// Constant data marked FLASH_DATA stays in flash instead of being copied into DRAM at boot.
+// Flash can only be read 32 bits at a time, so it must not be handed to os_printf, os_strcmp
+// and friends, which read bytes: use the accessors below, or httpdSendRef with the length,
+// which knows about flash. Tables of strings are best declared as 2-dimensional char arrays,
+// an array of pointers would leave the strings themselves in DRAM.
+
+#define FLASH_DATA ICACHE_RODATA_ATTR STORE_ATTR
+
+// Read a byte of FLASH_DATA
+static inline uint8_t flashReadByte(const void *p) {
+  uintptr_t a = (uintptr_t)p;
+  return *(const volatile uint32_t *)(a & ~3) >> (8 * (a & 3));
+}
+
+// Copy a FLASH_DATA string into a RAM buffer of size bytes, truncating it if necessary,
+// returns dst
+static inline char *flashStrncpy(char *dst, const char *src, int size) {
+  int i = 0;
+  for (; i < size-1; i++)
+    if ((dst[i] = flashReadByte(src+i)) == 0) return dst;
+  if (size > 0) dst[i] = 0;
+  return dst;
+}
+
+// Compare a string in RAM to one in FLASH_DATA, same result as os_strcmp
+static inline int flashStrcmp(const char *ram, const char *flash) {
+  for (;; ram++, flash++) {
+    uint8_t c = flashReadByte(flash);
+    if ((uint8_t)*ram != c) return (uint8_t)*ram - c;
+    if (c == 0) return 0;
+  }
+}
+
+#endif
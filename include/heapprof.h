@@ -0,0 +1,59 @@
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+// Heap usage figures: the free heap low-water mark and the largest free block are always
+// available. When built with HEAP_PROF=yes os_malloc & co are redirected to wrappers that put
+// a small header in front of each block and keep per-module counters, the module is derived
+// from the directory of the source file making the allocation. Blocks allocated by esp-link
+// must not be freed by the SDK when HEAP_PROF is on, and vice versa blocks allocated by the SDK
+// are recognized and freed without touching the counters.
+
+enum {
+  HEAP_MOD_OTHER, HEAP_MOD_SERBRIDGE, HEAP_MOD_MQTT, HEAP_MOD_HTTPD, HEAP_MOD_SYSLOG,
+  HEAP_MOD_REST, HEAP_MOD_SOCKET, HEAP_MOD_COUNT
+};
+
+typedef struct {
+  uint32_t bytes;   // bytes currently allocated, not counting the headers
+  uint32_t peak;    // highest value bytes had
+  uint32_t allocs;  // allocations since boot
+  uint16_t blocks;  // blocks currently allocated
+  uint16_t fails;   // allocations that returned NULL
+} HeapModStats;
+
+#define HEAP_PROF_JSON_MAX 800  // output of heapProfJson at most
+
+// Sample the free heap to update the low-water mark, done on every allocation with HEAP_PROF
+void heapProfSample(void);
+
+// Lowest free heap seen so far
+uint32_t heapProfLowWater(void);
+
+// Largest block that can be allocated right now, found by trying, so not for frequent use
+uint32_t heapProfLargestBlock(void);
+
+// Counters of a module (HEAP_MOD_*), returns false if built without HEAP_PROF
+bool heapProfModStats(int mod, HeapModStats *stats);
+
+// Write the heap figures as a JSON object, at most HEAP_PROF_JSON_MAX bytes
+struct JsonWriter;
+void heapProfJson(struct JsonWriter *w);
+
+#ifdef HEAP_PROF
+void *heapProfMalloc(size_t size, const char *file, bool zero);
+void *heapProfRealloc(void *ptr, size_t size, const char *file);
+void heapProfFree(void *ptr);
+
+#undef os_malloc
+#undef os_zalloc
+#undef os_calloc
+#undef os_realloc
+#undef os_free
+#define os_malloc(s)     heapProfMalloc((s), __FILE__, false)
+#define os_zalloc(s)     heapProfMalloc((s), __FILE__, true)
+#define os_calloc(s, n)  heapProfMalloc((s)*(n), __FILE__, true)
+#define os_realloc(p, s) heapProfRealloc((p), (s), __FILE__)
+#define os_free(p)       heapProfFree(p)
+#endif
+
+#endif
@@ -34,12 +34,16 @@
 // TODO:
 // Handle SessionPresent=0 in CONNACK and rexmit subscriptions
 // Improve timeout for CONNACK, currently only has keep-alive timeout (maybe send artificial ping?)
-// Allow messages that don't require ACK to be sent even when pending_buffer is != NULL
-// Set dup flag in retransmissions
+// Allow messages that don't require ACK to be sent even when the in-flight window is full
 
 #include <esp8266.h>
 #include "pktbuf.h"
 #include "mqtt.h"
+#include "cmd.h"
+#include "dnscache.h"
+#include "metrics.h"
+#include "perf.h"
+#include "httpdjson.h"
 
 #ifdef MQTT_DBG
 #define DBG_MQTT(format, ...) os_printf(format, ## __VA_ARGS__)
@@ -64,18 +68,153 @@ sint8 espconn_secure_sent(struct espconn *espconn, uint8 *psent, uint16 length)
 #define MQTT_MAX_RCV_MESSAGE 2048
 // max message size for sending (except publish)
 #define MQTT_MAX_SHORT_MESSAGE 128
+// a connection must have been up this many seconds for the fast reconnect, so a broker that
+// accepts and then drops the connection right away doesn't get hammered
+#define MQTT_FAST_RECON_UP 10
 
 #ifdef MQTT_DBG
-static char* mqtt_msg_type[] = {
+static const char mqtt_msg_types[16][16] FLASH_DATA = {
   "NULL", "TYPE_CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
   "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "RESV",
 };
+
+// Name of a message type for debug output, overwritten by the next call
+static const char * ICACHE_FLASH_ATTR
+mqtt_msg_type(uint8_t type) {
+  static char name[16];
+  return flashStrncpy(name, mqtt_msg_types[type & 0xf], sizeof(name));
+}
 #endif
 
 // forward declarations
 static void mqtt_enq_message(MQTT_Client *client, const uint8_t *data, uint16_t len);
 static void mqtt_send_message(MQTT_Client* client);
 static void mqtt_doAbort(MQTT_Client* client);
+static void mqtt_spool_drain(MQTT_Client* client);
+
+// Find the in-flight message of the given type that an ACK with the given id is for, release it
+// and return true, or return false if there is none
+static bool ICACHE_FLASH_ATTR
+mqtt_inflight_ack(MQTT_Client* client, uint8_t msg_type, uint16_t msg_id) {
+  for (uint8_t i=0; i<client->inflightCount; i++) {
+    PktRingEntry *e = client->inflight[i];
+    if (mqtt_get_type(e->data) != msg_type || mqtt_get_id(e->data, e->len) != msg_id) continue;
+    PktRing_Release(&client->msgQueue, e);
+    client->inflight[i] = client->inflight[--client->inflightCount];
+    // got progress, restart the timeout for the others
+    if (client->inflightCount > 0) twheelArm(&client->ackTimer, client->sendTimeout*1000);
+    else twheelDisarm(&client->ackTimer);
+    return true;
+  }
+  DBG_MQTT("MQTT: no %s id=%04X in flight\n", mqtt_msg_type(msg_type), msg_id);
+  return false;
+}
+
+// Release the messages that were sent and don't need an ACK
+static void ICACHE_FLASH_ATTR
+mqtt_release_sending(MQTT_Client* client) {
+  for (uint8_t i=0; i<client->sendingCount; i++)
+    PktRing_Release(&client->msgQueue, client->sending_entry[i]);
+  client->sendingCount = 0;
+}
+
+// Return whether a message needs to be held on to until it is ACKed
+static bool ICACHE_FLASH_ATTR
+mqtt_needs_ack(const uint8_t *data) {
+  uint8_t msg_type = mqtt_get_type(data);
+  return (msg_type == MQTT_MSG_TYPE_PUBLISH && mqtt_get_qos(data) > 0) ||
+    msg_type == MQTT_MSG_TYPE_PUBREL || msg_type == MQTT_MSG_TYPE_PUBREC ||
+    msg_type == MQTT_MSG_TYPE_SUBSCRIBE || msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE;
+}
+
+// Return whether a queued message may be dropped to make room for a new one, that's only
+// publishes that are neither being sent nor awaiting an ACK
+static bool ICACHE_FLASH_ATTR
+mqtt_droppable(MQTT_Client* client, PktRingEntry *e) {
+  if (mqtt_get_type(e->data) != MQTT_MSG_TYPE_PUBLISH) return false;
+  for (uint8_t i=0; i<client->inflightCount; i++)
+    if (client->inflight[i] == e) return false;
+  for (uint8_t i=0; i<client->sendingCount; i++)
+    if (client->sending_entry[i] == e) return false;
+  return true;
+}
+
+// Pick the queued message to drop according to the queue policy, NULL if it's the new message
+// that has to go. Space in the ring is only reclaimed at the head, so unless it's the message
+// count that is over the limit only the oldest message is worth dropping.
+static PktRingEntry * ICACHE_FLASH_ATTR
+mqtt_drop_victim(MQTT_Client* client, bool anywhere, uint8_t qos) {
+  if (client->queuePolicy == MQTT_DROP_NEWEST) return NULL;
+  PktRingEntry *oldest = NULL;
+  PktRingEntry *e = PktRing_Iter(&client->msgQueue, NULL);
+  for (; e != NULL; e = anywhere ? PktRing_Iter(&client->msgQueue, e) : NULL) {
+    if (!mqtt_droppable(client, e)) continue;
+    if (client->queuePolicy == MQTT_DROP_OLDEST || mqtt_get_qos(e->data) == 0) return e;
+    if (oldest == NULL) oldest = e;
+  }
+  // no QoS0 message to drop, a new QoS0 message goes before a queued QoS1/2 one
+  return qos == 0 ? NULL : oldest;
+}
+
+// Reserve space for a new message in the queue, dropping queued messages according to the
+// queue policy if it's full. Returns NULL if the new message has to be dropped.
+static uint8_t * ICACHE_FLASH_ATTR
+mqtt_queue_reserve(MQTT_Client* client, uint16_t len, uint8_t qos) {
+  PktRing *q = &client->msgQueue;
+  if (len + sizeof(PktRingEntry) + 3 <= q->size) {
+    while (true) {
+      bool full = client->queueMaxCount > 0 && q->count >= client->queueMaxCount;
+      uint8_t *buf = full ? NULL : PktRing_Reserve(q, len);
+      if (buf != NULL) return buf;
+      PktRingEntry *victim = mqtt_drop_victim(client, full, qos);
+      if (victim == NULL) break;
+      DBG_MQTT("MQTT: Queue full, dropping queued %d byte message\n", victim->len);
+      PktRing_Release(q, victim);
+      client->queueStats.dropped++;
+      METRIC_INC(M_MQTT_DROPPED);
+    }
+  }
+  client->queueStats.dropped++;
+  METRIC_INC(M_MQTT_DROPPED);
+  return NULL;
+}
+
+// Return whether a message of len bytes fits into the queue without dropping anything
+static bool ICACHE_FLASH_ATTR
+mqtt_queue_fits(MQTT_Client* client, uint16_t len) {
+  PktRing *q = &client->msgQueue;
+  if (client->queueMaxCount > 0 && q->count >= client->queueMaxCount) return false;
+  return PktRing_Reserve(q, len) != NULL;
+}
+
+// Complete a message started with mqtt_queue_reserve
+static void ICACHE_FLASH_ATTR
+mqtt_queue_commit(MQTT_Client* client, uint16_t len) {
+  PktRing *q = &client->msgQueue;
+  PktRing_Commit(q, len);
+  client->queueStats.enqueued++;
+  if (q->count > client->queueStats.peakCount) client->queueStats.peakCount = q->count;
+  if (q->used > client->queueStats.peakBytes) client->queueStats.peakBytes = q->used;
+}
+
+// Return whether the in-flight window has room, until it does nothing gets sent so
+// messages stay in order
+static inline bool ICACHE_FLASH_ATTR
+mqtt_can_send(MQTT_Client* client) {
+  return client->inflightCount < client->inflightMax;
+}
+
+// Queue a control message to go out ahead of the queue
+static void ICACHE_FLASH_ATTR
+mqtt_enq_ctrl(MQTT_Client* client) {
+  if (client->ctrl_buffer != NULL) return; // still one waiting
+  PktBuf *buf = PktBuf_New(client->mqtt_connection.message.length);
+  if (buf == NULL) return;
+  os_memcpy(buf->data, client->mqtt_connection.message.data,
+      client->mqtt_connection.message.length);
+  buf->filled = client->mqtt_connection.message.length;
+  client->ctrl_buffer = buf;
+}
 
 // Deliver a publish message to the client
 static void ICACHE_FLASH_ATTR
@@ -87,6 +226,7 @@ deliver_publish(MQTT_Client* client, uint8_t* message, uint16_t length) {
   uint16_t data_length = length;
   const char *data = mqtt_get_publish_data(message, &data_length);
 
+  METRIC_INC(M_MQTT_RECEIVED);
   // callback to client
   if (client->dataCb)
     client->dataCb(client, topic, topic_length, data, data_length);
@@ -94,6 +234,62 @@ deliver_publish(MQTT_Client* client, uint8_t* message, uint16_t length) {
     client->cmdDataCb(client, topic, topic_length, data, data_length);
 }
 
+// Return the length of the fixed and variable header of the publish message in buf, which is
+// where the payload starts, or 0 if buf doesn't hold all of it yet
+static uint16_t ICACHE_FLASH_ATTR
+mqtt_publish_hdr_len(const uint8_t *buf, uint16_t len) {
+  uint16_t i = 1;
+  while (i < len && i < 4 && (buf[i] & 0x80)) i++; // remaining length, up to 4 bytes
+  i++;
+  if (i+2 > len) return 0;
+  i += 2 + (buf[i] << 8 | buf[i+1]); // topic
+  if (mqtt_get_qos(buf) > 0) i += 2; // message id
+  return i <= len ? i : 0;
+}
+
+// Pass a chunk of the payload of the publish being streamed to the client, the header of the
+// message with the topic stays in in_buffer while the payload goes by
+static void ICACHE_FLASH_ATTR
+mqtt_stream_chunk(MQTT_Client* client, const char *data, uint32_t len) {
+  uint16_t topic_length = client->in_buffer_filled;
+  const char *topic = mqtt_get_publish_topic(client->in_buffer, &topic_length);
+  uint32_t offset = client->stream_total - client->stream_left;
+  client->stream_left -= len;
+  if (client->cmdStreamCb && len > 0)
+    client->cmdStreamCb(client, topic, topic_length, offset, client->stream_total, data, len);
+  if (client->stream_left > 0) return;
+
+  // got it all, now ACK it
+  uint8_t msg_qos = mqtt_get_qos(client->in_buffer);
+  uint16_t msg_id = mqtt_get_id(client->in_buffer, client->in_buffer_size);
+  DBG_MQTT("MQTT: Streamed PUBLISH qos=%d len=%lu\n", msg_qos,
+      (unsigned long)client->stream_total);
+  if (msg_qos == 1) mqtt_msg_puback(&client->mqtt_connection, msg_id);
+  if (msg_qos == 2) mqtt_msg_pubrec(&client->mqtt_connection, msg_id);
+  if (msg_qos == 1 || msg_qos == 2) {
+    mqtt_enq_message(client, client->mqtt_connection.message.data,
+        client->mqtt_connection.message.length);
+  }
+  client->in_buffer_filled = 0;
+}
+
+// Start streaming a publish that doesn't fit into in_buffer, returns false if we can't (yet)
+static bool ICACHE_FLASH_ATTR
+mqtt_stream_start(MQTT_Client* client, uint32_t msg_len) {
+  if (client->cmdStreamCb == NULL ||
+      mqtt_get_type(client->in_buffer) != MQTT_MSG_TYPE_PUBLISH) return false;
+  uint16_t hdr_len = mqtt_publish_hdr_len(client->in_buffer, client->in_buffer_filled);
+  if (hdr_len == 0) return false;
+
+  // whatever follows the header in the buffer is the first chunk
+  uint16_t have = client->in_buffer_filled - hdr_len;
+  client->in_buffer_filled = hdr_len;
+  client->stream_total = msg_len - hdr_len;
+  client->stream_left = client->stream_total;
+  mqtt_stream_chunk(client, (char *)client->in_buffer + hdr_len, have);
+  return true;
+}
+
 /**
 * @brief  Client received callback function.
 * @param  arg: contain the ip link information
@@ -102,11 +298,11 @@ deliver_publish(MQTT_Client* client, uint8_t* message, uint16_t length) {
 * @retval None
 */
 static void ICACHE_FLASH_ATTR
-mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
+mqtt_tcpclient_recv_msgs(void* arg, char* pdata, unsigned short len) {
   //os_printf("MQTT: recv CB\n");
   uint8_t msg_type;
   uint16_t msg_id;
-  uint16_t msg_len;
+  uint32_t msg_len;
 
   struct espconn* pCon = (struct espconn*)arg;
   MQTT_Client* client = (MQTT_Client *)pCon->reverse;
@@ -115,6 +311,16 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
   //os_printf("MQTT: Data received %d bytes\n", len);
 
   do {
+    // the payload of a publish being streamed goes straight through
+    if (client->stream_left > 0) {
+      if (len == 0) break;
+      uint32_t chunk = len < client->stream_left ? len : client->stream_left;
+      mqtt_stream_chunk(client, pdata, chunk);
+      pdata += chunk;
+      len -= chunk;
+      continue;
+    }
+
     // append data to our buffer
     int avail = client->in_buffer_size - client->in_buffer_filled;
     if (len <= avail) {
@@ -134,8 +340,12 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
     msg_len = mqtt_get_total_length(client->in_buffer, client->in_buffer_size);
 
     if (msg_len > client->in_buffer_size) {
+      // a publish can be streamed once we have its header, until then we need more data
+      if (client->connState == MQTT_CONNECTED && mqtt_stream_start(client, msg_len)) continue;
+      if (client->in_buffer_filled < client->in_buffer_size &&
+          client->cmdStreamCb != NULL && msg_type == MQTT_MSG_TYPE_PUBLISH) break;
       // oops, too long a message for us to digest, disconnect and hope for a miracle
-      os_printf("MQTT: Too long a message (%d bytes)\n", msg_len);
+      os_printf("MQTT: Too long a message (%lu bytes)\n", (unsigned long)msg_len);
       mqtt_doAbort(client);
       return;
     }
@@ -151,14 +361,8 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
     }
 
     // we are connected and are sending/receiving data messages
-    uint8_t pending_msg_type = 0;
-    uint16_t pending_msg_id = 0;
-    if (client->pending_buffer != NULL) {
-      pending_msg_type = mqtt_get_type(client->pending_buffer->data);
-      pending_msg_id = mqtt_get_id(client->pending_buffer->data, client->pending_buffer->filled);
-    }
-    DBG_MQTT("MQTT: Recv type=%s id=%04X len=%d; Pend type=%s id=%02X\n",
-        mqtt_msg_type[msg_type], msg_id, msg_len, mqtt_msg_type[pending_msg_type],pending_msg_id);
+    DBG_MQTT("MQTT: Recv type=%s id=%04X len=%d; %d in flight\n",
+        mqtt_msg_type(msg_type), msg_id, msg_len, client->inflightCount);
 
     switch (msg_type) {
     case MQTT_MSG_TYPE_CONNACK:
@@ -167,33 +371,34 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
       if (client->connectedCb) client->connectedCb(client);
       if (client->cmdConnectedCb) client->cmdConnectedCb(client);
       client->reconTimeout = 1; // reset the reconnect backoff
+      if (client->in_buffer[3] == 0) { // accepted, this broker address is good
+        client->reconFast = true;
+        client->connackTime = system_get_time();
+        os_memcpy(&client->brokerIp, client->pCon->proto.tcp->remote_ip, 4);
+      }
       break;
 
     case MQTT_MSG_TYPE_SUBACK:
-      if (pending_msg_type == MQTT_MSG_TYPE_SUBSCRIBE && pending_msg_id == msg_id) {
+      if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_SUBSCRIBE, msg_id)) {
         //DBG_MQTT("MQTT: Subscribe successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
       }
       break;
 
     case MQTT_MSG_TYPE_UNSUBACK:
-      if (pending_msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE && pending_msg_id == msg_id) {
+      if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_UNSUBSCRIBE, msg_id)) {
         //DBG_MQTT("MQTT: Unsubscribe successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
       }
       break;
 
     case MQTT_MSG_TYPE_PUBACK: // ack for a publish we sent
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBLISH && pending_msg_id == msg_id) {
+      if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBLISH, msg_id)) {
         //DBG_MQTT("MQTT: QoS1 Publish successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
       }
       break;
 
     case MQTT_MSG_TYPE_PUBREC: // rec for a publish we sent
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBLISH && pending_msg_id == msg_id) {
+      if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBLISH, msg_id)) {
         //DBG_MQTT("MQTT: QoS2 publish cont\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
         // we need to send PUBREL
         mqtt_msg_pubrel(&client->mqtt_connection, msg_id);
         mqtt_enq_message(client, client->mqtt_connection.message.data,
@@ -202,9 +407,8 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
       break;
 
     case MQTT_MSG_TYPE_PUBCOMP: // comp for a pubrel we sent (originally publish we sent)
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBREL && pending_msg_id == msg_id) {
+      if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBREL, msg_id)) {
         //DBG_MQTT("MQTT: QoS2 Publish successful\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
       }
       break;
 
@@ -228,9 +432,8 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
       break;
 
     case MQTT_MSG_TYPE_PUBREL: // rel for a rec we sent (originally publish received)
-      if (pending_msg_type == MQTT_MSG_TYPE_PUBREC && pending_msg_id == msg_id) {
+      if (mqtt_inflight_ack(client, MQTT_MSG_TYPE_PUBREC, msg_id)) {
         //DBG_MQTT("MQTT: Cont QoS2 recv\n");
-        client->pending_buffer = PktBuf_ShiftFree(client->pending_buffer);
         // we need to send PUBCOMP
         mqtt_msg_pubcomp(&client->mqtt_connection, msg_id);
         mqtt_enq_message(client, client->mqtt_connection.message.data,
@@ -239,7 +442,7 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
       break;
 
     case MQTT_MSG_TYPE_PINGRESP:
-      client->keepAliveAckTick = 0;
+      twheelDisarm(&client->pongTimer);
       break;
     }
 
@@ -249,12 +452,22 @@ mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
     client->in_buffer_filled -= msg_len;
   } while(client->in_buffer_filled > 0 || len > 0);
 
-  // Send next packet out, if possible
-  if (!client->sending && client->pending_buffer == NULL && client->msgQueue != NULL) {
+  // ACKs may have made room for spooled messages, then send next packet out, if possible
+  mqtt_spool_drain(client);
+  if (!client->sending && mqtt_can_send(client) && client->msgQueue.unsent > 0) {
     mqtt_send_message(client);
   }
 }
 
+// Messages arriving in one segment produce a burst of callbacks to the MCU, send those in a
+// single batch frame if the MCU asked for that
+static void ICACHE_FLASH_ATTR
+mqtt_tcpclient_recv(void* arg, char* pdata, unsigned short len) {
+  bool batched = cmdBatchBegin(true);
+  mqtt_tcpclient_recv_msgs(arg, pdata, len);
+  if (batched) cmdBatchEnd();
+}
+
 /**
 * @brief  Callback from TCP that previous send completed
 * @param  arg: contain the ip link information
@@ -275,70 +488,105 @@ mqtt_tcpclient_sent_cb(void* arg) {
     os_free(buf);
     client->sending_buffer = NULL;
   }
+  mqtt_release_sending(client);
   client->sending = false;
+  mqtt_spool_drain(client);
 
   // send next message if one is queued and we're not expecting an ACK
-  if (client->connState == MQTT_CONNECTED && client->pending_buffer == NULL &&
-      client->msgQueue != NULL) {
+  if (client->connState == MQTT_CONNECTED &&
+      (client->ctrl_buffer != NULL ||
+       (mqtt_can_send(client) && client->msgQueue.unsent > 0))) {
     mqtt_send_message(client);
   }
 }
 
-/*
- * @brief: Timer function to handle timeouts
- */
+// Stop the timers of a connection, so that they can't fire on the next one
 static void ICACHE_FLASH_ATTR
-mqtt_timer(void* arg) {
-  MQTT_Client* client = (MQTT_Client*)arg;
-  //DBG_MQTT("MQTT: timer CB\n");
+mqtt_stop_timers(MQTT_Client* client) {
+  twheelDisarm(&client->ackTimer);
+  twheelDisarm(&client->pingTimer);
+  twheelDisarm(&client->pongTimer);
+}
 
-  switch (client->connState) {
-  default: break;
+// Reconnect after the back-off time, which doubles each time up to 128 seconds. A connection
+// that was up for a while gets one immediate attempt first, to the address that worked, so a
+// brief WiFi blip costs neither the back-off nor a DNS lookup.
+static void ICACHE_FLASH_ATTR
+mqtt_reconnect_later(MQTT_Client* client) {
+  client->connState = TCP_RECONNECT_REQ;
+  bool fast = client->reconFast &&
+    system_get_time() - client->connackTime > MQTT_FAST_RECON_UP*1000000;
+  client->reconFast = false;
+  if (fast) {
+    DBG_MQTT("MQTT: fast reconnect\n");
+    client->reconCachedIp = true;
+    twheelArm(&client->reconTimer, 0);
+    return;
+  }
+  twheelArm(&client->reconTimer, client->reconTimeout*1000);
+  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
+}
 
-  case MQTT_CONNECTED:
-    // first check whether we're timing out for an ACK
-    if (client->pending_buffer != NULL && --client->timeoutTick == 0) {
-      // looks like we're not getting a response in time, abort the connection
-      mqtt_doAbort(client);
-      client->timeoutTick = 0; // trick to make reconnect happen in 1 second
-      return;
-    }
+// Timer callback: the oldest in-flight message didn't get its ACK in time
+static void ICACHE_FLASH_ATTR
+mqtt_ack_timeout(void* arg) {
+  MQTT_Client* client = (MQTT_Client*)arg;
+  if (client->connState != MQTT_CONNECTED || client->inflightCount == 0) return;
+  // looks like we're not getting a response in time, abort the connection
+  mqtt_doAbort(client);
+  twheelArm(&client->reconTimer, 1000); // reconnect in 1 second
+}
 
-    // check whether our last keep-alive timed out
-    if (client->keepAliveAckTick > 0 && --client->keepAliveAckTick == 0) {
-      os_printf("\nMQTT ERROR: Keep-alive timed out\n");
-      mqtt_doAbort(client);
-      return;
-    }
+// Timer callback: nothing was sent for the keep-alive time, send a ping
+static void ICACHE_FLASH_ATTR
+mqtt_ping_timeout(void* arg) {
+  MQTT_Client* client = (MQTT_Client*)arg;
+  if (client->connState != MQTT_CONNECTED) return;
+  //DBG_MQTT("MQTT: Send keepalive\n");
+  mqtt_msg_pingreq(&client->mqtt_connection);
+  mqtt_enq_ctrl(client);
+  mqtt_send_message(client);
+  twheelArm(&client->pongTimer, client->sendTimeout*1000);
+}
 
-    // check whether we need to send a keep-alive message
-    if (client->keepAliveTick > 0 && --client->keepAliveTick == 0) {
-      // timeout: we need to send a ping message
-      //DBG_MQTT("MQTT: Send keepalive\n");
-      mqtt_msg_pingreq(&client->mqtt_connection);
-      PktBuf *buf = PktBuf_New(client->mqtt_connection.message.length);
-      os_memcpy(buf->data, client->mqtt_connection.message.data,
-          client->mqtt_connection.message.length);
-      buf->filled = client->mqtt_connection.message.length;
-      client->msgQueue = PktBuf_Unshift(client->msgQueue, buf);
-      mqtt_send_message(client);
-      client->keepAliveTick = client->connect_info.keepalive;
-      client->keepAliveAckTick = client->sendTimeout;
-    }
+// Timer callback: the ping didn't get a response
+static void ICACHE_FLASH_ATTR
+mqtt_pong_timeout(void* arg) {
+  MQTT_Client* client = (MQTT_Client*)arg;
+  if (client->connState != MQTT_CONNECTED) return;
+  os_printf("\nMQTT ERROR: Keep-alive timed out\n");
+  mqtt_doAbort(client);
+}
 
-    break;
+// Timer callback: don't keep spooled messages in RAM for long, they're supposed to survive
+// a reset
+static void ICACHE_FLASH_ATTR
+mqtt_spool_timeout(void* arg) {
+  MQTT_Client* client = (MQTT_Client*)arg;
+  if (client->spool != NULL) MqttSpool_Flush(client->spool);
+}
 
-  case TCP_RECONNECT_REQ:
-    if (client->timeoutTick == 0 || --client->timeoutTick == 0) {
-      // it's time to reconnect! start by re-enqueueing anything pending
-      if (client->pending_buffer != NULL) {
-        client->msgQueue = PktBuf_Unshift(client->msgQueue, client->pending_buffer);
-        client->pending_buffer = NULL;
-      }
-      client->connect_info.clean_session = 0; // ask server to keep state
-      MQTT_Connect(client);
-    }
+// Timer callback: the back-off time is over, reconnect
+static void ICACHE_FLASH_ATTR
+mqtt_recon_timeout(void* arg) {
+  MQTT_Client* client = (MQTT_Client*)arg;
+  if (client->connState != TCP_RECONNECT_REQ) return;
+  // it's time to reconnect! start by re-enqueueing anything pending
+  mqtt_release_sending(client);
+  if (client->sending_buffer != NULL) {
+    os_free(client->sending_buffer);
+    client->sending_buffer = NULL;
+  }
+  // publishes that may have made it to the broker go out again with the dup flag
+  for (uint8_t i=0; i<client->inflightCount; i++) {
+    PktRingEntry *e = client->inflight[i];
+    if (mqtt_get_type(e->data) == MQTT_MSG_TYPE_PUBLISH) e->data[0] |= 0x08;
   }
+  client->queueStats.retransmitted += client->inflightCount;
+  client->inflightCount = 0;
+  PktRing_Rewind(&client->msgQueue);
+  client->connect_info.clean_session = 0; // ask server to keep state
+  MQTT_Connect(client);
 }
 
 /**
@@ -357,14 +605,13 @@ mqtt_tcpclient_discon_cb(void* arg) {
   // if this is an aborted connection we're done
   if (client == NULL) return;
   DBG_MQTT("MQTT: Disconnected from %s:%d\n", client->host, client->port);
+  mqtt_stop_timers(client);
   if (client->disconnectedCb) client->disconnectedCb(client);
   if (client->cmdDisconnectedCb) client->cmdDisconnectedCb(client);
 
   // reconnect unless we're in a permanently disconnected state
   if (client->connState == MQTT_DISCONNECTED) return;
-  client->timeoutTick = client->reconTimeout;
-  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-  client->connState = TCP_RECONNECT_REQ;
+  mqtt_reconnect_later(client);
 }
 
 /**
@@ -380,15 +627,14 @@ mqtt_tcpclient_recon_cb(void* arg, int8_t err) {
   if (pespconn->proto.tcp) os_free(pespconn->proto.tcp);
   os_free(pespconn);
   os_printf("MQTT: Connection reset from %s:%d\n", client->host, client->port);
+  mqtt_stop_timers(client);
   if (client->disconnectedCb) client->disconnectedCb(client);
   if (client->cmdDisconnectedCb) client->cmdDisconnectedCb(client);
 
   // reconnect unless we're in a permanently disconnected state
   if (client->connState == MQTT_DISCONNECTED) return;
-  client->timeoutTick = client->reconTimeout;
-  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-  client->connState = TCP_RECONNECT_REQ;
-  os_printf("timeoutTick=%d reconTimeout=%d\n", client->timeoutTick, client->reconTimeout);
+  os_printf("MQTT: reconnect in %ds\n", client->reconTimeout);
+  mqtt_reconnect_later(client);
 }
 
 
@@ -406,53 +652,101 @@ mqtt_tcpclient_connect_cb(void* arg) {
   espconn_regist_disconcb(client->pCon, mqtt_tcpclient_discon_cb);
   espconn_regist_recvcb(client->pCon, mqtt_tcpclient_recv);
   espconn_regist_sentcb(client->pCon, mqtt_tcpclient_sent_cb);
+  perfTcpSetup(client->pCon, TCP_SVC_MQTT);
   os_printf("MQTT: TCP connected to %s:%d\n", client->host, client->port);
+  METRIC_INC(M_MQTT_CONNECTS);
 
   // send MQTT connect message to broker
   mqtt_msg_connect(&client->mqtt_connection, &client->connect_info);
-  PktBuf *buf = PktBuf_New(client->mqtt_connection.message.length);
-  os_memcpy(buf->data, client->mqtt_connection.message.data,
-      client->mqtt_connection.message.length);
-  buf->filled = client->mqtt_connection.message.length;
-  client->msgQueue = PktBuf_Unshift(client->msgQueue, buf); // prepend to send (rexmit) queue
+  if (client->ctrl_buffer != NULL) os_free(client->ctrl_buffer); // stale ping
+  client->ctrl_buffer = NULL;
+  mqtt_enq_ctrl(client); // goes out ahead of the queue
   mqtt_send_message(client);
   client->connState = MQTT_CONNECTED; // v3.1.1 allows publishing while still connecting
 }
 
 /**
- * @brief  Allocate and enqueue mqtt message, kick sending, if appropriate
+ * @brief  Enqueue mqtt message, kick sending, if appropriate
  */
 static void ICACHE_FLASH_ATTR
 mqtt_enq_message(MQTT_Client *client, const uint8_t *data, uint16_t len) {
-  PktBuf *buf = PktBuf_New(len);
-  os_memcpy(buf->data, data, len);
-  buf->filled = len;
-  client->msgQueue = PktBuf_Push(client->msgQueue, buf);
+  // only publishes get dropped to make room, other messages are treated like QoS1/2 ones
+  uint8_t *buf = mqtt_queue_reserve(client, len, 1);
+  if (buf == NULL) {
+    os_printf("MQTT ERROR: Queue full, dropping %d byte message\n", len);
+    return;
+  }
+  os_memcpy(buf, data, len);
+  mqtt_queue_commit(client, len);
 
-  if (client->connState == MQTT_CONNECTED && !client->sending && client->pending_buffer == NULL) {
+  if (client->connState == MQTT_CONNECTED && !client->sending && mqtt_can_send(client)) {
     mqtt_send_message(client);
   }
 }
 
+// Something went out, the next keep-alive is due a keep-alive time from now
+static void ICACHE_FLASH_ATTR
+mqtt_keepalive_restart(MQTT_Client* client) {
+  if (client->connect_info.keepalive > 0)
+    twheelArm(&client->pingTimer, client->connect_info.keepalive*1000);
+}
+
 /**
  * @brief  Send out top message in queue onto socket
  */
 static void ICACHE_FLASH_ATTR
 mqtt_send_message(MQTT_Client* client) {
   //DBG_MQTT("MQTT: Send_message\n");
-  PktBuf *buf = client->msgQueue;
-  if (buf == NULL || client->sending) return; // ahem...
-  client->msgQueue = PktBuf_Shift(client->msgQueue);
+  if (client->sending) return; // ahem...
+
+  // control messages go first, else the next message in the queue, unless we're waiting
+  // for an ACK
+  PktBuf *buf = client->ctrl_buffer;
+  PktRingEntry *entry = NULL;
+  uint8_t *data;
+  uint16_t len;
+  if (buf != NULL) {
+    client->ctrl_buffer = NULL;
+    data = buf->data;
+    len = buf->filled;
+  } else {
+    if (!mqtt_can_send(client)) return;
+    entry = PktRing_Next(&client->msgQueue);
+    if (entry == NULL) return;
+    data = entry->data;
+    len = entry->len;
+    client->sendingCount = 0;
+
+    // when coalescing, messages that don't need an ACK are combined with those following
+    // them that don't either, as many as fit into one segment
+    PktRingEntry *e;
+    while (client->coalesce_buf != NULL && !mqtt_needs_ack(entry->data) &&
+        client->sendingCount < MQTT_COALESCE_MAX-1 &&
+        (e = PktRing_Peek(&client->msgQueue)) != NULL && !mqtt_needs_ack(e->data) &&
+        len + e->len <= MQTT_COALESCE_SIZE) {
+      if (client->sendingCount == 0) {
+        os_memcpy(client->coalesce_buf, entry->data, entry->len);
+        client->sending_entry[client->sendingCount++] = entry;
+        data = client->coalesce_buf;
+      }
+      PktRing_Next(&client->msgQueue);
+      os_memcpy(client->coalesce_buf+len, e->data, e->len);
+      len += e->len;
+      client->sending_entry[client->sendingCount++] = e;
+    }
+    if (client->sendingCount > 0)
+      DBG_MQTT("MQTT: Coalesced %d messages, %d bytes\n", client->sendingCount, len);
+  }
 
-  // get some details about the message
-  uint16_t msg_type = mqtt_get_type(buf->data);
-  uint8_t  msg_id = mqtt_get_id(buf->data, buf->filled);
 #ifdef MQTT_DBG
-  os_printf("MQTT: Send type=%s id=%04X len=%d\n", mqtt_msg_type[msg_type], msg_id, buf->filled);
+  // print some details about the message
+  uint16_t msg_type = mqtt_get_type(data);
+  uint8_t  msg_id = mqtt_get_id(data, len);
+  os_printf("MQTT: Send type=%s id=%04X len=%d\n", mqtt_msg_type(msg_type), msg_id, len);
 #if 0
-  for (int i=0; i<buf->filled; i++) {
-    if (buf->data[i] >= ' ' && buf->data[i] <= '~') os_printf("%c", buf->data[i]);
-    else os_printf("\\x%02X", buf->data[i]);
+  for (int i=0; i<len; i++) {
+    if (data[i] >= ' ' && data[i] <= '~') os_printf("%c", data[i]);
+    else os_printf("\\x%02X", data[i]);
   }
   os_printf("\n");
 #endif
@@ -460,30 +754,34 @@ mqtt_send_message(MQTT_Client* client) {
 
   // send the message out
   if (client->security)
-    espconn_secure_sent(client->pCon, buf->data, buf->filled);
+    espconn_secure_sent(client->pCon, data, len);
   else
-    espconn_sent(client->pCon, buf->data, buf->filled);
+    espconn_sent(client->pCon, data, len);
   client->sending = true;
+  metricObserve(M_MQTT_SEND_BYTES, len);
+  if (entry != NULL) {
+    client->queueStats.sent += client->sendingCount > 0 ? client->sendingCount : 1;
+    METRIC_ADD(M_MQTT_SENT, client->sendingCount > 0 ? client->sendingCount : 1);
+  }
 
-  // depending on whether it needs an ack we need to hold on to the message
-  bool needsAck =
-    (msg_type == MQTT_MSG_TYPE_PUBLISH && mqtt_get_qos(buf->data) > 0) ||
-    msg_type == MQTT_MSG_TYPE_PUBREL || msg_type == MQTT_MSG_TYPE_PUBREC ||
-    msg_type == MQTT_MSG_TYPE_SUBSCRIBE || msg_type == MQTT_MSG_TYPE_UNSUBSCRIBE ||
-    msg_type == MQTT_MSG_TYPE_PINGREQ;
-  if (msg_type == MQTT_MSG_TYPE_PINGREQ) {
-    client->pending_buffer = NULL; // we don't need to rexmit this one
+  if (buf != NULL) {
+    // CONNECT or PINGREQ, these are not retransmitted
     client->sending_buffer = buf;
-  } else if (needsAck) {
-    client->pending_buffer = buf;  // remeber for rexmit on disconnect/reconnect
-    client->sending_buffer = NULL;
-    client->timeoutTick = client->sendTimeout+1; // +1 to ensure full sendTireout seconds
+    mqtt_keepalive_restart(client);
+    return;
+  }
+
+  // depending on whether it needs an ack we need to hold on to the message
+  if (client->sendingCount > 0) {
+    // coalesced, none of them needs an ack
+  } else if (mqtt_needs_ack(data)) {
+    // remember for rexmit on disconnect/reconnect
+    if (client->inflightCount == 0) twheelArm(&client->ackTimer, client->sendTimeout*1000);
+    client->inflight[client->inflightCount++] = entry;
   } else {
-    client->pending_buffer = NULL;
-    client->sending_buffer = buf;
-    client->timeoutTick = 0;
+    client->sending_entry[client->sendingCount++] = entry;
   }
-  client->keepAliveTick = client->connect_info.keepalive > 0 ? client->connect_info.keepalive+1 : 0;
+  mqtt_keepalive_restart(client);
 }
 
 /**
@@ -496,11 +794,7 @@ mqtt_dns_found(const char* name, ip_addr_t* ipaddr, void* arg) {
 
   if (ipaddr == NULL) {
     os_printf("MQTT: DNS lookup failed\n");
-    if (client != NULL) {
-      client->timeoutTick = client->reconTimeout;
-      if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-      client->connState = TCP_RECONNECT_REQ; // the timer will kick-off a reconnection
-    }
+    if (client != NULL) mqtt_reconnect_later(client);
     return;
   }
   DBG_MQTT("MQTT: ip %d.%d.%d.%d\n",
@@ -509,7 +803,7 @@ mqtt_dns_found(const char* name, ip_addr_t* ipaddr, void* arg) {
             *((uint8 *)&ipaddr->addr + 2),
             *((uint8 *)&ipaddr->addr + 3));
 
-  if (client != NULL && client->ip.addr == 0 && ipaddr->addr != 0) {
+  if (client != NULL && client->pCon == pConn && ipaddr->addr != 0) {
     os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
     uint8_t err;
     if (client->security)
@@ -518,9 +812,7 @@ mqtt_dns_found(const char* name, ip_addr_t* ipaddr, void* arg) {
       err = espconn_connect(client->pCon);
     if (err != 0) {
       os_printf("MQTT ERROR: Failed to connect\n");
-      client->timeoutTick = client->reconTimeout;
-      if (client->reconTimeout < 128) client->reconTimeout <<= 1;
-      client->connState = TCP_RECONNECT_REQ;
+      mqtt_reconnect_later(client);
     } else {
       DBG_MQTT("MQTT: connecting...\n");
     }
@@ -529,12 +821,48 @@ mqtt_dns_found(const char* name, ip_addr_t* ipaddr, void* arg) {
 
 //===== publish / subscribe
 
+// Build a publish message in the queue, the payload is copied exactly once, straight into the
+// queue. Returns false if it has to be dropped.
+static bool ICACHE_FLASH_ATTR
+mqtt_queue_publish(MQTT_Client* client, const char* topic, uint16_t topic_length,
+    const char* data, uint16_t data_length, uint8_t qos, uint8_t retain)
+{
+  uint16_t msg_len = mqtt_msg_publish_size(topic_length, data_length, qos);
+  uint8_t *buf = mqtt_queue_reserve(client, msg_len, qos);
+  if (buf == NULL) {
+    os_printf("MQTT ERROR: Queue full, cannot queue %d byte publish\n", msg_len);
+    return FALSE;
+  }
+  uint16_t msg_id;
+  uint16_t hdr_len = mqtt_msg_publish_header(&client->mqtt_connection, buf, topic, topic_length,
+      data_length, qos, retain, &msg_id);
+  if (hdr_len == 0) {
+    os_printf("MQTT ERROR: Queuing Publish failed\n");
+    return FALSE;
+  }
+  os_memcpy(buf+hdr_len, data, data_length);
+  mqtt_queue_commit(client, msg_len);
+
+  DBG_MQTT("MQTT: Publish, qos=%d length: %d\n", qos, msg_len);
+  return TRUE;
+}
+
+// Move spooled publishes into the queue, oldest first, as long as they fit
 static void ICACHE_FLASH_ATTR
-msg_conn_init(mqtt_connection_t *new_msg, mqtt_connection_t *old_msg,
-    uint8_t *buf, uint16_t buflen) {
-  new_msg->message_id = old_msg->message_id;
-  new_msg->buffer = buf;
-  new_msg->buffer_length = buflen;
+mqtt_spool_drain(MQTT_Client* client) {
+  MqttSpool *spool = client->spool;
+  if (spool == NULL || spool->count == 0) return;
+  uint32_t *buf = os_malloc(MQTT_SPOOL_BUF);
+  if (buf == NULL) return;
+
+  MqttSpoolRecord rec;
+  while (MqttSpool_Peek(spool, buf, &rec) &&
+      mqtt_queue_fits(client, mqtt_msg_publish_size(rec.topic_len, rec.data_len, rec.qos))) {
+    mqtt_queue_publish(client, rec.topic, rec.topic_len, rec.data, rec.data_len,
+        rec.qos, rec.retain);
+    MqttSpool_Consume(spool);
+  }
+  os_free(buf);
 }
 
 /**
@@ -551,35 +879,21 @@ bool ICACHE_FLASH_ATTR
 MQTT_Publish(MQTT_Client* client, const char* topic, const char* data, uint16_t data_length,
     uint8_t qos, uint8_t retain)
 {
-  // estimate the packet size to allocate a buffer
+  // with a spool, publishes that don't fit go to flash instead of being dropped, and once
+  // something is spooled everything goes through the spool to stay in order
   uint16_t topic_length = os_strlen(topic);
-  // estimate: fixed hdr, pkt-id, topic length, topic, data, fudge
-  uint16_t buf_len = 3 + 2 + 2 + topic_length + data_length + 16;
-  PktBuf *buf = PktBuf_New(buf_len);
-  if (buf == NULL) {
-    os_printf("MQTT ERROR: Cannot allocate buffer for %d byte publish\n", buf_len);
-    return FALSE;
-  }
-  // use a temporary mqtt_message_t pointing to our buffer, this is a bit of a mess because we
-  // need to keep track of the message_id that is embedded in it
-  mqtt_connection_t msg;
-  msg_conn_init(&msg, &client->mqtt_connection, buf->data, buf_len);
-  uint16_t msg_id;
-  if (!mqtt_msg_publish(&msg, topic, data, data_length, qos, retain, &msg_id)){
-    os_printf("MQTT ERROR: Queuing Publish failed\n");
-    os_free(buf);
+  MqttSpool *spool = client->spool;
+  if (spool != NULL && (spool->count > 0 ||
+        !mqtt_queue_fits(client, mqtt_msg_publish_size(topic_length, data_length, qos))) &&
+      MqttSpool_Append(spool, topic, data, data_length, qos, retain)) {
+    client->queueStats.spooled++;
+    if (!twheelArmed(&client->spoolTimer)) twheelArm(&client->spoolTimer, 1000);
+    mqtt_spool_drain(client);
+  } else if (!mqtt_queue_publish(client, topic, topic_length, data, data_length, qos, retain)) {
     return FALSE;
   }
-  client->mqtt_connection.message_id = msg.message_id;
-  if (msg.message.data != buf->data)
-    os_memcpy(buf->data, msg.message.data, msg.message.length);
-  buf->filled = msg.message.length;
-
-  DBG_MQTT("MQTT: Publish, topic: \"%s\", length: %d\n", topic, msg.message.length);
-  //dumpMem(buf, buf_len);
-  client->msgQueue = PktBuf_Push(client->msgQueue, buf);
 
-  if (!client->sending && client->pending_buffer == NULL) {
+  if (!client->sending && mqtt_can_send(client)) {
     mqtt_send_message(client);
   }
   return TRUE;
@@ -617,6 +931,9 @@ MQTT_Subscribe(MQTT_Client* client, char* topic, uint8_t qos) {
 * @param  client_user:   MQTT client user
 * @param  client_pass:   MQTT client password
 * @param  keepAliveTime: MQTT keep alive timer, in second
+* @param  queueSize:     bytes for queued outbound messages, 0 for the default
+* @param  inflight:      max QoS1/2 messages awaiting an ACK, 0 for the default
+* @param  coalesce:      combine consecutive messages that don't need an ACK into one send
 * @param  cleanSession:  On connection, a client sets the "clean session" flag, which is sometimes also known as the "clean start" flag.
 *                        If clean session is set to false, then the connection is treated as durable. This means that when the client
 *                        disconnects, any subscriptions it has will remain and any subsequent QoS 1 or 2 messages will be stored until
@@ -627,7 +944,7 @@ MQTT_Subscribe(MQTT_Client* client, char* topic, uint8_t qos) {
 void ICACHE_FLASH_ATTR
 MQTT_Init(MQTT_Client* client, char* host, uint32 port, uint8_t security, uint8_t sendTimeout,
     char* client_id, char* client_user, char* client_pass,
-    uint8_t keepAliveTime) {
+    uint8_t keepAliveTime, uint16_t queueSize, uint8_t inflight, bool coalesce) {
   DBG_MQTT("MQTT_Init, host=%s\n", host);
 
   os_memset(client, 0, sizeof(MQTT_Client));
@@ -641,6 +958,13 @@ MQTT_Init(MQTT_Client* client, char* host, uint32 port, uint8_t security, uint8_
   // timeouts with sanity checks
   client->sendTimeout = sendTimeout == 0 ? 1 : sendTimeout;
   client->reconTimeout = 1; // reset reconnect back-off
+  twheelSetFn(&client->ackTimer, mqtt_ack_timeout, client);
+  twheelSetFn(&client->pingTimer, mqtt_ping_timeout, client);
+  twheelSetFn(&client->pongTimer, mqtt_pong_timeout, client);
+  twheelSetFn(&client->reconTimer, mqtt_recon_timeout, client);
+  twheelSetFn(&client->spoolTimer, mqtt_spool_timeout, client);
+  client->inflightMax = inflight == 0 ? MQTT_INFLIGHT :
+    (inflight > MQTT_MAX_INFLIGHT ? MQTT_MAX_INFLIGHT : inflight);
 
   os_memset(&client->connect_info, 0, sizeof(mqtt_connect_info_t));
 
@@ -659,10 +983,44 @@ MQTT_Init(MQTT_Client* client, char* host, uint32 port, uint8_t security, uint8_
   client->in_buffer = (uint8_t *)os_zalloc(MQTT_MAX_RCV_MESSAGE);
   client->in_buffer_size = MQTT_MAX_RCV_MESSAGE;
 
+  PktRing_Init(&client->msgQueue, queueSize == 0 ? MQTT_QUEUE_SIZE : queueSize);
+  if (coalesce) client->coalesce_buf = (uint8_t *)os_malloc(MQTT_COALESCE_SIZE);
+
   uint8_t *out_buffer = (uint8_t *)os_zalloc(MQTT_MAX_SHORT_MESSAGE);
   mqtt_msg_init(&client->mqtt_connection, out_buffer, MQTT_MAX_SHORT_MESSAGE);
 }
 
+void ICACHE_FLASH_ATTR
+MQTT_SetQueueLimit(MQTT_Client* client, uint16_t maxCount, tQueuePolicy policy) {
+  client->queueMaxCount = maxCount;
+  client->queuePolicy = policy <= MQTT_DROP_QOS0 ? policy : MQTT_DROP_NEWEST;
+}
+
+void ICACHE_FLASH_ATTR
+MQTT_SetSpool(MQTT_Client* client, MqttSpool *spool) {
+  client->spool = spool;
+  mqtt_spool_drain(client);
+}
+
+void ICACHE_FLASH_ATTR
+MQTT_QueueStatsJson(MQTT_Client* client, JsonWriter *w) {
+  MQTT_QueueStats *s = &client->queueStats;
+  MqttSpool *spool = client->spool;
+  jsonObject(w, NULL);
+  jsonInt(w, "queued", client->msgQueue.count);
+  jsonInt(w, "queue_bytes", client->msgQueue.used);
+  jsonUInt(w, "enqueued", s->enqueued);
+  jsonUInt(w, "sent", s->sent);
+  jsonUInt(w, "dropped", s->dropped);
+  jsonUInt(w, "retransmitted", s->retransmitted);
+  jsonInt(w, "peak", s->peakCount);
+  jsonInt(w, "peak_bytes", s->peakBytes);
+  jsonUInt(w, "spooled", s->spooled);
+  jsonUInt(w, "spool_pending", spool ? spool->count : 0);
+  jsonUInt(w, "spool_dropped", spool ? spool->dropped : 0);
+  jsonClose(w);
+}
+
 /**
  * @brief  MQTT Set Last Will Topic, must be called before MQTT_Connect
  */
@@ -690,6 +1048,7 @@ MQTT_InitLWT(MQTT_Client* client, char* will_topic, char* will_msg,
 void ICACHE_FLASH_ATTR
 MQTT_Connect(MQTT_Client* client) {
   //MQTT_Disconnect(client);
+  mqtt_stop_timers(client);
   client->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
   client->pCon->type = ESPCONN_TCP;
   client->pCon->state = ESPCONN_NONE;
@@ -700,15 +1059,13 @@ MQTT_Connect(MQTT_Client* client) {
   espconn_regist_connectcb(client->pCon, mqtt_tcpclient_connect_cb);
   espconn_regist_reconcb(client->pCon, mqtt_tcpclient_recon_cb);
 
-  // start timer function to tick every second
-  os_timer_disarm(&client->mqttTimer);
-  os_timer_setfn(&client->mqttTimer, (os_timer_func_t *)mqtt_timer, client);
-  os_timer_arm(&client->mqttTimer, 1000, 1);
-
   // initiate the TCP connection or DNS lookup
   os_printf("MQTT: Connect to %s:%d %p (client=%p)\n",
       client->host, client->port, client->pCon, client);
-  if (UTILS_StrToIP((const char *)client->host,
+  bool cached = client->reconCachedIp && client->brokerIp != 0;
+  client->reconCachedIp = false;
+  if (cached) os_memcpy(client->pCon->proto.tcp->remote_ip, &client->brokerIp, 4);
+  if (cached || UTILS_StrToIP((const char *)client->host,
         (void*)&client->pCon->proto.tcp->remote_ip)) {
     uint8_t err;
     if (client->security)
@@ -723,13 +1080,13 @@ MQTT_Connect(MQTT_Client* client) {
       return;
     }
   } else {
-    espconn_gethostbyname(client->pCon, (const char *)client->host, &client->ip,
-        mqtt_dns_found);
+    dnsCacheLookup((const char *)client->host, mqtt_dns_found, client->pCon);
   }
 
   client->connState = TCP_CONNECTING;
-  client->timeoutTick = 20; // generous timeout to allow for DNS, etc
   client->sending = FALSE;
+  client->in_buffer_filled = 0; // drop anything left over from the previous connection
+  client->stream_left = 0;
 }
 
 static void ICACHE_FLASH_ATTR
@@ -748,10 +1105,10 @@ mqtt_doAbort(MQTT_Client* client) {
     os_free(client->sending_buffer);
     client->sending_buffer = NULL;
   }
+  mqtt_release_sending(client);
   client->pCon = NULL;         // it will be freed in disconnect callback
-  client->connState = TCP_RECONNECT_REQ;
-  client->timeoutTick = client->reconTimeout;     // reconnect in a few seconds
-  if (client->reconTimeout < 128) client->reconTimeout <<= 1;
+  mqtt_stop_timers(client);
+  mqtt_reconnect_later(client); // reconnect in a few seconds
 }
 
 void ICACHE_FLASH_ATTR
@@ -764,16 +1121,27 @@ MQTT_Reconnect(MQTT_Client* client) {
   // in other cases we're already in the reconnecting process
 }
 
+void ICACHE_FLASH_ATTR
+MQTT_ReconnectNow(MQTT_Client* client) {
+  if (client->connState != TCP_RECONNECT_REQ) return;
+  DBG_MQTT("MQTT: Reconnect now\n");
+  client->reconTimeout = 1;
+  client->reconCachedIp = true;
+  twheelDisarm(&client->reconTimer);
+  mqtt_recon_timeout(client);
+}
+
 void ICACHE_FLASH_ATTR
 MQTT_Disconnect(MQTT_Client* client) {
   DBG_MQTT("MQTT: Disconnect requested\n");
-  os_timer_disarm(&client->mqttTimer);
   if (client->connState == MQTT_DISCONNECTED) return;
   if (client->connState == TCP_RECONNECT_REQ) {
+    twheelDisarm(&client->reconTimer);
     client->connState = MQTT_DISCONNECTED;
     return;
   }
   mqtt_doAbort(client);
+  twheelDisarm(&client->reconTimer);
   //void *out_buffer = client->mqtt_connection.buffer;
   //if (out_buffer != NULL) os_free(out_buffer);
   client->connState = MQTT_DISCONNECTED; // ensure we don't automatically reconnect
@@ -797,6 +1165,17 @@ MQTT_Free(MQTT_Client* client) {
 
   if (client->mqtt_connection.buffer) os_free(client->mqtt_connection.buffer);
   os_memset(&client->mqtt_connection, 0, sizeof(client->mqtt_connection));
+
+  PktRing_Free(&client->msgQueue);
+  twheelDisarm(&client->spoolTimer);
+  if (client->spool != NULL) MqttSpool_Flush(client->spool);
+  client->spool = NULL;
+  client->sendingCount = 0;
+  if (client->coalesce_buf) os_free(client->coalesce_buf);
+  client->coalesce_buf = NULL;
+  client->inflightCount = 0;
+  if (client->ctrl_buffer) os_free(client->ctrl_buffer);
+  client->ctrl_buffer = NULL;
 }
 
 void ICACHE_FLASH_ATTR
@@ -32,6 +32,41 @@
 
 #include "mqtt_msg.h"
 #include "pktbuf.h"
+#include "pktring.h"
+#include "mqtt_spool.h"
+#include "twheel.h"
+
+// default size of the outbound message queue in bytes
+#define MQTT_QUEUE_SIZE 4096
+// max number of messages sent and awaiting an ACK, and the default
+#define MQTT_MAX_INFLIGHT 16
+#define MQTT_INFLIGHT 4
+// when coalescing, max bytes and messages combined into one TCP send
+#define MQTT_COALESCE_SIZE 1460
+#define MQTT_COALESCE_MAX  16
+
+// What to do with a new message when the outbound queue is full. Only PUBLISH messages are
+// dropped to make room, and only ones that are neither being sent nor awaiting an ACK.
+typedef enum {
+  MQTT_DROP_NEWEST,     // drop the new message (default)
+  MQTT_DROP_OLDEST,     // drop the oldest queued messages to make room
+  MQTT_DROP_QOS0,       // drop queued QoS0 messages first, then the new one if it's QoS0,
+                        // else the oldest
+} tQueuePolicy;
+
+// Outbound queue counters, in messages, since MQTT_Init
+typedef struct {
+  uint32_t enqueued;      // messages added to the queue
+  uint32_t sent;          // messages handed to the TCP stack, including retransmissions
+  uint32_t dropped;       // messages dropped because the queue was full
+  uint32_t retransmitted; // messages sent again after a reconnect
+  uint32_t spooled;       // publishes that went to the flash spool
+  uint16_t peakCount;     // max messages in the queue at once
+  uint16_t peakBytes;     // max bytes in use in the queue at once
+} MQTT_QueueStats;
+
+// Max length of the output of MQTT_QueueStatsJson
+#define MQTT_QUEUE_STATS_JSON_MAX 256
 
 // in rest.c
 uint8_t UTILS_StrToIP(const char* str, void *ip);
@@ -51,6 +86,10 @@ typedef void (*MqttCallback)(MQTT_Client *client);
 // Callback with data messge
 typedef void (*MqttDataCallback)(MQTT_Client *client, const char* topic, uint32_t topic_len,
     const char* data, uint32_t data_len);
+// Callback with a chunk of the payload of a message too large to be buffered, offset is the
+// position of the chunk in the payload and total_len is the length of the whole payload
+typedef void (*MqttStreamCallback)(MQTT_Client *client, const char* topic, uint32_t topic_len,
+    uint32_t offset, uint32_t total_len, const char* data, uint32_t data_len);
 
 // MQTTY client data structure
 struct MQTT_Client {
@@ -59,27 +98,43 @@ struct MQTT_Client {
   char*               host;                   // MQTT server
   uint16_t            port;
   uint8_t             security;               // 0=tcp, 1=ssl
-  ip_addr_t           ip;                     // MQTT server IP address
   mqtt_connect_info_t connect_info;           // info to connect/reconnect
   // protocol state and message assembly
   tConnState          connState;              // connection state
   bool                sending;                // espconn_send is pending
   mqtt_connection_t   mqtt_connection;        // message assembly descriptor
-  PktBuf*             msgQueue;               // queued outbound messages
+  PktRing             msgQueue;               // queued outbound messages
+  uint16_t            queueMaxCount;          // max messages in msgQueue, 0 for no limit
+  uint8_t             queuePolicy;            // tQueuePolicy, what to drop when msgQueue is full
+  MQTT_QueueStats     queueStats;             // outbound queue counters
+  MqttSpool*          spool;                  // flash spool for publishes, NULL if none
+  PktBuf*             ctrl_buffer;            // CONNECT or PINGREQ to send ahead of the queue
   // TCP input buffer
   uint8_t*            in_buffer;
   int                 in_buffer_size;         // length allocated
   int                 in_buffer_filled;       // number of bytes held
-  // outstanding message when we expect an ACK
-  PktBuf*             pending_buffer;         // buffer sent and awaiting ACK
-  PktBuf*             sending_buffer;         // buffer sent not awaiting ACK
-  // timer and associated timeout counters
-  ETSTimer            mqttTimer;              // timer for this connection
-  uint8_t             keepAliveTick;          // seconds 'til keep-alive is required (0=no k-a)
-  uint8_t             keepAliveAckTick;       // seconds 'til keep-alive ack is overdue (0=no k-a)
-  uint8_t             timeoutTick;            // seconds 'til other timeout
+  uint32_t            stream_total;           // payload length of the publish being streamed
+  uint32_t            stream_left;            // payload bytes of it still to come, 0=none
+  // outstanding messages when we expect an ACK, these stay in msgQueue
+  PktRingEntry*       inflight[MQTT_MAX_INFLIGHT]; // messages sent and awaiting ACK
+  uint8_t             inflightCount;          // entries used in inflight[]
+  uint8_t             inflightMax;            // window, max messages awaiting ACK
+  PktRingEntry*       sending_entry[MQTT_COALESCE_MAX]; // messages sent not awaiting ACK
+  uint8_t             sendingCount;           // entries used in sending_entry[]
+  uint8_t*            coalesce_buf;           // buffer to combine messages, NULL if not coalescing
+  PktBuf*             sending_buffer;         // control message sent
+  // deadlines on the shared timer wheel
+  TWheelTimer         ackTimer;               // oldest in-flight message is overdue
+  TWheelTimer         pingTimer;              // keep-alive is required
+  TWheelTimer         pongTimer;              // keep-alive ack is overdue
+  TWheelTimer         reconTimer;             // time to reconnect
+  TWheelTimer         spoolTimer;             // time to flush the spool to flash
   uint8_t             sendTimeout;            // value of send timeout setting
   uint8_t             reconTimeout;           // timeout to reconnect (back-off)
+  bool                reconFast;              // got a CONNACK, first reconnect goes right away
+  bool                reconCachedIp;          // next connect skips DNS and uses brokerIp
+  uint32_t            brokerIp;               // address that sent the last CONNACK, 0=none
+  uint32_t            connackTime;            // system_get_time() of the last CONNACK
   // callbacks
   MqttCallback        connectedCb;
   MqttCallback        cmdConnectedCb;
@@ -89,6 +144,7 @@ struct MQTT_Client {
   MqttCallback        cmdPublishedCb;
   MqttDataCallback    dataCb;
   MqttDataCallback    cmdDataCb;
+  MqttStreamCallback  cmdStreamCb;            // gets publishes too large for in_buffer, if set
   // misc
   void*               user_data;
 };
@@ -97,13 +153,25 @@ struct MQTT_Client {
 void MQTT_Init(MQTT_Client* mqttClient, char* host, uint32 port,
     uint8_t security, uint8_t sendTimeout,
     char* client_id, char* client_user, char* client_pass,
-    uint8_t keepAliveTime);
+    uint8_t keepAliveTime, uint16_t queueSize, uint8_t inflight, bool coalesce);
 
 // Completely free buffers associated with client data structure
 // This does not free the mqttClient struct itself, it just readies the struct so
 // it can be freed or MQTT_Init can be called on it again
 void MQTT_Free(MQTT_Client* mqttClient);
 
+// Limit the number of queued outbound messages (0=only limited by the queue size) and set what
+// gets dropped when the queue is full
+void MQTT_SetQueueLimit(MQTT_Client* mqttClient, uint16_t maxCount, tQueuePolicy policy);
+
+// Spill publishes that don't fit into the outbound queue into a flash spool, NULL for none.
+// The spool is not owned by the client, MQTT_Free only flushes it.
+void MQTT_SetSpool(MQTT_Client* mqttClient, MqttSpool *spool);
+
+// Write the outbound queue counters as a JSON object
+struct JsonWriter;
+void MQTT_QueueStatsJson(MQTT_Client* mqttClient, struct JsonWriter *w);
+
 // Set Last Will Topic on client, must be called before MQTT_InitConnection
 void MQTT_InitLWT(MQTT_Client* mqttClient, char* will_topic, char* will_msg,
     uint8_t will_qos, uint8_t will_retain);
@@ -111,6 +179,9 @@ void MQTT_InitLWT(MQTT_Client* mqttClient, char* will_topic, char* will_msg,
 // Disconnect and reconnect in order to change params (such as LWT)
 void MQTT_Reconnect(MQTT_Client* mqttClient);
 
+// Skip the remaining back-off and reconnect now if waiting to, e.g. when the network is back
+void MQTT_ReconnectNow(MQTT_Client* mqttClient);
+
 // Kick of a persistent connection to the broker, will reconnect anytime conn breaks
 void MQTT_Connect(MQTT_Client* mqttClient);
 
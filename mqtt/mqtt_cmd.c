@@ -6,6 +6,7 @@
 #include "mqtt.h"
 #include "mqtt_client.h"
 #include "mqtt_cmd.h"
+#include "topic_trie.h"
 
 #ifdef MQTTCMD_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -55,8 +56,42 @@ cmdMqttDataCb(MQTT_Client* client, const char* topic, uint32_t topic_len,
   MqttCmdCb* cb = (MqttCmdCb*)client->user_data;
   DBG("MQTT: Data cb=%p topic=%s len=%u\n", (void*)cb->dataCb, topic, data_len);
 
-  cmdResponseStart(CMD_RESP_CB, cb->dataCb, 2);
+  // without subscriptions registered through MQTTCMD_Subscribe everything goes to dataCb,
+  // else only to the callbacks of the matching ones
+  uint32_t cbs[TOPIC_TRIE_MAX_MATCH];
+  int n = 1;
+  cbs[0] = cb->dataCb;
+  if (!TopicTrie_Empty()) {
+    n = TopicTrie_Match(topic, topic_len, cbs, TOPIC_TRIE_MAX_MATCH);
+    if (n == 0) DBG("MQTT: no subscription matches, dropped\n");
+  }
+
+  for (int i=0; i<n; i++) {
+    cmdResponseStart(CMD_RESP_CB, cbs[i], 2);
+    cmdResponseBody(topic, topic_len);
+    cmdResponseBody(data, data_len);
+    cmdResponseEnd();
+  }
+}
+
+// Chunk of a message too large to be buffered, it goes to the stream callback with the
+// offset of the chunk and the total length: topic, offset, total length, data
+void ICACHE_FLASH_ATTR
+cmdMqttStreamCb(MQTT_Client* client, const char* topic, uint32_t topic_len,
+    uint32_t offset, uint32_t total_len, const char* data, uint32_t data_len)
+{
+  if (blocked) return;
+  MqttCmdCb* cb = (MqttCmdCb*)client->user_data;
+  DBG("MQTT: Stream cb=%p off=%u/%u len=%u\n", (void*)cb->streamCb, offset, total_len, data_len);
+
+  // messages that match no subscription are dropped just like in cmdMqttDataCb
+  uint32_t cbs[1];
+  if (!TopicTrie_Empty() && TopicTrie_Match(topic, topic_len, cbs, 1) == 0) return;
+
+  cmdResponseStart(CMD_RESP_CB, cb->streamCb, 4);
   cmdResponseBody(topic, topic_len);
+  cmdResponseBody(&offset, sizeof(offset));
+  cmdResponseBody(&total_len, sizeof(total_len));
   cmdResponseBody(data, data_len);
   cmdResponseEnd();
 }
@@ -126,15 +161,12 @@ MQTTCMD_Publish(CmdPacket *cmd) {
   cmdPopArg(&req, topic, len);
   topic[len] = 0;
 
-  // get data
-  len = cmdArgLen(&req);
-  uint8_t *data = (uint8_t*)os_zalloc(len+1);
-  if (!data) { // safety check
+  // get data, it gets copied straight from the packet into the MQTT queue
+  const char *data = cmdPopArgPtr(&req, &len);
+  if (data == NULL) {
     os_free(topic);
     return;
   }
-  cmdPopArg(&req, data, len);
-  data[len] = 0;
 
   uint16_t data_len;
   uint8_t qos, retain;
@@ -151,18 +183,74 @@ MQTTCMD_Publish(CmdPacket *cmd) {
   DBG("MQTT: MQTTCMD_Publish topic=%s, data_len=%d, qos=%d, retain=%d\n",
     topic, data_len, qos, retain);
 
-  MQTT_Publish(client, (char*)topic, (char*)data, data_len, qos%3, retain&1);
+  if (data_len > len) data_len = len; // safety check
+  MQTT_Publish(client, (char*)topic, data, data_len, qos%3, retain&1);
   os_free(topic);
-  os_free(data);
   return;
 }
 
+// Streaming variant of MQTTCMD_Publish, this allows messages that don't fit into the SLIP
+// buffer. Same arguments: topic, data, data length, qos, retain.
+static struct {
+  uint8_t  *topic;
+  uint8_t  *data;
+  uint16_t data_size;   // length of the data argument
+  uint16_t data_len;
+  uint8_t  qos, retain;
+} pubStream;
+
+void ICACHE_FLASH_ATTR
+MQTTCMD_PublishStream(CmdStream *st, const uint8_t *data, uint16_t len) {
+  if (data == NULL) {
+    // end of packet
+    if (pubStream.data_len > pubStream.data_size) pubStream.data_len = pubStream.data_size;
+    if (st->ok && st->hdr.argc == 5 && pubStream.topic != NULL && pubStream.data != NULL) {
+      DBG("MQTT: MQTTCMD_PublishStream topic=%s, data_len=%d, qos=%d, retain=%d\n",
+        pubStream.topic, pubStream.data_len, pubStream.qos, pubStream.retain);
+      MQTT_Publish(&mqttClient, (char*)pubStream.topic, (char*)pubStream.data,
+          pubStream.data_len, pubStream.qos%3, pubStream.retain&1);
+    }
+    if (pubStream.topic) os_free(pubStream.topic);
+    if (pubStream.data) os_free(pubStream.data);
+    os_memset(&pubStream, 0, sizeof(pubStream));
+    return;
+  }
+
+  uint8_t **buf = NULL;
+  switch (st->argn) {
+  case 0: // topic
+    if (st->arglen > 128) return; // safety check
+    buf = &pubStream.topic;
+    break;
+  case 1: // data
+    buf = &pubStream.data;
+    pubStream.data_size = st->arglen;
+    break;
+  case 2: // data length
+    if (st->argoff + len <= sizeof(pubStream.data_len))
+      os_memcpy((uint8_t*)&pubStream.data_len + st->argoff, data, len);
+    return;
+  case 3:
+    if (st->argoff == 0 && len > 0) pubStream.qos = data[0];
+    return;
+  case 4:
+    if (st->argoff == 0 && len > 0) pubStream.retain = data[0];
+    return;
+  default:
+    return;
+  }
+  if (st->argoff == 0) *buf = (uint8_t*)os_zalloc(st->arglen+1);
+  if (*buf == NULL) return; // out of memory, the publish gets dropped at the end
+  os_memcpy(*buf + st->argoff, data, len);
+}
+
 void ICACHE_FLASH_ATTR
 MQTTCMD_Subscribe(CmdPacket *cmd) {
   CmdRequest req;
   cmdRequest(&req, cmd);
 
-  if (cmdGetArgc(&req) != 2) return;
+  uint32_t argc = cmdGetArgc(&req);
+  if (argc != 2 && argc != 3) return;
 
   MQTT_Client* client = &mqttClient;
 
@@ -179,7 +267,15 @@ MQTTCMD_Subscribe(CmdPacket *cmd) {
   uint32_t qos = 0;
   cmdPopArg(&req, (uint8_t*)&qos, sizeof(qos));
 
-  DBG("MQTT: MQTTCMD_Subscribe topic=%s, qos=%u\n", topic, qos);
+  // optional callback for messages matching this subscription, defaults to the data callback
+  // given to MQTTCMD_Setup
+  uint32_t callback = 0;
+  if (argc == 3) cmdPopArg(&req, &callback, sizeof(callback));
+  MqttCmdCb* cb = (MqttCmdCb*)client->user_data;
+  if (callback == 0 && cb != NULL) callback = cb->dataCb;
+  if (callback != 0) TopicTrie_Add((char*)topic, callback);
+
+  DBG("MQTT: MQTTCMD_Subscribe topic=%s, qos=%u, cb=%08x\n", topic, qos, callback);
 
   MQTT_Subscribe(client, (char*)topic, (uint8_t)qos);
   os_free(topic);
@@ -193,14 +289,21 @@ MQTTCMD_Setup(CmdPacket *cmd) {
 
   MQTT_Client* client = &mqttClient;
 
-  if (cmdGetArgc(&req) != 4) return;
+  uint32_t argc = cmdGetArgc(&req);
+  if (argc != 4 && argc != 5) return;
+
+  // the MCU starts over, so do its subscriptions
+  TopicTrie_Clear();
 
   // create callback
+  if (client->user_data) os_free(client->user_data);
   MqttCmdCb* callback = (MqttCmdCb*)os_zalloc(sizeof(MqttCmdCb));
   cmdPopArg(&req, &callback->connectedCb, 4);
   cmdPopArg(&req, &callback->disconnectedCb, 4);
   cmdPopArg(&req, &callback->publishedCb, 4);
   cmdPopArg(&req, &callback->dataCb, 4);
+  // optional callback for messages too large to be buffered, without it they abort the connection
+  if (argc == 5) cmdPopArg(&req, &callback->streamCb, 4);
   client->user_data = callback;
 
   DBG("MQTT connectedCb=%x\n", callback->connectedCb);
@@ -209,6 +312,7 @@ MQTTCMD_Setup(CmdPacket *cmd) {
   client->cmdDisconnectedCb = cmdMqttDisconnectedCb;
   client->cmdPublishedCb = cmdMqttPublishedCb;
   client->cmdDataCb = cmdMqttDataCb;
+  client->cmdStreamCb = callback->streamCb ? cmdMqttStreamCb : NULL;
 
   if (client->connState == MQTT_CONNECTED) {
     if (callback->connectedCb)
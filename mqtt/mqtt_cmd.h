@@ -8,12 +8,14 @@ typedef struct {
   uint32_t disconnectedCb;
   uint32_t publishedCb;
   uint32_t dataCb;
+  uint32_t streamCb;      // gets messages too large to be buffered in chunks, 0=not streaming
 } MqttCmdCb;
 
 void MQTTCMD_Connect(CmdPacket *cmd);
 void MQTTCMD_Disconnect(CmdPacket *cmd);
 void MQTTCMD_Setup(CmdPacket *cmd);
 void MQTTCMD_Publish(CmdPacket *cmd);
+void MQTTCMD_PublishStream(CmdStream *st, const uint8_t *data, uint16_t len);
 void MQTTCMD_Subscribe(CmdPacket *cmd);
 void MQTTCMD_Lwt(CmdPacket *cmd);
 
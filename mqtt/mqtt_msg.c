@@ -365,6 +365,49 @@ mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* d
   return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+// length of the variable header and payload of a publish
+static uint32_t ICACHE_FLASH_ATTR
+publish_remaining_length(uint16_t topic_length, uint16_t data_length, int qos) {
+  return 2 + topic_length + (qos > 0 ? 2 : 0) + data_length;
+}
+
+uint16_t ICACHE_FLASH_ATTR
+mqtt_msg_publish_size(uint16_t topic_length, uint16_t data_length, int qos) {
+  uint32_t rl = publish_remaining_length(topic_length, data_length, qos);
+  uint32_t len = 1 + (rl > 127 ? (rl > 16383 ? 3 : 2) : 1) + rl;
+  return len > 0xffff ? 0xffff : len; // too big for anything we could queue anyway
+}
+
+uint16_t ICACHE_FLASH_ATTR
+mqtt_msg_publish_header(mqtt_connection_t* connection, uint8_t* buf, const char* topic,
+    uint16_t topic_length, uint16_t data_length, int qos, int retain, uint16_t* message_id) {
+  if (topic == NULL || topic_length == 0) return 0;
+
+  // fixed header, the remaining length is known up front so it needs no fix-up at the end
+  uint32_t rl = publish_remaining_length(topic_length, data_length, qos);
+  uint16_t i = 0;
+  buf[i++] = (MQTT_MSG_TYPE_PUBLISH << 4) | ((qos & 3) << 1) | (retain & 1);
+  do {
+    buf[i] = rl & 0x7f;
+    rl >>= 7;
+    if (rl > 0) buf[i] |= 0x80;
+    i++;
+  } while (rl > 0);
+
+  buf[i++] = topic_length >> 8;
+  buf[i++] = topic_length & 0xff;
+  memcpy(buf + i, topic, topic_length);
+  i += topic_length;
+
+  *message_id = 0;
+  if (qos > 0) {
+    while (*message_id == 0) *message_id = ++connection->message_id;
+    buf[i++] = *message_id >> 8;
+    buf[i++] = *message_id & 0xff;
+  }
+  return i;
+}
+
 mqtt_message_t* ICACHE_FLASH_ATTR
 mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id) {
   init_message(connection);
@@ -113,6 +113,12 @@ uint16_t mqtt_get_id(const uint8_t* buffer, uint16_t length);
 // The following functions construct an outgoing message
 mqtt_message_t* mqtt_msg_connect(mqtt_connection_t* connection, mqtt_connect_info_t* info);
 mqtt_message_t* mqtt_msg_publish(mqtt_connection_t* connection, const char* topic, const char* data, int data_length, int qos, int retain, uint16_t* message_id);
+// Publish built in place: mqtt_msg_publish_size returns the exact length of the message and
+// mqtt_msg_publish_header writes everything but the payload at the start of buf, the caller puts
+// the payload right after it. Returns the length of the header, 0 on error.
+uint16_t mqtt_msg_publish_size(uint16_t topic_length, uint16_t data_length, int qos);
+uint16_t mqtt_msg_publish_header(mqtt_connection_t* connection, uint8_t* buf, const char* topic,
+    uint16_t topic_length, uint16_t data_length, int qos, int retain, uint16_t* message_id);
 mqtt_message_t* mqtt_msg_puback(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_pubrec(mqtt_connection_t* connection, uint16_t message_id);
 mqtt_message_t* mqtt_msg_pubrel(mqtt_connection_t* connection, uint16_t message_id);
@@ -0,0 +1,207 @@
+#include <esp8266.h>
+#include "mqtt_spool.h"
+
+#ifdef MQTTSPOOL_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define SPOOL_MAGIC 0x4c4f5053 // "SPOL"
+
+// header at the start of each sector
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;
+} SpoolSect;
+
+// header of each record, followed by topic and data, padded to a multiple of 4 bytes
+typedef struct {
+  uint16_t len;         // length of topic plus data, 0xffff: end of the records in the sector
+  uint8_t  topic_len;
+  uint8_t  flags;       // REC_*
+} SpoolRec;
+
+#define REC_QOS     0x03
+#define REC_RETAIN  0x04
+#define REC_PENDING 0x80  // cleared when the record is consumed, erased flash has it set
+
+#define REC_SIZE(len) (sizeof(SpoolRec) + (((len)+3) & ~3))
+
+static uint32_t ICACHE_FLASH_ATTR
+sectAddr(MqttSpool *spool, uint16_t sect) {
+  return spool->start + sect*MQTT_SPOOL_SECT;
+}
+
+// Read the header of the record at off in sect, returns false at the end of the sector
+static bool ICACHE_FLASH_ATTR
+readRec(MqttSpool *spool, uint16_t sect, uint16_t off, SpoolRec *rec) {
+  if (off + sizeof(SpoolRec) > MQTT_SPOOL_SECT) return false;
+  spi_flash_read(sectAddr(spool, sect)+off, (uint32_t *)rec, sizeof(SpoolRec));
+  return rec->len != 0xffff && off + REC_SIZE(rec->len) <= MQTT_SPOOL_SECT;
+}
+
+// Count the records not consumed in sect starting at off, optionally noting where the first is
+static uint32_t ICACHE_FLASH_ATTR
+countPending(MqttSpool *spool, uint16_t sect, uint16_t off, uint16_t *first) {
+  uint32_t n = 0;
+  SpoolRec rec;
+  while (readRec(spool, sect, off, &rec)) {
+    if (rec.flags & REC_PENDING) {
+      if (n == 0 && first != NULL) *first = off;
+      n++;
+    }
+    off += REC_SIZE(rec.len);
+  }
+  return n;
+}
+
+// Return the offset past the last record in sect
+static uint16_t ICACHE_FLASH_ATTR
+endOfRecs(MqttSpool *spool, uint16_t sect) {
+  uint16_t off = sizeof(SpoolSect);
+  SpoolRec rec;
+  while (readRec(spool, sect, off, &rec)) off += REC_SIZE(rec.len);
+  return off;
+}
+
+// Erase the sector at wr_sect and write its header, if the oldest records are in there they
+// are lost
+static void ICACHE_FLASH_ATTR
+startSector(MqttSpool *spool) {
+  if (spool->count > 0 && spool->rd_sect == spool->wr_sect) {
+    uint32_t n = countPending(spool, spool->rd_sect, spool->rd_off, NULL);
+    os_printf("MQTT spool: full, dropping %lu messages\n", (unsigned long)n);
+    spool->count -= n;
+    spool->dropped += n;
+    spool->rd_sect = (spool->rd_sect+1) % spool->sectors;
+    spool->rd_off = sizeof(SpoolSect);
+  }
+  SpoolSect hdr = { SPOOL_MAGIC, ++spool->seq };
+  spi_flash_erase_sector(sectAddr(spool, spool->wr_sect) >> 12);
+  spi_flash_write(sectAddr(spool, spool->wr_sect), (uint32_t *)&hdr, sizeof(hdr));
+  spool->wr_off = sizeof(SpoolSect);
+  DBG("MQTT spool: sector %d seq=%lu\n", spool->wr_sect, (unsigned long)spool->seq);
+}
+
+bool ICACHE_FLASH_ATTR
+MqttSpool_Init(MqttSpool *spool, uint32_t start, uint32_t end) {
+  os_memset(spool, 0, sizeof(MqttSpool));
+  if (end <= start || (end-start)/MQTT_SPOOL_SECT < 2) return false;
+  spool->start = start;
+  spool->sectors = (end-start)/MQTT_SPOOL_SECT;
+
+  // the sector written last has the highest sequence number
+  int last = -1;
+  SpoolSect hdr;
+  for (uint16_t s=0; s<spool->sectors; s++) {
+    spi_flash_read(sectAddr(spool, s), (uint32_t *)&hdr, sizeof(hdr));
+    if (hdr.magic == SPOOL_MAGIC && (last < 0 || hdr.seq > spool->seq)) {
+      last = s;
+      spool->seq = hdr.seq;
+    }
+  }
+  if (last < 0) return true; // nothing there, the first append starts with sector 0
+  spool->wr_sect = last;
+  spool->wr_off = endOfRecs(spool, last);
+
+  // count what hasn't been consumed, oldest sector first, which is the one after the last
+  for (uint16_t i=1; i<=spool->sectors; i++) {
+    uint16_t s = (last+i) % spool->sectors;
+    spi_flash_read(sectAddr(spool, s), (uint32_t *)&hdr, sizeof(hdr));
+    if (hdr.magic != SPOOL_MAGIC) continue;
+    uint16_t first = 0;
+    uint32_t n = countPending(spool, s, sizeof(SpoolSect), &first);
+    if (n > 0 && spool->count == 0) {
+      spool->rd_sect = s;
+      spool->rd_off = first;
+    }
+    spool->count += n;
+  }
+  os_printf("MQTT spool: %lu messages in flash\n", (unsigned long)spool->count);
+  return true;
+}
+
+void ICACHE_FLASH_ATTR
+MqttSpool_Flush(MqttSpool *spool) {
+  if (spool->buf_fill == 0) return;
+  spi_flash_write(sectAddr(spool, spool->wr_sect)+spool->wr_off, spool->buf, spool->buf_fill);
+  spool->wr_off += spool->buf_fill;
+  spool->buf_fill = 0;
+}
+
+bool ICACHE_FLASH_ATTR
+MqttSpool_Append(MqttSpool *spool, const char *topic, const char *data, uint16_t data_len,
+    uint8_t qos, uint8_t retain) {
+  uint16_t topic_len = os_strlen(topic);
+  uint16_t size = REC_SIZE(topic_len + data_len);
+  if (spool->sectors == 0 || topic_len > 255 || size > MQTT_SPOOL_BUF) return false;
+
+  if (spool->wr_off == 0) startSector(spool);
+  if (spool->buf_fill + size > MQTT_SPOOL_BUF) MqttSpool_Flush(spool);
+  if (spool->wr_off + spool->buf_fill + size > MQTT_SPOOL_SECT) {
+    // doesn't fit into this sector anymore, move on to the next one
+    MqttSpool_Flush(spool);
+    spool->wr_sect = (spool->wr_sect+1) % spool->sectors;
+    startSector(spool);
+  }
+  if (spool->count == 0) {
+    spool->rd_sect = spool->wr_sect;
+    spool->rd_off = spool->wr_off + spool->buf_fill;
+  }
+
+  uint8_t *p = (uint8_t *)spool->buf + spool->buf_fill;
+  SpoolRec rec = { topic_len + data_len, topic_len,
+    REC_PENDING | (qos & REC_QOS) | (retain ? REC_RETAIN : 0) };
+  os_memcpy(p, &rec, sizeof(rec));
+  os_memcpy(p+sizeof(rec), topic, topic_len);
+  os_memcpy(p+sizeof(rec)+topic_len, data, data_len);
+  os_memset(p+sizeof(rec)+topic_len+data_len, 0, size-sizeof(rec)-topic_len-data_len);
+  spool->buf_fill += size;
+  spool->count++;
+  return true;
+}
+
+bool ICACHE_FLASH_ATTR
+MqttSpool_Peek(MqttSpool *spool, uint32_t *buf, MqttSpoolRecord *rec) {
+  SpoolRec hdr;
+  while (spool->count > 0) {
+    if (spool->rd_sect == spool->wr_sect && spool->rd_off >= spool->wr_off) {
+      if (spool->buf_fill == 0) {
+        spool->count = 0; // lost track, shouldn't happen
+        return false;
+      }
+      MqttSpool_Flush(spool); // the record is still in the write buffer
+    }
+    if (!readRec(spool, spool->rd_sect, spool->rd_off, &hdr)) {
+      spool->rd_sect = (spool->rd_sect+1) % spool->sectors;
+      spool->rd_off = sizeof(SpoolSect);
+      continue;
+    }
+    uint16_t size = REC_SIZE(hdr.len);
+    if (!(hdr.flags & REC_PENDING) || size > MQTT_SPOOL_BUF || hdr.topic_len > hdr.len) {
+      spool->rd_off += size; // consumed or garbage
+      continue;
+    }
+    spi_flash_read(sectAddr(spool, spool->rd_sect)+spool->rd_off, buf, size);
+    rec->topic = (char *)buf + sizeof(SpoolRec);
+    rec->topic_len = hdr.topic_len;
+    rec->data = rec->topic + hdr.topic_len;
+    rec->data_len = hdr.len - hdr.topic_len;
+    rec->qos = hdr.flags & REC_QOS;
+    rec->retain = (hdr.flags & REC_RETAIN) != 0;
+    return true;
+  }
+  return false;
+}
+
+void ICACHE_FLASH_ATTR
+MqttSpool_Consume(MqttSpool *spool) {
+  SpoolRec hdr;
+  if (spool->count == 0 || !readRec(spool, spool->rd_sect, spool->rd_off, &hdr)) return;
+  // clearing a bit doesn't need an erase
+  hdr.flags &= ~REC_PENDING;
+  spi_flash_write(sectAddr(spool, spool->rd_sect)+spool->rd_off, (uint32_t *)&hdr, sizeof(hdr));
+  spool->rd_off += REC_SIZE(hdr.len);
+  spool->count--;
+}
@@ -0,0 +1,52 @@
+#ifndef MQTT_SPOOL_H
+#define MQTT_SPOOL_H
+
+// Store-and-forward log of MQTT publishes in a reserved flash region. It's a circular log of
+// 4KB sectors, each starting with a header carrying a sequence number so the order survives a
+// reset. Records are appended to a RAM buffer that is written out when it's full or when
+// MqttSpool_Flush is called, a sector is erased when the log moves into it. When the log is
+// full the oldest sector is overwritten. Consumed records are marked in flash by clearing a
+// bit in their header, so they don't come back after a reset.
+
+#define MQTT_SPOOL_SECT    4096  // flash sector size
+#define MQTT_SPOOL_BUF     1024  // write buffer, also the max size of a record
+
+typedef struct {
+  uint32_t start;          // flash address of the first sector
+  uint16_t sectors;        // number of sectors, 0 if the spool is not usable
+  uint16_t rd_sect, rd_off; // position of the oldest record that may not have been consumed
+  uint16_t wr_sect, wr_off; // position where the write buffer goes, wr_off=0: sector not erased
+  uint32_t seq;            // sequence number of the sector being written
+  uint32_t count;          // records not consumed yet
+  uint32_t dropped;        // records overwritten because the spool was full
+  uint16_t buf_fill;       // bytes in buf
+  uint32_t buf[MQTT_SPOOL_BUF/4];
+} MqttSpool;
+
+// A record as returned by MqttSpool_Peek, topic and data point into the caller's buffer
+typedef struct {
+  char     *topic;
+  char     *data;
+  uint16_t topic_len, data_len;
+  uint8_t  qos, retain;
+} MqttSpoolRecord;
+
+// Set up a spool in [start..end) and recover what's in there, returns false if the region
+// is too small
+bool MqttSpool_Init(MqttSpool *spool, uint32_t start, uint32_t end);
+
+// Append a publish, returns false if it's too big to be spooled
+bool MqttSpool_Append(MqttSpool *spool, const char *topic, const char *data, uint16_t data_len,
+    uint8_t qos, uint8_t retain);
+
+// Write out the buffered records
+void MqttSpool_Flush(MqttSpool *spool);
+
+// Get the oldest record that hasn't been consumed into buf, which must hold MQTT_SPOOL_BUF
+// bytes and be 4-byte aligned, returns false if there is none
+bool MqttSpool_Peek(MqttSpool *spool, uint32_t *buf, MqttSpoolRecord *rec);
+
+// Mark the record returned by MqttSpool_Peek as consumed
+void MqttSpool_Consume(MqttSpool *spool);
+
+#endif
@@ -0,0 +1,194 @@
+#include <esp8266.h>
+#include "pktring.h"
+
+#ifdef PKTRING_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+#define PKTRING_SENT 0x80    // entry has been handed out since the last rewind
+
+// bytes taken up by an entry with len bytes of data, everything stays 4-byte aligned
+#define ENTRY_SIZE(len) (sizeof(PktRingEntry) + (((len)+3) & ~3))
+
+bool ICACHE_FLASH_ATTR
+PktRing_Init(PktRing *ring, uint16_t size) {
+  os_memset(ring, 0, sizeof(PktRing));
+  size &= ~3;
+  ring->buf = os_malloc(size);
+  if (ring->buf == NULL) {
+    os_printf("PktRing: cannot allocate %d bytes\n", size);
+    return false;
+  }
+  ring->size = size;
+  return true;
+}
+
+void ICACHE_FLASH_ATTR
+PktRing_Free(PktRing *ring) {
+  if (ring->buf != NULL) os_free(ring->buf);
+  os_memset(ring, 0, sizeof(PktRing));
+}
+
+uint8_t * ICACHE_FLASH_ATTR
+PktRing_Reserve(PktRing *ring, uint16_t len) {
+  uint32_t need = ENTRY_SIZE(len);
+  if (ring->buf == NULL) return NULL;
+
+  if (ring->used == 0) {
+    ring->head = ring->tail = ring->next = 0; // empty: start over at the beginning
+    ring->resv = 0;
+    if (need > ring->size) return NULL;
+  } else if (ring->tail > ring->head) {
+    // data in [head..tail), free space at the end and before head
+    if (ring->size - ring->tail >= need) ring->resv = ring->tail;
+    else if (ring->head >= need) ring->resv = 0;
+    else return NULL;
+  } else {
+    // data wraps around, free space in [tail..head), none if tail==head
+    if (ring->head - ring->tail >= need) ring->resv = ring->tail;
+    else return NULL;
+  }
+  return ring->buf + ring->resv + sizeof(PktRingEntry);
+}
+
+PktRingEntry * ICACHE_FLASH_ATTR
+PktRing_Commit(PktRing *ring, uint16_t len) {
+  if (ring->resv != ring->tail) {
+    // wrapped around, mark the rest of the buffer as unused
+    if (ring->tail < ring->size) {
+      PktRingEntry *w = (PktRingEntry *)(ring->buf + ring->tail);
+      w->len = 0;
+      w->flags = PKTRING_WRAP;
+    }
+    ring->used += ring->size - ring->tail;
+  }
+
+  PktRingEntry *e = (PktRingEntry *)(ring->buf + ring->resv);
+  e->len = len;
+  e->flags = 0;
+  ring->used += ENTRY_SIZE(len);
+  ring->tail = ring->resv + ENTRY_SIZE(len);
+  if (ring->unsent == 0) ring->next = ring->resv;
+  ring->count++;
+  ring->unsent++;
+  DBG("PktRing: +%d @%d, used=%d count=%d\n", len, ring->resv, ring->used, ring->count);
+  return e;
+}
+
+PktRingEntry * ICACHE_FLASH_ATTR
+PktRing_Push(PktRing *ring, const uint8_t *data, uint16_t len) {
+  uint8_t *p = PktRing_Reserve(ring, len);
+  if (p == NULL) return NULL;
+  os_memcpy(p, data, len);
+  return PktRing_Commit(ring, len);
+}
+
+PktRingEntry * ICACHE_FLASH_ATTR
+PktRing_Next(PktRing *ring) {
+  while (ring->unsent > 0) {
+    PktRingEntry *e = (PktRingEntry *)(ring->buf + ring->next);
+    if (ring->next == ring->size || (e->flags & PKTRING_WRAP)) {
+      ring->next = 0;
+      continue;
+    }
+    ring->next += ENTRY_SIZE(e->len);
+    if (e->flags & (PKTRING_RELEASED|PKTRING_SENT)) continue;
+    e->flags |= PKTRING_SENT;
+    ring->unsent--;
+    return e;
+  }
+  return NULL;
+}
+
+PktRingEntry * ICACHE_FLASH_ATTR
+PktRing_Peek(PktRing *ring) {
+  while (ring->unsent > 0) {
+    PktRingEntry *e = (PktRingEntry *)(ring->buf + ring->next);
+    if (ring->next == ring->size || (e->flags & PKTRING_WRAP)) {
+      ring->next = 0;
+      continue;
+    }
+    if (!(e->flags & (PKTRING_RELEASED|PKTRING_SENT))) return e;
+    ring->next += ENTRY_SIZE(e->len); // skipping these doesn't change what Next returns
+  }
+  return NULL;
+}
+
+PktRingEntry * ICACHE_FLASH_ATTR
+PktRing_Iter(PktRing *ring, PktRingEntry *prev) {
+  if (ring->used == 0) return NULL;
+  uint16_t off = ring->head;
+  if (prev != NULL) {
+    off = (uint8_t *)prev - ring->buf + ENTRY_SIZE(prev->len);
+    if (off == ring->tail) return NULL;
+  }
+  while (true) {
+    PktRingEntry *e = (PktRingEntry *)(ring->buf + off);
+    if (off == ring->size || (e->flags & PKTRING_WRAP)) {
+      off = 0;
+    } else if (e->flags & PKTRING_RELEASED) {
+      off += ENTRY_SIZE(e->len);
+    } else {
+      return e;
+    }
+    if (off == ring->tail) return NULL;
+  }
+}
+
+void ICACHE_FLASH_ATTR
+PktRing_Release(PktRing *ring, PktRingEntry *entry) {
+  if (entry == NULL || (entry->flags & PKTRING_RELEASED)) return;
+  entry->flags |= PKTRING_RELEASED;
+  ring->count--;
+  if (!(entry->flags & PKTRING_SENT)) ring->unsent--;
+
+  // reclaim the space of released entries at the head
+  while (ring->used > 0) {
+    bool at_next = ring->next == ring->head;
+    PktRingEntry *e = (PktRingEntry *)(ring->buf + ring->head);
+    if (ring->head == ring->size || (e->flags & PKTRING_WRAP)) {
+      ring->used -= ring->size - ring->head;
+      ring->head = 0;
+    } else if (e->flags & PKTRING_RELEASED) {
+      ring->used -= ENTRY_SIZE(e->len);
+      ring->head += ENTRY_SIZE(e->len);
+    } else {
+      break;
+    }
+    if (at_next) ring->next = ring->head;
+  }
+  DBG("PktRing: release, used=%d count=%d\n", ring->used, ring->count);
+}
+
+void ICACHE_FLASH_ATTR
+PktRing_Rewind(PktRing *ring) {
+  uint16_t off = ring->head;
+  uint16_t left = ring->used;
+  while (left > 0) {
+    PktRingEntry *e = (PktRingEntry *)(ring->buf + off);
+    if (off == ring->size || (e->flags & PKTRING_WRAP)) {
+      left -= ring->size - off;
+      off = 0;
+      continue;
+    }
+    e->flags &= ~PKTRING_SENT;
+    left -= ENTRY_SIZE(e->len);
+    off += ENTRY_SIZE(e->len);
+  }
+  ring->next = ring->head;
+  ring->unsent = ring->count;
+}
+
+uint16_t ICACHE_FLASH_ATTR
+PktRing_Avail(PktRing *ring) {
+  uint16_t space;
+  if (ring->used == 0)
+    space = ring->size;
+  else if (ring->tail > ring->head)
+    space = ring->size - ring->tail > ring->head ? ring->size - ring->tail : ring->head;
+  else
+    space = ring->head - ring->tail;
+  return space > sizeof(PktRingEntry) ? space - sizeof(PktRingEntry) : 0;
+}
@@ -0,0 +1,69 @@
+#ifndef PKTRING_H
+#define PKTRING_H
+
+// A ring of variable-length packets in one contiguous buffer, used for the MQTT outbound queue.
+// Packets are appended at the tail and handed out for sending in order. They stay in the ring
+// until released, which may happen out of order (e.g. when ACKs arrive), the space is reclaimed
+// once everything before it has been released. Rewinding makes everything that hasn't been
+// released go out again, e.g. after a reconnect. All operations are O(1), except that release
+// has to skip over entries released earlier.
+
+typedef struct PktRingEntry {
+  uint16_t len;          // length of data, 0 for the wrap-around marker
+  uint8_t  flags;        // PKTRING_*
+  uint8_t  spare;
+  uint8_t  data[0];      // really data[len]
+} PktRingEntry;
+
+#define PKTRING_RELEASED 0x01  // entry is no longer needed
+#define PKTRING_WRAP     0x02  // rest of the buffer unused, next entry is at the start
+
+typedef struct PktRing {
+  uint8_t  *buf;          // storage, NULL if allocation failed
+  uint16_t size;          // bytes allocated, multiple of 4
+  uint16_t head;          // offset of the oldest entry
+  uint16_t tail;          // offset where the next entry goes
+  uint16_t next;          // offset of the next entry to hand out
+  uint16_t used;          // bytes in use, including headers, padding and wrap-around waste
+  uint16_t count;         // entries that have not been released
+  uint16_t unsent;        // entries that have not been handed out
+  uint16_t resv;          // offset of the entry being reserved
+} PktRing;
+
+// Allocate the storage for a ring, returns false if out of memory
+bool PktRing_Init(PktRing *ring, uint16_t size);
+
+// Free the storage of a ring and everything in it
+void PktRing_Free(PktRing *ring);
+
+// Reserve space for a packet of up to len bytes at the tail, returns a pointer to the data or
+// NULL if it doesn't fit. The packet must be completed with PktRing_Commit before anything
+// else is done to the ring.
+uint8_t *PktRing_Reserve(PktRing *ring, uint16_t len);
+
+// Complete a packet started with PktRing_Reserve, the actual length may be shorter
+PktRingEntry *PktRing_Commit(PktRing *ring, uint16_t len);
+
+// Append a copy of a packet, returns NULL if it doesn't fit
+PktRingEntry *PktRing_Push(PktRing *ring, const uint8_t *data, uint16_t len);
+
+// Hand out the next packet to send, NULL if there is none
+PktRingEntry *PktRing_Next(PktRing *ring);
+
+// Return the packet PktRing_Next would hand out without handing it out, NULL if there is none
+PktRingEntry *PktRing_Peek(PktRing *ring);
+
+// Iterate over the packets that haven't been released, oldest first: pass NULL to get the
+// oldest one and the previous one to get the next, returns NULL at the end
+PktRingEntry *PktRing_Iter(PktRing *ring, PktRingEntry *prev);
+
+// Release a packet, its space is reclaimed once all older packets are released as well
+void PktRing_Release(PktRing *ring, PktRingEntry *entry);
+
+// Hand out all packets that haven't been released again, starting with the oldest
+void PktRing_Rewind(PktRing *ring);
+
+// Bytes available for the largest packet that could be pushed right now
+uint16_t PktRing_Avail(PktRing *ring);
+
+#endif
@@ -0,0 +1,134 @@
+#include <esp8266.h>
+#include "topic_trie.h"
+
+#ifdef TOPIC_TRIE_DBG
+#define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
+#else
+#define DBG(format, ...) do { } while(0)
+#endif
+
+typedef struct TopicNode {
+  struct TopicNode *child;    // first node of the next level
+  struct TopicNode *sibling;  // next node at the same level
+  uint32_t         callback;  // callback of the filter ending here, 0 if none does
+  uint8_t          len;       // length of level
+  char             level[0];  // topic level, not null-terminated, "+" or "#" for wildcards
+} TopicNode;
+
+static TopicNode *root;   // nodes of the first level
+static uint16_t nodes;    // number of nodes allocated
+
+static bool ICACHE_FLASH_ATTR
+isWild(TopicNode *n, char w) {
+  return n->len == 1 && n->level[0] == w;
+}
+
+bool ICACHE_FLASH_ATTR
+TopicTrie_Add(const char *filter, uint32_t callback) {
+  TopicNode **list = &root;
+  TopicNode *node = NULL;
+  const char *t = filter;
+  const char *end = filter + os_strlen(filter);
+  if (t == end) return false;
+
+  while (true) {
+    const char *e = t;
+    while (e < end && *e != '/') e++;
+    uint16_t len = e - t;
+    // wildcards have to be a whole level, # has to be the last one
+    for (const char *c = t; c < e; c++)
+      if ((*c == '+' || *c == '#') && len != 1) return false;
+    if (len == 1 && *t == '#' && e != end) return false;
+    if (len > 255) return false;
+
+    // find the level among the siblings or add it
+    for (node = *list; node != NULL; node = node->sibling)
+      if (node->len == len && os_memcmp(node->level, t, len) == 0) break;
+    if (node == NULL) {
+      if (nodes >= TOPIC_TRIE_MAX_NODES) {
+        os_printf("MQTT: subscription table full\n");
+        return false;
+      }
+      node = os_zalloc(sizeof(TopicNode) + len);
+      if (node == NULL) return false;
+      node->len = len;
+      os_memcpy(node->level, t, len);
+      node->sibling = *list;
+      *list = node;
+      nodes++;
+    }
+
+    if (e == end) break;
+    list = &node->child;
+    t = e+1;
+  }
+
+  DBG("TopicTrie: add %s -> %08x\n", filter, callback);
+  node->callback = callback;
+  return true;
+}
+
+static void ICACHE_FLASH_ATTR
+freeNodes(TopicNode *n) {
+  while (n != NULL) {
+    TopicNode *next = n->sibling;
+    freeNodes(n->child);
+    os_free(n);
+    n = next;
+  }
+}
+
+void ICACHE_FLASH_ATTR
+TopicTrie_Clear(void) {
+  freeNodes(root);
+  root = NULL;
+  nodes = 0;
+}
+
+bool ICACHE_FLASH_ATTR
+TopicTrie_Empty(void) {
+  return root == NULL;
+}
+
+// add a callback to the result unless it's already there
+static int ICACHE_FLASH_ATTR
+addMatch(uint32_t cb, uint32_t *cbs, int n, int max) {
+  if (cb == 0 || n >= max) return n;
+  for (int i=0; i<n; i++)
+    if (cbs[i] == cb) return n;
+  cbs[n] = cb;
+  return n+1;
+}
+
+// match the topic level starting at t against the nodes in list, recursing into the next level
+static int ICACHE_FLASH_ATTR
+matchLevel(TopicNode *list, const char *t, const char *end, bool first,
+    uint32_t *cbs, int n, int max) {
+  const char *e = t;
+  while (e < end && *e != '/') e++;
+
+  for (TopicNode *node = list; node != NULL; node = node->sibling) {
+    bool plus = isWild(node, '+');
+    bool hash = isWild(node, '#');
+    // topics starting with $ are not matched by wildcards at the first level
+    if (first && (plus || hash) && t < end && *t == '$') continue;
+    if (hash) {
+      n = addMatch(node->callback, cbs, n, max);
+    } else if (plus || (node->len == e-t && os_memcmp(node->level, t, node->len) == 0)) {
+      if (e == end) {
+        // last level of the topic, "a/#" also matches "a"
+        n = addMatch(node->callback, cbs, n, max);
+        for (TopicNode *c = node->child; c != NULL; c = c->sibling)
+          if (isWild(c, '#')) n = addMatch(c->callback, cbs, n, max);
+      } else {
+        n = matchLevel(node->child, e+1, end, false, cbs, n, max);
+      }
+    }
+  }
+  return n;
+}
+
+int ICACHE_FLASH_ATTR
+TopicTrie_Match(const char *topic, uint16_t topic_len, uint32_t *cbs, int max) {
+  return matchLevel(root, topic, topic+topic_len, true, cbs, 0, max);
+}
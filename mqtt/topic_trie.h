@@ -0,0 +1,26 @@
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+// Subscription table mapping MQTT topic filters to MCU callbacks, it's a trie with one node per
+// topic level so incoming topics are matched level by level, including the + and # wildcards.
+
+// Max number of nodes (topic levels over all filters), this bounds the memory used
+#define TOPIC_TRIE_MAX_NODES 64
+// Max number of distinct callbacks an incoming message is routed to
+#define TOPIC_TRIE_MAX_MATCH 8
+
+// Add a topic filter with its callback, replacing the callback if the filter is there already.
+// Returns false if the filter is malformed or the table is full.
+bool TopicTrie_Add(const char *filter, uint32_t callback);
+
+// Remove all filters
+void TopicTrie_Clear(void);
+
+// Return true if no filters have been added, in which case nothing gets routed
+bool TopicTrie_Empty(void);
+
+// Find the callbacks of all filters matching a topic, each callback is returned once.
+// Returns the number of callbacks put into cbs.
+int TopicTrie_Match(const char *topic, uint16_t topic_len, uint32_t *cbs, int max);
+
+#endif
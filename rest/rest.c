@@ -7,6 +7,9 @@
 #include "ip_addr.h"
 #include "rest.h"
 #include "cmd.h"
+#include "dnscache.h"
+#include "metrics.h"
+#include "perf.h"
 
 #ifdef REST_DBG
 #define DBG_REST(format, ...) os_printf(format, ## __VA_ARGS__)
@@ -20,19 +23,94 @@ typedef enum {
   HEADER_USER_AGENT
 } HEADER_TYPE;
 
+// States of the response parser, it's fed whatever TCP segments arrive
+enum {
+  REST_IDLE = 0,     // no response expected
+  REST_STATUS,       // status line
+  REST_HEADER,       // header lines
+  REST_BODY,         // body delimited by Content-Length or by closing the connection
+  REST_CHUNK_SIZE,   // chunked encoding: chunk size line
+  REST_CHUNK_DATA,   // chunked encoding: chunk data
+  REST_CHUNK_END,    // chunked encoding: CRLF after the chunk data
+  REST_TRAILER,      // chunked encoding: trailer lines after the last chunk
+};
+
+#define REST_LINE_MAX 48   // longer status and header lines are truncated, we only need the start
+#define REST_BODY_MAX 100  // body bytes passed to an MCU that doesn't stream
+#define REST_IDLE_MS  15000 // time a kept-alive connection stays open without a request
+#define REST_QUEUE    4    // requests a pipelining MCU may have queued per client
+
+// A request waiting for its response, it's kept in case it has to be sent again
 typedef struct {
-  char           *host;
+  char           *data;
+  uint16_t       data_len;
+  uint8_t        seq;           // pipelined request sequence number, 0 if the MCU doesn't pipeline
+  bool           no_body;       // request is a HEAD, the response has no body
+  bool           retried;       // request has been sent again after losing the connection
+} RestRequest;
+
+#define REST_HOST_MAX   128 // longest host name
+#define REST_HEADER_MAX 256 // longest header value the MCU may set
+// host and headers of a client, all at their longest, zero-terminated and with CRLFs
+#define REST_STR_MAX  (REST_HOST_MAX+1 + 3*(REST_HEADER_MAX+3))
+#define REST_CONNS    2    // espconns of a client, a new connection may start while the SDK is
+                           // still closing the one that was dropped
+
+struct RestClient;
+
+// A connection, the SDK owns it from connecting until the disconnect or reset callback
+typedef struct {
+  struct espconn conn;          // first, the callbacks get a pointer to it
+  esp_tcp        tcp;
+  struct RestClient *owner;
+  bool           busy;
+} RestConn;
+
+// Everything a client needs memory for, allocated at the first setup and reused after that,
+// so the MCU restarting and setting up its clients over and over doesn't churn the heap. The
+// host, the generic header, the content type and the user agent are packed into str, each
+// zero-terminated, in that order
+typedef struct {
+  RestConn       conns[REST_CONNS];
+  char           body[REST_BODY_MAX]; // start of the body for an MCU that doesn't stream
+  char           str[REST_STR_MAX];
+} RestArena;
+
+enum { REST_STR_HOST = 0, REST_STR_HEADER, REST_STR_CONTENT_TYPE, REST_STR_USER_AGENT, REST_NSTR };
+
+typedef struct RestClient {
+  RestArena      *arena;
+  char           *host;         // the strings in the arena
   uint32_t       port;
   uint32_t       security;
-  ip_addr_t      ip;
   struct espconn *pCon;
   char           *header;
-  char           *data;
-  uint16_t       data_len;
-  uint16_t       data_sent;
   char           *content_type;
   char           *user_agent;
   uint32_t       resp_cb;
+  RestRequest    queue[REST_QUEUE]; // requests in the order they're sent, the oldest is answered next
+  uint8_t        q_head;        // index of the oldest request
+  uint8_t        q_count;       // requests in the queue
+  uint8_t        q_sent;        // requests (from the oldest) completely sent on this connection
+  uint16_t       data_sent;     // bytes of the next request sent so far
+  uint16_t       send_len;      // bytes handed to espconn_sent, 0 if nothing is being sent
+  bool           conn_open;     // pCon is connected and may be kept open between requests
+  bool           keep_alive;    // server keeps the connection open after the response
+  bool           resp_done;     // a response was completed by the data just received
+  ETSTimer       timer;         // closes an idle connection, or sends requests on a new one
+  uint16_t       stream_max;    // max body bytes per callback when streaming, 0 to not stream
+  uint8_t        resp_state;    // REST_* state of the response parser, REST_IDLE if queue empty
+  uint8_t        line_len;      // bytes in line
+  int16_t        code;          // HTTP status code of the response
+  bool           chunked;       // response uses chunked transfer-encoding
+  bool           has_length;    // response has a Content-Length
+  uint32_t       content_len;   // value of the Content-Length
+  uint32_t       body_left;     // bytes left in the body or in the current chunk
+  uint32_t       body_off;      // body bytes passed to the MCU so far
+  uint16_t       body_len;      // bytes in the arena's body
+  char           line[REST_LINE_MAX]; // line being parsed
+  RestFetchCb    fetch_cb;      // gets the body when esp-link fetches something, NULL for the MCU
+  void           *fetch_arg;
 } RestClient;
 
 
@@ -44,92 +122,381 @@ typedef struct {
 #define MAX_REST 4
 static RestClient restClient[MAX_REST];
 static uint8_t restNum = 0xff; // index into restClient for next slot to allocate
+static RestClient restFetchClient; // used by REST_Fetch, separate from the MCU's pool
 #define REST_CB 0xbeef0000 // fudge added to callback for arduino so we can detect problems
 
-// Receive HTTP response - this hacky function assumes that the full response is received in
-// one go. Sigh...
+static void restConnect(RestClient *client);
+static void restReconnect(RestClient *client);
+
+// Allocate the arena the first time, returns false if out of memory
+static bool ICACHE_FLASH_ATTR
+restArena(RestClient *client) {
+  if (client->arena != NULL) return true;
+  client->arena = (RestArena *)os_zalloc(sizeof(RestArena));
+  if (client->arena == NULL) return false;
+  for (int i=0; i<REST_CONNS; i++) client->arena->conns[i].owner = client;
+  // host, header, content type and user agent start out empty
+  os_memset(client->arena->str, 0, REST_NSTR);
+  return true;
+}
+
+// Point the string fields at the packed strings
+static void ICACHE_FLASH_ATTR
+restStrings(RestClient *client) {
+  char *p = client->arena->str;
+  char **f[REST_NSTR] = { &client->host, &client->header, &client->content_type,
+      &client->user_agent };
+  for (int i=0; i<REST_NSTR; i++) {
+    *f[i] = p;
+    p += os_strlen(p) + 1;
+  }
+}
+
+// Replace one of the packed strings with len bytes of s, followed by CRLF if crlf is set.
+// Returns false if the strings wouldn't fit anymore, they're left as they were then.
+static bool ICACHE_FLASH_ATTR
+restSetString(RestClient *client, int which, const char *s, uint16_t len, bool crlf) {
+  char *str = client->arena->str;
+  char *start = str, *end = str;
+  for (int i=0; i<REST_NSTR; i++) {
+    if (i == which) start = end;
+    end += os_strlen(end) + 1;
+  }
+  char *next = start + os_strlen(start) + 1;
+  int newLen = len + (crlf ? 2 : 0) + 1;
+  if ((end - str) - (next - start) + newLen > REST_STR_MAX) {
+    os_printf("REST: no room for %d more header bytes\n", len);
+    return false;
+  }
+  os_memmove(start + newLen, next, end - next);
+  os_memcpy(start, s, len);
+  if (crlf) os_memcpy(start + len, "\r\n", 2);
+  start[newLen-1] = 0;
+  restStrings(client);
+  return true;
+}
+
+// The SDK is done with a connection. If it was dropped the client may be waiting for it to
+// get its queued requests going.
+static void ICACHE_FLASH_ATTR
+restConnRelease(struct espconn *pCon) {
+  RestConn *rc = (RestConn *)pCon;
+  rc->busy = false;
+  RestClient *client = rc->owner;
+  if (pCon->reverse == NULL && client->q_count > 0 && client->pCon == NULL)
+    restReconnect(client);
+}
+
+// The request whose response comes next
+static RestRequest * ICACHE_FLASH_ATTR
+restHead(RestClient *client) {
+  return client->queue + client->q_head;
+}
+
+// Done with the oldest request, get the parser ready for the response to the next one
+static void ICACHE_FLASH_ATTR
+restPop(RestClient *client) {
+  RestRequest *r = restHead(client);
+  if (r->data) os_free(r->data);
+  os_memset(r, 0, sizeof(RestRequest));
+  METRIC_INC(M_REST_REQUESTS);
+  client->q_head = (client->q_head+1) % REST_QUEUE;
+  client->q_count--;
+  if (client->q_sent > 0) client->q_sent--;
+  client->body_len = 0;
+  client->body_off = 0;
+  client->line_len = 0;
+  client->resp_state = client->q_count > 0 ? REST_STATUS : REST_IDLE;
+}
+
+// Fail the oldest request. A pipelined MCU is told so it gets its window slot back, an MCU that
+// doesn't pipeline never hears about these failures.
+static void ICACHE_FLASH_ATTR
+restFail(RestClient *client, int16_t code) {
+  uint8_t seq = restHead(client)->seq;
+  METRIC_INC(M_REST_ERRORS);
+  restPop(client);
+  if (client->fetch_cb != NULL) client->fetch_cb(client->fetch_arg, code, 0, 0, NULL, 0, true);
+  if (seq == 0) return;
+  cmdResponseStartSeq(seq, CMD_RESP_CB, client->resp_cb, 1);
+  cmdResponseBody(&code, sizeof(code));
+  cmdResponseEnd();
+}
+
+// Fail all queued requests
+static void ICACHE_FLASH_ATTR
+restFailAll(RestClient *client) {
+  while (client->q_count > 0) restFail(client, 502); // BAD GATEWAY
+}
+
+// Drop the connection, if there is one, its espconn is released by whatever callback comes next
+static void ICACHE_FLASH_ATTR
+restDropConn(RestClient *client) {
+  os_timer_disarm(&client->timer);
+  client->q_sent = 0;
+  client->data_sent = 0;
+  client->send_len = 0;
+  if (client->pCon == NULL) return;
+  client->pCon->reverse = NULL;
+  if (client->conn_open) espconn_disconnect(client->pCon);
+  client->pCon = NULL;
+  client->conn_open = false;
+}
+
+// Timer callback: close a kept-alive connection that has been idle for too long
+static void ICACHE_FLASH_ATTR
+restIdleCb(void *arg) {
+  RestClient *client = arg;
+  if (client->q_count > 0) return;
+  DBG_REST("REST #%d: closing idle connection\n", client-restClient);
+  restDropConn(client);
+}
+
+// Timer callback: send the queued requests on a new connection
+static void ICACHE_FLASH_ATTR
+restRetryCb(void *arg) {
+  RestClient *client = arg;
+  if (client->q_count > 0 && client->pCon == NULL) restConnect(client);
+}
+
+// Get a new connection going for the queued requests, from a timer so it's not from within the
+// callbacks of the connection being closed
+static void ICACHE_FLASH_ATTR
+restReconnect(RestClient *client) {
+  os_timer_disarm(&client->timer);
+  os_timer_setfn(&client->timer, restRetryCb, client);
+  os_timer_arm(&client->timer, 10, 0);
+}
+
+// Send the next queued request, or the next part of it, they go out back to back without
+// waiting for the responses
+static void ICACHE_FLASH_ATTR
+restSendNext(RestClient *client) {
+  if (!client->conn_open || client->send_len > 0 || client->q_sent >= client->q_count) return;
+  RestRequest *r = client->queue + (client->q_head + client->q_sent) % REST_QUEUE;
+  uint16_t left = r->data_len - client->data_sent;
+  client->send_len = left <= 1400 ? left : 1400;
+  DBG_REST("REST #%d: sending %d\n", client-restClient, client->send_len);
+  //if(client->security){
+  //  espconn_secure_sent(client->pCon, r->data+client->data_sent, client->send_len);
+  //}
+  //else{
+    espconn_sent(client->pCon, (uint8_t*)r->data+client->data_sent, client->send_len);
+  //}
+}
+
+// Pass body data to the MCU, last completes the response. An MCU that streams gets callbacks
+// with the status code, the offset and total length of the body (0 while the total isn't known)
+// and up to stream_max bytes of data, the response to the request is the last callback, where
+// offset+length equals the total. Otherwise the start of the body is collected for one callback
+// with the status code and the data.
+static void ICACHE_FLASH_ATTR
+restBody(RestClient *client, const char *data, uint16_t len, bool last) {
+  uint8_t seq = restHead(client)->seq;
+  if (client->fetch_cb != NULL) {
+    uint32_t total = client->has_length ? client->content_len : 0;
+    client->fetch_cb(client->fetch_arg, client->code, client->body_off, total, data, len, last);
+    client->body_off += len;
+  } else if (client->stream_max == 0) {
+    uint16_t n = REST_BODY_MAX - client->body_len;
+    if (n > len) n = len;
+    if (n > 0) {
+      os_memcpy(client->arena->body+client->body_len, data, n);
+      client->body_len += n;
+    }
+    if (!last) return;
+    DBG_REST("REST: status=%d, body=%d\n", client->code, client->body_len);
+    cmdResponseStartSeq(seq, CMD_RESP_CB, client->resp_cb, client->body_len ? 2 : 1);
+    cmdResponseBody(&client->code, sizeof(client->code));
+    if (client->body_len) cmdResponseBody(client->arena->body, client->body_len);
+    cmdResponseEnd();
+  } else {
+    while (len > 0 || last) {
+      uint16_t n = len > client->stream_max ? client->stream_max : len;
+      bool fin = last && n == len;
+      uint32_t total = fin ? client->body_off + n : client->has_length ? client->content_len : 0;
+      cmdResponseStartSeq(fin ? seq : 0, CMD_RESP_CB, client->resp_cb, 4);
+      cmdResponseBody(&client->code, sizeof(client->code));
+      cmdResponseBody(&client->body_off, sizeof(client->body_off));
+      cmdResponseBody(&total, sizeof(total));
+      cmdResponseBody(data, n);
+      cmdResponseEnd();
+      client->body_off += n;
+      data += n;
+      len -= n;
+      if (fin) break;
+    }
+    if (last) DBG_REST("REST: status=%d, body=%d\n", client->code, client->body_off);
+  }
+  if (!last) return;
+  restPop(client);
+  client->resp_done = true;
+}
+
+// Return true if a header line starts with name, ignoring case, and set value to what follows
+static bool ICACHE_FLASH_ATTR
+restHeaderIs(const char *line, const char *name, const char **value) {
+  while (*name) {
+    char c = *line++;
+    if (c >= 'A' && c <= 'Z') c += 'a'-'A';
+    if (c != *name++) return false;
+  }
+  while (*line == ' ' || *line == '\t') line++;
+  *value = line;
+  return true;
+}
+
+// Process a complete status, header or chunk line
+static void ICACHE_FLASH_ATTR
+restLine(RestClient *client) {
+  char *line = client->line;
+  const char *value;
+  switch (client->resp_state) {
+  case REST_STATUS:
+    if (client->line_len == 0) break; // stray CRLF
+    client->code = 502; // BAD GATEWAY, unless it's a proper status line
+    if (os_strncmp(line, "HTTP/", 5) == 0) {
+      char *sp = os_strchr(line, ' ');
+      if (sp != NULL && atoi(sp+1) > 0) client->code = atoi(sp+1);
+    }
+    client->keep_alive = os_strncmp(line, "HTTP/1.1", 8) == 0; // the default for HTTP/1.1
+    client->chunked = client->has_length = false;
+    client->resp_state = REST_HEADER;
+    break;
+  case REST_HEADER:
+    if (client->line_len > 0) {
+      if (restHeaderIs(line, "content-length:", &value)) {
+        client->has_length = true;
+        client->content_len = atoi(value);
+      } else if (restHeaderIs(line, "transfer-encoding:", &value)) {
+        client->chunked = os_strstr(value, "chunked") != NULL;
+      } else if (restHeaderIs(line, "connection:", &value)) {
+        // the value isn't lower-cased, servers send "close" and "keep-alive" or "Keep-Alive"
+        if (os_strstr(value, "close")) client->keep_alive = false;
+        else if (os_strstr(value, "eep-")) client->keep_alive = true;
+      }
+      break;
+    }
+    // end of the header
+    if (client->code >= 100 && client->code < 200) {
+      client->resp_state = REST_STATUS; // interim response, the real one follows
+    } else if (restHead(client)->no_body || client->code == 204 || client->code == 304 ||
+        (!client->chunked && client->has_length && client->content_len == 0)) {
+      restBody(client, NULL, 0, true);
+    } else if (client->chunked) {
+      client->has_length = false; // chunked wins over Content-Length
+      client->resp_state = REST_CHUNK_SIZE;
+    } else {
+      client->body_left = client->content_len;
+      client->resp_state = REST_BODY;
+    }
+    break;
+  case REST_CHUNK_SIZE:
+    if (client->line_len == 0) break;
+    client->body_left = strtoul(line, NULL, 16); // stops at any chunk extension
+    client->resp_state = client->body_left ? REST_CHUNK_DATA : REST_TRAILER;
+    break;
+  case REST_CHUNK_END:
+    client->resp_state = REST_CHUNK_SIZE;
+    break;
+  case REST_TRAILER:
+    if (client->line_len == 0) restBody(client, NULL, 0, true);
+    break;
+  }
+}
+
+// Receive HTTP responses, they may be split across any number of TCP segments and a segment
+// may carry the end of one response and the start of the next
 static void ICACHE_FLASH_ATTR
 tcpclient_recv(void *arg, char *pdata, unsigned short len) {
   struct espconn *pCon = (struct espconn*)arg;
   RestClient *client = (RestClient *)pCon->reverse;
+  if (client == NULL) return; // connection was dropped
 
-  // parse status line
   int pi = 0;
-  int16_t code = -1;
-  char statusCode[4] = "\0\0\0\0";
-  int statusLen = 0;
-  bool inStatus = false;
-  while (pi < len) {
-    if (pdata[pi] == '\n') {
-      // end of status line
-      if (code == -1) code = 502; // BAD GATEWAY
-      break;
-    } else if (pdata[pi] == ' ') {
-      if (inStatus) code = atoi(statusCode);
-      inStatus = !inStatus;
-    } else if (inStatus) {
-      if (statusLen < 3) statusCode[statusLen] = pdata[pi];
-      statusLen++;
+  while (pi < len && client->resp_state != REST_IDLE && client->q_sent > 0) {
+    if (client->resp_state == REST_BODY || client->resp_state == REST_CHUNK_DATA) {
+      uint16_t n = len - pi;
+      bool counted = client->resp_state == REST_CHUNK_DATA || client->has_length;
+      if (counted && n > client->body_left) n = client->body_left;
+      bool last = client->resp_state == REST_BODY && client->has_length && n == client->body_left;
+      if (counted) client->body_left -= n;
+      if (client->resp_state == REST_CHUNK_DATA && client->body_left == 0)
+        client->resp_state = REST_CHUNK_END;
+      restBody(client, pdata+pi, n, last);
+      pi += n;
+    } else {
+      // the line based parts, CRs are dropped
+      char c = pdata[pi++];
+      if (c == '\n') {
+        client->line[client->line_len] = 0;
+        restLine(client);
+        client->line_len = 0;
+      } else if (c != '\r' && client->line_len < REST_LINE_MAX-1) {
+        client->line[client->line_len++] = c;
+      }
     }
-    pi++;
-  }
 
-  // parse header, all this does is look for the end of the header
-  bool currentLineIsBlank = false;
-  while (pi < len) {
-    if (pdata[pi] == '\n') {
-      if (currentLineIsBlank) {
-        // body is starting
-        pi++;
-        break;
+    if (client->resp_done) {
+      client->resp_done = false;
+      if (!client->keep_alive) {
+        // the server won't answer anything else on this connection, send the rest again
+        restDropConn(client);
+        if (client->q_count > 0) restReconnect(client);
+        return;
       }
-      currentLineIsBlank = true;
-    } else if (pdata[pi] != '\r') {
-      currentLineIsBlank = false;
     }
-    pi++;
   }
-  //if (pi < len && pdata[pi] == '\r') pi++; // hacky!
 
-  // collect body and send it
-  int body_len = len-pi;
-  DBG_REST("REST: status=%d, body=%d\n", code, body_len);
-  if (pi == len) {
-    cmdResponseStart(CMD_RESP_CB, client->resp_cb, 1);
-    cmdResponseBody(&code, sizeof(code));
-    cmdResponseEnd();
-  } else {
-    cmdResponseStart(CMD_RESP_CB, client->resp_cb, 2);
-    cmdResponseBody(&code, sizeof(code));
-    cmdResponseBody(pdata+pi, body_len>100?100:body_len);
-    cmdResponseEnd();
-#if 0
-    os_printf("REST: body=");
-    for (int j=pi; j<len; j++) os_printf(" %02x", pdata[j]);
-    os_printf("\n");
-#endif
+  if (client->q_count == 0) {
+    // keep the connection for the next request, but not forever
+    os_timer_disarm(&client->timer);
+    os_timer_setfn(&client->timer, restIdleCb, client);
+    os_timer_arm(&client->timer, REST_IDLE_MS, 0);
   }
-
-  //if(client->security)
-  //  espconn_secure_disconnect(client->pCon);
-  //else
-    espconn_disconnect(client->pCon);
 }
 
 static void ICACHE_FLASH_ATTR
 tcpclient_sent_cb(void *arg) {
   struct espconn *pCon = (struct espconn *)arg;
   RestClient* client = (RestClient *)pCon->reverse;
+  if (client == NULL || client->send_len == 0) return; // connection was dropped
   DBG_REST("REST: Sent\n");
-  if (client->data_sent != client->data_len) {
-    // we only sent part of the buffer, send the rest
-    espconn_sent(client->pCon, (uint8_t*)(client->data+client->data_sent),
-          client->data_len-client->data_sent);
-    client->data_sent = client->data_len;
-  } else {
-    // we're done sending, free the memory
-    if (client->data) os_free(client->data);
-    client->data = 0;
+  RestRequest *r = client->queue + (client->q_head + client->q_sent) % REST_QUEUE;
+  client->data_sent += client->send_len;
+  client->send_len = 0;
+  if (client->data_sent >= r->data_len) {
+    client->q_sent++;
+    client->data_sent = 0;
+  }
+  restSendNext(client);
+}
+
+// The connection went away. A response delimited by closing is complete, one that was cut off
+// fails. Requests that got no response are sent again on a new connection, but only once: one
+// sent on a kept-alive connection just as the server closes it for being idle deserves another
+// try, one the server keeps closing the connection on doesn't.
+static void ICACHE_FLASH_ATTR
+restConnLost(RestClient *client) {
+  // requests that went out completely or in part
+  uint8_t sent = client->q_sent + (client->data_sent > 0 || client->send_len > 0);
+  client->pCon = NULL; // the SDK is done with it, restDropConn must not disconnect it
+  client->conn_open = false;
+  restDropConn(client);
+  if (client->q_count == 0) return;
+
+  if (client->resp_state == REST_BODY && !client->has_length)
+    restBody(client, NULL, 0, true); // the end of the body is signaled by closing
+  else if (client->resp_state != REST_STATUS || client->line_len > 0 ||
+      (sent > 0 && restHead(client)->retried))
+    restFail(client, 502); // closed without a (complete) response
+  client->resp_done = false;
+
+  for (int i=0; i<client->q_count && i<sent; i++)
+    client->queue[(client->q_head + i) % REST_QUEUE].retried = true;
+  if (client->q_count > 0) {
+    DBG_REST("REST #%d: connection lost, %d requests left\n", client-restClient, client->q_count);
+    restReconnect(client);
   }
 }
 
@@ -137,38 +504,38 @@ static void ICACHE_FLASH_ATTR
 tcpclient_discon_cb(void *arg) {
   struct espconn *pespconn = (struct espconn *)arg;
   RestClient* client = (RestClient *)pespconn->reverse;
-  // free the data buffer, if we have one
-  if (client->data) os_free(client->data);
-  client->data = 0;
+  restConnRelease(pespconn);
+  if (client == NULL) return; // connection was dropped
+  DBG_REST("REST #%d: disconnected\n", client-restClient);
+  restConnLost(client);
 }
 
+// Note that no discon_cb follows
 static void ICACHE_FLASH_ATTR
 tcpclient_recon_cb(void *arg, sint8 errType) {
   struct espconn *pCon = (struct espconn *)arg;
   RestClient* client = (RestClient *)pCon->reverse;
+  restConnRelease(pCon);
+  if (client == NULL) return; // connection was dropped
   os_printf("REST #%d: conn reset, err=%d\n", client-restClient, errType);
-  // free the data buffer, if we have one
-  if (client->data) os_free(client->data);
-  client->data = 0;
+  restConnLost(client);
 }
 
 static void ICACHE_FLASH_ATTR
 tcpclient_connect_cb(void *arg) {
   struct espconn *pCon = (struct espconn *)arg;
   RestClient* client = (RestClient *)pCon->reverse;
+  if (client == NULL) { // connection was dropped while connecting
+    espconn_disconnect(pCon);
+    return;
+  }
   DBG_REST("REST #%d: connected\n", client-restClient);
-  espconn_regist_disconcb(client->pCon, tcpclient_discon_cb);
+  METRIC_INC(M_REST_CONNECTS);
+  client->conn_open = true;
   espconn_regist_recvcb(client->pCon, tcpclient_recv);
   espconn_regist_sentcb(client->pCon, tcpclient_sent_cb);
-
-  client->data_sent = client->data_len <= 1400 ? client->data_len : 1400;
-  DBG_REST("REST #%d: sending %d\n", client-restClient, client->data_sent);
-  //if(client->security){
-  //  espconn_secure_sent(client->pCon, client->data, client->data_sent);
-  //}
-  //else{
-    espconn_sent(client->pCon, (uint8_t*)client->data, client->data_sent);
-  //}
+  perfTcpSetup(client->pCon, TCP_SVC_REST);
+  restSendNext(client);
 }
 
 static void ICACHE_FLASH_ATTR
@@ -176,8 +543,12 @@ rest_dns_found(const char *name, ip_addr_t *ipaddr, void *arg) {
   struct espconn *pConn = (struct espconn *)arg;
   RestClient* client = (RestClient *)pConn->reverse;
 
-  if(ipaddr == NULL) {
+  if (client == NULL || ipaddr == NULL || ipaddr->addr == 0) {
+    restConnRelease(pConn);
+    if (client == NULL) return; // connection was dropped
     os_printf("REST DNS: Got no ip, try to reconnect\n");
+    client->pCon = NULL;
+    restFailAll(client);
     return;
   }
   DBG_REST("REST DNS: found ip %d.%d.%d.%d\n",
@@ -185,15 +556,58 @@ rest_dns_found(const char *name, ip_addr_t *ipaddr, void *arg) {
       *((uint8 *) &ipaddr->addr + 1),
       *((uint8 *) &ipaddr->addr + 2),
       *((uint8 *) &ipaddr->addr + 3));
-  if(client->ip.addr == 0 && ipaddr->addr != 0) {
-    os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
+  os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
 #ifdef CLIENT_SSL_ENABLE
-    if(client->security) {
-      espconn_secure_connect(client->pCon);
-    } else
+  if(client->security) {
+    espconn_secure_connect(client->pCon);
+  } else
 #endif
-    espconn_connect(client->pCon);
-    DBG_REST("REST: connecting...\n");
+  espconn_connect(client->pCon);
+  DBG_REST("REST: connecting...\n");
+}
+
+// Set up a new connection to the server and send the queued requests once it's open. Each
+// connection takes an espconn of the arena that the SDK is done with, if there is none the
+// connection is made once one is released.
+static void ICACHE_FLASH_ATTR
+restConnect(RestClient *client) {
+  client->q_sent = 0;
+  client->data_sent = 0;
+  client->send_len = 0;
+  if (client->arena == NULL) {
+    restFailAll(client);
+    return;
+  }
+  RestConn *rc = NULL;
+  for (int i=0; i<REST_CONNS && rc == NULL; i++)
+    if (!client->arena->conns[i].busy) rc = client->arena->conns + i;
+  if (rc == NULL) return;
+  os_memset(&rc->conn, 0, sizeof(struct espconn));
+  os_memset(&rc->tcp, 0, sizeof(esp_tcp));
+  rc->busy = true;
+  client->pCon = &rc->conn;
+  client->pCon->proto.tcp = &rc->tcp;
+  client->pCon->type = ESPCONN_TCP;
+  client->pCon->state = ESPCONN_NONE;
+  client->pCon->proto.tcp->local_port = espconn_port();
+  client->pCon->proto.tcp->remote_port = client->port;
+  client->pCon->reverse = client;
+  client->conn_open = false;
+  espconn_regist_connectcb(client->pCon, tcpclient_connect_cb);
+  espconn_regist_reconcb(client->pCon, tcpclient_recon_cb);
+  espconn_regist_disconcb(client->pCon, tcpclient_discon_cb);
+
+  if(UTILS_StrToIP((char *)client->host, &client->pCon->proto.tcp->remote_ip)) {
+    DBG_REST("REST: Connect to ip %s:%d\n",client->host, client->port);
+    //if(client->security){
+    //  espconn_secure_connect(client->pCon);
+    //}
+    //else {
+      espconn_connect(client->pCon);
+    //}
+  } else {
+    DBG_REST("REST: Connect to host %s:%d\n", client->host, client->port);
+    dnsCacheLookup(client->host, rest_dns_found, client->pCon);
   }
 }
 
@@ -206,30 +620,29 @@ REST_Setup(CmdPacket *cmd) {
 
   // start parsing the command
   cmdRequest(&req, cmd);
-  if(cmdGetArgc(&req) != 3) goto fail;
+  if(cmdGetArgc(&req) != 3 && cmdGetArgc(&req) != 4) goto fail;
   err--;
 
   // get the hostname
   uint16_t len = cmdArgLen(&req);
-  if (len > 128) goto fail; // safety check
+  if (len > REST_HOST_MAX) goto fail; // safety check
   err--;
-  uint8_t *rest_host = (uint8_t*)os_zalloc(len + 1);
+  char rest_host[REST_HOST_MAX+1];
   if (cmdPopArg(&req, rest_host, len)) goto fail;
   err--;
   rest_host[len] = 0;
 
   // get the port
-  if (cmdPopArg(&req, (uint8_t*)&port, 2)) {
-    os_free(rest_host);
-    goto fail;
-  }
+  if (cmdPopArg(&req, (uint8_t*)&port, 2)) goto fail;
   err--;
 
   // get the security mode
-  if (cmdPopArg(&req, (uint8_t*)&security, 1)) {
-    os_free(rest_host);
-    goto fail;
-  }
+  if (cmdPopArg(&req, (uint8_t*)&security, 1)) goto fail;
+  err--;
+
+  // get the optional max body bytes per callback, which makes responses stream
+  uint16_t stream_max = 0;
+  if (cmdGetArgc(&req) == 4 && cmdPopArg(&req, (uint8_t*)&stream_max, 2)) goto fail;
   err--;
 
   // clear connection structures the first time
@@ -240,45 +653,35 @@ REST_Setup(CmdPacket *cmd) {
 
   // allocate a connection structure
   RestClient *client = restClient + restNum;
+  if (!restArena(client)) goto fail;
   uint8_t clientNum = restNum;
   restNum = (restNum+1)%MAX_REST;
 
-  // free any data structure that may be left from a previous connection
-  if (client->header) os_free(client->header);
-  if (client->content_type) os_free(client->content_type);
-  if (client->user_agent) os_free(client->user_agent);
-  if (client->data) os_free(client->data);
-  if (client->pCon) {
-    if (client->pCon->proto.tcp) os_free(client->pCon->proto.tcp);
-    os_free(client->pCon);
-  }
+  // free the requests that may be left from a previous connection, the arena is reused
+  restDropConn(client);
+  for (int i=0; i<REST_QUEUE; i++)
+    if (client->queue[i].data) os_free(client->queue[i].data);
+  RestArena *arena = client->arena;
   os_memset(client, 0, sizeof(RestClient));
-  DBG_REST("REST: setup #%d host=%s port=%d security=%d\n", clientNum, rest_host, port, security);
+  client->arena = arena;
+  DBG_REST("REST: setup #%d host=%s port=%d security=%d stream=%d\n", clientNum, rest_host, port,
+      security, stream_max);
 
   client->resp_cb = cmd->value;
+  client->stream_max = stream_max;
 
-  client->host = (char *)rest_host;
   client->port = port;
   client->security = security;
 
-  client->header = (char*)os_zalloc(4);
-  client->header[0] = 0;
-
-  client->content_type = (char*)os_zalloc(22);
-  os_sprintf((char *)client->content_type, "x-www-form-urlencoded");
-
-  client->user_agent = (char*)os_zalloc(9);
-  os_sprintf((char *)client->user_agent, "esp-link");
-
-  client->pCon = (struct espconn *)os_zalloc(sizeof(struct espconn));
-  client->pCon->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
-
-  client->pCon->type = ESPCONN_TCP;
-  client->pCon->state = ESPCONN_NONE;
-  client->pCon->proto.tcp->local_port = espconn_port();
-  client->pCon->proto.tcp->remote_port = client->port;
-
-  client->pCon->reverse = client;
+  // the host can take at most half of the room, that leaves enough for the headers
+  char *str = arena->str;
+  os_memcpy(str, rest_host, len + 1);
+  str += len + 1;
+  *str++ = 0; // no generic header
+  os_strcpy(str, "x-www-form-urlencoded");
+  str += os_strlen(str) + 1;
+  os_strcpy(str, "esp-link");
+  restStrings(client);
 
   cmdResponseStart(CMD_RESP_V, clientNum, 0);
   cmdResponseEnd();
@@ -307,33 +710,21 @@ REST_SetHeader(CmdPacket *cmd) {
 
   // Get header value
   uint16_t len = cmdArgLen(&req);
-  if (len > 256) return; //safety check
+  if (len > REST_HEADER_MAX) return; //safety check
+  if (client->arena == NULL) return; // not set up
+  char value[REST_HEADER_MAX];
+  if (cmdPopArg(&req, (uint8_t*)value, len)) return;
   switch(header_index) {
   case HEADER_GENERIC:
-    if(client->header) os_free(client->header);
-    client->header = (char*)os_zalloc(len + 3);
-    cmdPopArg(&req, (uint8_t*)client->header, len);
-    client->header[len] = '\r';
-    client->header[len+1] = '\n';
-    client->header[len+2] = 0;
+    restSetString(client, REST_STR_HEADER, value, len, true);
     DBG_REST("REST: Set header: %s\r\n", client->header);
     break;
   case HEADER_CONTENT_TYPE:
-    if(client->content_type) os_free(client->content_type);
-    client->content_type = (char*)os_zalloc(len + 3);
-    cmdPopArg(&req, (uint8_t*)client->content_type, len);
-    client->content_type[len] = '\r';
-    client->content_type[len+1] = '\n';
-    client->content_type[len+2] = 0;
+    restSetString(client, REST_STR_CONTENT_TYPE, value, len, true);
     DBG_REST("REST: Set content_type: %s\r\n", client->content_type);
     break;
   case HEADER_USER_AGENT:
-    if(client->user_agent) os_free(client->user_agent);
-    client->user_agent = (char*)os_zalloc(len + 3);
-    cmdPopArg(&req, (uint8_t*)client->user_agent, len);
-    client->user_agent[len] = '\r';
-    client->user_agent[len+1] = '\n';
-    client->user_agent[len+2] = 0;
+    restSetString(client, REST_STR_USER_AGENT, value, len, true);
     DBG_REST("REST: Set user_agent: %s\r\n", client->user_agent);
     break;
   }
@@ -350,6 +741,7 @@ REST_Request(CmdPacket *cmd) {
   uint32_t clientNum = cmd->value;
   RestClient *client = restClient + (clientNum % MAX_REST);
   DBG_REST(" #%d", clientNum);
+  if (client->arena == NULL) goto fail; // not set up
 
   // Get HTTP method
   uint16_t len = cmdArgLen(&req);
@@ -377,56 +769,120 @@ REST_Request(CmdPacket *cmd) {
   }
   DBG_REST(" bodyLen=%d", realLen);
 
+  // An MCU that pipelines may queue a few requests, they go out back to back and the responses
+  // come back tagged with the sequence number of their request. Otherwise there's just one, a
+  // request still pending on this client is dropped along with its connection, which would
+  // deliver the old response.
+  if (cmdWindow == 0) {
+    if (client->q_count > 0) {
+      restDropConn(client);
+      restFailAll(client);
+    }
+  } else if (client->q_count >= REST_QUEUE) {
+    DBG_REST(" queue full\n");
+    int16_t code = 503; // SERVICE UNAVAILABLE
+    cmdResponseStart(CMD_RESP_CB, client->resp_cb, 1);
+    cmdResponseBody(&code, sizeof(code));
+    cmdResponseEnd();
+    return;
+  }
+  RestRequest *r = client->queue + (client->q_head + client->q_count) % REST_QUEUE;
+
   // we need to allocate memory for the header plus the body. First we count the length of the
   // header (including some extra counted "%s" and then we add the body length. We allocate the
   // whole shebang and copy everything into it.
-  // BTW, use http/1.0 to avoid responses with transfer-encoding: chunked
-  char *headerFmt = "%s %s HTTP/1.0\r\n"
+  // The connection is kept open for the next request unless the server closes it.
+  char *headerFmt = "%s %s HTTP/1.1\r\n"
                     "Host: %s\r\n"
                     "%s"
                     "Content-Length: %d\r\n"
-                    "Connection: close\r\n"
+                    "Connection: keep-alive\r\n"
                     "Content-Type: %s\r\n"
                     "User-Agent: %s\r\n\r\n";
   uint16_t headerLen = strlen(headerFmt) + strlen(method) + strlen(path) + strlen(client->host) +
       strlen(client->header) + strlen(client->content_type) + strlen(client->user_agent);
   DBG_REST(" hdrLen=%d", headerLen);
-  if (client->data) os_free(client->data);
-  client->data = (char*)os_zalloc(headerLen + realLen);
-  if (client->data == NULL) goto fail;
-  DBG_REST(" totLen=%d data=%p", headerLen + realLen, client->data);
-  client->data_len = os_sprintf((char*)client->data, headerFmt, method, path, client->host,
+  r->data = (char*)os_zalloc(headerLen + realLen);
+  if (r->data == NULL) goto fail;
+  DBG_REST(" totLen=%d data=%p", headerLen + realLen, r->data);
+  r->data_len = os_sprintf((char*)r->data, headerFmt, method, path, client->host,
       client->header, realLen, client->content_type, client->user_agent);
-  DBG_REST(" hdrLen=%d", client->data_len);
+  DBG_REST(" hdrLen=%d", r->data_len);
 
   if (realLen > 0) {
-    cmdPopArg(&req, client->data + client->data_len, realLen);
-    client->data_len += realLen;
+    cmdPopArg(&req, r->data + r->data_len, realLen);
+    r->data_len += realLen;
   }
-  DBG_REST("\n");
-
-  //DBG_REST("REST request: %s", (char*)client->data);
-
-  //DBG_REST("REST: pCon state=%d\n", client->pCon->state);
-  client->pCon->state = ESPCONN_NONE;
-  espconn_regist_connectcb(client->pCon, tcpclient_connect_cb);
-  espconn_regist_reconcb(client->pCon, tcpclient_recon_cb);
-
-  if(UTILS_StrToIP((char *)client->host, &client->pCon->proto.tcp->remote_ip)) {
-    DBG_REST("REST: Connect to ip %s:%d\n",client->host, client->port);
-    //if(client->security){
-    //  espconn_secure_connect(client->pCon);
-    //}
-    //else {
-      espconn_connect(client->pCon);
-    //}
-  } else {
-    DBG_REST("REST: Connect to host %s:%d\n", client->host, client->port);
-    espconn_gethostbyname(client->pCon, (char *)client->host, &client->ip, rest_dns_found);
+  DBG_REST(" queued=%d\n", client->q_count+1);
+
+  //DBG_REST("REST request: %s", (char*)r->data);
+
+  // the response comes from tcpclient_recv
+  r->seq = cmdDeferResponse();
+  r->no_body = os_strcmp(method, "HEAD") == 0;
+  r->retried = false;
+  if (client->q_count++ == 0) {
+    client->resp_state = REST_STATUS;
+    client->line_len = 0;
+    client->body_off = 0;
+    client->body_len = 0;
   }
 
+  // use the connection kept open after the previous response if there is one, while it's still
+  // being opened the request goes out once it's connected
+  if (client->conn_open) {
+    os_timer_disarm(&client->timer);
+    restSendNext(client);
+  } else if (client->pCon == NULL) {
+    restConnect(client);
+  }
   return;
 
 fail:
   DBG_REST("\n");
 }
+
+void ICACHE_FLASH_ATTR
+REST_FetchAbort(void) {
+  RestClient *client = &restFetchClient;
+  client->fetch_cb = NULL; // nobody gets told
+  restDropConn(client);
+  restFailAll(client);
+}
+
+bool ICACHE_FLASH_ATTR
+REST_Fetch(const char *host, uint16_t port, const char *path, uint32_t offset,
+    RestFetchCb cb, void *arg) {
+  RestClient *client = &restFetchClient;
+  REST_FetchAbort();
+
+  if (!restArena(client)) return false;
+  if (os_strcmp(client->arena->str, host) != 0 &&
+      !restSetString(client, REST_STR_HOST, host, os_strlen(host), false))
+    return false;
+  restStrings(client);
+  client->port = port;
+
+  char *headerFmt = "GET %s HTTP/1.1\r\n"
+                    "Host: %s\r\n"
+                    "%s"
+                    "Connection: keep-alive\r\n"
+                    "User-Agent: esp-link\r\n\r\n";
+  char range[32] = "";
+  if (offset > 0) os_sprintf(range, "Range: bytes=%d-\r\n", offset);
+  RestRequest *r = client->queue + client->q_head;
+  r->data = os_malloc(os_strlen(headerFmt) + os_strlen(path) + os_strlen(host) + os_strlen(range));
+  if (r->data == NULL) return false;
+  r->data_len = os_sprintf(r->data, headerFmt, path, host, range);
+  DBG_REST("REST fetch: %s:%d%s from %d\n", host, port, path, offset);
+
+  client->fetch_cb = cb;
+  client->fetch_arg = arg;
+  client->q_count = 1;
+  client->resp_state = REST_STATUS;
+  client->line_len = 0;
+  client->body_off = 0;
+  client->body_len = 0;
+  restConnect(client);
+  return true;
+}
@@ -14,4 +14,20 @@ void REST_Setup(CmdPacket *cmd);
 void REST_Request(CmdPacket *cmd);
 void REST_SetHeader(CmdPacket *cmd);
 
+// Callback for REST_Fetch with the status code and a piece of the body, offset is where it
+// starts in the body and total is the Content-Length or 0 if there is none. The last callback
+// has last set, one that fails gets a code of 502 and no data. It must not start another fetch.
+typedef void (*RestFetchCb)(void *arg, int16_t code, uint32_t offset, uint32_t total,
+    const char *data, uint16_t len, bool last);
+
+// Fetch http://host:port/path for esp-link itself, the body is streamed to cb as it arrives.
+// A non-zero offset asks for the body from there on using a Range header (the server may
+// ignore it and answer 200 with the whole body). A fetch still going on is dropped. Returns
+// false if out of memory.
+bool REST_Fetch(const char *host, uint16_t port, const char *path, uint32_t offset,
+    RestFetchCb cb, void *arg);
+
+// Drop the fetch going on, if any, the callback isn't called anymore. Not from within it.
+void REST_FetchAbort(void);
+
 #endif /* MODULES_INCLUDE_API_H_ */
@@ -8,31 +8,42 @@
 #include "serled.h"
 #include "config.h"
 #include "console.h"
+#include "httpdjson.h"
 
-// Microcontroller console capturing the last 1024 characters received on the uart so
-// they can be shown on a web page
+// Microcontroller console capturing the last characters received on the uart so they can be
+// shown on a web page. The buffer is allocated on the heap, its size is configurable.
 
-// Buffer to hold concole contents.
+// Buffer to hold concole contents, raw bytes as received.
 // Invariants:
 // - console_rd==console_wr <=> buffer empty
 // - *console_rd == next char to read
 // - *console_wr == next char to write
-// - 0 <= console_xx < BUF_MAX
-// - (console_wr+1)%BUF_MAX) == console_rd <=> buffer full
-#define BUF_MAX (1024)
-static char console_buf[BUF_MAX];
+// - 0 <= console_xx < console_size
+// - (console_wr+1)%console_size) == console_rd <=> buffer full
+static char *console_buf;
+static int console_size;
 static int console_wr, console_rd;
 static int console_pos; // offset since reset of buffer
 
-static void ICACHE_FLASH_ATTR
-console_write(char c) {
-  console_buf[console_wr] = c;
-  console_wr = (console_wr+1) % BUF_MAX;
-  if (console_wr == console_rd) {
-    // full, we write anyway and loose the oldest char
-    console_rd = (console_rd+1) % BUF_MAX; // full, eat first char
-    console_pos++;
+EventSource consoleEvents = { NULL, 0, &console_wr, &console_rd, &console_pos };
+
+// append characters to the buffer, if it's full we write anyway and loose the oldest ones
+void HOT_IRAM_ATTR
+console_write_buf(const char *buf, int len) {
+  if (console_buf == NULL) return;
+  int used = (console_wr+console_size-console_rd) % console_size;
+  int now_used = used+len < console_size-1 ? used+len : console_size-1;
+  console_pos += used + len - now_used;
+  if (len > console_size-1) { // only the tail survives anyway
+    buf += len - (console_size-1);
+    len = console_size-1;
   }
+  int n = console_size - console_wr; // room until the end of the buffer
+  if (n > len) n = len;
+  os_memcpy(console_buf+console_wr, buf, n);
+  os_memcpy(console_buf, buf+n, len-n);
+  console_wr = (console_wr+len) % console_size;
+  console_rd = (console_wr+console_size-now_used) % console_size;
 }
 
 #if 0
@@ -40,14 +51,14 @@ console_write(char c) {
 static char ICACHE_FLASH_ATTR
 console_prev(void) {
   if (console_wr == console_rd) return 0;
-  return console_buf[(console_wr-1+BUF_MAX)%BUF_MAX];
+  return console_buf[(console_wr-1+console_size)%console_size];
 }
 #endif
 
-void ICACHE_FLASH_ATTR
+void HOT_IRAM_ATTR
 console_write_char(char c) {
   //if (c == '\n' && console_prev() != '\r') console_write('\r'); // does more harm than good
-  console_write(c);
+  console_write_buf(&c, 1);
 }
 
 int ICACHE_FLASH_ATTR
@@ -119,6 +130,26 @@ ajaxConsoleFormat(HttpdConnData *connData) {
   return HTTPD_CGI_DONE;
 }
 
+// Serial bridge counters, see serbridgeStatsJson, sent in as many parts as it takes
+int ICACHE_FLASH_ATTR
+ajaxConsoleStats(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+  JsonWriter w;
+  // cgiData: where serbridgeStatsJson continues, cgiPrivData the state of the writer there
+  int pos = (int)connData->cgiData;
+  if (pos == 0) {
+    jsonHeader(connData, 200);
+    jsonBegin(&w, connData, 0);
+  } else {
+    jsonBegin(&w, connData, (uint32_t)connData->cgiPrivData);
+  }
+  serbridgeStatsJson(&w, &pos);
+  uint32_t state = jsonCheckpoint(&w);
+  if (jsonEnd(&w)) return HTTPD_CGI_DONE;
+  connData->cgiData = (void *)pos;
+  connData->cgiPrivData = (void *)state;
+  return HTTPD_CGI_MORE;
+}
 
 int ICACHE_FLASH_ATTR
 ajaxConsoleSend(HttpdConnData *connData) {
@@ -143,7 +174,7 @@ ajaxConsole(HttpdConnData *connData) {
   if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
   char buff[2048];
   int len; // length of text in buff
-  int console_len = (console_wr+BUF_MAX-console_rd) % BUF_MAX; // num chars in console_buf
+  int console_len = console_buf ? (console_wr+console_size-console_rd) % console_size : 0;
   int start = 0; // offset onto console_wr to start sending out chars
 
   jsonHeader(connData, 200);
@@ -165,7 +196,7 @@ ajaxConsole(HttpdConnData *connData) {
   len = os_sprintf(buff, "{\"len\":%d, \"start\":%d, \"text\": \"",
       console_len-start, console_pos+start);
 
-  int rd = (console_rd+start) % BUF_MAX;
+  int rd = console_buf ? (console_rd+start) % console_size : 0;
   while (len < 2040 && rd != console_wr) {
     uint8_t c = console_buf[rd];
     if (c == '\\' || c == '"') {
@@ -178,16 +209,122 @@ ajaxConsole(HttpdConnData *connData) {
     } else {
       buff[len++] = c;
     }
-    rd = (rd + 1) % BUF_MAX;
+    rd = (rd + 1) % console_size;
   }
   os_strcpy(buff+len, "\"}"); len+=2;
   httpdSend(connData, buff, len);
   return HTTPD_CGI_DONE;
 }
 
+// Raw console bytes from the offset passed as "start" arg on, nothing is escaped so binary
+// data comes through as is. The X-Start header has the offset of the first byte sent, which
+// is later than start if some of the text has fallen out of the buffer, the next request
+// should start at X-Start plus the length of the body. At most "max" bytes are sent, by
+// default everything that's in the buffer when the request arrives.
+int ICACHE_FLASH_ATTR
+ajaxConsoleRaw(HttpdConnData *connData) {
+  int *next = connData->cgiData; // next offset to send and offset to stop at
+  if (connData->conn==NULL) {
+    // Connection aborted. Clean up.
+    if (next != NULL) os_free(next);
+    return HTTPD_CGI_DONE;
+  }
+
+  if (next == NULL) {
+    int console_len = console_buf ? (console_wr+console_size-console_rd) % console_size : 0;
+    int end = console_pos + console_len;
+    int start = console_pos;
+    char buff[16];
+    if (httpdFindArg(connData->getArgs, "start", buff, sizeof(buff)) > 0) {
+      start = atoi(buff);
+      if (start < console_pos || start > end) start = console_pos;
+    }
+    if (httpdFindArg(connData->getArgs, "max", buff, sizeof(buff)) > 0) {
+      int max = atoi(buff);
+      if (max >= 0 && start + max < end) end = start + max;
+    }
+    next = os_malloc(2*sizeof(int));
+    if (next == NULL) {
+      errorResponse(connData, 500, "Out of memory");
+      return HTTPD_CGI_DONE;
+    }
+    next[0] = start;
+    next[1] = end;
+    connData->cgiData = next;
+
+    os_sprintf(buff, "%d", start);
+    httpdStartResponse(connData, 200);
+    httpdHeader(connData, "Content-Type", "application/octet-stream");
+    httpdHeader(connData, "Cache-Control", "no-cache");
+    httpdHeader(connData, "X-Start", buff);
+    httpdHeader(connData, "Access-Control-Expose-Headers", "X-Start");
+    httpdEndHeaders(connData);
+  }
+
+  // stop short if what's left to send has been overwritten in the meantime
+  if (next[0] < console_pos) next[1] = next[0];
+
+  int avail;
+  char *out = httpdSendBuf(connData, &avail);
+  int len = next[1] - next[0];
+  if (len > avail) len = avail;
+  int rd = console_buf ? (console_rd + next[0] - console_pos) % console_size : 0;
+  int n = console_size - rd; // contiguous up to the end of the buffer
+  if (n > len) n = len;
+  os_memcpy(out, console_buf+rd, n);
+  os_memcpy(out+n, console_buf, len-n);
+  httpdSendCommit(connData, len);
+  next[0] += len;
+
+  if (next[0] < next[1]) return HTTPD_CGI_MORE;
+  os_free(next);
+  connData->cgiData = NULL;
+  return HTTPD_CGI_DONE;
+}
+
+// Allocate the buffer, console_size bytes from the config, with less if the heap is short
+static void ICACHE_FLASH_ATTR
+consoleAlloc(void) {
+  if (console_buf != NULL) os_free(console_buf);
+  int size = flashConfig.console_size ? flashConfig.console_size : CONSOLE_SIZE;
+  if (size > CONSOLE_SIZE_MAX) size = CONSOLE_SIZE_MAX;
+  if (size < CONSOLE_SIZE_MIN) size = CONSOLE_SIZE_MIN;
+  while (size > CONSOLE_SIZE && system_get_free_heap_size() < size + CONSOLE_HEAP_RESERVE)
+    size /= 2;
+  console_buf = os_malloc(size);
+  console_size = console_buf ? size : 0;
+  console_rd = console_wr = console_pos = 0;
+  consoleEvents.buf = console_buf;
+  consoleEvents.size = console_size;
+  if (console_buf == NULL) os_printf("Console: cannot allocate %d bytes\n", size);
+}
+
+// Get or set the size of the console buffer, changing it clears the console
+int ICACHE_FLASH_ATTR
+ajaxConsoleSize(HttpdConnData *connData) {
+  if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+  char buff[64];
+  int len, status = 400;
+  len = httpdFindArg(connData->getArgs, "size", buff, sizeof(buff));
+  if (connData->requestType == HTTPD_METHOD_POST) {
+    int size = len > 0 ? atoi(buff) : -1;
+    if (size >= 0 && size <= CONSOLE_SIZE_MAX) {
+      flashConfig.console_size = size;
+      consoleAlloc();
+      status = configSave() ? 200 : 400;
+    }
+  } else if (connData->requestType == HTTPD_METHOD_GET && len <= 0) {
+    status = 200; // GET only reports the size, resizing takes a POST
+  }
+
+  jsonHeader(connData, status);
+  os_sprintf(buff, "{\"size\": %d, \"max\": %d}", console_size, CONSOLE_SIZE_MAX);
+  httpdSend(connData, buff, -1);
+  return HTTPD_CGI_DONE;
+}
+
 void ICACHE_FLASH_ATTR consoleInit() {
-  console_wr = 0;
-  console_rd = 0;
+  consoleAlloc();
 }
 
 
@@ -2,15 +2,27 @@
 #define CONSOLE_H
 
 #include "httpd.h"
+#include "cgievents.h"
+
+#define CONSOLE_SIZE         1024  // default size of the console buffer
+#define CONSOLE_SIZE_MIN     256
+#define CONSOLE_SIZE_MAX     16384
+#define CONSOLE_HEAP_RESERVE 16384 // heap the console buffer leaves to everything else
+
+extern EventSource consoleEvents; // stream of the console text for cgiEvents
 
 void consoleInit(void);
-void ICACHE_FLASH_ATTR console_write_char(char c);
+void HOT_IRAM_ATTR console_write_char(char c);
+void console_write_buf(const char *buf, int len);
 int ajaxConsole(HttpdConnData *connData);
 int ajaxConsoleReset(HttpdConnData *connData);
 int ajaxConsoleClear(HttpdConnData *connData);
 int ajaxConsoleBaud(HttpdConnData *connData);
 int ajaxConsoleFormat(HttpdConnData *connData);
 int ajaxConsoleSend(HttpdConnData *connData);
+int ajaxConsoleStats(HttpdConnData *connData);
+int ajaxConsoleRaw(HttpdConnData *connData);
+int ajaxConsoleSize(HttpdConnData *connData);
 int tplConsole(HttpdConnData *connData, char *token, void **arg);
 
 #endif
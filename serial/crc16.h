@@ -67,11 +67,6 @@ extern "C" {
  *             with one byte. It can be used as a running checksum, or
  *             to checksum an entire data block.
  *
- *             \note The algorithm used in this implementation is
- *             tailored for a running checksum and does not perform as
- *             well as a table-driven algorithm when checksumming an
- *             entire data block.
- *
  */
 unsigned short crc16_add(unsigned char b, unsigned short crc);
 
@@ -83,14 +78,23 @@ unsigned short crc16_add(unsigned char b, unsigned short crc);
  * \return     The CRC16 checksum.
  *
  *             This function calculates the CRC16 checksum of a data area.
- *
- *             \note The algorithm used in this implementation is
- *             tailored for a running checksum and does not perform as
- *             well as a table-driven algorithm when checksumming an
- *             entire data block.
  */
 unsigned short crc16_data(const unsigned char *data, int datalen,
 			  unsigned short acc);
+
+/**
+ * \brief      SLIP-escape a data area while adding it to a CRC16 checksum
+ * \param dst  Where to put the escaped data, must hold 2*datalen bytes
+ * \param src  Pointer to the data
+ * \param datalen The length of the data
+ * \param acc  The accumulated CRC, updated with the unescaped data
+ * \return     The number of bytes written to dst
+ *
+ *             This function does in one pass what crc16_data plus SLIP
+ *             escaping of SLIP_END and SLIP_ESC would do in two.
+ */
+int crc16_slip(unsigned char *dst, const unsigned char *src, int datalen,
+               unsigned short *acc);
 #ifdef	__cplusplus
 }
 #endif
@@ -9,11 +9,19 @@
 #include "config.h"
 #include "console.h"
 #include "slip.h"
+#include "cmd.h"
+#include "metrics.h"
+#include "httpdjson.h"
+#include "prof.h"
+#include "perf.h"
 #ifdef SYSLOG
 #include "syslog.h"
 #else
 #define syslog(X1...)
 #endif
+#ifdef MQTT
+#include "mqtt_client.h"
+#endif
 
 static struct espconn serbridgeConn1; // plain bridging port
 static struct espconn serbridgeConn2; // programming port
@@ -27,7 +35,8 @@ void (*programmingCB)(char *buffer, short length) = NULL;
 static sint8 espbuffsend(serbridgeConnData *conn, const char *data, uint16 len);
 
 // Connection pool
-serbridgeConnData connData[MAX_CONN];
+serbridgeConnData connData[SERBR_NCONN];
+static uint32_t uart_tx_bytes; // total bytes written to the UART by the bridge
 
 //===== TCP -> UART
 
@@ -45,6 +54,13 @@ serbridgeConnData connData[MAX_CONN];
 #define SetControl   5  // Set control lines
 #define PurgeData   12  // Flush FIFO buffer(s)
 #define PURGE_TX     2
+#define FLOW_REQ     0  // request current flow control setting
+#define FLOW_NONE    1  // no flow control
+#define FLOW_XONXOFF 2  // XON/XOFF flow control (not supported)
+#define FLOW_HW      3  // RTS/CTS hardware flow control
+#define FLOWIN_REQ  13  // request current inbound flow control setting
+#define FLOWIN_NONE 14
+#define FLOWIN_HW   16
 #define BRK_REQ      4  // request current BREAK state
 #define BRK_ON       5  // set BREAK (TX-line to LOW)
 #define BRK_OFF      6  // reset BREAK
@@ -61,12 +77,20 @@ static uint32_t tn_baud; // shared across all sockets, thus possible race condit
 static uint8_t tn_break = 0;  // 0=BREAK-OFF, 1=BREAK-ON
 
 // process a buffer-full on a telnet connection
-static void ICACHE_FLASH_ATTR
+static void HOT_IRAM_ATTR
 telnetUnwrap(serbridgeConnData *conn, uint8_t *inBuf, int len)
 {
   uint8_t state = conn->telnet_state;
 
   for (int i=0; i<len; i++) {
+    // fast path: hand the whole run of regular chars up to the next IAC to the uart at once
+    if (state == TN_normal && inBuf[i] != IAC) {
+      uint8_t *iac = memchr(inBuf+i, IAC, len-i);
+      int run = (iac != NULL ? iac - inBuf : len) - i;
+      uart0_tx_buffer((char *)inBuf+i, run);
+      i += run - 1;
+      continue;
+    }
     uint8_t c = inBuf[i];
     switch (state) {
     default:
@@ -170,6 +194,28 @@ telnetUnwrap(serbridgeConnData *conn, uint8_t *inBuf, int len)
         }
         if (in_mcu_flashing > 0) in_mcu_flashing--;
         break;
+      case FLOW_REQ:
+      case FLOWIN_REQ: {
+        char respBuf[7] = { IAC, SB, ComPortOpt, SetControl, FLOW_NONE, IAC, SE };
+        if (uart0_flow_control_enabled()) respBuf[4] = c == FLOW_REQ ? FLOW_HW : FLOWIN_HW;
+        else if (c == FLOWIN_REQ) respBuf[4] = FLOWIN_NONE;
+        espbuffsend(conn, respBuf, 7);
+        break; }
+      case FLOW_NONE:
+      case FLOWIN_NONE:
+        uart0_flow_control(false);
+#ifdef SERBR_DBG
+        os_printf("Telnet: flow control off\n");
+#endif
+        break;
+      case FLOW_HW:
+      case FLOWIN_HW:
+        // only possible if the RTS/CTS pins have been assigned in the pin configuration
+        if (flashConfig.flow_control) uart0_flow_control(true);
+#ifdef SERBR_DBG
+        os_printf("Telnet: flow control %s\n", flashConfig.flow_control ? "on" : "no pins");
+#endif
+        break;
       case BRK_REQ: {
         char respBuf[7] = { IAC, SB, ComPortOpt, SetControl, tn_break, IAC, SE };
         espbuffsend(conn, respBuf, 7);
@@ -178,7 +224,7 @@ telnetUnwrap(serbridgeConnData *conn, uint8_t *inBuf, int len)
 #endif
         break; }
       case BRK_ON:
-	if (((READ_PERI_REG(UART_STATUS(UART0))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT) == 0) {  // TX-FIFO of UART0 must be empty
+	if (uart0_tx_pending() == 0) {  // TX ring and TX-FIFO of UART0 must be empty
           PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0TXD_U, FUNC_GPIO1);
           GPIO_OUTPUT_SET(1, 0);
           tn_break = 1;
@@ -274,6 +320,108 @@ serbridgeReset()
 #endif
 }
 
+// TCP -> UART backpressure: when the UART TX ring doesn't have room for another full TCP
+// segment we stop the stack from delivering more data on the connection using
+// espconn_recv_hold. A timer polls the TX ring and releases all held connections once it
+// has drained, so TCP flow control pushes back all the way to the sender.
+static ETSTimer serbridgeUnholdTimer;
+static bool unholdTimerArmed;
+
+static void ICACHE_FLASH_ATTR
+serbridgeUnholdTimerCb(void *arg)
+{
+  unholdTimerArmed = false;
+  if (uart0_tx_space() < SERBR_RX_HOLD) {
+    // not drained enough yet, check again later
+    os_timer_arm(&serbridgeUnholdTimer, SERBR_RX_HOLD_MS, 0);
+    unholdTimerArmed = true;
+    return;
+  }
+  for (int i=0; i<MAX_CONN; i++) {
+    if (connData[i].conn && connData[i].rx_held) {
+      espconn_recv_unhold(connData[i].conn);
+      connData[i].rx_held = false;
+    }
+  }
+}
+
+static void ICACHE_FLASH_ATTR
+serbridgeCheckHold(serbridgeConnData *conn)
+{
+  if (conn->rx_held || uart0_tx_space() >= SERBR_RX_HOLD) return;
+  espconn_recv_hold(conn->conn);
+  conn->rx_held = true;
+  if (!unholdTimerArmed) {
+    os_timer_disarm(&serbridgeUnholdTimer);
+    os_timer_setfn(&serbridgeUnholdTimer, serbridgeUnholdTimerCb, NULL);
+    os_timer_arm(&serbridgeUnholdTimer, SERBR_RX_HOLD_MS, 0);
+    unholdTimerArmed = true;
+  }
+}
+
+//===== Channels
+
+// With channels on, see cmd.h, connections on the primary port are carried over the command
+// link as channel 1..MAX_CONN, i.e. connection slot+1, from the time they're accepted until
+// they turn out to be telnet or programming connections, or go away. Channels only get what
+// the MCU sends them, they're kept off the broadcast of the UART data.
+static bool serbr_channels;
+
+static void serbridgeBroadcastAttach(serbridgeConnData *conn);
+static void serbridgeBroadcastDetach(serbridgeConnData *conn);
+
+static void ICACHE_FLASH_ATTR
+serbridgeChannelOpen(serbridgeConnData *conn)
+{
+  conn->chan_open = true;
+  cmdChannelSend(SLIP_CHAN_OPEN | (conn-connData+1), NULL, 0);
+}
+
+static void ICACHE_FLASH_ATTR
+serbridgeChannelClose(serbridgeConnData *conn)
+{
+  conn->chan_open = false;
+  cmdChannelSend(SLIP_CHAN_CLOSE | (conn-connData+1), NULL, 0);
+}
+
+void ICACHE_FLASH_ATTR
+serbridgeSetChannels(bool on)
+{
+  serbr_channels = on;
+  slip_set_channels(on);
+  // (re)announce the connections that are open, the MCU may just have reset
+  for (short i=0; i<MAX_CONN; i++) {
+    serbridgeConnData *conn = connData+i;
+    bool chan = on && conn->conn != NULL &&
+        (conn->conn_mode == cmInit || conn->conn_mode == cmTransparent);
+    if (chan && !conn->chan_open) serbridgeBroadcastDetach(conn);
+    if (!chan && conn->chan_open) serbridgeBroadcastAttach(conn);
+    conn->chan_open = false;
+    if (chan) serbridgeChannelOpen(conn);
+  }
+}
+
+// Data for a channel goes straight into its send buffer, channel 0 means all of them
+void HOT_IRAM_ATTR
+serbridgeChannelRecv(uint8_t ctl, char *data, short len)
+{
+  uint8_t ch = SLIP_CHAN_NUM(ctl);
+  for (short i=0; i<MAX_CONN; i++) {
+    serbridgeConnData *conn = connData+i;
+    if (!conn->chan_open || (ch != 0 && ch != i+1)) continue;
+    switch (SLIP_CHAN_TYPE(ctl)) {
+    case SLIP_CHAN_DATA:
+      espbuffsend(conn, data, len);
+      break;
+    case SLIP_CHAN_CLOSE:
+      conn->chan_open = false;
+      espconn_disconnect(conn->conn);
+      break;
+    }
+  }
+  serledFlash(50); // short blink on serial LED
+}
+
 // Receive callback
 static void ICACHE_FLASH_ATTR
 serbridgeRecvCb(void *arg, char *data, unsigned short len)
@@ -281,6 +429,7 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
   serbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   //os_printf("Receive callback on conn %p\n", conn);
   if (conn == NULL) return;
+  PROF_BEGIN(PROF_SERBR_RECV); // not counting the programming reset below
 
   bool startPGM = false;
 
@@ -336,6 +485,10 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
     //os_delay_us(100L);
     //if (mcu_isp_pin >= 0) GPIO_OUTPUT_SET(mcu_isp_pin, 1);
     os_delay_us(1000L); // wait a millisecond before writing to the UART below
+    if (conn->chan_open) {
+      serbridgeChannelClose(conn);
+      serbridgeBroadcastAttach(conn);
+    }
     conn->conn_mode = cmPGM;
     in_mcu_flashing++; // disable SLIP so it doesn't interfere with flashing
     serledFlash(50); // short blink on serial LED
@@ -343,55 +496,273 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
   }
 
 
+  // telnet connections aren't channels
+  if (conn->chan_open && conn->conn_mode != cmTransparent) {
+    serbridgeChannelClose(conn);
+    serbridgeBroadcastAttach(conn);
+  }
+
   // write the buffer to the uart
-  if (conn->conn_mode == cmTelnet) {
+  conn->stats.bytes_in += len;
+  METRIC_ADD(M_SERBR_BYTES_IN, len);
+  uart_tx_bytes += len;
+  if (conn->chan_open) {
+    cmdChannelSend(SLIP_CHAN_DATA | (conn-connData+1), data, len);
+  } else if (conn->conn_mode == cmTelnet) {
+    PROF_BEGIN(PROF_TELNET);
     telnetUnwrap(conn, (uint8_t *)data, len);
+    PROF_END(PROF_TELNET);
   } else {
     uart0_tx_buffer(data, len);
   }
+  serbridgeCheckHold(conn);
 
   serledFlash(50); // short blink on serial LED
+  PROF_END(PROF_SERBR_RECV);
 }
 
 //===== UART -> TCP
 
-// Send all data in conn->txbuffer
+// Pool of TX buffers allocated once, when the first one is needed, so steady-state bridging
+// doesn't churn the heap with ~3KB allocations while a device nobody connects to doesn't pay
+// for it. The buffers are not zeroed since they're only ever read up to
+// their fill length. If the pool runs dry (many connections) we fall back to the heap.
+static serbridgeBuf *txpool;     // SERBR_TXPOOL buffers
+static uint8_t txpool_free;      // bitmask of free buffers in the pool
+
+// Get a buffer with a single reference
+static serbridgeBuf * ICACHE_FLASH_ATTR
+txbufAlloc(void)
+{
+  serbridgeBuf *buf = NULL;
+  if (txpool == NULL) {
+    txpool = os_malloc(SERBR_TXPOOL*sizeof(serbridgeBuf));
+    txpool_free = txpool != NULL ? (1<<SERBR_TXPOOL)-1 : 0;
+  }
+  for (int i=0; i<SERBR_TXPOOL; i++) {
+    if (txpool_free & (1<<i)) {
+      txpool_free &= ~(1<<i);
+      buf = txpool + i;
+      break;
+    }
+  }
+  if (buf == NULL) buf = os_malloc(sizeof(serbridgeBuf));
+  if (buf == NULL) return NULL;
+  buf->next = NULL;
+  buf->len = 0;
+  buf->refs = 1;
+  return buf;
+}
+
+// Drop a reference to a buffer and return it to the pool (or heap) once nobody holds it
+static void ICACHE_FLASH_ATTR
+txbufRelease(serbridgeBuf *buf)
+{
+  if (buf == NULL || --buf->refs > 0) return;
+  if (txpool != NULL && buf >= txpool && buf < txpool + SERBR_TXPOOL) {
+    txpool_free |= 1 << (buf - txpool);
+  } else {
+    os_free(buf);
+  }
+}
+
+// Broadcast: data from the UART is stored once in a chain of shared buffers, newest at
+// bchead. Each connection holds a reference to the buffer it's sending from (bcbuf) plus an
+// offset of the next byte to send (bcoff), and a reference to the buffer in flight until the
+// sent callback fires. The chain holds one reference to bchead. A connection that lags more
+// than SERBR_BCLAG buffers behind the head skips ahead and is treated as overflowing.
+static serbridgeBuf *bchead;
+
+// Number of bytes waiting to be sent on a connection
+static uint16_t ICACHE_FLASH_ATTR
+serbridgePending(serbridgeConnData *conn)
+{
+  uint16_t pending = conn->txbufferlen;
+  if (conn->bcbuf != NULL) {
+    pending += conn->bcbuf->len - conn->bcoff;
+    if (conn->bcbuf->next != NULL) pending += MAX_TXBUFFER; // more than we care to count
+  }
+  return pending;
+}
+
+// Account for the time a connection spent overflowing once it makes progress again
+static void ICACHE_FLASH_ATTR
+serbridgeOverflowEnd(serbridgeConnData *conn)
+{
+  if (conn->txoverflow_at == 0) return;
+  conn->stats.overflow_ms += (system_get_time() - conn->txoverflow_at) / 1000;
+  conn->txoverflow_at = 0;
+}
+
+// Count a send, successful or not
+static void ICACHE_FLASH_ATTR
+serbridgeCountSend(serbridgeConnData *conn, sint8 result, uint16_t len)
+{
+  if (result == ESPCONN_OK) {
+    conn->stats.bytes_out += len;
+    conn->stats.segments++;
+    METRIC_ADD(M_SERBR_BYTES_OUT, len);
+    metricObserve(M_SERBR_SEGMENT, len);
+  } else {
+    conn->stats.send_errors++;
+    METRIC_INC(M_SERBR_SEND_ERRORS);
+  }
+}
+
+// Coalescing: with flashConfig.bridge_flush_bytes set, UART data accumulates in the buffers
+// until that many bytes are there or until the flush timer fires bridge_flush_ms after data
+// first got held back. A single timer is shared by all connections, when it fires it sends
+// whatever is pending on all of them, which at worst sends some data a bit early.
+static ETSTimer serbridgeFlushTimer;
+static bool flushTimerArmed;
+
+static sint8 sendtxbuffer(serbridgeConnData *conn);
+static sint8 senddatagrams(serbridgeConnData *conn);
+
+static void ICACHE_FLASH_ATTR
+serbridgeFlushTimerCb(void *arg)
+{
+  flushTimerArmed = false;
+  for (int i=0; i<SERBR_NCONN; i++) {
+    if (connData[i].conn && connData[i].readytosend) sendtxbuffer(&connData[i]);
+  }
+}
+
+// Return whether the pending data should be sent now, else ensure the flush timer runs
+static bool ICACHE_FLASH_ATTR
+serbridgeFlushNow(serbridgeConnData *conn)
+{
+  uint16_t threshold = flashConfig.bridge_flush_bytes;
+  uint16_t pending = serbridgePending(conn);
+  if (pending > conn->stats.peak_fill) conn->stats.peak_fill = pending;
+  if (threshold == 0 || pending >= threshold || conn->txbufferlen >= MAX_TXBUFFER)
+    return true;
+  if (pending > 0 && !flushTimerArmed) {
+    uint16_t ms = flashConfig.bridge_flush_ms ? flashConfig.bridge_flush_ms : SERBR_FLUSH_MS_DEFAULT;
+    os_timer_disarm(&serbridgeFlushTimer);
+    os_timer_setfn(&serbridgeFlushTimer, serbridgeFlushTimerCb, NULL);
+    os_timer_arm(&serbridgeFlushTimer, ms, 0);
+    flushTimerArmed = true;
+  }
+  return false;
+}
+
+// UDP bridge: send all pending broadcast data as datagrams, UDP sends are not acknowledged
+// so there's nothing to hold on to and we remain ready to send
+static sint8 ICACHE_FLASH_ATTR
+senddatagrams(serbridgeConnData *conn)
+{
+  sint8 result = ESPCONN_OK;
+  serbridgeBuf *buf;
+  while ((buf = conn->bcbuf) != NULL) {
+    while (conn->bcoff < buf->len) {
+      uint16_t len = buf->len - conn->bcoff;
+      if (len > SERBR_UDP_MAX) len = SERBR_UDP_MAX;
+      result = espconn_sent(conn->conn, (uint8_t*)buf->data + conn->bcoff, len);
+      serbridgeCountSend(conn, result, len);
+      conn->bcoff += len;
+      if (result != ESPCONN_OK) {
+        os_printf("senddatagrams: espconn_sent error %d\n", result);
+        conn->bcoff = buf->len; // drop it
+      }
+    }
+    if (buf->next == NULL) break;
+    conn->bcbuf = buf->next;
+    conn->bcbuf->refs++;
+    conn->bcoff = 0;
+    txbufRelease(buf);
+  }
+  serbridgeOverflowEnd(conn);
+  return result;
+}
+
+// Send the next chunk of pending data: first anything in conn->txbuffer, which holds
+// responses specific to this connection, then the next span of broadcast data.
 // returns result from espconn_sent if data in buffer or ESPCONN_OK (0)
-// Use only internally from espbuffsend and serbridgeSentCb
+// Use only internally from espbuffsend, the broadcast and serbridgeSentCb
 static sint8 ICACHE_FLASH_ATTR
 sendtxbuffer(serbridgeConnData *conn)
 {
   sint8 result = ESPCONN_OK;
+  if (conn->conn->type == ESPCONN_UDP) return senddatagrams(conn);
   if (conn->txbufferlen != 0) {
     //os_printf("TX %p %d\n", conn, conn->txbufferlen);
     conn->readytosend = false;
-    result = espconn_sent(conn->conn, (uint8_t*)conn->txbuffer, conn->txbufferlen);
+    result = espconn_sent(conn->conn, (uint8_t*)conn->txbuffer->data, conn->txbufferlen);
+    serbridgeCountSend(conn, result, conn->txbufferlen);
     conn->txbufferlen = 0;
     if (result != ESPCONN_OK) {
       os_printf("sendtxbuffer: espconn_sent error %d on conn %p\n", result, conn);
-      conn->txbufferlen = 0;
       if (!conn->txoverflow_at) conn->txoverflow_at = system_get_time();
     } else {
       conn->sentbuffer = conn->txbuffer;
       conn->txbuffer = NULL;
-      conn->txbufferlen = 0;
     }
+    return result;
+  }
+
+  serbridgeBuf *buf = conn->bcbuf;
+  if (buf == NULL) return result;
+  if (conn->bcoff == buf->len && buf->next != NULL) {
+    // done with this buffer, move on to the next one in the chain
+    conn->bcbuf = buf->next;
+    conn->bcbuf->refs++;
+    conn->bcoff = 0;
+    txbufRelease(buf);
+    buf = conn->bcbuf;
+  }
+  if (conn->bcoff == buf->len) return result;
+
+  conn->readytosend = false;
+  uint16_t len = buf->len - conn->bcoff;
+  result = espconn_sent(conn->conn, (uint8_t*)buf->data + conn->bcoff, len);
+  serbridgeCountSend(conn, result, len);
+  conn->bcoff = buf->len;
+  if (result != ESPCONN_OK) {
+    os_printf("sendtxbuffer: espconn_sent error %d on conn %p\n", result, conn);
+    if (!conn->txoverflow_at) conn->txoverflow_at = system_get_time();
+  } else {
+    buf->refs++; // held until the sent callback
+    conn->sentbuffer = buf;
   }
   return result;
 }
 
-// espbuffsend adds data to the send buffer. If the previous send was completed it calls
-// sendtxbuffer and espconn_sent.
+// Note that a connection is overflowing and kill it if it has been stuck for too long
+static void ICACHE_FLASH_ATTR
+serbridgeOverflow(serbridgeConnData *conn)
+{
+  if (conn->txoverflow_at) {
+    // we've already been overflowing
+    if (system_get_time() - conn->txoverflow_at > 10*1000*1000) {
+      // no progress in 10 seconds, kill the connection
+      os_printf("serbridge: killing overlowing stuck conn %p\n", conn);
+      if (conn->conn->type == ESPCONN_TCP) espconn_disconnect(conn->conn);
+    }
+    // else be silent, we already printed an error
+  } else {
+    // print 1-time message and take timestamp
+    os_printf("serbridge: txbuffer full, conn %p\n", conn);
+    conn->txoverflow_at = system_get_time();
+  }
+}
+
+// espbuffsend adds data to the send buffer of one connection. If the previous send was
+// completed it calls sendtxbuffer and espconn_sent.
 // Returns ESPCONN_OK (0) for success, -128 if buffer is full or error from  espconn_sent
 // Use espbuffsend instead of espconn_sent as it solves the problem that espconn_sent must
 // only be called *after* receiving an espconn_sent_callback for the previous packet.
-static sint8 ICACHE_FLASH_ATTR
-espbuffsend(serbridgeConnData *conn, const char *data, uint16 len)
+static sint8 HOT_IRAM_ATTR
+espbuffsendBuf(serbridgeConnData *conn, const char *data, uint16 len)
 {
-  if (conn->txbufferlen >= MAX_TXBUFFER) goto overflow;
+  if (conn->txbufferlen >= MAX_TXBUFFER) {
+    conn->stats.drops += len;
+    METRIC_ADD(M_SERBR_DROPS, len);
+    goto overflow;
+  }
 
   // make sure we indeed have a buffer
-  if (conn->txbuffer == NULL) conn->txbuffer = os_zalloc(MAX_TXBUFFER);
+  if (conn->txbuffer == NULL) conn->txbuffer = txbufAlloc();
   if (conn->txbuffer == NULL) {
     os_printf("espbuffsend: cannot alloc tx buffer\n");
     return -128;
@@ -399,38 +770,131 @@ espbuffsend(serbridgeConnData *conn, const char *data, uint16 len)
 
   // add to send buffer
   uint16_t avail = conn->txbufferlen+len > MAX_TXBUFFER ? MAX_TXBUFFER-conn->txbufferlen : len;
-  os_memcpy(conn->txbuffer + conn->txbufferlen, data, avail);
+  os_memcpy(conn->txbuffer->data + conn->txbufferlen, data, avail);
   conn->txbufferlen += avail;
 
   // try to send
   sint8 result = ESPCONN_OK;
-  if (conn->readytosend) result = sendtxbuffer(conn);
+  if (conn->readytosend && serbridgeFlushNow(conn)) result = sendtxbuffer(conn);
 
   if (avail < len) {
     // some data didn't fit into the buffer
     if (conn->txbufferlen == 0) {
       // we sent the prior buffer, so try again
-      return espbuffsend(conn, data+avail, len-avail);
+      return espbuffsendBuf(conn, data+avail, len-avail);
     }
+    conn->stats.drops += len-avail;
+    METRIC_ADD(M_SERBR_DROPS, len-avail);
     goto overflow;
   }
   return result;
 
 overflow:
-  if (conn->txoverflow_at) {
-    // we've already been overflowing
-    if (system_get_time() - conn->txoverflow_at > 10*1000*1000) {
-      // no progress in 10 seconds, kill the connection
-      os_printf("serbridge: killing overlowing stuck conn %p\n", conn);
-      espconn_disconnect(conn->conn);
+  serbridgeOverflow(conn);
+  return -128;
+}
+
+// The profiled entry point of espbuffsendBuf
+static sint8 HOT_IRAM_ATTR
+espbuffsend(serbridgeConnData *conn, const char *data, uint16 len)
+{
+  PROF_BEGIN(PROF_BUFFSEND);
+  sint8 result = espbuffsendBuf(conn, data, len);
+  PROF_END(PROF_BUFFSEND);
+  return result;
+}
+
+// Start a new broadcast buffer at the head of the chain, returns false if out of memory
+static bool ICACHE_FLASH_ATTR
+serbridgeBroadcastExtend(void)
+{
+  serbridgeBuf *nb = txbufAlloc();
+  if (nb == NULL) return false;
+  serbridgeBuf *old = bchead;
+  if (old != NULL) old->next = nb;
+  bchead = nb; // the chain's reference moves from old to nb
+
+  for (short i=0; i<SERBR_NCONN; i++) {
+    serbridgeConnData *conn = connData+i;
+    if (!conn->conn || conn->chan_open) continue;
+    int lag = 0;
+    for (serbridgeBuf *b = conn->bcbuf; b != NULL && b != nb; b = b->next) lag++;
+    if (conn->bcbuf == NULL || lag >= SERBR_BCLAG) {
+      // connection is new, or lags too far behind: it continues with the new buffer
+      if (conn->bcbuf != NULL) {
+        // count what it won't get to send
+        uint16_t off = conn->bcoff;
+        for (serbridgeBuf *b = conn->bcbuf; b != NULL && b != nb; b = b->next, off = 0) {
+          conn->stats.drops += b->len - off;
+          METRIC_ADD(M_SERBR_DROPS, b->len - off);
+        }
+        serbridgeOverflow(conn);
+      }
+      txbufRelease(conn->bcbuf);
+      conn->bcbuf = nb;
+      conn->bcoff = 0;
+      nb->refs++;
     }
-    // else be silent, we already printed an error
-  } else {
-    // print 1-time message and take timestamp
-    os_printf("serbridge: txbuffer full, conn %p\n", conn);
-    conn->txoverflow_at = system_get_time();
   }
-  return -128;
+  txbufRelease(old);
+  return true;
+}
+
+// Have a connection continue with the data that gets broadcast from now on
+static void ICACHE_FLASH_ATTR
+serbridgeBroadcastAttach(serbridgeConnData *conn)
+{
+  if (conn->bcbuf != NULL || bchead == NULL) return;
+  conn->bcbuf = bchead;
+  conn->bcoff = bchead->len;
+  bchead->refs++;
+}
+
+// Take a connection off the broadcast, dropping what it hasn't sent yet
+static void ICACHE_FLASH_ATTR
+serbridgeBroadcastDetach(serbridgeConnData *conn)
+{
+  txbufRelease(conn->bcbuf);
+  conn->bcbuf = NULL;
+  conn->bcoff = 0;
+}
+
+// Send a buffer-full of UART data to all connections, except channels, the data is copied
+// only once into shared buffers
+static void ICACHE_FLASH_ATTR
+serbridgeBroadcast(char *data, short len)
+{
+  // attach connections that have just opened to the current head
+  bool any = false;
+  for (short i=0; i<SERBR_NCONN; i++) {
+    serbridgeConnData *conn = connData+i;
+    if (!conn->conn || conn->chan_open) continue;
+    any = true;
+    serbridgeBroadcastAttach(conn);
+  }
+  if (!any) return;
+
+  while (len > 0) {
+    if (bchead == NULL || bchead->len == MAX_TXBUFFER) {
+      if (!serbridgeBroadcastExtend()) {
+        os_printf("serbridge: cannot alloc broadcast buffer\n");
+        return;
+      }
+    }
+    uint16_t avail = MAX_TXBUFFER - bchead->len;
+    if (avail > len) avail = len;
+    os_memcpy(bchead->data + bchead->len, data, avail);
+    bchead->len += avail;
+    data += avail;
+    len -= avail;
+  }
+
+  // kick off sending on each connection that is idle
+  for (short i=0; i<SERBR_NCONN; i++) {
+    serbridgeConnData *conn = connData+i;
+    if (conn->conn && !conn->chan_open && conn->readytosend && serbridgeFlushNow(conn))
+      sendtxbuffer(conn);
+  }
 }
 
 //callback after the data are sent
@@ -441,33 +905,33 @@ serbridgeSentCb(void *arg)
   //os_printf("Sent CB %p\n", conn);
   if (conn == NULL) return;
   //os_printf("%d ST\n", system_get_time());
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
+  txbufRelease(conn->sentbuffer);
   conn->sentbuffer = NULL;
   conn->readytosend = true;
-  conn->txoverflow_at = 0;
-  sendtxbuffer(conn); // send possible new data in txbuffer
+  serbridgeOverflowEnd(conn);
+  if (serbridgeFlushNow(conn)) sendtxbuffer(conn); // send possible new data
 }
 
 void ICACHE_FLASH_ATTR
 console_process(char *buf, short len)
 {
   // push buffer into web-console
-  for (short i=0; i<len; i++)
-    console_write_char(buf[i]);
+  console_write_buf(buf, len);
   // push the buffer into each open connection
-  for (short i=0; i<MAX_CONN; i++) {
-    if (connData[i].conn) {
-      espbuffsend(&connData[i], buf, len);
-    }
-  }
+  serbridgeBroadcast(buf, len);
 }
 
 // callback with a buffer of characters that have arrived on the uart
-void ICACHE_FLASH_ATTR
+void HOT_IRAM_ATTR
 serbridgeUartCb(char *buf, short length)
 {
+  PROF_BEGIN(PROF_SERBR_UART);
   if (programmingCB) {
     programmingCB(buf, length);
+#ifdef MQTT
+  } else if (in_mcu_flashing == 0 && mqttUartBridge(buf, length)) {
+    console_process(buf, length); // the records show on the console page as well
+#endif
   } else if (!flashConfig.slip_enable || in_mcu_flashing > 0) {
     //os_printf("SLIP: disabled got %d\n", length);
     console_process(buf, length);
@@ -476,6 +940,79 @@ serbridgeUartCb(char *buf, short length)
   }
 
   serledFlash(50); // short blink on serial LED
+  PROF_END(PROF_SERBR_UART);
+}
+
+//===== UDP bridge
+
+static struct espconn serbridgeUdpConn;
+static esp_udp serbridgeUdp;
+
+// Start sending UART data to the UDP peer
+static void ICACHE_FLASH_ATTR
+serbridgeUdpActivate(void)
+{
+  serbridgeConnData *conn = connData+SERBR_UDP;
+  if (conn->conn != NULL) return;
+  os_memset(conn, 0, sizeof(serbridgeConnData));
+  conn->conn = &serbridgeUdpConn;
+  conn->conn_mode = cmTransparent;
+  conn->readytosend = true;
+  serbridgeUdpConn.reverse = conn;
+}
+
+// Receive callback: datagrams go straight to the uart
+static void ICACHE_FLASH_ATTR
+serbridgeUdpRecvCb(void *arg, char *data, unsigned short len)
+{
+  struct espconn *pconn = arg;
+  if (flashConfig.bridge_udp_peer_ip == 0) {
+    // no fixed peer: reply to whoever sent us the last datagram
+    remot_info *ri = NULL;
+    if (espconn_get_connection_info(pconn, &ri, 0) == ESPCONN_OK && ri != NULL) {
+      os_memcpy(serbridgeUdp.remote_ip, ri->remote_ip, 4);
+      serbridgeUdp.remote_port = ri->remote_port;
+      serbridgeUdpActivate();
+    }
+  }
+  connData[SERBR_UDP].stats.bytes_in += len;
+  METRIC_ADD(M_SERBR_BYTES_IN, len);
+  uart_tx_bytes += len;
+  uart0_tx_buffer(data, len);
+  serledFlash(50); // short blink on serial LED
+}
+
+void ICACHE_FLASH_ATTR
+serbridgeUdpInit(void)
+{
+  // tear down what we may have had before
+  serbridgeConnData *conn = connData+SERBR_UDP;
+  if (conn->conn != NULL) {
+    txbufRelease(conn->bcbuf);
+    os_memset(conn, 0, sizeof(serbridgeConnData));
+  }
+  if (serbridgeUdpConn.type == ESPCONN_UDP) espconn_delete(&serbridgeUdpConn);
+  os_memset(&serbridgeUdpConn, 0, sizeof(serbridgeUdpConn));
+  os_memset(&serbridgeUdp, 0, sizeof(serbridgeUdp));
+
+  if (flashConfig.bridge_udp_port == 0) return;
+  serbridgeUdpConn.type = ESPCONN_UDP;
+  serbridgeUdpConn.state = ESPCONN_NONE;
+  serbridgeUdpConn.proto.udp = &serbridgeUdp;
+  serbridgeUdp.local_port = flashConfig.bridge_udp_port;
+  if (flashConfig.bridge_udp_peer_ip != 0) {
+    os_memcpy(serbridgeUdp.remote_ip, &flashConfig.bridge_udp_peer_ip, 4);
+    serbridgeUdp.remote_port = flashConfig.bridge_udp_peer_port ?
+      flashConfig.bridge_udp_peer_port : flashConfig.bridge_udp_port;
+    serbridgeUdpActivate();
+  }
+  espconn_regist_recvcb(&serbridgeUdpConn, serbridgeUdpRecvCb);
+  if (espconn_create(&serbridgeUdpConn) != ESPCONN_OK)
+    os_printf("serbridge: cannot create UDP port %d\n", flashConfig.bridge_udp_port);
+#ifdef SERBR_DBG
+  else
+    os_printf("serbridge: UDP bridge on port %d\n", flashConfig.bridge_udp_port);
+#endif
 }
 
 //===== Connect / disconnect
@@ -487,11 +1024,13 @@ serbridgeDisconCb(void *arg)
   serbridgeConnData *conn = ((struct espconn*)arg)->reverse;
   if (conn == NULL) return;
   // Free buffers
-  if (conn->sentbuffer != NULL) os_free(conn->sentbuffer);
+  txbufRelease(conn->sentbuffer);
   conn->sentbuffer = NULL;
-  if (conn->txbuffer != NULL) os_free(conn->txbuffer);
+  txbufRelease(conn->txbuffer);
   conn->txbuffer = NULL;
   conn->txbufferlen = 0;
+  txbufRelease(conn->bcbuf);
+  conn->bcbuf = NULL;
   // Send reset to attached uC if it was in programming mode
   if (conn->conn_mode == cmPGM && mcu_reset_pin >= 0) {
     if (mcu_isp_pin >= 0) GPIO_OUTPUT_SET(mcu_isp_pin, 1);
@@ -500,6 +1039,8 @@ serbridgeDisconCb(void *arg)
     os_delay_us(100L);
     GPIO_DIS_OUTPUT(mcu_reset_pin);
   }
+  if (conn->chan_open) serbridgeChannelClose(conn);
+  if (conn->conn != NULL) METRIC_GAUGE_ADD(M_SERBR_CLIENTS, -1);
   conn->conn = NULL;
 }
 
@@ -535,6 +1076,8 @@ serbridgeConnectCb(void *arg)
 
   os_memset(connData+i, 0, sizeof(struct serbridgeConnData));
   connData[i].conn = conn;
+  METRIC_INC(M_SERBR_CONNECTS);
+  METRIC_GAUGE_ADD(M_SERBR_CLIENTS, 1);
   conn->reverse = connData+i;
   connData[i].readytosend = true;
   connData[i].conn_mode = cmInit;
@@ -546,8 +1089,84 @@ serbridgeConnectCb(void *arg)
   espconn_regist_disconcb(conn, serbridgeDisconCb);
   espconn_regist_reconcb(conn, serbridgeResetCb);
   espconn_regist_sentcb(conn, serbridgeSentCb);
+  if (serbr_channels && connData[i].conn_mode == cmInit) serbridgeChannelOpen(connData+i);
 
-  espconn_set_opt(conn, ESPCONN_REUSEADDR|ESPCONN_NODELAY);
+  perfTcpSetup(conn, TCP_SVC_BRIDGE);
+}
+
+//===== Statistics
+
+static const char *connModeNames[] = { "init", "pgminit", "transparent", "pgm", "telnet" };
+
+bool ICACHE_FLASH_ATTR
+serbridgeStatsJson(JsonWriter *w, int *pos)
+{
+  if (*pos == 0) {
+    UartRxStats rx;
+    uart0_rx_stats(&rx);
+    jsonObject(w, NULL);
+    jsonObject(w, "uart");
+    jsonUInt(w, "rx_bytes", rx.rx_bytes);
+    jsonUInt(w, "rx_overruns", rx.overruns);
+    jsonUInt(w, "rx_fifo_overflows", rx.fifo_overflows);
+    jsonInt(w, "rx_peak", rx.high_water);
+    jsonUInt(w, "tx_bytes", uart_tx_bytes);
+    jsonInt(w, "tx_pending", uart0_tx_pending());
+    jsonClose(w);
+    jsonArray(w, "conns");
+    *pos = 1;
+  }
+  jsonCheckpoint(w);
+
+  uint32_t now = system_get_time();
+  for (; *pos-1 < SERBR_NCONN; (*pos)++) {
+    int i = *pos-1;
+    serbridgeConnData *conn = connData+i;
+    if (conn->conn == NULL) continue;
+    serbridgeStats *st = &conn->stats;
+    uint8_t *ip; int port;
+    if (conn->conn->type == ESPCONN_UDP) {
+      ip = conn->conn->proto.udp->remote_ip;
+      port = conn->conn->proto.udp->remote_port;
+    } else {
+      ip = conn->conn->proto.tcp->remote_ip;
+      port = conn->conn->proto.tcp->remote_port;
+    }
+    uint32_t ovf_ms = st->overflow_ms;
+    if (conn->txoverflow_at) ovf_ms += (now - conn->txoverflow_at) / 1000;
+    char remote[24];
+    os_sprintf(remote, "%d.%d.%d.%d:%d", ip[0], ip[1], ip[2], ip[3], port);
+    jsonObject(w, NULL);
+    jsonInt(w, "slot", i);
+    jsonString(w, "proto", conn->conn->type == ESPCONN_UDP ? "udp" : "tcp");
+    jsonString(w, "mode", connModeNames[conn->conn_mode]);
+    jsonString(w, "remote", remote);
+    jsonUInt(w, "bytes_in", st->bytes_in);
+    jsonUInt(w, "bytes_out", st->bytes_out);
+    jsonUInt(w, "segments", st->segments);
+    jsonUInt(w, "send_errors", st->send_errors);
+    jsonUInt(w, "drops", st->drops);
+    jsonUInt(w, "overflow_ms", ovf_ms);
+    jsonInt(w, "peak_fill", st->peak_fill);
+    jsonClose(w);
+    if (w->full) return false;
+    jsonCheckpoint(w);
+  }
+  jsonClose(w);
+  jsonClose(w);
+  return !w->full;
+}
+
+void ICACHE_FLASH_ATTR
+serbridgeGetTotals(serbridgeTotals *t)
+{
+  UartRxStats rx;
+  uart0_rx_stats(&rx);
+  t->rx_bytes = rx.rx_bytes;
+  t->tx_bytes = uart_tx_bytes;
+  t->drops = 0;
+  for (int i=0; i<SERBR_NCONN; i++)
+    if (connData[i].conn != NULL) t->drops += connData[i].stats.drops;
 }
 
 //===== Initialization
@@ -578,6 +1197,21 @@ serbridgeInitPins()
     system_uart_de_swap();
   }
 
+  // RTS/CTS flow control: normally U0CTS is on gpio13 and U0RTS on gpio15, when the uart is
+  // swapped those pins carry RX/TX and the swap routes CTS/RTS to gpio3/gpio1 instead
+  if (flashConfig.flow_control) {
+    if (flashConfig.swap_uart) {
+      PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0TXD_U, 0); // RTS
+      PIN_FUNC_SELECT(PERIPHS_IO_MUX_U0RXD_U, 0); // CTS
+      PIN_PULLUP_EN(PERIPHS_IO_MUX_U0RXD_U);   // CTS floating high means "hold off"
+    } else {
+      PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTCK_U, FUNC_U0CTS);
+      PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDO_U, FUNC_U0RTS);
+      PIN_PULLUP_EN(PERIPHS_IO_MUX_MTCK_U);
+    }
+  }
+  uart0_flow_control(flashConfig.flow_control);
+
   // set both pins to 1 before turning them on so we don't cause a reset
   if (mcu_isp_pin >= 0)   GPIO_OUTPUT_SET(mcu_isp_pin, 1);
   if (mcu_reset_pin >= 0) GPIO_DIS_OUTPUT(mcu_reset_pin);
@@ -593,6 +1227,7 @@ serbridgeInit(int port1, int port2)
   serbridgeInitPins();
 
   os_memset(connData, 0, sizeof(connData));
+  if (txpool != NULL) txpool_free = (1<<SERBR_TXPOOL)-1;
   os_memset(&serbridgeTcp1, 0, sizeof(serbridgeTcp1));
   os_memset(&serbridgeTcp2, 0, sizeof(serbridgeTcp2));
 
@@ -617,6 +1252,8 @@ serbridgeInit(int port1, int port2)
   espconn_accept(&serbridgeConn2);
   espconn_tcp_set_max_con_allow(&serbridgeConn2, MAX_CONN);
   espconn_regist_time(&serbridgeConn2, SER_BRIDGE_TIMEOUT, 0);
+
+  serbridgeUdpInit();
 }
 
 int  ICACHE_FLASH_ATTR serbridgeInMCUFlashing()
@@ -6,10 +6,55 @@
 #include <espconn.h>
 
 #define MAX_CONN 4
+// The UDP bridge uses an extra connection slot after the TCP ones
+#define SERBR_UDP   MAX_CONN
+#define SERBR_NCONN (MAX_CONN+1)
+// Max payload sent in one UDP datagram
+#define SERBR_UDP_MAX 1472
 #define SER_BRIDGE_TIMEOUT 300 // 300 seconds = 5 minutes
 
 // Send buffer size
 #define MAX_TXBUFFER (2*1460)
+// Max time UART data is held back when coalescing and no bridge_flush_ms is configured
+#define SERBR_FLUSH_MS_DEFAULT 20
+// Hold off TCP receive while the UART TX ring has less space than this (one TCP segment) and
+// check every few ms whether it has drained
+#define SERBR_RX_HOLD    1460
+#define SERBR_RX_HOLD_MS 5
+// Number of send buffers in the pool allocated with the first one, enough for two connections
+// to double-buffer
+#define SERBR_TXPOOL 4
+// Max number of shared broadcast buffers a connection may lag behind before it drops data
+#define SERBR_BCLAG 2
+
+// Send buffer, shared by reference count when broadcasting UART data to all connections
+typedef struct serbridgeBuf {
+  struct serbridgeBuf *next;    // next newer buffer in the broadcast chain
+  uint16_t       len;           // length of data in the buffer
+  uint8_t        refs;          // number of holders of this buffer
+  char           data[MAX_TXBUFFER];
+} serbridgeBuf;
+
+// Counters kept for each connection, they're reset when a connection slot gets reused
+typedef struct {
+  uint32_t bytes_in;            // bytes received from the network (written to the UART)
+  uint32_t bytes_out;           // bytes handed to espconn_sent
+  uint32_t segments;            // successful espconn_sent calls
+  uint32_t send_errors;         // failed espconn_sent calls
+  uint32_t drops;               // UART bytes dropped because the connection fell behind
+  uint32_t overflow_ms;         // total time spent overflowing, excluding the current spell
+  uint16_t peak_fill;           // max bytes pending for this connection
+} serbridgeStats;
+
+// Totals over the UART and the open connections, for compact status reporting
+typedef struct {
+  uint32_t rx_bytes;            // bytes received on the UART
+  uint32_t tx_bytes;            // bytes written to the UART
+  uint32_t drops;               // UART bytes dropped by the open connections
+} serbridgeTotals;
+
+// Max length of the output of serbridgeStatsJson
+#define SERBR_STATS_JSON_MAX 2048
 
 enum connModes {
   cmInit = 0,        // initialization mode: nothing received yet
@@ -24,17 +69,35 @@ typedef struct serbridgeConnData {
 	enum connModes conn_mode;     // connection mode
   uint8_t        telnet_state;
 	uint16         txbufferlen;   // length of data in txbuffer
-	char           *txbuffer;     // buffer for the data to send
-  char           *sentbuffer;   // buffer sent, awaiting callback to get freed
+	serbridgeBuf   *txbuffer;     // buffer for data to send on this connection only
+  serbridgeBuf   *sentbuffer;   // buffer sent, awaiting callback to get released
+  serbridgeBuf   *bcbuf;        // broadcast buffer we're sending from
+  uint16_t       bcoff;         // offset of next byte to send in bcbuf
   uint32_t       txoverflow_at; // when the transmitter started to overflow
 	bool           readytosend;   // true, if txbuffer can be sent by espconn_sent
+  bool           rx_held;       // TCP receive held due to UART TX backpressure
+  bool           chan_open;     // carried over the command link as a channel, see cmd.h
+  serbridgeStats stats;
 } serbridgeConnData;
 
 // port1 is transparent&programming, second port is programming only
 void ICACHE_FLASH_ATTR serbridgeInit(int port1, int port2);
 void ICACHE_FLASH_ATTR serbridgeInitPins(void);
-void ICACHE_FLASH_ATTR serbridgeUartCb(char *buf, short len);
+// (re)start the UDP bridge according to the flash config
+void ICACHE_FLASH_ATTR serbridgeUdpInit(void);
+void HOT_IRAM_ATTR serbridgeUartCb(char *buf, short len);
 void ICACHE_FLASH_ATTR serbridgeReset();
+// Write the UART and per-connection counters as a JSON object. *pos is 0 to start with, if
+// the writer runs out of room the output is cut after the last complete connection and *pos
+// tells where to continue, with a writer resumed from jsonCheckpoint. Returns true once it's
+// all written.
+struct JsonWriter;
+bool ICACHE_FLASH_ATTR serbridgeStatsJson(struct JsonWriter *w, int *pos);
+void ICACHE_FLASH_ATTR serbridgeGetTotals(serbridgeTotals *t);
+// Turn carrying the TCP connections as channels over the command link on or off, see cmd.h
+void ICACHE_FLASH_ATTR serbridgeSetChannels(bool on);
+// Handle a channel frame, or part of the data of one, that came in from the MCU
+void HOT_IRAM_ATTR serbridgeChannelRecv(uint8_t ctl, char *data, short len);
 
 int  ICACHE_FLASH_ATTR serbridgeInMCUFlashing();
 
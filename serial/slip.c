@@ -6,6 +6,7 @@
 #include "serbridge.h"
 #include "console.h"
 #include "cmd.h"
+#include "prof.h"
 
 #ifdef SLIP_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
@@ -32,29 +33,97 @@ static bool slip_inpkt;         // true when we're after SLIP_START and before S
 static char slip_buf[SLIP_MAX]; // buffer for current SLIP packet
 static short slip_len;          // accumulated length in slip_buf
 
+// COBS framing, see cmd.h: each raw byte is XOR-ed with SLIP_END and then decoded. A block
+// implies a zero after it unless its code is 0xff, that zero is only added when another block
+// follows since the last block of a frame has none. The start of each raw frame is kept so
+// that a SLIP frame, i.e. a CMD_SYNC from an MCU that reset, can be recognized too.
+static bool slip_cobs;          // COBS framing is on
+static bool slip_frame_cobs;    // framing of the packet being processed
+static uint8_t slip_cobs_left;  // bytes left in the current block, 0 when a code byte is next
+static bool slip_cobs_zero;     // the current block is followed by a zero
+#define SLIP_RAW_MAX 48         // fits any CMD_SYNC, even escaped
+static char slip_raw[SLIP_RAW_MAX];
+static short slip_raw_len;
+
+void ICACHE_FLASH_ATTR
+slip_set_cobs(bool cobs) {
+  slip_cobs = cobs;
+}
+
+bool ICACHE_FLASH_ATTR
+slip_is_cobs_frame(void) {
+  return slip_frame_cobs;
+}
+
+// Channel frames, see cmd.h: once the SLIP_CHAN and control bytes are in, the data is not
+// accumulated but passed on to serbridgeChannelRecv each time the buffer fills up and at the
+// end of the frame, with no CRC to check.
+static bool slip_channels;      // channel frames are recognized
+static bool slip_chan;          // true when the current packet is a channel frame
+static uint8_t slip_chan_ctl;   // type and channel of the current packet
+
+void ICACHE_FLASH_ATTR
+slip_set_channels(bool on) {
+  slip_channels = on;
+}
+
+// Pass the accumulated channel data on, frames other than data are only passed on at the end
+static void ICACHE_FLASH_ATTR
+slip_chan_flush(bool end) {
+  bool data = SLIP_CHAN_TYPE(slip_chan_ctl) == SLIP_CHAN_DATA;
+  if ((data && slip_len > 0) || (!data && end))
+    serbridgeChannelRecv(slip_chan_ctl, slip_buf, slip_len);
+  slip_len = 0;
+}
+
+// Check the CRC of a packet and invoke the command processor, returns false if the CRC is bad
+static bool ICACHE_FLASH_ATTR
+slip_exec(bool cobs) {
+  uint16_t crc = crc16_data((uint8_t*)slip_buf, slip_len-2, 0);
+  uint16_t rcv = ((uint16_t)slip_buf[slip_len-2]) | ((uint16_t)slip_buf[slip_len-1] << 8);
+  if (crc != rcv) return false;
+  slip_frame_cobs = cobs;
+  PROF_BEGIN(PROF_CMD_PARSE);
+  cmdParsePacket((uint8_t*)slip_buf, slip_len-2);
+  PROF_END(PROF_CMD_PARSE);
+  return true;
+}
+
+// Decode the start of a frame that failed as COBS as a SLIP frame and process it
+static bool ICACHE_FLASH_ATTR
+slip_retry_raw() {
+  if (slip_raw_len >= SLIP_RAW_MAX) return false; // may have been longer
+  slip_len = 0;
+  for (short i=0; i<slip_raw_len; i++) {
+    char c = slip_raw[i];
+    if (c == SLIP_ESC && i+1 < slip_raw_len) {
+      c = slip_raw[++i];
+      if (c == SLIP_ESC_END) c = SLIP_END;
+      if (c == SLIP_ESC_ESC) c = SLIP_ESC;
+    }
+    slip_buf[slip_len++] = c;
+  }
+  return slip_len > 2 && slip_exec(false);
+}
+
 // SLIP process a packet or a bunch of debug console chars
 static void ICACHE_FLASH_ATTR
 slip_process() {
-  if (slip_len > 2) {
-    // proper SLIP packet, invoke command processor after checking CRC
-    //os_printf("SLIP: rcv %d\n", slip_len);
-    uint16_t crc = crc16_data((uint8_t*)slip_buf, slip_len-2, 0);
-    uint16_t rcv = ((uint16_t)slip_buf[slip_len-2]) | ((uint16_t)slip_buf[slip_len-1] << 8);
-    if (crc == rcv) {
-      cmdParsePacket((uint8_t*)slip_buf, slip_len-2);
+  // proper packet, invoke command processor after checking CRC
+  //os_printf("SLIP: rcv %d\n", slip_len);
+  bool complete = slip_len > 2 && !(slip_cobs && slip_cobs_left > 0);
+  if (complete && slip_exec(slip_cobs)) return;
+  if (slip_cobs && slip_retry_raw()) return;
+  os_printf("SLIP: bad%s frame, len=%d\n", slip_cobs ? " COBS" : "", slip_len);
+
+  for (short i=0; i<slip_len; i++) {
+    if (slip_buf[i] >= ' ' && slip_buf[i] <= '~') {
+      DBG("%c", slip_buf[i]);
     } else {
-      os_printf("SLIP: bad CRC, crc=%04x rcv=%04x len=%d\n", crc, rcv, slip_len);
-
-      for (short i=0; i<slip_len; i++) {
-        if (slip_buf[i] >= ' ' && slip_buf[i] <= '~') {
-          DBG("%c", slip_buf[i]);
-        } else {
-          DBG("\\%02X", slip_buf[i]);
-        }
-      }
-      DBG("\n");
+      DBG("\\%02X", slip_buf[i]);
     }
   }
+  DBG("\n");
 }
 
 // determine whether a character is printable or not (or \r \n)
@@ -69,24 +138,110 @@ slip_reset() {
   slip_inpkt = true;
   slip_escaped = false;
   slip_len = 0;
+  slip_cobs_left = 0;
+  slip_cobs_zero = false;
+  slip_raw_len = 0;
+  slip_chan = false;
+}
+
+// Packets of commands that have a stream handler are not accumulated in slip_buf, once the
+// header is in the remainder is passed on to cmdStreamData each time the buffer fills up.
+// The CRC is then checked on the fly: running it over the data plus the appended CRC has to
+// come out as zero. The last two bytes are always held back since they may be the CRC.
+static bool slip_stream;        // true when streaming the current packet
+static uint16_t slip_crc;       // running CRC when streaming
+
+static void ICACHE_FLASH_ATTR
+slip_stream_flush() {
+  if (slip_len <= 2) return;
+  cmdStreamData((uint8_t*)slip_buf, slip_len-2);
+  slip_buf[0] = slip_buf[slip_len-2];
+  slip_buf[1] = slip_buf[slip_len-1];
+  slip_len = 2;
 }
 
-// SLIP parse a single character
 static void ICACHE_FLASH_ATTR
+slip_stream_end() {
+  slip_stream_flush();
+  cmdStreamEnd(slip_len == 2 && slip_crc == 0 && slip_cobs_left == 0);
+  slip_stream = false;
+}
+
+// Add a character to the current packet
+static void HOT_IRAM_ATTR
+slip_add_char(char c) {
+  if (slip_chan) {
+    if (slip_len == SLIP_MAX) slip_chan_flush(false);
+    if (slip_len < SLIP_MAX) slip_buf[slip_len++] = c;
+    return;
+  }
+  if (slip_stream) {
+    slip_crc = crc16_add(c, slip_crc);
+    if (slip_len == SLIP_MAX) slip_stream_flush();
+    slip_buf[slip_len++] = c;
+    return;
+  }
+  if (slip_len < SLIP_MAX) slip_buf[slip_len++] = c;
+  if (slip_len == 2 && slip_inpkt && slip_channels && slip_buf[0] == (char)SLIP_CHAN) {
+    slip_chan_ctl = slip_buf[1];
+    slip_chan = true;
+    slip_len = 0;
+    return;
+  }
+  if (slip_len == sizeof(CmdPacket) && slip_inpkt && cmdStreamStart((CmdPacket*)slip_buf)) {
+    slip_crc = crc16_data((uint8_t*)slip_buf, slip_len, 0);
+    slip_stream = true;
+    slip_len = 0;
+  }
+}
+
+// COBS-decode a character of a packet
+static void HOT_IRAM_ATTR
+slip_cobs_char(char c) {
+  if (slip_raw_len < SLIP_RAW_MAX) slip_raw[slip_raw_len++] = c;
+  if (slip_raw_len == 2 && slip_printable(slip_raw[0]) && slip_printable(c)) {
+    // console text, see below, the command byte after the code byte is never printable
+    slip_inpkt = false;
+    slip_len = 0;
+    slip_add_char(slip_raw[0]);
+    slip_add_char(c);
+    return;
+  }
+  uint8_t b = (uint8_t)c ^ SLIP_END;
+  if (slip_cobs_left > 0) {
+    slip_add_char(b);
+    slip_cobs_left--;
+    return;
+  }
+  // code byte
+  if (slip_cobs_zero) slip_add_char(0);
+  slip_cobs_zero = b != 0xff;
+  slip_cobs_left = b - 1;
+}
+
+// SLIP parse a single character
+static void HOT_IRAM_ATTR
 slip_parse_char(char c) {
   if (c == SLIP_END) {
     // either start or end of packet, process whatever we may have accumulated
     DBG("SLIP: start or end len=%d inpkt=%d\n", slip_len, slip_inpkt);
-    if (slip_len > 0) {
-      if (slip_len > 2 && slip_inpkt) slip_process();
-      else console_process(slip_buf, slip_len);
+    if (slip_chan) {
+      slip_chan_flush(true);
+    } else if (slip_stream) {
+      slip_stream_end();
+    } else if (slip_inpkt && (slip_len > 2 || slip_raw_len > 2)) {
+      slip_process();
+    } else if (slip_len > 0) {
+      console_process(slip_buf, slip_len);
     }
     slip_reset();
+  } else if (slip_cobs && slip_inpkt) {
+    slip_cobs_char(c);
   } else if (slip_escaped) {
     // prev char was SLIP_ESC
     if (c == SLIP_ESC_END) c = SLIP_END;
     if (c == SLIP_ESC_ESC) c = SLIP_ESC;
-    if (slip_len < SLIP_MAX) slip_buf[slip_len++] = c;
+    slip_add_char(c);
     slip_escaped = false;
   } else if (slip_inpkt && c == SLIP_ESC) {
     slip_escaped = true;
@@ -95,12 +250,12 @@ slip_parse_char(char c) {
       // start of packet and it's a printable character, we're gonna assume that this is console text
       slip_inpkt = false;
     }
-    if (slip_len < SLIP_MAX) slip_buf[slip_len++] = c;
+    slip_add_char(c);
   }
 }
 
 // callback with a buffer of characters that have arrived on the uart
-void ICACHE_FLASH_ATTR
+void HOT_IRAM_ATTR
 slip_parse_buf(char *buf, short length) {
   // do SLIP parsing
   for (short i=0; i<length; i++)
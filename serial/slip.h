@@ -3,4 +3,12 @@
 
 void slip_parse_buf(char *buf, short length);
 
+// Switch the framing of the packets that follow to COBS or back to SLIP, see cmd.h
+void slip_set_cobs(bool cobs);
+// Whether the packet being processed came in COBS framing
+bool slip_is_cobs_frame(void);
+
+// Turn recognition of channel frames on or off, see cmd.h
+void slip_set_channels(bool on);
+
 #endif
@@ -20,6 +20,8 @@
 #include "esp8266.h"
 #include "task.h"
 #include "uart.h"
+#include "metrics.h"
+#include "prof.h"
 
 #ifdef UART_DBG
 #define DBG_UART(format, ...) os_printf(format, ## __VA_ARGS__)
@@ -36,6 +38,48 @@ static UartRecv_cb uart_recv_cb[4];
 
 static void uart0_rx_intr_handler(void *para);
 
+// UART0 transmit ring buffer: characters are queued here by the uart0_* write functions and
+// the TXFIFO_EMPTY interrupt moves them into the hardware FIFO. The producer side (head) is
+// only updated from task context, the consumer side (tail) from the interrupt handler or with
+// the uart interrupt disabled. One slot is kept free to distinguish full from empty.
+#define UART_TX_RING_SZ   2048 // must be a power of 2
+#define UART_TX_FIFO_FILL 120  // don't fill the 128-char hardware fifo beyond this
+#define UART_TX_FIFO_LOW  16   // TXFIFO_EMPTY interrupt fires when fifo drops below this
+static char tx_ring[UART_TX_RING_SZ];
+static volatile uint16_t tx_head; // next slot to be written
+static volatile uint16_t tx_tail; // next slot to be transmitted
+
+#define TX_RING_USED() ((uint16_t)(tx_head - tx_tail) & (UART_TX_RING_SZ-1))
+#define TX_RING_FREE() (UART_TX_RING_SZ - 1 - TX_RING_USED())
+#define UART_TXFIFO_LEN(uart) ((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)
+#define UART_RXFIFO_LEN(uart) ((READ_PERI_REG(UART_STATUS(uart))>>UART_RXFIFO_CNT_S)&UART_RXFIFO_CNT)
+
+// UART0 receive ring buffer: the interrupt handler empties the hardware fifo into this ring
+// and the receive task hands contiguous spans of it to the callbacks. The handler only
+// updates rx_head, the task (or uart0_rx_poll) only updates rx_tail.
+#define UART_RX_RING_SZ 4096 // must be a power of 2
+static char rx_ring[UART_RX_RING_SZ];
+static volatile uint16_t rx_head; // next slot to be filled by the interrupt handler
+static volatile uint16_t rx_tail; // next slot to be consumed
+static volatile bool rx_task_posted;
+static bool rx_flow;              // RTS/CTS hardware flow control enabled
+static volatile bool rx_throttled; // RX left in the hardware fifo because the ring is full
+static UartRxStats rx_stats;
+
+#define RX_RING_USED() ((uint16_t)(rx_head - rx_tail) & (UART_RX_RING_SZ-1))
+
+// UART1 transmit ring buffer for the debug log, it works like the UART0 one except that
+// writers never wait: what doesn't fit is dropped and a marker is put into the output once
+// there is room again. The TXFIFO_EMPTY interrupt of UART1 shares the vector with UART0.
+#define UART1_TX_RING_SZ 1024 // must be a power of 2
+static char tx1_ring[UART1_TX_RING_SZ];
+static volatile uint16_t tx1_head; // next slot to be written
+static volatile uint16_t tx1_tail; // next slot to be transmitted
+static uint32_t tx1_dropped;       // characters dropped since the last marker
+
+#define TX1_RING_USED() ((uint16_t)(tx1_head - tx1_tail) & (UART1_TX_RING_SZ-1))
+#define TX1_RING_FREE() (UART1_TX_RING_SZ - 1 - TX1_RING_USED())
+
 /******************************************************************************
  * FunctionName : uart_config
  * Description  : Internal used function
@@ -73,9 +117,9 @@ uart_config(uint8 uart_no, UartBautRate baudrate, uint32 conf0)
     // Configure RX interrupt conditions as follows: trigger rx-full when there are 80 characters
     // in the buffer, trigger rx-timeout when the fifo is non-empty and nothing further has been
     // received for 4 character periods.
-    // Set the hardware flow-control to trigger when the FIFO holds 100 characters, although
-    // we don't really expect the signals to actually be wired up to anything. It doesn't hurt
-    // to set the threshold here...
+    // Set the hardware flow-control to trigger when the FIFO holds 100 characters. This only
+    // has an effect if RTS is routed to a pin (see uart0_flow_control), normally the
+    // interrupt handler keeps the FIFO from getting anywhere near this level.
     // We do not enable framing error interrupts 'cause they tend to cause an interrupt avalanche
     // and instead just poll for them when we get a std RX interrupt.
     WRITE_PERI_REG(UART_CONF1(uart_no),
@@ -83,11 +127,13 @@ uart_config(uint8 uart_no, UartBautRate baudrate, uint32 conf0)
                    ((100 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
                    UART_RX_FLOW_EN |
                    (4 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
-                   UART_RX_TOUT_EN);
+                   UART_RX_TOUT_EN |
+                   ((UART_TX_FIFO_LOW & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S));
     SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
   } else {
     WRITE_PERI_REG(UART_CONF1(uart_no),
-                   ((UartDev.rcv_buff.TrigLvl & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S));
+                   ((UartDev.rcv_buff.TrigLvl & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S) |
+                   ((UART_TX_FIFO_LOW & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S));
   }
 
   //clear all interrupt
@@ -96,56 +142,232 @@ uart_config(uint8 uart_no, UartBautRate baudrate, uint32 conf0)
 
 
 /******************************************************************************
- * FunctionName : uart1_tx_one_char
+ * FunctionName : uart0_tx_fill_fifo
+ * Description  : Internal used function
+ *                Move characters from the TX ring buffer into the UART0 hardware fifo and
+ *                turn the TXFIFO_EMPTY interrupt off once the ring is empty. Must be called
+ *                from the interrupt handler or with the uart interrupt disabled.
+ * Parameters   : NONE
+ * Returns      : NONE
+*******************************************************************************/
+static void // must not use ICACHE_FLASH_ATTR, called from the interrupt handler
+uart0_tx_fill_fifo(void)
+{
+  uint16_t tail = tx_tail;
+  uint16_t fifo = UART_TXFIFO_LEN(UART0);
+  while (tail != tx_head && fifo < UART_TX_FIFO_FILL) {
+    WRITE_PERI_REG(UART_FIFO(UART0), tx_ring[tail]);
+    tail = (tail+1) & (UART_TX_RING_SZ-1);
+    fifo++;
+  }
+  tx_tail = tail;
+  if (tail == tx_head)
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+// Same as uart0_tx_fill_fifo for UART1
+static void // must not use ICACHE_FLASH_ATTR, called from the interrupt handler
+uart1_tx_fill_fifo(void)
+{
+  uint16_t tail = tx1_tail;
+  uint16_t fifo = UART_TXFIFO_LEN(UART1);
+  while (tail != tx1_head && fifo < UART_TX_FIFO_FILL) {
+    WRITE_PERI_REG(UART_FIFO(UART1), tx1_ring[tail]);
+    tail = (tail+1) & (UART1_TX_RING_SZ-1);
+    fifo++;
+  }
+  tx1_tail = tail;
+  if (tail == tx1_head)
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(UART1), UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+// Copy len characters into the UART1 TX ring, the caller must have checked that there is space
+static void ICACHE_FLASH_ATTR
+uart1_tx_ring_put(const char *buf, uint16_t len)
+{
+  uint16_t head = tx1_head;
+  uint16_t n = UART1_TX_RING_SZ - head; // room until the end of the ring
+  if (n > len) n = len;
+  os_memcpy(tx1_ring+head, buf, n);
+  if (len > n) os_memcpy(tx1_ring, buf+n, len-n);
+  ETS_UART_INTR_DISABLE();
+  tx1_head = (head+len) & (UART1_TX_RING_SZ-1);
+  SET_PERI_REG_MASK(UART_INT_ENA(UART1), UART_TXFIFO_EMPTY_INT_ENA);
+  ETS_UART_INTR_ENABLE();
+}
+
+// Copy len characters into the TX ring, the caller must have checked that there is space
+static void ICACHE_FLASH_ATTR
+uart0_tx_ring_put(const char *buf, uint16_t len)
+{
+  uint16_t head = tx_head;
+  uint16_t n = UART_TX_RING_SZ - head; // room until the end of the ring
+  if (n > len) n = len;
+  os_memcpy(tx_ring+head, buf, n);
+  if (len > n) os_memcpy(tx_ring, buf+n, len-n);
+  ETS_UART_INTR_DISABLE();
+  tx_head = (head+len) & (UART_TX_RING_SZ-1);
+  SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_TXFIFO_EMPTY_INT_ENA);
+  ETS_UART_INTR_ENABLE();
+}
+
+// Wait for some space to open up in the TX ring. This pushes characters into the fifo by
+// polling so it makes progress even if interrupts are off. With flow control a transmitter
+// that CTS holds off for UART_TX_STALL_US drops what's queued, CTS is probably not wired up
+// and spinning would end in a watchdog reset.
+#define UART_TX_STALL_US 500000
+static void ICACHE_FLASH_ATTR
+uart0_tx_wait(void)
+{
+  static uint32_t stall_at;       // when the transmitter stopped making progress, 0 if it didn't
+  static uint16_t stall_pending;  // characters pending at the previous wait
+  uint16_t dropped = 0;
+  ETS_UART_INTR_DISABLE();
+  uart0_tx_fill_fifo();
+  uint16_t pending = TX_RING_USED() + UART_TXFIFO_LEN(UART0);
+  if (!rx_flow || pending != stall_pending) {
+    stall_at = 0;
+  } else if (stall_at == 0) {
+    stall_at = system_get_time();
+  } else if (system_get_time() - stall_at > UART_TX_STALL_US) {
+    dropped = pending;
+    tx_tail = tx_head;
+    SET_PERI_REG_MASK(UART_CONF0(UART0), UART_TXFIFO_RST);
+    CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_TXFIFO_RST);
+    stall_at = 0;
+    pending = 0;
+  }
+  stall_pending = pending;
+  ETS_UART_INTR_ENABLE();
+  if (dropped > 0) os_printf("UART: TX held off by CTS, dropped %d chars\n", dropped);
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_enqueue
+ * Description  : Queue a buffer for transmission on UART0 without blocking. Either the
+ *                whole buffer is queued or nothing is.
+ * Parameters   : const char *buf - characters to send
+ *                uint16 len - number of characters
+ * Returns      : space left in the TX ring after queueing, or -1 if buf didn't fit
+*******************************************************************************/
+int16_t ICACHE_FLASH_ATTR
+uart0_tx_enqueue(const char *buf, uint16 len)
+{
+  if (len > TX_RING_FREE()) return -1;
+  if (len > 0) uart0_tx_ring_put(buf, len);
+  return TX_RING_FREE();
+}
+
+// Return the number of characters that can be queued without blocking
+uint16_t ICACHE_FLASH_ATTR
+uart0_tx_space(void)
+{
+  return TX_RING_FREE();
+}
+
+// Return the number of characters queued or in the hardware fifo that have not been sent yet
+uint16_t ICACHE_FLASH_ATTR
+uart0_tx_pending(void)
+{
+  return TX_RING_USED() + UART_TXFIFO_LEN(UART0);
+}
+
+// Block until everything queued has been handed to the hardware fifo and the fifo is empty
+void ICACHE_FLASH_ATTR
+uart0_tx_flush(void)
+{
+  while (uart0_tx_pending() > 0) uart0_tx_wait();
+}
+
+/******************************************************************************
+ * FunctionName : uart_tx_one_char
  * Description  : Internal used function
- *                Use uart1 interface to transfer one char
+ *                Use uart interface to transfer one char, on UART0 this goes through
+ *                the TX ring buffer so the ordering with queued characters is preserved
  * Parameters   : uint8 TxChar - character to tx
  * Returns      : OK
 *******************************************************************************/
 STATUS
 uart_tx_one_char(uint8 uart, uint8 c)
 {
+  if (uart == UART0) {
+    uart0_write_char(c);
+    return OK;
+  }
   //Wait until there is room in the FIFO
-  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100) ;
+  while (UART_TXFIFO_LEN(uart) >= 100) ;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
   return OK;
 }
 
+/******************************************************************************
+ * FunctionName : uart1_tx_buffer
+ * Description  : Queue characters for transmission on UART1 without ever blocking,
+ *                what doesn't fit into the TX ring is dropped and counted, and a
+ *                "[N dropped]" marker goes out once there is room again
+ * Parameters   : const char *buf - characters to send
+ *                uint16 len - number of characters
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart1_tx_buffer(const char *buf, uint16 len)
+{
+  if (tx1_dropped > 0) {
+    char mark[24];
+    uint16_t n = os_sprintf(mark, "[%u dropped]", tx1_dropped);
+    if (TX1_RING_FREE() < n + len) {
+      tx1_dropped += len;
+      return;
+    }
+    uart1_tx_ring_put(mark, n);
+    tx1_dropped = 0;
+  }
+  uint16_t n = TX1_RING_FREE();
+  if (n > len) n = len;
+  if (n > 0) uart1_tx_ring_put(buf, n);
+  tx1_dropped += len - n;
+}
+
 /******************************************************************************
  * FunctionName : uart1_write_char
- * Description  : Internal used function
- *                Do some special deal while tx char is '\r' or '\n'
+ * Description  : Queue one char on UART1, see uart1_tx_buffer
  * Parameters   : char c - character to tx
  * Returns      : NONE
 *******************************************************************************/
 void ICACHE_FLASH_ATTR
 uart1_write_char(char c)
 {
-  //if (c == '\n') uart_tx_one_char(UART1, '\r');
-  uart_tx_one_char(UART1, c);
+  uart1_tx_buffer(&c, 1);
 }
 void ICACHE_FLASH_ATTR
 uart0_write_char(char c)
 {
   //if (c == '\n') uart_tx_one_char(UART0, '\r');
-  uart_tx_one_char(UART0, c);
+  while (TX_RING_FREE() == 0) uart0_tx_wait();
+  uart0_tx_ring_put(&c, 1);
 }
 /******************************************************************************
  * FunctionName : uart0_tx_buffer
- * Description  : use uart0 to transfer buffer
+ * Description  : use uart0 to transfer buffer, blocks only while the TX ring is full
  * Parameters   : uint8 *buf - point to send buffer
  *                uint16 len - buffer len
  * Returns      :
 *******************************************************************************/
-void ICACHE_FLASH_ATTR
+void HOT_IRAM_ATTR
 uart0_tx_buffer(char *buf, uint16 len)
 {
-  uint16 i;
-
-  for (i = 0; i < len; i++)
-  {
-    uart_tx_one_char(UART0, buf[i]);
+  METRIC_ADD(M_UART_TX_BYTES, len);
+  while (len > 0) {
+    uint16_t n = TX_RING_FREE();
+    if (n == 0) {
+      uart0_tx_wait();
+      continue;
+    }
+    if (n > len) n = len;
+    uart0_tx_ring_put(buf, n);
+    buf += n;
+    len -= n;
   }
 }
 
@@ -159,13 +381,26 @@ uart0_tx_buffer(char *buf, uint16 len)
 void ICACHE_FLASH_ATTR
 uart0_sendStr(const char *str)
 {
-  while(*str)
-  {
-    uart_tx_one_char(UART0, *str++);
-  }
+  uart0_tx_buffer((char *)str, os_strlen(str));
 }
 
-static uint32 last_frm_err; // time in us when last framing error message was printed
+// Framing errors are counted by the interrupt handler and reported by the receive task, at most
+// once a second, os_printf isn't safe to call from the handler
+static volatile uint32_t frm_errs;   // framing errors seen
+static uint32_t frm_errs_reported;   // framing errors seen at the last report
+static uint32 last_frm_err;          // time in us when last framing error message was printed
+
+static void ICACHE_FLASH_ATTR
+uart0_report_frm_errs(void)
+{
+  uint32_t errs = frm_errs;
+  if (errs == frm_errs_reported) return;
+  uint32 now = system_get_time();
+  if (last_frm_err != 0 && now - last_frm_err < 1000000) return;
+  os_printf("UART framing error (bad baud rate?)\n");
+  last_frm_err = now;
+  frm_errs_reported = errs;
+}
 
 /******************************************************************************
  * FunctionName : uart0_rx_intr_handler
@@ -177,89 +412,185 @@ static uint32 last_frm_err; // time in us when last framing error message was pr
 static void // must not use ICACHE_FLASH_ATTR !
 uart0_rx_intr_handler(void *para)
 {
-  // we assume that uart1 has interrupts disabled (it uses the same interrupt vector)
+  // uart1 only has the TXFIFO_EMPTY interrupt enabled (it uses the same interrupt vector)
+  if (READ_PERI_REG(UART_INT_ST(UART1)) & UART_TXFIFO_EMPTY_INT_ST) {
+    uart1_tx_fill_fifo();
+    WRITE_PERI_REG(UART_INT_CLR(UART1), UART_TXFIFO_EMPTY_INT_CLR);
+  }
+
   uint8 uart_no = UART0;
-  const uint32 one_sec = 1000000; // one second in usecs
 
-  // we end up largely ignoring framing errors and we just print a warning every second max
+  // we end up largely ignoring framing errors, the receive task prints a warning
   if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_FRM_ERR_INT_RAW) {
-    uint32 now = system_get_time();
-    if (last_frm_err == 0 || (now - last_frm_err) > one_sec) {
-      os_printf("UART framing error (bad baud rate?)\n");
-      last_frm_err = now;
-    }
+    frm_errs++;
     // clear rx fifo (apparently this is not optional at this point)
     SET_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST);
     CLEAR_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST);
     // reset framing error
     WRITE_PERI_REG(UART_INT_CLR(UART0), UART_FRM_ERR_INT_CLR);
-  // once framing errors are gone for 10 secs we forget about having seen them
-  } else if (last_frm_err != 0 && (system_get_time() - last_frm_err) > 10*one_sec) {
-    last_frm_err = 0;
+    if (!rx_task_posted) {
+      rx_task_posted = true;
+      post_usr_task(uart_recvTaskNum, 0);
+    }
+  }
+
+  uint32 int_st = READ_PERI_REG(UART_INT_ST(uart_no));
+
+  // refill the TX fifo from the ring buffer
+  if (int_st & UART_TXFIFO_EMPTY_INT_ST) {
+    uart0_tx_fill_fifo();
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
   }
 
-  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST)
-  ||  UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
+  // the hardware fifo overflowed before we got to it, chars were lost
+  if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_RXFIFO_OVF_INT_RAW) {
+    rx_stats.fifo_overflows++;
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_OVF_INT_CLR);
+  }
+
+  if (int_st & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST))
   {
     //DBG_UART("stat:%02X",*(uint8 *)UART_INT_ENA(uart_no));
-    ETS_UART_INTR_DISABLE();
-    post_usr_task(uart_recvTaskNum, 0);
+    // empty the hardware fifo into the ring buffer, dropping chars if the ring is full
+    uint16_t head = rx_head;
+    uint16_t cnt = UART_RXFIFO_LEN(uart_no);
+    if (rx_flow && cnt >= UART_RX_RING_SZ - 1 - RX_RING_USED()) {
+      // with flow control we leave the chars in the fifo and stop taking interrupts, once the
+      // fifo fills up the hardware deasserts RTS, the receive task turns us back on
+      CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA|UART_RXFIFO_TOUT_INT_ENA);
+      rx_throttled = true;
+      cnt = 0;
+    }
+    while (cnt-- > 0) {
+      char c = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
+      uint16_t next = (head+1) & (UART_RX_RING_SZ-1);
+      if (next == rx_tail) {
+        rx_stats.overruns++;
+        continue;
+      }
+      rx_ring[head] = c;
+      head = next;
+      rx_stats.rx_bytes++;
+    }
+    rx_head = head;
+    uint16_t used = RX_RING_USED();
+    if (used > rx_stats.high_water) rx_stats.high_water = used;
+    if (!rx_throttled)
+      WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR|UART_RXFIFO_TOUT_INT_CLR);
+    if (!rx_task_posted) {
+      rx_task_posted = true;
+      post_usr_task(uart_recvTaskNum, 0);
+    }
   }
 }
 
+// The ring has room again after having been full with flow control on: turn the RX
+// interrupts back on, the pending status bits make the handler run right away to pick up
+// what accumulated in the fifo
+static void ICACHE_FLASH_ATTR
+uart0_rx_unthrottle(void)
+{
+  if (!rx_throttled) return;
+  rx_throttled = false;
+  SET_PERI_REG_MASK(UART_INT_ENA(UART0), UART_RXFIFO_FULL_INT_ENA|UART_RXFIFO_TOUT_INT_ENA);
+}
+
 /******************************************************************************
  * FunctionName : uart_recvTask
- * Description  : system task triggered on receive interrupt, empties FIFO and calls callbacks
+ * Description  : system task triggered on receive interrupt, passes the characters
+ *                accumulated in the RX ring buffer to the callbacks
 *******************************************************************************/
-static void ICACHE_FLASH_ATTR
+static void HOT_IRAM_ATTR
 uart_recvTask(os_event_t *events)
 {
-  while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
-    //WRITE_PERI_REG(0X60000914, 0x73); //WTD // commented out by TvE
-
-    // read a buffer-full from the uart
-    uint16 length = 0;
-    char buf[128];
-    while ((READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) &&
-           (length < 128)) {
-      buf[length++] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-    }
+  PROF_BEGIN(PROF_UART_RECV);
+  rx_task_posted = false; // anything arriving from here on posts the task again
+  uint16_t head = rx_head;
+  uint16_t batch = (head - rx_tail) & (UART_RX_RING_SZ-1);
+  if (batch > 0) {
+    METRIC_ADD(M_UART_RX_BYTES, batch);
+    metricObserve(M_UART_RX_BATCH, batch);
+  }
+  while (rx_tail != head) {
+    // hand out the contiguous span up to the head or the end of the ring
+    uint16_t tail = rx_tail;
+    uint16_t length = (head > tail ? head : UART_RX_RING_SZ) - tail;
     //DBG_UART("%d ix %d\n", system_get_time(), length);
 
     for (int i=0; i<MAX_CB; i++) {
-      if (uart_recv_cb[i] != NULL) (uart_recv_cb[i])(buf, length);
+      if (uart_recv_cb[i] != NULL) (uart_recv_cb[i])(rx_ring+tail, length);
     }
+    rx_tail = (tail+length) & (UART_RX_RING_SZ-1);
   }
-  WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_FULL_INT_CLR|UART_RXFIFO_TOUT_INT_CLR);
-  ETS_UART_INTR_ENABLE();
+  uart0_rx_unthrottle();
+  uart0_report_frm_errs();
+  PROF_END(PROF_UART_RECV);
 }
 
-// Turn UART interrupts off and poll for nchars or until timeout hits
+// Poll for nchars or until timeout hits. Characters are taken out of the RX ring buffer
+// and are not passed to the receive callbacks.
 uint16_t ICACHE_FLASH_ATTR
 uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us) {
-  ETS_UART_INTR_DISABLE();
   uint16_t got = 0;
   uint32_t start = system_get_time(); // time in us
   while (system_get_time()-start < timeout_us) {
-    while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
-      buff[got++] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-      if (got == nchars) goto done;
+    while (rx_tail != rx_head) {
+      buff[got++] = rx_ring[rx_tail];
+      rx_tail = (rx_tail+1) & (UART_RX_RING_SZ-1);
+      if (got == nchars) break;
     }
+    uart0_rx_unthrottle();
+    if (got == nchars) break;
   }
-done:
-  ETS_UART_INTR_ENABLE();
   return got;
 }
 
+// Turn RTS/CTS hardware flow control on UART0 on or off. With flow control the transmitter
+// holds off while CTS is deasserted, and RTS is deasserted when the RX fifo holds more than
+// UART_RX_FLOW_THRHD chars, which happens when the RX ring is full. Routing the signals to
+// pins is up to the caller.
+void ICACHE_FLASH_ATTR
+uart0_flow_control(bool enable) {
+  rx_flow = enable;
+  if (enable) SET_PERI_REG_MASK(UART_CONF0(UART0), UART_TX_FLOW_EN);
+  else        CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_TX_FLOW_EN);
+}
+
+// Return whether RTS/CTS hardware flow control is on
+bool ICACHE_FLASH_ATTR
+uart0_flow_control_enabled(void) {
+  return rx_flow;
+}
+
+// Get a snapshot of the RX ring buffer statistics
+void ICACHE_FLASH_ATTR
+uart0_rx_stats(UartRxStats *stats) {
+  ETS_UART_INTR_DISABLE();
+  *stats = rx_stats;
+  ETS_UART_INTR_ENABLE();
+  stats->ring_size = UART_RX_RING_SZ;
+}
+
+// Reset the RX ring buffer statistics
+void ICACHE_FLASH_ATTR
+uart0_rx_stats_reset(void) {
+  ETS_UART_INTR_DISABLE();
+  os_memset(&rx_stats, 0, sizeof(rx_stats));
+  ETS_UART_INTR_ENABLE();
+}
+
 void ICACHE_FLASH_ATTR
 uart0_baud(int rate) {
   os_printf("UART %d baud\n", rate);
+  uart0_tx_flush(); // don't change the rate under queued characters
   uart_div_modify(UART0, UART_CLK_FREQ / rate);
 }
 
 void ICACHE_FLASH_ATTR
 uart0_config(uint8_t data_bits, uint8_t parity, uint8_t stop_bits) {
   uint32_t conf0 = CALC_UARTMODE(data_bits, parity, stop_bits);
+  uart0_tx_flush();
+  if (rx_flow) conf0 |= UART_TX_FLOW_EN;
   WRITE_PERI_REG(UART_CONF0(0), conf0);
 }
 
@@ -277,13 +608,13 @@ uart_init(uint32 conf0, UartBautRate uart0_br, UartBautRate uart1_br)
   uart_config(UART0, uart0_br, conf0);
   uart_config(UART1, uart1_br, conf0);
   for (int i=0; i<4; i++) uart_tx_one_char(UART1, '\n');
-  for (int i=0; i<4; i++) uart_tx_one_char(UART0, '\n');
   ETS_UART_INTR_ENABLE();
+  for (int i=0; i<4; i++) uart_tx_one_char(UART0, '\n');
 
   // install uart1 putc callback
   os_install_putc1((void *)uart0_write_char);
 
-  uart_recvTaskNum = register_usr_task(uart_recvTask);
+  uart_recvTaskNum = register_usr_task_prio(uart_recvTask, USRTASK_PRIO_HIGH);
 }
 
 void ICACHE_FLASH_ATTR
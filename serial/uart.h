@@ -3,29 +3,61 @@
 
 #include "uart_hw.h"
 
-// Receive callback function signature
+// Receive callback function signature. The buffer points straight into the UART RX ring
+// buffer, it is only valid for the duration of the callback and must not be modified.
 typedef void (*UartRecv_cb)(char *buf, short len);
 
+// Statistics for the UART0 RX ring buffer, useful to size the ring for the baud rate in use
+typedef struct {
+  uint32_t rx_bytes;        // characters received into the ring
+  uint32_t overruns;        // characters dropped because the ring was full
+  uint32_t fifo_overflows;  // times the hardware fifo overflowed before the interrupt ran
+  uint16_t high_water;      // max number of characters the ring has held
+  uint16_t ring_size;       // size of the ring buffer
+} UartRxStats;
+
 // Initialize UARTs to the provided baud rates (115200 recommended). This also makes the os_printf
 // calls use uart1 for output (for debugging purposes)
 void uart_init(uint32 conf0, UartBautRate uart0_br, UartBautRate uart1_br);
 
-// Transmit a buffer of characters on UART0
+// Transmit a buffer of characters on UART0, this queues the characters in the TX ring buffer
+// and only blocks if the ring is full
 void uart0_tx_buffer(char *buf, uint16 len);
 
+// Queue a buffer for transmission on UART0 without blocking. Either all of buf is queued or
+// nothing is. Returns the space left in the TX ring, or -1 if buf didn't fit.
+int16_t uart0_tx_enqueue(const char *buf, uint16 len);
+// Number of characters that can currently be queued without blocking
+uint16_t uart0_tx_space(void);
+// Number of characters queued or in the hardware fifo that have not been transmitted yet
+uint16_t uart0_tx_pending(void);
+// Block until all queued characters have been transmitted
+void uart0_tx_flush(void);
+
 void uart0_write_char(char c);
 STATUS uart_tx_one_char(uint8 uart, uint8 c);
 
+// Queue characters on UART1 (debug log), this never blocks: when the TX ring is full the
+// characters are dropped and a "[N dropped]" marker shows up in the output later
+void uart1_tx_buffer(const char *buf, uint16 len);
 void uart1_write_char(char c);
 
 // Add a receive callback function, this is called on the uart receive task each time a chunk
 // of bytes are received. A small number of callbacks can be added and they are all called
-// with all new characters.
+// with all new characters, which are passed as contiguous spans of the RX ring buffer.
 void uart_add_recv_cb(UartRecv_cb cb);
 
-// Turn UART interrupts off and poll for nchars or until timeout hits
+// Poll for nchars or until timeout hits, the characters are not passed to the callbacks
 uint16_t uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us);
 
+// Turn RTS/CTS hardware flow control on UART0 on or off, this does not touch the pin muxes
+void uart0_flow_control(bool enable);
+bool uart0_flow_control_enabled(void);
+
+// Get a snapshot of the RX ring buffer statistics, respectively reset them
+void uart0_rx_stats(UartRxStats *stats);
+void uart0_rx_stats_reset(void);
+
 void uart0_baud(int rate);
 void uart0_config(uint8_t data_bits, uint8_t parity, uint8_t stop_bits);
 void uart_config(uint8 uart_no, UartBautRate baudrate, uint32 conf0);
@@ -7,6 +7,9 @@
 #include "c_types.h"
 #include "ip_addr.h"
 #include "socket.h"
+#include "dnscache.h"
+#include "metrics.h"
+#include "perf.h"
 
 #define SOCK_DBG
 
@@ -16,17 +19,33 @@
 #define DBG_SOCK(format, ...) do { } while(0)
 #endif
 
-typedef struct {
+typedef struct SocketClient {
 	char			*host;
 	uint32_t		port;
-	ip_addr_t		ip;
 	struct espconn	*pCon;
-	char			*data;
-	uint16_t		data_len;
-	uint16_t		data_sent;
+	char			*txbuf;		// data waiting to be sent, allocated while there is some
+	uint16_t		tx_len;		// bytes in txbuf
+	uint16_t		tx_inflight;	// bytes at the start of txbuf handed to espconn
+	uint16_t		tx_stage;	// bytes of a streamed send collected after tx_len
+	uint16_t		tx_done;	// bytes sent since the last sent callback to the MCU
+	bool			tx_reject;	// streamed send being collected doesn't fit
+	bool			connected;	// TCP client: connection is established
+	bool			connecting;	// TCP client: connection is being established
 	uint32_t		resp_cb;
 	uint8_t			conn_num;
 	uint8_t			sock_mode;
+	uint16_t		chunk_max;	// max data bytes per receive callback
+	bool			flow_ctl;	// MCU grants credit for received data with SOCKET_CREDIT
+	bool			held;		// receiving is on hold until the MCU grants credit
+	uint16_t		credit;		// received bytes the MCU can still accept
+	struct espconn	*rx_conn;	// connection that's on hold
+	char			*pend;		// received data the MCU had no credit for yet
+	uint16_t		pend_len;
+	struct SocketClient *server;	// accepted connection: the server it belongs to, else NULL
+	struct SocketClient *last;	// multi-client server: connection that was active last
+	uint8_t			max_conn;	// multi-client server: max connections, 0 for a single handle
+	uint16_t		idle_s;		// multi-client server: idle timeout in seconds, 0 for none
+	uint32_t		active;		// accepted connection: socketTick at the last activity
 } SocketClient;
 
 
@@ -36,83 +55,323 @@ typedef struct {
 // Instead, we allocate a fixed pool of connections an round-robin. What this means is that the
 // attached MCU should really use at most as many SOCKET connections as there are slots in the pool.
 #define MAX_SOCKET 4
-#define MAX_RECEIVE_PACKET_LENGTH 100
+#define MAX_RECEIVE_PACKET_LENGTH 100 // default max data bytes per receive callback
+#define SOCKET_MSS 1460 // largest chunk size an MCU may ask for
+#define SOCKET_PEND_MAX 4096 // max received data held while the MCU has no credit
+#define SOCKET_TXBUF (2*1460) // send buffer per socket, sends are coalesced up to this size
+#define SOCKET_TXFULL -128 // sent callback length: the data didn't fit into the send buffer
 
 static SocketClient socketClient[MAX_SOCKET];
 static uint8_t socketNum = 0xff; // index into socketClient for next slot to allocate
 
-// Any incoming data?
-static void ICACHE_FLASH_ATTR
-socketclient_recv_cb(void *arg, char *pusrdata, unsigned short length) {
-	struct espconn *pCon = (struct espconn *)arg;
-	SocketClient* client = (SocketClient *)pCon->reverse;
+// Connections accepted by multi-client servers, each with its own handle MAX_SOCKET+index which
+// the MCU sees in the callbacks and uses to send. The pool is shared by all servers, when it's
+// full, or a server has its max number of connections, the least recently active one is closed
+// to make room. Connections idle for longer than their server's timeout are closed as well.
+#define SOCKET_MAX_CONN 8
+static SocketClient socketConn[SOCKET_MAX_CONN];
+static ETSTimer socketIdleTimer;
+static uint32_t socketTick; // seconds, counted while there are accepted connections
+
+// Find a socket or accepted connection by handle
+static SocketClient * ICACHE_FLASH_ATTR
+socketGet(uint32_t clientNum) {
+	if (clientNum < MAX_SOCKET) return socketClient + clientNum;
+	if (clientNum - MAX_SOCKET < SOCKET_MAX_CONN && socketConn[clientNum - MAX_SOCKET].pCon != NULL)
+		return socketConn + (clientNum - MAX_SOCKET);
+	return NULL;
+}
+
+static void socketTxFree(SocketClient *client);
 
+// Pass received data to the MCU in callbacks of up to chunk_max bytes each
+static void ICACHE_FLASH_ATTR
+socketDeliver(SocketClient *client, char *data, uint16_t length) {
 	uint8_t clientNum = client->conn_num;
 	uint8_t cb_type = USERCB_RECV;
-	DBG_SOCK("SOCKET #%d: Received %d bytes: %s\n", client-socketClient, length, pusrdata);
-	
+
 	unsigned short position = 0;
-	do
-	{
+	while (position < length) {
 		unsigned short msgLen = length - position;
-		if( msgLen > MAX_RECEIVE_PACKET_LENGTH )
-			msgLen = MAX_RECEIVE_PACKET_LENGTH;
-		
+		if (msgLen > client->chunk_max)
+			msgLen = client->chunk_max;
+
 		cmdResponseStart(CMD_RESP_CB, client->resp_cb, 4);
-		cmdResponseBody(&cb_type, 1);	
+		cmdResponseBody(&cb_type, 1);
 		cmdResponseBody(&clientNum, 1);
 		cmdResponseBody(&msgLen, 2);
-		cmdResponseBody(pusrdata + position, msgLen);
+		cmdResponseBody(data + position, msgLen);
 		cmdResponseEnd();
-		
+
 		position += msgLen;
-	}while(position < length );
-	
+	}
+	if (client->flow_ctl) client->credit -= length;
+}
+
+// Keep received data the MCU has no credit for, receiving a TCP connection is put on hold so
+// the window closes and the sender waits. Data that has already been received when the hold
+// takes effect is kept as well, up to SOCKET_PEND_MAX.
+static void ICACHE_FLASH_ATTR
+socketHold(SocketClient *client, struct espconn *pCon, char *data, uint16_t length) {
+	if (client->pend_len + length > SOCKET_PEND_MAX) {
+		os_printf("SOCKET #%d: no credit, dropping %d bytes\n", client->conn_num, length);
+		return;
+	}
+	char *pend = os_malloc(client->pend_len + length);
+	if (pend == NULL) {
+		os_printf("SOCKET #%d: no memory, dropping %d bytes\n", client->conn_num, length);
+		return;
+	}
+	if (client->pend) {
+		os_memcpy(pend, client->pend, client->pend_len);
+		os_free(client->pend);
+	}
+	os_memcpy(pend + client->pend_len, data, length);
+	client->pend = pend;
+	client->pend_len += length;
+
+	if (!client->held && client->sock_mode != SOCKET_UDP) {
+		DBG_SOCK("SOCKET #%d: no credit, holding\n", client->conn_num);
+		espconn_recv_hold(pCon);
+		client->held = true;
+		client->rx_conn = pCon;
+	}
+}
+
+// Any incoming data?
+static void ICACHE_FLASH_ATTR
+socketclient_recv_cb(void *arg, char *pusrdata, unsigned short length) {
+	struct espconn *pCon = (struct espconn *)arg;
+	SocketClient* client = (SocketClient *)pCon->reverse;
+	if (client == NULL) return; // connection was closed to make room
+
+	DBG_SOCK("SOCKET #%d: Received %d bytes\n", client->conn_num, length);
+	METRIC_ADD(M_SOCKET_RX_BYTES, length);
+	client->active = socketTick;
+
+	if (!client->flow_ctl) {
+		socketDeliver(client, pusrdata, length);
+	} else {
+		// pass on what the MCU has credit for, unless older data is waiting
+		uint16_t n = client->pend_len > 0 ? 0 : length < client->credit ? length : client->credit;
+		socketDeliver(client, pusrdata, n);
+		if (n < length) socketHold(client, pCon, pusrdata + n, length - n);
+	}
+
 	if (client->sock_mode != SOCKET_TCP_SERVER) { // We don't wait for a response
 		DBG_SOCK("SOCKET #%d: disconnect after receiving\n", client-socketClient);
 		espconn_disconnect(client->pCon); // disconnect from the server
 	}
 }
 
+// Tell the MCU how much data has been sent, a negative length is an error and the data is gone
+static void ICACHE_FLASH_ATTR
+socketSentCb(SocketClient *client, sint16 sentDataLen) {
+	uint8_t clientNum = client->conn_num;
+	uint8_t cb_type = USERCB_SENT;
+	cmdResponseStart(CMD_RESP_CB, client->resp_cb, 3);
+	cmdResponseBody(&cb_type, 1);
+	cmdResponseBody(&clientNum, 1);
+	cmdResponseBody(&sentDataLen, 2);
+	cmdResponseEnd();
+}
+
+// Drop all buffered data, a streamed send that is being collected gets rejected
+static void ICACHE_FLASH_ATTR
+socketTxFree(SocketClient *client) {
+	if (client->txbuf) os_free(client->txbuf);
+	client->txbuf = NULL;
+	client->tx_len = 0;
+	client->tx_inflight = 0;
+	client->tx_reject = client->tx_stage > 0;
+	client->tx_stage = 0;
+	client->tx_done = 0;
+}
+
+// Point a TCP server's espconn at the connection to send to, that's the last one accepted
+static bool ICACHE_FLASH_ATTR
+socketServerRemote(SocketClient *client) {
+	remot_info *premot = NULL;
+	if (espconn_get_connection_info(client->pCon, &premot, 0) != ESPCONN_OK) return false;
+	for (uint8 count = 0; count < client->pCon->link_cnt; count ++){
+		client->pCon->proto.tcp->remote_port = premot[count].remote_port;
+
+		client->pCon->proto.tcp->remote_ip[0] = premot[count].remote_ip[0];
+		client->pCon->proto.tcp->remote_ip[1] = premot[count].remote_ip[1];
+		client->pCon->proto.tcp->remote_ip[2] = premot[count].remote_ip[2];
+		client->pCon->proto.tcp->remote_ip[3] = premot[count].remote_ip[3];
+		DBG_SOCK("SOCKET #%d: connected to %d.%d.%d.%d:%d\n",
+			client->conn_num,
+			client->pCon->proto.tcp->remote_ip[0],
+			client->pCon->proto.tcp->remote_ip[1],
+			client->pCon->proto.tcp->remote_ip[2],
+			client->pCon->proto.tcp->remote_ip[3],
+			client->pCon->proto.tcp->remote_port
+			);
+	}
+	return client->pCon->link_cnt > 0;
+}
+
+// Hand the next chunk of buffered data to espconn unless some is in flight already, espconn_sent
+// must only be called after the sent callback for the previous chunk. A UDP datagram goes out
+// in one piece and lwip copies it, so the buffer is emptied right away.
+static void ICACHE_FLASH_ATTR
+socketSendNext(SocketClient *client) {
+	if (client->tx_inflight > 0 || client->tx_len == 0) return;
+	if (client->sock_mode == SOCKET_UDP) {
+		client->tx_inflight = client->tx_len;
+	} else {
+		if (client->sock_mode == SOCKET_TCP_SERVER && client->server == NULL &&
+				!socketServerRemote(client)) return;
+		if (client->sock_mode != SOCKET_TCP_SERVER && !client->connected) return;
+		client->tx_inflight = client->tx_len <= 1460 ? client->tx_len : 1460;
+	}
+	DBG_SOCK("SOCKET #%d: sending %d of %d\n", client->conn_num, client->tx_inflight, client->tx_len);
+	sint8 result = espconn_send(client->pCon, (uint8_t*)client->txbuf, client->tx_inflight);
+	if (result != ESPCONN_OK) {
+		os_printf("SOCKET #%d: espconn_send error %d\n", client->conn_num, result);
+		METRIC_INC(M_SOCKET_ERRORS);
+		socketTxFree(client);
+		socketSentCb(client, result);
+	} else {
+		METRIC_ADD(M_SOCKET_TX_BYTES, client->tx_inflight);
+	}
+}
+
 // Data is sent
 static void ICACHE_FLASH_ATTR
 socketclient_sent_cb(void *arg) {
 	struct espconn *pCon = (struct espconn *)arg;
 	SocketClient* client = (SocketClient *)pCon->reverse;
+	if (client == NULL) return; // connection was closed to make room
+	DBG_SOCK("SOCKET #%d: Sent\n", client->conn_num);
+	client->active = socketTick;
+
+	uint16_t n = client->tx_inflight;
+	if (n == 0) return;
+	client->tx_inflight = 0;
+	client->tx_len -= n;
+	os_memmove(client->txbuf, client->txbuf + n, client->tx_len + client->tx_stage);
+	client->tx_done = n > 0x7fff - client->tx_done ? 0x7fff : client->tx_done + n;
+
+	if (client->tx_len > 0) {
+		socketSendNext(client);
+		return;
+	}
 
-	uint8_t clientNum = client->conn_num;
-	uint8_t cb_type = USERCB_SENT;
-	DBG_SOCK("SOCKET #%d: Sent\n", client-socketClient);
-	sint16 sentDataLen = client->data_sent;
-	if (client->data_sent != client->data_len) 
-	{
-		// we only sent part of the buffer, send the rest
-		uint16_t data_left = client->data_len - client->data_sent;
-		if (data_left  > 1400) // we have more than 1400 bytes left
-		{ 
-			data_left = 1400;
-			espconn_sent(client->pCon, (uint8_t*)(client->data+client->data_sent), 1400 );
+	// we're done sending, tell the MCU and free the memory
+	sint16 sentDataLen = client->tx_done;
+	client->tx_done = 0;
+	if (client->tx_stage == 0) socketTxFree(client);
+
+	if (client->sock_mode == SOCKET_TCP_CLIENT) { // We don't wait for a response
+		DBG_SOCK("SOCKET #%d: disconnect after sending\n", client->conn_num);
+		client->connected = false;
+		espconn_disconnect(client->pCon);
+	}
+
+	socketSentCb(client, sentDataLen);
+}
+
+// Free an accepted connection's slot
+static void ICACHE_FLASH_ATTR
+socketConnFree(SocketClient *conn) {
+	socketTxFree(conn);
+	if (conn->pend) os_free(conn->pend);
+	if (conn->server && conn->server->last == conn) conn->server->last = NULL;
+	os_memset(conn, 0, sizeof(SocketClient));
+}
+
+// Close an accepted connection right away, the MCU is told it's gone and the callbacks that
+// are still to come for it are ignored
+static void ICACHE_FLASH_ATTR
+socketConnClose(SocketClient *conn) {
+	uint8_t clientNum = conn->conn_num;
+	uint8_t cb_type = USERCB_CONN;
+	sint16 _status = CONNSTAT_DIS;
+	DBG_SOCK("SOCKET #%d: closing\n", clientNum);
+	struct espconn *pCon = conn->pCon;
+	uint32_t resp_cb = conn->resp_cb;
+	socketConnFree(conn);
+	pCon->reverse = NULL;
+	espconn_disconnect(pCon);
+
+	cmdResponseStart(CMD_RESP_CB, resp_cb, 3);
+	cmdResponseBody(&cb_type, 1);
+	cmdResponseBody(&clientNum, 1);
+	cmdResponseBody(&_status, 2);
+	cmdResponseEnd();
+}
+
+// Timer callback: close accepted connections that have been idle for too long
+static void ICACHE_FLASH_ATTR
+socketIdleCb(void *arg) {
+	socketTick++;
+	bool any = false;
+	for (int i=0; i<SOCKET_MAX_CONN; i++) {
+		SocketClient *conn = socketConn + i;
+		if (conn->pCon == NULL) continue;
+		if (conn->server->idle_s && socketTick - conn->active > conn->server->idle_s) {
+			DBG_SOCK("SOCKET #%d: idle\n", conn->conn_num);
+			socketConnClose(conn);
+		} else {
+			any = true;
 		}
-		espconn_sent(client->pCon, (uint8_t*)(client->data+client->data_sent), data_left );
-		client->data_sent += data_left;
-	}
-	else
-	{
-		// we're done sending, free the memory
-		if (client->data) os_free(client->data);
-		client->data = 0;
-
-		if (client->sock_mode == SOCKET_TCP_CLIENT) { // We don't wait for a response
-			DBG_SOCK("SOCKET #%d: disconnect after sending\n", clientNum);
-			espconn_disconnect(client->pCon);
+	}
+	if (!any) os_timer_disarm(&socketIdleTimer);
+}
+
+// Find a slot for a connection accepted by a server, making room if need be
+static SocketClient * ICACHE_FLASH_ATTR
+socketConnAlloc(SocketClient *server) {
+	SocketClient *free = NULL, *lru = NULL, *lru_server = NULL;
+	uint8_t count = 0;
+	for (int i=0; i<SOCKET_MAX_CONN; i++) {
+		SocketClient *conn = socketConn + i;
+		if (conn->pCon == NULL) {
+			if (free == NULL) free = conn;
+			continue;
 		}
+		if (lru == NULL || socketTick - conn->active > socketTick - lru->active) lru = conn;
+		if (conn->server != server) continue;
+		count++;
+		if (lru_server == NULL || socketTick - conn->active > socketTick - lru_server->active)
+			lru_server = conn;
+	}
+	if (count >= server->max_conn) {
+		socketConnClose(lru_server);
+		return lru_server;
+	}
+	if (free != NULL) return free;
+	socketConnClose(lru);
+	return lru;
+}
 
-		cmdResponseStart(CMD_RESP_CB, client->resp_cb, 3);
-		cmdResponseBody(&cb_type, 1);	
-		cmdResponseBody(&clientNum, 1);
-		cmdResponseBody(&sentDataLen, 2);
-		cmdResponseEnd();
+// A multi-client server accepted a connection, give it a handle of its own
+static void ICACHE_FLASH_ATTR
+socketAccept(SocketClient *server, struct espconn *pCon) {
+	SocketClient *conn = socketConnAlloc(server);
+	bool any = false;
+	for (int i=0; i<SOCKET_MAX_CONN; i++) any |= socketConn[i].pCon != NULL;
+	if (!any) {
+		os_timer_disarm(&socketIdleTimer);
+		os_timer_setfn(&socketIdleTimer, socketIdleCb, NULL);
+		os_timer_arm(&socketIdleTimer, 1000, 1);
 	}
+
+	conn->pCon = pCon;
+	conn->server = server;
+	conn->sock_mode = SOCKET_TCP_SERVER;
+	conn->resp_cb = server->resp_cb;
+	conn->conn_num = MAX_SOCKET + (conn - socketConn);
+	conn->chunk_max = server->chunk_max;
+	conn->flow_ctl = server->flow_ctl;
+	conn->credit = server->credit;
+	conn->connected = true;
+	conn->active = socketTick;
+	server->last = conn;
+	pCon->reverse = conn;
+	DBG_SOCK("SOCKET #%d: accepted #%d\n", server->conn_num, conn->conn_num);
 }
 
 // Connection is disconnected
@@ -120,19 +379,27 @@ static void ICACHE_FLASH_ATTR
 socketclient_discon_cb(void *arg) {
 	struct espconn *pespconn = (struct espconn *)arg;
 	SocketClient* client = (SocketClient *)pespconn->reverse;
+	if (client == NULL) return; // connection was closed to make room
 
 	uint8_t clientNum = client->conn_num;
 	uint8_t cb_type = USERCB_CONN;
 	sint16 _status = CONNSTAT_DIS;
 	DBG_SOCK("SOCKET #%d: Disconnect\n", clientNum);
-	// free the data buffer, if we have one
-	if (client->data) os_free(client->data);
-	client->data = 0;
+	if (client->rx_conn == pespconn) {
+		client->rx_conn = NULL;
+		client->held = false;
+	}
+	// drop the data that wasn't sent
+	if (client->sock_mode != SOCKET_TCP_SERVER) {
+		client->connected = client->connecting = false;
+		socketTxFree(client);
+	}
 	cmdResponseStart(CMD_RESP_CB, client->resp_cb, 3);
 	cmdResponseBody(&cb_type, 1);	
 	cmdResponseBody(&clientNum, 1);
 	cmdResponseBody(&_status, 2);
 	cmdResponseEnd();
+	if (client->server) socketConnFree(client);
 }
 
 // Connection was reset
@@ -140,19 +407,27 @@ static void ICACHE_FLASH_ATTR
 socketclient_recon_cb(void *arg, sint8 errType) {
 	struct espconn *pCon = (struct espconn *)arg;
 	SocketClient* client = (SocketClient *)pCon->reverse;
+	if (client == NULL) return; // connection was closed to make room
 
 	uint8_t clientNum = client->conn_num;
 	uint8_t cb_type = USERCB_RECO;
 	sint16 _errType = errType;
 	os_printf("SOCKET #%d: conn reset, err=%d\n", clientNum, _errType);
+	if (client->rx_conn == pCon) {
+		client->rx_conn = NULL;
+		client->held = false;
+	}
 	cmdResponseStart(CMD_RESP_CB, client->resp_cb, 3);
 	cmdResponseBody(&cb_type, 1);	
 	cmdResponseBody(&clientNum, 1);
 	cmdResponseBody(&_errType, 2);
 	cmdResponseEnd();
-	// free the data buffer, if we have one
-	if (client->data) os_free(client->data);
-	client->data = 0;
+	// drop the data that wasn't sent
+	if (client->sock_mode != SOCKET_TCP_SERVER) {
+		client->connected = client->connecting = false;
+		socketTxFree(client);
+	}
+	if (client->server) socketConnFree(client);
 }
 
 // Connection is done
@@ -160,6 +435,11 @@ static void ICACHE_FLASH_ATTR
 socketclient_connect_cb(void *arg) {
 	struct espconn *pCon = (struct espconn *)arg;
 	SocketClient* client = (SocketClient *)pCon->reverse;
+	if (client->max_conn > 0) {
+		socketAccept(client, pCon);
+		client = client->last;
+		espconn_regist_reconcb(client->pCon, socketclient_recon_cb);
+	}
 
 	uint8_t clientNum = client->conn_num;
 	uint8_t cb_type = USERCB_CONN;
@@ -168,13 +448,13 @@ socketclient_connect_cb(void *arg) {
 	espconn_regist_disconcb(client->pCon, socketclient_discon_cb);
 	espconn_regist_recvcb(client->pCon, socketclient_recv_cb);
 	espconn_regist_sentcb(client->pCon, socketclient_sent_cb);
+	perfTcpSetup(client->pCon, TCP_SVC_SOCKET);
 
-	DBG_SOCK("SOCKET #%d: sending %d\n", clientNum, client->data_sent);
 	if (client->sock_mode != SOCKET_TCP_SERVER) { // Send data after established connection only in client mode
-		client->data_sent = client->data_len <= 1400 ? client->data_len : 1400;
-		DBG_SOCK("SOCKET #%d: sending %d\n", clientNum, client->data_sent);
-		espconn_send(client->pCon, (uint8_t*)client->data, client->data_sent);
+		client->connected = true;
+		client->connecting = false;
 	}
+	socketSendNext(client);
 
 	cmdResponseStart(CMD_RESP_CB, client->resp_cb, 3);
 	cmdResponseBody(&cb_type, 1);	
@@ -193,6 +473,8 @@ socket_dns_found(const char *name, ip_addr_t *ipaddr, void *arg) {
 		sint16 _errType = ESPCONN_RTE; //-4;   
 		uint8_t cb_type = USERCB_RECO; // use Routing problem or define a new one
 		os_printf("SOCKET #%d DNS: Got no ip, report error\n", clientNum);
+		client->connecting = false;
+		socketTxFree(client);
 		cmdResponseStart(CMD_RESP_CB, client->resp_cb, 3);    
 		cmdResponseBody(&cb_type, 2); // Same as connection reset?? or define a new one
 		cmdResponseBody(&clientNum, 1);    
@@ -206,7 +488,7 @@ socket_dns_found(const char *name, ip_addr_t *ipaddr, void *arg) {
 			*((uint8 *) &ipaddr->addr + 1),
 			*((uint8 *) &ipaddr->addr + 2),
 			*((uint8 *) &ipaddr->addr + 3));
-	if(client->ip.addr == 0 && ipaddr->addr != 0) {
+	if(ipaddr->addr != 0) {
 		os_memcpy(client->pCon->proto.tcp->remote_ip, &ipaddr->addr, 4);
 		espconn_connect(client->pCon);
 		DBG_SOCK("SOCKET #%d: connecting...\n", clientNum);
@@ -222,8 +504,9 @@ SOCKET_Setup(CmdPacket *cmd) {
 
 	// start parsing the command
 	cmdRequest(&req, cmd);
-	if(cmdGetArgc(&req) != 3) {
-		DBG_SOCK("SOCKET Setup parse command failure: (cmdGetArgc(&req) != 3)\n");
+	uint32_t argc = cmdGetArgc(&req);
+	if(argc < 3 || argc > 7) {
+		DBG_SOCK("SOCKET Setup parse command failure: (cmdGetArgc(&req) != 3..7)\n");
 		goto fail;
 	}
 	err--;
@@ -262,6 +545,39 @@ SOCKET_Setup(CmdPacket *cmd) {
 		goto fail;
 	}
 	err--;
+
+	// get the optional max data bytes per receive callback
+	uint16_t chunk_max = 0;
+	if (argc > 3 && cmdPopArg(&req, (uint8_t*)&chunk_max, 2)) {
+		DBG_SOCK("SOCKET Setup parse command failure: cannot get chunk size\n");
+		os_free(socket_host);
+		goto fail;
+	}
+	if (chunk_max == 0) chunk_max = MAX_RECEIVE_PACKET_LENGTH;
+	if (chunk_max > SOCKET_MSS) chunk_max = SOCKET_MSS;
+	err--;
+
+	// get the optional initial credit, which turns on flow control
+	uint16_t credit = 0;
+	if (argc > 4 && cmdPopArg(&req, (uint8_t*)&credit, 2)) {
+		DBG_SOCK("SOCKET Setup parse command failure: cannot get credit\n");
+		os_free(socket_host);
+		goto fail;
+	}
+	err--;
+
+	// get the optional max connections of a server, which gives each one its own handle, and
+	// their idle timeout
+	uint8_t max_conn = 0;
+	uint16_t idle_s = 0;
+	if ((argc > 5 && cmdPopArg(&req, (uint8_t*)&max_conn, 1)) ||
+			(argc > 6 && cmdPopArg(&req, (uint8_t*)&idle_s, 2))) {
+		DBG_SOCK("SOCKET Setup parse command failure: cannot get max connections\n");
+		os_free(socket_host);
+		goto fail;
+	}
+	if (max_conn > SOCKET_MAX_CONN) max_conn = SOCKET_MAX_CONN;
+	err--;
 	DBG_SOCK("SOCKET Setup listener flag\n");
 
 	// clear connection structures the first time
@@ -276,7 +592,11 @@ SOCKET_Setup(CmdPacket *cmd) {
 	socketNum = (socketNum+1)%MAX_SOCKET;
 
 	// free any data structure that may be left from a previous connection
-	if (client->data) os_free(client->data);
+	if (client->txbuf) os_free(client->txbuf);
+	if (client->pend) os_free(client->pend);
+	for (int i=0; i<SOCKET_MAX_CONN; i++)
+		if (socketConn[i].pCon != NULL && socketConn[i].server == client) socketConnClose(socketConn+i);
+	if (client->pCon && client->sock_mode == SOCKET_TCP_SERVER) espconn_delete(client->pCon);
 	if (client->pCon) {
 		if (sock_mode != SOCKET_UDP) {
 			if (client->pCon->proto.tcp) os_free(client->pCon->proto.tcp);
@@ -286,11 +606,17 @@ SOCKET_Setup(CmdPacket *cmd) {
 		os_free(client->pCon);
 	}
 	os_memset(client, 0, sizeof(SocketClient));
-	DBG_SOCK("SOCKET #%d: Setup host=%s port=%d \n", clientNum, socket_host, port);
+	DBG_SOCK("SOCKET #%d: Setup host=%s port=%d chunk=%d credit=%d\n", clientNum, socket_host, port,
+		chunk_max, credit);
 
 	client->sock_mode = sock_mode;
 	client->resp_cb = cmd->value;
 	client->conn_num = clientNum;
+	client->chunk_max = chunk_max;
+	client->flow_ctl = credit > 0;
+	client->credit = credit;
+	client->max_conn = sock_mode == SOCKET_TCP_SERVER ? max_conn : 0;
+	client->idle_s = idle_s;
 
 	client->host = (char *)socket_host;
 	client->port = port;
@@ -348,6 +674,8 @@ SOCKET_Setup(CmdPacket *cmd) {
 		espconn_regist_reconcb(client->pCon, socketclient_recon_cb);
 		if (client->sock_mode == SOCKET_TCP_SERVER) { // Server mode?
 			DBG_SOCK("SOCKET #%d: Enable server mode on port%d\n", clientNum, client->port);
+			// allow one more connection than the max so a new client can evict the least active one
+			if (client->max_conn > 0) espconn_tcp_set_max_con_allow(client->pCon, client->max_conn+1);
 			espconn_accept(client->pCon);
 			espconn_regist_connectcb(client->pCon, socketclient_connect_cb);
 		}
@@ -364,6 +692,39 @@ fail:
 	return;
 }
 
+// Make room for len more bytes after the buffered data, returns false if they don't fit
+static bool ICACHE_FLASH_ATTR
+socketTxRoom(SocketClient *client, uint16_t len) {
+	if (len > SOCKET_TXBUF - client->tx_len) return false;
+	if (client->txbuf == NULL) client->txbuf = os_malloc(SOCKET_TXBUF);
+	return client->txbuf != NULL;
+}
+
+// Send the data just added to the buffer, a TCP client connects first and sends from the
+// connected callback
+static void ICACHE_FLASH_ATTR
+socketSendData(SocketClient *client, uint32_t clientNum) {
+	if (client->sock_mode == SOCKET_TCP_CLIENT || client->sock_mode == SOCKET_TCP_CLIENT_LISTEN) {
+		if (!client->connected && !client->connecting) {
+			client->connecting = true;
+			espconn_regist_connectcb(client->pCon, socketclient_connect_cb);
+
+			if(UTILS_StrToIP((char *)client->host, &client->pCon->proto.tcp->remote_ip)) {
+				DBG_SOCK("SOCKET #%d: Connect to ip %s:%d\n", clientNum, client->host, client->port);
+				espconn_connect(client->pCon);
+			} else {
+				DBG_SOCK("SOCKET #%d: Connect to host %s:%d\n", clientNum, client->host, client->port);
+				dnsCacheLookup((char *)client->host, socket_dns_found, client->pCon);
+			}
+			return;
+		}
+	}
+	socketSendNext(client);
+}
+
+// Data sent by the MCU is added to the socket's send buffer, where it's coalesced with what's
+// still waiting to go out, except for UDP where each send is a datagram. The MCU gets a sent
+// callback once the buffer has drained, or right away with SOCKET_TXFULL if the data doesn't fit.
 void ICACHE_FLASH_ATTR
 SOCKET_Send(CmdPacket *cmd) {
 	CmdRequest req;
@@ -371,74 +732,123 @@ SOCKET_Send(CmdPacket *cmd) {
 	
 	// Get client
 	uint32_t clientNum = cmd->value;
-	SocketClient *client = socketClient + (clientNum % MAX_SOCKET);
+	SocketClient *client = socketGet(clientNum);
 	DBG_SOCK("SOCKET #%d: send", clientNum);
+	if (client == NULL) {
+		DBG_SOCK(" - no such connection\n");
+		return;
+	}
+	// a multi-client server sends to the connection that was active last
+	if (client->max_conn > 0) client = client->last;
+	if (client == NULL) {
+		DBG_SOCK(" - not connected\n");
+		return;
+	}
 
 	if (cmd->argc != 1 && cmd->argc != 2) {
 		DBG_SOCK("\nSOCKET #%d: send - wrong number of arguments\n", clientNum);
 		return;
 	}
 	
-	// Get data to sent
-	client->data_len = cmdArgLen(&req);
-	DBG_SOCK(" dataLen=%d", client->data_len);
-
-	if (client->data) os_free(client->data);
-	client->data = (char*)os_zalloc(client->data_len);
-	if (client->data == NULL) {
-		DBG_SOCK("\nSOCKET #%d failed to alloc memory for client->data\n", clientNum);
-		goto fail;
+	// Get data to send
+	uint16_t len;
+	const void *data = cmdPopArgPtr(&req, &len);
+	DBG_SOCK(" dataLen=%d buffered=%d\n", len, client->tx_len);
+	if (data == NULL) return;
+
+	if ((client->sock_mode == SOCKET_UDP && client->tx_len > 0) || !socketTxRoom(client, len)) {
+		DBG_SOCK("SOCKET #%d: send buffer full\n", clientNum);
+		socketSentCb(client, SOCKET_TXFULL);
+		return;
 	}
-	cmdPopArg(&req, client->data, client->data_len);
-	DBG_SOCK(" socketData=%s", client->data);
+	os_memcpy(client->txbuf + client->tx_len, data, len);
+	client->tx_len += len;
 
-	// client->data_len = os_sprintf((char*)client->data, socketDataSet, socketData);
-	
-	DBG_SOCK("\n");
-
-	DBG_SOCK("SOCKET #%d: Create connection to ip %s:%d\n", clientNum, client->host, client->port);
-
-	if (client->sock_mode == SOCKET_TCP_SERVER) { // In TCP server mode we should be connected already and send the data immediately
-		remot_info *premot = NULL;
-		if (espconn_get_connection_info(client->pCon,&premot,0) == ESPCONN_OK){
-			for (uint8 count = 0; count < client->pCon->link_cnt; count ++){
-				client->pCon->proto.tcp->remote_port = premot[count].remote_port;
-          
-				client->pCon->proto.tcp->remote_ip[0] = premot[count].remote_ip[0];
-				client->pCon->proto.tcp->remote_ip[1] = premot[count].remote_ip[1];
-				client->pCon->proto.tcp->remote_ip[2] = premot[count].remote_ip[2];
-				client->pCon->proto.tcp->remote_ip[3] = premot[count].remote_ip[3];
-				DBG_SOCK("SOCKET #%d: connected to %d.%d.%d.%d:%d\n", 
-					clientNum,
-					client->pCon->proto.tcp->remote_ip[0],
-					client->pCon->proto.tcp->remote_ip[1],
-					client->pCon->proto.tcp->remote_ip[2],
-					client->pCon->proto.tcp->remote_ip[3],
-					client->pCon->proto.tcp->remote_port
-					);
-			}
-			client->data_sent = client->data_len <= 1400 ? client->data_len : 1400;
-			DBG_SOCK("SOCKET #%d: Server sending %d\n", clientNum, client->data_sent);
-			espconn_send(client->pCon, (uint8_t*)client->data, client->data_sent);
+	socketSendData(client, clientNum);
+}
+
+// Streaming variant of SOCKET_Send for data that doesn't fit into the SLIP buffer, the data is
+// collected in the send buffer but only goes out once the CRC checks out
+void ICACHE_FLASH_ATTR
+SOCKET_SendStream(CmdStream *st, const uint8_t *data, uint16_t len) {
+	uint32_t clientNum = st->hdr.value;
+	// the connection is picked when the data starts, a server's last accepted one may change
+	// before the packet ends
+	SocketClient *client = st->ctx;
+	if (data != NULL && st->argn == 0 && st->argoff == 0) {
+		client = socketGet(clientNum);
+		if (client != NULL && client->max_conn > 0) client = client->last;
+		st->ctx = client;
+	}
+	if (client == NULL) return;
+
+	if (data == NULL) { // end of packet
+		uint16_t stage = client->tx_stage;
+		bool reject = client->tx_reject;
+		client->tx_stage = 0;
+		client->tx_reject = false;
+		if (!st->ok || (stage == 0 && !reject) || (st->hdr.argc != 1 && st->hdr.argc != 2)) {
+			DBG_SOCK("SOCKET #%d: send - bad packet\n", clientNum);
+			if (client->tx_len == 0) socketTxFree(client);
+			return;
 		}
-	} else if (client->sock_mode != SOCKET_UDP) { // In TCP client mode we connect and send the data from the connected callback
-		espconn_regist_connectcb(client->pCon, socketclient_connect_cb);
-		
-		if(UTILS_StrToIP((char *)client->host, &client->pCon->proto.tcp->remote_ip)) {
-			DBG_SOCK("SOCKET #%d: Connect to ip %s:%d\n", clientNum, client->host, client->port);
-			espconn_connect(client->pCon);
-		} else {
-			DBG_SOCK("SOCKET #%d: Connect to host %s:%d\n", clientNum, client->host, client->port);
-			espconn_gethostbyname(client->pCon, (char *)client->host, &client->ip, socket_dns_found);
-		} 
-	} else { // in UDP socket mode we send the data immediately
-		client->data_sent = client->data_len <= 1400 ? client->data_len : 1400;
-		DBG_SOCK("SOCKET #%d: sending %d bytes: %s\n", clientNum, client->data_sent, client->data);
-		espconn_sent(client->pCon, (uint8_t*)client->data, client->data_sent);
+		if (reject) {
+			socketSentCb(client, SOCKET_TXFULL);
+			return;
+		}
+		client->tx_len += stage;
+		DBG_SOCK("SOCKET #%d: send dataLen=%d buffered=%d\n", clientNum, stage, client->tx_len);
+		socketSendData(client, clientNum);
+		return;
 	}
 
-	return;
+	if (st->argn != 0) return; // only the first argument carries data
+	if (st->argoff == 0) {
+		bool fits = (client->sock_mode != SOCKET_UDP || client->tx_len == 0) &&
+			socketTxRoom(client, st->arglen);
+		client->tx_stage = fits ? st->arglen : 0;
+		client->tx_reject = !fits;
+		if (!fits) DBG_SOCK("SOCKET #%d: send buffer full\n", clientNum);
+	}
+	// the buffer may have been dropped since, e.g. by a disconnect
+	if (client->tx_reject || client->txbuf == NULL) return;
+	os_memcpy(client->txbuf + client->tx_len + st->argoff, data, len);
+}
 
-fail:
-	DBG_SOCK("\n");
+// The MCU can accept more received data, pass on what's waiting and resume receiving
+void ICACHE_FLASH_ATTR
+SOCKET_Credit(CmdPacket *cmd) {
+	CmdRequest req;
+	cmdRequest(&req, cmd);
+
+	uint32_t clientNum = cmd->value;
+	SocketClient *client = socketGet(clientNum);
+	uint16_t credit;
+	if (client == NULL) return;
+	if (cmd->argc != 1 || cmdPopArg(&req, (uint8_t*)&credit, 2)) {
+		DBG_SOCK("SOCKET #%d: credit - wrong arguments\n", clientNum);
+		return;
+	}
+	if (!client->flow_ctl) return;
+	client->credit = credit > 0xffff - client->credit ? 0xffff : client->credit + credit;
+	DBG_SOCK("SOCKET #%d: credit=%d pending=%d\n", clientNum, client->credit, client->pend_len);
+
+	if (client->pend_len > 0) {
+		uint16_t n = client->pend_len < client->credit ? client->pend_len : client->credit;
+		socketDeliver(client, client->pend, n);
+		client->pend_len -= n;
+		if (client->pend_len > 0) {
+			os_memmove(client->pend, client->pend + n, client->pend_len);
+		} else {
+			os_free(client->pend);
+			client->pend = NULL;
+		}
+	}
+
+	if (client->held && client->pend_len == 0 && client->credit > 0) {
+		DBG_SOCK("SOCKET #%d: resume receiving\n", clientNum);
+		espconn_recv_unhold(client->rx_conn);
+		client->held = false;
+		client->rx_conn = NULL;
+	}
 }
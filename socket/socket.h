@@ -10,8 +10,19 @@
 
 #include "cmd.h"
 
+// SOCKET_SETUP takes host, port, mode and optionally the max data bytes per receive callback
+// (default 100, at most 1460) and an initial credit. With a credit the MCU is sent at most that
+// many received bytes, it grants more with SOCKET_CREDIT and until then the ESP holds the TCP
+// window closed. A TCP server also takes the max number of connections and their idle timeout
+// in seconds: with a max each connection it accepts gets a handle of its own, which is reported
+// in the USERCB_CONN callbacks when it's accepted and closed and which the MCU sends to.
 void SOCKET_Setup(CmdPacket *cmd);
+// SOCKET_SEND adds the data to a send buffer where it's coalesced with data still waiting to go
+// out. A USERCB_SENT callback reports the bytes sent once the buffer has drained, a negative
+// length means data was dropped: -128 if it didn't fit into the buffer, else an espconn error.
 void SOCKET_Send(CmdPacket *cmd);
+void SOCKET_Credit(CmdPacket *cmd);
+void SOCKET_SendStream(CmdStream *st, const uint8_t *data, uint16_t len);
 
 // Socket mode
 typedef enum {
@@ -10,36 +10,75 @@
 
 #include <esp8266.h>
 #include "config.h"
+#include "cgiwifi.h"
 #include "syslog.h"
+#include "dnscache.h"
 #include "time.h"
 #include "task.h"
+#include "metrics.h"
 #include "sntp.h"
 
-extern void * mem_trim(void *m, size_t s);	// not well documented...
-
 #ifdef SYSLOG_DBG
 #define DBG(format, ...) do { os_printf(format, ## __VA_ARGS__); } while(0)
 #else
 #define DBG(format, ...) do { } while(0)
 #endif
 
-#define WIFI_CHK_INTERVAL 1000	// ms to check Wifi statis
+#define TCP_BATCH_SIZE    1024	// max bytes of queued messages sent at once over TCP
+#define TCP_BACKOFF_MIN   1000	// ms before the first reconnect attempt
+#define TCP_BACKOFF_MAX   60000
 
 static struct espconn *syslog_espconn = NULL;
 static uint32_t syslog_msgid = 1;
 static uint8_t syslog_task = 0;
 
 static syslog_host_t	syslogHost;
-static syslog_entry_t *syslogQueue = NULL;
+
+// queued messages, a ring of preallocated slots, the oldest one is at syslogHead
+static syslog_entry_t *syslogPool = NULL;
+static uint8_t syslogSlots = 0;
+static uint8_t syslogHead = 0;
+static uint8_t syslogCount = 0;
+static uint8_t syslog_inflight = 0;	// number of oldest messages that have been handed to espconn
+
+// TCP transport (RFC 6587 octet counting), the connection is opened when there is something to send
+static struct espconn *syslog_tcpconn = NULL;
+static char *syslog_tcpbuf = NULL;	// batch of framed messages being sent
+static enum { TCP_IDLE, TCP_CONNECTING, TCP_CONNECTED } syslog_tcpstate = TCP_IDLE;
+static uint32_t syslog_backoff = 0;	// ms until the next connection attempt
+static os_timer_t syslog_backoff_timer;
+
+// the last message, repeats of it within the repeat window are only counted
+static struct {
+  uint32_t	hash;
+  uint32_t	time;		// system_get_time() when it was queued
+  uint16_t	repeats;
+  uint8_t	facility, severity;
+  char		tag[24];
+} syslogLast;
+static os_timer_t syslog_repeat_timer;
+
+// token buckets for the rate limit, one per tag+severity that has been seen recently
+typedef struct {
+  uint32_t	key;
+  uint32_t	time;		// system_get_time() of the last refill
+  uint16_t	tokens;		// in 1/1000 messages
+  uint16_t	dropped;	// messages dropped since the last one that went through
+} syslog_bucket_t;
+static syslog_bucket_t syslogBuckets[SYSLOG_BUCKETS];
 
 static enum syslog_state syslogState = SYSLOG_NONE;
 
 static bool syslog_timer_armed = false;
 
 static void ICACHE_FLASH_ATTR syslog_add_entry(syslog_entry_t *entry);
+static syslog_entry_t ICACHE_FLASH_ATTR *syslog_alloc_entry(void);
 static void ICACHE_FLASH_ATTR syslog_chk_status(void);
+static void ICACHE_FLASH_ATTR syslog_wifi_cb(uint8_t wifiStatus);
+static bool ICACHE_FLASH_ATTR syslog_pool_init(void);
 static void ICACHE_FLASH_ATTR syslog_udp_sent_cb(void *arg);
-static syslog_entry_t ICACHE_FLASH_ATTR *syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *fmt, ...);
+static syslog_entry_t ICACHE_FLASH_ATTR *syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *msg, int len);
+static void ICACHE_FLASH_ATTR syslog_queue(uint8_t facility, uint8_t severity, const char *tag, const char *msg, int len);
 
 #ifdef SYSLOG_UDP_RECV
 static void ICACHE_FLASH_ATTR syslog_udp_recv_cb(void *arg, char *pusrdata, unsigned short length);
@@ -78,6 +117,10 @@ static char ICACHE_FLASH_ATTR *syslog_get_status(void) {
       return "UNKNOWN ";
 }
 
+static syslog_entry_t ICACHE_FLASH_ATTR *syslog_oldest(void) {
+  return syslogCount ? &syslogPool[syslogHead] : NULL;
+}
+
 static void ICACHE_FLASH_ATTR syslog_set_status(enum syslog_state state) {
   syslogState = state;
   DBG("[%dµs] %s: %s (%d)\n", WDEV_NOW(), __FUNCTION__, syslog_get_status(), state);
@@ -104,7 +147,7 @@ static void ICACHE_FLASH_ATTR syslog_chk_status(void)
 {
   struct ip_info ipconfig;
 
-  DBG("[%uµs] %s: id=%lu ", WDEV_NOW(), __FUNCTION__, syslogQueue ? syslogQueue->msgid : 0);
+  DBG("[%uµs] %s: id=%lu ", WDEV_NOW(), __FUNCTION__, syslog_oldest() ? syslog_oldest()->msgid : 0);
 
   //disarm timer first
   syslog_timer_armed = false;
@@ -163,12 +206,23 @@ static void ICACHE_FLASH_ATTR syslog_chk_status(void)
       syslog_set_status(SYSLOG_ERROR);
       os_printf("*** connect failure!!!\n");
     } else {
-      DBG("re-arming timer...\n");
-      syslog_timer_arm(WIFI_CHK_INTERVAL);
+      DBG("waiting for Wifi...\n");
+      wifiAddStateChangeCb(syslog_wifi_cb);
     }
   }
 }
 
+// Wifi state change callback: instead of polling until Wifi is up pick up where the
+// status check left off once we have an IP address
+static void ICACHE_FLASH_ATTR
+syslog_wifi_cb(uint8_t wifiStatus)
+{
+  if (wifiStatus != wifiGotIP || syslog_timer_armed) return;
+  if (syslogState == SYSLOG_WAIT || (syslogState != SYSLOG_NONE && syslogState != SYSLOG_ERROR &&
+        syslogState != SYSLOG_HALTED && syslogCount > 0))
+    syslog_chk_status();
+}
+
 /******************************************************************************
  * FunctionName : syslog_sent_cb
  * Description  : udp sent successfully
@@ -181,14 +235,17 @@ static void ICACHE_FLASH_ATTR syslog_udp_sent_cb(void *arg)
   struct espconn *pespconn = arg;
   (void) pespconn;
 
-  DBG("[%uµs] %s: id=%lu\n", WDEV_NOW(), __FUNCTION__, syslogQueue ? syslogQueue->msgid : 0);
+  DBG("[%uµs] %s: id=%lu\n", WDEV_NOW(), __FUNCTION__, syslog_oldest() ? syslog_oldest()->msgid : 0);
 
-  // datagram is delivered - free and advance queue
-  syslog_entry_t *pse = syslogQueue;
-  syslogQueue = syslogQueue -> next;
-  os_free(pse);
+  // datagram is delivered - advance queue, except for messages that have been overwritten meanwhile
+  if (syslog_inflight) {
+    METRIC_ADD(M_SYSLOG_SENT, syslog_inflight);
+    syslogHead = (syslogHead + syslog_inflight) % syslogSlots;
+    syslogCount -= syslog_inflight;
+    syslog_inflight = 0;
+  }
 
-  if (syslogQueue == NULL)
+  if (syslogCount == 0)
     syslog_set_status(SYSLOG_READY);
   else {
     // UDP seems timecritical - we must ensure a minimum delay after each package...
@@ -198,20 +255,152 @@ static void ICACHE_FLASH_ATTR syslog_udp_sent_cb(void *arg)
   }
 }
 
+/******************************************************************************
+ * TCP transport: the connection is opened when there are messages to send and
+ * re-opened with exponential backoff when it fails. Messages leave the queue
+ * only once the send of the batch they're in has completed, so they get resent
+ * after a reconnect.
+ ******************************************************************************/
+static void ICACHE_FLASH_ATTR syslog_tcp_connect(void);
+
+static void ICACHE_FLASH_ATTR
+syslog_tcp_retry(void)
+{
+  syslog_tcpstate = TCP_IDLE;
+  syslog_inflight = 0;		// whatever was in flight goes out again
+  syslog_backoff = syslog_backoff ? syslog_backoff * 2 : TCP_BACKOFF_MIN;
+  if (syslog_backoff > TCP_BACKOFF_MAX)
+    syslog_backoff = TCP_BACKOFF_MAX;
+  DBG("[%uµs] %s: retry in %lums\n", WDEV_NOW(), __FUNCTION__, syslog_backoff);
+  os_timer_disarm(&syslog_backoff_timer);
+  os_timer_setfn(&syslog_backoff_timer, (os_timer_func_t *)syslog_tcp_connect, NULL);
+  os_timer_arm(&syslog_backoff_timer, syslog_backoff, 0);
+}
+
+static void ICACHE_FLASH_ATTR
+syslog_tcp_connect_cb(void *arg)
+{
+  DBG("[%uµs] %s\n", WDEV_NOW(), __FUNCTION__);
+  syslog_tcpstate = TCP_CONNECTED;
+  syslog_backoff = 0;
+  syslog_send_udp();
+}
+
+static void ICACHE_FLASH_ATTR
+syslog_tcp_discon_cb(void *arg)
+{
+  DBG("[%uµs] %s\n", WDEV_NOW(), __FUNCTION__);
+  if (syslog_tcpstate != TCP_IDLE)	// not closed by syslog_tcp_close
+    syslog_tcp_retry();
+}
+
+static void ICACHE_FLASH_ATTR
+syslog_tcp_recon_cb(void *arg, sint8 err)
+{
+  os_printf("syslog_tcp: connection error %d\n", err);
+  syslog_tcp_discon_cb(arg);
+}
+
+static void ICACHE_FLASH_ATTR
+syslog_tcp_connect(void)
+{
+  if (syslog_tcpstate != TCP_IDLE || syslogCount == 0 || !flashConfig.syslog_tcp)
+    return;
+
+  if (syslog_tcpconn == NULL) {
+    syslog_tcpconn = (espconn *)os_zalloc(sizeof(espconn));
+    syslog_tcpbuf = os_malloc(TCP_BATCH_SIZE);
+    if (syslog_tcpconn == NULL || syslog_tcpbuf == NULL) goto oom;
+    syslog_tcpconn->proto.tcp = (esp_tcp *)os_zalloc(sizeof(esp_tcp));
+    if (syslog_tcpconn->proto.tcp == NULL) goto oom;
+    syslog_tcpconn->type = ESPCONN_TCP;
+    syslog_tcpconn->state = ESPCONN_NONE;
+    espconn_regist_connectcb(syslog_tcpconn, syslog_tcp_connect_cb);
+    espconn_regist_reconcb(syslog_tcpconn, syslog_tcp_recon_cb);
+    espconn_regist_disconcb(syslog_tcpconn, syslog_tcp_discon_cb);
+    espconn_regist_sentcb(syslog_tcpconn, syslog_udp_sent_cb);
+  }
+
+  DBG("[%uµs] %s\n", WDEV_NOW(), __FUNCTION__);
+  syslog_tcpconn->proto.tcp->remote_port = syslogHost.port;
+  os_memcpy(syslog_tcpconn->proto.tcp->remote_ip, &syslogHost.addr.addr, 4);
+  syslog_tcpconn->proto.tcp->local_port = espconn_port();
+  syslog_tcpstate = TCP_CONNECTING;
+  if (espconn_connect(syslog_tcpconn) != 0)
+    syslog_tcp_retry();
+  return;
+
+oom:
+  os_printf("syslog_tcp: out of memory\n");
+  if (syslog_tcpconn != NULL) os_free(syslog_tcpconn);
+  if (syslog_tcpbuf != NULL) os_free(syslog_tcpbuf);
+  syslog_tcpconn = NULL;
+  syslog_tcpbuf = NULL;
+  syslog_tcp_retry();
+}
+
+// send as many of the queued messages as fit into the batch, each one framed as "LEN SP MSG"
+static void ICACHE_FLASH_ATTR
+syslog_tcp_send(void)
+{
+  if (syslog_tcpstate != TCP_CONNECTED) {
+    syslog_tcp_connect();
+    return;
+  }
+
+  uint16_t len = 0;
+  uint8_t n = 0;
+  while (n < syslogCount) {
+    syslog_entry_t *se = &syslogPool[(syslogHead + n) % syslogSlots];
+    if (len + se->datagram_len + 5 > TCP_BATCH_SIZE)
+      break;
+    len += os_sprintf(syslog_tcpbuf + len, "%d ", se->datagram_len);
+    os_memcpy(syslog_tcpbuf + len, se->datagram, se->datagram_len);
+    len += se->datagram_len;
+    n++;
+  }
+
+  int res = espconn_send(syslog_tcpconn, (uint8_t *)syslog_tcpbuf, len);
+  if (res != 0) {
+    os_printf("syslog_tcp_send: error %d\n", res);
+  } else {
+    DBG("[%uµs] %s: %d messages, %d bytes\n", WDEV_NOW(), __FUNCTION__, n, len);
+    syslog_inflight = n;
+  }
+}
+
+static void ICACHE_FLASH_ATTR
+syslog_tcp_close(void)
+{
+  os_timer_disarm(&syslog_backoff_timer);
+  syslog_backoff = 0;
+  syslog_inflight = 0;
+  if (syslog_tcpconn != NULL && syslog_tcpstate != TCP_IDLE) {
+    syslog_tcpstate = TCP_IDLE;
+    espconn_disconnect(syslog_tcpconn);
+  }
+}
+
 static void ICACHE_FLASH_ATTR
 syslog_udp_send_event(os_event_t *events) {
-//  os_printf("syslog_udp_send_event: %d %lu, %lu\n", syslogState, syslogQueue->msgid, syslogQueue->tick);
-  DBG("[%uµs] %s: id=%lu\n", WDEV_NOW(), __FUNCTION__, syslogQueue ? syslogQueue->msgid : 0);
+  DBG("[%uµs] %s: id=%lu\n", WDEV_NOW(), __FUNCTION__, syslog_oldest() ? syslog_oldest()->msgid : 0);
 
-  if (syslogQueue == NULL)
+  syslog_entry_t *se = syslog_oldest();
+  if (se == NULL)
     syslog_set_status(SYSLOG_READY);
+  else if (syslog_inflight)
+    ;	// wait for the sent callback
+  else if (flashConfig.syslog_tcp)
+    syslog_tcp_send();
   else {
     int res = 0;
     syslog_espconn->proto.udp->remote_port = syslogHost.port;			// ESP8266 udp remote port
     os_memcpy(syslog_espconn->proto.udp->remote_ip, &syslogHost.addr.addr, 4);	// ESP8266 udp remote IP
-    res = espconn_send(syslog_espconn, (uint8_t *)syslogQueue->datagram, syslogQueue->datagram_len);
+    res = espconn_send(syslog_espconn, (uint8_t *)se->datagram, se->datagram_len);
     if (res != 0) {
       os_printf("syslog_udp_send: error %d\n", res);
+    } else {
+      syslog_inflight = 1;
     }
   }
 }
@@ -266,6 +455,7 @@ void ICACHE_FLASH_ATTR syslog_init(char *syslog_host)
   os_printf("SYSLOG host=%s *host=0x%x\n", syslog_host, *syslog_host);
   if (!*syslog_host) {
     syslog_set_status(SYSLOG_HALTED);
+    syslog_tcp_close();
     return;
  }
 
@@ -282,13 +472,11 @@ void ICACHE_FLASH_ATTR syslog_init(char *syslog_host)
     syslog_espconn = NULL;
 
     // clean up syslog queue
-    syslog_entry_t *pse = syslogQueue;
-    while (pse != NULL) {
-      syslog_entry_t *next = pse->next;
-      os_free(pse);
-      pse = next;
-    }
-    syslogQueue = NULL;
+    if (syslogPool != NULL)
+      os_free(syslogPool);
+    syslogPool = NULL;
+    syslogSlots = syslogHead = syslogCount = 0;
+    syslog_tcp_close();
     return;
   }
 
@@ -320,6 +508,8 @@ void ICACHE_FLASH_ATTR syslog_init(char *syslog_host)
   espconn_regist_sentcb(syslog_espconn, syslog_udp_sent_cb);			// register a udp packet sent callback
   syslog_task = register_usr_task(syslog_udp_send_event);
   syslogHost.min_heap_size = flashConfig.syslog_minheap;
+  syslog_tcp_close();		// the next send connects to the new host if TCP is enabled
+  syslog_pool_init();
 
 // the wifi_set_broadcast_if must be handled global in connection handler...
 //  wifi_set_broadcast_if(STATIONAP_MODE); // send UDP broadcast from both station and soft-AP interface
@@ -334,57 +524,107 @@ void ICACHE_FLASH_ATTR syslog_init(char *syslog_host)
     syslog_set_status(SYSLOG_DNSWAIT);
     syslog(SYSLOG_FAC_USER, SYSLOG_PRIO_NOTICE, "SYSLOG",
           "must resolve hostname \"%s\"", host);
-    espconn_gethostbyname(syslog_espconn, host, &syslogHost.addr, syslog_gethostbyname_cb);
+    dnsCacheLookup(host, syslog_gethostbyname_cb, syslog_espconn);
+  }
+}
+
+/******************************************************************************
+ * FunctionName : syslog_pool_init
+ * Description  : allocate the ring of syslog_slots message slots, leaving at
+ *                least syslog_minheap bytes of heap to the rest of the system
+ * Parameters   : none
+ * Returns      : false if the slots cannot be allocated
+ ******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+syslog_pool_init(void)
+{
+  uint8_t slots = flashConfig.syslog_slots ? flashConfig.syslog_slots : SYSLOG_SLOTS;
+  if (slots < 4) slots = 4;
+  if (slots > SYSLOG_SLOTS_MAX) slots = SYSLOG_SLOTS_MAX;
+  if (syslogPool != NULL && slots == syslogSlots)
+    return true;
+
+  // resizing drops whatever is queued
+  if (syslogPool != NULL)
+    os_free(syslogPool);
+  syslogSlots = syslogHead = syslogCount = 0;
+  syslog_inflight = 0;
+
+  uint32_t heap = system_get_free_heap_size();
+  while (slots > 4 && heap < flashConfig.syslog_minheap + slots * sizeof(syslog_entry_t))
+    slots--;
+  // one more slot to format messages in
+  syslogPool = os_malloc((slots + 1) * sizeof(syslog_entry_t));
+  if (syslogPool == NULL) {
+    os_printf("syslog_pool_init: cannot allocate %d slots\n", slots);
+    return false;
   }
+  syslogSlots = slots;
+  DBG("[%dµs] %s slots=%d\n", WDEV_NOW(), __FUNCTION__, slots);
+  return true;
+}
+
+/******************************************************************************
+ * FunctionName : syslog_alloc_entry
+ * Description  : get the slot for a new message, with syslog_overwrite set
+ *                the oldest message is dropped if the queue is full
+ * Parameters   : none
+ * Returns      : the slot or NULL if the queue is full
+ ******************************************************************************/
+static syslog_entry_t ICACHE_FLASH_ATTR *
+syslog_alloc_entry(void)
+{
+  if (syslogCount == syslogSlots) {
+    if (!flashConfig.syslog_overwrite)
+      return NULL;
+    // if the oldest message is on the air the sent callback must not advance the queue again
+    if (syslog_inflight) syslog_inflight--;
+    METRIC_INC(M_SYSLOG_DROPPED);
+    syslogHead = (syslogHead + 1) % syslogSlots;
+    syslogCount--;
+  }
+  return &syslogPool[(syslogHead + syslogCount) % syslogSlots];
 }
 
 /******************************************************************************
  * FunctionName : syslog_add_entry
- * Description  : add a syslog_entry_t to the syslogQueue
+ * Description  : add a syslog_entry_t from syslog_alloc_entry to the queue
  * Parameters   : entry: the syslog_entry_t
  * Returns      : none
  ******************************************************************************/
 static void ICACHE_FLASH_ATTR
 syslog_add_entry(syslog_entry_t *entry)
 {
-  syslog_entry_t *pse = syslogQueue;
-
   DBG("[%dµs] %s id=%lu\n", WDEV_NOW(), __FUNCTION__, entry->msgid);
-  // append msg to syslog_queue
-  if (pse == NULL)
-    syslogQueue = entry;
-  else {
-    while (pse->next != NULL)
-      pse = pse->next;
-    pse->next = entry;	// append msg to syslog queue
-  }
-//   DBG("%p %lu %d\n", entry, entry->msgid, system_get_free_heap_size());
-
-  // ensure we have sufficient heap for the rest of the system
-  if (system_get_free_heap_size() < syslogHost.min_heap_size) {
-    if (syslogState != SYSLOG_HALTED) {
-      os_printf("syslog_add_entry: Warning: queue filled up, halted\n");
-      entry->next = syslog_compose(SYSLOG_FAC_USER, SYSLOG_PRIO_CRIT, "SYSLOG", "queue filled up, halted");
-      if (syslogState == SYSLOG_READY)
-        syslog_send_udp();
-      syslog_set_status(SYSLOG_HALTED);
-    }
+  syslogCount++;
+
+  // unless old messages get overwritten the last slot is kept for an obituary
+  if (!flashConfig.syslog_overwrite && syslogCount == syslogSlots - 1) {
+    os_printf("syslog_add_entry: Warning: queue filled up, halted\n");
+    static const char obituary[] = "queue filled up, halted";
+    syslog_entry_t *se = syslog_compose(SYSLOG_FAC_USER, SYSLOG_PRIO_CRIT, "SYSLOG", obituary, sizeof(obituary) - 1);
+    if (se != NULL)
+      syslogCount++;
+    if (syslogState == SYSLOG_READY)
+      syslog_send_udp();
+    syslog_set_status(SYSLOG_HALTED);
   }
 }
 
 /******************************************************************************
  * FunctionName : syslog_compose
- * Description  : compose a syslog_entry_t from va_args
- * Parameters   : va_args
- * Returns      : the malloced syslog_entry_t
+ * Description  : compose a syslog_entry_t from a formatted message
+ * Parameters   : facility, severity, tag, msg: the message text, len: its length
+ * Returns      : the syslog_entry_t in the next free slot, NULL if the queue is full
  ******************************************************************************/
 LOCAL syslog_entry_t ICACHE_FLASH_ATTR *
-syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *fmt, ...)
+syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *msg, int len)
 {
   DBG("[%dµs] %s id=%lu\n", WDEV_NOW(), __FUNCTION__, syslog_msgid);
-  syslog_entry_t *se = os_zalloc(sizeof (syslog_entry_t) + 1024);	// allow up to 1k datagram
+  syslog_entry_t *se = syslog_alloc_entry();
   if (se == NULL) return NULL;
   char *p = se->datagram;
+  char *end = se->datagram + SYSLOG_SLOT_SIZE - 1;
   se->tick = WDEV_NOW();			// 0 ... 4294.967295s
   se->msgid = syslog_msgid;
 
@@ -417,22 +657,143 @@ syslog_compose(uint8_t facility, uint8_t severity, const char *tag, const char *
 
   // add HOSTNAME APP-NAME PROCID MSGID
   if (flashConfig.syslog_showtick)
-    p += os_sprintf(p, "%s %s %u.%06u %u ", flashConfig.hostname, tag, se->tick / 1000000,
+    p += os_snprintf(p, end - p, "%s %s %u.%06u %u ", flashConfig.hostname, tag, se->tick / 1000000,
         se->tick % 1000000, syslog_msgid++);
   else
-    p += os_sprintf(p, "%s %s - %u ", flashConfig.hostname, tag, syslog_msgid++);
+    p += os_snprintf(p, end - p, "%s %s - %u ", flashConfig.hostname, tag, syslog_msgid++);
+  if (p > end) p = end;
 
-  // append syslog message
-  va_list arglist;
-  va_start(arglist, fmt);
-  p += ets_vsprintf(p, fmt, arglist );
-  va_end(arglist);
+  // append syslog message, truncated to what fits into the slot
+  if (len > end - p) len = end - p;
+  os_memcpy(p, msg, len);
+  p += len;
+  *p = 0;
 
   se->datagram_len = p - se->datagram;
-  se = mem_trim(se, sizeof(syslog_entry_t) + se->datagram_len + 1);
   return se;
 }
 
+/******************************************************************************
+ * FunctionName : syslog_queue
+ * Description  : compose a message and append it to the queue, the caller
+ *                has to syslog_kick() the queue afterwards
+ * Parameters   : facility, severity, tag, msg: the message text, len: its length
+ * Returns      : none
+ ******************************************************************************/
+static void ICACHE_FLASH_ATTR
+syslog_queue(uint8_t facility, uint8_t severity, const char *tag, const char *msg, int len)
+{
+  if (syslogState == SYSLOG_ERROR || syslogState == SYSLOG_HALTED)
+    return;
+
+  syslog_entry_t *se = syslog_compose(facility, severity, tag, msg, len);
+  if (se == NULL) return; // queue is full
+
+  // and append it to the message queue
+  syslog_add_entry(se);
+}
+
+// get the queued messages going
+static void ICACHE_FLASH_ATTR
+syslog_kick(void)
+{
+  if (syslogState == SYSLOG_NONE)
+    syslog_set_status(SYSLOG_WAIT);
+
+  if (! syslog_timer_armed)
+    syslog_chk_status();
+}
+
+/******************************************************************************
+ * FunctionName : syslog_flush_repeats
+ * Description  : queue "last message repeated N times" if the last message
+ *                has been suppressed
+ * Parameters   : none
+ * Returns      : none
+ ******************************************************************************/
+static void ICACHE_FLASH_ATTR
+syslog_flush_repeats(void)
+{
+  os_timer_disarm(&syslog_repeat_timer);
+  if (syslogLast.repeats == 0)
+    return;
+
+  char msg[40];
+  int len = os_sprintf(msg, "last message repeated %d times", syslogLast.repeats);
+  syslogLast.repeats = 0;
+  syslog_queue(syslogLast.facility, syslogLast.severity, syslogLast.tag, msg, len);
+}
+
+static void ICACHE_FLASH_ATTR
+syslog_repeat_cb(void *arg)
+{
+  syslog_flush_repeats();
+  syslog_kick();
+}
+
+static uint32_t ICACHE_FLASH_ATTR
+syslog_hash(uint32_t h, const char *p, int len)
+{
+  while (len-- > 0)
+    h = (h ^ (uint8_t)*p++) * 16777619;	// FNV-1a
+  return h;
+}
+
+/******************************************************************************
+ * FunctionName : syslog_rate_ok
+ * Description  : token bucket rate limit per tag and severity, allows
+ *                syslog_rate messages per second with bursts of SYSLOG_BURST
+ * Parameters   : facility, severity, tag
+ * Returns      : false if the message must be dropped
+ ******************************************************************************/
+static bool ICACHE_FLASH_ATTR
+syslog_rate_ok(uint8_t facility, uint8_t severity, const char *tag)
+{
+  if (flashConfig.syslog_rate == 0)
+    return true;
+
+  uint32_t now = system_get_time();
+  uint32_t key = syslog_hash(2166136261 ^ severity, tag, os_strlen(tag));
+  syslog_bucket_t *b = &syslogBuckets[0];
+  for (int i = 0; i < SYSLOG_BUCKETS; i++) {
+    if (syslogBuckets[i].key == key) {
+      b = &syslogBuckets[i];
+      break;
+    }
+    // otherwise reuse the one that's been idle the longest
+    if (now - syslogBuckets[i].time > now - b->time)
+      b = &syslogBuckets[i];
+  }
+  if (b->key != key) {
+    b->key = key;
+    b->time = now;
+    b->tokens = SYSLOG_BURST * 1000;
+    b->dropped = 0;
+  }
+
+  // refill, the rate is messages per second, i.e. 1/1000 messages per ms
+  uint32_t ms = (now - b->time) / 1000;
+  if (ms > 0) {
+    uint32_t tokens = b->tokens + ms * flashConfig.syslog_rate;
+    b->tokens = tokens > SYSLOG_BURST * 1000 ? SYSLOG_BURST * 1000 : tokens;
+    b->time += ms * 1000;
+  }
+  if (b->tokens < 1000) {
+    b->dropped++;
+    METRIC_INC(M_SYSLOG_DROPPED);
+    return false;
+  }
+  b->tokens -= 1000;
+
+  if (b->dropped > 0) {
+    char msg[40];
+    int len = os_sprintf(msg, "rate limit dropped %d messages", b->dropped);
+    b->dropped = 0;
+    syslog_queue(facility, severity, tag, msg, len);
+  }
+  return true;
+}
+
  /*****************************************************************************
   * FunctionName : syslog
   * Description  : compose and queue a new syslog message
@@ -514,18 +875,40 @@ void ICACHE_FLASH_ATTR syslog(uint8_t facility, uint8_t severity, const char *ta
   if (severity > flashConfig.syslog_filter)
     return;
 
-  // compose the syslog message
-  void *arg = __builtin_apply_args();
-  void *res = __builtin_apply((void*)syslog_compose, arg, 128);
-  if (res == NULL) return; // compose failed, probably due to malloc failure
-  syslog_entry_t *se  = *(syslog_entry_t **)res;
+  if (syslogPool == NULL && !syslog_pool_init())
+    return;
 
-  // and append it to the message queue
-  syslog_add_entry(se);
+  // format the message text into the spare slot
+  char *msg = syslogPool[syslogSlots].datagram;
+  va_list arglist;
+  va_start(arglist, fmt);
+  int len = ets_vsnprintf(msg, SYSLOG_SLOT_SIZE, fmt, arglist);
+  va_end(arglist);
+  if (len > SYSLOG_SLOT_SIZE - 1) len = SYSLOG_SLOT_SIZE - 1;
+
+  // repeats of the last message within the window are only counted
+  uint32_t now = system_get_time();
+  uint32_t window = (flashConfig.syslog_repeat ? flashConfig.syslog_repeat : SYSLOG_REPEAT) * 1000;
+  uint32_t hash = syslog_hash(syslog_hash(2166136261 ^ severity, tag, os_strlen(tag)), msg, len);
+  if (hash == syslogLast.hash && now - syslogLast.time < window * 1000) {
+    if (syslogLast.repeats++ == 0) {
+      os_timer_disarm(&syslog_repeat_timer);
+      os_timer_setfn(&syslog_repeat_timer, syslog_repeat_cb, NULL);
+      os_timer_arm(&syslog_repeat_timer, window - (now - syslogLast.time) / 1000, 0);
+    }
+    return;
+  }
+  syslog_flush_repeats();
 
-  if (syslogState == SYSLOG_NONE)
-    syslog_set_status(SYSLOG_WAIT);
+  if (!syslog_rate_ok(facility, severity, tag))
+    return;
 
-  if (! syslog_timer_armed)
-    syslog_chk_status();
+  syslogLast.hash = hash;
+  syslogLast.time = now;
+  syslogLast.facility = facility;
+  syslogLast.severity = severity;
+  os_strncpy(syslogLast.tag, tag, sizeof(syslogLast.tag) - 1);
+
+  syslog_queue(facility, severity, tag, msg, len);
+  syslog_kick();
 }
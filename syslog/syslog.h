@@ -80,14 +80,21 @@ struct syslog_host_t {
     uint16_t	port;
 };
 
+#define SYSLOG_SLOTS		8	// default number of queued messages
+#define SYSLOG_SLOTS_MAX	64
+#define SYSLOG_SLOT_SIZE	256	// max datagram size, longer messages are truncated
+#define SYSLOG_REPEAT		30	// default seconds repeats of a message are collapsed
+#define SYSLOG_BURST		10	// messages per tag+severity that may exceed syslog_rate
+#define SYSLOG_BUCKETS		8	// tag+severity combinations that are rate limited
+
 // buffered syslog event - f.e. if network stack isn't up and running
+// the entries live in a ring of syslog_slots preallocated slots
 typedef struct syslog_entry_t syslog_entry_t;
 struct syslog_entry_t {
-    syslog_entry_t *next;
     uint32_t	msgid;
     uint32_t	tick;
     uint16_t	datagram_len;
-    char	datagram[];
+    char	datagram[SYSLOG_SLOT_SIZE];
 };
 
 syslog_host_t syslogserver;
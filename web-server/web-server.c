@@ -13,10 +13,17 @@
 // - handles JSON data coming from the browser
 // - handles SLIP messages coming from MCU
 
-#define MAX_ARGUMENT_BUFFER_SIZE 128
+// arguments going to the MCU are sent in SLIP frames of up to web_server_frame bytes, MCUs that
+// can take bigger frames than the default tell so in WEB_SETUP
+#define MAX_ARGUMENT_BUFFER_SIZE 1024
+#define DEFAULT_ARGUMENT_FRAME_SIZE 128
 #define HEADER_SIZE 32
 
+// the JSON response to the browser may be made up of several WEB_DATA frames
+#define MAX_RESPONSE_SIZE 4096
+
 uint32_t web_server_cb = 0;
+uint16_t web_server_frame = DEFAULT_ARGUMENT_FRAME_SIZE;
 
 struct ArgumentBuffer
 {
@@ -25,7 +32,46 @@ struct ArgumentBuffer
 	int  numberOfArgs;
 };
 
-static char* web_server_reasons[] = {
+// the JSON response being collected from the MCU and sent to the browser, kept in cgiData
+struct JsonResponse
+{
+	char * buf;
+	int    len;       // bytes in buf
+	int    size;      // bytes allocated
+	int    sent;      // bytes sent to the browser
+	int    values;    // number of values so far
+	int    complete;  // the last frame has arrived
+	int    wait;      // no request went out, waiting for the answer to an identical one
+};
+
+// LOAD and REFRESH answers may be cached for web_server_ttl ms, as set by the MCU in WEB_SETUP,
+// keyed on the page and the reason. While a request is out to the MCU identical requests from
+// other connections wait for its answer instead of going to the MCU as well. BUTTON and SUBMIT
+// drop the answers of their page, the MCU can drop them with WEB_INVALIDATE.
+#define WEB_CACHE_ENTRIES 4
+#define WEB_CACHE_WAITERS 4
+#define WEB_CACHE_URL_SIZE 40
+#define WEB_CACHE_MAX_JSON 1024
+
+struct CacheEntry
+{
+	char           url[WEB_CACHE_URL_SIZE]; // page, empty if the entry was never used
+	uint8_t        reason;
+	uint8_t        pending;  // the leader's request is out to the MCU
+	uint8_t        wake;     // the waiters have to be resumed
+	uint8_t        waiters;
+	char         * json;     // the last answer, NULL if none
+	int            len;
+	uint32_t       stamp;    // system_get_time() when the answer came in
+	HttpdConnData *leader;
+	HttpdConnData *waiter[WEB_CACHE_WAITERS];
+};
+
+uint16_t web_server_ttl = 0; // 0: no caching
+static struct CacheEntry web_cache[WEB_CACHE_ENTRIES];
+static ETSTimer web_cache_timer;
+
+static const char web_server_reasons[][8] FLASH_DATA = {
   "load",     // readable name for RequestReason::LOAD
   "refresh",  // readable name for RequestReason::REFRESH
   "button",   // readable name for RequestReason::BUTTON
@@ -42,46 +88,59 @@ char * ICACHE_FLASH_ATTR WEB_UserPages()
 	return webServerPages;
 }
 
+// appends a page to the list shown in the menu if name is an HTML file, returns -1 if the list
+// of size bytes is full
+int ICACHE_FLASH_ATTR WEB_AddUserPage(char * list, int size, const char * name)
+{
+	int nameLen = os_strlen(name);
+	if( nameLen < 6 || os_strcmp( name + nameLen-5, ".html" ) != 0 )
+		return 0;
+	
+	int slashPos = nameLen - 5;
+	
+	// chop path and .html from the name
+	while( slashPos > 0 && name[slashPos-1] != '/' )
+		slashPos--;
+	
+	// here we check buffer overrun
+	int maxLen = 10 + nameLen + (nameLen - slashPos -5);
+	if( os_strlen(list) + maxLen >= size )
+		return -1;
+	
+	os_strcat(list, ", \"");
+	
+	int writePos = os_strlen(list);
+	for( int i=slashPos; i < nameLen-5; i++ )
+	  list[writePos++] = name[i];
+	list[writePos] = 0; // terminating zero
+	
+	os_strcat(list, "\", \"/");
+	os_strcat(list, name);
+	os_strcat(list, "\"");
+	return 0;
+}
+
 // generates the content of webServerPages variable (called at booting/web page uploading)
+// uploaded images carry the list, older ones get searched for HTML files
 void ICACHE_FLASH_ATTR WEB_BrowseFiles()
 {
-	char buffer[1024];
+	char buffer[WEB_USER_PAGES_SIZE];
 	buffer[0] = 0;
 	
 	if( espFsIsValid( userPageCtx ) )
 	{
-		EspFsIterator it;
-		espFsIteratorInit(userPageCtx, &it);
-		while( espFsIteratorNext(&it) )
+		int len = espFsPageList(userPageCtx, buffer, sizeof(buffer) - 1);
+		if( len >= 0 && len < sizeof(buffer) )
+			buffer[len] = 0;
+		else
 		{
-			int nameLen = os_strlen(it.name);
-			if( nameLen >= 6 )
+			buffer[0] = 0;
+			EspFsIterator it;
+			espFsIteratorInit(userPageCtx, &it);
+			while( espFsIteratorNext(&it) )
 			{
-				// fetch HTML files
-				if( os_strcmp( it.name + nameLen-5, ".html" ) == 0 )
-				{
-					int slashPos = nameLen - 5;
-					
-					// chop path and .html from the name
-					while( slashPos > 0 && it.name[slashPos-1] != '/' )
-						slashPos--;
-					
-					// here we check buffer overrun
-					int maxLen = 10 + os_strlen( it.name ) + (nameLen - slashPos -5);
-					if( maxLen >= sizeof(buffer) )
-						break;
-					
-					os_strcat(buffer, ", \"");
-					
-					int writePos = os_strlen(buffer);
-					for( int i=slashPos; i < nameLen-5; i++ )
-					  buffer[writePos++] = it.name[i];
-					buffer[writePos] = 0; // terminating zero
-					
-					os_strcat(buffer, "\", \"/");
-					os_strcat(buffer, it.name);
-					os_strcat(buffer, "\"");
-				}
+				if( WEB_AddUserPage(buffer, sizeof(buffer), it.name) )
+					break;
 			}
 		}
 	}
@@ -115,7 +174,8 @@ static void ICACHE_FLASH_ATTR WEB_argInit(struct ArgumentBuffer * argBuffer)
 // adds an argument to the argument buffer (returns 0 if successful)
 static int ICACHE_FLASH_ATTR WEB_addArg(struct ArgumentBuffer * argBuffer, char * arg, int argLen )
 {
-	if( argBuffer->argBufferPtr + argLen + sizeof(int) >= MAX_ARGUMENT_BUFFER_SIZE )
+	int max = web_server_frame < MAX_ARGUMENT_BUFFER_SIZE ? web_server_frame : MAX_ARGUMENT_BUFFER_SIZE;
+	if( argBuffer->argBufferPtr + argLen + sizeof(int) >= max )
 		return -1; // buffer overflow
 	
 	os_memcpy(argBuffer->argBuffer + argBuffer->argBufferPtr, &argLen, sizeof(int));
@@ -154,6 +214,9 @@ static void ICACHE_FLASH_ATTR WEB_sendArgBuffer(struct ArgumentBuffer * argBuffe
 	cmdResponseEnd();
 }
 
+static int WEB_cacheLookup(HttpdConnData *connData, RequestReason reason);
+static void WEB_cacheInvalidate(const char *url);
+
 // this method processes SLIP data from MCU and converts to JSON
 // this method receives JSON from the browser, sends SLIP data to MCU
 static int ICACHE_FLASH_ATTR WEB_handleJSONRequest(HttpdConnData *connData)
@@ -185,9 +248,9 @@ static int ICACHE_FLASH_ATTR WEB_handleJSONRequest(HttpdConnData *connData)
 	}
 	
 	RequestReason reason = INVALID;
-	for(i=0; i < sizeof(web_server_reasons)/sizeof(char *); i++)
+	for(i=0; i < sizeof(web_server_reasons)/sizeof(web_server_reasons[0]); i++)
 	{
-		if( os_strcmp( web_server_reasons[i], reasonBuf ) == 0 )
+		if( flashStrcmp( reasonBuf, web_server_reasons[i] ) == 0 )
 			reason = (RequestReason)i;
 	}
 	
@@ -197,6 +260,15 @@ static int ICACHE_FLASH_ATTR WEB_handleJSONRequest(HttpdConnData *connData)
 		return HTTPD_CGI_DONE;
 	}
 	
+	if( reason == LOAD || reason == REFRESH )
+	{
+		int r = WEB_cacheLookup(connData, reason);
+		if( r >= 0 )
+			return r; // answered from the cache or waiting for an identical request
+	}
+	else
+		WEB_cacheInvalidate(connData->url);
+	
 	struct ArgumentBuffer argBuffer;
 	WEB_argInit( &argBuffer );
 	
@@ -229,7 +301,8 @@ static int ICACHE_FLASH_ATTR WEB_handleJSONRequest(HttpdConnData *connData)
 				
 				int bptr = 0;
 				int sent_args = 0;
-				int max_buf_size = MAX_ARGUMENT_BUFFER_SIZE - HEADER_SIZE - os_strlen(connData->url);
+				int max_frame = web_server_frame < MAX_ARGUMENT_BUFFER_SIZE ? web_server_frame : MAX_ARGUMENT_BUFFER_SIZE;
+				int max_buf_size = max_frame - HEADER_SIZE - os_strlen(connData->url);
 				
 				while( bptr < connData->post->len )
 				{
@@ -320,15 +393,263 @@ static int ICACHE_FLASH_ATTR WEB_handleJSONRequest(HttpdConnData *connData)
 	return HTTPD_CGI_MORE;
 }
 
-// this method receives SLIP data from MCU sends JSON to the browser
-static int ICACHE_FLASH_ATTR WEB_handleMCUResponse(HttpdConnData *connData, CmdRequest * response)
+// makes room for len more bytes in the response, returns NULL if it would get too large
+static char * ICACHE_FLASH_ATTR WEB_jsonReserve(struct JsonResponse * resp, int len)
+{
+	if( resp->len + len > resp->size )
+	{
+		int size = resp->size;
+		while( size < resp->len + len )
+			size *= 2;
+		if( size > MAX_RESPONSE_SIZE )
+			return NULL;
+		char * buf = (char *)os_malloc(size);
+		if( buf == NULL )
+			return NULL;
+		os_memcpy(buf, resp->buf, resp->len);
+		os_free(resp->buf);
+		resp->buf = buf;
+		resp->size = size;
+	}
+	return resp->buf + resp->len;
+}
+
+static void ICACHE_FLASH_ATTR WEB_freeResponse(HttpdConnData *connData)
 {
-	char jsonBuf[1500];
-	int  jsonPtr = 0;
+	struct JsonResponse * resp = (struct JsonResponse *)connData->cgiData;
+	if( resp == NULL || resp == (void *)1 )
+		return;
+	if( resp->buf != NULL )
+		os_free(resp->buf);
+	os_free(resp);
+	connData->cgiData = (void *)1;
+}
+
+// sends as much of the collected response as fits
+static int ICACHE_FLASH_ATTR WEB_sendResponse(HttpdConnData *connData)
+{
+	struct JsonResponse * resp = (struct JsonResponse *)connData->cgiData;
+	int avail;
+	char * out = httpdSendBuf(connData, &avail);
+	int len = resp->len - resp->sent;
+	if( len > avail )
+		len = avail;
+	os_memcpy(out, resp->buf + resp->sent, len);
+	httpdSendCommit(connData, len);
+	resp->sent += len;
+	if( resp->sent < resp->len )
+		return HTTPD_CGI_MORE;
+	WEB_freeResponse(connData);
+	return HTTPD_CGI_DONE;
+}
+
+// sends the headers of a complete response and starts sending it
+static int ICACHE_FLASH_ATTR WEB_startResponse(HttpdConnData *connData)
+{
+	struct JsonResponse * resp = (struct JsonResponse *)connData->cgiData;
 	
+	noCacheHeaders(connData, 200);
+	httpdHeader(connData, "Content-Type", "application/json");
 	
-	jsonBuf[jsonPtr++] = '{';
+	char cl[16];
+	os_sprintf(cl, "%d", resp->len);
+	httpdHeader(connData, "Content-Length", cl);
+	httpdEndHeaders(connData);
 	
+	return WEB_sendResponse(connData);
+}
+
+// sends a copy of a cached answer
+static int ICACHE_FLASH_ATTR WEB_serveJson(HttpdConnData *connData, const char * json, int len)
+{
+	struct JsonResponse * resp = (struct JsonResponse *)os_zalloc(sizeof(struct JsonResponse));
+	if( resp != NULL )
+		resp->buf = (char *)os_malloc(resp->size = len);
+	if( resp == NULL || resp->buf == NULL )
+	{
+		if( resp != NULL )
+			os_free(resp);
+		errorResponse(connData, 500, "Out of memory!");
+		return HTTPD_CGI_DONE;
+	}
+	os_memcpy(resp->buf, json, len);
+	resp->len = len;
+	resp->complete = 1;
+	connData->cgiData = resp;
+	return WEB_startResponse(connData);
+}
+
+static void ICACHE_FLASH_ATTR WEB_cacheDrop(struct CacheEntry * e)
+{
+	if( e->json != NULL )
+		os_free(e->json);
+	e->json = NULL;
+	e->len = 0;
+}
+
+// drops the cached answers of a page, of all pages if url is NULL
+static void ICACHE_FLASH_ATTR WEB_cacheInvalidate(const char * url)
+{
+	for( int i=0; i < WEB_CACHE_ENTRIES; i++ )
+	{
+		if( url == NULL || os_strcmp(web_cache[i].url, url) == 0 )
+			WEB_cacheDrop(&web_cache[i]);
+	}
+}
+
+// resumes the connections waiting for an answer, they find it in the cache or go to the MCU
+// themselves if the leader failed. This runs from a timer as the httpd send buffer is shared
+// and still holds the leader's response when the answer gets stored.
+static void ICACHE_FLASH_ATTR WEB_cacheWakeCb(void * arg)
+{
+	for( int i=0; i < WEB_CACHE_ENTRIES; i++ )
+	{
+		struct CacheEntry * e = &web_cache[i];
+		if( !e->wake )
+			continue;
+		
+		// resumed connections may start waiting again, take them off the list first
+		HttpdConnData * waiter[WEB_CACHE_WAITERS];
+		int n = e->waiters;
+		os_memcpy(waiter, e->waiter, sizeof(waiter));
+		e->waiters = 0;
+		e->wake = 0;
+		
+		for( int j=0; j < n; j++ )
+		{
+			HttpdConnData * conn = waiter[j];
+			struct JsonResponse * resp = (struct JsonResponse *)conn->cgiData;
+			// the connection may have gone away and its slot been reused
+			if( conn->conn != NULL && conn->cgi == WEB_CgiJsonHook && resp != NULL &&
+			    resp != (void *)1 && resp->wait )
+				httpdResume(conn);
+		}
+	}
+}
+
+// tells whether entry a should be reused before entry b: unused entries go first, then the
+// ones without an answer, then the one with the oldest answer
+static int ICACHE_FLASH_ATTR WEB_cacheOlder(struct CacheEntry * a, struct CacheEntry * b)
+{
+	if( a->url[0] == 0 || b->url[0] == 0 )
+		return b->url[0] != 0;
+	if( a->json == NULL || b->json == NULL )
+		return b->json != NULL;
+	return (int32_t)(a->stamp - b->stamp) < 0;
+}
+
+// answers a LOAD or REFRESH from the cache or makes it wait for an identical request that is
+// out to the MCU already, returns -1 if the request has to go to the MCU
+static int ICACHE_FLASH_ATTR WEB_cacheLookup(HttpdConnData *connData, RequestReason reason)
+{
+	if( web_server_ttl == 0 || os_strlen(connData->url) >= WEB_CACHE_URL_SIZE )
+		return -1;
+	
+	struct CacheEntry * e = NULL;
+	struct CacheEntry * victim = NULL;
+	for( int i=0; i < WEB_CACHE_ENTRIES; i++ )
+	{
+		struct CacheEntry * c = &web_cache[i];
+		if( c->reason == reason && os_strcmp(c->url, connData->url) == 0 )
+		{
+			e = c;
+			break;
+		}
+		if( !c->pending && (victim == NULL || WEB_cacheOlder(c, victim)) )
+			victim = c;
+	}
+	
+	if( e != NULL && e->json != NULL && system_get_time() - e->stamp < web_server_ttl * 1000UL )
+		return WEB_serveJson(connData, e->json, e->len);
+	
+	if( e != NULL && e->pending )
+	{
+		if( e->waiters >= WEB_CACHE_WAITERS )
+			return -1;
+		struct JsonResponse * resp = (struct JsonResponse *)os_zalloc(sizeof(struct JsonResponse));
+		if( resp == NULL )
+			return -1;
+		resp->wait = 1;
+		connData->cgiData = resp;
+		e->waiter[e->waiters++] = connData;
+		return HTTPD_CGI_MORE;
+	}
+	
+	if( e == NULL )
+	{
+		if( victim == NULL )
+			return -1;
+		e = victim;
+		os_strcpy(e->url, connData->url);
+		e->reason = reason;
+		e->waiters = 0;
+	}
+	WEB_cacheDrop(e); // it's stale
+	e->pending = 1;
+	e->leader = connData;
+	return -1;
+}
+
+// the leader's request has been answered, resp is NULL if that failed
+static void ICACHE_FLASH_ATTR WEB_cacheStore(HttpdConnData *connData, struct JsonResponse * resp)
+{
+	for( int i=0; i < WEB_CACHE_ENTRIES; i++ )
+	{
+		struct CacheEntry * e = &web_cache[i];
+		if( !e->pending || e->leader != connData )
+			continue;
+		
+		e->pending = 0;
+		if( resp != NULL && resp->len <= WEB_CACHE_MAX_JSON && (e->json = (char *)os_malloc(resp->len)) != NULL )
+		{
+			os_memcpy(e->json, resp->buf, resp->len);
+			e->len = resp->len;
+			e->stamp = system_get_time();
+		}
+		if( e->waiters > 0 )
+		{
+			e->wake = 1;
+			os_timer_disarm(&web_cache_timer);
+			os_timer_setfn(&web_cache_timer, WEB_cacheWakeCb, NULL);
+			os_timer_arm(&web_cache_timer, 0, 0);
+		}
+	}
+}
+
+// a connection waiting for an identical request got resumed
+static int ICACHE_FLASH_ATTR WEB_cacheResume(HttpdConnData *connData)
+{
+	// look it up again: the answer is in the cache now, or this becomes the leader
+	WEB_freeResponse(connData);
+	return WEB_handleJSONRequest(connData);
+}
+
+// this method receives SLIP data from MCU sends JSON to the browser
+// the values of a frame are added to the response, it goes out once a frame arrives that
+// doesn't end with a WEB_CONTINUED argument
+static int ICACHE_FLASH_ATTR WEB_handleMCUResponse(HttpdConnData *connData, CmdRequest * response)
+{
+	struct JsonResponse * resp = (struct JsonResponse *)connData->cgiData;
+	if( resp == (void *)1 )
+	{
+		resp = (struct JsonResponse *)os_zalloc(sizeof(struct JsonResponse));
+		if( resp != NULL )
+			resp->buf = (char *)os_malloc(resp->size = 512);
+		if( resp == NULL || resp->buf == NULL )
+		{
+			if( resp != NULL )
+				os_free(resp);
+			WEB_cacheStore(connData, NULL);
+			errorResponse(connData, 500, "Out of memory!");
+			return HTTPD_CGI_DONE;
+		}
+		connData->cgiData = resp;
+		resp->buf[resp->len++] = '{';
+	}
+	else if( resp->complete )
+		return HTTPD_CGI_MORE; // still sending, ignore stray frames
+	
+	resp->complete = 1;
 	int c = 2;
 	while( c++ < cmdGetArgc(response) )
 	{
@@ -341,14 +662,25 @@ static int ICACHE_FLASH_ATTR WEB_handleMCUResponse(HttpdConnData *connData, CmdR
 		if(len == 0)
 			break; // last argument
 		
-		if( c > 3 ) // skip the first argument
-			jsonBuf[jsonPtr++] = ',';
+		if( len == 1 && buf[0] == WEB_CONTINUED )
+		{
+			resp->complete = 0; // more frames follow
+			break;
+		}
 		
-		if( jsonPtr + 20 + len > sizeof(jsonBuf) )
+		// strings may double in size by escaping
+		char * jsonBuf = WEB_jsonReserve(resp, 2*len + 24);
+		if( jsonBuf == NULL )
 		{
+			WEB_freeResponse(connData);
+			WEB_cacheStore(connData, NULL);
 			errorResponse(connData, 500, "Response too large!");
 			return HTTPD_CGI_DONE;
 		}
+		int jsonPtr = 0;
+		
+		if( resp->values++ > 0 )
+			jsonBuf[jsonPtr++] = ',';
 		
 		WebValueType type = (WebValueType)buf[0];
 		
@@ -418,27 +750,39 @@ static int ICACHE_FLASH_ATTR WEB_handleMCUResponse(HttpdConnData *connData, CmdR
 				os_memcpy(jsonBuf + jsonPtr, value, len - 2 - nameLen);
 				jsonPtr += len - 2 - nameLen;
 				break;
+			default:
+				break;
 		}
+		resp->len += jsonPtr;
 	}
 	
-	jsonBuf[jsonPtr++] = '}';
+	if( !resp->complete )
+		return HTTPD_CGI_MORE;
 	
-	noCacheHeaders(connData, 200);
-	httpdHeader(connData, "Content-Type", "application/json");
-	
-	char cl[16];
-	os_sprintf(cl, "%d", jsonPtr);
-	httpdHeader(connData, "Content-Length", cl);
-	httpdEndHeaders(connData);
+	char * end = WEB_jsonReserve(resp, 1);
+	if( end == NULL )
+	{
+		WEB_freeResponse(connData);
+		WEB_cacheStore(connData, NULL);
+		errorResponse(connData, 500, "Response too large!");
+		return HTTPD_CGI_DONE;
+	}
+	*end = '}';
+	resp->len++;
 	
-	httpdSend(connData, jsonBuf, jsonPtr);
-	return HTTPD_CGI_DONE;
+	WEB_cacheStore(connData, resp);
+	return WEB_startResponse(connData);
 }
 
 // this method is responsible for the MCU <==JSON==> Browser communication
 int ICACHE_FLASH_ATTR WEB_CgiJsonHook(HttpdConnData *connData)
 {
-	if (connData->conn==NULL) return HTTPD_CGI_DONE; // Connection aborted. Clean up.
+	if (connData->conn==NULL) // Connection aborted. Clean up.
+	{
+		WEB_freeResponse(connData);
+		WEB_cacheStore(connData, NULL);
+		return HTTPD_CGI_DONE;
+	}
 	
 	void * cgiData = connData->cgiData;
 	
@@ -448,9 +792,15 @@ int ICACHE_FLASH_ATTR WEB_CgiJsonHook(HttpdConnData *connData)
 		return WEB_handleJSONRequest(connData);
 	}
 	
+	if( cgiData != (void *)1 && ((struct JsonResponse *)cgiData)->wait )
+		return connData->cgiResponse != NULL ? HTTPD_CGI_MORE : WEB_cacheResume(connData);
+	
 	if( connData->cgiResponse != NULL ) // data from MCU
 		return WEB_handleMCUResponse(connData, (CmdRequest *)(connData->cgiResponse));
 	
+	if( cgiData != (void *)1 && ((struct JsonResponse *)cgiData)->complete )
+		return WEB_sendResponse(connData); // the rest of the response
+	
 	return HTTPD_CGI_MORE;
 }
 
@@ -464,7 +814,44 @@ void ICACHE_FLASH_ATTR WEB_Setup(CmdPacket *cmd)
 	
 	cmdPopArg(&req, &web_server_cb, 4); // pop the callback
 	
-	os_printf("Web-server connected, cb=0x%x\n", web_server_cb);
+	// optional: the largest SLIP frame the MCU can receive
+	web_server_frame = DEFAULT_ARGUMENT_FRAME_SIZE;
+	if (cmdGetArgc(&req) >= 2)
+	{
+		uint16_t frame;
+		cmdPopArg(&req, &frame, 2);
+		if( frame > web_server_frame )
+			web_server_frame = frame;
+	}
+	
+	// optional: how long LOAD and REFRESH answers may be served from the cache in ms
+	web_server_ttl = 0;
+	if (cmdGetArgc(&req) >= 3)
+		cmdPopArg(&req, &web_server_ttl, 2);
+	WEB_cacheInvalidate(NULL);
+	
+	os_printf("Web-server connected, cb=0x%x, frame=%d, ttl=%d\n", web_server_cb, web_server_frame, web_server_ttl);
+}
+
+// the MCU drops the cached answers of a page, or of all pages if no URL is given
+void ICACHE_FLASH_ATTR WEB_Invalidate(CmdPacket *cmd)
+{
+	CmdRequest req;
+	cmdRequest(&req, cmd);
+	
+	if (cmdGetArgc(&req) < 1)
+	{
+		WEB_cacheInvalidate(NULL);
+		return;
+	}
+	
+	int len = cmdArgLen(&req);
+	if( len >= WEB_CACHE_URL_SIZE )
+		return; // not cached anyway
+	char url[len+1];
+	cmdPopArg(&req, url, len);
+	url[len] = 0;
+	WEB_cacheInvalidate(url);
 }
 
 // this method is called when MCU transmits WEB_DATA command
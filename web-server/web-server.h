@@ -23,16 +23,23 @@ typedef enum
   WEB_INTEGER,   // the value is integer
   WEB_BOOLEAN,   // the value is boolean
   WEB_FLOAT,     // the value is float
-  WEB_JSON       // the value is JSON data
+  WEB_JSON,      // the value is JSON data
+
+  WEB_CONTINUED=0x7f // a WEB_DATA argument of just this byte: another frame follows
 } WebValueType;
 
+// room for the list of user pages in the menu
+#define WEB_USER_PAGES_SIZE 1024
+
 void   WEB_Init();
 
 char * WEB_UserPages();
+int    WEB_AddUserPage(char * list, int size, const char * name);
 
 int    WEB_CgiJsonHook(HttpdConnData *connData);
 void   WEB_Setup(CmdPacket *cmd);
 void   WEB_Data(CmdPacket *cmd);
+void   WEB_Invalidate(CmdPacket *cmd);
 
 #endif /* WEB_SERVER_H */
 